@@ -35,13 +35,38 @@ extern "C" {
 #define SPD_IOCTL_BTL_T(Btl)            (((Btl) >> 8) & 0xff)
 #define SPD_IOCTL_BTL_L(Btl)            ((Btl) & 0xff)
 #define SPD_IOCTL_STORAGE_UNIT_CAPACITY 16
-#define SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY 64
+#define SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY 4096
+#define SPD_IOCTL_TARGET_MAX            128
+#define SPD_IOCTL_TRANSACT_BATCH_MAX    64
+#define SPD_IOCTL_RING_CAPACITY_MAX     256
+#define SPD_IOCTL_REGISTERED_BUFFER_MAX 64
+#define SPD_IOCTL_READ_CACHE_SIZE_MAX   (256 * 1024 * 1024)
+
+/*
+ * Storage unit addressing
+ *
+ * A unit's B/T/L address follows from its index in an adapter of capacity C (and back):
+ * B is always 0 and there are min(C, SPD_IOCTL_TARGET_MAX) targets with as many LUN's
+ * as needed for C units. Index I is target I % TargetCount, LUN I / TargetCount; so the
+ * first units are LUN 0 of consecutive targets, as they were before LUN's were used.
+ */
+#define SPD_IOCTL_TARGET_COUNT(C)       ((C) < SPD_IOCTL_TARGET_MAX ? (C) : SPD_IOCTL_TARGET_MAX)
+#define SPD_IOCTL_LUN_COUNT(C)          (((C) + SPD_IOCTL_TARGET_COUNT(C) - 1) / SPD_IOCTL_TARGET_COUNT(C))
+#define SPD_IOCTL_BTL_FROM_INDEX(C, I)  \
+    SPD_IOCTL_BTL(0, (I) % SPD_IOCTL_TARGET_COUNT(C), (I) / SPD_IOCTL_TARGET_COUNT(C))
+#define SPD_IOCTL_INDEX_FROM_BTL(C, Btl)\
+    (0 == SPD_IOCTL_BTL_B(Btl) && SPD_IOCTL_TARGET_COUNT(C) > SPD_IOCTL_BTL_T(Btl) ?\
+        SPD_IOCTL_BTL_L(Btl) * SPD_IOCTL_TARGET_COUNT(C) + SPD_IOCTL_BTL_T(Btl) : (ULONG)-1)
 
 /* alignment macros */
 #define SPD_IOCTL_ALIGN_UP(x, s)        (((x) + ((s) - 1L)) & ~((s) - 1L))
 #define SPD_IOCTL_DEFAULT_ALIGNMENT     8
 #define SPD_IOCTL_DEFAULT_ALIGN_UP(x)   SPD_IOCTL_ALIGN_UP(x, SPD_IOCTL_DEFAULT_ALIGNMENT)
+#if defined(_MSC_VER)
 #define SPD_IOCTL_DECLSPEC_ALIGN        __declspec(align(SPD_IOCTL_DEFAULT_ALIGNMENT))
+#else
+#define SPD_IOCTL_DECLSPEC_ALIGN        __attribute__((aligned(SPD_IOCTL_DEFAULT_ALIGNMENT)))
+#endif
 
 /* IOCTL_MINIPORT_PROCESS_SERVICE_IRP codes */
 #define SPD_IOCTL_PROVISION             ('p')
@@ -49,6 +74,12 @@ extern "C" {
 #define SPD_IOCTL_LIST                  ('l')
 #define SPD_IOCTL_TRANSACT              ('t')
 #define SPD_IOCTL_SET_TRANSACT_PID      ('i')
+#define SPD_IOCTL_TRANSACT_BATCH        ('b')
+#define SPD_IOCTL_RING_SETUP            ('r')
+#define SPD_IOCTL_RING_DOORBELL         ('d')
+#define SPD_IOCTL_REGISTER_BUFFER       ('g')
+#define SPD_IOCTL_UNREGISTER_BUFFER     ('G')
+#define SPD_IOCTL_GET_STATS             ('s')
 
 /* IOCTL_MINIPORT_PROCESS_SERVICE_IRP marshalling */
 #pragma warning(push)
@@ -62,6 +93,13 @@ enum
     SpdIoctlTransactUnmapKind,
     SpdIoctlTransactKindCount,
 };
+enum
+{
+    SpdIoctlSchedFifoPolicy = 0,        /* requests are handed out in the order they arrive */
+    SpdIoctlSchedPriorityPolicy,        /* reads and flushes go before writes and unmaps */
+    SpdIoctlSchedDeadlinePolicy,        /* earliest deadline first; reads expire sooner */
+    SpdIoctlSchedPolicyCount,
+};
 typedef struct
 {
     GUID Guid;                          /* identity */
@@ -74,8 +112,18 @@ typedef struct
     UINT32 CacheSupported:1;
     UINT32 UnmapSupported:1;
     UINT32 EjectDisabled:1;             /* disables UI eject */
+    UINT32 ZeroCopy:1;                  /* map READ/WRITE data instead of copying it */
+    UINT32 PipeInstanceCount:8;         /* pipe transport only: 0 means 1 */
+    UINT32 SchedPolicy:2;               /* SpdIoctlSched*Policy; see shared/iosched.h */
+    UINT32 Coalesce:1;                  /* merge adjacent READ/WRITE's; see shared/merge.h */
     UINT32 MaxTransferLength;
-    UINT64 Reserved[8];
+    UINT32 MaxIops;                     /* request rate limit; 0 means none */
+    UINT64 MaxBandwidth;                /* byte rate limit; 0 means none */
+    UINT32 SpinBudget;                  /* dispatcher polling, in usec; 0 means none */
+    UINT32 ReadCacheBlockCount;         /* in-kernel read cache; 0 means none */
+    UINT32 UnmapGranularity;            /* in blocks; see shared/unmap.h; 0 means 1 */
+    UINT32 Reserved0;
+    UINT64 Reserved[5];
 } SPD_IOCTL_STORAGE_UNIT_PARAMS;
 #if defined(WINSPD_SYS_INTERNAL)
 static_assert(128 == sizeof(SPD_IOCTL_STORAGE_UNIT_PARAMS),
@@ -181,6 +229,8 @@ typedef struct
     UINT32 Btl;
     UINT32 ReqValid:1;
     UINT32 RspValid:1;
+    UINT32 DataBufferRegistered:1;      /* DataBuffer is a registered buffer index */
+    UINT32 DataBufferMapped:1;          /* in: accept mapped data; out: DataBuffer is mapped */
     UINT64 DataBuffer;
     union
     {
@@ -194,9 +244,88 @@ typedef struct
     UINT32 Btl;
     UINT32 ProcessId;
 } SPD_IOCTL_SET_TRANSACT_PID_PARAMS;
+typedef struct
+{
+    UINT32 ReqValid:1;                  /* in: slot can receive a request; out: slot has a request */
+    UINT32 RspValid:1;                  /* in: slot has a response for its previous request */
+    union
+    {
+        SPD_IOCTL_TRANSACT_REQ Req;
+        SPD_IOCTL_TRANSACT_RSP Rsp;
+    } Dir;
+} SPD_IOCTL_TRANSACT_BATCH_ENTRY;
+typedef struct
+{
+    SPD_IOCTL_BASE_PARAMS Base;
+    UINT32 Btl;
+    UINT32 Count;
+    UINT32 DataBufferRegistered:1;      /* DataBuffer is a registered buffer index */
+    UINT64 DataBuffer;                  /* Count slots of MaxTransferLength each */
+    SPD_IOCTL_TRANSACT_BATCH_ENTRY Entries[];
+} SPD_IOCTL_TRANSACT_BATCH_PARAMS;
+#define SPD_IOCTL_TRANSACT_BATCH_PARAMS_SIZE(Count)\
+    (FIELD_OFFSET(SPD_IOCTL_TRANSACT_BATCH_PARAMS, Entries) +\
+        (Count) * sizeof(SPD_IOCTL_TRANSACT_BATCH_ENTRY))
+typedef struct
+{
+    UINT32 Slot;                        /* data slot index */
+    UINT32 Reserved;
+    SPD_IOCTL_TRANSACT_REQ Req;
+} SPD_IOCTL_RING_REQ;
+typedef struct
+{
+    UINT32 Slot;                        /* data slot index */
+    UINT32 Reserved;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+} SPD_IOCTL_RING_RSP;
+typedef struct
+{
+    SPD_IOCTL_BASE_PARAMS Base;
+    UINT32 Btl;
+    UINT32 Capacity;                    /* power of 2; also the number of data slots */
+    UINT64 Buffer;                      /* rings and data slots; see shared/ring.h */
+    UINT64 BufferSize;
+    UINT64 Event;                       /* event signaled when the REQ ring becomes non-empty */
+} SPD_IOCTL_RING_SETUP_PARAMS;
+typedef struct
+{
+    SPD_IOCTL_BASE_PARAMS Base;
+    UINT32 Btl;
+} SPD_IOCTL_RING_DOORBELL_PARAMS;
+typedef struct
+{
+    SPD_IOCTL_BASE_PARAMS Base;
+    UINT32 Btl;
+    UINT32 Index;                       /* out: registered buffer index */
+    UINT64 Buffer;
+    UINT32 BufferSize;
+} SPD_IOCTL_REGISTER_BUFFER_PARAMS;
+typedef struct
+{
+    SPD_IOCTL_BASE_PARAMS Base;
+    UINT32 Btl;
+    UINT32 Index;
+} SPD_IOCTL_UNREGISTER_BUFFER_PARAMS;
+enum
+{
+    SpdIoctlStatsTimingKeep = 0,        /* leave lock hold timing as it is */
+    SpdIoctlStatsTimingOn,
+    SpdIoctlStatsTimingOff,
+};
+typedef struct
+{
+    SPD_IOCTL_BASE_PARAMS Base;
+    UINT32 Btl;
+    UINT32 Timing;                      /* in: SpdIoctlStatsTiming*; out: 1 if timing is on */
+    UINT64 LockHoldTime;                /* out: 100ns units; only counted while timing is on */
+    UINT64 LockHoldCount;               /* out */
+    UINT64 CompleteTime;                /* out: 100ns units; only counted while timing is on */
+    UINT64 CompleteCount;               /* out */
+} SPD_IOCTL_GET_STATS_PARAMS;
 #pragma warning(pop)
 
-#if !defined(WINSPD_SYS_INTERNAL)
+/* the marshalling above is also used by the portable headers; these need Windows */
+#if !defined(WINSPD_SYS_INTERNAL) && defined(_WIN32)
 DWORD SpdIoctlGetDevicePath(GUID *ClassGuid, PWSTR DeviceName,
     PWCHAR PathBuf, UINT32 PathBufSize);
 DWORD SpdIoctlOpenDevice(PWSTR DeviceName, PHANDLE PDeviceHandle);
@@ -219,6 +348,50 @@ DWORD SpdIoctlTransact(HANDLE DeviceHandle,
 DWORD SpdIoctlSetTransactProcessId(HANDLE DeviceHandle,
     UINT32 Btl,
     ULONG ProcessId);
+DWORD SpdIoctlTransactBatch(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_BATCH_PARAMS *Params,
+    UINT32 Count,
+    PVOID DataBuffer);
+DWORD SpdIoctlRingSetup(HANDLE DeviceHandle,
+    UINT32 Btl,
+    UINT32 Capacity,
+    PVOID Buffer,
+    UINT64 BufferSize,
+    HANDLE Event);
+DWORD SpdIoctlRingDoorbell(HANDLE DeviceHandle,
+    UINT32 Btl);
+DWORD SpdIoctlRegisterBuffer(HANDLE DeviceHandle,
+    UINT32 Btl,
+    PVOID Buffer,
+    UINT32 BufferSize,
+    PUINT32 PIndex);
+DWORD SpdIoctlUnregisterBuffer(HANDLE DeviceHandle,
+    UINT32 Btl,
+    UINT32 Index);
+DWORD SpdIoctlGetStats(HANDLE DeviceHandle,
+    UINT32 Btl,
+    UINT32 Timing,
+    SPD_IOCTL_GET_STATS_PARAMS *Stats);
+DWORD SpdIoctlTransactRegistered(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    UINT32 DataBufferIndex);
+DWORD SpdIoctlTransactBatchRegistered(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_BATCH_PARAMS *Params,
+    UINT32 Count,
+    UINT32 DataBufferIndex);
+DWORD SpdIoctlTransactMapped(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    PVOID DataBuffer,
+    UINT32 DataBufferIndex,
+    PVOID *PReqDataBuffer);
+DWORD SpdIoctlMemAlignAlloc(UINT32 Size, UINT32 AlignmentMask, PVOID *PP);
+VOID SpdIoctlMemAlignFree(PVOID P);
 #endif
 
 #ifdef __cplusplus
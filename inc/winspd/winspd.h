@@ -81,12 +81,21 @@ typedef struct _SPD_STORAGE_UNIT
     ULONG DispatcherThreadCount;
     DWORD DispatcherError;
     UINT32 DebugLog;
+    ULONG DispatcherBatchSize;
+    ULONG DispatcherAsyncDepth;
+    PVOID DispatcherAsyncPool;
+    UINT64 WriteBackCacheSize;
+    PVOID WriteBackCache;
+    ULONG DispatcherRingCapacity;
+    PVOID DispatcherRing;
 } SPD_STORAGE_UNIT;
+typedef struct _SPD_STORAGE_UNIT_ASYNC_REQUEST SPD_STORAGE_UNIT_ASYNC_REQUEST;
 typedef struct _SPD_STORAGE_UNIT_OPERATION_CONTEXT
 {
     SPD_IOCTL_TRANSACT_REQ *Request;
     SPD_IOCTL_TRANSACT_RSP *Response;
     PVOID DataBuffer;
+    SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest;   /* 0 unless the dispatcher is asynchronous */
 } SPD_STORAGE_UNIT_OPERATION_CONTEXT;
 /**
  * Create a storage unit object.
@@ -150,7 +159,8 @@ VOID SpdStorageUnitWaitDispatcher(SPD_STORAGE_UNIT *StorageUnit);
  * @param Response
  *     The response buffer.
  * @param DataBuffer
- *     The response data buffer.
+ *     The response data buffer. This must be the DataBuffer of the operation context, even
+ *     when the request data buffer was mapped (see SPD_STORAGE_UNIT_PARAMS::ZeroCopy).
  */
 VOID SpdStorageUnitSendResponse(SPD_STORAGE_UNIT *StorageUnit,
     SPD_IOCTL_TRANSACT_RSP *Response, PVOID DataBuffer);
@@ -204,6 +214,141 @@ VOID SpdStorageUnitSetDebugLog(SPD_STORAGE_UNIT *StorageUnit,
 }
 VOID SpdStorageUnitSetDebugLogF(SPD_STORAGE_UNIT *StorageUnit,
     UINT32 DebugLog);
+/**
+ * Set the dispatcher batch size.
+ *
+ * When the batch size is greater than 1, each dispatcher thread uses SPD_IOCTL_TRANSACT_BATCH
+ * to deliver all its completed responses and receive up to BatchSize new requests in a single
+ * call into the kernel. Each thread then allocates BatchSize * MaxTransferLength bytes of
+ * data buffers. This must be called prior to SpdStorageUnitStartDispatcher.
+ *
+ * @param StorageUnit
+ *     The storage unit object.
+ * @param BatchSize
+ *     The number of requests per dispatcher thread transact. A value of 0 or 1 disables
+ *     batching. Values larger than SPD_IOCTL_TRANSACT_BATCH_MAX are capped.
+ */
+static inline
+VOID SpdStorageUnitSetDispatcherBatchSize(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG BatchSize)
+{
+    StorageUnit->DispatcherBatchSize = BatchSize;
+}
+VOID SpdStorageUnitSetDispatcherBatchSizeF(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG BatchSize);
+/**
+ * Set the dispatcher asynchronous depth.
+ *
+ * When the asynchronous depth is greater than 0, the dispatcher serves requests from a
+ * per storage unit pool of AsyncDepth request handles, each of which owns its own request,
+ * response and MaxTransferLength data buffer. An operation may then call
+ * SpdStorageUnitBeginAsyncRequest, return FALSE and complete the request at a later time
+ * from any thread with SpdStorageUnitCompleteAsyncRequest; its data buffer remains valid
+ * until then. When all AsyncDepth requests are outstanding, dispatcher threads wait for
+ * one to complete. This is ignored when batching is enabled and must be called prior to
+ * SpdStorageUnitStartDispatcher.
+ *
+ * @param StorageUnit
+ *     The storage unit object.
+ * @param AsyncDepth
+ *     The maximum number of requests in flight for this storage unit. A value of 0
+ *     disables asynchronous dispatching.
+ */
+static inline
+VOID SpdStorageUnitSetDispatcherAsyncDepth(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG AsyncDepth)
+{
+    StorageUnit->DispatcherAsyncDepth = AsyncDepth;
+}
+VOID SpdStorageUnitSetDispatcherAsyncDepthF(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG AsyncDepth);
+/**
+ * Set the write-back cache size.
+ *
+ * When the cache size is greater than 0, the dispatcher places a write-back cache of
+ * CacheSize bytes (including its index) in front of the storage unit interface. WRITE's
+ * complete once their data are in the cache; a background thread destages dirty blocks
+ * to the Write operation, oldest first and with adjacent blocks combined into a single
+ * Write of up to MaxTransferLength bytes. READ's that the cache holds are served from it.
+ *
+ * FUA WRITE's and SYNCHRONIZE CACHE destage the dirty blocks in their range and then call
+ * the Flush operation for it before they complete. FUA READ's and READ's that the cache does
+ * not hold are served by the Read operation, once any dirty blocks in their range have been
+ * destaged. UNMAP drops the cached blocks in its range. All dirty blocks are destaged when
+ * the dispatcher stops.
+ *
+ * The cache calls the storage unit operations synchronously: an operation called by the
+ * cache cannot use SpdStorageUnitBeginAsyncRequest and one that returns FALSE is failed;
+ * a failed destage leaves its blocks dirty. The storage unit must be created with
+ * CacheSupported, it must have a Flush operation and the cache must hold at least
+ * 4 * MaxTransferLength bytes of data. This must be called prior to
+ * SpdStorageUnitStartDispatcher.
+ *
+ * @param StorageUnit
+ *     The storage unit object.
+ * @param CacheSize
+ *     The memory budget of the cache in bytes. A value of 0 disables the cache.
+ */
+static inline
+VOID SpdStorageUnitSetWriteBackCacheSize(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 CacheSize)
+{
+    StorageUnit->WriteBackCacheSize = CacheSize;
+}
+VOID SpdStorageUnitSetWriteBackCacheSizeF(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 CacheSize);
+/**
+ * Set the dispatcher ring capacity.
+ *
+ * When the ring capacity is greater than 0, the dispatcher shares a pair of rings and
+ * RingCapacity data slots of MaxTransferLength bytes with the driver (SPD_IOCTL_RING_SETUP).
+ * The driver places requests on the REQ ring as they arrive, so dispatcher threads only
+ * call into the kernel to wait when the ring is empty and to ring the doorbell when the
+ * driver is not already draining the RSP ring. Operations must complete synchronously.
+ * This takes precedence over batching and asynchronous dispatching; if the ring cannot
+ * be set up (e.g. pipe handles) the dispatcher transacts as usual. This must be called
+ * prior to SpdStorageUnitStartDispatcher.
+ *
+ * @param StorageUnit
+ *     The storage unit object.
+ * @param RingCapacity
+ *     The number of requests in flight for this storage unit. It is rounded down to a
+ *     power of 2; values larger than SPD_IOCTL_RING_CAPACITY_MAX are capped. A value of
+ *     0 disables the ring.
+ */
+static inline
+VOID SpdStorageUnitSetDispatcherRingCapacity(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG RingCapacity)
+{
+    StorageUnit->DispatcherRingCapacity = RingCapacity;
+}
+VOID SpdStorageUnitSetDispatcherRingCapacityF(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG RingCapacity);
+/**
+ * Take ownership of the current request for asynchronous completion.
+ *
+ * This function may be used only when servicing one of the SPD_STORAGE_UNIT_INTERFACE
+ * operations. After a successful call the operation must return FALSE and later complete
+ * the request with SpdStorageUnitCompleteAsyncRequest.
+ *
+ * @return
+ *     The request handle or 0 if the dispatcher is not asynchronous.
+ */
+SPD_STORAGE_UNIT_ASYNC_REQUEST *SpdStorageUnitBeginAsyncRequest(VOID);
+/**
+ * Complete an asynchronous request.
+ *
+ * The response is sent to the kernel together with the request data buffer (which must
+ * contain the data of a READ) and the request handle returns to the pool. The handle
+ * must not be used after this call.
+ *
+ * @param AsyncRequest
+ *     The request handle returned by SpdStorageUnitBeginAsyncRequest.
+ * @param Status
+ *     The completion status of the request.
+ */
+VOID SpdStorageUnitCompleteAsyncRequest(SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest,
+    SPD_STORAGE_UNIT_STATUS *Status);
 
 /*
  * Helpers
@@ -37,6 +37,12 @@ namespace Spd.Interop
         internal const UInt32 CacheSupported = 0x00000002;
         internal const UInt32 UnmapSupported = 0x00000004;
         internal const UInt32 EjectDisabled = 0x00000008;
+        internal const UInt32 ZeroCopy = 0x00000010;
+        internal const UInt32 PipeInstanceCountMask = 0x00001fe0;
+        internal const int PipeInstanceCountShift = 5;
+        internal const UInt32 SchedPolicyMask = 0x00006000;
+        internal const int SchedPolicyShift = 13;
+        internal const UInt32 Coalesce = 0x00008000;
         internal const int GuidSize = 16;
         internal const int ProductIdSize = 16;
         internal const int ProductRevisionLevelSize = 4;
@@ -49,7 +55,13 @@ namespace Spd.Interop
         internal Byte DeviceType;
         internal UInt32 Flags;
         internal UInt32 MaxTransferLength;
-        internal unsafe fixed UInt64 Reserved[8];
+        internal UInt32 MaxIops;
+        internal UInt64 MaxBandwidth;
+        internal UInt32 SpinBudget;
+        internal UInt32 ReadCacheBlockCount;
+        internal UInt32 UnmapGranularity;
+        internal UInt32 Reserved0;
+        internal unsafe fixed UInt64 Reserved[5];
 
         internal unsafe System.Guid GetGuid()
         {
@@ -290,6 +302,13 @@ namespace Spd.Interop
             IntPtr UserContext = *(IntPtr *)((Byte *)NativePtr + sizeof(IntPtr));
             return IntPtr.Zero != UserContext ? GCHandle.FromIntPtr(UserContext).Target : null;
         }
+        internal unsafe static UInt32 GetBlockLength(
+            IntPtr NativePtr)
+        {
+            /* SPD_STORAGE_UNIT starts with Version, UserContext and StorageUnitParams */
+            return *(UInt32 *)((Byte *)NativePtr + 2 * sizeof(IntPtr) +
+                (int)Marshal.OffsetOf(typeof(StorageUnitParams), "BlockLength"));
+        }
         internal unsafe static void SetUserContext(
             IntPtr NativePtr,
             Object Obj)
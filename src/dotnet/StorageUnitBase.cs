@@ -20,6 +20,7 @@
  */
 
 using System;
+using System.Runtime.InteropServices;
 
 using Spd.Interop;
 
@@ -85,6 +86,46 @@ namespace Spd
         {
         }
         /// <summary>
+        /// Reads blocks from the storage unit into a native buffer of
+        /// BlockCount * BlockLength bytes.
+        /// The host calls this method instead of the Byte[] one when the data
+        /// buffer is not its own, for example when ZeroCopy maps the kernel
+        /// buffers. Storage units that set ZeroCopy should override it; the
+        /// default implementation reads through a copy.
+        /// </summary>
+        public virtual void Read(
+            IntPtr Buffer,
+            UInt32 Length,
+            UInt64 BlockAddress,
+            UInt32 BlockCount,
+            Boolean Flush,
+            ref StorageUnitStatus Status)
+        {
+            Byte[] Data = new Byte[Length];
+            Read(Data, BlockAddress, BlockCount, Flush, ref Status);
+            Marshal.Copy(Data, 0, Buffer, (int)Length);
+        }
+        /// <summary>
+        /// Write blocks to the storage unit from a native buffer of
+        /// BlockCount * BlockLength bytes.
+        /// The host calls this method instead of the Byte[] one when the data
+        /// buffer is not its own, for example when ZeroCopy maps the kernel
+        /// buffers. Storage units that set ZeroCopy should override it; the
+        /// default implementation writes through a copy.
+        /// </summary>
+        public virtual void Write(
+            IntPtr Buffer,
+            UInt32 Length,
+            UInt64 BlockAddress,
+            UInt32 BlockCount,
+            Boolean Flush,
+            ref StorageUnitStatus Status)
+        {
+            Byte[] Data = new Byte[Length];
+            Marshal.Copy(Buffer, Data, 0, (int)Length);
+            Write(Data, BlockAddress, BlockCount, Flush, ref Status);
+        }
+        /// <summary>
         /// Flush cached blocks to the storage unit.
         /// </summary>
         public virtual void Flush(
@@ -173,6 +173,35 @@ namespace Spd
             set { _StorageUnitParams.Flags |= (value ? StorageUnitParams.EjectDisabled : 0); }
         }
         /// <summary>
+        /// Gets or sets a value that determines whether the storage unit accesses read/write
+        /// data directly in the kernel buffers rather than through a copy.
+        /// The storage unit should then override the Read and Write methods that take
+        /// an IntPtr buffer; the others see the data through a copy.
+        /// </summary>
+        public Boolean ZeroCopy
+        {
+            get { return 0 != (_StorageUnitParams.Flags & StorageUnitParams.ZeroCopy); }
+            set { _StorageUnitParams.Flags |= (value ? StorageUnitParams.ZeroCopy : 0); }
+        }
+        /// <summary>
+        /// Gets or sets the number of pipe instances (and hence concurrent clients) when the
+        /// storage unit listens on a pipe. A value of 0 means 1.
+        /// </summary>
+        public Byte PipeInstanceCount
+        {
+            get
+            {
+                return (Byte)((_StorageUnitParams.Flags & StorageUnitParams.PipeInstanceCountMask) >>
+                    StorageUnitParams.PipeInstanceCountShift);
+            }
+            set
+            {
+                _StorageUnitParams.Flags =
+                    (_StorageUnitParams.Flags & ~StorageUnitParams.PipeInstanceCountMask) |
+                    ((UInt32)value << StorageUnitParams.PipeInstanceCountShift);
+            }
+        }
+        /// <summary>
         /// Gets or sets the storage unit maximum transfer length for a single operation.
         /// </summary>
         public UInt32 MaxTransferLength
@@ -180,6 +209,81 @@ namespace Spd
             get { return _StorageUnitParams.MaxTransferLength; }
             set { _StorageUnitParams.MaxTransferLength = value; }
         }
+        /// <summary>
+        /// Gets or sets the policy that orders the requests of the storage unit:
+        /// 0 (first in, first out), 1 (reads before writes) or 2 (earliest deadline first).
+        /// </summary>
+        public Byte SchedPolicy
+        {
+            get
+            {
+                return (Byte)((_StorageUnitParams.Flags & StorageUnitParams.SchedPolicyMask) >>
+                    StorageUnitParams.SchedPolicyShift);
+            }
+            set
+            {
+                _StorageUnitParams.Flags =
+                    (_StorageUnitParams.Flags & ~StorageUnitParams.SchedPolicyMask) |
+                    (((UInt32)value << StorageUnitParams.SchedPolicyShift) &
+                        StorageUnitParams.SchedPolicyMask);
+            }
+        }
+        /// <summary>
+        /// Gets or sets a value that determines whether pending reads (or writes) of adjacent
+        /// blocks are merged into a single operation, up to the maximum transfer length.
+        /// </summary>
+        public Boolean Coalesce
+        {
+            get { return 0 != (_StorageUnitParams.Flags & StorageUnitParams.Coalesce); }
+            set { _StorageUnitParams.Flags |= (value ? StorageUnitParams.Coalesce : 0); }
+        }
+        /// <summary>
+        /// Gets or sets the maximum number of requests per second that the storage unit
+        /// is given. A value of 0 means no limit.
+        /// </summary>
+        public UInt32 MaxIops
+        {
+            get { return _StorageUnitParams.MaxIops; }
+            set { _StorageUnitParams.MaxIops = value; }
+        }
+        /// <summary>
+        /// Gets or sets the maximum number of bytes per second that the storage unit
+        /// is given. A value of 0 means no limit.
+        /// </summary>
+        public UInt64 MaxBandwidth
+        {
+            get { return _StorageUnitParams.MaxBandwidth; }
+            set { _StorageUnitParams.MaxBandwidth = value; }
+        }
+        /// <summary>
+        /// Gets or sets the maximum time in microseconds that a dispatcher polls for new
+        /// requests before it blocks (up to 1000). A value of 0 means that it never polls.
+        /// </summary>
+        public UInt32 SpinBudget
+        {
+            get { return _StorageUnitParams.SpinBudget; }
+            set { _StorageUnitParams.SpinBudget = value; }
+        }
+        /// <summary>
+        /// Gets or sets the number of blocks in the in-kernel read cache (up to 256MB worth).
+        /// Reads that the cache holds complete without a round trip to the storage unit.
+        /// A value of 0 means that there is no read cache.
+        /// </summary>
+        public UInt32 ReadCacheBlockCount
+        {
+            get { return _StorageUnitParams.ReadCacheBlockCount; }
+            set { _StorageUnitParams.ReadCacheBlockCount = value; }
+        }
+        /// <summary>
+        /// Gets or sets the unmap granularity in blocks. Unmap requests are merged and
+        /// aligned to it before they reach the storage unit and parts smaller than a
+        /// granule are dropped. A value of 0 means 1.
+        /// </summary>
+        public UInt32 UnmapGranularity
+        {
+            get { return _StorageUnitParams.UnmapGranularity; }
+            set { _StorageUnitParams.UnmapGranularity = value; }
+        }
 
         /* control */
         /// <summary>
@@ -317,7 +421,11 @@ namespace Spd
             StorageUnitBase StorageUnit = (StorageUnitBase)Api.GetUserContext(StorageUnitPtr);
             try
             {
-                StorageUnit.Read(_ThreadBuffer, BlockAddress, BlockCount, Flush, ref Status);
+                if (IsThreadBuffer(Buffer))
+                    StorageUnit.Read(_ThreadBuffer, BlockAddress, BlockCount, Flush, ref Status);
+                else
+                    StorageUnit.Read(Buffer, BlockCount * Api.GetBlockLength(StorageUnitPtr),
+                        BlockAddress, BlockCount, Flush, ref Status);
             }
             catch (Exception)
             {
@@ -335,7 +443,11 @@ namespace Spd
             StorageUnitBase StorageUnit = (StorageUnitBase)Api.GetUserContext(StorageUnitPtr);
             try
             {
-                StorageUnit.Write(_ThreadBuffer, BlockAddress, BlockCount, Flush, ref Status);
+                if (IsThreadBuffer(Buffer))
+                    StorageUnit.Write(_ThreadBuffer, BlockAddress, BlockCount, Flush, ref Status);
+                else
+                    StorageUnit.Write(Buffer, BlockCount * Api.GetBlockLength(StorageUnitPtr),
+                        BlockAddress, BlockCount, Flush, ref Status);
             }
             catch (Exception)
             {
@@ -394,6 +506,12 @@ namespace Spd
             if (IntPtr.Zero != Pointer)
                 _ThreadGCHandle.Free();
         }
+        private static Boolean IsThreadBuffer(IntPtr Buffer)
+        {
+            /* other buffers are e.g. kernel buffers mapped for ZeroCopy */
+            return null != _ThreadBuffer && _ThreadGCHandle.IsAllocated &&
+                _ThreadGCHandle.AddrOfPinnedObject() == Buffer;
+        }
 
         static StorageUnitHost()
         {
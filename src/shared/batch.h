@@ -0,0 +1,99 @@
+/**
+ * @file shared/batch.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_BATCH_H_INCLUDED
+#define WINSPD_SHARED_BATCH_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Batched transact
+ *
+ * This is the I/O queue independent part of SPD_IOCTL_TRANSACT_BATCH. The driver
+ * runs it against SPD_IOQ; the tests run it against a user mode stand-in queue.
+ * For this reason it must only depend on the types in <winspd/ioctl.h>.
+ *
+ * All responses are delivered before any request is taken, because an entry's
+ * response and request share storage. Only the first request is waited for;
+ * the remaining slots are filled with whatever is already pending.
+ */
+
+enum
+{
+    SpdBatchStartSuccess                = 0,
+    SpdBatchStartEmpty,
+    SpdBatchStartCancelled,
+};
+typedef struct
+{
+    VOID (*EndProcessing)(PVOID Context,
+        SPD_IOCTL_TRANSACT_RSP *Rsp, PVOID DataBuffer);
+    LONG (*StartProcessing)(PVOID Context, BOOLEAN Wait,
+        SPD_IOCTL_TRANSACT_REQ *Req, PVOID DataBuffer);
+} SPD_BATCH_IOQ_INTERFACE;
+
+static inline
+LONG SpdTransactBatch(const SPD_BATCH_IOQ_INTERFACE *Interface, PVOID Context,
+    SPD_IOCTL_TRANSACT_BATCH_ENTRY *Entries, ULONG Count,
+    PVOID DataBuffer, ULONG DataStride,
+    PULONG PReqCount)
+{
+    LONG Result = SpdBatchStartSuccess;
+    ULONG ReqCount = 0;
+
+    for (ULONG I = 0; Count > I; I++)
+        if (Entries[I].RspValid)
+        {
+            Entries[I].RspValid = 0;
+            Interface->EndProcessing(Context,
+                &Entries[I].Dir.Rsp, (PUINT8)DataBuffer + (UINT_PTR)I * DataStride);
+        }
+
+    for (ULONG I = 0; Count > I; I++)
+        if (Entries[I].ReqValid)
+        {
+            Entries[I].ReqValid = 0;
+            if (SpdBatchStartSuccess != Result)
+                continue;
+
+            Result = Interface->StartProcessing(Context, 0 == ReqCount,
+                &Entries[I].Dir.Req, (PUINT8)DataBuffer + (UINT_PTR)I * DataStride);
+            if (SpdBatchStartSuccess != Result)
+                continue;
+
+            Entries[I].ReqValid = 1;
+            ReqCount++;
+        }
+
+    *PReqCount = ReqCount;
+
+    /* report cancellation only if we have no requests to hand out */
+    return 0 != ReqCount || SpdBatchStartCancelled != Result ?
+        SpdBatchStartSuccess : SpdBatchStartCancelled;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
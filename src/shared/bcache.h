@@ -0,0 +1,277 @@
+/**
+ * @file shared/bcache.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_BCACHE_H_INCLUDED
+#define WINSPD_SHARED_BCACHE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Block cache
+ *
+ * A fixed number of blocks, indexed by block address in a hash table. The cache
+ * is filled with the data of completed reads and read requests that it holds in
+ * full are served from it; a request that it holds only in part is a miss.
+ *
+ * Eviction is CLOCK: a hit marks a block referenced and the hand that looks for a
+ * block to evict gives referenced blocks a second chance. New blocks come in not
+ * referenced, so a block must be hit once before it survives the hand; this keeps
+ * a scan from flushing the blocks that are hot. Reads of more than a quarter of
+ * the cache are not cached at all.
+ *
+ * Invalidation: writes (and unmaps) invalidate their range when they are posted and
+ * again when they complete, and every invalidation bumps the Generation. A read takes
+ * the Generation when it is posted and fills the cache when it completes only if the
+ * Generation has not changed. So a read that may have raced with a write never fills
+ * the cache with data that the write made stale; and a read that started after the
+ * write was posted, but was served before it, is undone when the write completes.
+ *
+ * The cache does no locking and no allocation: the caller serializes access and
+ * provides a buffer of SpdBcacheBufferSize bytes.
+ */
+
+#define SPD_BCACHE_FILL_FRACTION        4       /* larger reads are not cached */
+
+typedef struct _SPD_BCACHE_ENTRY
+{
+    struct _SPD_BCACHE_ENTRY *HashNext;
+    UINT64 BlockAddress;
+    BOOLEAN Valid;
+    BOOLEAN Referenced;                 /* hit since the hand last passed */
+} SPD_BCACHE_ENTRY;
+typedef struct
+{
+    PUINT8 Data;                        /* EntryCount blocks */
+    SPD_BCACHE_ENTRY *Entries;
+    SPD_BCACHE_ENTRY **Buckets;
+    ULONG EntryCount, BucketMask;
+    ULONG BlockLength;
+    ULONG Hand;
+    UINT64 Generation;
+    /* statistics */
+    UINT64 HitCount, MissCount;         /* read requests */
+    UINT64 FillCount, EvictCount;       /* blocks */
+    UINT64 InvalidateCount;             /* blocks */
+} SPD_BCACHE;
+
+static inline
+ULONG SpdBcacheBucketCount(ULONG EntryCount)
+{
+    ULONG BucketCount = 1;
+    while (BucketCount < EntryCount)
+        BucketCount <<= 1;
+    return BucketCount;
+}
+
+static inline
+UINT64 SpdBcacheBufferSize(ULONG EntryCount, ULONG BlockLength)
+{
+    return (UINT64)EntryCount * BlockLength +
+        (UINT64)EntryCount * sizeof(SPD_BCACHE_ENTRY) +
+        (UINT64)SpdBcacheBucketCount(EntryCount) * sizeof(SPD_BCACHE_ENTRY *);
+}
+
+/* the data come first, so that they are as aligned as the buffer */
+static inline
+VOID SpdBcacheInitialize(SPD_BCACHE *Cache, PVOID Buffer, ULONG EntryCount, ULONG BlockLength)
+{
+    ULONG BucketCount = SpdBcacheBucketCount(EntryCount);
+
+    memset(Cache, 0, sizeof *Cache);
+    Cache->Data = Buffer;
+    Cache->Entries = (PVOID)(Cache->Data + (UINT_PTR)EntryCount * BlockLength);
+    Cache->Buckets = (PVOID)(Cache->Entries + EntryCount);
+    Cache->EntryCount = EntryCount;
+    Cache->BucketMask = BucketCount - 1;
+    Cache->BlockLength = BlockLength;
+    memset(Cache->Entries, 0, EntryCount * sizeof Cache->Entries[0]);
+    memset(Cache->Buckets, 0, BucketCount * sizeof Cache->Buckets[0]);
+}
+
+static inline
+SPD_BCACHE_ENTRY **SpdBcacheBucket(SPD_BCACHE *Cache, UINT64 BlockAddress)
+{
+    /* the first half of MurmurHash3 fmix64; it spreads runs of block addresses well */
+    BlockAddress ^= BlockAddress >> 33;
+    BlockAddress *= 0xff51afd7ed558ccdULL;
+    BlockAddress ^= BlockAddress >> 33;
+    return &Cache->Buckets[(ULONG)BlockAddress & Cache->BucketMask];
+}
+
+static inline
+SPD_BCACHE_ENTRY *SpdBcacheFind(SPD_BCACHE *Cache, UINT64 BlockAddress)
+{
+    SPD_BCACHE_ENTRY *Entry;
+    for (Entry = *SpdBcacheBucket(Cache, BlockAddress); 0 != Entry; Entry = Entry->HashNext)
+        if (BlockAddress == Entry->BlockAddress)
+            return Entry;
+    return 0;
+}
+
+static inline
+PUINT8 SpdBcacheEntryData(SPD_BCACHE *Cache, SPD_BCACHE_ENTRY *Entry)
+{
+    return Cache->Data + (UINT_PTR)(Entry - Cache->Entries) * Cache->BlockLength;
+}
+
+static inline
+VOID SpdBcacheRemove(SPD_BCACHE *Cache, SPD_BCACHE_ENTRY *Entry)
+{
+    SPD_BCACHE_ENTRY **P;
+    for (P = SpdBcacheBucket(Cache, Entry->BlockAddress); Entry != *P; P = &(*P)->HashNext)
+        ;
+    *P = Entry->HashNext;
+    Entry->HashNext = 0;
+    Entry->Valid = FALSE;
+    Entry->Referenced = FALSE;
+}
+
+/* the Generation that a read must pass to SpdBcacheFill */
+static inline
+UINT64 SpdBcacheGeneration(SPD_BCACHE *Cache)
+{
+    return Cache->Generation;
+}
+
+/* copy BlockCount blocks to Buffer if the cache holds all of them; else FALSE */
+static inline
+BOOLEAN SpdBcacheRead(SPD_BCACHE *Cache,
+    UINT64 BlockAddress, UINT32 BlockCount, PVOID Buffer)
+{
+    SPD_BCACHE_ENTRY *Entry;
+
+    if (0 == BlockCount || Cache->EntryCount < BlockCount)
+    {
+        Cache->MissCount++;
+        return FALSE;
+    }
+
+    for (UINT32 I = 0; BlockCount > I; I++)
+        if (0 == SpdBcacheFind(Cache, BlockAddress + I))
+        {
+            Cache->MissCount++;
+            return FALSE;
+        }
+
+    for (UINT32 I = 0; BlockCount > I; I++)
+    {
+        Entry = SpdBcacheFind(Cache, BlockAddress + I);
+        Entry->Referenced = TRUE;
+        memcpy((PUINT8)Buffer + (UINT_PTR)I * Cache->BlockLength,
+            SpdBcacheEntryData(Cache, Entry), Cache->BlockLength);
+    }
+
+    Cache->HitCount++;
+    return TRUE;
+}
+
+static inline
+SPD_BCACHE_ENTRY *SpdBcacheEvict(SPD_BCACHE *Cache)
+{
+    SPD_BCACHE_ENTRY *Entry;
+
+    /* at most two rounds: the first one clears all Referenced marks */
+    for (;;)
+    {
+        Entry = &Cache->Entries[Cache->Hand];
+        Cache->Hand = (Cache->Hand + 1) % Cache->EntryCount;
+
+        if (!Entry->Valid)
+            return Entry;
+        if (!Entry->Referenced)
+        {
+            SpdBcacheRemove(Cache, Entry);
+            Cache->EvictCount++;
+            return Entry;
+        }
+        Entry->Referenced = FALSE;
+    }
+}
+
+/* fill the cache with the data of a completed read that was posted at Generation */
+static inline
+VOID SpdBcacheFill(SPD_BCACHE *Cache, UINT64 Generation,
+    UINT64 BlockAddress, UINT32 BlockCount, const VOID *Buffer)
+{
+    SPD_BCACHE_ENTRY *Entry, **Bucket;
+
+    if (Generation != Cache->Generation ||
+        0 == BlockCount || Cache->EntryCount / SPD_BCACHE_FILL_FRACTION < BlockCount)
+        return;
+
+    for (UINT32 I = 0; BlockCount > I; I++)
+    {
+        Entry = SpdBcacheFind(Cache, BlockAddress + I);
+        if (0 == Entry)
+        {
+            Entry = SpdBcacheEvict(Cache);
+            Entry->BlockAddress = BlockAddress + I;
+            Entry->Valid = TRUE;
+            Bucket = SpdBcacheBucket(Cache, Entry->BlockAddress);
+            Entry->HashNext = *Bucket;
+            *Bucket = Entry;
+            Cache->FillCount++;
+        }
+        memcpy(SpdBcacheEntryData(Cache, Entry),
+            (const UINT8 *)Buffer + (UINT_PTR)I * Cache->BlockLength, Cache->BlockLength);
+    }
+}
+
+/* a write or unmap of the range has been posted or has completed */
+static inline
+VOID SpdBcacheInvalidate(SPD_BCACHE *Cache, UINT64 BlockAddress, UINT64 BlockCount)
+{
+    SPD_BCACHE_ENTRY *Entry;
+
+    Cache->Generation++;
+
+    /* look up each block of a small range; scan the whole cache for a large one */
+    if (Cache->EntryCount > BlockCount)
+    {
+        for (UINT64 I = 0; BlockCount > I; I++)
+            if (0 != (Entry = SpdBcacheFind(Cache, BlockAddress + I)))
+            {
+                SpdBcacheRemove(Cache, Entry);
+                Cache->InvalidateCount++;
+            }
+    }
+    else
+    {
+        for (ULONG I = 0; Cache->EntryCount > I; I++)
+        {
+            Entry = &Cache->Entries[I];
+            if (Entry->Valid &&
+                BlockAddress <= Entry->BlockAddress && Entry->BlockAddress - BlockAddress < BlockCount)
+            {
+                SpdBcacheRemove(Cache, Entry);
+                Cache->InvalidateCount++;
+            }
+        }
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+/**
+ * @file shared/bufpool.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_BUFPOOL_H_INCLUDED
+#define WINSPD_SHARED_BUFPOOL_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Buffer pools
+ *
+ * A buffer pool caches freed buffers in size classes of powers of two, from 512
+ * bytes up to 16MB. Each size class is a lock-free LIFO (an interlocked SList), so
+ * that a buffer is usually reused while it is still warm in the cache and so that
+ * allocating and freeing does not take a lock or go to the heap once the pool has
+ * warmed up. Requests larger than the largest size class go to the heap directly.
+ *
+ * Each size class caches at most SPD_BUFFER_POOL_CACHE_MAX buffers and all classes
+ * together cache at most SPD_BUFFER_POOL_CACHE_SIZE_MAX bytes; any extra buffers freed
+ * are returned to the heap. Without the byte cap the large classes alone could hold
+ * about 1GB. AllocCount counts the heap allocations made by the pool and may be used
+ * to tell how often the pool misses.
+ */
+
+#define SPD_BUFFER_POOL_MIN_SHIFT       9
+#define SPD_BUFFER_POOL_CLASS_COUNT     16
+#define SPD_BUFFER_POOL_CACHE_MAX       64
+#define SPD_BUFFER_POOL_CACHE_SIZE_MAX  (64 * 1024 * 1024)
+
+typedef struct
+{
+    SLIST_ENTRY ListEntry;
+    ULONG Class;
+} SPD_BUFFER_POOL_HEADER;
+typedef struct
+{
+    SLIST_HEADER FreeLists[SPD_BUFFER_POOL_CLASS_COUNT];
+    volatile LONG64 CacheSize;          /* bytes cached in FreeLists */
+    LONG AllocCount;
+} SPD_BUFFER_POOL;
+
+static inline
+ULONG SpdBufferPoolClass(size_t Size)
+{
+    ULONG Class = 0;
+
+    while (SPD_BUFFER_POOL_CLASS_COUNT > Class &&
+        ((size_t)1 << (SPD_BUFFER_POOL_MIN_SHIFT + Class)) < Size)
+        Class++;
+
+    /* SPD_BUFFER_POOL_CLASS_COUNT if too large for any size class */
+    return Class;
+}
+
+static inline
+VOID SpdBufferPoolInitialize(SPD_BUFFER_POOL *Pool)
+{
+    for (ULONG I = 0; SPD_BUFFER_POOL_CLASS_COUNT > I; I++)
+        InitializeSListHead(&Pool->FreeLists[I]);
+    Pool->CacheSize = 0;
+    Pool->AllocCount = 0;
+}
+
+static inline
+VOID SpdBufferPoolFinalize(SPD_BUFFER_POOL *Pool)
+{
+    PSLIST_ENTRY ListEntry, NextEntry;
+
+    for (ULONG I = 0; SPD_BUFFER_POOL_CLASS_COUNT > I; I++)
+        for (ListEntry = InterlockedFlushSList(&Pool->FreeLists[I]); 0 != ListEntry;
+            ListEntry = NextEntry)
+        {
+            NextEntry = ListEntry->Next;
+            HeapFree(GetProcessHeap(), 0,
+                CONTAINING_RECORD(ListEntry, SPD_BUFFER_POOL_HEADER, ListEntry));
+        }
+    Pool->CacheSize = 0;
+}
+
+static inline
+PVOID SpdBufferPoolAlloc(SPD_BUFFER_POOL *Pool, size_t Size)
+{
+    ULONG Class = SpdBufferPoolClass(Size);
+    SPD_BUFFER_POOL_HEADER *Header;
+    PSLIST_ENTRY ListEntry;
+
+    if (SPD_BUFFER_POOL_CLASS_COUNT > Class)
+    {
+        Size = (size_t)1 << (SPD_BUFFER_POOL_MIN_SHIFT + Class);
+
+        ListEntry = InterlockedPopEntrySList(&Pool->FreeLists[Class]);
+        if (0 != ListEntry)
+        {
+            InterlockedAdd64(&Pool->CacheSize, -(LONG64)Size);
+            return CONTAINING_RECORD(ListEntry, SPD_BUFFER_POOL_HEADER, ListEntry) + 1;
+        }
+    }
+    else if ((size_t)-1 - sizeof *Header < Size)
+        return 0;
+
+    Header = HeapAlloc(GetProcessHeap(), 0, sizeof *Header + Size);
+    if (0 == Header)
+        return 0;
+    Header->Class = Class;
+    InterlockedIncrement(&Pool->AllocCount);
+
+    return Header + 1;
+}
+
+static inline
+VOID SpdBufferPoolFree(SPD_BUFFER_POOL *Pool, PVOID Buffer)
+{
+    SPD_BUFFER_POOL_HEADER *Header;
+    LONG64 Size;
+
+    if (0 == Buffer)
+        return;
+
+    Header = (SPD_BUFFER_POOL_HEADER *)Buffer - 1;
+
+    /* the depth check is racy and may overshoot by a few buffers; the byte cap is exact */
+    if (SPD_BUFFER_POOL_CLASS_COUNT > Header->Class &&
+        SPD_BUFFER_POOL_CACHE_MAX > QueryDepthSList(&Pool->FreeLists[Header->Class]))
+    {
+        Size = (LONG64)1 << (SPD_BUFFER_POOL_MIN_SHIFT + Header->Class);
+        if (SPD_BUFFER_POOL_CACHE_SIZE_MAX >= InterlockedAdd64(&Pool->CacheSize, Size))
+        {
+            InterlockedPushEntrySList(&Pool->FreeLists[Header->Class], &Header->ListEntry);
+            return;
+        }
+        InterlockedAdd64(&Pool->CacheSize, -Size);
+    }
+
+    HeapFree(GetProcessHeap(), 0, Header);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
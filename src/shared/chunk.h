@@ -0,0 +1,114 @@
+/**
+ * @file shared/chunk.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_CHUNK_H_INCLUDED
+#define WINSPD_SHARED_CHUNK_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * SRB data chunking
+ *
+ * An SRB whose data exceed MaxTransferLength is handed out in chunks: each chunk
+ * is a separate request that covers the bytes [ChunkOffset, ChunkOffset + Length)
+ * of the SRB data. Chunks may be processed one after the other, with ChunkOffset
+ * advancing as each chunk completes; or several at once, with each chunk claiming
+ * the next piece of the SRB when it completes (see SpdChunkNext). The pieces do not
+ * overlap, so chunks that are processed at once never touch the same SRB bytes.
+ *
+ * A chunk is either copied or mapped. A copied chunk goes through the transact
+ * data buffer: write data are copied into it when the request is prepared and
+ * read data are copied out of it when the response is completed. A mapped chunk
+ * is accessed by the storage unit directly in the SRB pages, so nothing is copied.
+ */
+
+static inline
+ULONG SpdChunkLength(ULONG DataLength, ULONG ChunkOffset, ULONG MaxTransferLength)
+{
+    ULONG ChunkLength = DataLength - ChunkOffset;
+    return ChunkLength > MaxTransferLength ? MaxTransferLength : ChunkLength;
+}
+
+/* number of chunks of an SRB; an SRB without data still takes one */
+static inline
+ULONG SpdChunkCount(ULONG DataLength, ULONG MaxTransferLength)
+{
+    return 0 != DataLength ? (DataLength - 1) / MaxTransferLength + 1 : 1;
+}
+
+static inline
+ULONG SpdChunkPrepare(PVOID SystemDataBuffer, ULONG DataLength, ULONG ChunkOffset,
+    ULONG MaxTransferLength, BOOLEAN Write, BOOLEAN Mapped, PVOID DataBuffer)
+{
+    ULONG ChunkLength = SpdChunkLength(DataLength, ChunkOffset, MaxTransferLength);
+
+    if (Write && !Mapped)
+        memcpy(DataBuffer, (PUINT8)SystemDataBuffer + ChunkOffset, ChunkLength);
+
+    return ChunkLength;
+}
+
+static inline
+BOOLEAN SpdChunkComplete(PVOID SystemDataBuffer, ULONG DataLength, PULONG PChunkOffset,
+    ULONG MaxTransferLength, BOOLEAN Read, BOOLEAN Mapped, PVOID DataBuffer)
+{
+    ULONG ChunkOffset = *PChunkOffset;
+    ULONG ChunkLength = SpdChunkLength(DataLength, ChunkOffset, MaxTransferLength);
+
+    if (Read && !Mapped)
+    {
+        if (0 != DataBuffer)
+            memcpy((PUINT8)SystemDataBuffer + ChunkOffset, DataBuffer, ChunkLength);
+        else
+            memset((PUINT8)SystemDataBuffer + ChunkOffset, 0, ChunkLength);
+    }
+
+    *PChunkOffset = ChunkOffset + ChunkLength;
+
+    /* return TRUE if we are done; FALSE if we have more chunks */
+    return *PChunkOffset >= DataLength;
+}
+
+/*
+ * Claim the next piece of an SRB whose chunks are processed at once. *PNextOffset is
+ * shared by the chunks and starts past the pieces that they were first given. Returns
+ * FALSE if the SRB has no more pieces, in which case the chunk is done.
+ */
+static inline
+BOOLEAN SpdChunkNext(volatile LONG *PNextOffset, ULONG DataLength, ULONG MaxTransferLength,
+    PULONG PChunkOffset)
+{
+    ULONG ChunkOffset = (ULONG)InterlockedExchangeAdd(PNextOffset, (LONG)MaxTransferLength);
+
+    if (ChunkOffset >= DataLength)
+        return FALSE;
+
+    *PChunkOffset = ChunkOffset;
+    return TRUE;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
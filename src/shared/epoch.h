@@ -0,0 +1,137 @@
+/**
+ * @file shared/epoch.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_EPOCH_H_INCLUDED
+#define WINSPD_SHARED_EPOCH_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Epochs
+ *
+ * An epoch lets readers look up published pointers without a lock, while writers
+ * that unpublish a pointer can tell when the object is no longer reachable. A reader
+ * announces the current epoch in its slot for the duration of a short read section
+ * (SpdEpochEnter/SpdEpochLeave); inside the section it may read published pointers and
+ * take references to the objects. A writer unpublishes a pointer and then calls
+ * SpdEpochSynchronize, which advances the epoch and waits until every slot is idle or
+ * has entered the new epoch. After that no reader can find the object, except through
+ * a reference that it took, and the object may be released.
+ *
+ * A slot may be used by only one reader at a time: the kernel uses one slot per
+ * processor and reads at DISPATCH_LEVEL; user mode may use one slot per thread.
+ * Readers that do not know their threads in advance use SpdEpochEnterAny instead,
+ * which claims an idle slot for the duration of the section.
+ *
+ * Writers wait with SpdEpochWait. A user mode reader may be preempted inside its
+ * section, so the default gives up the processor; the kernel spins instead, because
+ * its readers cannot be preempted.
+ */
+
+#if !defined(SpdEpochWait)
+#define SpdEpochWait()                  SwitchToThread()
+#endif
+
+typedef struct DECLSPEC_CACHEALIGN
+{
+    volatile LONG Epoch;                /* 0 if the slot is idle */
+} SPD_EPOCH_SLOT;
+typedef struct
+{
+    volatile LONG Epoch;
+    ULONG SlotCount;
+    SPD_EPOCH_SLOT *Slots;
+} SPD_EPOCH;
+
+static inline
+VOID SpdEpochInitialize(SPD_EPOCH *Epoch, SPD_EPOCH_SLOT *Slots, ULONG SlotCount)
+{
+    Epoch->Epoch = 1;
+    Epoch->SlotCount = SlotCount;
+    Epoch->Slots = Slots;
+    memset(Slots, 0, SlotCount * sizeof Slots[0]);
+}
+
+static inline
+VOID SpdEpochEnter(SPD_EPOCH *Epoch, ULONG Slot)
+{
+    LONG Current = Epoch->Epoch;
+
+    /* 0 means idle; skip it when the epoch wraps */
+    Epoch->Slots[Slot].Epoch = 0 != Current ? Current : 1;
+
+    /* the slot must be visible before we read any published pointer */
+    MemoryBarrier();
+}
+
+static inline
+ULONG SpdEpochEnterAny(SPD_EPOCH *Epoch, ULONG Hint)
+{
+    ULONG Slot = Hint % Epoch->SlotCount;
+    LONG Current;
+
+    for (ULONG I = 1;; I++)
+    {
+        Current = Epoch->Epoch;
+
+        /* the interlocked claim also makes the slot visible before we read any pointer */
+        if (0 == Epoch->Slots[Slot].Epoch &&
+            0 == InterlockedCompareExchange(&Epoch->Slots[Slot].Epoch,
+                0 != Current ? Current : 1, 0))
+            return Slot;
+
+        Slot = (Slot + 1) % Epoch->SlotCount;
+        if (0 == I % Epoch->SlotCount)
+            SpdEpochWait();
+    }
+}
+
+static inline
+VOID SpdEpochLeave(SPD_EPOCH *Epoch, ULONG Slot)
+{
+    /* our reads must be done before the slot appears idle */
+    InterlockedExchange(&Epoch->Slots[Slot].Epoch, 0);
+}
+
+static inline
+VOID SpdEpochSynchronize(SPD_EPOCH *Epoch)
+{
+    /* the interlocked increment orders the caller's unpublish before the slot reads */
+    LONG Current = InterlockedIncrement(&Epoch->Epoch);
+    LONG SlotEpoch;
+
+    if (0 == Current)
+        Current = InterlockedIncrement(&Epoch->Epoch);
+
+    /* wait for the slots that entered before Current; compare so that wrapping works */
+    for (ULONG I = 0; Epoch->SlotCount > I; I++)
+        while (0 != (SlotEpoch = Epoch->Slots[I].Epoch) &&
+            0 < (LONG)((ULONG)Current - (ULONG)SlotEpoch))
+            SpdEpochWait();
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,235 @@
+/**
+ * @file shared/extmap.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_EXTMAP_H_INCLUDED
+#define WINSPD_SHARED_EXTMAP_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Extent maps
+ *
+ * An extent map tracks which parts of an image of Length bytes may hold data. The image
+ * is divided in chunks of 1 << ChunkShift bytes and the map keeps one bit per chunk: a
+ * clear bit means that the chunk is known to read as zeroes. The map is conservative:
+ * SpdExtentMapSet marks every chunk that a range touches, while SpdExtentMapClear only
+ * clears the chunks that a range covers in full.
+ *
+ * SpdExtentMapRun splits a range in runs of allocated and unallocated chunks; it scans
+ * the map a word at a time, so long runs cost little. Ranges that span whole words are
+ * set or cleared with a plain memset, which keeps building the map from the allocated
+ * ranges of a multi-TB image fast.
+ *
+ * Set and Clear of different ranges may run concurrently with each other and with Run:
+ * bits in words that are shared with other ranges are changed with interlocked operations.
+ * Overlapping Set and Clear have no defined order.
+ */
+
+#define SPD_EXTENT_MAP_WORD_BITS        32
+
+typedef struct
+{
+    volatile LONG *Bits;
+    UINT64 Length;
+    UINT64 ChunkCount;
+    ULONG ChunkShift;
+} SPD_EXTENT_MAP;
+
+static inline
+DWORD SpdExtentMapInitialize(SPD_EXTENT_MAP *Map, UINT64 Length, ULONG ChunkShift)
+{
+    UINT64 ChunkCount, WordCount;
+    size_t Size;
+
+    memset(Map, 0, sizeof *Map);
+
+    if (0 == Length || 64 <= ChunkShift)
+        return ERROR_INVALID_PARAMETER;
+
+    ChunkCount = ((Length - 1) >> ChunkShift) + 1;
+    WordCount = (ChunkCount + SPD_EXTENT_MAP_WORD_BITS - 1) / SPD_EXTENT_MAP_WORD_BITS;
+    Size = (size_t)(WordCount * sizeof(LONG));
+    if (Size / sizeof(LONG) != WordCount)
+        return ERROR_NO_SYSTEM_RESOURCES;
+
+    Map->Bits = HeapAlloc(GetProcessHeap(), 0, Size);
+    if (0 == Map->Bits)
+        return ERROR_NO_SYSTEM_RESOURCES;
+    memset((PVOID)Map->Bits, 0, Size);
+    Map->Length = Length;
+    Map->ChunkCount = ChunkCount;
+    Map->ChunkShift = ChunkShift;
+
+    return ERROR_SUCCESS;
+}
+
+static inline
+VOID SpdExtentMapFinalize(SPD_EXTENT_MAP *Map)
+{
+    if (0 != Map->Bits)
+        HeapFree(GetProcessHeap(), 0, (PVOID)Map->Bits);
+    Map->Bits = 0;
+}
+
+static inline
+VOID SpdExtentMapSetChunks(SPD_EXTENT_MAP *Map,
+    UINT64 Chunk, UINT64 EndChunk, BOOLEAN Allocated)
+{
+    UINT64 Index, Count, WordCount;
+    ULONG Bit, Mask;
+
+    while (EndChunk > Chunk)
+    {
+        Index = Chunk / SPD_EXTENT_MAP_WORD_BITS;
+        Bit = (ULONG)(Chunk % SPD_EXTENT_MAP_WORD_BITS);
+        Count = EndChunk - Chunk;
+
+        if (0 == Bit && SPD_EXTENT_MAP_WORD_BITS <= Count)
+        {
+            /* these words hold no bits of other ranges */
+            WordCount = Count / SPD_EXTENT_MAP_WORD_BITS;
+            memset((PVOID)(Map->Bits + Index), Allocated ? 0xff : 0, (size_t)WordCount * sizeof(LONG));
+            Chunk += WordCount * SPD_EXTENT_MAP_WORD_BITS;
+            continue;
+        }
+
+        if (SPD_EXTENT_MAP_WORD_BITS - Bit <= Count)
+        {
+            Mask = ~(ULONG)0 << Bit;
+            Chunk += SPD_EXTENT_MAP_WORD_BITS - Bit;
+        }
+        else
+        {
+            Mask = (((ULONG)1 << (ULONG)Count) - 1) << Bit;
+            Chunk += Count;
+        }
+
+        /* the common case is that there is nothing to change: do not dirty the word */
+        if (Allocated)
+        {
+            if (Mask != ((ULONG)Map->Bits[Index] & Mask))
+                InterlockedOr(Map->Bits + Index, (LONG)Mask);
+        }
+        else
+        {
+            if (0 != ((ULONG)Map->Bits[Index] & Mask))
+                InterlockedAnd(Map->Bits + Index, (LONG)~Mask);
+        }
+    }
+}
+
+static inline
+UINT64 SpdExtentMapFindChunk(SPD_EXTENT_MAP *Map,
+    UINT64 Chunk, UINT64 EndChunk, BOOLEAN Allocated)
+{
+    UINT64 Index;
+    ULONG Word, Bit;
+
+    while (EndChunk > Chunk)
+    {
+        Index = Chunk / SPD_EXTENT_MAP_WORD_BITS;
+        Word = (ULONG)Map->Bits[Index];
+        if (!Allocated)
+            Word = ~Word;
+        Word &= ~(ULONG)0 << (ULONG)(Chunk % SPD_EXTENT_MAP_WORD_BITS);
+
+        if (0 != Word)
+        {
+            _BitScanForward(&Bit, Word);
+            Chunk = Index * SPD_EXTENT_MAP_WORD_BITS + Bit;
+            return EndChunk > Chunk ? Chunk : EndChunk;
+        }
+
+        Chunk = (Index + 1) * SPD_EXTENT_MAP_WORD_BITS;
+    }
+
+    return EndChunk;
+}
+
+static inline
+VOID SpdExtentMapSet(SPD_EXTENT_MAP *Map, UINT64 Offset, UINT64 Length)
+{
+    UINT64 EndOffset;
+
+    if (Map->Length <= Offset || 0 == Length)
+        return;
+
+    EndOffset = Map->Length - Offset > Length ? Offset + Length : Map->Length;
+    SpdExtentMapSetChunks(Map,
+        Offset >> Map->ChunkShift, ((EndOffset - 1) >> Map->ChunkShift) + 1, TRUE);
+}
+
+static inline
+VOID SpdExtentMapSetAll(SPD_EXTENT_MAP *Map)
+{
+    SpdExtentMapSetChunks(Map, 0, Map->ChunkCount, TRUE);
+}
+
+static inline
+VOID SpdExtentMapClear(SPD_EXTENT_MAP *Map, UINT64 Offset, UINT64 Length)
+{
+    UINT64 EndOffset, Chunk, EndChunk;
+
+    if (Map->Length <= Offset || 0 == Length)
+        return;
+
+    EndOffset = Map->Length - Offset > Length ? Offset + Length : Map->Length;
+
+    /* a range that reaches the end of the image covers its last (short) chunk */
+    Chunk = 0 != Offset ? ((Offset - 1) >> Map->ChunkShift) + 1 : 0;
+    EndChunk = Map->Length == EndOffset ? Map->ChunkCount : EndOffset >> Map->ChunkShift;
+    SpdExtentMapSetChunks(Map, Chunk, EndChunk, FALSE);
+}
+
+static inline
+UINT64 SpdExtentMapRun(SPD_EXTENT_MAP *Map, UINT64 Offset, UINT64 Length,
+    PBOOLEAN PAllocated)
+{
+    UINT64 EndOffset, Chunk, RunEndOffset;
+    BOOLEAN Allocated;
+
+    /* the leading part of the range whose chunks are all allocated or all unallocated */
+    if (Map->Length <= Offset || 0 == Length)
+    {
+        *PAllocated = FALSE;
+        return Length;
+    }
+
+    EndOffset = Map->Length - Offset > Length ? Offset + Length : Map->Length;
+    Chunk = Offset >> Map->ChunkShift;
+    Allocated = 0 != ((ULONG)Map->Bits[Chunk / SPD_EXTENT_MAP_WORD_BITS] &
+        ((ULONG)1 << (ULONG)(Chunk % SPD_EXTENT_MAP_WORD_BITS)));
+
+    Chunk = SpdExtentMapFindChunk(Map,
+        Chunk + 1, ((EndOffset - 1) >> Map->ChunkShift) + 1, !Allocated);
+    RunEndOffset = Chunk << Map->ChunkShift;
+
+    *PAllocated = Allocated;
+    return (EndOffset > RunEndOffset ? RunEndOffset : Offset + Length) - Offset;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,283 @@
+/**
+ * @file shared/frame.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_FRAME_H_INCLUDED
+#define WINSPD_SHARED_FRAME_H_INCLUDED
+
+#if !defined(_WIN32)
+#include <shared/posix.h>
+#include <winspd/ioctl.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Transport framing
+ *
+ * A frame carries one transact request or response between a storage unit and a
+ * remote initiator. It consists of a frame header, the request or response and the
+ * data (if any):
+ *
+ *     +--------------+------------------+------------------+
+ *     | FRAME_HEADER | REQ/RSP          | data             |
+ *     +--------------+------------------+------------------+
+ *     |<------- HeaderLength -------->|<-- DataLength -->|
+ *
+ * HeaderLength is a multiple of 8 and may exceed the size of the message known to
+ * this version; any extra bytes are skipped. Requests and responses are matched by
+ * Hint, so any number of requests may be in flight on a connection and responses may
+ * arrive in any order.
+ *
+ * A connection starts unframed (legacy: a bare TRANSACT_MSG per message). A client
+ * that wants frames sends a HELLO frame with the highest version it speaks; the unit
+ * answers with a HELLO that carries the version used from then on. A HELLO frame is
+ * shorter than any legacy message, so the two cannot be confused.
+ *
+ * On a message transport (pipe) a frame is sent as a single message up to version 1.
+ * From version 2 (SPD_FRAME_VERSION_SPLIT) the data of a frame, if any, are sent as a
+ * message of their own right after the header message, so that the sender writes them
+ * straight from its data buffer and the receiver reads them straight into its own. On
+ * a stream transport (socket) the data always follow the message.
+ *
+ * The codec does not depend on any particular transport; it only validates buffers.
+ */
+
+#define SPD_FRAME_MAGIC                 0x46445053  /* 'SPDF' */
+#define SPD_FRAME_VERSION               2
+#define SPD_FRAME_VERSION_SPLIT         2
+
+enum
+{
+    SpdFrameHelloType                   = 1,
+    SpdFrameReqType                     = 2,
+    SpdFrameRspType                     = 3,
+};
+
+typedef struct
+{
+    UINT32 Magic;
+    UINT8 Version;
+    UINT8 Type;
+    UINT16 HeaderLength;                /* frame header and message */
+    UINT32 DataLength;                  /* data that follow the message */
+    UINT32 Reserved;
+} SPD_FRAME_HEADER;
+
+typedef struct
+{
+    UINT8 Version;
+    UINT8 Type;
+    PVOID Message;                      /* REQ or RSP; 0 for HELLO */
+    PVOID Data;
+    UINT32 DataLength;
+} SPD_FRAME;
+
+static inline
+ULONG SpdFrameMessageLength(UINT8 Type)
+{
+    switch (Type)
+    {
+    case SpdFrameHelloType:
+        return 0;
+    case SpdFrameReqType:
+        return sizeof(SPD_IOCTL_TRANSACT_REQ);
+    case SpdFrameRspType:
+        return sizeof(SPD_IOCTL_TRANSACT_RSP);
+    default:
+        return (ULONG)-1;
+    }
+}
+
+/*
+ * Data length that a request must carry: WRITE data or UNMAP descriptors.
+ * Returns (ULONG)-1 if the request is malformed or too large.
+ */
+static inline
+ULONG SpdFrameReqDataLength(const SPD_IOCTL_TRANSACT_REQ *Req,
+    UINT32 BlockLength, UINT32 MaxTransferLength)
+{
+    UINT64 DataLength;
+
+    switch (Req->Kind)
+    {
+    case SpdIoctlTransactWriteKind:
+        DataLength = (UINT64)Req->Op.Write.BlockCount * BlockLength;
+        break;
+    case SpdIoctlTransactUnmapKind:
+        DataLength = (UINT64)Req->Op.Unmap.Count * sizeof(SPD_IOCTL_UNMAP_DESCRIPTOR);
+        break;
+    default:
+        DataLength = 0;
+        break;
+    }
+
+    return MaxTransferLength >= DataLength ? (ULONG)DataLength : (ULONG)-1;
+}
+
+/*
+ * Encode a frame header and message into Buffer, which must have room for
+ * sizeof(SPD_FRAME_HEADER) + SpdFrameMessageLength(Type) bytes. The DataLength
+ * bytes of data must follow and are not copied: the caller sends them after the
+ * returned header length (possibly as a separate segment).
+ */
+static inline
+ULONG SpdFrameEncode(PVOID Buffer, UINT8 Version, UINT8 Type,
+    const VOID *Message, UINT32 DataLength)
+{
+    SPD_FRAME_HEADER *Header = Buffer;
+    ULONG MessageLength = SpdFrameMessageLength(Type);
+
+    Header->Magic = SPD_FRAME_MAGIC;
+    Header->Version = Version;
+    Header->Type = Type;
+    Header->HeaderLength = (UINT16)(sizeof *Header + MessageLength);
+    Header->DataLength = DataLength;
+    Header->Reserved = 0;
+    if (0 != MessageLength)
+        memcpy(Header + 1, Message, MessageLength);
+
+    return sizeof *Header + MessageLength;
+}
+
+static inline
+ULONG SpdFrameEncodeHello(PVOID Buffer, UINT8 Version)
+{
+    return SpdFrameEncode(Buffer, Version, SpdFrameHelloType, 0, 0);
+}
+
+/*
+ * Validate a frame header. This is all that a stream transport can check before it
+ * knows how much more to receive: the frame is HeaderLength + DataLength bytes long.
+ */
+static inline
+BOOLEAN SpdFrameCheckHeader(const SPD_FRAME_HEADER *Header, UINT32 MaxTransferLength)
+{
+    ULONG MessageLength;
+
+    /* a HELLO may name a newer version; the peers then agree on ours */
+    if (SPD_FRAME_MAGIC != Header->Magic ||
+        0 == Header->Version ||
+        (SPD_FRAME_VERSION < Header->Version && SpdFrameHelloType != Header->Type))
+        return FALSE;
+
+    MessageLength = SpdFrameMessageLength(Header->Type);
+    if ((ULONG)-1 == MessageLength ||
+        sizeof *Header + MessageLength > Header->HeaderLength ||
+        0 != Header->HeaderLength % 8)
+        return FALSE;
+
+    if (SpdFrameHelloType == Header->Type && 0 != Header->DataLength)
+        return FALSE;
+    if (MaxTransferLength < Header->DataLength)
+        return FALSE;
+
+    return TRUE;
+}
+
+/*
+ * Validate the message of a frame whose header has been checked, before any of its
+ * data are looked at. Requests are checked against the unit geometry: WRITE and UNMAP
+ * requests must carry exactly their data and other requests none. Only READ responses
+ * may carry data; the caller checks their length against the original request.
+ */
+static inline
+BOOLEAN SpdFrameCheckMessage(const SPD_FRAME_HEADER *Header, const VOID *Message,
+    UINT32 BlockLength, UINT32 MaxTransferLength)
+{
+    switch (Header->Type)
+    {
+    case SpdFrameReqType:
+        return SpdFrameReqDataLength(Message, BlockLength, MaxTransferLength) ==
+            Header->DataLength;
+    case SpdFrameRspType:
+        return 0 == Header->DataLength ||
+            SpdIoctlTransactReadKind == ((const SPD_IOCTL_TRANSACT_RSP *)Message)->Kind;
+    default:
+        return TRUE;
+    }
+}
+
+/*
+ * Decode a frame header and message of exactly Length bytes, received apart from the
+ * data. On success Frame points into Buffer, except for Frame->Data which is 0: the
+ * caller receives the Frame->DataLength bytes of data separately. Since the length of
+ * the header is not known in advance, it must be that of the negotiated version.
+ */
+static inline
+BOOLEAN SpdFrameDecodeHeader(PVOID Buffer, ULONG Length,
+    UINT32 BlockLength, UINT32 MaxTransferLength,
+    SPD_FRAME *Frame)
+{
+    SPD_FRAME_HEADER *Header = Buffer;
+
+    memset(Frame, 0, sizeof *Frame);
+
+    if (sizeof *Header > Length ||
+        !SpdFrameCheckHeader(Header, MaxTransferLength) ||
+        Header->HeaderLength != Length ||
+        !SpdFrameCheckMessage(Header, Header + 1, BlockLength, MaxTransferLength))
+        return FALSE;
+
+    Frame->Version = Header->Version;
+    Frame->Type = Header->Type;
+    Frame->Message = SpdFrameHelloType != Header->Type ? Header + 1 : 0;
+    Frame->DataLength = Header->DataLength;
+
+    return TRUE;
+}
+
+/*
+ * Decode a complete frame of Length bytes. On success Frame points into Buffer.
+ */
+static inline
+BOOLEAN SpdFrameDecode(PVOID Buffer, ULONG Length,
+    UINT32 BlockLength, UINT32 MaxTransferLength,
+    SPD_FRAME *Frame)
+{
+    SPD_FRAME_HEADER *Header = Buffer;
+
+    if (sizeof *Header > Length ||
+        Header->HeaderLength > Length ||
+        !SpdFrameDecodeHeader(Buffer, Header->HeaderLength,
+            BlockLength, MaxTransferLength, Frame))
+    {
+        memset(Frame, 0, sizeof *Frame);
+        return FALSE;
+    }
+
+    if (Header->DataLength != Length - Header->HeaderLength)
+    {
+        memset(Frame, 0, sizeof *Frame);
+        return FALSE;
+    }
+
+    Frame->Data = (PUINT8)Buffer + Header->HeaderLength;
+
+    return TRUE;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,218 @@
+/**
+ * @file shared/hintmap.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_HINTMAP_H_INCLUDED
+#define WINSPD_SHARED_HINTMAP_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hint maps
+ *
+ * A hint map associates a UINT64 value with the Hint of an outstanding request. It is
+ * an open-addressed table that is preallocated from the expected number of requests
+ * in flight and that is lock-free: Put claims an empty slot with a compare-exchange
+ * and Take releases it the same way.
+ *
+ * Every hint hashes to two buckets of SPD_HINT_MAP_BUCKET_SIZE slots (a cache line)
+ * and lives in one of them; Put prefers the emptier one. There are no probe chains,
+ * so Take can empty a slot right away and there are no tombstones to clean up. The
+ * map is sized to be at most an eighth full at the expected depth; Put fails only if
+ * both buckets are full.
+ *
+ * A hint of 0 is never stored (0 marks an empty slot). Put and Take on different
+ * hints may run concurrently. Take of a hint is expected to happen after its Put has
+ * returned (a response follows its request).
+ *
+ * Requests from several sources (e.g. the instances of a pipe and their connections)
+ * may use the same hints, including 0. Such a map is keyed on the pair: SpdHintMapKey
+ * offsets the hint by a multiple of a large odd constant for the source and
+ * SpdHintMapHint undoes it. For up to SPD_HINT_MAP_SOURCE_MAX sources every multiple
+ * is at least 2^49 away from 0, so hint 0 gets a non-zero key, and the keys of two
+ * sources meet only if their hints are at least that far apart; counters and user mode
+ * pointers (below 2^47) never are.
+ */
+
+#define SPD_HINT_MAP_BUCKET_SIZE        4
+#define SPD_HINT_MAP_SOURCE_MAX         16384
+#define SPD_HINT_MAP_SOURCE_STEP        0x9e3779b97f4a7c15ULL
+
+typedef struct
+{
+    volatile LONG64 Hint;
+    volatile UINT64 Value;
+} SPD_HINT_MAP_SLOT;
+typedef struct
+{
+    SPD_HINT_MAP_SLOT *Slots;
+    ULONG BucketMask;
+} SPD_HINT_MAP;
+
+static inline
+UINT64 SpdHintMapHash(UINT64 k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline
+UINT64 SpdHintMapKey(UINT64 Hint, ULONG Source)
+{
+    return Hint + (Source + 1) * SPD_HINT_MAP_SOURCE_STEP;
+}
+
+static inline
+UINT64 SpdHintMapHint(UINT64 Key, ULONG Source)
+{
+    return Key - (Source + 1) * SPD_HINT_MAP_SOURCE_STEP;
+}
+
+static inline
+DWORD SpdHintMapInitialize(SPD_HINT_MAP *Map, ULONG Depth)
+{
+    ULONG BucketCount = 2;
+    size_t Size;
+
+    /* two buckets per expected request: the map is at most an eighth full */
+    while (BucketCount < Depth * 2 && 0x10000000 > BucketCount)
+        BucketCount <<= 1;
+
+    Size = (size_t)BucketCount * SPD_HINT_MAP_BUCKET_SIZE * sizeof(SPD_HINT_MAP_SLOT);
+    Map->Slots = HeapAlloc(GetProcessHeap(), 0, Size);
+    if (0 == Map->Slots)
+        return ERROR_NO_SYSTEM_RESOURCES;
+    memset(Map->Slots, 0, Size);
+    Map->BucketMask = BucketCount - 1;
+
+    return ERROR_SUCCESS;
+}
+
+static inline
+VOID SpdHintMapFinalize(SPD_HINT_MAP *Map)
+{
+    if (0 != Map->Slots)
+        HeapFree(GetProcessHeap(), 0, Map->Slots);
+    Map->Slots = 0;
+}
+
+static inline
+VOID SpdHintMapBuckets(SPD_HINT_MAP *Map, UINT64 Hint, SPD_HINT_MAP_SLOT *Buckets[2])
+{
+    UINT64 Hash = SpdHintMapHash(Hint);
+    ULONG Index0 = (ULONG)Hash & Map->BucketMask;
+    ULONG Index1 = (ULONG)(Hash >> 32) & Map->BucketMask;
+
+    if (Index0 == Index1)
+        Index1 ^= 1;
+
+    Buckets[0] = Map->Slots + Index0 * SPD_HINT_MAP_BUCKET_SIZE;
+    Buckets[1] = Map->Slots + Index1 * SPD_HINT_MAP_BUCKET_SIZE;
+}
+
+static inline
+BOOLEAN SpdHintMapPut(SPD_HINT_MAP *Map, UINT64 Hint, UINT64 Value)
+{
+    SPD_HINT_MAP_SLOT *Buckets[2], *Slot;
+    ULONG FreeCount[2] = { 0, 0 };
+    LONG64 SlotHint;
+
+    if (0 == Hint)
+        return FALSE;
+
+    SpdHintMapBuckets(Map, Hint, Buckets);
+
+    /* reject duplicates */
+    for (ULONG I = 0; 2 > I; I++)
+        for (ULONG J = 0; SPD_HINT_MAP_BUCKET_SIZE > J; J++)
+        {
+            SlotHint = Buckets[I][J].Hint;
+            if ((LONG64)Hint == SlotHint)
+                return FALSE;
+            FreeCount[I] += 0 == SlotHint;
+        }
+
+    /* try the emptier bucket first */
+    if (FreeCount[0] < FreeCount[1])
+    {
+        Slot = Buckets[0];
+        Buckets[0] = Buckets[1];
+        Buckets[1] = Slot;
+    }
+
+    for (ULONG I = 0; 2 > I; I++)
+        for (ULONG J = 0; SPD_HINT_MAP_BUCKET_SIZE > J; J++)
+        {
+            Slot = &Buckets[I][J];
+            if (0 == Slot->Hint &&
+                0 == InterlockedCompareExchange64(&Slot->Hint, (LONG64)Hint, 0))
+            {
+                /* nobody reads Value until Take(Hint), which comes after us */
+                Slot->Value = Value;
+                return TRUE;
+            }
+        }
+
+    return FALSE;
+}
+
+static inline
+BOOLEAN SpdHintMapTake(SPD_HINT_MAP *Map, UINT64 Hint, PUINT64 PValue)
+{
+    SPD_HINT_MAP_SLOT *Buckets[2], *Slot;
+    UINT64 Value;
+
+    *PValue = 0;
+
+    if (0 == Hint)
+        return FALSE;
+
+    SpdHintMapBuckets(Map, Hint, Buckets);
+
+    for (ULONG I = 0; 2 > I; I++)
+        for (ULONG J = 0; SPD_HINT_MAP_BUCKET_SIZE > J; J++)
+        {
+            Slot = &Buckets[I][J];
+            if ((LONG64)Hint == Slot->Hint)
+            {
+                /* read Value before we release the slot to other Put's */
+                Value = Slot->Value;
+                if ((LONG64)Hint == InterlockedCompareExchange64(&Slot->Hint, 0, (LONG64)Hint))
+                {
+                    *PValue = Value;
+                    return TRUE;
+                }
+            }
+        }
+
+    return FALSE;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -408,11 +408,13 @@ exit:
     return Error;
 }
 
-DWORD SpdIoctlTransact(HANDLE DeviceHandle,
+static DWORD SpdIoctlTransactInternal(HANDLE DeviceHandle,
     UINT32 Btl,
     SPD_IOCTL_TRANSACT_RSP *Rsp,
     SPD_IOCTL_TRANSACT_REQ *Req,
-    PVOID DataBuffer)
+    UINT64 DataBuffer,
+    BOOLEAN DataBufferRegistered,
+    PVOID *PReqDataBuffer)
 {
     SPD_IOCTL_TRANSACT_PARAMS Params;
     DWORD BytesTransferred;
@@ -424,7 +426,9 @@ DWORD SpdIoctlTransact(HANDLE DeviceHandle,
     Params.Btl = Btl;
     Params.ReqValid = 0 != Req;
     Params.RspValid = 0 != Rsp;
-    Params.DataBuffer = (UINT64)(UINT_PTR)DataBuffer;
+    Params.DataBufferRegistered = DataBufferRegistered;
+    Params.DataBufferMapped = 0 != PReqDataBuffer;
+    Params.DataBuffer = DataBuffer;
 
     if (Params.RspValid)
         memcpy(&Params.Dir.Rsp, Rsp, sizeof *Rsp);
@@ -467,12 +471,59 @@ DWORD SpdIoctlTransact(HANDLE DeviceHandle,
         else
             memset(Req, 0, sizeof *Req);
 
+    if (0 != PReqDataBuffer)
+        *PReqDataBuffer = sizeof Params == BytesTransferred && Params.ReqValid &&
+            Params.DataBufferMapped ? (PVOID)(UINT_PTR)Params.DataBuffer : 0;
+
     Error = ERROR_SUCCESS;
 
 exit:
     return Error;
 }
 
+DWORD SpdIoctlTransact(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    PVOID DataBuffer)
+{
+    return SpdIoctlTransactInternal(DeviceHandle, Btl, Rsp, Req,
+        (UINT64)(UINT_PTR)DataBuffer, FALSE, 0);
+}
+
+DWORD SpdIoctlTransactRegistered(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    UINT32 DataBufferIndex)
+{
+    return SpdIoctlTransactInternal(DeviceHandle, Btl, Rsp, Req,
+        DataBufferIndex, TRUE, 0);
+}
+
+DWORD SpdIoctlTransactMapped(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    PVOID DataBuffer,
+    UINT32 DataBufferIndex,
+    PVOID *PReqDataBuffer)
+{
+    DWORD Error;
+
+    Error = (UINT32)-1 != DataBufferIndex ?
+        SpdIoctlTransactInternal(DeviceHandle, Btl, Rsp, Req,
+            DataBufferIndex, TRUE, PReqDataBuffer) :
+        SpdIoctlTransactInternal(DeviceHandle, Btl, Rsp, Req,
+            (UINT64)(UINT_PTR)DataBuffer, FALSE, PReqDataBuffer);
+
+    /* if the request data were not mapped they are in the data buffer as usual */
+    if (ERROR_SUCCESS == Error && 0 == *PReqDataBuffer)
+        *PReqDataBuffer = DataBuffer;
+
+    return Error;
+}
+
 DWORD SpdIoctlSetTransactProcessId(HANDLE DeviceHandle,
     UINT32 Btl,
     ULONG ProcessId)
@@ -501,3 +552,228 @@ DWORD SpdIoctlSetTransactProcessId(HANDLE DeviceHandle,
 exit:
     return Error;
 }
+
+static DWORD SpdIoctlTransactBatchInternal(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_BATCH_PARAMS *Params,
+    UINT32 Count,
+    UINT64 DataBuffer,
+    BOOLEAN DataBufferRegistered)
+{
+    DWORD ParamsSize;
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    if (0 == Count || SPD_IOCTL_TRANSACT_BATCH_MAX < Count ||
+        (0 == DataBuffer && !DataBufferRegistered))
+    {
+        Error = ERROR_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    ParamsSize = SPD_IOCTL_TRANSACT_BATCH_PARAMS_SIZE(Count);
+    Params->Base.Size = (UINT16)ParamsSize;
+    Params->Base.Code = SPD_IOCTL_TRANSACT_BATCH;
+    Params->Btl = Btl;
+    Params->Count = Count;
+    Params->DataBufferRegistered = DataBufferRegistered;
+    Params->DataBuffer = DataBuffer;
+
+    /* see SpdIoctlTransact for why we can use a NULL Overlapped parameter here */
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        Params, ParamsSize,
+        Params, ParamsSize,
+        &BytesTransferred, 0))
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    if (ParamsSize != BytesTransferred)
+        for (UINT32 I = 0; Count > I; I++)
+        {
+            Params->Entries[I].ReqValid = 0;
+            Params->Entries[I].RspValid = 0;
+        }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    return Error;
+}
+
+DWORD SpdIoctlTransactBatch(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_BATCH_PARAMS *Params,
+    UINT32 Count,
+    PVOID DataBuffer)
+{
+    return SpdIoctlTransactBatchInternal(DeviceHandle, Btl, Params, Count,
+        (UINT64)(UINT_PTR)DataBuffer, FALSE);
+}
+
+DWORD SpdIoctlTransactBatchRegistered(HANDLE DeviceHandle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_BATCH_PARAMS *Params,
+    UINT32 Count,
+    UINT32 DataBufferIndex)
+{
+    return SpdIoctlTransactBatchInternal(DeviceHandle, Btl, Params, Count,
+        DataBufferIndex, TRUE);
+}
+
+DWORD SpdIoctlRingSetup(HANDLE DeviceHandle,
+    UINT32 Btl,
+    UINT32 Capacity,
+    PVOID Buffer,
+    UINT64 BufferSize,
+    HANDLE Event)
+{
+    SPD_IOCTL_RING_SETUP_PARAMS Params;
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    memset(&Params, 0, sizeof Params);
+    Params.Base.Size = sizeof Params;
+    Params.Base.Code = SPD_IOCTL_RING_SETUP;
+    Params.Btl = Btl;
+    Params.Capacity = Capacity;
+    Params.Buffer = (UINT64)(UINT_PTR)Buffer;
+    Params.BufferSize = BufferSize;
+    Params.Event = (UINT64)(UINT_PTR)Event;
+
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Params, sizeof Params,
+        0, 0,
+        &BytesTransferred, 0))
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    return Error;
+}
+
+DWORD SpdIoctlRingDoorbell(HANDLE DeviceHandle,
+    UINT32 Btl)
+{
+    SPD_IOCTL_RING_DOORBELL_PARAMS Params;
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    memset(&Params, 0, sizeof Params);
+    Params.Base.Size = sizeof Params;
+    Params.Base.Code = SPD_IOCTL_RING_DOORBELL;
+    Params.Btl = Btl;
+
+    /* see SpdIoctlTransact for why we can use a NULL Overlapped parameter here */
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Params, sizeof Params,
+        0, 0,
+        &BytesTransferred, 0))
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    return Error;
+}
+
+DWORD SpdIoctlRegisterBuffer(HANDLE DeviceHandle,
+    UINT32 Btl,
+    PVOID Buffer,
+    UINT32 BufferSize,
+    PUINT32 PIndex)
+{
+    SPD_IOCTL_REGISTER_BUFFER_PARAMS Params;
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    *PIndex = (UINT32)-1;
+
+    memset(&Params, 0, sizeof Params);
+    Params.Base.Size = sizeof Params;
+    Params.Base.Code = SPD_IOCTL_REGISTER_BUFFER;
+    Params.Btl = Btl;
+    Params.Buffer = (UINT64)(UINT_PTR)Buffer;
+    Params.BufferSize = BufferSize;
+
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Params, sizeof Params,
+        &Params, sizeof Params,
+        &BytesTransferred, 0))
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    *PIndex = Params.Index;
+    Error = ERROR_SUCCESS;
+
+exit:
+    return Error;
+}
+
+DWORD SpdIoctlUnregisterBuffer(HANDLE DeviceHandle,
+    UINT32 Btl,
+    UINT32 Index)
+{
+    SPD_IOCTL_UNREGISTER_BUFFER_PARAMS Params;
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    memset(&Params, 0, sizeof Params);
+    Params.Base.Size = sizeof Params;
+    Params.Base.Code = SPD_IOCTL_UNREGISTER_BUFFER;
+    Params.Btl = Btl;
+    Params.Index = Index;
+
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        &Params, sizeof Params,
+        0, 0,
+        &BytesTransferred, 0))
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    return Error;
+}
+
+DWORD SpdIoctlGetStats(HANDLE DeviceHandle,
+    UINT32 Btl,
+    UINT32 Timing,
+    SPD_IOCTL_GET_STATS_PARAMS *Stats)
+{
+    DWORD BytesTransferred;
+    DWORD Error;
+
+    memset(Stats, 0, sizeof *Stats);
+    Stats->Base.Size = sizeof *Stats;
+    Stats->Base.Code = SPD_IOCTL_GET_STATS;
+    Stats->Btl = Btl;
+    Stats->Timing = Timing;
+
+    if (!DeviceIoControl(DeviceHandle, IOCTL_MINIPORT_PROCESS_SERVICE_IRP,
+        Stats, sizeof *Stats,
+        Stats, sizeof *Stats,
+        &BytesTransferred, 0))
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    return Error;
+}
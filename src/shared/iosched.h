@@ -0,0 +1,190 @@
+/**
+ * @file shared/iosched.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_IOSCHED_H_INCLUDED
+#define WINSPD_SHARED_IOSCHED_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * I/O scheduling
+ *
+ * The scheduler decides which pending request a multi-queue hands out next (see
+ * shared/mqueue.h). Requests are in one of two classes: urgent (reads, flushes and
+ * everything else that is not a write) and bulk (writes and unmaps). A queue keeps
+ * its pending requests in a list per class, in posting order, and the policy picks
+ * between the heads of the lists:
+ *
+ * - FIFO: posting order; all requests are kept in the urgent list.
+ * - Priority: urgent requests first; but after SPD_IOSCHED_STARVE_MAX urgent requests
+ *   in a row a waiting bulk request goes next, so that writes are not starved.
+ * - Deadline: a request gets a deadline when it is posted, SPD_IOSCHED_URGENT_EXPIRE
+ *   or SPD_IOSCHED_BULK_EXPIRE later, and the earliest deadline goes first. Reads
+ *   expire sooner so they normally win, but not over a write that has waited longer.
+ *
+ * Regardless of the policy a token bucket may limit the rate at which requests are
+ * handed out, in requests and in bytes per second. Credit accrues with time, up to a
+ * burst of SPD_IOSCHED_BURST worth, and a request is admitted while there is credit;
+ * it is then charged in full. So a request larger than the burst is still admitted
+ * and the resulting debt holds back the requests that follow.
+ *
+ * Times are in 100ns units. SpdIoSchedNow is the tick count by default; the kernel
+ * defines it to the interrupt time. Calls that change the bucket must be serialized
+ * by the caller.
+ */
+
+#if !defined(SpdIoSchedNow)
+#define SpdIoSchedNow()                 (GetTickCount64() * 10000)
+#endif
+
+#define SPD_IOSCHED_SECOND              10000000ULL
+#define SPD_IOSCHED_BURST               (SPD_IOSCHED_SECOND / 10)
+#define SPD_IOSCHED_URGENT_EXPIRE       (SPD_IOSCHED_SECOND / 100)
+#define SPD_IOSCHED_BULK_EXPIRE         (SPD_IOSCHED_SECOND / 4)
+#define SPD_IOSCHED_STARVE_MAX          16
+#define SPD_IOSCHED_BANDWIDTH_MAX       (1ULL << 40)    /* keeps credit within INT64 */
+
+enum
+{
+    SpdIoSchedUrgentClass = 0,
+    SpdIoSchedBulkClass,
+    SpdIoSchedClassCount,
+};
+typedef struct
+{
+    UINT8 Policy;                       /* SpdIoctlSched*Policy */
+    UINT32 MaxIops;                     /* 0 if unlimited */
+    UINT64 MaxBandwidth;                /* 0 if unlimited */
+    /* credit is in units of 1/SPD_IOSCHED_SECOND of a request or byte; may go negative */
+    INT64 IoCredit, ByteCredit;
+    UINT64 Time;                        /* of the last refill */
+} SPD_IOSCHED;
+
+static inline
+VOID SpdIoSchedInitialize(SPD_IOSCHED *Sched,
+    UINT8 Policy, UINT32 MaxIops, UINT64 MaxBandwidth, UINT64 Now)
+{
+    Sched->Policy = SpdIoctlSchedPolicyCount > Policy ? Policy : SpdIoctlSchedFifoPolicy;
+    Sched->MaxIops = MaxIops;
+    Sched->MaxBandwidth = SPD_IOSCHED_BANDWIDTH_MAX < MaxBandwidth ?
+        SPD_IOSCHED_BANDWIDTH_MAX : MaxBandwidth;
+    Sched->IoCredit = (INT64)(Sched->MaxIops * SPD_IOSCHED_BURST);
+    Sched->ByteCredit = (INT64)(Sched->MaxBandwidth * SPD_IOSCHED_BURST);
+    Sched->Time = Now;
+}
+
+static inline
+BOOLEAN SpdIoSchedLimited(SPD_IOSCHED *Sched)
+{
+    return 0 != Sched->MaxIops || 0 != Sched->MaxBandwidth;
+}
+
+/* class of a request; bulk requests are those that move data to the storage unit */
+static inline
+UINT8 SpdIoSchedClass(UINT8 Kind)
+{
+    return SpdIoctlTransactWriteKind == Kind || SpdIoctlTransactUnmapKind == Kind ?
+        SpdIoSchedBulkClass : SpdIoSchedUrgentClass;
+}
+
+static inline
+UINT64 SpdIoSchedDeadline(UINT8 Class, UINT64 Now)
+{
+    return Now + (SpdIoSchedBulkClass == Class ?
+        SPD_IOSCHED_BULK_EXPIRE : SPD_IOSCHED_URGENT_EXPIRE);
+}
+
+static inline
+INT64 SpdIoSchedCredit(INT64 Credit, UINT64 Rate, UINT64 Elapsed)
+{
+    /* compare before multiplying: a long idle time would overflow */
+    INT64 Burst = (INT64)(Rate * SPD_IOSCHED_BURST);
+    if (0 == Rate || (UINT64)(Burst - Credit) / Rate < Elapsed)
+        return Burst;
+    return Credit + (INT64)(Rate * Elapsed);
+}
+
+static inline
+VOID SpdIoSchedRefill(SPD_IOSCHED *Sched, UINT64 Now)
+{
+    UINT64 Elapsed = Now - Sched->Time;
+
+    if ((INT64)Elapsed <= 0)
+        return;
+    Sched->Time = Now;
+
+    Sched->IoCredit = SpdIoSchedCredit(Sched->IoCredit, Sched->MaxIops, Elapsed);
+    Sched->ByteCredit = SpdIoSchedCredit(Sched->ByteCredit, Sched->MaxBandwidth, Elapsed);
+}
+
+/* admit a request of Length bytes and charge for it; FALSE if the credit is used up */
+static inline
+BOOLEAN SpdIoSchedAdmit(SPD_IOSCHED *Sched, ULONG Length, UINT64 Now)
+{
+    SpdIoSchedRefill(Sched, Now);
+
+    if ((0 != Sched->MaxIops && 0 >= Sched->IoCredit) ||
+        (0 != Sched->MaxBandwidth && 0 >= Sched->ByteCredit))
+        return FALSE;
+
+    if (0 != Sched->MaxIops)
+        Sched->IoCredit -= (INT64)SPD_IOSCHED_SECOND;
+    if (0 != Sched->MaxBandwidth)
+        Sched->ByteCredit -= (INT64)(Length * SPD_IOSCHED_SECOND);
+
+    return TRUE;
+}
+
+/* charge for Length more bytes of a request that has been admitted (e.g. merged ones) */
+static inline
+VOID SpdIoSchedCharge(SPD_IOSCHED *Sched, ULONG Length)
+{
+    if (0 != Sched->MaxBandwidth)
+        Sched->ByteCredit -= (INT64)(Length * SPD_IOSCHED_SECOND);
+}
+
+/* time until a request may be admitted again; 0 if one may be admitted now */
+static inline
+UINT64 SpdIoSchedDelay(SPD_IOSCHED *Sched, UINT64 Now)
+{
+    UINT64 Delay = 0, D;
+
+    SpdIoSchedRefill(Sched, Now);
+
+    if (0 != Sched->MaxIops && 0 >= Sched->IoCredit)
+        Delay = (UINT64)-Sched->IoCredit / Sched->MaxIops + 1;
+    if (0 != Sched->MaxBandwidth && 0 >= Sched->ByteCredit)
+    {
+        D = (UINT64)-Sched->ByteCredit / Sched->MaxBandwidth + 1;
+        if (Delay < D)
+            Delay = D;
+    }
+
+    return Delay;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,142 @@
+/**
+ * @file shared/merge.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_MERGE_H_INCLUDED
+#define WINSPD_SHARED_MERGE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Request merging
+ *
+ * Pending reads (or writes) whose block ranges are adjacent may be merged into a single
+ * request that covers all of them, up to MaxBlockCount blocks. A merge starts with the
+ * request that is about to be handed out and grows at either end as adjacent requests
+ * are added. Its members are kept in block address order, so that the data of a member
+ * is at SpdMergeOffset in the data of the merged request: writes are gathered there
+ * before the merged request is handed out and reads are scattered from there when it
+ * completes.
+ *
+ * Requests merge only if their keys are equal and not 0. The key is the request kind
+ * and anything else that must be the same for all members (e.g. FUA); 0 means that
+ * a request does not merge.
+ *
+ * A member may be removed from a merge that has been handed out (e.g. when it is
+ * cancelled); it then leaves a hole in the merged range, which still covers it.
+ */
+
+#define SPD_MERGE_KEY_FUA               0x80
+
+typedef struct _SPD_MERGE_ENTRY
+{
+    struct _SPD_MERGE_ENTRY *Next;      /* in block address order */
+    UINT64 BlockAddress;
+    UINT32 BlockCount;
+    UINT8 Key;                          /* 0 if the request does not merge */
+} SPD_MERGE_ENTRY;
+typedef struct
+{
+    SPD_MERGE_ENTRY *First;
+    UINT64 BlockAddress;
+    UINT32 BlockCount, MaxBlockCount;
+    ULONG Count;                        /* members */
+    UINT8 Key;
+} SPD_MERGE;
+
+static inline
+VOID SpdMergeInitialize(SPD_MERGE *Merge, SPD_MERGE_ENTRY *Entry, UINT32 MaxBlockCount)
+{
+    Entry->Next = 0;
+    Merge->First = Entry;
+    Merge->BlockAddress = Entry->BlockAddress;
+    Merge->BlockCount = Entry->BlockCount;
+    Merge->MaxBlockCount = MaxBlockCount;
+    Merge->Count = 1;
+    Merge->Key = Entry->Key;
+}
+
+/* room left in the merge, in blocks */
+static inline
+UINT32 SpdMergeRoom(SPD_MERGE *Merge)
+{
+    return Merge->MaxBlockCount > Merge->BlockCount ?
+        Merge->MaxBlockCount - Merge->BlockCount : 0;
+}
+
+/* add a request if it is adjacent to the merge at either end; FALSE if it is not */
+static inline
+BOOLEAN SpdMergeAdd(SPD_MERGE *Merge, SPD_MERGE_ENTRY *Entry)
+{
+    SPD_MERGE_ENTRY *Last;
+
+    if (0 == Entry->Key || Merge->Key != Entry->Key ||
+        0 == Entry->BlockCount || SpdMergeRoom(Merge) < Entry->BlockCount)
+        return FALSE;
+
+    if (Merge->BlockAddress + Merge->BlockCount == Entry->BlockAddress)
+    {
+        for (Last = Merge->First; 0 != Last->Next; Last = Last->Next)
+            ;
+        Entry->Next = 0;
+        Last->Next = Entry;
+    }
+    else if (Entry->BlockAddress + Entry->BlockCount == Merge->BlockAddress)
+    {
+        Entry->Next = Merge->First;
+        Merge->First = Entry;
+        Merge->BlockAddress = Entry->BlockAddress;
+    }
+    else
+        return FALSE;
+
+    Merge->BlockCount += Entry->BlockCount;
+    Merge->Count++;
+    return TRUE;
+}
+
+/* remove a member; the merged range is unchanged */
+static inline
+VOID SpdMergeRemove(SPD_MERGE *Merge, SPD_MERGE_ENTRY *Entry)
+{
+    for (SPD_MERGE_ENTRY **P = &Merge->First; 0 != *P; P = &(*P)->Next)
+        if (*P == Entry)
+        {
+            *P = Entry->Next;
+            Entry->Next = 0;
+            Merge->Count--;
+            break;
+        }
+}
+
+/* byte offset of the data of a member in the data of the merged request */
+static inline
+ULONG SpdMergeOffset(SPD_MERGE *Merge, SPD_MERGE_ENTRY *Entry, ULONG BlockLength)
+{
+    return (ULONG)(Entry->BlockAddress - Merge->BlockAddress) * BlockLength;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
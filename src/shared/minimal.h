@@ -194,7 +194,8 @@ static inline VOID SpdOverlappedFini(OVERLAPPED *Overlapped)
 static inline DWORD SpdOverlappedWaitResult(BOOL Success,
     HANDLE Handle, OVERLAPPED *Overlapped, PDWORD PBytesTransferred)
 {
-    if (!Success && ERROR_IO_PENDING != GetLastError())
+    /* ERROR_MORE_DATA: a partial message read; the byte count is in Overlapped */
+    if (!Success && ERROR_IO_PENDING != GetLastError() && ERROR_MORE_DATA != GetLastError())
         return GetLastError();
     if (!GetOverlappedResult(Handle, Overlapped, PBytesTransferred, TRUE))
         return GetLastError();
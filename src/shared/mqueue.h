@@ -0,0 +1,405 @@
+/**
+ * @file shared/mqueue.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_MQUEUE_H_INCLUDED
+#define WINSPD_SHARED_MQUEUE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Multi-queues
+ *
+ * A multi-queue spreads the requests of a storage unit over QueueCount queues, each
+ * with its own lock, pending list and processing table. A request belongs to the queue
+ * that its entry address hashes to from the time it is posted until it is done: it is
+ * pending and then processing in that queue only. So every operation on a request
+ * takes exactly one queue lock, and a response finds its request from the hint (the
+ * entry address, which is not trusted) by hashing it the same way.
+ *
+ * Consumers have a home queue (e.g. by processor) and take pending requests from it
+ * first; when it runs dry they steal from the other queues. PendingCount is the total
+ * number of pending requests and tells a consumer whether to wake another one.
+ *
+ * Which pending request of a queue goes next is up to the scheduler, and the rate at
+ * which requests are taken may be limited; see shared/iosched.h, which must be included
+ * first. The poster sets the Class and Length of a request; a request posted at the head
+ * (the next chunk of an SRB) keeps its place and deadline.
+ *
+ * Queue locks are SRWLOCK's by default. The kernel defines SPD_MQ_LOCK and friends to
+ * spin locks (acquired at DISPATCH_LEVEL) before including this file. SchedLock is taken
+ * under a queue lock. A consumer that holds a queue lock may try (but not wait) to lock
+ * another one, e.g. to look for requests to merge with the one it took.
+ */
+
+#if !defined(SPD_MQ_LOCK)
+#define SPD_MQ_LOCK                     SRWLOCK
+#define SpdMqLockInitialize(L)          InitializeSRWLock(L)
+#define SpdMqLockAcquire(L)             AcquireSRWLockExclusive(L)
+#define SpdMqLockTryAcquire(L)          TryAcquireSRWLockExclusive(L)
+#define SpdMqLockRelease(L)             ReleaseSRWLockExclusive(L)
+#endif
+
+typedef struct _SPD_MQ_ENTRY
+{
+    struct _SPD_MQ_ENTRY *Flink, *Blink;
+    struct _SPD_MQ_ENTRY *HashNext;
+    UINT64 Deadline;
+    ULONG Length;                       /* bytes that the request transfers */
+    UINT8 Class;                        /* SpdIoSched*Class */
+} SPD_MQ_ENTRY;
+typedef struct DECLSPEC_CACHEALIGN _SPD_MQ_QUEUE
+{
+    SPD_MQ_LOCK Lock;
+    volatile LONG PendingCount;         /* read without the lock by stealers */
+    ULONG UrgentRun;                    /* urgent requests taken while bulk ones waited */
+    SPD_MQ_ENTRY PendingLists[SpdIoSchedClassCount], ProcessList;
+    SPD_MQ_ENTRY **ProcessBuckets;
+    ULONG ProcessBucketCount;
+} SPD_MQ_QUEUE;
+typedef struct
+{
+    volatile LONG PendingCount;
+    ULONG QueueCount;
+    SPD_MQ_QUEUE *Queues;
+    SPD_MQ_LOCK SchedLock;              /* protects the Sched token bucket */
+    SPD_IOSCHED Sched;
+} SPD_MQ;
+
+/* lists: like the NT LIST_ENTRY functions, which are not available everywhere */
+static inline
+VOID SpdMqListInitialize(SPD_MQ_ENTRY *Head)
+{
+    Head->Flink = Head->Blink = Head;
+}
+
+static inline
+BOOLEAN SpdMqListIsEmpty(SPD_MQ_ENTRY *Head)
+{
+    return Head->Flink == Head;
+}
+
+static inline
+VOID SpdMqListInsertTail(SPD_MQ_ENTRY *Head, SPD_MQ_ENTRY *Entry)
+{
+    Entry->Flink = Head;
+    Entry->Blink = Head->Blink;
+    Head->Blink->Flink = Entry;
+    Head->Blink = Entry;
+}
+
+static inline
+VOID SpdMqListInsertHead(SPD_MQ_ENTRY *Head, SPD_MQ_ENTRY *Entry)
+{
+    Entry->Flink = Head->Flink;
+    Entry->Blink = Head;
+    Head->Flink->Blink = Entry;
+    Head->Flink = Entry;
+}
+
+static inline
+VOID SpdMqListRemove(SPD_MQ_ENTRY *Entry)
+{
+    Entry->Blink->Flink = Entry->Flink;
+    Entry->Flink->Blink = Entry->Blink;
+    Entry->Flink = Entry->Blink = 0;
+}
+
+static inline
+ULONG SpdMqHash(UINT64 Key)
+{
+    Key ^= Key >> 33;
+    Key *= 0xff51afd7ed558ccdULL;
+    Key ^= Key >> 33;
+    Key *= 0xc4ceb9fe1a85ec53ULL;
+    Key ^= Key >> 33;
+    return (ULONG)Key;
+}
+
+/*
+ * Initialize a multi-queue over QueueCount queues, each with BucketCount processing
+ * buckets taken from Buckets (QueueCount * BucketCount pointers). The caller provides
+ * the memory, so that the kernel can allocate it nonpaged.
+ */
+static inline
+VOID SpdMqInitialize(SPD_MQ *Mq,
+    SPD_MQ_QUEUE *Queues, ULONG QueueCount,
+    SPD_MQ_ENTRY **Buckets, ULONG BucketCount)
+{
+    Mq->PendingCount = 0;
+    Mq->QueueCount = QueueCount;
+    Mq->Queues = Queues;
+    SpdMqLockInitialize(&Mq->SchedLock);
+    SpdIoSchedInitialize(&Mq->Sched, SpdIoctlSchedFifoPolicy, 0, 0, 0);
+    for (ULONG I = 0; QueueCount > I; I++)
+    {
+        SPD_MQ_QUEUE *Queue = &Queues[I];
+
+        SpdMqLockInitialize(&Queue->Lock);
+        Queue->PendingCount = 0;
+        Queue->UrgentRun = 0;
+        for (ULONG J = 0; SpdIoSchedClassCount > J; J++)
+            SpdMqListInitialize(&Queue->PendingLists[J]);
+        SpdMqListInitialize(&Queue->ProcessList);
+        Queue->ProcessBuckets = Buckets + I * BucketCount;
+        Queue->ProcessBucketCount = BucketCount;
+        memset(Queue->ProcessBuckets, 0, BucketCount * sizeof Buckets[0]);
+    }
+}
+
+/* set the scheduling policy and rate limits; before any request is posted */
+static inline
+VOID SpdMqSetScheduler(SPD_MQ *Mq, UINT8 Policy, UINT32 MaxIops, UINT64 MaxBandwidth)
+{
+    SpdIoSchedInitialize(&Mq->Sched, Policy, MaxIops, MaxBandwidth, SpdIoSchedNow());
+}
+
+/*
+ * Queue of a request given its entry address or hint. The low bits of the hash pick
+ * the queue and the high bits the processing bucket, so that the buckets of a queue
+ * are evenly used.
+ */
+static inline
+SPD_MQ_QUEUE *SpdMqQueue(SPD_MQ *Mq, UINT64 Key)
+{
+    return &Mq->Queues[SpdMqHash(Key) % Mq->QueueCount];
+}
+
+static inline
+SPD_MQ_ENTRY **SpdMqBucket(SPD_MQ *Mq, SPD_MQ_QUEUE *Queue, UINT64 Key)
+{
+    return &Queue->ProcessBuckets[
+        SpdMqHash(Key) / Mq->QueueCount % Queue->ProcessBucketCount];
+}
+
+/* post a request to its queue, at the head to have it taken next; queue locked */
+static inline
+VOID SpdMqPostNoLock(SPD_MQ *Mq, SPD_MQ_QUEUE *Queue, SPD_MQ_ENTRY *Entry, BOOLEAN Head)
+{
+    SPD_MQ_ENTRY *List = &Queue->PendingLists[
+        SpdIoctlSchedFifoPolicy != Mq->Sched.Policy ? Entry->Class : SpdIoSchedUrgentClass];
+
+    if (Head)
+        SpdMqListInsertHead(List, Entry);
+    else
+    {
+        if (SpdIoctlSchedDeadlinePolicy == Mq->Sched.Policy)
+            Entry->Deadline = SpdIoSchedDeadline(Entry->Class, SpdIoSchedNow());
+        SpdMqListInsertTail(List, Entry);
+    }
+    InterlockedIncrement(&Queue->PendingCount);
+    InterlockedIncrement(&Mq->PendingCount);
+}
+
+/* the pending request of a queue that the policy picks next; 0 if none; queue locked */
+static inline
+SPD_MQ_ENTRY *SpdMqPickNoLock(SPD_MQ *Mq, SPD_MQ_QUEUE *Queue)
+{
+    SPD_MQ_ENTRY *Urgent = 0, *Bulk = 0;
+
+    if (!SpdMqListIsEmpty(&Queue->PendingLists[SpdIoSchedUrgentClass]))
+        Urgent = Queue->PendingLists[SpdIoSchedUrgentClass].Flink;
+    if (!SpdMqListIsEmpty(&Queue->PendingLists[SpdIoSchedBulkClass]))
+        Bulk = Queue->PendingLists[SpdIoSchedBulkClass].Flink;
+    if (0 == Urgent || 0 == Bulk)
+        return 0 != Urgent ? Urgent : Bulk;
+
+    switch (Mq->Sched.Policy)
+    {
+    case SpdIoctlSchedPriorityPolicy:
+        return SPD_IOSCHED_STARVE_MAX > Queue->UrgentRun ? Urgent : Bulk;
+    case SpdIoctlSchedDeadlinePolicy:
+        /* compare so that wrapping works; ties go to the urgent request */
+        return 0 > (INT64)(Bulk->Deadline - Urgent->Deadline) ? Bulk : Urgent;
+    default:
+        return Urgent;
+    }
+}
+
+/*
+ * Take the next pending request: from the Home queue if it has any, else from the
+ * first other queue that does. On success the request's queue is returned locked in
+ * *PQueue, so that the caller can process the request before anyone else sees it.
+ *
+ * If the rate limit holds the request back, 0 is returned although requests are
+ * pending; SpdMqThrottleDelay tells the caller when to try again.
+ */
+static inline
+SPD_MQ_ENTRY *SpdMqTake(SPD_MQ *Mq, ULONG Home, SPD_MQ_QUEUE **PQueue)
+{
+    SPD_MQ_QUEUE *Queue;
+    SPD_MQ_ENTRY *Entry;
+    BOOLEAN Admitted;
+
+    for (ULONG I = 0; Mq->QueueCount > I; I++)
+    {
+        Queue = &Mq->Queues[(Home + I) % Mq->QueueCount];
+
+        /* do not bother with the lock of an empty queue */
+        if (0 == Queue->PendingCount)
+            continue;
+
+        SpdMqLockAcquire(&Queue->Lock);
+        Entry = SpdMqPickNoLock(Mq, Queue);
+        if (0 != Entry)
+        {
+            if (SpdIoSchedLimited(&Mq->Sched))
+            {
+                /* the limit is for the whole multi-queue: do not try the other queues */
+                SpdMqLockAcquire(&Mq->SchedLock);
+                Admitted = SpdIoSchedAdmit(&Mq->Sched, Entry->Length, SpdIoSchedNow());
+                SpdMqLockRelease(&Mq->SchedLock);
+                if (!Admitted)
+                {
+                    SpdMqLockRelease(&Queue->Lock);
+                    break;
+                }
+            }
+
+            if (SpdIoSchedUrgentClass == Entry->Class &&
+                !SpdMqListIsEmpty(&Queue->PendingLists[SpdIoSchedBulkClass]))
+                Queue->UrgentRun++;
+            else
+                Queue->UrgentRun = 0;
+
+            SpdMqListRemove(Entry);
+            InterlockedDecrement(&Queue->PendingCount);
+            InterlockedDecrement(&Mq->PendingCount);
+            *PQueue = Queue;
+            return Entry;
+        }
+        SpdMqLockRelease(&Queue->Lock);
+    }
+
+    *PQueue = 0;
+    return 0;
+}
+
+/* time until a request held back by the rate limit may be taken; 0 if none is */
+static inline
+UINT64 SpdMqThrottleDelay(SPD_MQ *Mq)
+{
+    UINT64 Delay;
+
+    if (!SpdIoSchedLimited(&Mq->Sched))
+        return 0;
+
+    SpdMqLockAcquire(&Mq->SchedLock);
+    Delay = SpdIoSchedDelay(&Mq->Sched, SpdIoSchedNow());
+    SpdMqLockRelease(&Mq->SchedLock);
+
+    return Delay;
+}
+
+/* charge the rate limit for Length more bytes of a taken request (e.g. merged ones) */
+static inline
+VOID SpdMqCharge(SPD_MQ *Mq, ULONG Length)
+{
+    if (!SpdIoSchedLimited(&Mq->Sched))
+        return;
+
+    SpdMqLockAcquire(&Mq->SchedLock);
+    SpdIoSchedCharge(&Mq->Sched, Length);
+    SpdMqLockRelease(&Mq->SchedLock);
+}
+
+/* add a request to the processing table of its queue; queue locked */
+static inline
+VOID SpdMqProcessInsertNoLock(SPD_MQ *Mq, SPD_MQ_QUEUE *Queue, SPD_MQ_ENTRY *Entry)
+{
+    SPD_MQ_ENTRY **Bucket = SpdMqBucket(Mq, Queue, (UINT64)(UINT_PTR)Entry);
+
+    SpdMqListInsertTail(&Queue->ProcessList, Entry);
+    Entry->HashNext = *Bucket;
+    *Bucket = Entry;
+}
+
+/*
+ * Remove a processing request given its hint. The hint is compared against the
+ * requests in the table and is never dereferenced. Returns 0 if there is no such
+ * request; queue locked.
+ */
+static inline
+SPD_MQ_ENTRY *SpdMqProcessRemoveNoLock(SPD_MQ *Mq, SPD_MQ_QUEUE *Queue, UINT64 Hint)
+{
+    SPD_MQ_ENTRY *Entry;
+
+    for (SPD_MQ_ENTRY **P = SpdMqBucket(Mq, Queue, Hint); 0 != (Entry = *P); P = &Entry->HashNext)
+        if ((UINT64)(UINT_PTR)Entry == Hint)
+        {
+            *P = Entry->HashNext;
+            Entry->HashNext = 0;
+            SpdMqListRemove(Entry);
+            return Entry;
+        }
+
+    return 0;
+}
+
+/* remove a request from its queue, whether pending or processing; queue locked */
+static inline
+VOID SpdMqRemoveNoLock(SPD_MQ *Mq, SPD_MQ_QUEUE *Queue, SPD_MQ_ENTRY *Entry)
+{
+    if (Entry != SpdMqProcessRemoveNoLock(Mq, Queue, (UINT64)(UINT_PTR)Entry))
+    {
+        SpdMqListRemove(Entry);
+        InterlockedDecrement(&Queue->PendingCount);
+        InterlockedDecrement(&Mq->PendingCount);
+    }
+}
+
+/*
+ * Empty a queue: move its pending requests and then its processing requests to the
+ * tail of List, which the caller then completes; queue locked.
+ */
+static inline
+VOID SpdMqResetNoLock(SPD_MQ *Mq, SPD_MQ_QUEUE *Queue, SPD_MQ_ENTRY *List)
+{
+    SPD_MQ_ENTRY *Entry;
+
+    for (ULONG I = 0; SpdIoSchedClassCount > I; I++)
+        while (!SpdMqListIsEmpty(&Queue->PendingLists[I]))
+        {
+            Entry = Queue->PendingLists[I].Flink;
+            SpdMqListRemove(Entry);
+            SpdMqListInsertTail(List, Entry);
+        }
+    InterlockedExchangeAdd(&Mq->PendingCount, -Queue->PendingCount);
+    Queue->PendingCount = 0;
+    Queue->UrgentRun = 0;
+
+    while (!SpdMqListIsEmpty(&Queue->ProcessList))
+    {
+        Entry = Queue->ProcessList.Flink;
+        Entry->HashNext = 0;
+        SpdMqListRemove(Entry);
+        SpdMqListInsertTail(List, Entry);
+    }
+    memset(Queue->ProcessBuckets, 0,
+        Queue->ProcessBucketCount * sizeof Queue->ProcessBuckets[0]);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,434 @@
+/**
+ * @file shared/posix.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_POSIX_H_INCLUDED
+#define WINSPD_SHARED_POSIX_H_INCLUDED
+
+/*
+ * POSIX compatibility
+ *
+ * The shared headers that do not talk to the driver (queues, maps, pools, rings, framing)
+ * are written against a handful of Windows types and primitives. This header maps those
+ * onto C11 atomics and pthreads, so that the headers and their tests also build on POSIX
+ * systems (see tst/winspd-tests/Makefile). It is not meant to be complete: it provides
+ * what these headers and their tests use and nothing else. On Windows it is empty.
+ */
+
+#if !defined(_WIN32)
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* types */
+typedef void VOID;
+typedef void *PVOID;
+typedef const void *LPCVOID;
+typedef char CHAR;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef unsigned char BOOLEAN, *PBOOLEAN;
+typedef int BOOL;
+typedef int INT;
+typedef unsigned int UINT;
+typedef int8_t INT8;
+typedef uint8_t UINT8, *PUINT8;
+typedef int16_t INT16, SHORT;
+typedef uint16_t UINT16, USHORT, WORD;
+typedef int32_t INT32, LONG, *PLONG;
+typedef uint32_t UINT32, *PUINT32, ULONG, *PULONG, DWORD;
+typedef int64_t INT64, LONG64, LONGLONG;
+typedef uint64_t UINT64, *PUINT64, ULONG64, ULONGLONG;
+typedef intptr_t INT_PTR, LONG_PTR;
+typedef uintptr_t UINT_PTR, ULONG_PTR, DWORD_PTR;
+typedef size_t SIZE_T;
+typedef wchar_t WCHAR, *PWSTR;
+typedef const wchar_t *PCWSTR;
+typedef void *HANDLE, **PHANDLE;
+typedef struct { uint32_t Data1; uint16_t Data2, Data3; uint8_t Data4[8]; } GUID;
+#define TRUE                            1
+#define FALSE                           0
+#define INFINITE                        0xffffffff
+#define MAXULONG                        0xffffffff
+#define ERROR_SUCCESS                   0
+#define ERROR_INVALID_PARAMETER         87
+#define ERROR_NOT_ENOUGH_MEMORY         8
+#define ERROR_NO_SYSTEM_RESOURCES       1450
+#define ERROR_NOT_SUPPORTED             50
+#define ERROR_IO_DEVICE                 1117
+#define ERROR_OPERATION_ABORTED         995
+#define ERROR_BROKEN_PIPE               109
+#define ERROR_BAD_NETPATH               53
+#define ERROR_INVALID_DATA              13
+#define WAIT_OBJECT_0                   0
+#define WAIT_TIMEOUT                    258
+#define SCSISTAT_GOOD                   0x00
+#define SCSISTAT_CHECK_CONDITION        0x02
+
+#define FIELD_OFFSET(T, F)              ((LONG)offsetof(T, F))
+#define CONTAINING_RECORD(P, T, F)      ((T *)((char *)(P) - offsetof(T, F)))
+#define ARRAYSIZE(A)                    (sizeof(A) / sizeof((A)[0]))
+#define UNREFERENCED_PARAMETER(P)       ((void)(P))
+#define DECLSPEC_ALIGN(N)               __attribute__((aligned(N)))
+#define DECLSPEC_CACHEALIGN             DECLSPEC_ALIGN(64)
+#define FORCEINLINE                     static inline __attribute__((always_inline))
+#define __stdcall
+#define WINAPI
+#define static_assert                   _Static_assert
+
+/*
+ * Interlocked operations. These use the compiler's C11 atomic builtins, which work on
+ * plain (volatile) objects as the Windows primitives do; all are full barriers.
+ */
+#define SPD_POSIX_SEQ_CST               __ATOMIC_SEQ_CST
+#define MemoryBarrier()                 atomic_thread_fence(memory_order_seq_cst)
+#define YieldProcessor()                ((void)0)
+#define SwitchToThread()                sched_yield()
+#define InterlockedIncrement(P)         __atomic_add_fetch(P, 1, SPD_POSIX_SEQ_CST)
+#define InterlockedDecrement(P)         __atomic_sub_fetch(P, 1, SPD_POSIX_SEQ_CST)
+#define InterlockedIncrement64(P)       InterlockedIncrement(P)
+#define InterlockedDecrement64(P)       InterlockedDecrement(P)
+#define InterlockedAdd(P, V)            __atomic_add_fetch(P, V, SPD_POSIX_SEQ_CST)
+#define InterlockedAdd64(P, V)          InterlockedAdd(P, V)
+#define InterlockedExchangeAdd(P, V)    __atomic_fetch_add(P, V, SPD_POSIX_SEQ_CST)
+#define InterlockedExchangeAdd64(P, V)  InterlockedExchangeAdd(P, V)
+#define InterlockedOr(P, V)             __atomic_fetch_or(P, V, SPD_POSIX_SEQ_CST)
+#define InterlockedAnd(P, V)            __atomic_fetch_and(P, V, SPD_POSIX_SEQ_CST)
+#define InterlockedExchange(P, V)       \
+    __extension__ ({ __typeof__(*(P)) SpdPosixOld = __atomic_exchange_n(P, V, SPD_POSIX_SEQ_CST);\
+        SpdPosixOld; })
+#define InterlockedExchange64(P, V)     InterlockedExchange(P, V)
+#define InterlockedExchangePointer(P, V)\
+    InterlockedExchange(P, V)
+#define InterlockedCompareExchange(P, V, C)\
+    __sync_val_compare_and_swap(P, C, V)
+#define InterlockedCompareExchange64(P, V, C)\
+    InterlockedCompareExchange(P, V, C)
+#define InterlockedCompareExchangePointer(P, V, C)\
+    InterlockedCompareExchange(P, V, C)
+
+/* bit scans */
+static inline BOOLEAN _BitScanForward(ULONG *Index, ULONG Mask)
+{
+    if (0 == Mask)
+        return FALSE;
+    *Index = (ULONG)__builtin_ctz(Mask);
+    return TRUE;
+}
+static inline BOOLEAN _BitScanReverse(ULONG *Index, ULONG Mask)
+{
+    if (0 == Mask)
+        return FALSE;
+    *Index = 31 - (ULONG)__builtin_clz(Mask);
+    return TRUE;
+}
+static inline BOOLEAN _BitScanForward64(ULONG *Index, UINT64 Mask)
+{
+    if (0 == Mask)
+        return FALSE;
+    *Index = (ULONG)__builtin_ctzll(Mask);
+    return TRUE;
+}
+static inline BOOLEAN _BitScanReverse64(ULONG *Index, UINT64 Mask)
+{
+    if (0 == Mask)
+        return FALSE;
+    *Index = 63 - (ULONG)__builtin_clzll(Mask);
+    return TRUE;
+}
+
+/*
+ * Interlocked singly linked lists. These are lock-free on Windows; here a mutex protects
+ * them, which needs no double width compare-and-swap and is good enough for tests.
+ */
+typedef struct _SLIST_ENTRY
+{
+    struct _SLIST_ENTRY *Next;
+} SLIST_ENTRY, *PSLIST_ENTRY;
+typedef struct
+{
+    pthread_mutex_t Mutex;
+    PSLIST_ENTRY Next;
+    USHORT Depth;
+} SLIST_HEADER, *PSLIST_HEADER;
+static inline VOID InitializeSListHead(PSLIST_HEADER Head)
+{
+    pthread_mutex_init(&Head->Mutex, 0);
+    Head->Next = 0;
+    Head->Depth = 0;
+}
+static inline PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER Head, PSLIST_ENTRY Entry)
+{
+    PSLIST_ENTRY Next;
+    pthread_mutex_lock(&Head->Mutex);
+    Next = Entry->Next = Head->Next;
+    Head->Next = Entry;
+    Head->Depth++;
+    pthread_mutex_unlock(&Head->Mutex);
+    return Next;
+}
+static inline PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER Head)
+{
+    PSLIST_ENTRY Entry;
+    pthread_mutex_lock(&Head->Mutex);
+    Entry = Head->Next;
+    if (0 != Entry)
+    {
+        Head->Next = Entry->Next;
+        Head->Depth--;
+    }
+    pthread_mutex_unlock(&Head->Mutex);
+    return Entry;
+}
+static inline PSLIST_ENTRY InterlockedFlushSList(PSLIST_HEADER Head)
+{
+    PSLIST_ENTRY Entry;
+    pthread_mutex_lock(&Head->Mutex);
+    Entry = Head->Next;
+    Head->Next = 0;
+    Head->Depth = 0;
+    pthread_mutex_unlock(&Head->Mutex);
+    return Entry;
+}
+static inline USHORT QueryDepthSList(PSLIST_HEADER Head)
+{
+    USHORT Depth;
+    pthread_mutex_lock(&Head->Mutex);
+    Depth = Head->Depth;
+    pthread_mutex_unlock(&Head->Mutex);
+    return Depth;
+}
+
+/* heap */
+#define HEAP_ZERO_MEMORY                0x00000008
+#define GetProcessHeap()                ((HANDLE)1)
+static inline PVOID HeapAlloc(HANDLE Heap, DWORD Flags, SIZE_T Size)
+{
+    /* Windows heap blocks are 16-byte aligned on x64; SLIST_ENTRY's need it */
+    PVOID P = aligned_alloc(16, (Size + 15) & ~(SIZE_T)15);
+    if (0 != P && (Flags & HEAP_ZERO_MEMORY))
+        memset(P, 0, Size);
+    return P;
+}
+static inline BOOL HeapFree(HANDLE Heap, DWORD Flags, PVOID P)
+{
+    free(P);
+    return TRUE;
+}
+#define MEMORY_ALLOCATION_ALIGNMENT     16
+#define _aligned_malloc(Size, Alignment)\
+    aligned_alloc(Alignment, ((Size) + (Alignment) - 1) & ~(SIZE_T)((Alignment) - 1))
+#define _aligned_free(P)                free(P)
+#define MemAlloc(Size)                  HeapAlloc(GetProcessHeap(), 0, Size)
+#define MemFree(P)                      ((void)(0 != (P) && HeapFree(GetProcessHeap(), 0, P)))
+
+/* slim reader/writer locks */
+typedef pthread_rwlock_t SRWLOCK, *PSRWLOCK;
+#define SRWLOCK_INIT                    PTHREAD_RWLOCK_INITIALIZER
+#define InitializeSRWLock(L)            pthread_rwlock_init(L, 0)
+#define AcquireSRWLockExclusive(L)      pthread_rwlock_wrlock(L)
+#define ReleaseSRWLockExclusive(L)      pthread_rwlock_unlock(L)
+#define AcquireSRWLockShared(L)         pthread_rwlock_rdlock(L)
+#define ReleaseSRWLockShared(L)         pthread_rwlock_unlock(L)
+#define TryAcquireSRWLockExclusive(L)   (0 == pthread_rwlock_trywrlock(L))
+
+/* time */
+typedef union
+{
+    struct
+    {
+        DWORD LowPart;
+        LONG HighPart;
+    } u;
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+static inline BOOL QueryPerformanceFrequency(LARGE_INTEGER *Frequency)
+{
+    Frequency->QuadPart = 1000000000;
+    return TRUE;
+}
+static inline BOOL QueryPerformanceCounter(LARGE_INTEGER *Counter)
+{
+    struct timespec Time;
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    Counter->QuadPart = (LONGLONG)Time.tv_sec * 1000000000 + Time.tv_nsec;
+    return TRUE;
+}
+static inline ULONGLONG GetTickCount64(VOID)
+{
+    struct timespec Time;
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (ULONGLONG)Time.tv_sec * 1000 + (ULONGLONG)Time.tv_nsec / 1000000;
+}
+#define GetTickCount()                  ((DWORD)GetTickCount64())
+#define Sleep(Milliseconds)             usleep((useconds_t)(Milliseconds) * 1000)
+
+/*
+ * Waitable handles: events and threads. A thread handle is a manual-reset event that is
+ * set when the thread exits. Handles are reference counted, so that a thread handle may
+ * be closed before the thread exits.
+ */
+typedef struct
+{
+    pthread_mutex_t Mutex;
+    pthread_cond_t Cond;
+    LONG RefCount;
+    BOOLEAN ManualReset;
+    BOOLEAN Signaled;
+    unsigned (__stdcall *Function)(void *);
+    void *Data;
+    DWORD ExitCode;
+} SPD_POSIX_HANDLE;
+static inline SPD_POSIX_HANDLE *SpdPosixHandleCreate(BOOLEAN ManualReset, BOOLEAN Signaled,
+    LONG RefCount)
+{
+    SPD_POSIX_HANDLE *Handle = calloc(1, sizeof *Handle);
+    if (0 == Handle)
+        return 0;
+    pthread_mutex_init(&Handle->Mutex, 0);
+    pthread_cond_init(&Handle->Cond, 0);
+    Handle->RefCount = RefCount;
+    Handle->ManualReset = ManualReset;
+    Handle->Signaled = Signaled;
+    return Handle;
+}
+static inline VOID SpdPosixHandleDereference(SPD_POSIX_HANDLE *Handle)
+{
+    if (0 == __atomic_sub_fetch(&Handle->RefCount, 1, __ATOMIC_SEQ_CST))
+    {
+        pthread_cond_destroy(&Handle->Cond);
+        pthread_mutex_destroy(&Handle->Mutex);
+        free(Handle);
+    }
+}
+static inline HANDLE CreateEventW(PVOID Security, BOOL ManualReset, BOOL InitialState,
+    PCWSTR Name)
+{
+    return SpdPosixHandleCreate(!!ManualReset, !!InitialState, 1);
+}
+static inline BOOL SetEvent(HANDLE Handle0)
+{
+    SPD_POSIX_HANDLE *Handle = Handle0;
+    pthread_mutex_lock(&Handle->Mutex);
+    Handle->Signaled = TRUE;
+    if (Handle->ManualReset)
+        pthread_cond_broadcast(&Handle->Cond);
+    else
+        pthread_cond_signal(&Handle->Cond);
+    pthread_mutex_unlock(&Handle->Mutex);
+    return TRUE;
+}
+static inline BOOL ResetEvent(HANDLE Handle0)
+{
+    SPD_POSIX_HANDLE *Handle = Handle0;
+    pthread_mutex_lock(&Handle->Mutex);
+    Handle->Signaled = FALSE;
+    pthread_mutex_unlock(&Handle->Mutex);
+    return TRUE;
+}
+static inline DWORD WaitForSingleObject(HANDLE Handle0, DWORD Milliseconds)
+{
+    SPD_POSIX_HANDLE *Handle = Handle0;
+    struct timespec Deadline;
+    DWORD Result = WAIT_OBJECT_0;
+    if (INFINITE != Milliseconds)
+    {
+        clock_gettime(CLOCK_REALTIME, &Deadline);
+        Deadline.tv_sec += Milliseconds / 1000;
+        Deadline.tv_nsec += (long)(Milliseconds % 1000) * 1000000;
+        if (1000000000 <= Deadline.tv_nsec)
+        {
+            Deadline.tv_sec++;
+            Deadline.tv_nsec -= 1000000000;
+        }
+    }
+    pthread_mutex_lock(&Handle->Mutex);
+    while (!Handle->Signaled)
+    {
+        if (INFINITE == Milliseconds)
+            pthread_cond_wait(&Handle->Cond, &Handle->Mutex);
+        else if (ETIMEDOUT == pthread_cond_timedwait(&Handle->Cond, &Handle->Mutex, &Deadline))
+        {
+            Result = WAIT_TIMEOUT;
+            break;
+        }
+    }
+    if (WAIT_OBJECT_0 == Result && !Handle->ManualReset)
+        Handle->Signaled = FALSE;
+    pthread_mutex_unlock(&Handle->Mutex);
+    return Result;
+}
+static inline BOOL CloseHandle(HANDLE Handle)
+{
+    SpdPosixHandleDereference(Handle);
+    return TRUE;
+}
+static inline void *SpdPosixThreadStart(void *Handle0)
+{
+    SPD_POSIX_HANDLE *Handle = Handle0;
+    Handle->ExitCode = Handle->Function(Handle->Data);
+    SetEvent(Handle);
+    SpdPosixHandleDereference(Handle);
+    return 0;
+}
+static inline UINT_PTR _beginthreadex(void *Security, unsigned StackSize,
+    unsigned (__stdcall *Function)(void *), void *Data, unsigned Flags, unsigned *PThreadId)
+{
+    SPD_POSIX_HANDLE *Handle = SpdPosixHandleCreate(TRUE, FALSE, 2);
+    pthread_t Thread;
+    if (0 == Handle)
+        return 0;
+    Handle->Function = Function;
+    Handle->Data = Data;
+    if (0 != pthread_create(&Thread, 0, SpdPosixThreadStart, Handle))
+    {
+        SpdPosixHandleDereference(Handle);
+        SpdPosixHandleDereference(Handle);
+        return 0;
+    }
+    pthread_detach(Thread);
+    return (UINT_PTR)Handle;
+}
+static inline BOOL GetExitCodeThread(HANDLE Handle, DWORD *PExitCode)
+{
+    *PExitCode = ((SPD_POSIX_HANDLE *)Handle)->ExitCode;
+    return TRUE;
+}
+#define GetCurrentThreadId()            ((DWORD)(UINT_PTR)pthread_self())
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+/**
+ * @file shared/reqpool.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_REQPOOL_H_INCLUDED
+#define WINSPD_SHARED_REQPOOL_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Request pools
+ *
+ * A request pool holds a fixed number (Depth) of request entries. A dispatcher
+ * thread takes an entry before it asks the kernel for a request and the entry is
+ * returned when the request is completed, possibly much later and from another
+ * thread. Thus Depth bounds the number of requests in flight: when all entries
+ * are out, dispatcher threads block in SpdRequestPoolGet until one comes back.
+ *
+ * SpdRequestPoolStop releases all blocked (and future) getters, so that dispatcher
+ * threads can exit. SpdRequestPoolDrain waits until every entry has been returned,
+ * after which the entries may be freed.
+ */
+
+typedef struct _SPD_REQUEST_POOL_ENTRY
+{
+    struct _SPD_REQUEST_POOL_ENTRY *Next;
+} SPD_REQUEST_POOL_ENTRY;
+typedef struct
+{
+    SRWLOCK Lock;
+    CONDITION_VARIABLE FreeCondition, DrainCondition;
+    SPD_REQUEST_POOL_ENTRY *FreeList;
+    ULONG Depth, FreeCount;
+    BOOLEAN Stopped;
+} SPD_REQUEST_POOL;
+
+static inline
+VOID SpdRequestPoolInitialize(SPD_REQUEST_POOL *Pool)
+{
+    InitializeSRWLock(&Pool->Lock);
+    InitializeConditionVariable(&Pool->FreeCondition);
+    InitializeConditionVariable(&Pool->DrainCondition);
+    Pool->FreeList = 0;
+    Pool->Depth = 0;
+    Pool->FreeCount = 0;
+    Pool->Stopped = FALSE;
+}
+
+static inline
+VOID SpdRequestPoolAdd(SPD_REQUEST_POOL *Pool, SPD_REQUEST_POOL_ENTRY *Entry)
+{
+    /* only during initialization: no waiters yet */
+    Entry->Next = Pool->FreeList;
+    Pool->FreeList = Entry;
+    Pool->Depth++;
+    Pool->FreeCount++;
+}
+
+static inline
+SPD_REQUEST_POOL_ENTRY *SpdRequestPoolGet(SPD_REQUEST_POOL *Pool)
+{
+    SPD_REQUEST_POOL_ENTRY *Entry = 0;
+
+    AcquireSRWLockExclusive(&Pool->Lock);
+
+    while (0 == Pool->FreeList && !Pool->Stopped)
+        SleepConditionVariableSRW(&Pool->FreeCondition, &Pool->Lock, INFINITE, 0);
+
+    if (!Pool->Stopped)
+    {
+        Entry = Pool->FreeList;
+        Pool->FreeList = Entry->Next;
+        Pool->FreeCount--;
+    }
+
+    ReleaseSRWLockExclusive(&Pool->Lock);
+
+    return Entry;
+}
+
+static inline
+VOID SpdRequestPoolPut(SPD_REQUEST_POOL *Pool, SPD_REQUEST_POOL_ENTRY *Entry)
+{
+    BOOLEAN Drained;
+
+    AcquireSRWLockExclusive(&Pool->Lock);
+
+    Entry->Next = Pool->FreeList;
+    Pool->FreeList = Entry;
+    Pool->FreeCount++;
+    Drained = Pool->Depth == Pool->FreeCount;
+
+    ReleaseSRWLockExclusive(&Pool->Lock);
+
+    WakeConditionVariable(&Pool->FreeCondition);
+    if (Drained)
+        WakeAllConditionVariable(&Pool->DrainCondition);
+}
+
+static inline
+VOID SpdRequestPoolStop(SPD_REQUEST_POOL *Pool)
+{
+    AcquireSRWLockExclusive(&Pool->Lock);
+    Pool->Stopped = TRUE;
+    ReleaseSRWLockExclusive(&Pool->Lock);
+
+    WakeAllConditionVariable(&Pool->FreeCondition);
+}
+
+static inline
+VOID SpdRequestPoolDrain(SPD_REQUEST_POOL *Pool)
+{
+    AcquireSRWLockExclusive(&Pool->Lock);
+
+    while (Pool->Depth != Pool->FreeCount)
+        SleepConditionVariableSRW(&Pool->DrainCondition, &Pool->Lock, INFINITE, 0);
+
+    ReleaseSRWLockExclusive(&Pool->Lock);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
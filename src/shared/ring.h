@@ -0,0 +1,202 @@
+/**
+ * @file shared/ring.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_RING_H_INCLUDED
+#define WINSPD_SHARED_RING_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Shared memory rings
+ *
+ * A ring is a single producer, single consumer queue of fixed size entries that
+ * lives in memory shared between the driver and a storage unit process. The REQ
+ * ring is produced by the driver and consumed by the process; the RSP ring is
+ * produced by the process and consumed by the driver. Each side that has more
+ * than one thread must serialize its own access to a ring end.
+ *
+ * Only Head and Tail are shared. Each end keeps a private copy of the index that
+ * it owns (SPD_RING_PORT::Position) and never trusts the shared copy of it; the
+ * other index is only used as a hint, so a misbehaving peer cannot make us index
+ * outside the ring.
+ *
+ * Memory ordering:
+ *
+ * - The producer writes the entry, issues a barrier and then publishes Tail.
+ * - The consumer reads Tail, issues a barrier, reads the entry, issues a barrier
+ *   and then publishes Head.
+ * - Doorbell: after publishing Tail the producer issues a full barrier and reads
+ *   Head; if Head equals the position it just filled, the ring went from empty
+ *   to non-empty and the consumer must be notified. Before going to sleep the
+ *   consumer issues a full barrier after publishing Head and re-reads Tail
+ *   (SpdRingIsEmpty). This is the store-barrier-load pattern on both sides, so
+ *   at least one of them sees the other's store: either the consumer sees the
+ *   new entry or the producer rings the doorbell. Spurious doorbells are
+ *   possible and harmless.
+ */
+
+typedef struct
+{
+    volatile UINT32 Head;               /* written by consumer */
+    UINT32 Reserved0[15];
+    volatile UINT32 Tail;               /* written by producer */
+    UINT32 Reserved1[15];
+} SPD_RING;
+typedef struct
+{
+    SPD_RING *Ring;
+    PUINT8 Entries;
+    UINT32 Capacity;                    /* power of 2 */
+    UINT32 EntrySize;
+    UINT32 Position;                    /* private Tail (producer) or Head (consumer) */
+} SPD_RING_PORT;
+
+static inline
+VOID SpdRingInitialize(SPD_RING *Ring)
+{
+    Ring->Head = 0;
+    Ring->Tail = 0;
+    MemoryBarrier();
+}
+
+static inline
+VOID SpdRingPortInitialize(SPD_RING_PORT *Port,
+    SPD_RING *Ring, PVOID Entries, UINT32 Capacity, UINT32 EntrySize)
+{
+    Port->Ring = Ring;
+    Port->Entries = Entries;
+    Port->Capacity = Capacity;
+    Port->EntrySize = EntrySize;
+    Port->Position = 0;
+}
+
+static inline
+PVOID SpdRingReserve(SPD_RING_PORT *Port)
+{
+    UINT32 Position = Port->Position;
+    UINT32 Head = Port->Ring->Head;
+
+    if (Position - Head >= Port->Capacity)
+        return 0;
+
+    return Port->Entries + (Position & (Port->Capacity - 1)) * Port->EntrySize;
+}
+
+static inline
+VOID SpdRingCommit(SPD_RING_PORT *Port, PBOOLEAN PDoorbell)
+{
+    UINT32 Position = Port->Position;
+
+    /* entry must be visible before Tail */
+    MemoryBarrier();
+    Port->Ring->Tail = Port->Position = Position + 1;
+
+    /* Tail must be visible before we look at Head; see doorbell rule above */
+    MemoryBarrier();
+    if (Port->Ring->Head == Position)
+        *PDoorbell = TRUE;
+}
+
+static inline
+BOOLEAN SpdRingPush(SPD_RING_PORT *Port, const VOID *Entry, PBOOLEAN PDoorbell)
+{
+    PVOID Slot = SpdRingReserve(Port);
+
+    if (0 == Slot)
+        return FALSE;
+
+    memcpy(Slot, Entry, Port->EntrySize);
+    SpdRingCommit(Port, PDoorbell);
+
+    return TRUE;
+}
+
+static inline
+BOOLEAN SpdRingPop(SPD_RING_PORT *Port, PVOID Entry)
+{
+    UINT32 Position = Port->Position;
+    UINT32 Tail = Port->Ring->Tail;
+
+    if (Tail == Position || Tail - Position > Port->Capacity)
+        return FALSE;
+
+    /* Tail must be read before the entry */
+    MemoryBarrier();
+    memcpy(Entry,
+        Port->Entries + (Position & (Port->Capacity - 1)) * Port->EntrySize,
+        Port->EntrySize);
+
+    /* entry must be read before the producer may reuse it */
+    MemoryBarrier();
+    Port->Ring->Head = Port->Position = Position + 1;
+
+    return TRUE;
+}
+
+static inline
+BOOLEAN SpdRingIsEmpty(SPD_RING_PORT *Port)
+{
+    /* Head must be visible before we look at Tail; see doorbell rule above */
+    MemoryBarrier();
+    return Port->Ring->Tail == Port->Position;
+}
+
+/*
+ * Transact ring layout
+ *
+ * A single buffer holds the REQ ring, the RSP ring and Capacity data slots of
+ * DataStride bytes each. The data slots start on a page boundary.
+ */
+typedef struct
+{
+    UINT32 ReqRingOffset, ReqEntriesOffset;
+    UINT32 RspRingOffset, RspEntriesOffset;
+    UINT64 DataOffset;
+    UINT64 Size;
+} SPD_RING_LAYOUT;
+
+static inline
+VOID SpdRingGetLayout(UINT32 Capacity, UINT32 ReqEntrySize, UINT32 RspEntrySize,
+    UINT32 DataStride, SPD_RING_LAYOUT *Layout)
+{
+    UINT32 Offset = 0;
+
+    Layout->ReqRingOffset = Offset;
+    Offset += sizeof(SPD_RING);
+    Layout->ReqEntriesOffset = Offset;
+    Offset += Capacity * ReqEntrySize;
+    Offset = (Offset + sizeof(SPD_RING) - 1) & ~(UINT32)(sizeof(SPD_RING) - 1);
+    Layout->RspRingOffset = Offset;
+    Offset += sizeof(SPD_RING);
+    Layout->RspEntriesOffset = Offset;
+    Offset += Capacity * RspEntrySize;
+    Offset = (Offset + 4095) & ~4095;
+    Layout->DataOffset = Offset;
+    Layout->Size = Offset + (UINT64)Capacity * DataStride;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -130,12 +130,6 @@ DWORD SpdLaunchGetNameList(
  */
 PWSTR SpdDiagIdent(VOID);
 
-/*
- * MemAlign
- */
-DWORD SpdIoctlMemAlignAlloc(UINT32 Size, UINT32 AlignmentMask, PVOID *PP);
-VOID SpdIoctlMemAlignFree(PVOID P);
-
 /*
  * strtoint
  */
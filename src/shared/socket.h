@@ -0,0 +1,524 @@
+/**
+ * @file shared/socket.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_SOCKET_H_INCLUDED
+#define WINSPD_SHARED_SOCKET_H_INCLUDED
+
+#include <shared/frame.h>
+
+#if defined(_WIN32)
+/* winsock2.h and ws2tcpip.h must be included before windows.h */
+#include <afunix.h>
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Socket transport
+ *
+ * A storage unit may listen on a socket instead of a pipe; the name selects it:
+ *
+ *     tcp://Host:Port     (Host may be empty when listening, or [IPv6])
+ *     unix://Path
+ *
+ * A socket is a byte stream, so every message is a frame (see frame.h). When a client
+ * connects the unit sends a HELLO with its frame version followed by the storage unit
+ * parameters; the client answers with a HELLO that names the version to use.
+ *
+ * Frames are sent with a single vectored send of the header and the data, and they
+ * are received in two steps: first the header and message, then the data directly
+ * into the buffer where they belong. Thus data are never staged. TCP sockets disable
+ * Nagle so that small requests are not delayed; a sender that has several frames to
+ * send may cork the socket around them so that they go out in as few segments as
+ * possible.
+ *
+ * These functions use blocking sockets and are the same on Windows and POSIX.
+ */
+
+#if defined(_WIN32)
+typedef SOCKET SPD_SOCKET;
+#define SPD_SOCKET_INVALID              INVALID_SOCKET
+#define SpdSocketLastError()            ((DWORD)WSAGetLastError())
+#else
+typedef int SPD_SOCKET;
+#define SPD_SOCKET_INVALID              (-1)
+#define SpdSocketLastError()            ((DWORD)ERROR_IO_DEVICE)
+#endif
+
+#define SPD_SOCKET_BUF_MAX              4
+#define SPD_SOCKET_NAME_MAX             256
+#define SPD_SOCKET_FRAME_HEADER_SIZE    \
+    (sizeof(SPD_FRAME_HEADER) + sizeof(SPD_IOCTL_TRANSACT_RSP))
+
+typedef struct
+{
+    PVOID Buffer;
+    ULONG Length;
+} SPD_SOCKET_BUF;
+
+static inline
+DWORD SpdSocketStartup(VOID)
+{
+#if defined(_WIN32)
+    WSADATA WsaData;
+    return WSAStartup(MAKEWORD(2, 2), &WsaData);
+#else
+    return ERROR_SUCCESS;
+#endif
+}
+
+static inline
+VOID SpdSocketCleanup(VOID)
+{
+#if defined(_WIN32)
+    WSACleanup();
+#endif
+}
+
+static inline
+VOID SpdSocketClose(SPD_SOCKET Socket)
+{
+#if defined(_WIN32)
+    closesocket(Socket);
+#else
+    close(Socket);
+#endif
+}
+
+/*
+ * Shut a socket down without closing it, so that threads blocked on it return.
+ */
+static inline
+VOID SpdSocketShutdown(SPD_SOCKET Socket)
+{
+#if defined(_WIN32)
+    shutdown(Socket, SD_BOTH);
+#else
+    shutdown(Socket, SHUT_RDWR);
+#endif
+}
+
+/*
+ * Split a tcp:// or unix:// name into its parts. For TCP, Host and Port receive the
+ * host (without brackets) and port; for Unix sockets, Host receives the path.
+ */
+static inline
+BOOLEAN SpdSocketParseName(const char *Name, PBOOLEAN PUnix,
+    char Host[SPD_SOCKET_NAME_MAX], char Port[16])
+{
+    const char *P, *Colon = 0, *End;
+    ULONG Length;
+
+    if ('t' == Name[0] && 'c' == Name[1] && 'p' == Name[2] &&
+        ':' == Name[3] && '/' == Name[4] && '/' == Name[5])
+        *PUnix = FALSE;
+    else
+    if ('u' == Name[0] && 'n' == Name[1] && 'i' == Name[2] && 'x' == Name[3] &&
+        ':' == Name[4] && '/' == Name[5] && '/' == Name[6])
+        *PUnix = TRUE;
+    else
+        return FALSE;
+    P = Name + (*PUnix ? 7 : 6);
+
+    for (End = P; '\0' != *End; End++)
+        if (':' == *End)
+            Colon = End;
+
+    if (*PUnix)
+    {
+        Length = (ULONG)(End - P);
+        if (0 == Length || SPD_SOCKET_NAME_MAX <= Length)
+            return FALSE;
+        memcpy(Host, P, Length);
+        Host[Length] = '\0';
+        Port[0] = '\0';
+        return TRUE;
+    }
+
+    if (0 == Colon || 0 == End - (Colon + 1) || 16 <= End - (Colon + 1))
+        return FALSE;
+    for (const char *Q = Colon + 1; End > Q; Q++)
+        if ('0' > *Q || '9' < *Q)
+            return FALSE;
+    memcpy(Port, Colon + 1, End - (Colon + 1));
+    Port[End - (Colon + 1)] = '\0';
+
+    End = Colon;
+    if ('[' == *P)
+    {
+        if (2 > End - P || ']' != End[-1])
+            return FALSE;
+        P++;
+        End--;
+    }
+    Length = (ULONG)(End - P);
+    if (SPD_SOCKET_NAME_MAX <= Length)
+        return FALSE;
+    memcpy(Host, P, Length);
+    Host[Length] = '\0';
+
+    return TRUE;
+}
+
+/*
+ * Disable Nagle for TCP sockets. Storage requests are latency sensitive and every
+ * frame is sent with a single send, so there is nothing for Nagle to coalesce.
+ */
+static inline
+VOID SpdSocketTune(SPD_SOCKET Socket)
+{
+    int Value = 1;
+    setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, (PVOID)&Value, sizeof Value);
+}
+
+/*
+ * Hold back partial segments while several frames are sent; uncorking flushes them.
+ * Where corking is not available this does nothing and every frame goes out as is.
+ */
+static inline
+VOID SpdSocketCork(SPD_SOCKET Socket, BOOLEAN Cork)
+{
+#if defined(TCP_CORK)
+    int Value = Cork;
+    setsockopt(Socket, IPPROTO_TCP, TCP_CORK, (PVOID)&Value, sizeof Value);
+#else
+    (VOID)Socket;
+    (VOID)Cork;
+#endif
+}
+
+static inline
+DWORD SpdSocketOpen(const char *Name, BOOLEAN Listen, SPD_SOCKET *PSocket)
+{
+    SPD_SOCKET Socket = SPD_SOCKET_INVALID;
+    char Host[SPD_SOCKET_NAME_MAX], Port[16];
+    BOOLEAN Unix;
+    struct addrinfo Hints, *Info = 0;
+    struct sockaddr_un UnixAddress;
+    DWORD Error;
+
+    *PSocket = SPD_SOCKET_INVALID;
+
+    if (!SpdSocketParseName(Name, &Unix, Host, Port))
+        return ERROR_INVALID_PARAMETER;
+
+    if (Unix)
+    {
+        ULONG HostLength = 0;
+        while ('\0' != Host[HostLength])
+            HostLength++;
+        if (sizeof UnixAddress.sun_path <= HostLength)
+            return ERROR_INVALID_PARAMETER;
+        memset(&UnixAddress, 0, sizeof UnixAddress);
+        UnixAddress.sun_family = AF_UNIX;
+        memcpy(UnixAddress.sun_path, Host, HostLength + 1);
+
+        Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (SPD_SOCKET_INVALID == Socket)
+        {
+            Error = SpdSocketLastError();
+            goto exit;
+        }
+
+        if (Listen)
+        {
+            /* a stale socket file from a previous run would fail the bind */
+#if defined(_WIN32)
+            DeleteFileA(Host);
+#else
+            unlink(Host);
+#endif
+            if (0 != bind(Socket, (PVOID)&UnixAddress, sizeof UnixAddress))
+            {
+                Error = SpdSocketLastError();
+                goto exit;
+            }
+        }
+        else
+        {
+            if (0 != connect(Socket, (PVOID)&UnixAddress, sizeof UnixAddress))
+            {
+                Error = SpdSocketLastError();
+                goto exit;
+            }
+        }
+    }
+    else
+    {
+        memset(&Hints, 0, sizeof Hints);
+        Hints.ai_family = AF_UNSPEC;
+        Hints.ai_socktype = SOCK_STREAM;
+        Hints.ai_protocol = IPPROTO_TCP;
+        Hints.ai_flags = Listen ? AI_PASSIVE : 0;
+        if (0 != getaddrinfo('\0' != Host[0] ? Host : 0, Port, &Hints, &Info))
+        {
+            Error = ERROR_BAD_NETPATH;
+            goto exit;
+        }
+
+        Socket = socket(Info->ai_family, Info->ai_socktype, Info->ai_protocol);
+        if (SPD_SOCKET_INVALID == Socket)
+        {
+            Error = SpdSocketLastError();
+            goto exit;
+        }
+
+        if (Listen)
+        {
+#if !defined(_WIN32)
+            int Value = 1;
+            setsockopt(Socket, SOL_SOCKET, SO_REUSEADDR, &Value, sizeof Value);
+#endif
+            if (0 != bind(Socket, Info->ai_addr, (int)Info->ai_addrlen))
+            {
+                Error = SpdSocketLastError();
+                goto exit;
+            }
+        }
+        else
+        {
+            if (0 != connect(Socket, Info->ai_addr, (int)Info->ai_addrlen))
+            {
+                Error = SpdSocketLastError();
+                goto exit;
+            }
+            SpdSocketTune(Socket);
+        }
+    }
+
+    if (Listen && 0 != listen(Socket, 1))
+    {
+        Error = SpdSocketLastError();
+        goto exit;
+    }
+
+    *PSocket = Socket;
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (0 != Info)
+        freeaddrinfo(Info);
+
+    if (ERROR_SUCCESS != Error && SPD_SOCKET_INVALID != Socket)
+        SpdSocketClose(Socket);
+
+    return Error;
+}
+
+static inline
+DWORD SpdSocketAccept(SPD_SOCKET Listener, SPD_SOCKET *PSocket)
+{
+    SPD_SOCKET Socket;
+
+    *PSocket = SPD_SOCKET_INVALID;
+
+    Socket = accept(Listener, 0, 0);
+    if (SPD_SOCKET_INVALID == Socket)
+        return SpdSocketLastError();
+
+    SpdSocketTune(Socket);
+
+    *PSocket = Socket;
+
+    return ERROR_SUCCESS;
+}
+
+/*
+ * Send or receive all the bytes in Bufs, which are consumed as they go.
+ */
+static inline
+DWORD SpdSocketTransfer(SPD_SOCKET Socket, BOOLEAN Send, SPD_SOCKET_BUF *Bufs, ULONG Count)
+{
+#if defined(_WIN32)
+    WSABUF Vector[SPD_SOCKET_BUF_MAX];
+    DWORD Flags;
+#else
+    struct iovec Vector[SPD_SOCKET_BUF_MAX];
+    struct msghdr Message;
+#endif
+    ULONG VectorCount;
+    ULONG BytesTransferred;
+
+    if (SPD_SOCKET_BUF_MAX < Count)
+        return ERROR_INVALID_PARAMETER;
+
+    for (;;)
+    {
+        while (0 < Count && 0 == Bufs->Length)
+        {
+            Bufs++;
+            Count--;
+        }
+        if (0 == Count)
+            return ERROR_SUCCESS;
+
+        VectorCount = 0;
+        for (ULONG I = 0; Count > I; I++)
+        {
+            if (0 == Bufs[I].Length)
+                continue;
+#if defined(_WIN32)
+            Vector[VectorCount].buf = Bufs[I].Buffer;
+            Vector[VectorCount].len = Bufs[I].Length;
+#else
+            Vector[VectorCount].iov_base = Bufs[I].Buffer;
+            Vector[VectorCount].iov_len = Bufs[I].Length;
+#endif
+            VectorCount++;
+        }
+
+#if defined(_WIN32)
+        Flags = 0;
+        if (0 != (Send ?
+            WSASend(Socket, Vector, VectorCount, &BytesTransferred, 0, 0, 0) :
+            WSARecv(Socket, Vector, VectorCount, &BytesTransferred, &Flags, 0, 0)))
+            return SpdSocketLastError();
+#else
+        ssize_t Result;
+        memset(&Message, 0, sizeof Message);
+        Message.msg_iov = Vector;
+        Message.msg_iovlen = VectorCount;
+        Result = Send ?
+            sendmsg(Socket, &Message, MSG_NOSIGNAL) :
+            recvmsg(Socket, &Message, MSG_WAITALL);
+        if (0 > Result)
+            return SpdSocketLastError();
+        BytesTransferred = (ULONG)Result;
+#endif
+
+        /* the peer closed the connection */
+        if (0 == BytesTransferred)
+            return ERROR_BROKEN_PIPE;
+
+        while (0 < BytesTransferred)
+        {
+            ULONG Length = Bufs->Length < BytesTransferred ? Bufs->Length : BytesTransferred;
+            Bufs->Buffer = (PUINT8)Bufs->Buffer + Length;
+            Bufs->Length -= Length;
+            BytesTransferred -= Length;
+            if (0 == Bufs->Length)
+            {
+                Bufs++;
+                Count--;
+            }
+        }
+    }
+}
+
+static inline
+DWORD SpdSocketSend(SPD_SOCKET Socket, PVOID Buffer, ULONG Length)
+{
+    SPD_SOCKET_BUF Buf = { Buffer, Length };
+    return SpdSocketTransfer(Socket, TRUE, &Buf, 1);
+}
+
+static inline
+DWORD SpdSocketRecv(SPD_SOCKET Socket, PVOID Buffer, ULONG Length)
+{
+    SPD_SOCKET_BUF Buf = { Buffer, Length };
+    return SpdSocketTransfer(Socket, FALSE, &Buf, 1);
+}
+
+/*
+ * Send a frame: the header and message from a small buffer and the data (if any)
+ * straight from where they are, in one vectored send.
+ */
+static inline
+DWORD SpdSocketSendFrame(SPD_SOCKET Socket, UINT8 Version, UINT8 Type,
+    const VOID *Message, PVOID Data, UINT32 DataLength)
+{
+    UINT64 Header[SPD_SOCKET_FRAME_HEADER_SIZE / sizeof(UINT64)];
+    SPD_SOCKET_BUF Bufs[2];
+
+    Bufs[0].Buffer = Header;
+    Bufs[0].Length = SpdFrameEncode(Header, Version, Type, Message, DataLength);
+    Bufs[1].Buffer = Data;
+    Bufs[1].Length = DataLength;
+
+    return SpdSocketTransfer(Socket, TRUE, Bufs, 2);
+}
+
+/*
+ * Receive the header and message of a frame into Buffer and validate them. The
+ * Frame->DataLength bytes of data are still to be received (SpdSocketRecv) and may
+ * go directly where they belong, as the message says.
+ */
+static inline
+DWORD SpdSocketRecvFrameHeader(SPD_SOCKET Socket,
+    UINT32 BlockLength, UINT32 MaxTransferLength,
+    UINT64 Buffer[SPD_SOCKET_FRAME_HEADER_SIZE / sizeof(UINT64)],
+    SPD_FRAME *Frame)
+{
+    SPD_FRAME_HEADER *Header = (PVOID)Buffer;
+    UINT64 Discard[8];
+    ULONG Length;
+    DWORD Error;
+
+    memset(Frame, 0, sizeof *Frame);
+
+    Error = SpdSocketRecv(Socket, Header, sizeof *Header);
+    if (ERROR_SUCCESS != Error)
+        return Error;
+    if (!SpdFrameCheckHeader(Header, MaxTransferLength))
+        return ERROR_INVALID_DATA;
+
+    Length = SpdFrameMessageLength(Header->Type);
+    Error = SpdSocketRecv(Socket, Header + 1, Length);
+    if (ERROR_SUCCESS != Error)
+        return Error;
+
+    /* skip header bytes from a later revision that we do not understand */
+    for (ULONG Extra = Header->HeaderLength - sizeof *Header - Length; 0 < Extra;)
+    {
+        Length = Extra < sizeof Discard ? Extra : sizeof Discard;
+        Error = SpdSocketRecv(Socket, Discard, Length);
+        if (ERROR_SUCCESS != Error)
+            return Error;
+        Extra -= Length;
+    }
+
+    if (!SpdFrameCheckMessage(Header, Header + 1, BlockLength, MaxTransferLength))
+        return ERROR_INVALID_DATA;
+
+    Frame->Version = Header->Version;
+    Frame->Type = Header->Type;
+    Frame->Message = SpdFrameHelloType != Header->Type ? Header + 1 : 0;
+    Frame->DataLength = Header->DataLength;
+
+    return ERROR_SUCCESS;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,131 @@
+/**
+ * @file shared/spinwait.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_SPINWAIT_H_INCLUDED
+#define WINSPD_SHARED_SPINWAIT_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Spin-then-block waiting
+ *
+ * A consumer that runs out of requests may poll for new ones for a while before it
+ * blocks on an event, which saves a wake-up (and its latency) when requests arrive
+ * back to back. While a consumer polls, producers need not set the event.
+ *
+ * How long a consumer polls adapts to the request stream: when a request shows up
+ * after polling for T, the next consumer polls for at least 2T; when none does, the
+ * next one polls for half as long. It never polls for longer than the budget given at
+ * initialization, and it keeps polling for SPD_SPINWAIT_MIN so that it notices when
+ * requests come faster again. A budget of 0 disables polling.
+ *
+ * Memory ordering: a producer makes its request visible with a full barrier and then
+ * checks SpdSpinWaitPolling; a consumer stops polling with a full barrier (see
+ * SpdSpinWaitEnd) and then checks for requests once more before it blocks. So either
+ * the producer sets the event or the consumer sees the request.
+ *
+ * Times are in 100ns units. SpdSpinWaitNow is the performance counter by default; the
+ * kernel defines it to its own performance counter before including this file. The
+ * adaptive spin time is updated without a lock; concurrent updates may lose one another,
+ * which only matters to the heuristic.
+ */
+
+#if !defined(SpdSpinWaitNow)
+static inline
+UINT64 SpdSpinWaitNow(VOID)
+{
+    LARGE_INTEGER Counter, Frequency;
+    QueryPerformanceCounter(&Counter);
+    QueryPerformanceFrequency(&Frequency);
+    /* split the multiplication so that it cannot overflow */
+    return (UINT64)(Counter.QuadPart / Frequency.QuadPart) * 10000000 +
+        (UINT64)(Counter.QuadPart % Frequency.QuadPart) * 10000000 / (UINT64)Frequency.QuadPart;
+}
+#endif
+
+#define SPD_SPINWAIT_MIN                10              /* 1us */
+#define SPD_SPINWAIT_BUDGET_MAX         10000           /* 1ms */
+#define SPD_SPINWAIT_CHECK              64              /* spins between looking at the time */
+
+typedef struct
+{
+    UINT32 Budget;                      /* 0 if consumers never poll */
+    volatile LONG Spin;                 /* how long the next consumer polls */
+    volatile LONG PollerCount;
+} SPD_SPINWAIT;
+
+static inline
+VOID SpdSpinWaitInitialize(SPD_SPINWAIT *SpinWait, UINT32 Budget)
+{
+    SpinWait->Budget = SPD_SPINWAIT_BUDGET_MAX < Budget ? SPD_SPINWAIT_BUDGET_MAX : Budget;
+    SpinWait->Spin = SpinWait->Budget;
+    SpinWait->PollerCount = 0;
+}
+
+/* start polling: returns how long to poll for; 0 if the caller should block right away */
+static inline
+UINT32 SpdSpinWaitBegin(SPD_SPINWAIT *SpinWait)
+{
+    if (0 == SpinWait->Budget)
+        return 0;
+
+    InterlockedIncrement(&SpinWait->PollerCount);
+    return (UINT32)SpinWait->Spin;
+}
+
+/*
+ * Stop polling: Found tells whether a request showed up after polling for Elapsed.
+ * Includes a full barrier, after which the caller must check for requests once more
+ * before it blocks; see memory ordering above.
+ */
+static inline
+VOID SpdSpinWaitEnd(SPD_SPINWAIT *SpinWait, BOOLEAN Found, UINT64 Elapsed)
+{
+    UINT32 Spin = (UINT32)SpinWait->Spin;
+
+    InterlockedDecrement(&SpinWait->PollerCount);
+
+    if (Found)
+    {
+        if (Spin < 2 * Elapsed)
+            Spin = SpinWait->Budget < 2 * Elapsed ? SpinWait->Budget : (UINT32)(2 * Elapsed);
+    }
+    else
+        Spin /= 2;
+
+    SpinWait->Spin = SPD_SPINWAIT_MIN < Spin ? Spin :
+        (SPD_SPINWAIT_MIN < SpinWait->Budget ? SPD_SPINWAIT_MIN : SpinWait->Budget);
+}
+
+/* TRUE if a consumer polls, in which case a producer need not set the event */
+static inline
+BOOLEAN SpdSpinWaitPolling(SPD_SPINWAIT *SpinWait)
+{
+    return 0 != SpinWait->PollerCount;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
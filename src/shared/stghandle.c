@@ -19,115 +19,81 @@
  * associated repository.
  */
 
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <shared/shared.h>
-
-#define SPD_INDEX_FROM_BTL(Btl)         SPD_IOCTL_BTL_T(Btl)
-#define SPD_BTL_FROM_INDEX(Idx)         SPD_IOCTL_BTL(0, Idx, 0)
+#include <shared/bufpool.h>
+#include <shared/hintmap.h>
+#include <shared/frame.h>
+#include <shared/socket.h>
+#include <shared/unittab.h>
+
+/* pipe units are addressed like the units of an adapter of maximum capacity */
+#define SPD_INDEX_FROM_BTL(Btl)         \
+    SPD_IOCTL_INDEX_FROM_BTL(SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY, Btl)
+#define SPD_BTL_FROM_INDEX(Idx)         \
+    SPD_IOCTL_BTL_FROM_INDEX(SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY, Idx)
 
 #define IsPipeHandle(Handle)            (((UINT_PTR)(Handle)) & 1)
 #define GetPipeHandle(Handle)           ((HANDLE)((UINT_PTR)(Handle) & ~1))
 #define SetPipeHandle(Handle)           ((HANDLE)((UINT_PTR)(Handle) | 1))
+#define IsSocketHandle(Handle)          (((UINT_PTR)(Handle)) & 2)
+#define GetSocketHandle(Handle)         ((HANDLE)((UINT_PTR)(Handle) & ~2))
+#define SetSocketHandle(Handle)         ((HANDLE)((UINT_PTR)(Handle) | 2))
 #define GetDeviceHandle(Handle)         (Handle)
 
+/* bound on the requests a pipe instance has outstanding; sizes the hint map */
+#define SPD_PIPE_QUEUE_DEPTH            256
+#define SPD_PIPE_INSTANCE_MAX           64
+
+/*
+ * Every request received on a pipe is remembered in the hint map until its response
+ * is sent, so that the response goes back to the instance and connection that the
+ * request came from. For READ requests we also remember how much data to send. The
+ * clients of different instances (and legacy clients, which may use hint 0) may use
+ * the same hints, and so may a client that reconnects while requests of its previous
+ * connection are in flight: the map is keyed on the instance, connection generation
+ * and hint (see SpdHintMapKey) and the dispatcher sees the key as the hint of the
+ * request.
+ */
+#define SPD_PIPE_HINT_VALUE(Index, Generation, DataLength)\
+    (((UINT64)(Index) << 56) | ((UINT64)((Generation) & 0xffffff) << 32) | (DataLength))
+#define SPD_PIPE_HINT_INDEX(Value)      ((ULONG)((Value) >> 56))
+#define SPD_PIPE_HINT_GENERATION(Value) ((LONG)(((Value) >> 32) & 0xffffff))
+#define SPD_PIPE_HINT_DATALENGTH(Value) ((ULONG)(Value))
+#define SPD_PIPE_HINT_SOURCE(Index, Generation)\
+    ((ULONG)(Index) + SPD_PIPE_INSTANCE_MAX * ((ULONG)(Generation) & 0xff))
+static_assert(SPD_PIPE_INSTANCE_MAX * 0x100 <= SPD_HINT_MAP_SOURCE_MAX,
+    "SPD_PIPE_INSTANCE_MAX * 0x100 <= SPD_HINT_MAP_SOURCE_MAX");
+
 typedef union
 {
     SPD_IOCTL_TRANSACT_REQ Req;
     SPD_IOCTL_TRANSACT_RSP Rsp;
 } TRANSACT_MSG;
-typedef struct _HINT_VALUE_ITEM
+typedef struct
 {
-    struct _HINT_VALUE_ITEM *HashNext;
-    UINT64 Hint;
-    ULONG Value;
-} HINT_VALUE_ITEM;
+    HANDLE Pipe;
+    SRWLOCK Lock;
+    SRWLOCK ReceiveLock;                /* held while a request is read (header, then data) */
+    SRWLOCK SendLock;                   /* split frames: see SpdStorageUnitPipeSend */
+    volatile LONG Connected;            /* > 0: connection generation; <= 0: disconnected */
+    volatile LONG Readers;              /* threads receiving requests on this instance */
+    volatile UINT8 Version;             /* frame version; 0: unframed (legacy) */
+} PIPE_INSTANCE;
 typedef struct
 {
+    SPD_UNIT_TABLE_ENTRY TableEntry;    /* protected by StorageUnitLock */
     SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
     HANDLE Event;
-    HANDLE Pipe;
-    SRWLOCK Lock;
-    LONG Connected;
-    HINT_VALUE_ITEM *HashBuckets[61];
+    SPD_HINT_MAP HintMap;
+    SPD_BUFFER_POOL BufferPool;
+    ULONG InstanceCount;
+    PIPE_INSTANCE Instances[];
 } STORAGE_UNIT;
 
 static SRWLOCK StorageUnitLock = SRWLOCK_INIT;
-static STORAGE_UNIT **StorageUnits;
-
-static inline UINT64 HashMix64(UINT64 k)
-{
-    k ^= k >> 33;
-    k *= 0xff51afd7ed558ccdULL;
-    k ^= k >> 33;
-    k *= 0xc4ceb9fe1a85ec53ULL;
-    k ^= k >> 33;
-    return k;
-}
-
-static inline ULONG TakeHintValue(STORAGE_UNIT *StorageUnit, UINT64 Hint)
-{
-    ULONG Result = 0;
-
-    AcquireSRWLockExclusive(&StorageUnit->Lock);
-
-    ULONG HashIndex = HashMix64(Hint) %
-        (sizeof StorageUnit->HashBuckets / sizeof StorageUnit->HashBuckets[0]);
-    for (HINT_VALUE_ITEM **P = &StorageUnit->HashBuckets[HashIndex]; *P; P = &(*P)->HashNext)
-        if ((*P)->Hint == Hint)
-        {
-            HINT_VALUE_ITEM *Item = *P;
-            *P = (*P)->HashNext;
-            Result = Item->Value;
-            MemFree(Item);
-            break;
-        }
-
-    ReleaseSRWLockExclusive(&StorageUnit->Lock);
-
-    return Result;
-}
-
-static inline BOOLEAN PutHintValue(STORAGE_UNIT *StorageUnit, UINT64 Hint, ULONG Value)
-{
-    BOOLEAN Result = FALSE;
-
-    AcquireSRWLockExclusive(&StorageUnit->Lock);
-
-    ULONG HashIndex = HashMix64(Hint) %
-        (sizeof StorageUnit->HashBuckets / sizeof StorageUnit->HashBuckets[0]);
-    for (HINT_VALUE_ITEM *ItemX = StorageUnit->HashBuckets[HashIndex]; ItemX; ItemX = ItemX->HashNext)
-        if (ItemX->Hint == Hint)
-            goto exit;
-    HINT_VALUE_ITEM *Item = MemAlloc(sizeof(HINT_VALUE_ITEM));
-    if (0 == Item)
-        goto exit;
-    Item->Hint = Hint;
-    Item->Value = Value;
-    Item->HashNext = StorageUnit->HashBuckets[HashIndex];
-    StorageUnit->HashBuckets[HashIndex] = Item;
-
-    Result = TRUE;
-
-exit:
-    ReleaseSRWLockExclusive(&StorageUnit->Lock);
-
-    return Result;
-}
-
-static inline GuidEqual(const GUID *a, const GUID *b)
-{
-    return
-        a->Data1 == b->Data1 &&
-        a->Data2 == b->Data2 &&
-        a->Data3 == b->Data3 &&
-        a->Data4[0] == b->Data4[0] &&
-        a->Data4[1] == b->Data4[1] &&
-        a->Data4[2] == b->Data4[2] &&
-        a->Data4[3] == b->Data4[3] &&
-        a->Data4[4] == b->Data4[4] &&
-        a->Data4[5] == b->Data4[5] &&
-        a->Data4[6] == b->Data4[6] &&
-        a->Data4[7] == b->Data4[7];
-}
+static SPD_UNIT_TABLE *StorageUnits;
 
 static DWORD SpdStorageUnitHandleOpenPipe(PWSTR Name,
     const SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams,
@@ -135,66 +101,71 @@ static DWORD SpdStorageUnitHandleOpenPipe(PWSTR Name,
 {
     UINT32 Btl = (UINT32)-1;
     STORAGE_UNIT *StorageUnit = 0;
-    STORAGE_UNIT *DuplicateUnit = 0;
+    BOOLEAN Duplicate = FALSE, Inserted = FALSE;
+    ULONG InstanceCount;
+    ULONG MaxMessageLength;
     WCHAR PipeNameBuf[1024];
     DWORD Error;
 
     *PHandle = INVALID_HANDLE_VALUE;
     *PBtl = (UINT32)-1;
 
+    InstanceCount = StorageUnitParams->PipeInstanceCount;
+    if (0 == InstanceCount)
+        InstanceCount = 1;
+    else if (SPD_PIPE_INSTANCE_MAX < InstanceCount)
+        InstanceCount = SPD_PIPE_INSTANCE_MAX;
+
     AcquireSRWLockExclusive(&StorageUnitLock);
 
     if (0 == StorageUnits)
     {
-        StorageUnits = MemAlloc(sizeof *StorageUnits * SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY);
+        StorageUnits = MemAlloc(SpdUnitTableSize(SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY));
         if (0 == StorageUnits)
         {
             Error = ERROR_NO_SYSTEM_RESOURCES;
             goto exit;
         }
-        memset(StorageUnits, 0, sizeof *StorageUnits * SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY);
+        SpdUnitTableInitialize(StorageUnits, SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY);
     }
 
-    StorageUnit = MemAlloc(sizeof *StorageUnit);
+    StorageUnit = MemAlloc(sizeof *StorageUnit + InstanceCount * sizeof(PIPE_INSTANCE));
     if (0 == StorageUnit)
     {
         Error = ERROR_NO_SYSTEM_RESOURCES;
         goto exit;
     }
-    memset(StorageUnit, 0, sizeof *StorageUnit);
+    memset(StorageUnit, 0, sizeof *StorageUnit + InstanceCount * sizeof(PIPE_INSTANCE));
     memcpy(&StorageUnit->StorageUnitParams, StorageUnitParams, sizeof *StorageUnitParams);
-    StorageUnit->Pipe = INVALID_HANDLE_VALUE;
-    InitializeSRWLock(&StorageUnit->Lock);
-
-    for (ULONG I = 0; SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY > I; I++)
+    memcpy(&StorageUnit->TableEntry.Guid, &StorageUnitParams->Guid, sizeof StorageUnitParams->Guid);
+    StorageUnit->InstanceCount = InstanceCount;
+    for (ULONG I = 0; InstanceCount > I; I++)
     {
-        STORAGE_UNIT *Unit = StorageUnits[I];
-        if (0 == Unit)
-        {
-            if ((UINT32)-1 == Btl)
-                Btl = SPD_BTL_FROM_INDEX(I);
-            continue;
-        }
-
-        if (GuidEqual(&StorageUnit->StorageUnitParams.Guid, &Unit->StorageUnitParams.Guid))
-        {
-            DuplicateUnit = Unit;
-            break;
-        }
+        StorageUnit->Instances[I].Pipe = INVALID_HANDLE_VALUE;
+        InitializeSRWLock(&StorageUnit->Instances[I].Lock);
+        InitializeSRWLock(&StorageUnit->Instances[I].ReceiveLock);
+        InitializeSRWLock(&StorageUnit->Instances[I].SendLock);
     }
-    if (0 == DuplicateUnit && -1 != Btl)
-        StorageUnits[SPD_INDEX_FROM_BTL(Btl)] = StorageUnit;
+    SpdBufferPoolInitialize(&StorageUnit->BufferPool);
 
-    if (0 != DuplicateUnit)
+    Error = SpdHintMapInitialize(&StorageUnit->HintMap, SPD_PIPE_QUEUE_DEPTH * InstanceCount);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    Duplicate = 0 != SpdUnitTableLookupGuid(StorageUnits, &StorageUnit->TableEntry.Guid);
+    Inserted = !Duplicate && SpdUnitTableInsert(StorageUnits, &StorageUnit->TableEntry);
+
+    if (Duplicate)
     {
         Error = ERROR_ALREADY_EXISTS;
         goto exit;
     }
-    if (-1 == Btl)
+    if (!Inserted)
     {
         Error = ERROR_CANNOT_MAKE;
         goto exit;
     }
+    Btl = SPD_BTL_FROM_INDEX(StorageUnit->TableEntry.Index);
 
     StorageUnit->Event = CreateEventW(0, TRUE, FALSE, 0);
     if (0 == StorageUnit->Event)
@@ -203,20 +174,26 @@ static DWORD SpdStorageUnitHandleOpenPipe(PWSTR Name,
         goto exit;
     }
 
+    MaxMessageLength = sizeof(SPD_FRAME_HEADER) + sizeof(TRANSACT_MSG) +
+        StorageUnit->StorageUnitParams.MaxTransferLength;
     wsprintfW(PipeNameBuf, L"%s\\%u", Name, (unsigned)SPD_INDEX_FROM_BTL(Btl));
-    StorageUnit->Pipe = CreateNamedPipeW(PipeNameBuf,
-        PIPE_ACCESS_DUPLEX |
-            FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_WRITE_THROUGH | FILE_FLAG_OVERLAPPED,
-        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
-        1,
-        sizeof(TRANSACT_MSG) + StorageUnit->StorageUnitParams.MaxTransferLength,
-        sizeof(TRANSACT_MSG) + StorageUnit->StorageUnitParams.MaxTransferLength,
-        60 * 60 * 1000,
-        0);
-    if (INVALID_HANDLE_VALUE == StorageUnit->Pipe)
+    for (ULONG I = 0; InstanceCount > I; I++)
     {
-        Error = GetLastError();
-        goto exit;
+        StorageUnit->Instances[I].Pipe = CreateNamedPipeW(PipeNameBuf,
+            PIPE_ACCESS_DUPLEX |
+                (0 == I ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0) |
+                FILE_FLAG_WRITE_THROUGH | FILE_FLAG_OVERLAPPED,
+            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            InstanceCount,
+            MaxMessageLength,
+            MaxMessageLength,
+            60 * 60 * 1000,
+            0);
+        if (INVALID_HANDLE_VALUE == StorageUnit->Instances[I].Pipe)
+        {
+            Error = GetLastError();
+            goto exit;
+        }
     }
 
     *PHandle = SetPipeHandle(StorageUnit);
@@ -227,15 +204,17 @@ static DWORD SpdStorageUnitHandleOpenPipe(PWSTR Name,
 exit:
     if (ERROR_SUCCESS != Error)
     {
-        if (0 == DuplicateUnit && -1 != Btl)
-            StorageUnits[SPD_INDEX_FROM_BTL(Btl)] = 0;
+        if (Inserted)
+            SpdUnitTableRemove(StorageUnits, &StorageUnit->TableEntry);
 
         if (0 != StorageUnit)
         {
-            if (INVALID_HANDLE_VALUE != StorageUnit->Pipe)
-                CloseHandle(StorageUnit->Pipe);
+            for (ULONG I = 0; StorageUnit->InstanceCount > I; I++)
+                if (INVALID_HANDLE_VALUE != StorageUnit->Instances[I].Pipe)
+                    CloseHandle(StorageUnit->Instances[I].Pipe);
             if (0 != StorageUnit->Event)
                 CloseHandle(StorageUnit->Event);
+            SpdHintMapFinalize(&StorageUnit->HintMap);
             MemFree(StorageUnit);
         }
     }
@@ -251,7 +230,8 @@ static inline DWORD WaitOverlappedResult(HANDLE StopEvent, BOOL Success,
     HANDLE WaitObjects[2];
     DWORD WaitResult;
 
-    if (!Success && ERROR_IO_PENDING != GetLastError())
+    /* ERROR_MORE_DATA: a partial message read; the byte count is in Overlapped */
+    if (!Success && ERROR_IO_PENDING != GetLastError() && ERROR_MORE_DATA != GetLastError())
         return GetLastError();
 
     WaitObjects[0] = StopEvent;
@@ -274,194 +254,445 @@ static inline DWORD WaitOverlappedResult(HANDLE StopEvent, BOOL Success,
     return ERROR_SUCCESS;
 }
 
-static DWORD SpdStorageUnitHandleTransactPipe(HANDLE Handle,
-    UINT32 Btl,
-    SPD_IOCTL_TRANSACT_RSP *Rsp,
-    SPD_IOCTL_TRANSACT_REQ *Req,
-    PVOID DataBuffer)
+static DWORD SpdStorageUnitPipeWrite(STORAGE_UNIT *StorageUnit, PIPE_INSTANCE *Instance,
+    PVOID Buffer, ULONG Length,
+    OVERLAPPED *Overlapped)
 {
-    STORAGE_UNIT *StorageUnit = Handle;
-    LONG Connected;
-    ULONG DataLength;
-    TRANSACT_MSG *Msg = 0;
-    OVERLAPPED Overlapped;
     DWORD BytesTransferred;
+
+    return WaitOverlappedResult(
+        StorageUnit->Event,
+        WriteFile(Instance->Pipe, Buffer, Length, 0, Overlapped),
+        Instance->Pipe, Overlapped, &BytesTransferred);
+}
+
+static DWORD SpdStorageUnitPipeRead(STORAGE_UNIT *StorageUnit, PIPE_INSTANCE *Instance,
+    PVOID Buffer, ULONG Length,
+    OVERLAPPED *Overlapped, PULONG PBytesTransferred, PBOOLEAN PMore)
+{
+    DWORD BytesTransferred = 0;
     DWORD Error;
 
-    if ((0 == Req && 0 == Rsp) ||
-        (0 != Req && 0 == DataBuffer))
-        return ERROR_INVALID_PARAMETER;
+    Error = WaitOverlappedResult(
+        StorageUnit->Event,
+        ReadFile(Instance->Pipe, Buffer, Length, 0, Overlapped),
+        Instance->Pipe, Overlapped, &BytesTransferred);
 
-    Error = SpdOverlappedInit(&Overlapped);
-    if (ERROR_SUCCESS != Error)
-        goto exit;
+    /* the message is longer than Buffer: the next read gets the rest of it */
+    *PMore = ERROR_MORE_DATA == Error;
+    *PBytesTransferred = BytesTransferred;
 
-    AcquireSRWLockShared(&StorageUnitLock);
-    Error = StorageUnit == StorageUnits[SPD_INDEX_FROM_BTL(Btl)] ?
-        ERROR_SUCCESS : ERROR_FILE_NOT_FOUND;
-    ReleaseSRWLockShared(&StorageUnitLock);
-    if (ERROR_SUCCESS != Error)
-        goto exit;
+    return *PMore ? ERROR_SUCCESS : Error;
+}
 
-    Msg = MemAlloc(sizeof(TRANSACT_MSG) + StorageUnit->StorageUnitParams.MaxTransferLength);
-    if (0 == Msg)
+static DWORD SpdStorageUnitPipeDrain(STORAGE_UNIT *StorageUnit, PIPE_INSTANCE *Instance,
+    OVERLAPPED *Overlapped, BOOLEAN More)
+{
+    UINT64 Buffer[64];
+    ULONG BytesTransferred;
+    DWORD Error = ERROR_SUCCESS;
+
+    while (More && ERROR_SUCCESS == Error)
+        Error = SpdStorageUnitPipeRead(StorageUnit, Instance, Buffer, sizeof Buffer,
+            Overlapped, &BytesTransferred, &More);
+
+    return Error;
+}
+
+static VOID SpdStorageUnitPipeDisconnect(PIPE_INSTANCE *Instance, LONG Connected)
+{
+    AcquireSRWLockExclusive(&Instance->Lock);
+    if (Connected == Instance->Connected)
     {
-        Error = ERROR_NO_SYSTEM_RESOURCES;
-        goto exit;
+        DisconnectNamedPipe(Instance->Pipe);
+        Instance->Connected = -Instance->Connected;
     }
+    ReleaseSRWLockExclusive(&Instance->Lock);
+}
+
+static DWORD SpdStorageUnitPipeConnect(STORAGE_UNIT *StorageUnit, PIPE_INSTANCE *Instance,
+    OVERLAPPED *Overlapped, PLONG PConnected)
+{
+    DWORD BytesTransferred;
+    DWORD Error;
 
     Error = ERROR_SUCCESS;
-    AcquireSRWLockExclusive(&StorageUnit->Lock);
-    if (0 >= StorageUnit->Connected)
+    AcquireSRWLockExclusive(&Instance->Lock);
+    if (0 >= Instance->Connected)
     {
         Error = WaitOverlappedResult(
             StorageUnit->Event,
-            ConnectNamedPipe(StorageUnit->Pipe, &Overlapped),
-            StorageUnit->Pipe, &Overlapped, &BytesTransferred);
+            ConnectNamedPipe(Instance->Pipe, Overlapped),
+            Instance->Pipe, Overlapped, &BytesTransferred);
         if (ERROR_SUCCESS == Error || ERROR_PIPE_CONNECTED == Error)
         {
             Error = WaitOverlappedResult(
                 StorageUnit->Event,
-                WriteFile(StorageUnit->Pipe,
+                WriteFile(Instance->Pipe,
                     &StorageUnit->StorageUnitParams, sizeof StorageUnit->StorageUnitParams,
-                    0, &Overlapped),
-                StorageUnit->Pipe, &Overlapped, &BytesTransferred);
+                    0, Overlapped),
+                Instance->Pipe, Overlapped, &BytesTransferred);
             if (ERROR_SUCCESS == Error)
             {
-                StorageUnit->Connected = -StorageUnit->Connected;
-                StorageUnit->Connected++;
+                Instance->Connected = -Instance->Connected;
+                Instance->Connected++;
+                Instance->Version = 0;
             }
             else
             {
-                DisconnectNamedPipe(StorageUnit->Pipe);
+                DisconnectNamedPipe(Instance->Pipe);
                 Error = ERROR_NO_DATA;
             }
         }
     }
-    Connected = StorageUnit->Connected;
-    ReleaseSRWLockExclusive(&StorageUnit->Lock);
-    if (ERROR_NO_DATA == Error)
-        goto zeroout;
-    if (ERROR_SUCCESS != Error)
-        goto exit;
+    *PConnected = Instance->Connected;
+    ReleaseSRWLockExclusive(&Instance->Lock);
 
-    if (0 != Rsp)
+    return Error;
+}
+
+static PIPE_INSTANCE *SpdStorageUnitPipeInstance(STORAGE_UNIT *StorageUnit)
+{
+    PIPE_INSTANCE *Instance = &StorageUnit->Instances[0];
+
+    /*
+     * Receive on the instance with the fewest readers, so that every instance (and
+     * hence every connected client) has a thread waiting for its requests as long
+     * as there are at least as many dispatcher threads as instances.
+     */
+    for (ULONG I = 1; StorageUnit->InstanceCount > I; I++)
+        if (Instance->Readers > StorageUnit->Instances[I].Readers)
+            Instance = &StorageUnit->Instances[I];
+
+    return Instance;
+}
+
+static DWORD SpdStorageUnitPipeSend(STORAGE_UNIT *StorageUnit,
+    SPD_IOCTL_TRANSACT_RSP *Rsp, PVOID DataBuffer,
+    OVERLAPPED *Overlapped, PIPE_INSTANCE **PInstance)
+{
+    PIPE_INSTANCE *Instance;
+    SPD_IOCTL_TRANSACT_RSP MsgRsp;
+    UINT64 Value;
+    LONG Connected;
+    UINT8 Version;
+    ULONG DataLength, HeaderLength;
+    UINT64 Header[(sizeof(SPD_FRAME_HEADER) + sizeof(TRANSACT_MSG) + 7) / 8];
+    PUINT8 Msg;
+    DWORD Error;
+
+    *PInstance = 0;
+
+    /* a response without a request (e.g. after a reconnect) has nowhere to go */
+    if (!SpdHintMapTake(&StorageUnit->HintMap, Rsp->Hint, &Value) ||
+        StorageUnit->InstanceCount <= SPD_PIPE_HINT_INDEX(Value))
+        return ERROR_SUCCESS;
+
+    Instance = &StorageUnit->Instances[SPD_PIPE_HINT_INDEX(Value)];
+    *PInstance = Instance;
+
+    /* the client gets its own hint back */
+    memcpy(&MsgRsp, Rsp, sizeof MsgRsp);
+    MsgRsp.Hint = SpdHintMapHint(Rsp->Hint,
+        SPD_PIPE_HINT_SOURCE(SPD_PIPE_HINT_INDEX(Value), SPD_PIPE_HINT_GENERATION(Value)));
+    Rsp = &MsgRsp;
+
+    /*
+     * Do not take the instance lock: a thread may hold it while waiting for the next
+     * client, in which case the generation check below drops this response anyway.
+     */
+    Connected = Instance->Connected;
+    Version = Instance->Version;
+    if (0 >= Connected || SPD_PIPE_HINT_GENERATION(Value) != (Connected & 0xffffff))
+        return ERROR_SUCCESS;
+
+    DataLength = SpdIoctlTransactReadKind == Rsp->Kind && 0 != DataBuffer ?
+        SPD_PIPE_HINT_DATALENGTH(Value) : 0;
+
+    if (SPD_FRAME_VERSION_SPLIT <= Version)
     {
-        DataLength = SpdIoctlTransactReadKind == Rsp->Kind && 0 != DataBuffer ?
-            TakeHintValue(StorageUnit, Rsp->Hint) : 0;
-        memcpy(Msg, Rsp, sizeof *Rsp);
+        /*
+         * The data go out as a message of their own, straight from DataBuffer. No other
+         * response may come between the header and the data: responses with data hold
+         * the send lock exclusive, responses without data hold it shared.
+         */
+        HeaderLength = SpdFrameEncode(Header, Version, SpdFrameRspType, Rsp, DataLength);
         if (0 != DataLength)
-            memcpy(Msg + 1, DataBuffer, DataLength);
-        Error = WaitOverlappedResult(
-            StorageUnit->Event,
-            WriteFile(StorageUnit->Pipe, Msg, sizeof(TRANSACT_MSG) + DataLength, 0, &Overlapped),
-            StorageUnit->Pipe, &Overlapped, &BytesTransferred);
-        if (ERROR_SUCCESS != Error)
-            goto disconnect;
+            AcquireSRWLockExclusive(&Instance->SendLock);
+        else
+            AcquireSRWLockShared(&Instance->SendLock);
+        Error = SpdStorageUnitPipeWrite(StorageUnit, Instance, Header, HeaderLength, Overlapped);
+        if (ERROR_SUCCESS == Error && 0 != DataLength)
+            Error = SpdStorageUnitPipeWrite(StorageUnit, Instance, DataBuffer, DataLength,
+                Overlapped);
+        if (0 != DataLength)
+            ReleaseSRWLockExclusive(&Instance->SendLock);
+        else
+            ReleaseSRWLockShared(&Instance->SendLock);
     }
+    else
+    {
+        /* unframed and version 1 frames are a single message: stage the data */
+        Msg = SpdBufferPoolAlloc(&StorageUnit->BufferPool,
+            sizeof(SPD_FRAME_HEADER) + sizeof(TRANSACT_MSG) + DataLength);
+        if (0 == Msg)
+            return ERROR_NO_SYSTEM_RESOURCES;
+
+        if (0 != Version)
+            HeaderLength = SpdFrameEncode(Msg, Version, SpdFrameRspType, Rsp, DataLength);
+        else
+        {
+            memcpy(Msg, Rsp, sizeof *Rsp);
+            HeaderLength = sizeof(TRANSACT_MSG);
+        }
+        if (0 != DataLength)
+            memcpy(Msg + HeaderLength, DataBuffer, DataLength);
 
-    if (0 != Req)
+        Error = SpdStorageUnitPipeWrite(StorageUnit, Instance, Msg, HeaderLength + DataLength,
+            Overlapped);
+
+        SpdBufferPoolFree(&StorageUnit->BufferPool, Msg);
+    }
+
+    if (ERROR_SUCCESS != Error && ERROR_OPERATION_ABORTED != Error)
     {
-        Error = WaitOverlappedResult(
-            StorageUnit->Event,
-            ReadFile(StorageUnit->Pipe,
-                Msg, sizeof(TRANSACT_MSG) + StorageUnit->StorageUnitParams.MaxTransferLength, 0, &Overlapped),
-            StorageUnit->Pipe, &Overlapped, &BytesTransferred);
-        if (ERROR_SUCCESS != Error)
-            goto disconnect;
+        SpdStorageUnitPipeDisconnect(Instance, Connected);
+        Error = ERROR_SUCCESS;
+    }
 
-        if (sizeof(TRANSACT_MSG) > BytesTransferred)
+    return Error;
+}
+
+static DWORD SpdStorageUnitPipeReceive(STORAGE_UNIT *StorageUnit, PIPE_INSTANCE *Instance,
+    SPD_IOCTL_TRANSACT_REQ *Req, PVOID DataBuffer,
+    OVERLAPPED *Overlapped)
+{
+    ULONG BlockLength = StorageUnit->StorageUnitParams.BlockLength;
+    ULONG MaxTransferLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    ULONG Index = (ULONG)(Instance - StorageUnit->Instances);
+    SPD_IOCTL_TRANSACT_REQ *MsgReq;
+    ULONG MsgDataLength, DataLength, ReadLength;
+    SPD_FRAME Frame;
+    UINT8 Version;
+    LONG Connected;
+    UINT64 Key;
+    UINT64 Msg[(sizeof(SPD_FRAME_HEADER) + sizeof(TRANSACT_MSG) + 7) / 8];
+    ULONG BytesTransferred;
+    BOOLEAN More = FALSE;
+    DWORD Error;
+
+    memset(Req, 0, sizeof *Req);
+
+    InterlockedIncrement(&Instance->Readers);
+
+    /*
+     * Read the request message first and its data (if any) straight into DataBuffer.
+     * Readers of an instance take turns, so that the two reads are not split up.
+     */
+    AcquireSRWLockExclusive(&Instance->ReceiveLock);
+
+    for (;;)
+    {
+        Error = SpdStorageUnitPipeConnect(StorageUnit, Instance, Overlapped, &Connected);
+        if (ERROR_NO_DATA == Error)
             goto zeroout;
+        if (ERROR_SUCCESS != Error)
+            goto exit;
 
-        if (SpdIoctlTransactReadKind == Msg->Req.Kind)
-        {
-            DataLength = Msg->Req.Op.Read.BlockCount *
-                StorageUnit->StorageUnitParams.BlockLength;
-            if (DataLength > StorageUnit->StorageUnitParams.MaxTransferLength)
-                goto zeroout;
+        Version = Instance->Version;
+        Error = SpdStorageUnitPipeRead(StorageUnit, Instance,
+            Msg, 0 != Version ?
+                sizeof(SPD_FRAME_HEADER) + sizeof(SPD_IOCTL_TRANSACT_REQ) : sizeof(TRANSACT_MSG),
+            Overlapped, &BytesTransferred, &More);
+        if (ERROR_OPERATION_ABORTED == Error)
+            goto exit;
+        if (ERROR_SUCCESS != Error)
+            goto disconnect;
 
-            if (!PutHintValue(StorageUnit, Msg->Req.Hint, DataLength))
-                goto zeroout;
-        }
-        else if (SpdIoctlTransactWriteKind == Msg->Req.Kind)
+        if (0 != Version)
         {
-            DataLength = Msg->Req.Op.Write.BlockCount *
-                StorageUnit->StorageUnitParams.BlockLength;
-            if (DataLength > StorageUnit->StorageUnitParams.MaxTransferLength)
-                goto zeroout;
-
-            BytesTransferred -= sizeof(TRANSACT_MSG);
-            if (BytesTransferred > DataLength)
-                BytesTransferred = DataLength;
-            memcpy(DataBuffer, Msg + 1, BytesTransferred);
-            memset((PUINT8)(DataBuffer) + BytesTransferred, 0, DataLength - BytesTransferred);
+            /* up to version 1 the data are the rest of this message; then the next one */
+            if (!SpdFrameDecodeHeader(Msg, BytesTransferred, BlockLength, MaxTransferLength,
+                    &Frame) ||
+                SpdFrameReqType != Frame.Type ||
+                More != (SPD_FRAME_VERSION_SPLIT > Version && 0 != Frame.DataLength))
+                goto drain;
+            MsgReq = Frame.Message;
+            break;
         }
-        else if (SpdIoctlTransactUnmapKind == Msg->Req.Kind)
+
+        if (sizeof(SPD_FRAME_HEADER) == BytesTransferred &&
+            SpdFrameDecodeHeader(Msg, BytesTransferred, BlockLength, MaxTransferLength,
+                &Frame) &&
+            SpdFrameHelloType == Frame.Type)
         {
-            DataLength = Msg->Req.Op.Unmap.Count *
-                sizeof(SPD_IOCTL_UNMAP_DESCRIPTOR);
-            if (DataLength > StorageUnit->StorageUnitParams.MaxTransferLength)
-                goto zeroout;
-
-            BytesTransferred -= sizeof(TRANSACT_MSG);
-            if (BytesTransferred > DataLength)
-                BytesTransferred = DataLength;
-            memcpy(DataBuffer, Msg + 1, BytesTransferred);
-            memset((PUINT8)(DataBuffer) + BytesTransferred, 0, DataLength - BytesTransferred);
+            /* client speaks frames: agree on a version and answer in kind */
+            Version = SPD_FRAME_VERSION < Frame.Version ? SPD_FRAME_VERSION : Frame.Version;
+            AcquireSRWLockExclusive(&Instance->Lock);
+            if (Connected == Instance->Connected)
+                Instance->Version = Version;
+            ReleaseSRWLockExclusive(&Instance->Lock);
+
+            Error = SpdStorageUnitPipeWrite(StorageUnit, Instance,
+                Msg, SpdFrameEncodeHello(Msg, Version), Overlapped);
+            if (ERROR_OPERATION_ABORTED == Error)
+                goto exit;
+            if (ERROR_SUCCESS != Error)
+                goto disconnect;
+            continue;
         }
 
-        memcpy(Req, &Msg->Req, sizeof *Req);
+        if (sizeof(TRANSACT_MSG) > BytesTransferred)
+            goto drain;
+        MsgReq = (PVOID)Msg;
+        break;
     }
 
+    ReadLength = 0;
+    if (SpdIoctlTransactReadKind == MsgReq->Kind)
+    {
+        if ((UINT64)MsgReq->Op.Read.BlockCount * BlockLength > MaxTransferLength)
+            goto drain;
+        ReadLength = MsgReq->Op.Read.BlockCount * BlockLength;
+    }
+
+    DataLength = SpdFrameReqDataLength(MsgReq, BlockLength, MaxTransferLength);
+    if ((ULONG)-1 == DataLength)
+        goto drain;
+
+    MsgDataLength = 0;
+    if (0 != DataLength && (More || SPD_FRAME_VERSION_SPLIT <= Version))
+    {
+        Error = SpdStorageUnitPipeRead(StorageUnit, Instance,
+            DataBuffer, DataLength,
+            Overlapped, &MsgDataLength, &More);
+        if (ERROR_OPERATION_ABORTED == Error)
+            goto exit;
+        if (ERROR_SUCCESS != Error)
+            goto disconnect;
+        if (0 != Version && DataLength != MsgDataLength)
+            goto drain;
+    }
+    if (More)
+    {
+        /* unframed messages may come long; the extra data are dropped */
+        if (0 != Version)
+            goto drain;
+        Error = SpdStorageUnitPipeDrain(StorageUnit, Instance, Overlapped, More);
+        if (ERROR_OPERATION_ABORTED == Error)
+            goto exit;
+        if (ERROR_SUCCESS != Error)
+            goto disconnect;
+    }
+
+    /* unframed messages may also come short; the rest of the data are zero */
+    memset((PUINT8)DataBuffer + MsgDataLength, 0, DataLength - MsgDataLength);
+
+    /* the client reused the hint of a request in flight or exceeded the queue depth */
+    Key = SpdHintMapKey(MsgReq->Hint, SPD_PIPE_HINT_SOURCE(Index, Connected));
+    if (!SpdHintMapPut(&StorageUnit->HintMap, Key,
+        SPD_PIPE_HINT_VALUE(Index, Connected, ReadLength)))
+        goto disconnect;
+
+    memcpy(Req, MsgReq, sizeof *Req);
+    Req->Hint = Key;
+
     Error = ERROR_SUCCESS;
 
 exit:
-    MemFree(Msg);
+    ReleaseSRWLockExclusive(&Instance->ReceiveLock);
 
-    SpdOverlappedFini(&Overlapped);
+    InterlockedDecrement(&Instance->Readers);
 
     return Error;
 
+drain:
+    /*
+     * A malformed message. A framed client pipelines its requests and would wait for a
+     * response to this one forever: hang up on it. Skip what is left of an unframed
+     * message and carry on.
+     */
+    if (0 != Version)
+        goto disconnect;
+    Error = SpdStorageUnitPipeDrain(StorageUnit, Instance, Overlapped, More);
+    if (ERROR_OPERATION_ABORTED == Error)
+        goto exit;
+    if (ERROR_SUCCESS == Error)
+        goto zeroout;
+
 disconnect:
-    AcquireSRWLockExclusive(&StorageUnit->Lock);
-    if (Connected == StorageUnit->Connected)
+    SpdStorageUnitPipeDisconnect(Instance, Connected);
+
+zeroout:
+    memset(Req, 0, sizeof *Req);
+
+    Error = ERROR_SUCCESS;
+    goto exit;
+}
+
+static DWORD SpdStorageUnitHandleTransactPipe(HANDLE Handle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    PVOID DataBuffer)
+{
+    STORAGE_UNIT *StorageUnit = Handle;
+    PIPE_INSTANCE *Instance = 0;
+    OVERLAPPED Overlapped;
+    DWORD Error;
+
+    if ((0 == Req && 0 == Rsp) ||
+        (0 != Req && 0 == DataBuffer))
+        return ERROR_INVALID_PARAMETER;
+
+    Error = SpdOverlappedInit(&Overlapped);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    AcquireSRWLockShared(&StorageUnitLock);
+    Error = &StorageUnit->TableEntry ==
+        SpdUnitTableLookup(StorageUnits, SPD_INDEX_FROM_BTL(Btl)) ?
+        ERROR_SUCCESS : ERROR_FILE_NOT_FOUND;
+    ReleaseSRWLockShared(&StorageUnitLock);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    if (0 != Rsp)
     {
-        DisconnectNamedPipe(StorageUnit->Pipe);
-        StorageUnit->Connected = -StorageUnit->Connected;
+        Error = SpdStorageUnitPipeSend(StorageUnit, Rsp, DataBuffer, &Overlapped, &Instance);
+        if (ERROR_SUCCESS != Error)
+            goto exit;
     }
-    ReleaseSRWLockExclusive(&StorageUnit->Lock);
 
-zeroout:
     if (0 != Req)
-        memset(Req, 0, sizeof *Req);
+    {
+        /* keep receiving from the instance we just answered, if any */
+        if (0 == Instance)
+            Instance = SpdStorageUnitPipeInstance(StorageUnit);
+
+        Error = SpdStorageUnitPipeReceive(StorageUnit, Instance, Req, DataBuffer, &Overlapped);
+        if (ERROR_SUCCESS != Error)
+            goto exit;
+    }
 
     Error = ERROR_SUCCESS;
-    goto exit;
+
+exit:
+    SpdOverlappedFini(&Overlapped);
+
+    return Error;
 }
 
 static DWORD SpdStorageUnitHandleShutdownPipe(HANDLE Handle,
     const GUID *Guid)
 {
     STORAGE_UNIT *StorageUnit = Handle;
-    ULONG Index = -1;
     DWORD Error;
 
     AcquireSRWLockExclusive(&StorageUnitLock);
 
-    for (ULONG I = 0; SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY > I; I++)
-    {
-        STORAGE_UNIT *Unit = StorageUnits[I];
-        if (0 == Unit)
-            continue;
-
-        if (GuidEqual(Guid, &Unit->StorageUnitParams.Guid))
-        {
-            Index = I;
-            break;
-        }
-    }
-    if (-1 != Index && StorageUnit == StorageUnits[Index])
-        StorageUnits[Index] = 0;
+    if (&StorageUnit->TableEntry == SpdUnitTableLookupGuid(StorageUnits, Guid))
+        SpdUnitTableRemove(StorageUnits, &StorageUnit->TableEntry);
     else
     {
         Error = ERROR_FILE_NOT_FOUND;
@@ -482,13 +713,377 @@ static DWORD SpdStorageUnitHandleClosePipe(HANDLE Handle)
 {
     STORAGE_UNIT *StorageUnit = Handle;
 
-    CloseHandle(StorageUnit->Pipe);
+    for (ULONG I = 0; StorageUnit->InstanceCount > I; I++)
+        CloseHandle(StorageUnit->Instances[I].Pipe);
     CloseHandle(StorageUnit->Event);
+    SpdBufferPoolFinalize(&StorageUnit->BufferPool);
+    SpdHintMapFinalize(&StorageUnit->HintMap);
     MemFree(StorageUnit);
 
     return ERROR_SUCCESS;
 }
 
+/* bound on the requests a socket connection has outstanding; sizes the hint map */
+#define SPD_SOCKET_QUEUE_DEPTH          256
+
+/*
+ * Every request received on a socket is remembered in the hint map until its response
+ * is sent, together with the connection generation (so that responses to a previous
+ * connection are dropped) and for READ requests the data length. A client that
+ * reconnects may reuse the hints of requests still in flight: the map is keyed on the
+ * generation and hint (see SpdHintMapKey).
+ */
+#define SPD_SOCKET_HINT_VALUE(Generation, DataLength)\
+    (((UINT64)(Generation) << 32) | (DataLength))
+#define SPD_SOCKET_HINT_GENERATION(Value)\
+    ((LONG)((Value) >> 32))
+#define SPD_SOCKET_HINT_DATALENGTH(Value)\
+    ((ULONG)(Value))
+#define SPD_SOCKET_HINT_SOURCE(Generation)\
+    ((ULONG)(Generation) & 0xff)
+
+typedef struct
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_SOCKET Listener;
+    SPD_SOCKET Socket;
+    SRWLOCK ReceiveLock;                /* receives and connects */
+    SRWLOCK SendLock;                   /* sends; protects Socket, Connected, Version */
+    LONG Connected;                     /* > 0: connection generation; <= 0: disconnected */
+    UINT8 Version;
+    volatile BOOLEAN Stopped;
+    SPD_HINT_MAP HintMap;
+} SOCKET_UNIT;
+
+static DWORD SpdStorageUnitHandleOpenSocket(PWSTR Name,
+    const SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams,
+    PHANDLE PHandle, PUINT32 PBtl)
+{
+    SOCKET_UNIT *SocketUnit = 0;
+    BOOLEAN Startup = FALSE;
+    char NameBuf[SPD_SOCKET_NAME_MAX + 16];
+    DWORD Error;
+
+    *PHandle = INVALID_HANDLE_VALUE;
+    *PBtl = (UINT32)-1;
+
+    if (0 == WideCharToMultiByte(CP_UTF8, 0, Name, -1, NameBuf, sizeof NameBuf, 0, 0))
+    {
+        Error = ERROR_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    Error = SpdSocketStartup();
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+    Startup = TRUE;
+
+    SocketUnit = MemAlloc(sizeof *SocketUnit);
+    if (0 == SocketUnit)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+    memset(SocketUnit, 0, sizeof *SocketUnit);
+    memcpy(&SocketUnit->StorageUnitParams, StorageUnitParams, sizeof *StorageUnitParams);
+    SocketUnit->Listener = SPD_SOCKET_INVALID;
+    SocketUnit->Socket = SPD_SOCKET_INVALID;
+    InitializeSRWLock(&SocketUnit->ReceiveLock);
+    InitializeSRWLock(&SocketUnit->SendLock);
+
+    Error = SpdHintMapInitialize(&SocketUnit->HintMap, SPD_SOCKET_QUEUE_DEPTH);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    Error = SpdSocketOpen(NameBuf, TRUE, &SocketUnit->Listener);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    /* a socket serves a single storage unit */
+    *PHandle = SetSocketHandle(SocketUnit);
+    *PBtl = SPD_BTL_FROM_INDEX(0);
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (ERROR_SUCCESS != Error)
+    {
+        if (0 != SocketUnit)
+        {
+            SpdHintMapFinalize(&SocketUnit->HintMap);
+            MemFree(SocketUnit);
+        }
+
+        if (Startup)
+            SpdSocketCleanup();
+    }
+
+    return Error;
+}
+
+static VOID SpdStorageUnitSocketDisconnect(SOCKET_UNIT *SocketUnit, LONG Connected)
+{
+    AcquireSRWLockExclusive(&SocketUnit->SendLock);
+    if (Connected == SocketUnit->Connected)
+    {
+        /* the socket is closed when it is replaced; senders may still hold it */
+        SpdSocketShutdown(SocketUnit->Socket);
+        SocketUnit->Connected = -SocketUnit->Connected;
+    }
+    ReleaseSRWLockExclusive(&SocketUnit->SendLock);
+}
+
+static DWORD SpdStorageUnitSocketConnect(SOCKET_UNIT *SocketUnit)
+{
+    SPD_SOCKET Socket = SPD_SOCKET_INVALID;
+    UINT64 Buffer[SPD_SOCKET_FRAME_HEADER_SIZE / sizeof(UINT64)];
+    SPD_FRAME Frame;
+    UINT8 Version;
+    DWORD Error;
+
+    /* called with the ReceiveLock held, so only we change Connected from <= 0 */
+    Error = SpdSocketAccept(SocketUnit->Listener, &Socket);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    Error = SpdSocketSendFrame(Socket, SPD_FRAME_VERSION, SpdFrameHelloType, 0, 0, 0);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+    Error = SpdSocketSend(Socket,
+        &SocketUnit->StorageUnitParams, sizeof SocketUnit->StorageUnitParams);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    Error = SpdSocketRecvFrameHeader(Socket,
+        SocketUnit->StorageUnitParams.BlockLength, SocketUnit->StorageUnitParams.MaxTransferLength,
+        Buffer, &Frame);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+    if (SpdFrameHelloType != Frame.Type)
+    {
+        Error = ERROR_INVALID_DATA;
+        goto exit;
+    }
+    Version = SPD_FRAME_VERSION < Frame.Version ? SPD_FRAME_VERSION : Frame.Version;
+
+    AcquireSRWLockExclusive(&SocketUnit->SendLock);
+    if (SPD_SOCKET_INVALID != SocketUnit->Socket)
+        SpdSocketClose(SocketUnit->Socket);
+    SocketUnit->Socket = Socket;
+    SocketUnit->Version = Version;
+    SocketUnit->Connected = -SocketUnit->Connected;
+    SocketUnit->Connected++;
+    ReleaseSRWLockExclusive(&SocketUnit->SendLock);
+    Socket = SPD_SOCKET_INVALID;
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (SPD_SOCKET_INVALID != Socket)
+        SpdSocketClose(Socket);
+
+    return Error;
+}
+
+static DWORD SpdStorageUnitSocketSend(SOCKET_UNIT *SocketUnit,
+    SPD_IOCTL_TRANSACT_RSP *Rsp, PVOID DataBuffer)
+{
+    SPD_IOCTL_TRANSACT_RSP MsgRsp;
+    UINT64 Value;
+    ULONG DataLength;
+    LONG Connected;
+    DWORD Error;
+
+    /* a response without a request (e.g. after a reconnect) has nowhere to go */
+    if (!SpdHintMapTake(&SocketUnit->HintMap, Rsp->Hint, &Value))
+        return ERROR_SUCCESS;
+
+    /* the client gets its own hint back */
+    memcpy(&MsgRsp, Rsp, sizeof MsgRsp);
+    MsgRsp.Hint = SpdHintMapHint(Rsp->Hint,
+        SPD_SOCKET_HINT_SOURCE(SPD_SOCKET_HINT_GENERATION(Value)));
+    Rsp = &MsgRsp;
+
+    DataLength = SpdIoctlTransactReadKind == Rsp->Kind && 0 != DataBuffer ?
+        SPD_SOCKET_HINT_DATALENGTH(Value) : 0;
+
+    Error = ERROR_SUCCESS;
+    AcquireSRWLockExclusive(&SocketUnit->SendLock);
+    Connected = SocketUnit->Connected;
+    if (0 < Connected && SPD_SOCKET_HINT_GENERATION(Value) == Connected)
+        Error = SpdSocketSendFrame(SocketUnit->Socket,
+            SocketUnit->Version, SpdFrameRspType, Rsp, DataBuffer, DataLength);
+    ReleaseSRWLockExclusive(&SocketUnit->SendLock);
+
+    if (ERROR_SUCCESS != Error)
+        SpdStorageUnitSocketDisconnect(SocketUnit, Connected);
+
+    return SocketUnit->Stopped ? ERROR_OPERATION_ABORTED : ERROR_SUCCESS;
+}
+
+static DWORD SpdStorageUnitSocketReceive(SOCKET_UNIT *SocketUnit,
+    SPD_IOCTL_TRANSACT_REQ *Req, PVOID DataBuffer)
+{
+    ULONG BlockLength = SocketUnit->StorageUnitParams.BlockLength;
+    ULONG MaxTransferLength = SocketUnit->StorageUnitParams.MaxTransferLength;
+    UINT64 Buffer[SPD_SOCKET_FRAME_HEADER_SIZE / sizeof(UINT64)];
+    SPD_IOCTL_TRANSACT_REQ *MsgReq;
+    SPD_FRAME Frame;
+    ULONG ReadLength;
+    LONG Connected;
+    DWORD Error;
+
+    memset(Req, 0, sizeof *Req);
+
+    AcquireSRWLockExclusive(&SocketUnit->ReceiveLock);
+
+    if (0 >= SocketUnit->Connected)
+    {
+        Error = SpdStorageUnitSocketConnect(SocketUnit);
+        if (ERROR_SUCCESS != Error)
+            goto exit;
+    }
+    Connected = SocketUnit->Connected;
+
+    /*
+     * The ReceiveLock keeps other receivers off the socket and Connected > 0 keeps it
+     * from being replaced, so we may use it without the SendLock.
+     */
+    Error = SpdSocketRecvFrameHeader(SocketUnit->Socket, BlockLength, MaxTransferLength,
+        Buffer, &Frame);
+    if (ERROR_SUCCESS != Error)
+        goto disconnect;
+    if (SpdFrameReqType != Frame.Type)
+    {
+        Error = ERROR_INVALID_DATA;
+        goto disconnect;
+    }
+    MsgReq = Frame.Message;
+
+    ReadLength = 0;
+    if (SpdIoctlTransactReadKind == MsgReq->Kind)
+    {
+        if ((UINT64)MsgReq->Op.Read.BlockCount * BlockLength > MaxTransferLength)
+        {
+            Error = ERROR_INVALID_DATA;
+            goto disconnect;
+        }
+        ReadLength = MsgReq->Op.Read.BlockCount * BlockLength;
+    }
+
+    /* the data go straight into the dispatcher buffer */
+    Error = SpdSocketRecv(SocketUnit->Socket, DataBuffer, Frame.DataLength);
+    if (ERROR_SUCCESS != Error)
+        goto disconnect;
+
+    /* hints identify requests on a framed connection: duplicates are errors */
+    if (!SpdHintMapPut(&SocketUnit->HintMap,
+        SpdHintMapKey(MsgReq->Hint, SPD_SOCKET_HINT_SOURCE(Connected)),
+        SPD_SOCKET_HINT_VALUE(Connected, ReadLength)))
+    {
+        Error = ERROR_INVALID_DATA;
+        goto disconnect;
+    }
+
+    memcpy(Req, MsgReq, sizeof *Req);
+    Req->Hint = SpdHintMapKey(MsgReq->Hint, SPD_SOCKET_HINT_SOURCE(Connected));
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    ReleaseSRWLockExclusive(&SocketUnit->ReceiveLock);
+
+    if (SocketUnit->Stopped)
+        return ERROR_OPERATION_ABORTED;
+
+    /* connection errors are not dispatcher errors: the next receive reconnects */
+    return ERROR_SUCCESS;
+
+disconnect:
+    SpdStorageUnitSocketDisconnect(SocketUnit, Connected);
+    goto exit;
+}
+
+static DWORD SpdStorageUnitHandleTransactSocket(HANDLE Handle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    PVOID DataBuffer)
+{
+    SOCKET_UNIT *SocketUnit = Handle;
+    DWORD Error;
+
+    if ((0 == Req && 0 == Rsp) ||
+        (0 != Req && 0 == DataBuffer) ||
+        SPD_BTL_FROM_INDEX(0) != Btl)
+        return ERROR_INVALID_PARAMETER;
+
+    if (0 != Rsp)
+    {
+        Error = SpdStorageUnitSocketSend(SocketUnit, Rsp, DataBuffer);
+        if (ERROR_SUCCESS != Error)
+            return Error;
+    }
+
+    if (0 != Req)
+    {
+        Error = SpdStorageUnitSocketReceive(SocketUnit, Req, DataBuffer);
+        if (ERROR_SUCCESS != Error)
+            return Error;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static VOID SpdStorageUnitHandleCorkSocket(HANDLE Handle, BOOLEAN Cork)
+{
+    SOCKET_UNIT *SocketUnit = Handle;
+
+    AcquireSRWLockExclusive(&SocketUnit->SendLock);
+    if (0 < SocketUnit->Connected)
+        SpdSocketCork(SocketUnit->Socket, Cork);
+    ReleaseSRWLockExclusive(&SocketUnit->SendLock);
+}
+
+static DWORD SpdStorageUnitHandleShutdownSocket(HANDLE Handle,
+    const GUID *Guid)
+{
+    SOCKET_UNIT *SocketUnit = Handle;
+
+    if (!SpdUnitTableGuidEqual(Guid, &SocketUnit->StorageUnitParams.Guid))
+        return ERROR_FILE_NOT_FOUND;
+
+    SocketUnit->Stopped = TRUE;
+
+    /*
+     * Wake up the threads blocked on the sockets. Shutting down a listening socket
+     * does not wake up accept on Windows, so the listener is closed here instead.
+     */
+    AcquireSRWLockExclusive(&SocketUnit->SendLock);
+    if (SPD_SOCKET_INVALID != SocketUnit->Socket)
+        SpdSocketShutdown(SocketUnit->Socket);
+    ReleaseSRWLockExclusive(&SocketUnit->SendLock);
+    SpdSocketClose(SocketUnit->Listener);
+
+    return ERROR_SUCCESS;
+}
+
+static DWORD SpdStorageUnitHandleCloseSocket(HANDLE Handle)
+{
+    SOCKET_UNIT *SocketUnit = Handle;
+
+    if (SPD_SOCKET_INVALID != SocketUnit->Socket)
+        SpdSocketClose(SocketUnit->Socket);
+    if (!SocketUnit->Stopped)
+        SpdSocketClose(SocketUnit->Listener);
+    SpdHintMapFinalize(&SocketUnit->HintMap);
+    MemFree(SocketUnit);
+
+    SpdSocketCleanup();
+
+    return ERROR_SUCCESS;
+}
+
 static DWORD SpdStorageUnitHandleOpenDevice(PWSTR Name,
     const SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams,
     PHANDLE PHandle, PUINT32 PBtl)
@@ -536,6 +1131,11 @@ DWORD SpdStorageUnitHandleOpen(PWSTR Name,
         L'e'  == Name[7] &&
         L'\\' == Name[8])
         return SpdStorageUnitHandleOpenPipe(Name, StorageUnitParams, PHandle, PBtl);
+    else if (
+        (L't' == Name[0] && L'c' == Name[1] && L'p' == Name[2] && L':' == Name[3]) ||
+        (L'u' == Name[0] && L'n' == Name[1] && L'i' == Name[2] && L'x' == Name[3] &&
+            L':' == Name[4]))
+        return SpdStorageUnitHandleOpenSocket(Name, StorageUnitParams, PHandle, PBtl);
     else
         return SpdStorageUnitHandleOpenDevice(Name, StorageUnitParams, PHandle, PBtl);
 }
@@ -544,19 +1144,184 @@ DWORD SpdStorageUnitHandleTransact(HANDLE Handle,
     UINT32 Btl,
     SPD_IOCTL_TRANSACT_RSP *Rsp,
     SPD_IOCTL_TRANSACT_REQ *Req,
-    PVOID DataBuffer)
+    PVOID DataBuffer,
+    UINT32 DataBufferIndex,
+    PVOID *PReqDataBuffer)
 {
     if (IsPipeHandle(Handle))
+    {
+        /* pipes always copy */
+        if (0 != PReqDataBuffer)
+            *PReqDataBuffer = DataBuffer;
         return SpdStorageUnitHandleTransactPipe(GetPipeHandle(Handle), Btl, Rsp, Req, DataBuffer);
+    }
+    else if (IsSocketHandle(Handle))
+    {
+        /* socket data are received directly into DataBuffer */
+        if (0 != PReqDataBuffer)
+            *PReqDataBuffer = DataBuffer;
+        return SpdStorageUnitHandleTransactSocket(GetSocketHandle(Handle), Btl, Rsp, Req, DataBuffer);
+    }
+    else if (0 != PReqDataBuffer)
+        return SpdIoctlTransactMapped(GetDeviceHandle(Handle), Btl, Rsp, Req,
+            DataBuffer, DataBufferIndex, PReqDataBuffer);
+    else if ((UINT32)-1 != DataBufferIndex)
+        return SpdIoctlTransactRegistered(GetDeviceHandle(Handle), Btl, Rsp, Req, DataBufferIndex);
     else
         return SpdIoctlTransact(GetDeviceHandle(Handle), Btl, Rsp, Req, DataBuffer);
 }
 
+static DWORD SpdStorageUnitHandleTransactBatchEmulated(HANDLE Handle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_BATCH_PARAMS *Params,
+    UINT32 Count,
+    PVOID DataBuffer,
+    ULONG MaxTransferLength,
+    DWORD (*Transact)(HANDLE, UINT32, SPD_IOCTL_TRANSACT_RSP *, SPD_IOCTL_TRANSACT_REQ *, PVOID),
+    VOID (*Cork)(HANDLE, BOOLEAN))
+{
+    SPD_IOCTL_TRANSACT_BATCH_ENTRY *ReqEntry = 0;
+    PVOID ReqDataBuffer = 0;
+    DWORD Error;
+
+    /*
+     * The pipe and socket protocols carry a single request per message, so we
+     * emulate batching: deliver all responses and then receive one request.
+     */
+
+    if (0 != Cork)
+        Cork(Handle, TRUE);
+
+    for (UINT32 I = 0; Count > I; I++)
+    {
+        SPD_IOCTL_TRANSACT_BATCH_ENTRY *Entry = &Params->Entries[I];
+        PVOID EntryDataBuffer = (PUINT8)DataBuffer + (UINT_PTR)I * MaxTransferLength;
+
+        if (Entry->RspValid)
+        {
+            Entry->RspValid = 0;
+            Error = Transact(Handle, Btl,
+                &Entry->Dir.Rsp, 0, EntryDataBuffer);
+            if (ERROR_SUCCESS != Error)
+                goto exit;
+        }
+
+        if (Entry->ReqValid)
+        {
+            Entry->ReqValid = 0;
+            if (0 == ReqEntry)
+            {
+                ReqEntry = Entry;
+                ReqDataBuffer = EntryDataBuffer;
+            }
+        }
+    }
+
+    if (0 != Cork)
+    {
+        Cork(Handle, FALSE);
+        Cork = 0;
+    }
+
+    if (0 != ReqEntry)
+    {
+        Error = Transact(Handle, Btl,
+            0, &ReqEntry->Dir.Req, ReqDataBuffer);
+        if (ERROR_SUCCESS != Error)
+            goto exit;
+
+        ReqEntry->ReqValid = 0 != ReqEntry->Dir.Req.Hint;
+    }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (0 != Cork)
+        Cork(Handle, FALSE);
+
+    return Error;
+}
+
+DWORD SpdStorageUnitHandleTransactBatch(HANDLE Handle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_BATCH_PARAMS *Params,
+    UINT32 Count,
+    PVOID DataBuffer,
+    UINT32 DataBufferIndex)
+{
+    if (IsPipeHandle(Handle))
+        return SpdStorageUnitHandleTransactBatchEmulated(GetPipeHandle(Handle),
+            Btl, Params, Count, DataBuffer,
+            ((STORAGE_UNIT *)GetPipeHandle(Handle))->StorageUnitParams.MaxTransferLength,
+            SpdStorageUnitHandleTransactPipe, 0);
+    else if (IsSocketHandle(Handle))
+        return SpdStorageUnitHandleTransactBatchEmulated(GetSocketHandle(Handle),
+            Btl, Params, Count, DataBuffer,
+            ((SOCKET_UNIT *)GetSocketHandle(Handle))->StorageUnitParams.MaxTransferLength,
+            SpdStorageUnitHandleTransactSocket, SpdStorageUnitHandleCorkSocket);
+    else if ((UINT32)-1 != DataBufferIndex)
+        return SpdIoctlTransactBatchRegistered(GetDeviceHandle(Handle),
+            Btl, Params, Count, DataBufferIndex);
+    else
+        return SpdIoctlTransactBatch(GetDeviceHandle(Handle), Btl, Params, Count, DataBuffer);
+}
+
+DWORD SpdStorageUnitHandleRegisterBuffer(HANDLE Handle,
+    UINT32 Btl,
+    PVOID Buffer,
+    UINT32 BufferSize,
+    PUINT32 PIndex)
+{
+    if (IsPipeHandle(Handle) || IsSocketHandle(Handle))
+    {
+        /* pipe and socket transacts move data through user mode; there is nothing to lock */
+        *PIndex = (UINT32)-1;
+        return ERROR_NOT_SUPPORTED;
+    }
+    else
+        return SpdIoctlRegisterBuffer(GetDeviceHandle(Handle), Btl, Buffer, BufferSize, PIndex);
+}
+
+DWORD SpdStorageUnitHandleUnregisterBuffer(HANDLE Handle,
+    UINT32 Btl,
+    UINT32 Index)
+{
+    if (IsPipeHandle(Handle) || IsSocketHandle(Handle))
+        return ERROR_NOT_SUPPORTED;
+    else
+        return SpdIoctlUnregisterBuffer(GetDeviceHandle(Handle), Btl, Index);
+}
+
+DWORD SpdStorageUnitHandleRingSetup(HANDLE Handle,
+    UINT32 Btl,
+    UINT32 Capacity,
+    PVOID Buffer,
+    UINT64 BufferSize,
+    HANDLE Event)
+{
+    if (IsPipeHandle(Handle) || IsSocketHandle(Handle))
+        /* rings live in memory shared with the driver; there is no driver to share with */
+        return ERROR_NOT_SUPPORTED;
+    else
+        return SpdIoctlRingSetup(GetDeviceHandle(Handle), Btl, Capacity, Buffer, BufferSize, Event);
+}
+
+DWORD SpdStorageUnitHandleRingDoorbell(HANDLE Handle,
+    UINT32 Btl)
+{
+    if (IsPipeHandle(Handle) || IsSocketHandle(Handle))
+        return ERROR_NOT_SUPPORTED;
+    else
+        return SpdIoctlRingDoorbell(GetDeviceHandle(Handle), Btl);
+}
+
 DWORD SpdStorageUnitHandleShutdown(HANDLE Handle,
     const GUID *Guid)
 {
     if (IsPipeHandle(Handle))
         return SpdStorageUnitHandleShutdownPipe(GetPipeHandle(Handle), Guid);
+    else if (IsSocketHandle(Handle))
+        return SpdStorageUnitHandleShutdownSocket(GetSocketHandle(Handle), Guid);
     else
         return SpdIoctlUnprovision(GetDeviceHandle(Handle), Guid);
 }
@@ -565,6 +1330,8 @@ DWORD SpdStorageUnitHandleClose(HANDLE Handle)
 {
     if (IsPipeHandle(Handle))
         return SpdStorageUnitHandleClosePipe(GetPipeHandle(Handle));
+    else if (IsSocketHandle(Handle))
+        return SpdStorageUnitHandleCloseSocket(GetSocketHandle(Handle));
     else
         return CloseHandle(GetDeviceHandle(Handle)) ? 0 : GetLastError();
 }
@@ -20,6 +20,11 @@
  */
 
 #include <shared/shared.h>
+#include <shared/reqpool.h>
+#include <shared/bufpool.h>
+#include <shared/wbcache.h>
+#include <shared/unmap.h>
+#include <shared/ring.h>
 
 DWORD SpdStorageUnitHandleOpen(PWSTR Name,
     const SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams,
@@ -28,31 +33,117 @@ DWORD SpdStorageUnitHandleTransact(HANDLE Handle,
     UINT32 Btl,
     SPD_IOCTL_TRANSACT_RSP *Rsp,
     SPD_IOCTL_TRANSACT_REQ *Req,
-    PVOID DataBuffer);
+    PVOID DataBuffer,
+    UINT32 DataBufferIndex,
+    PVOID *PReqDataBuffer);
+DWORD SpdStorageUnitHandleTransactBatch(HANDLE Handle,
+    UINT32 Btl,
+    SPD_IOCTL_TRANSACT_BATCH_PARAMS *Params,
+    UINT32 Count,
+    PVOID DataBuffer,
+    UINT32 DataBufferIndex);
+DWORD SpdStorageUnitHandleRegisterBuffer(HANDLE Handle,
+    UINT32 Btl,
+    PVOID Buffer,
+    UINT32 BufferSize,
+    PUINT32 PIndex);
+DWORD SpdStorageUnitHandleUnregisterBuffer(HANDLE Handle,
+    UINT32 Btl,
+    UINT32 Index);
+DWORD SpdStorageUnitHandleRingSetup(HANDLE Handle,
+    UINT32 Btl,
+    UINT32 Capacity,
+    PVOID Buffer,
+    UINT64 BufferSize,
+    HANDLE Event);
+DWORD SpdStorageUnitHandleRingDoorbell(HANDLE Handle,
+    UINT32 Btl);
 DWORD SpdStorageUnitHandleShutdown(HANDLE Handle,
     const GUID *Guid);
 DWORD SpdStorageUnitHandleClose(HANDLE Handle);
 
 static SPD_STORAGE_UNIT_INTERFACE SpdStorageUnitNullInterface;
+static SPD_STORAGE_UNIT_INTERFACE SpdStorageUnitCacheInterface;
+
+struct _SPD_STORAGE_UNIT_ASYNC_REQUEST
+{
+    SPD_REQUEST_POOL_ENTRY PoolEntry;
+    SPD_STORAGE_UNIT *StorageUnit;
+    SPD_IOCTL_TRANSACT_REQ Request;
+    SPD_IOCTL_TRANSACT_RSP Response;
+    PVOID DataBuffer;
+};
+typedef struct
+{
+    SPD_REQUEST_POOL Pool;
+    PVOID DataBuffer;
+    SPD_STORAGE_UNIT_ASYNC_REQUEST Requests[];
+} SPD_STORAGE_UNIT_ASYNC_POOL;
+
+#define SPD_STORAGE_UNIT_CACHE_DESTAGE_INTERVAL 1000    /* ms */
+typedef struct
+{
+    SPD_STORAGE_UNIT *StorageUnit;
+    SRWLOCK Lock;                       /* protects Cache */
+    SRWLOCK DestageLock;                /* serializes destaging and unmapping */
+    SPD_WBCACHE Cache;
+    PVOID DestageBuffer;                /* MaxTransferLength bytes; under DestageLock */
+    HANDLE DestageEvent;
+    HANDLE DestageThread;
+    BOOLEAN Stopped;
+} SPD_STORAGE_UNIT_CACHE;
+
+typedef struct
+{
+    PVOID Buffer;                       /* rings and data slots; see shared/ring.h */
+    HANDLE Event;                       /* auto-reset; set when the REQ ring becomes non-empty */
+    SRWLOCK ReqLock;                    /* serializes the dispatcher threads on the REQ ring */
+    SRWLOCK RspLock;                    /* serializes the dispatcher threads on the RSP ring */
+    SPD_RING_PORT ReqPort, RspPort;
+    PUINT8 DataBuffer;
+    ULONG DataStride;
+    ULONG ThreadCount;
+} SPD_STORAGE_UNIT_RING;
 
 static DWORD SpdStorageUnitTlsCount = 0;
 static SRWLOCK SpdStorageUnitTlsLock = SRWLOCK_INIT;
 static DWORD SpdStorageUnitTlsKey = TLS_OUT_OF_INDEXES;
+
+/*
+ * The default buffer allocator takes its buffers from a buffer pool that lives while
+ * any storage unit exists. A dispatcher that is stopped and restarted, or a storage unit
+ * that is deleted and created again, reuses the buffers of the one before it.
+ */
+static SPD_BUFFER_POOL SpdStorageUnitBufferPool;
+static PVOID SpdStorageUnitBufferAlloc(size_t Size)
+{
+    return SpdBufferPoolAlloc(&SpdStorageUnitBufferPool, Size);
+}
+static VOID SpdStorageUnitBufferFree(PVOID Buffer)
+{
+    SpdBufferPoolFree(&SpdStorageUnitBufferPool, Buffer);
+}
 static VOID WINAPI SpdStorageUnitTlsInit(VOID)
 {
     AcquireSRWLockExclusive(&SpdStorageUnitTlsLock);
     if (1 == ++SpdStorageUnitTlsCount)
+    {
         SpdStorageUnitTlsKey = TlsAlloc();
+        SpdBufferPoolInitialize(&SpdStorageUnitBufferPool);
+    }
     ReleaseSRWLockExclusive(&SpdStorageUnitTlsLock);
 }
 static VOID SpdStorageUnitTlsFini(VOID)
 {
     AcquireSRWLockExclusive(&SpdStorageUnitTlsLock);
-    if (0 == --SpdStorageUnitTlsCount &&
-        TLS_OUT_OF_INDEXES != SpdStorageUnitTlsKey)
+    if (0 == --SpdStorageUnitTlsCount)
     {
-        TlsFree(SpdStorageUnitTlsKey);
-        SpdStorageUnitTlsKey = TLS_OUT_OF_INDEXES;
+        if (TLS_OUT_OF_INDEXES != SpdStorageUnitTlsKey)
+        {
+            TlsFree(SpdStorageUnitTlsKey);
+            SpdStorageUnitTlsKey = TLS_OUT_OF_INDEXES;
+        }
+        SpdBufferPoolFinalize(&SpdStorageUnitBufferPool);
     }
     ReleaseSRWLockExclusive(&SpdStorageUnitTlsLock);
 }
@@ -99,7 +190,8 @@ DWORD SpdStorageUnitCreate(
     StorageUnit->Interface = Interface;
     StorageUnit->Handle = Handle;
     StorageUnit->Btl = Btl;
-    SpdStorageUnitSetBufferAllocator(StorageUnit, MemAlloc, MemFree);
+    SpdStorageUnitSetBufferAllocator(StorageUnit,
+        SpdStorageUnitBufferAlloc, SpdStorageUnitBufferFree);
 
     *PStorageUnit = StorageUnit;
 
@@ -128,27 +220,861 @@ VOID SpdStorageUnitShutdown(SPD_STORAGE_UNIT *StorageUnit)
     SpdStorageUnitHandleShutdown(StorageUnit->Handle, &StorageUnit->StorageUnitParams.Guid);
 }
 
+static BOOLEAN SpdStorageUnitDispatchRequest(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_IOCTL_TRANSACT_REQ *Request, SPD_IOCTL_TRANSACT_RSP *Response, PVOID DataBuffer)
+{
+    /* the write-back cache calls the storage unit interface itself */
+    const SPD_STORAGE_UNIT_INTERFACE *Interface = 0 != StorageUnit->WriteBackCache ?
+        &SpdStorageUnitCacheInterface : StorageUnit->Interface;
+    UINT32 Count;
+    BOOLEAN Complete;
+
+    if (StorageUnit->DebugLog)
+    {
+        if (SpdIoctlTransactKindCount <= Request->Kind ||
+            (StorageUnit->DebugLog & (1 << Request->Kind)))
+            SpdDebugLogRequest(Request);
+    }
+
+    memset(Response, 0, sizeof *Response);
+    Response->Hint = Request->Hint;
+    Response->Kind = Request->Kind;
+    switch (Request->Kind)
+    {
+    case SpdIoctlTransactReadKind:
+        if (0 == StorageUnit->Interface->Read)
+            goto invalid;
+        Complete = Interface->Read(
+            StorageUnit,
+            DataBuffer,
+            Request->Op.Read.BlockAddress,
+            Request->Op.Read.BlockCount,
+            Request->Op.Read.ForceUnitAccess,
+            &Response->Status);
+        break;
+    case SpdIoctlTransactWriteKind:
+        if (0 == StorageUnit->Interface->Write)
+            goto invalid;
+        Complete = Interface->Write(
+            StorageUnit,
+            DataBuffer,
+            Request->Op.Write.BlockAddress,
+            Request->Op.Write.BlockCount,
+            Request->Op.Write.ForceUnitAccess,
+            &Response->Status);
+        break;
+    case SpdIoctlTransactFlushKind:
+        if (0 == Interface->Flush)
+            goto invalid;
+        Complete = Interface->Flush(
+            StorageUnit,
+            Request->Op.Flush.BlockAddress,
+            Request->Op.Flush.BlockCount,
+            &Response->Status);
+        break;
+    case SpdIoctlTransactUnmapKind:
+        if (0 == StorageUnit->Interface->Unmap)
+            goto invalid;
+        /* sort, merge and align the descriptors in place; there may be none left */
+        Count = SpdUnmapCompact(
+            DataBuffer,
+            Request->Op.Unmap.Count,
+            StorageUnit->StorageUnitParams.UnmapGranularity,
+            StorageUnit->StorageUnitParams.BlockCount);
+        if (0 == Count)
+        {
+            Complete = TRUE;
+            break;
+        }
+        Complete = Interface->Unmap(
+            StorageUnit,
+            DataBuffer,
+            Count,
+            &Response->Status);
+        break;
+    default:
+    invalid:
+        SpdStorageUnitStatusSetSense(&Response->Status,
+            SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_COMMAND, 0);
+        Complete = TRUE;
+        break;
+    }
+
+    if (Complete && StorageUnit->DebugLog)
+    {
+        if (SpdIoctlTransactKindCount <= Response->Kind ||
+            (StorageUnit->DebugLog & (1 << Response->Kind)))
+            SpdDebugLogResponse(Response);
+    }
+
+    return Complete;
+}
+
+static DWORD SpdStorageUnitDispatchBatch(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_OPERATION_CONTEXT *OperationContext,
+    SPD_IOCTL_TRANSACT_BATCH_PARAMS *BatchParams, ULONG BatchSize,
+    PVOID DataBuffer, UINT32 DataBufferIndex)
+{
+    ULONG MaxTransferLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    SPD_IOCTL_TRANSACT_BATCH_ENTRY *Entry;
+    DWORD Error;
+
+    memset(BatchParams, 0, SPD_IOCTL_TRANSACT_BATCH_PARAMS_SIZE(BatchSize));
+    for (ULONG I = 0; BatchSize > I; I++)
+        BatchParams->Entries[I].ReqValid = 1;
+
+    for (;;)
+    {
+        Error = SpdStorageUnitHandleTransactBatch(StorageUnit->Handle,
+            StorageUnit->Btl, BatchParams, BatchSize, DataBuffer, DataBufferIndex);
+        if (ERROR_SUCCESS != Error)
+            return Error;
+
+        for (ULONG I = 0; BatchSize > I; I++)
+        {
+            Entry = &BatchParams->Entries[I];
+            if (!Entry->ReqValid)
+            {
+                /* slot is idle: offer it again */
+                Entry->ReqValid = 1;
+                continue;
+            }
+
+            /* the request and response share storage in the entry */
+            memcpy(OperationContext->Request, &Entry->Dir.Req, sizeof Entry->Dir.Req);
+            OperationContext->DataBuffer = (PUINT8)DataBuffer + (UINT_PTR)I * MaxTransferLength;
+
+            if (SpdStorageUnitDispatchRequest(StorageUnit,
+                OperationContext->Request, OperationContext->Response,
+                OperationContext->DataBuffer))
+            {
+                memcpy(&Entry->Dir.Rsp, OperationContext->Response, sizeof Entry->Dir.Rsp);
+                Entry->RspValid = 1;
+            }
+        }
+    }
+}
+
+static DWORD SpdStorageUnitAsyncPoolCreate(SPD_STORAGE_UNIT *StorageUnit, ULONG Depth,
+    SPD_STORAGE_UNIT_ASYNC_POOL **PAsyncPool)
+{
+    ULONG MaxTransferLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    SPD_STORAGE_UNIT_ASYNC_POOL *AsyncPool;
+
+    *PAsyncPool = 0;
+
+    if ((SIZE_MAX - sizeof *AsyncPool) / sizeof AsyncPool->Requests[0] < Depth ||
+        SIZE_MAX / MaxTransferLength < Depth)
+        return ERROR_INVALID_PARAMETER;
+
+    AsyncPool = MemAlloc(sizeof *AsyncPool + Depth * sizeof AsyncPool->Requests[0]);
+    if (0 == AsyncPool)
+        return ERROR_NO_SYSTEM_RESOURCES;
+    memset(AsyncPool, 0, sizeof *AsyncPool + Depth * sizeof AsyncPool->Requests[0]);
+
+    AsyncPool->DataBuffer = StorageUnit->BufferAlloc((size_t)Depth * MaxTransferLength);
+    if (0 == AsyncPool->DataBuffer)
+    {
+        MemFree(AsyncPool);
+        return ERROR_NO_SYSTEM_RESOURCES;
+    }
+
+    SpdRequestPoolInitialize(&AsyncPool->Pool);
+    for (ULONG I = 0; Depth > I; I++)
+    {
+        SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest = &AsyncPool->Requests[I];
+        AsyncRequest->StorageUnit = StorageUnit;
+        AsyncRequest->DataBuffer = (PUINT8)AsyncPool->DataBuffer + (size_t)I * MaxTransferLength;
+        SpdRequestPoolAdd(&AsyncPool->Pool, &AsyncRequest->PoolEntry);
+    }
+
+    *PAsyncPool = AsyncPool;
+
+    return ERROR_SUCCESS;
+}
+
+static VOID SpdStorageUnitAsyncPoolDelete(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_ASYNC_POOL *AsyncPool)
+{
+    StorageUnit->BufferFree(AsyncPool->DataBuffer);
+    MemFree(AsyncPool);
+}
+
+/*
+ * Write-back cache (see shared/wbcache.h)
+ *
+ * Lock order: DestageLock, then Lock. The DestageLock is held across the storage unit
+ * Write's of destaging and Unmap's, so that there is only one run in flight and so that
+ * the backend never sees a destage Write race with an Unmap or with another Write of the
+ * same blocks. Reads from the backend do not take the DestageLock, but they wait for the
+ * dirty blocks of their range to be destaged first.
+ */
+static SPD_STORAGE_UNIT_ASYNC_REQUEST *SpdStorageUnitCacheEnter(VOID)
+{
+    SPD_STORAGE_UNIT_OPERATION_CONTEXT *OperationContext = SpdStorageUnitGetOperationContext();
+    SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest = 0;
+
+    /* the cache calls the storage unit interface synchronously: hide any async request */
+    if (0 != OperationContext)
+    {
+        AsyncRequest = OperationContext->AsyncRequest;
+        OperationContext->AsyncRequest = 0;
+    }
+
+    return AsyncRequest;
+}
+
+static VOID SpdStorageUnitCacheLeave(SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest)
+{
+    SPD_STORAGE_UNIT_OPERATION_CONTEXT *OperationContext = SpdStorageUnitGetOperationContext();
+
+    if (0 != OperationContext)
+        OperationContext->AsyncRequest = AsyncRequest;
+}
+
+/* the cache needs the result of every operation that it calls: one that is pending failed */
+static VOID SpdStorageUnitCacheComplete(BOOLEAN Complete, SPD_STORAGE_UNIT_STATUS *Status)
+{
+    if (!Complete)
+        SpdStorageUnitStatusSetSense(Status,
+            SCSI_SENSE_HARDWARE_ERROR, SCSI_ADSENSE_INTERNAL_TARGET_FAILURE, 0);
+}
+
+/*
+ * Destage the dirty blocks of a range (BlockCount 0: any) until at most LowWater remain.
+ * With Flush the range is then flushed, even if none of its blocks were dirty: the destage
+ * thread may have written them moments ago, but it does not make them durable.
+ */
+static BOOLEAN SpdStorageUnitCacheDestage(SPD_STORAGE_UNIT_CACHE *Cache,
+    UINT64 BlockAddress, UINT64 BlockCount, BOOLEAN Flush, ULONG LowWater,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    SPD_STORAGE_UNIT *StorageUnit = Cache->StorageUnit;
+    SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest;
+    SPD_STORAGE_UNIT_STATUS RunStatus;
+    UINT64 RunAddress;
+    UINT32 RunCount;
+    BOOLEAN Found, Success = TRUE;
+
+    if (!Flush)
+    {
+        AcquireSRWLockExclusive(&Cache->Lock);
+        Found = LowWater < SpdWbcacheDirtyCount(&Cache->Cache) &&
+            SpdWbcacheDirtyRange(&Cache->Cache, BlockAddress, BlockCount);
+        ReleaseSRWLockExclusive(&Cache->Lock);
+        if (!Found)
+            return TRUE;
+    }
+
+    /* a Flush also waits here for any run in flight, which may hold blocks of its range */
+    AsyncRequest = SpdStorageUnitCacheEnter();
+    AcquireSRWLockExclusive(&Cache->DestageLock);
+
+    for (;;)
+    {
+        AcquireSRWLockExclusive(&Cache->Lock);
+        Found = LowWater < SpdWbcacheDirtyCount(&Cache->Cache) &&
+            SpdWbcacheDestageBegin(&Cache->Cache, BlockAddress, BlockCount,
+                StorageUnit->StorageUnitParams.MaxTransferLength /
+                    StorageUnit->StorageUnitParams.BlockLength,
+                Cache->DestageBuffer, &RunAddress, &RunCount);
+        ReleaseSRWLockExclusive(&Cache->Lock);
+        if (!Found)
+            break;
+
+        memset(&RunStatus, 0, sizeof RunStatus);
+        SpdStorageUnitCacheComplete(StorageUnit->Interface->Write(
+            StorageUnit,
+            Cache->DestageBuffer,
+            RunAddress,
+            RunCount,
+            FALSE,
+            &RunStatus), &RunStatus);
+        Success = SCSISTAT_GOOD == RunStatus.ScsiStatus;
+
+        AcquireSRWLockExclusive(&Cache->Lock);
+        SpdWbcacheDestageEnd(&Cache->Cache, RunAddress, RunCount, Success);
+        ReleaseSRWLockExclusive(&Cache->Lock);
+
+        /* the blocks remain dirty and will be retried; the caller gets the error */
+        if (!Success)
+        {
+            if (0 != Status)
+                memcpy(Status, &RunStatus, sizeof RunStatus);
+            break;
+        }
+    }
+
+    if (Success && Flush)
+    {
+        memset(&RunStatus, 0, sizeof RunStatus);
+        SpdStorageUnitCacheComplete(StorageUnit->Interface->Flush(
+            StorageUnit,
+            BlockAddress,
+            (UINT32)BlockCount,
+            &RunStatus), &RunStatus);
+        Success = SCSISTAT_GOOD == RunStatus.ScsiStatus;
+        if (!Success && 0 != Status)
+            memcpy(Status, &RunStatus, sizeof RunStatus);
+    }
+
+    ReleaseSRWLockExclusive(&Cache->DestageLock);
+    SpdStorageUnitCacheLeave(AsyncRequest);
+
+    return Success;
+}
+
+static DWORD WINAPI SpdStorageUnitCacheDestageThread(PVOID Cache0)
+{
+    SPD_STORAGE_UNIT_CACHE *Cache = Cache0;
+    DWORD WaitResult;
+
+    for (;;)
+    {
+        WaitResult = WaitForSingleObject(Cache->DestageEvent,
+            SPD_STORAGE_UNIT_CACHE_DESTAGE_INTERVAL);
+        if (Cache->Stopped)
+            break;
+
+        /*
+         * When signaled (the cache is half dirty) destage down to a quarter; else destage
+         * everything, which bounds how long data stay in the cache only. On errors we
+         * simply try again on the next round.
+         */
+        SpdStorageUnitCacheDestage(Cache, 0, 0, FALSE,
+            WAIT_TIMEOUT == WaitResult ? 0 : Cache->Cache.EntryCount / 4,
+            0);
+    }
+
+    return 0;
+}
+
+static BOOLEAN SpdStorageUnitCacheRead(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN Flush,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    SPD_STORAGE_UNIT_CACHE *Cache = StorageUnit->WriteBackCache;
+    SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest;
+    UINT64 Generation;
+    BOOLEAN Hit = FALSE;
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+    if (!Flush)
+        Hit = SpdWbcacheRead(&Cache->Cache, BlockAddress, BlockCount, Buffer);
+    ReleaseSRWLockExclusive(&Cache->Lock);
+    if (Hit)
+        return TRUE;
+
+    /* the backend must have the data of any dirty blocks before it is read */
+    if (!SpdStorageUnitCacheDestage(Cache, BlockAddress, BlockCount, FALSE, 0, Status))
+        return TRUE;
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+    Generation = SpdWbcacheGeneration(&Cache->Cache);
+    ReleaseSRWLockExclusive(&Cache->Lock);
+
+    AsyncRequest = SpdStorageUnitCacheEnter();
+    SpdStorageUnitCacheComplete(StorageUnit->Interface->Read(
+        StorageUnit,
+        Buffer,
+        BlockAddress,
+        BlockCount,
+        Flush,
+        Status), Status);
+    SpdStorageUnitCacheLeave(AsyncRequest);
+
+    if (SCSISTAT_GOOD == Status->ScsiStatus)
+    {
+        AcquireSRWLockExclusive(&Cache->Lock);
+        SpdWbcacheFill(&Cache->Cache, Generation, BlockAddress, BlockCount, Buffer);
+        ReleaseSRWLockExclusive(&Cache->Lock);
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN SpdStorageUnitCacheWrite(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN Flush,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    SPD_STORAGE_UNIT_CACHE *Cache = StorageUnit->WriteBackCache;
+    BOOLEAN Written, Signal;
+
+    for (;;)
+    {
+        AcquireSRWLockExclusive(&Cache->Lock);
+        Written = SpdWbcacheWrite(&Cache->Cache, BlockAddress, BlockCount, Buffer);
+        Signal = Cache->Cache.EntryCount / 2 < SpdWbcacheDirtyCount(&Cache->Cache);
+        ReleaseSRWLockExclusive(&Cache->Lock);
+
+        if (Signal)
+            SetEvent(Cache->DestageEvent);
+        if (Written)
+            break;
+
+        /* the cache is full of dirty blocks: destage some of them ourselves */
+        if (!SpdStorageUnitCacheDestage(Cache, 0, 0, FALSE, Cache->Cache.EntryCount / 2, Status))
+            return TRUE;
+    }
+
+    /* FUA: the data must be durable before we complete */
+    if (Flush)
+        SpdStorageUnitCacheDestage(Cache, BlockAddress, BlockCount, TRUE, 0, Status);
+
+    return TRUE;
+}
+
+static BOOLEAN SpdStorageUnitCacheFlush(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT32 BlockCount,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    SPD_STORAGE_UNIT_CACHE *Cache = StorageUnit->WriteBackCache;
+
+    /* a BlockCount of 0 means to the end of the storage unit; we destage all blocks then */
+    SpdStorageUnitCacheDestage(Cache, BlockAddress, BlockCount, TRUE, 0, Status);
+
+    return TRUE;
+}
+
+static BOOLEAN SpdStorageUnitCacheUnmap(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_UNMAP_DESCRIPTOR Descriptors[], UINT32 Count,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    SPD_STORAGE_UNIT_CACHE *Cache = StorageUnit->WriteBackCache;
+    SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest;
+
+    AsyncRequest = SpdStorageUnitCacheEnter();
+    AcquireSRWLockExclusive(&Cache->DestageLock);
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+    for (UINT32 I = 0; Count > I; I++)
+        SpdWbcacheDiscard(&Cache->Cache, Descriptors[I].BlockAddress, Descriptors[I].BlockCount);
+    ReleaseSRWLockExclusive(&Cache->Lock);
+
+    SpdStorageUnitCacheComplete(StorageUnit->Interface->Unmap(
+        StorageUnit,
+        Descriptors,
+        Count,
+        Status), Status);
+
+    ReleaseSRWLockExclusive(&Cache->DestageLock);
+    SpdStorageUnitCacheLeave(AsyncRequest);
+
+    return TRUE;
+}
+
+static SPD_STORAGE_UNIT_INTERFACE SpdStorageUnitCacheInterface =
+{
+    SpdStorageUnitCacheRead,
+    SpdStorageUnitCacheWrite,
+    SpdStorageUnitCacheFlush,
+    SpdStorageUnitCacheUnmap,
+};
+
+static DWORD SpdStorageUnitCacheCreate(SPD_STORAGE_UNIT *StorageUnit, UINT64 CacheSize,
+    SPD_STORAGE_UNIT_CACHE **PCache)
+{
+    ULONG BlockLength = StorageUnit->StorageUnitParams.BlockLength;
+    ULONG MaxTransferLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    SPD_STORAGE_UNIT_CACHE *Cache = 0;
+    UINT64 EntryCount;
+    PVOID Buffer = 0;
+    DWORD Error;
+
+    *PCache = 0;
+
+    /* write-back caching is only safe if the initiator knows to SYNCHRONIZE CACHE */
+    if (!StorageUnit->StorageUnitParams.CacheSupported ||
+        0 == StorageUnit->Interface->Write ||
+        0 == StorageUnit->Interface->Flush ||
+        0 == BlockLength)
+        return ERROR_INVALID_PARAMETER;
+
+    EntryCount = SpdWbcacheEntryCount(CacheSize, BlockLength);
+    if (4 * (MaxTransferLength / BlockLength) > EntryCount || MAXLONG < EntryCount ||
+        SIZE_MAX < SpdWbcacheBufferSize((ULONG)EntryCount, BlockLength))
+        return ERROR_INVALID_PARAMETER;
+
+    Cache = MemAlloc(sizeof *Cache);
+    if (0 == Cache)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+    memset(Cache, 0, sizeof *Cache);
+
+    Buffer = MemAlloc((size_t)SpdWbcacheBufferSize((ULONG)EntryCount, BlockLength));
+    if (0 == Buffer)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+
+    /* destage Write's come from this buffer: get it from the storage unit's allocator */
+    Cache->DestageBuffer = StorageUnit->BufferAlloc(MaxTransferLength);
+    if (0 == Cache->DestageBuffer)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+
+    Cache->StorageUnit = StorageUnit;
+    InitializeSRWLock(&Cache->Lock);
+    InitializeSRWLock(&Cache->DestageLock);
+    SpdWbcacheInitialize(&Cache->Cache, Buffer, (ULONG)EntryCount, BlockLength);
+
+    Cache->DestageEvent = CreateEventW(0, FALSE, FALSE, 0);
+    if (0 == Cache->DestageEvent)
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    Cache->DestageThread = CreateThread(0, 0, SpdStorageUnitCacheDestageThread, Cache, 0, 0);
+    if (0 == Cache->DestageThread)
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    *PCache = Cache;
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (ERROR_SUCCESS != Error && 0 != Cache)
+    {
+        if (0 != Cache->DestageEvent)
+            CloseHandle(Cache->DestageEvent);
+        if (0 != Cache->DestageBuffer)
+            StorageUnit->BufferFree(Cache->DestageBuffer);
+        MemFree(Buffer);
+        MemFree(Cache);
+    }
+
+    return Error;
+}
+
+static VOID SpdStorageUnitCacheDelete(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_CACHE *Cache)
+{
+    Cache->Stopped = TRUE;
+    SetEvent(Cache->DestageEvent);
+    WaitForSingleObject(Cache->DestageThread, INFINITE);
+    CloseHandle(Cache->DestageThread);
+    CloseHandle(Cache->DestageEvent);
+
+    /* there is nobody left to report a failure to; the final Flush follows */
+    SpdStorageUnitCacheDestage(Cache, 0, 0, FALSE, 0, 0);
+
+    StorageUnit->BufferFree(Cache->DestageBuffer);
+    MemFree(Cache->Cache.Data);
+    MemFree(Cache);
+}
+
+static DWORD SpdStorageUnitDispatchAsync(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_OPERATION_CONTEXT *OperationContext,
+    SPD_STORAGE_UNIT_ASYNC_POOL *AsyncPool)
+{
+    SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest = 0;
+    SPD_IOCTL_TRANSACT_RSP *Response = 0;
+    PVOID ReqDataBuffer = 0;
+    BOOLEAN Complete;
+    DWORD Error;
+
+    for (;;)
+    {
+        if (0 == AsyncRequest)
+        {
+            /* wait until there is room for one more request in flight */
+            AsyncRequest = (PVOID)SpdRequestPoolGet(&AsyncPool->Pool);
+            if (0 == AsyncRequest)
+                return ERROR_OPERATION_ABORTED;
+        }
+
+        memset(&AsyncRequest->Request, 0, sizeof AsyncRequest->Request);
+        Error = SpdStorageUnitHandleTransact(StorageUnit->Handle,
+            StorageUnit->Btl, Response, &AsyncRequest->Request, AsyncRequest->DataBuffer, (UINT32)-1,
+            StorageUnit->StorageUnitParams.ZeroCopy ? &ReqDataBuffer : 0);
+        if (ERROR_SUCCESS != Error)
+        {
+            SpdRequestPoolPut(&AsyncPool->Pool, &AsyncRequest->PoolEntry);
+            return Error;
+        }
+
+        if (0 == AsyncRequest->Request.Hint)
+        {
+            Response = 0;
+            continue;
+        }
+
+        OperationContext->Request = &AsyncRequest->Request;
+        OperationContext->Response = &AsyncRequest->Response;
+        OperationContext->DataBuffer = AsyncRequest->DataBuffer;
+        OperationContext->AsyncRequest = AsyncRequest;
+
+        Complete = SpdStorageUnitDispatchRequest(StorageUnit,
+            &AsyncRequest->Request, &AsyncRequest->Response,
+            StorageUnit->StorageUnitParams.ZeroCopy ? ReqDataBuffer : AsyncRequest->DataBuffer);
+
+        /*
+         * SpdStorageUnitBeginAsyncRequest clears OperationContext->AsyncRequest. In that
+         * case the request belongs to the storage unit now and may already have been
+         * completed and reused by another thread, so we must not look at it again.
+         */
+        if (0 == OperationContext->AsyncRequest)
+        {
+            AsyncRequest = 0;
+            Response = 0;
+        }
+        else
+        {
+            OperationContext->AsyncRequest = 0;
+            Response = Complete ? &AsyncRequest->Response : 0;
+        }
+    }
+}
+
+static DWORD SpdStorageUnitRingCreate(SPD_STORAGE_UNIT *StorageUnit, ULONG Capacity,
+    ULONG ThreadCount, SPD_STORAGE_UNIT_RING **PRing)
+{
+    ULONG MaxTransferLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    SPD_STORAGE_UNIT_RING *Ring = 0;
+    SPD_RING_LAYOUT Layout;
+    DWORD Error;
+
+    *PRing = 0;
+
+    /* round down to a power of 2 */
+    if (SPD_IOCTL_RING_CAPACITY_MAX < Capacity)
+        Capacity = SPD_IOCTL_RING_CAPACITY_MAX;
+    while (0 != (Capacity & (Capacity - 1)))
+        Capacity &= Capacity - 1;
+
+    SpdRingGetLayout(Capacity,
+        sizeof(SPD_IOCTL_RING_REQ), sizeof(SPD_IOCTL_RING_RSP), MaxTransferLength, &Layout);
+
+    Ring = MemAlloc(sizeof *Ring);
+    if (0 == Ring)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+    memset(Ring, 0, sizeof *Ring);
+    InitializeSRWLock(&Ring->ReqLock);
+    InitializeSRWLock(&Ring->RspLock);
+    Ring->DataStride = MaxTransferLength;
+    Ring->ThreadCount = ThreadCount;
+
+    /* the driver wants the ring page aligned */
+    Ring->Buffer = VirtualAlloc(0, (SIZE_T)Layout.Size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (0 == Ring->Buffer)
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    Ring->Event = CreateEventW(0, FALSE, FALSE, 0);
+    if (0 == Ring->Event)
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+
+    /* the driver initializes the shared indices; the ports only need their own */
+    SpdRingPortInitialize(&Ring->ReqPort,
+        (PVOID)((PUINT8)Ring->Buffer + Layout.ReqRingOffset),
+        (PUINT8)Ring->Buffer + Layout.ReqEntriesOffset,
+        Capacity, sizeof(SPD_IOCTL_RING_REQ));
+    SpdRingPortInitialize(&Ring->RspPort,
+        (PVOID)((PUINT8)Ring->Buffer + Layout.RspRingOffset),
+        (PUINT8)Ring->Buffer + Layout.RspEntriesOffset,
+        Capacity, sizeof(SPD_IOCTL_RING_RSP));
+    Ring->DataBuffer = (PUINT8)Ring->Buffer + Layout.DataOffset;
+
+    Error = SpdStorageUnitHandleRingSetup(StorageUnit->Handle,
+        StorageUnit->Btl, Capacity, Ring->Buffer, Layout.Size, Ring->Event);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    *PRing = Ring;
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (ERROR_SUCCESS != Error && 0 != Ring)
+    {
+        if (0 != Ring->Event)
+            CloseHandle(Ring->Event);
+        if (0 != Ring->Buffer)
+            VirtualFree(Ring->Buffer, 0, MEM_RELEASE);
+        MemFree(Ring);
+    }
+
+    return Error;
+}
+
+static VOID SpdStorageUnitRingDelete(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_RING *Ring)
+{
+    /* the storage unit is shut down: the driver has detached the ring and unlocked it */
+    CloseHandle(Ring->Event);
+    VirtualFree(Ring->Buffer, 0, MEM_RELEASE);
+    MemFree(Ring);
+}
+
+static DWORD SpdStorageUnitDispatchRing(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_STORAGE_UNIT_OPERATION_CONTEXT *OperationContext,
+    SPD_STORAGE_UNIT_RING *Ring)
+{
+    SPD_IOCTL_RING_REQ ReqEntry;
+    SPD_IOCTL_RING_RSP RspEntry;
+    BOOLEAN Popped, More, Woken = FALSE, Doorbell;
+    DWORD Error;
+
+    for (;;)
+    {
+        AcquireSRWLockExclusive(&Ring->ReqLock);
+        Popped = SpdRingPop(&Ring->ReqPort, &ReqEntry);
+        More = Popped && !SpdRingIsEmpty(&Ring->ReqPort);
+        ReleaseSRWLockExclusive(&Ring->ReqLock);
+
+        if (!Popped)
+        {
+            /*
+             * The driver also sets the event when it detaches the ring. If we were woken
+             * up and there is nothing for us, ring the doorbell: it fails once the storage
+             * unit is shut down, which is how we find out that it is.
+             */
+            if (Woken)
+            {
+                Error = SpdStorageUnitHandleRingDoorbell(StorageUnit->Handle, StorageUnit->Btl);
+                if (ERROR_SUCCESS != Error)
+                    goto exit;
+            }
+
+            if (WAIT_OBJECT_0 != WaitForSingleObject(Ring->Event, INFINITE))
+            {
+                Error = GetLastError();
+                goto exit;
+            }
+            Woken = TRUE;
+            continue;
+        }
+        Woken = FALSE;
+
+        /* the driver only sets the event for the first of several requests: pass it on */
+        if (More && 1 < Ring->ThreadCount)
+            SetEvent(Ring->Event);
+
+        if (Ring->ReqPort.Capacity <= ReqEntry.Slot)
+        {
+            Error = ERROR_IO_DEVICE;
+            goto exit;
+        }
+
+        OperationContext->Request = &ReqEntry.Req;
+        OperationContext->Response = &RspEntry.Rsp;
+        OperationContext->DataBuffer = Ring->DataBuffer + (UINT_PTR)ReqEntry.Slot * Ring->DataStride;
+
+        if (!SpdStorageUnitDispatchRequest(StorageUnit,
+            &ReqEntry.Req, &RspEntry.Rsp, OperationContext->DataBuffer))
+            continue;
+
+        /* there are as many RSP entries as data slots, so the push cannot fail */
+        RspEntry.Slot = ReqEntry.Slot;
+        RspEntry.Reserved = 0;
+        Doorbell = FALSE;
+        AcquireSRWLockExclusive(&Ring->RspLock);
+        SpdRingPush(&Ring->RspPort, &RspEntry, &Doorbell);
+        ReleaseSRWLockExclusive(&Ring->RspLock);
+
+        if (Doorbell)
+        {
+            Error = SpdStorageUnitHandleRingDoorbell(StorageUnit->Handle, StorageUnit->Btl);
+            if (ERROR_SUCCESS != Error)
+                goto exit;
+        }
+    }
+
+exit:
+    /* the driver sets the event once when it detaches the ring: wake up the next thread */
+    SetEvent(Ring->Event);
+
+    return Error;
+}
+
 static DWORD WINAPI SpdStorageUnitDispatcherThread(PVOID StorageUnit0)
 {
     SPD_STORAGE_UNIT *StorageUnit = StorageUnit0;
+    SPD_STORAGE_UNIT_ASYNC_POOL *AsyncPool = StorageUnit->DispatcherAsyncPool;
+    SPD_STORAGE_UNIT_RING *Ring = 0;
     SPD_IOCTL_TRANSACT_REQ RequestBuf, *Request = &RequestBuf;
     SPD_IOCTL_TRANSACT_RSP ResponseBuf, *Response;
     SPD_STORAGE_UNIT_OPERATION_CONTEXT OperationContext;
-    PVOID DataBuffer = 0;
+    SPD_IOCTL_TRANSACT_BATCH_PARAMS *BatchParams = 0;
+    ULONG BatchSize;
+    PVOID DataBuffer = 0, ReqDataBuffer = 0;
+    UINT32 DataBufferIndex = (UINT32)-1;
     HANDLE DispatcherThread = 0;
-    BOOLEAN Complete;
     DWORD Error;
 
-    DataBuffer = StorageUnit->BufferAlloc(StorageUnit->StorageUnitParams.MaxTransferLength);
-    if (0 == DataBuffer)
+    /*
+     * The first dispatcher thread sets up the ring before it starts the others, so that
+     * a ring that the driver accepted is always served. The ring is an optimization only:
+     * if it cannot be set up (e.g. pipe handle or we are not the owner process) we
+     * transact as usual.
+     */
+    if (GetCurrentThreadId() == StorageUnit->DispatcherThreadId &&
+        0 < StorageUnit->DispatcherRingCapacity)
     {
-        Error = ERROR_NO_SYSTEM_RESOURCES;
-        goto exit;
+        if (ERROR_SUCCESS == SpdStorageUnitRingCreate(StorageUnit,
+            StorageUnit->DispatcherRingCapacity, StorageUnit->DispatcherThreadCount, &Ring))
+            StorageUnit->DispatcherRing = Ring;
+    }
+    Ring = StorageUnit->DispatcherRing;
+
+    BatchSize = StorageUnit->DispatcherBatchSize;
+    if (SPD_IOCTL_TRANSACT_BATCH_MAX < BatchSize)
+        BatchSize = SPD_IOCTL_TRANSACT_BATCH_MAX;
+    if (0 == AsyncPool && 0 == Ring && 1 < BatchSize)
+    {
+        BatchParams = MemAlloc(SPD_IOCTL_TRANSACT_BATCH_PARAMS_SIZE(BatchSize));
+        if (0 == BatchParams)
+        {
+            Error = ERROR_NO_SYSTEM_RESOURCES;
+            goto exit;
+        }
+    }
+    else
+        BatchSize = 1;
+
+    /* in async and ring mode the data buffers come with the async requests or the ring */
+    if (0 == AsyncPool && 0 == Ring)
+    {
+        DataBuffer = StorageUnit->BufferAlloc(
+            BatchSize * StorageUnit->StorageUnitParams.MaxTransferLength);
+        if (0 == DataBuffer)
+        {
+            Error = ERROR_NO_SYSTEM_RESOURCES;
+            goto exit;
+        }
+
+        /*
+         * Register our data buffer so that the driver locks and maps it once rather than
+         * on every transact. This is an optimization only: if it fails (e.g. pipe handle
+         * or we are not the owner process) we transact with the unregistered buffer.
+         */
+        if (ERROR_SUCCESS != SpdStorageUnitHandleRegisterBuffer(StorageUnit->Handle,
+            StorageUnit->Btl, DataBuffer, BatchSize * StorageUnit->StorageUnitParams.MaxTransferLength,
+            &DataBufferIndex))
+            DataBufferIndex = (UINT32)-1;
     }
 
     OperationContext.Request = &RequestBuf;
     OperationContext.Response = &ResponseBuf;
     OperationContext.DataBuffer = DataBuffer;
+    OperationContext.AsyncRequest = 0;
     TlsSetValue(SpdStorageUnitTlsKey, &OperationContext);
 
     if (1 < StorageUnit->DispatcherThreadCount)
@@ -162,12 +1088,32 @@ static DWORD WINAPI SpdStorageUnitDispatcherThread(PVOID StorageUnit0)
         }
     }
 
+    if (0 != Ring)
+    {
+        Error = SpdStorageUnitDispatchRing(StorageUnit, &OperationContext, Ring);
+        goto exit;
+    }
+
+    if (0 != AsyncPool)
+    {
+        Error = SpdStorageUnitDispatchAsync(StorageUnit, &OperationContext, AsyncPool);
+        goto exit;
+    }
+
+    if (0 != BatchParams)
+    {
+        Error = SpdStorageUnitDispatchBatch(StorageUnit,
+            &OperationContext, BatchParams, BatchSize, DataBuffer, DataBufferIndex);
+        goto exit;
+    }
+
     Response = 0;
     for (;;)
     {
         memset(Request, 0, sizeof *Request);
         Error = SpdStorageUnitHandleTransact(StorageUnit->Handle,
-            StorageUnit->Btl, Response, Request, DataBuffer);
+            StorageUnit->Btl, Response, Request, DataBuffer, DataBufferIndex,
+            StorageUnit->StorageUnitParams.ZeroCopy ? &ReqDataBuffer : 0);
         if (ERROR_SUCCESS != Error)
             goto exit;
 
@@ -177,75 +1123,14 @@ static DWORD WINAPI SpdStorageUnitDispatcherThread(PVOID StorageUnit0)
             continue;
         }
 
-        if (StorageUnit->DebugLog)
-        {
-            if (SpdIoctlTransactKindCount <= Request->Kind ||
-                (StorageUnit->DebugLog & (1 << Request->Kind)))
-                SpdDebugLogRequest(Request);
-        }
-
+        /*
+         * With ZeroCopy the READ/WRITE data may be mapped directly from the SRB, in which
+         * case ReqDataBuffer points at them rather than into our DataBuffer. Responses are
+         * still sent with our DataBuffer; the driver ignores it for mapped requests.
+         */
         Response = &ResponseBuf;
-        memset(Response, 0, sizeof *Response);
-        Response->Hint = Request->Hint;
-        Response->Kind = Request->Kind;
-        switch (Request->Kind)
-        {
-        case SpdIoctlTransactReadKind:
-            if (0 == StorageUnit->Interface->Read)
-                goto invalid;
-            Complete = StorageUnit->Interface->Read(
-                StorageUnit,
-                DataBuffer,
-                Request->Op.Read.BlockAddress,
-                Request->Op.Read.BlockCount,
-                Request->Op.Read.ForceUnitAccess,
-                &Response->Status);
-            break;
-        case SpdIoctlTransactWriteKind:
-            if (0 == StorageUnit->Interface->Write)
-                goto invalid;
-            Complete = StorageUnit->Interface->Write(
-                StorageUnit,
-                DataBuffer,
-                Request->Op.Write.BlockAddress,
-                Request->Op.Write.BlockCount,
-                Request->Op.Write.ForceUnitAccess,
-                &Response->Status);
-            break;
-        case SpdIoctlTransactFlushKind:
-            if (0 == StorageUnit->Interface->Flush)
-                goto invalid;
-            Complete = StorageUnit->Interface->Flush(
-                StorageUnit,
-                Request->Op.Flush.BlockAddress,
-                Request->Op.Flush.BlockCount,
-                &Response->Status);
-            break;
-        case SpdIoctlTransactUnmapKind:
-            if (0 == StorageUnit->Interface->Unmap)
-                goto invalid;
-            Complete = StorageUnit->Interface->Unmap(
-                StorageUnit,
-                DataBuffer,
-                Request->Op.Unmap.Count,
-                &Response->Status);
-            break;
-        default:
-        invalid:
-            SpdStorageUnitStatusSetSense(&Response->Status,
-                SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_COMMAND, 0);
-            Complete = TRUE;
-            break;
-        }
-
-        if (Complete && StorageUnit->DebugLog)
-        {
-            if (SpdIoctlTransactKindCount <= Response->Kind ||
-                (StorageUnit->DebugLog & (1 << Response->Kind)))
-                SpdDebugLogResponse(Response);
-        }
-
-        if (!Complete)
+        if (!SpdStorageUnitDispatchRequest(StorageUnit, Request, Response,
+            StorageUnit->StorageUnitParams.ZeroCopy ? ReqDataBuffer : DataBuffer))
             Response = 0;
     }
 
@@ -254,6 +1139,10 @@ exit:
 
     SpdStorageUnitHandleShutdown(StorageUnit->Handle, &StorageUnit->StorageUnitParams.Guid);
 
+    /* release any dispatcher threads waiting for an async request */
+    if (0 != AsyncPool)
+        SpdRequestPoolStop(&AsyncPool->Pool);
+
     if (0 != DispatcherThread)
     {
         WaitForSingleObject(DispatcherThread, INFINITE);
@@ -262,6 +1151,31 @@ exit:
 
     if (GetCurrentThreadId() == StorageUnit->DispatcherThreadId)
     {
+        /*
+         * Async requests that the storage unit has begun must be completed before we
+         * can free them. Completing them after shutdown is harmless: the responses
+         * fail to send and are discarded.
+         */
+        if (0 != AsyncPool)
+        {
+            SpdRequestPoolDrain(&AsyncPool->Pool);
+            SpdStorageUnitAsyncPoolDelete(StorageUnit, AsyncPool);
+            StorageUnit->DispatcherAsyncPool = 0;
+        }
+
+        if (0 != Ring)
+        {
+            SpdStorageUnitRingDelete(StorageUnit, Ring);
+            StorageUnit->DispatcherRing = 0;
+        }
+
+        /* the other dispatcher threads are gone: destage what is left in the cache */
+        if (0 != StorageUnit->WriteBackCache)
+        {
+            SpdStorageUnitCacheDelete(StorageUnit, StorageUnit->WriteBackCache);
+            StorageUnit->WriteBackCache = 0;
+        }
+
         if (StorageUnit->StorageUnitParams.CacheSupported && 0 != StorageUnit->Interface->Flush)
         {
             Response = &ResponseBuf;
@@ -277,7 +1191,11 @@ exit:
 
     TlsSetValue(SpdStorageUnitTlsKey, 0);
 
-    StorageUnit->BufferFree(DataBuffer);
+    if ((UINT32)-1 != DataBufferIndex)
+        SpdStorageUnitHandleUnregisterBuffer(StorageUnit->Handle, StorageUnit->Btl, DataBufferIndex);
+    if (0 != DataBuffer)
+        StorageUnit->BufferFree(DataBuffer);
+    MemFree(BatchParams);
 
     return Error;
 }
@@ -298,12 +1216,52 @@ DWORD SpdStorageUnitStartDispatcher(SPD_STORAGE_UNIT *StorageUnit, ULONG ThreadC
             ThreadCount += ProcessMask & 1;
     }
 
+    /* the ring and batched transacts carry their own data buffers; async mode does not apply */
+    if (0 == StorageUnit->DispatcherRingCapacity &&
+        0 < StorageUnit->DispatcherAsyncDepth && 1 >= StorageUnit->DispatcherBatchSize)
+    {
+        DWORD Error = SpdStorageUnitAsyncPoolCreate(StorageUnit,
+            StorageUnit->DispatcherAsyncDepth,
+            (SPD_STORAGE_UNIT_ASYNC_POOL **)&StorageUnit->DispatcherAsyncPool);
+        if (ERROR_SUCCESS != Error)
+            return Error;
+    }
+
+    if (0 < StorageUnit->WriteBackCacheSize)
+    {
+        DWORD Error = SpdStorageUnitCacheCreate(StorageUnit,
+            StorageUnit->WriteBackCacheSize,
+            (SPD_STORAGE_UNIT_CACHE **)&StorageUnit->WriteBackCache);
+        if (ERROR_SUCCESS != Error)
+        {
+            if (0 != StorageUnit->DispatcherAsyncPool)
+            {
+                SpdStorageUnitAsyncPoolDelete(StorageUnit, StorageUnit->DispatcherAsyncPool);
+                StorageUnit->DispatcherAsyncPool = 0;
+            }
+            return Error;
+        }
+    }
+
     StorageUnit->DispatcherThreadCount = ThreadCount;
     StorageUnit->DispatcherThread = CreateThread(0, 0,
         SpdStorageUnitDispatcherThread, StorageUnit, CREATE_SUSPENDED,
         &StorageUnit->DispatcherThreadId);
     if (0 == StorageUnit->DispatcherThread)
-        return GetLastError();
+    {
+        DWORD Error = GetLastError();
+        if (0 != StorageUnit->WriteBackCache)
+        {
+            SpdStorageUnitCacheDelete(StorageUnit, StorageUnit->WriteBackCache);
+            StorageUnit->WriteBackCache = 0;
+        }
+        if (0 != StorageUnit->DispatcherAsyncPool)
+        {
+            SpdStorageUnitAsyncPoolDelete(StorageUnit, StorageUnit->DispatcherAsyncPool);
+            StorageUnit->DispatcherAsyncPool = 0;
+        }
+        return Error;
+    }
     if (!ResumeThread(StorageUnit->DispatcherThread))
     {
         CloseHandle(StorageUnit->DispatcherThread);
@@ -336,7 +1294,7 @@ VOID SpdStorageUnitSendResponse(SPD_STORAGE_UNIT *StorageUnit,
     }
 
     Error = SpdStorageUnitHandleTransact(StorageUnit->Handle,
-        StorageUnit->Btl, Response, 0, DataBuffer);
+        StorageUnit->Btl, Response, 0, DataBuffer, (UINT32)-1, 0);
     if (ERROR_SUCCESS != Error)
     {
         SpdStorageUnitSetDispatcherError(StorageUnit, Error);
@@ -350,6 +1308,35 @@ SPD_STORAGE_UNIT_OPERATION_CONTEXT *SpdStorageUnitGetOperationContext(VOID)
     return (SPD_STORAGE_UNIT_OPERATION_CONTEXT *)TlsGetValue(SpdStorageUnitTlsKey);
 }
 
+SPD_STORAGE_UNIT_ASYNC_REQUEST *SpdStorageUnitBeginAsyncRequest(VOID)
+{
+    SPD_STORAGE_UNIT_OPERATION_CONTEXT *OperationContext = SpdStorageUnitGetOperationContext();
+    SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest;
+
+    if (0 == OperationContext || 0 == OperationContext->AsyncRequest)
+        return 0;
+
+    /* the dispatcher must not touch the request after this */
+    AsyncRequest = OperationContext->AsyncRequest;
+    OperationContext->AsyncRequest = 0;
+
+    return AsyncRequest;
+}
+
+VOID SpdStorageUnitCompleteAsyncRequest(SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    SPD_STORAGE_UNIT *StorageUnit = AsyncRequest->StorageUnit;
+    SPD_STORAGE_UNIT_ASYNC_POOL *AsyncPool = StorageUnit->DispatcherAsyncPool;
+
+    if (&AsyncRequest->Response.Status != Status)
+        memcpy(&AsyncRequest->Response.Status, Status, sizeof *Status);
+
+    SpdStorageUnitSendResponse(StorageUnit, &AsyncRequest->Response, AsyncRequest->DataBuffer);
+
+    SpdRequestPoolPut(&AsyncPool->Pool, &AsyncRequest->PoolEntry);
+}
+
 VOID SpdStorageUnitSetBufferAllocatorF(SPD_STORAGE_UNIT *StorageUnit,
     PVOID(*BufferAlloc)(size_t),
     VOID(*BufferFree)(PVOID))
@@ -374,3 +1361,27 @@ VOID SpdStorageUnitSetDebugLogF(SPD_STORAGE_UNIT *StorageUnit,
 {
     SpdStorageUnitSetDebugLog(StorageUnit, DebugLog);
 }
+
+VOID SpdStorageUnitSetDispatcherBatchSizeF(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG BatchSize)
+{
+    SpdStorageUnitSetDispatcherBatchSize(StorageUnit, BatchSize);
+}
+
+VOID SpdStorageUnitSetDispatcherAsyncDepthF(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG AsyncDepth)
+{
+    SpdStorageUnitSetDispatcherAsyncDepth(StorageUnit, AsyncDepth);
+}
+
+VOID SpdStorageUnitSetWriteBackCacheSizeF(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 CacheSize)
+{
+    SpdStorageUnitSetWriteBackCacheSize(StorageUnit, CacheSize);
+}
+
+VOID SpdStorageUnitSetDispatcherRingCapacityF(SPD_STORAGE_UNIT *StorageUnit,
+    ULONG RingCapacity)
+{
+    SpdStorageUnitSetDispatcherRingCapacity(StorageUnit, RingCapacity);
+}
@@ -0,0 +1,214 @@
+/**
+ * @file shared/unittab.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_UNITTAB_H_INCLUDED
+#define WINSPD_SHARED_UNITTAB_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Unit tables
+ *
+ * A unit table maps unit indexes to storage units, and unit GUID's to storage units,
+ * in constant time, for up to Capacity units. An index is the position of a unit's
+ * B/T/L address in the address space of the adapter (see SPD_IOCTL_BTL_FROM_INDEX).
+ * Units are identified by an SPD_UNIT_TABLE_ENTRY embedded in them.
+ *
+ * An allocation bitmap makes finding the lowest free index and visiting the units in
+ * index order proportional to Capacity / 32 and the number of units, rather than to
+ * Capacity. The GUID index is a chained hash table with at least as many buckets as
+ * there are possible units.
+ *
+ * Changes to the table must be serialized by the caller. Entries[] is published with
+ * interlocked operations so that SpdUnitTableLookup may also be used without the lock,
+ * provided that the caller defers the release of removed units (see shared/epoch.h).
+ */
+
+typedef struct _SPD_UNIT_TABLE_ENTRY
+{
+    struct _SPD_UNIT_TABLE_ENTRY *GuidNext;
+    GUID Guid;
+    ULONG Index;
+} SPD_UNIT_TABLE_ENTRY;
+typedef struct
+{
+    ULONG Capacity, Count;
+    ULONG GuidBucketCount;              /* power of 2 */
+    UINT32 *Bitmap;
+    SPD_UNIT_TABLE_ENTRY **GuidBuckets;
+    SPD_UNIT_TABLE_ENTRY *volatile Entries[];
+} SPD_UNIT_TABLE;
+
+static inline
+ULONG SpdUnitTableGuidBucketCount(ULONG Capacity)
+{
+    ULONG BucketCount = 16;
+    while (Capacity > BucketCount)
+        BucketCount <<= 1;
+    return BucketCount;
+}
+
+/* size of the single allocation that holds a unit table of Capacity units */
+static inline
+ULONG SpdUnitTableSize(ULONG Capacity)
+{
+    return sizeof(SPD_UNIT_TABLE) +
+        Capacity * sizeof(SPD_UNIT_TABLE_ENTRY *) +
+        SpdUnitTableGuidBucketCount(Capacity) * sizeof(SPD_UNIT_TABLE_ENTRY *) +
+        (Capacity + 31) / 32 * sizeof(UINT32);
+}
+
+static inline
+VOID SpdUnitTableInitialize(SPD_UNIT_TABLE *Table, ULONG Capacity)
+{
+    memset(Table, 0, SpdUnitTableSize(Capacity));
+    Table->Capacity = Capacity;
+    Table->GuidBucketCount = SpdUnitTableGuidBucketCount(Capacity);
+    Table->GuidBuckets = (SPD_UNIT_TABLE_ENTRY **)(Table->Entries + Capacity);
+    Table->Bitmap = (UINT32 *)(Table->GuidBuckets + Table->GuidBucketCount);
+}
+
+static inline
+ULONG SpdUnitTableGuidHash(SPD_UNIT_TABLE *Table, const GUID *Guid)
+{
+    /* GUID's are mostly random, but fold all of them in case they are not */
+    UINT64 Key;
+    Key = ((UINT64)Guid->Data1 << 32) | ((UINT32)Guid->Data2 << 16) | Guid->Data3;
+    for (ULONG I = 0; 8 > I; I++)
+        Key = (Key ^ Guid->Data4[I]) * 0x100000001b3ULL;
+    Key ^= Key >> 33;
+    Key *= 0xff51afd7ed558ccdULL;
+    Key ^= Key >> 33;
+    return (ULONG)Key & (Table->GuidBucketCount - 1);
+}
+
+static inline
+BOOLEAN SpdUnitTableGuidEqual(const GUID *A, const GUID *B)
+{
+    /* no memcmp: the DLL does not use the CRT */
+    if (A->Data1 != B->Data1 || A->Data2 != B->Data2 || A->Data3 != B->Data3)
+        return FALSE;
+    for (ULONG I = 0; 8 > I; I++)
+        if (A->Data4[I] != B->Data4[I])
+            return FALSE;
+    return TRUE;
+}
+
+static inline
+SPD_UNIT_TABLE_ENTRY *SpdUnitTableLookup(SPD_UNIT_TABLE *Table, ULONG Index)
+{
+    return Table->Capacity > Index ? Table->Entries[Index] : 0;
+}
+
+static inline
+SPD_UNIT_TABLE_ENTRY *SpdUnitTableLookupGuid(SPD_UNIT_TABLE *Table, const GUID *Guid)
+{
+    SPD_UNIT_TABLE_ENTRY *Entry;
+
+    for (Entry = Table->GuidBuckets[SpdUnitTableGuidHash(Table, Guid)];
+        0 != Entry; Entry = Entry->GuidNext)
+        if (SpdUnitTableGuidEqual(Guid, &Entry->Guid))
+            return Entry;
+
+    return 0;
+}
+
+/* index of the first unit at or after Index; Capacity if there is none */
+static inline
+ULONG SpdUnitTableNext(SPD_UNIT_TABLE *Table, ULONG Index)
+{
+    ULONG WordIndex = Index / 32, WordCount = (Table->Capacity + 31) / 32, Bit;
+    UINT32 Word;
+
+    if (Table->Capacity <= Index)
+        return Table->Capacity;
+
+    Word = Table->Bitmap[WordIndex] & (0xffffffffU << (Index % 32));
+    for (;;)
+    {
+        if (BitScanForward(&Bit, Word))
+            return WordIndex * 32 + Bit;
+        if (WordCount <= ++WordIndex)
+            return Table->Capacity;
+        Word = Table->Bitmap[WordIndex];
+    }
+}
+
+/*
+ * Insert a unit at the lowest free index. Entry->Guid must be set and must not be
+ * in the table already (see SpdUnitTableLookupGuid). Returns FALSE if the table is full.
+ */
+static inline
+BOOLEAN SpdUnitTableInsert(SPD_UNIT_TABLE *Table, SPD_UNIT_TABLE_ENTRY *Entry)
+{
+    ULONG WordCount = (Table->Capacity + 31) / 32, Index, Bit;
+    SPD_UNIT_TABLE_ENTRY **Bucket;
+
+    for (ULONG I = 0; WordCount > I; I++)
+        if (BitScanForward(&Bit, ~Table->Bitmap[I]))
+        {
+            Index = I * 32 + Bit;
+            if (Table->Capacity <= Index)
+                break;
+
+            Table->Bitmap[I] |= 1U << Bit;
+            Table->Count++;
+
+            Bucket = &Table->GuidBuckets[SpdUnitTableGuidHash(Table, &Entry->Guid)];
+            Entry->GuidNext = *Bucket;
+            *Bucket = Entry;
+
+            /* publish: the unit must be fully constructed before lock-free lookups find it */
+            Entry->Index = Index;
+            InterlockedExchangePointer((PVOID volatile *)&Table->Entries[Index], Entry);
+
+            return TRUE;
+        }
+
+    return FALSE;
+}
+
+static inline
+VOID SpdUnitTableRemove(SPD_UNIT_TABLE *Table, SPD_UNIT_TABLE_ENTRY *Entry)
+{
+    ULONG Index = Entry->Index;
+
+    for (SPD_UNIT_TABLE_ENTRY **P = &Table->GuidBuckets[SpdUnitTableGuidHash(Table, &Entry->Guid)];
+        0 != *P; P = &(*P)->GuidNext)
+        if (*P == Entry)
+        {
+            *P = Entry->GuidNext;
+            Entry->GuidNext = 0;
+            break;
+        }
+
+    InterlockedExchangePointer((PVOID volatile *)&Table->Entries[Index], 0);
+    Table->Bitmap[Index / 32] &= ~(1U << (Index % 32));
+    Table->Count--;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
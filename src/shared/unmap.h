@@ -0,0 +1,173 @@
+/**
+ * @file shared/unmap.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_UNMAP_H_INCLUDED
+#define WINSPD_SHARED_UNMAP_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Unmap compaction
+ *
+ * SpdUnmapCompact rewrites an UNMAP descriptor list in place: it sorts the descriptors
+ * by block address, merges the ones that overlap or are adjacent and aligns the merged
+ * ranges inwards to Granularity blocks, dropping what is left of a range that holds no
+ * whole granule. The last granule of the device may be short; a range that reaches the
+ * end of the device (BlockCount) covers it.
+ *
+ * The result never unmaps a block that the original list did not, and it unmaps every
+ * granule that the original list covered in full. This is fine for UNMAP, which need
+ * not unmap anything (the storage unit does not report that unmapped blocks read as
+ * zeroes).
+ *
+ * A merged range that would be longer than a descriptor can hold is split at the last
+ * granule boundary before the next descriptor starts, so that the granule across the
+ * cut goes with the next part; the result never has more descriptors than the original.
+ * (Only when a part would come within a granule of 2^32 blocks may it lose its last
+ * granule, so that it fits its descriptor.) Sorting is a heap sort (no allocation),
+ * skipped for lists that are sorted already.
+ */
+
+static inline
+VOID SpdUnmapSiftDown(SPD_UNMAP_DESCRIPTOR Descriptors[], UINT32 Index, UINT32 Count)
+{
+    SPD_UNMAP_DESCRIPTOR Descriptor = Descriptors[Index];
+    UINT32 Child;
+
+    while ((Child = 2 * Index + 1) < Count)
+    {
+        if (Child + 1 < Count &&
+            Descriptors[Child].BlockAddress < Descriptors[Child + 1].BlockAddress)
+            Child++;
+        if (Descriptor.BlockAddress >= Descriptors[Child].BlockAddress)
+            break;
+        Descriptors[Index] = Descriptors[Child];
+        Index = Child;
+    }
+    Descriptors[Index] = Descriptor;
+}
+
+static inline
+VOID SpdUnmapSort(SPD_UNMAP_DESCRIPTOR Descriptors[], UINT32 Count)
+{
+    SPD_UNMAP_DESCRIPTOR Descriptor;
+    UINT32 I;
+
+    for (I = 1; Count > I; I++)
+        if (Descriptors[I - 1].BlockAddress > Descriptors[I].BlockAddress)
+            break;
+    if (Count <= I)
+        return;
+
+    for (I = Count / 2; 0 < I; I--)
+        SpdUnmapSiftDown(Descriptors, I - 1, Count);
+    for (I = Count - 1; 0 < I; I--)
+    {
+        Descriptor = Descriptors[0];
+        Descriptors[0] = Descriptors[I];
+        Descriptors[I] = Descriptor;
+        SpdUnmapSiftDown(Descriptors, 0, I);
+    }
+}
+
+static inline
+UINT32 SpdUnmapEmit(SPD_UNMAP_DESCRIPTOR Descriptors[], UINT32 Index,
+    UINT64 BlockAddress, UINT64 EndBlockAddress, UINT32 Granularity, UINT64 BlockCount)
+{
+    BlockAddress = (BlockAddress + Granularity - 1) / Granularity * Granularity;
+    if (BlockCount > EndBlockAddress)
+        EndBlockAddress = EndBlockAddress / Granularity * Granularity;
+    if (BlockAddress >= EndBlockAddress)
+        return Index;
+    if (EndBlockAddress - BlockAddress > (UINT32)-1)
+        EndBlockAddress = BlockAddress + (UINT32)-1 / Granularity * Granularity;
+
+    Descriptors[Index].BlockAddress = BlockAddress;
+    Descriptors[Index].BlockCount = (UINT32)(EndBlockAddress - BlockAddress);
+    Descriptors[Index].Reserved = 0;
+
+    return Index + 1;
+}
+
+static inline
+UINT32 SpdUnmapCompact(SPD_UNMAP_DESCRIPTOR Descriptors[], UINT32 Count,
+    UINT32 Granularity, UINT64 BlockCount)
+{
+    UINT64 BlockAddress, EndBlockAddress, NextBlockAddress, NextEndBlockAddress, CutBlockAddress;
+    UINT32 Index = 0;
+
+    if (0 == Granularity)
+        Granularity = 1;
+
+    SpdUnmapSort(Descriptors, Count);
+
+    BlockAddress = EndBlockAddress = 0;
+    for (UINT32 I = 0; Count > I; I++)
+    {
+        NextBlockAddress = Descriptors[I].BlockAddress;
+        NextEndBlockAddress = NextBlockAddress + Descriptors[I].BlockCount;
+        if (NextBlockAddress >= NextEndBlockAddress)
+            continue;
+
+        if (BlockAddress == EndBlockAddress)
+        {
+            BlockAddress = NextBlockAddress;
+            EndBlockAddress = NextEndBlockAddress;
+        }
+        else if (NextBlockAddress > EndBlockAddress)
+        {
+            Index = SpdUnmapEmit(Descriptors, Index,
+                BlockAddress, EndBlockAddress, Granularity, BlockCount);
+            BlockAddress = NextBlockAddress;
+            EndBlockAddress = NextEndBlockAddress;
+        }
+        else if (NextEndBlockAddress > EndBlockAddress)
+        {
+            if (NextEndBlockAddress - BlockAddress <= (UINT32)-1)
+                EndBlockAddress = NextEndBlockAddress;
+            else
+            {
+                /* too long for one descriptor: split it where this one takes over */
+                CutBlockAddress = EndBlockAddress / Granularity * Granularity;
+                if (BlockAddress < CutBlockAddress)
+                {
+                    Index = SpdUnmapEmit(Descriptors, Index,
+                        BlockAddress, CutBlockAddress, Granularity, BlockCount);
+                    BlockAddress = CutBlockAddress;
+                }
+                EndBlockAddress = NextEndBlockAddress;
+            }
+        }
+    }
+    if (BlockAddress != EndBlockAddress)
+        Index = SpdUnmapEmit(Descriptors, Index,
+            BlockAddress, EndBlockAddress, Granularity, BlockCount);
+
+    return Index;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,487 @@
+/**
+ * @file shared/wbcache.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef WINSPD_SHARED_WBCACHE_H_INCLUDED
+#define WINSPD_SHARED_WBCACHE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Write-back cache
+ *
+ * A fixed number of blocks, indexed by block address in a hash table. Each block is
+ * on one of three lists: free; clean, in LRU order; or dirty, in the order in which
+ * the blocks were first written (so the oldest dirty data are destaged first).
+ *
+ * Writes go to the cache only: SpdWbcacheWrite makes the blocks dirty, evicting clean
+ * blocks to make room, and fails if there is not enough room (the caller must then
+ * destage). Dirty blocks are never evicted.
+ *
+ * Destaging is done in runs: SpdWbcacheDestageBegin picks the oldest dirty block (or any
+ * dirty block of a range, if one is given), extends it with the dirty blocks that are
+ * adjacent to it on either side, up to MaxBlockCount blocks, and copies the run to a
+ * buffer. The caller then writes the run to the backend (with no locks held) and calls
+ * SpdWbcacheDestageEnd, which makes the blocks of the run clean, unless they were written
+ * again meanwhile. Blocks that are being destaged stay dirty until then. The caller must
+ * not have more than one run in flight, nor discard blocks while one is.
+ *
+ * Reads that the cache holds in full are served from it. The data of other reads are
+ * filled in as clean blocks, but only blocks that are not in the cache already, and
+ * only if no block was evicted or discarded since the read was started (Generation).
+ * A block that a fill does not find must then have been out of the cache for the whole
+ * read, so the read could not have missed a write that the cache holds.
+ *
+ * The cache does no locking and no allocation: the caller serializes access and
+ * provides a buffer of SpdWbcacheBufferSize bytes.
+ */
+
+#define SPD_WBCACHE_FILL_FRACTION       4       /* larger reads are not cached */
+
+enum
+{
+    SpdWbcacheFree = 0,
+    SpdWbcacheClean,
+    SpdWbcacheDirty,
+};
+typedef struct _SPD_WBCACHE_ENTRY
+{
+    struct _SPD_WBCACHE_ENTRY *HashNext;
+    struct _SPD_WBCACHE_ENTRY *ListPrev, *ListNext;
+    UINT64 BlockAddress;
+    UINT32 Version;                     /* bumped by every write */
+    UINT32 DestageVersion;              /* Version when last picked for destaging */
+    UINT8 State;
+} SPD_WBCACHE_ENTRY;
+typedef struct
+{
+    PUINT8 Data;                        /* EntryCount blocks */
+    SPD_WBCACHE_ENTRY *Entries;
+    SPD_WBCACHE_ENTRY **Buckets;
+    SPD_WBCACHE_ENTRY Lists[3];         /* list heads: free, clean, dirty */
+    ULONG Counts[3];
+    ULONG EntryCount, BucketMask;
+    ULONG BlockLength;
+    UINT64 Generation;
+    /* statistics */
+    UINT64 HitCount, MissCount;         /* read requests */
+    UINT64 WriteCount;                  /* blocks */
+    UINT64 DestageCount;                /* runs */
+    UINT64 DestageBlockCount;           /* blocks */
+    UINT64 EvictCount, DiscardCount;    /* blocks */
+} SPD_WBCACHE;
+
+static inline
+ULONG SpdWbcacheBucketCount(ULONG EntryCount)
+{
+    ULONG BucketCount = 1;
+    while (BucketCount < EntryCount)
+        BucketCount <<= 1;
+    return BucketCount;
+}
+
+static inline
+UINT64 SpdWbcacheBufferSize(ULONG EntryCount, ULONG BlockLength)
+{
+    return (UINT64)EntryCount * BlockLength +
+        (UINT64)EntryCount * sizeof(SPD_WBCACHE_ENTRY) +
+        (UINT64)SpdWbcacheBucketCount(EntryCount) * sizeof(SPD_WBCACHE_ENTRY *);
+}
+
+/* the number of blocks that fit in CacheSize bytes, including the index */
+static inline
+UINT64 SpdWbcacheEntryCount(UINT64 CacheSize, ULONG BlockLength)
+{
+    /* there are fewer than 2 buckets per entry */
+    return CacheSize / (BlockLength + sizeof(SPD_WBCACHE_ENTRY) + 2 * sizeof(SPD_WBCACHE_ENTRY *));
+}
+
+static inline
+VOID SpdWbcacheListInsertTail(SPD_WBCACHE *Cache, UINT8 State, SPD_WBCACHE_ENTRY *Entry)
+{
+    SPD_WBCACHE_ENTRY *Head = &Cache->Lists[State];
+    Entry->ListPrev = Head->ListPrev;
+    Entry->ListNext = Head;
+    Head->ListPrev->ListNext = Entry;
+    Head->ListPrev = Entry;
+    Entry->State = State;
+    Cache->Counts[State]++;
+}
+
+static inline
+VOID SpdWbcacheListRemove(SPD_WBCACHE *Cache, SPD_WBCACHE_ENTRY *Entry)
+{
+    Entry->ListPrev->ListNext = Entry->ListNext;
+    Entry->ListNext->ListPrev = Entry->ListPrev;
+    Entry->ListPrev = Entry->ListNext = 0;
+    Cache->Counts[Entry->State]--;
+}
+
+/* the data come first, so that they are as aligned as the buffer */
+static inline
+VOID SpdWbcacheInitialize(SPD_WBCACHE *Cache, PVOID Buffer, ULONG EntryCount, ULONG BlockLength)
+{
+    ULONG BucketCount = SpdWbcacheBucketCount(EntryCount);
+
+    memset(Cache, 0, sizeof *Cache);
+    Cache->Data = Buffer;
+    Cache->Entries = (PVOID)(Cache->Data + (UINT_PTR)EntryCount * BlockLength);
+    Cache->Buckets = (PVOID)(Cache->Entries + EntryCount);
+    Cache->EntryCount = EntryCount;
+    Cache->BucketMask = BucketCount - 1;
+    Cache->BlockLength = BlockLength;
+    memset(Cache->Entries, 0, EntryCount * sizeof Cache->Entries[0]);
+    memset(Cache->Buckets, 0, BucketCount * sizeof Cache->Buckets[0]);
+    for (ULONG I = 0; 3 > I; I++)
+        Cache->Lists[I].ListPrev = Cache->Lists[I].ListNext = &Cache->Lists[I];
+    for (ULONG I = 0; EntryCount > I; I++)
+        SpdWbcacheListInsertTail(Cache, SpdWbcacheFree, &Cache->Entries[I]);
+}
+
+static inline
+SPD_WBCACHE_ENTRY **SpdWbcacheBucket(SPD_WBCACHE *Cache, UINT64 BlockAddress)
+{
+    /* the first half of MurmurHash3 fmix64; it spreads runs of block addresses well */
+    BlockAddress ^= BlockAddress >> 33;
+    BlockAddress *= 0xff51afd7ed558ccdULL;
+    BlockAddress ^= BlockAddress >> 33;
+    return &Cache->Buckets[(ULONG)BlockAddress & Cache->BucketMask];
+}
+
+static inline
+SPD_WBCACHE_ENTRY *SpdWbcacheFind(SPD_WBCACHE *Cache, UINT64 BlockAddress)
+{
+    SPD_WBCACHE_ENTRY *Entry;
+    for (Entry = *SpdWbcacheBucket(Cache, BlockAddress); 0 != Entry; Entry = Entry->HashNext)
+        if (BlockAddress == Entry->BlockAddress)
+            return Entry;
+    return 0;
+}
+
+static inline
+PUINT8 SpdWbcacheEntryData(SPD_WBCACHE *Cache, SPD_WBCACHE_ENTRY *Entry)
+{
+    return Cache->Data + (UINT_PTR)(Entry - Cache->Entries) * Cache->BlockLength;
+}
+
+static inline
+VOID SpdWbcacheRemove(SPD_WBCACHE *Cache, SPD_WBCACHE_ENTRY *Entry)
+{
+    SPD_WBCACHE_ENTRY **P;
+    for (P = SpdWbcacheBucket(Cache, Entry->BlockAddress); Entry != *P; P = &(*P)->HashNext)
+        ;
+    *P = Entry->HashNext;
+    Entry->HashNext = 0;
+    SpdWbcacheListRemove(Cache, Entry);
+    SpdWbcacheListInsertTail(Cache, SpdWbcacheFree, Entry);
+}
+
+/* a free entry, evicting the least recently used clean block if need be; 0 if none */
+static inline
+SPD_WBCACHE_ENTRY *SpdWbcacheAllocate(SPD_WBCACHE *Cache, UINT64 BlockAddress)
+{
+    SPD_WBCACHE_ENTRY *Entry, **Bucket;
+
+    if (0 == Cache->Counts[SpdWbcacheFree])
+    {
+        if (0 == Cache->Counts[SpdWbcacheClean])
+            return 0;
+        SpdWbcacheRemove(Cache, Cache->Lists[SpdWbcacheClean].ListNext);
+        Cache->Generation++;
+        Cache->EvictCount++;
+    }
+
+    Entry = Cache->Lists[SpdWbcacheFree].ListNext;
+    SpdWbcacheListRemove(Cache, Entry);
+    Entry->BlockAddress = BlockAddress;
+    Bucket = SpdWbcacheBucket(Cache, BlockAddress);
+    Entry->HashNext = *Bucket;
+    *Bucket = Entry;
+
+    return Entry;
+}
+
+/* the Generation that a read must pass to SpdWbcacheFill */
+static inline
+UINT64 SpdWbcacheGeneration(SPD_WBCACHE *Cache)
+{
+    return Cache->Generation;
+}
+
+static inline
+ULONG SpdWbcacheDirtyCount(SPD_WBCACHE *Cache)
+{
+    return Cache->Counts[SpdWbcacheDirty];
+}
+
+/* copy BlockCount blocks to Buffer if the cache holds all of them; else FALSE */
+static inline
+BOOLEAN SpdWbcacheRead(SPD_WBCACHE *Cache,
+    UINT64 BlockAddress, UINT32 BlockCount, PVOID Buffer)
+{
+    SPD_WBCACHE_ENTRY *Entry;
+
+    if (0 == BlockCount || Cache->EntryCount < BlockCount)
+    {
+        Cache->MissCount++;
+        return FALSE;
+    }
+
+    for (UINT32 I = 0; BlockCount > I; I++)
+        if (0 == SpdWbcacheFind(Cache, BlockAddress + I))
+        {
+            Cache->MissCount++;
+            return FALSE;
+        }
+
+    for (UINT32 I = 0; BlockCount > I; I++)
+    {
+        Entry = SpdWbcacheFind(Cache, BlockAddress + I);
+        if (SpdWbcacheClean == Entry->State)
+        {
+            SpdWbcacheListRemove(Cache, Entry);
+            SpdWbcacheListInsertTail(Cache, SpdWbcacheClean, Entry);
+        }
+        memcpy((PUINT8)Buffer + (UINT_PTR)I * Cache->BlockLength,
+            SpdWbcacheEntryData(Cache, Entry), Cache->BlockLength);
+    }
+
+    Cache->HitCount++;
+    return TRUE;
+}
+
+/* write BlockCount blocks from Buffer to the cache and make them dirty; FALSE if no room */
+static inline
+BOOLEAN SpdWbcacheWrite(SPD_WBCACHE *Cache,
+    UINT64 BlockAddress, UINT32 BlockCount, const VOID *Buffer)
+{
+    SPD_WBCACHE_ENTRY *Entry;
+    ULONG NewCount = 0, CleanCount = 0;
+
+    for (UINT32 I = 0; BlockCount > I; I++)
+    {
+        Entry = SpdWbcacheFind(Cache, BlockAddress + I);
+        if (0 == Entry)
+            NewCount++;
+        else if (SpdWbcacheClean == Entry->State)
+            CleanCount++;
+    }
+
+    /* the clean blocks of the range cannot be evicted to make room for the range */
+    if (NewCount > Cache->Counts[SpdWbcacheFree] + Cache->Counts[SpdWbcacheClean] - CleanCount)
+        return FALSE;
+
+    /* first make the blocks that we have dirty, so that the evictions below spare them */
+    for (UINT32 I = 0; BlockCount > I; I++)
+    {
+        Entry = SpdWbcacheFind(Cache, BlockAddress + I);
+        if (0 != Entry && SpdWbcacheClean == Entry->State)
+        {
+            SpdWbcacheListRemove(Cache, Entry);
+            SpdWbcacheListInsertTail(Cache, SpdWbcacheDirty, Entry);
+        }
+    }
+
+    for (UINT32 I = 0; BlockCount > I; I++)
+    {
+        Entry = SpdWbcacheFind(Cache, BlockAddress + I);
+        if (0 == Entry)
+        {
+            Entry = SpdWbcacheAllocate(Cache, BlockAddress + I);
+            SpdWbcacheListInsertTail(Cache, SpdWbcacheDirty, Entry);
+        }
+        Entry->Version++;
+        memcpy(SpdWbcacheEntryData(Cache, Entry),
+            (const UINT8 *)Buffer + (UINT_PTR)I * Cache->BlockLength, Cache->BlockLength);
+    }
+
+    Cache->WriteCount += BlockCount;
+    return TRUE;
+}
+
+/* fill the cache with the data of a completed read that was started at Generation */
+static inline
+VOID SpdWbcacheFill(SPD_WBCACHE *Cache, UINT64 Generation,
+    UINT64 BlockAddress, UINT32 BlockCount, const VOID *Buffer)
+{
+    SPD_WBCACHE_ENTRY *Entry;
+
+    if (Generation != Cache->Generation ||
+        0 == BlockCount || Cache->EntryCount / SPD_WBCACHE_FILL_FRACTION < BlockCount)
+        return;
+
+    for (UINT32 I = 0; BlockCount > I; I++)
+    {
+        if (0 != SpdWbcacheFind(Cache, BlockAddress + I))
+            continue;
+        Entry = SpdWbcacheAllocate(Cache, BlockAddress + I);
+        if (0 == Entry)
+            break;
+        SpdWbcacheListInsertTail(Cache, SpdWbcacheClean, Entry);
+        memcpy(SpdWbcacheEntryData(Cache, Entry),
+            (const UINT8 *)Buffer + (UINT_PTR)I * Cache->BlockLength, Cache->BlockLength);
+    }
+}
+
+static inline
+BOOLEAN SpdWbcacheDirtyEntry(SPD_WBCACHE *Cache, UINT64 BlockAddress)
+{
+    SPD_WBCACHE_ENTRY *Entry = SpdWbcacheFind(Cache, BlockAddress);
+    return 0 != Entry && SpdWbcacheDirty == Entry->State;
+}
+
+/* a dirty block in the range, the oldest of all if BlockCount is 0 */
+static inline
+SPD_WBCACHE_ENTRY *SpdWbcacheFindDirty(SPD_WBCACHE *Cache,
+    UINT64 BlockAddress, UINT64 BlockCount)
+{
+    SPD_WBCACHE_ENTRY *Head = &Cache->Lists[SpdWbcacheDirty], *Entry;
+
+    if (0 == BlockCount)
+        return Head != Head->ListNext ? Head->ListNext : 0;
+
+    /* look up each block of a small range; scan the dirty list for a large one */
+    if (Cache->Counts[SpdWbcacheDirty] > BlockCount)
+    {
+        for (UINT64 I = 0; BlockCount > I; I++)
+            if (SpdWbcacheDirtyEntry(Cache, BlockAddress + I))
+                return SpdWbcacheFind(Cache, BlockAddress + I);
+    }
+    else
+    {
+        for (Entry = Head->ListNext; Head != Entry; Entry = Entry->ListNext)
+            if (BlockAddress <= Entry->BlockAddress && Entry->BlockAddress - BlockAddress < BlockCount)
+                return Entry;
+    }
+
+    return 0;
+}
+
+/* does the range have dirty blocks? a BlockCount of 0 means any block */
+static inline
+BOOLEAN SpdWbcacheDirtyRange(SPD_WBCACHE *Cache, UINT64 BlockAddress, UINT64 BlockCount)
+{
+    return 0 != SpdWbcacheFindDirty(Cache, BlockAddress, BlockCount);
+}
+
+/* pick a run of dirty blocks to destage and copy it to Buffer; FALSE if there are none */
+static inline
+BOOLEAN SpdWbcacheDestageBegin(SPD_WBCACHE *Cache,
+    UINT64 BlockAddress, UINT64 BlockCount, UINT32 MaxBlockCount, PVOID Buffer,
+    PUINT64 PRunAddress, PUINT32 PRunCount)
+{
+    SPD_WBCACHE_ENTRY *Entry;
+    UINT64 RunAddress;
+    UINT32 RunCount;
+
+    Entry = SpdWbcacheFindDirty(Cache, BlockAddress, BlockCount);
+    if (0 == Entry || 0 == MaxBlockCount)
+        return FALSE;
+
+    /* write combining: extend the run with the adjacent dirty blocks, first backward */
+    RunAddress = Entry->BlockAddress;
+    RunCount = 1;
+    while (MaxBlockCount > RunCount && 0 < RunAddress &&
+        SpdWbcacheDirtyEntry(Cache, RunAddress - 1))
+    {
+        RunAddress--;
+        RunCount++;
+    }
+    while (MaxBlockCount > RunCount && (UINT64)-1 > RunAddress + RunCount &&
+        SpdWbcacheDirtyEntry(Cache, RunAddress + RunCount))
+        RunCount++;
+
+    for (UINT32 I = 0; RunCount > I; I++)
+    {
+        Entry = SpdWbcacheFind(Cache, RunAddress + I);
+        Entry->DestageVersion = Entry->Version;
+        memcpy((PUINT8)Buffer + (UINT_PTR)I * Cache->BlockLength,
+            SpdWbcacheEntryData(Cache, Entry), Cache->BlockLength);
+    }
+
+    *PRunAddress = RunAddress;
+    *PRunCount = RunCount;
+    return TRUE;
+}
+
+/* the run has been written to the backend (Success) or has failed to */
+static inline
+VOID SpdWbcacheDestageEnd(SPD_WBCACHE *Cache,
+    UINT64 RunAddress, UINT32 RunCount, BOOLEAN Success)
+{
+    SPD_WBCACHE_ENTRY *Entry;
+
+    if (!Success)
+        return;
+
+    for (UINT32 I = 0; RunCount > I; I++)
+    {
+        Entry = SpdWbcacheFind(Cache, RunAddress + I);
+        if (0 != Entry && SpdWbcacheDirty == Entry->State && Entry->DestageVersion == Entry->Version)
+        {
+            SpdWbcacheListRemove(Cache, Entry);
+            SpdWbcacheListInsertTail(Cache, SpdWbcacheClean, Entry);
+        }
+    }
+
+    Cache->DestageCount++;
+    Cache->DestageBlockCount += RunCount;
+}
+
+/* an unmap of the range: its blocks, dirty or not, are dropped */
+static inline
+VOID SpdWbcacheDiscard(SPD_WBCACHE *Cache, UINT64 BlockAddress, UINT64 BlockCount)
+{
+    SPD_WBCACHE_ENTRY *Entry;
+
+    Cache->Generation++;
+
+    /* look up each block of a small range; scan the whole cache for a large one */
+    if (Cache->EntryCount > BlockCount)
+    {
+        for (UINT64 I = 0; BlockCount > I; I++)
+            if (0 != (Entry = SpdWbcacheFind(Cache, BlockAddress + I)))
+            {
+                SpdWbcacheRemove(Cache, Entry);
+                Cache->DiscardCount++;
+            }
+    }
+    else
+    {
+        for (ULONG I = 0; Cache->EntryCount > I; I++)
+        {
+            Entry = &Cache->Entries[I];
+            if (SpdWbcacheFree != Entry->State &&
+                BlockAddress <= Entry->BlockAddress && Entry->BlockAddress - BlockAddress < BlockCount)
+            {
+                SpdWbcacheRemove(Cache, Entry);
+                Cache->DiscardCount++;
+            }
+        }
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
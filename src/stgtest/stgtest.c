@@ -19,7 +19,11 @@
  * associated repository.
  */
 
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <shared/shared.h>
+#include <shared/frame.h>
+#include <shared/socket.h>
 
 #define PROGNAME                        "stgtest"
 
@@ -41,10 +45,44 @@ typedef union
     SPD_IOCTL_TRANSACT_RSP Rsp;
 } TRANSACT_MSG;
 
+/*
+ * A framed pipe or socket connection may have many requests in flight. Every thread that
+ * transacts registers a waiter for its hint and sends its request; one of the
+ * waiting threads at a time (the receiver) reads responses and hands each to its
+ * waiter. The receiver keeps reading until its own response arrives and then passes
+ * the job on to another waiting thread.
+ */
+typedef struct _STG_PIPE_WAITER
+{
+    struct _STG_PIPE_WAITER *Next;
+    UINT64 Hint;
+    HANDLE Event;
+    SPD_IOCTL_TRANSACT_RSP *Rsp;
+    PVOID DataBuffer;
+    ULONG DataLength;
+    BOOLEAN Done;
+    DWORD Error;
+} STG_PIPE_WAITER;
+typedef struct
+{
+    HANDLE Handle;
+    SPD_SOCKET Socket;                  /* socket backend; SPD_SOCKET_INVALID for pipes */
+    UINT8 Version;                      /* frame version; 0: unframed (legacy) */
+    SRWLOCK Lock;                       /* protects Waiters */
+    SRWLOCK ReceiveLock;                /* held by the receiver; protects Buffer */
+    SRWLOCK SendLock;                   /* sockets and split frames: see StgTransactPipeFramed */
+    STG_PIPE_WAITER *Waiters;
+    PVOID Buffer;
+} STG_PIPE;
+
 static DWORD StgOpenPipe(PWSTR PipeName, ULONG Timeout,
     PHANDLE PHandle, SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams)
 {
     HANDLE Handle = INVALID_HANDLE_VALUE;
+    STG_PIPE *Pipe = 0;
+    SPD_FRAME_HEADER Hello;
+    SPD_FRAME Frame;
+    OVERLAPPED Overlapped = { 0 };
     DWORD PipeMode;
     DWORD BytesTransferred;
     DWORD Error;
@@ -99,13 +137,68 @@ static DWORD StgOpenPipe(PWSTR PipeName, ULONG Timeout,
         goto exit;
     }
 
-    *PHandle = SetPipeHandle(Handle);
+    Pipe = MemAlloc(sizeof *Pipe);
+    if (0 == Pipe)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+    memset(Pipe, 0, sizeof *Pipe);
+    Pipe->Socket = SPD_SOCKET_INVALID;
+    InitializeSRWLock(&Pipe->Lock);
+    InitializeSRWLock(&Pipe->ReceiveLock);
+    InitializeSRWLock(&Pipe->SendLock);
+
+    Pipe->Buffer = MemAlloc(
+        sizeof(SPD_FRAME_HEADER) + sizeof(TRANSACT_MSG) + StorageUnitParams->MaxTransferLength);
+    if (0 == Pipe->Buffer)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+
+    /*
+     * Ask for frames. A unit that does not know about them drops the HELLO and never
+     * answers, in which case we give up after Timeout and stay unframed.
+     */
+    Error = SpdOverlappedInit(&Overlapped);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+    Error = SpdOverlappedWaitResult(
+        WriteFile(Handle, &Hello, SpdFrameEncodeHello(&Hello, SPD_FRAME_VERSION), 0, &Overlapped),
+        Handle, &Overlapped, &BytesTransferred);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+    if (!ReadFile(Handle, &Hello, sizeof Hello, 0, &Overlapped) &&
+        ERROR_IO_PENDING != GetLastError())
+    {
+        Error = GetLastError();
+        goto exit;
+    }
+    if (WAIT_OBJECT_0 != WaitForSingleObject(Overlapped.hEvent, Timeout))
+        CancelIoEx(Handle, &Overlapped);
+    if (GetOverlappedResult(Handle, &Overlapped, &BytesTransferred, TRUE) &&
+        SpdFrameDecode(&Hello, BytesTransferred,
+            StorageUnitParams->BlockLength, StorageUnitParams->MaxTransferLength, &Frame) &&
+        SpdFrameHelloType == Frame.Type)
+        Pipe->Version = Frame.Version;
+
+    Pipe->Handle = Handle;
+    *PHandle = SetPipeHandle(Pipe);
 
     Error = ERROR_SUCCESS;
 
 exit:
+    SpdOverlappedFini(&Overlapped);
+
     if (ERROR_SUCCESS != Error)
     {
+        if (0 != Pipe)
+        {
+            MemFree(Pipe->Buffer);
+            MemFree(Pipe);
+        }
+
         if (INVALID_HANDLE_VALUE != Handle)
             CloseHandle(Handle);
     }
@@ -113,33 +206,418 @@ exit:
     return Error;
 }
 
-static DWORD StgTransactPipe(HANDLE Handle,
+static DWORD StgOpenSocket(PWSTR Name, ULONG Timeout,
+    PHANDLE PHandle, SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams)
+{
+    SPD_SOCKET Socket = SPD_SOCKET_INVALID;
+    STG_PIPE *Pipe = 0;
+    BOOLEAN Startup = FALSE;
+    char NameBuf[SPD_SOCKET_NAME_MAX + 16];
+    UINT64 Buffer[SPD_SOCKET_FRAME_HEADER_SIZE / sizeof(UINT64)];
+    SPD_FRAME Frame;
+    UINT8 Version;
+    DWORD Error;
+
+    *PHandle = INVALID_HANDLE_VALUE;
+
+    if (0 == WideCharToMultiByte(CP_UTF8, 0, Name, -1, NameBuf, sizeof NameBuf, 0, 0))
+    {
+        Error = ERROR_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    Error = SpdSocketStartup();
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+    Startup = TRUE;
+
+    Error = SpdSocketOpen(NameBuf, FALSE, &Socket);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    /* the unit greets us with its frame version and the storage unit parameters */
+    Error = SpdSocketRecvFrameHeader(Socket, 0, 0, Buffer, &Frame);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+    if (SpdFrameHelloType != Frame.Type)
+    {
+        Error = ERROR_IO_DEVICE;
+        goto exit;
+    }
+    Version = SPD_FRAME_VERSION < Frame.Version ? SPD_FRAME_VERSION : Frame.Version;
+
+    Error = SpdSocketRecv(Socket, StorageUnitParams, sizeof *StorageUnitParams);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+    if (0 == StorageUnitParams->BlockCount ||
+        sizeof(SPD_IOCTL_UNMAP_DESCRIPTOR) > StorageUnitParams->BlockLength ||
+        0 == StorageUnitParams->MaxTransferLength ||
+        0 != StorageUnitParams->MaxTransferLength % StorageUnitParams->BlockLength)
+    {
+        Error = ERROR_IO_DEVICE;
+        goto exit;
+    }
+
+    Error = SpdSocketSendFrame(Socket, Version, SpdFrameHelloType, 0, 0, 0);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    Pipe = MemAlloc(sizeof *Pipe);
+    if (0 == Pipe)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+    memset(Pipe, 0, sizeof *Pipe);
+    Pipe->Handle = INVALID_HANDLE_VALUE;
+    Pipe->Socket = Socket;
+    Pipe->Version = Version;
+    InitializeSRWLock(&Pipe->Lock);
+    InitializeSRWLock(&Pipe->ReceiveLock);
+    InitializeSRWLock(&Pipe->SendLock);
+
+    /* frame headers and data that nobody waits for */
+    Pipe->Buffer = MemAlloc(
+        sizeof(SPD_FRAME_HEADER) + sizeof(TRANSACT_MSG) + StorageUnitParams->MaxTransferLength);
+    if (0 == Pipe->Buffer)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+
+    *PHandle = SetPipeHandle(Pipe);
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (ERROR_SUCCESS != Error)
+    {
+        if (0 != Pipe)
+        {
+            MemFree(Pipe->Buffer);
+            MemFree(Pipe);
+        }
+
+        if (SPD_SOCKET_INVALID != Socket)
+            SpdSocketClose(Socket);
+
+        if (Startup)
+            SpdSocketCleanup();
+    }
+
+    return Error;
+}
+
+static VOID StgPipeWakeWaiter(STG_PIPE *Pipe)
+{
+    AcquireSRWLockExclusive(&Pipe->Lock);
+    if (0 != Pipe->Waiters)
+        SetEvent(Pipe->Waiters->Event);
+    ReleaseSRWLockExclusive(&Pipe->Lock);
+}
+
+static DWORD StgPipeRead(STG_PIPE *Pipe, PVOID Buffer, ULONG Length,
+    PULONG PBytesTransferred, PBOOLEAN PMore)
+{
+    OVERLAPPED Overlapped;
+    DWORD BytesTransferred = 0;
+    DWORD Error;
+
+    Error = SpdOverlappedInit(&Overlapped);
+    if (ERROR_SUCCESS != Error)
+        return Error;
+    Error = SpdOverlappedWaitResult(
+        ReadFile(Pipe->Handle, Buffer, Length, 0, &Overlapped),
+        Pipe->Handle, &Overlapped, &BytesTransferred);
+    SpdOverlappedFini(&Overlapped);
+
+    /* the message is longer than Buffer: the next read gets the rest of it */
+    *PMore = ERROR_MORE_DATA == Error;
+    *PBytesTransferred = BytesTransferred;
+
+    return *PMore ? ERROR_SUCCESS : Error;
+}
+
+static DWORD StgPipeReceiveData(STG_PIPE *Pipe, PVOID Buffer, ULONG Length)
+{
+    ULONG BytesTransferred;
+    BOOLEAN More;
+    DWORD Error;
+
+    if (0 == Length)
+        return ERROR_SUCCESS;
+
+    if (SPD_SOCKET_INVALID != Pipe->Socket)
+        return SpdSocketRecv(Pipe->Socket, Buffer, Length);
+
+    /* a pipe message may hold more than we want now; the rest is read next */
+    Error = StgPipeRead(Pipe, Buffer, Length, &BytesTransferred, &More);
+    if (ERROR_SUCCESS == Error && Length != BytesTransferred)
+        Error = ERROR_IO_DEVICE;
+
+    return Error;
+}
+
+static VOID StgPipeReceive(STG_PIPE *Pipe,
+    const SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams)
+{
+    SPD_IOCTL_TRANSACT_RSP *Rsp;
+    STG_PIPE_WAITER **P, *Waiter;
+    SPD_FRAME Frame;
+    ULONG DataLength;
+    ULONG BytesTransferred;
+    BOOLEAN More;
+    DWORD Error;
+
+    /* read the response message only; the data go directly into the waiter buffer */
+    if (SPD_SOCKET_INVALID != Pipe->Socket)
+    {
+        Error = SpdSocketRecvFrameHeader(Pipe->Socket,
+            StorageUnitParams->BlockLength, StorageUnitParams->MaxTransferLength,
+            Pipe->Buffer, &Frame);
+        if (ERROR_SUCCESS != Error)
+            goto fail;
+    }
+    else
+    {
+        Error = StgPipeRead(Pipe,
+            Pipe->Buffer, sizeof(SPD_FRAME_HEADER) + sizeof(SPD_IOCTL_TRANSACT_RSP),
+            &BytesTransferred, &More);
+        if (ERROR_SUCCESS != Error)
+            goto fail;
+
+        /* up to version 1 the data are the rest of this message; then the next one */
+        if (!SpdFrameDecodeHeader(Pipe->Buffer, BytesTransferred,
+                StorageUnitParams->BlockLength, StorageUnitParams->MaxTransferLength, &Frame) ||
+            More != (SPD_FRAME_VERSION_SPLIT > Pipe->Version && 0 != Frame.DataLength))
+        {
+            Error = ERROR_IO_DEVICE;
+            goto fail;
+        }
+    }
+    if (SpdFrameRspType != Frame.Type)
+    {
+        Error = ERROR_IO_DEVICE;
+        goto fail;
+    }
+    Rsp = Frame.Message;
+
+    AcquireSRWLockExclusive(&Pipe->Lock);
+    for (P = &Pipe->Waiters; 0 != (Waiter = *P); P = &Waiter->Next)
+        if (Rsp->Hint == Waiter->Hint)
+        {
+            *P = Waiter->Next;
+            break;
+        }
+    ReleaseSRWLockExclusive(&Pipe->Lock);
+
+    /* a response to nobody is a protocol error, but it does not hurt anyone else */
+    if (0 == Waiter)
+    {
+        Error = StgPipeReceiveData(Pipe, Pipe->Buffer, Frame.DataLength);
+        if (ERROR_SUCCESS != Error)
+            goto fail;
+        return;
+    }
+
+    memcpy(Waiter->Rsp, Rsp, sizeof *Rsp);
+    DataLength = 0;
+    if (SpdIoctlTransactReadKind == Rsp->Kind && SCSISTAT_GOOD == Rsp->Status.ScsiStatus)
+    {
+        DataLength = Frame.DataLength < Waiter->DataLength ?
+            Frame.DataLength : Waiter->DataLength;
+        Error = StgPipeReceiveData(Pipe, Waiter->DataBuffer, DataLength);
+        memset((PUINT8)Waiter->DataBuffer + DataLength, 0,
+            Waiter->DataLength - DataLength);
+    }
+    if (ERROR_SUCCESS == Error)
+        Error = StgPipeReceiveData(Pipe, Pipe->Buffer, Frame.DataLength - DataLength);
+
+    /* once Done is seen the waiter may return, so signal it under the lock */
+    AcquireSRWLockExclusive(&Pipe->Lock);
+    Waiter->Error = Error;
+    Waiter->Done = TRUE;
+    SetEvent(Waiter->Event);
+    ReleaseSRWLockExclusive(&Pipe->Lock);
+
+    if (ERROR_SUCCESS != Error)
+        goto fail;
+
+    return;
+
+fail:
+    /* the connection is unusable: fail everyone */
+    AcquireSRWLockExclusive(&Pipe->Lock);
+    while (0 != (Waiter = Pipe->Waiters))
+    {
+        Pipe->Waiters = Waiter->Next;
+        Waiter->Error = Error;
+        Waiter->Done = TRUE;
+        SetEvent(Waiter->Event);
+    }
+    ReleaseSRWLockExclusive(&Pipe->Lock);
+}
+
+static DWORD StgTransactPipeFramed(STG_PIPE *Pipe,
     SPD_IOCTL_TRANSACT_REQ *Req,
     SPD_IOCTL_TRANSACT_RSP *Rsp,
     PVOID DataBuffer,
+    ULONG DataLength,
     const SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams)
 {
-    ULONG DataLength;
-    TRANSACT_MSG *Msg = 0;
+    STG_PIPE_WAITER Waiter, **P;
+    PUINT8 Msg = 0;
+    UINT64 Header[(sizeof(SPD_FRAME_HEADER) + sizeof(TRANSACT_MSG) + 7) / 8];
+    ULONG HeaderLength;
     OVERLAPPED Overlapped;
+    BOOLEAN Done;
     DWORD BytesTransferred;
     DWORD Error;
 
-    if (0 == Req || 0 == Rsp)
+    memset(&Waiter, 0, sizeof Waiter);
+    Waiter.Hint = Req->Hint;
+    Waiter.Rsp = Rsp;
+    Waiter.DataBuffer = DataBuffer;
+    Waiter.DataLength = SpdIoctlTransactReadKind == Req->Kind && 0 != DataBuffer ?
+        Req->Op.Read.BlockCount * StorageUnitParams->BlockLength : 0;
+    if (Waiter.DataLength > StorageUnitParams->MaxTransferLength)
         return ERROR_INVALID_PARAMETER;
 
     Error = SpdOverlappedInit(&Overlapped);
     if (ERROR_SUCCESS != Error)
-        goto exit;
+        return Error;
+    Waiter.Event = CreateEventW(0, FALSE, FALSE, 0);
+    if (0 == Waiter.Event)
+    {
+        Error = GetLastError();
+        SpdOverlappedFini(&Overlapped);
+        return Error;
+    }
 
-    Msg = MemAlloc(
-        sizeof(TRANSACT_MSG) + StorageUnitParams->MaxTransferLength);
-    if (0 == Msg)
+    if (SPD_SOCKET_INVALID == Pipe->Socket && SPD_FRAME_VERSION_SPLIT > Pipe->Version)
     {
-        Error = ERROR_NO_SYSTEM_RESOURCES;
+        /* version 1 frames are a single message: stage the data */
+        Msg = MemAlloc(sizeof(SPD_FRAME_HEADER) + sizeof(TRANSACT_MSG) + DataLength);
+        if (0 == Msg)
+        {
+            Error = ERROR_NO_SYSTEM_RESOURCES;
+            goto exit;
+        }
+        HeaderLength = SpdFrameEncode(Msg, Pipe->Version, SpdFrameReqType, Req, DataLength);
+        if (0 != DataLength)
+            memcpy(Msg + HeaderLength, DataBuffer, DataLength);
+    }
+
+    /* register before sending: the response may come back right away */
+    AcquireSRWLockExclusive(&Pipe->Lock);
+    Waiter.Next = Pipe->Waiters;
+    Pipe->Waiters = &Waiter;
+    ReleaseSRWLockExclusive(&Pipe->Lock);
+
+    if (SPD_SOCKET_INVALID != Pipe->Socket)
+    {
+        /* header and data go out in one vectored send, without a staging copy */
+        AcquireSRWLockExclusive(&Pipe->SendLock);
+        Error = SpdSocketSendFrame(Pipe->Socket,
+            Pipe->Version, SpdFrameReqType, Req, DataBuffer, DataLength);
+        ReleaseSRWLockExclusive(&Pipe->SendLock);
+    }
+    else if (SPD_FRAME_VERSION_SPLIT <= Pipe->Version)
+    {
+        /*
+         * The data go out as a message of their own, straight from DataBuffer. No other
+         * request may come between the header and the data: requests with data hold
+         * the send lock exclusive, requests without data hold it shared.
+         */
+        HeaderLength = SpdFrameEncode(Header, Pipe->Version, SpdFrameReqType, Req, DataLength);
+        if (0 != DataLength)
+            AcquireSRWLockExclusive(&Pipe->SendLock);
+        else
+            AcquireSRWLockShared(&Pipe->SendLock);
+        Error = SpdOverlappedWaitResult(
+            WriteFile(Pipe->Handle, Header, HeaderLength, 0, &Overlapped),
+            Pipe->Handle, &Overlapped, &BytesTransferred);
+        if (ERROR_SUCCESS == Error && 0 != DataLength)
+            Error = SpdOverlappedWaitResult(
+                WriteFile(Pipe->Handle, DataBuffer, DataLength, 0, &Overlapped),
+                Pipe->Handle, &Overlapped, &BytesTransferred);
+        if (0 != DataLength)
+            ReleaseSRWLockExclusive(&Pipe->SendLock);
+        else
+            ReleaseSRWLockShared(&Pipe->SendLock);
+    }
+    else
+        Error = SpdOverlappedWaitResult(
+            WriteFile(Pipe->Handle, Msg, HeaderLength + DataLength, 0, &Overlapped),
+            Pipe->Handle, &Overlapped, &BytesTransferred);
+    if (ERROR_SUCCESS != Error)
+    {
+        AcquireSRWLockExclusive(&Pipe->Lock);
+        for (P = &Pipe->Waiters; 0 != *P; P = &(*P)->Next)
+            if (&Waiter == *P)
+            {
+                *P = Waiter.Next;
+                break;
+            }
+        Done = Waiter.Done;
+        ReleaseSRWLockExclusive(&Pipe->Lock);
+
+        /* the receiver may have already failed us; either way we are off the list */
+        if (Done)
+            Error = Waiter.Error;
         goto exit;
     }
 
+    for (;;)
+    {
+        AcquireSRWLockShared(&Pipe->Lock);
+        Done = Waiter.Done;
+        ReleaseSRWLockShared(&Pipe->Lock);
+        if (Done)
+            break;
+
+        if (TryAcquireSRWLockExclusive(&Pipe->ReceiveLock))
+        {
+            while (!Waiter.Done)
+                StgPipeReceive(Pipe, StorageUnitParams);
+            ReleaseSRWLockExclusive(&Pipe->ReceiveLock);
+
+            /* hand the receiver job to a thread that is still waiting */
+            StgPipeWakeWaiter(Pipe);
+            break;
+        }
+
+        WaitForSingleObject(Waiter.Event, INFINITE);
+    }
+
+    Error = Waiter.Error;
+
+exit:
+    MemFree(Msg);
+
+    CloseHandle(Waiter.Event);
+    SpdOverlappedFini(&Overlapped);
+
+    return Error;
+}
+
+static DWORD StgTransactPipe(STG_PIPE *Pipe,
+    SPD_IOCTL_TRANSACT_REQ *Req,
+    SPD_IOCTL_TRANSACT_RSP *Rsp,
+    PVOID DataBuffer,
+    const SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams)
+{
+    HANDLE Handle = Pipe->Handle;
+    ULONG DataLength, ReadLength, ReadTransferred;
+    TRANSACT_MSG *Msg = 0;
+    OVERLAPPED Overlapped;
+    DWORD BytesTransferred;
+    BOOLEAN More;
+    DWORD Error;
+
+    if (0 == Req || 0 == Rsp)
+        return ERROR_INVALID_PARAMETER;
+
     DataLength = 0;
     if (0 != DataBuffer)
         switch (Req->Kind)
@@ -153,19 +631,50 @@ static DWORD StgTransactPipe(HANDLE Handle,
         default:
             break;
         }
+
+    if (0 != Pipe->Version)
+        return StgTransactPipeFramed(Pipe, Req, Rsp, DataBuffer, DataLength, StorageUnitParams);
+
+    Error = SpdOverlappedInit(&Overlapped);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    Msg = MemAlloc(
+        sizeof(TRANSACT_MSG) + StorageUnitParams->MaxTransferLength);
+    if (0 == Msg)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        goto exit;
+    }
+
+    /* unframed: responses cannot be told apart, so one request at a time */
+    AcquireSRWLockExclusive(&Pipe->ReceiveLock);
+
     memcpy(Msg, Req, sizeof *Req);
     if (0 != DataLength)
         memcpy(Msg + 1, DataBuffer, DataLength);
     Error = SpdOverlappedWaitResult(
         WriteFile(Handle, Msg, sizeof(TRANSACT_MSG) + DataLength, 0, &Overlapped),
         Handle, &Overlapped, &BytesTransferred);
-    if (ERROR_SUCCESS != Error)
-        goto exit;
+    More = FALSE;
+    if (ERROR_SUCCESS == Error)
+        Error = StgPipeRead(Pipe, Msg, sizeof(TRANSACT_MSG), &BytesTransferred, &More);
+
+    /* READ data are the rest of the message: read them directly into DataBuffer */
+    ReadLength = SpdIoctlTransactReadKind == Req->Kind ?
+        Req->Op.Read.BlockCount * StorageUnitParams->BlockLength : 0;
+    ReadTransferred = 0;
+    if (ERROR_SUCCESS == Error && More &&
+        sizeof(TRANSACT_MSG) == BytesTransferred && Req->Hint == Msg->Rsp.Hint &&
+        SpdIoctlTransactReadKind == Msg->Rsp.Kind && SCSISTAT_GOOD == Msg->Rsp.Status.ScsiStatus &&
+        ReadLength <= StorageUnitParams->MaxTransferLength)
+        Error = StgPipeRead(Pipe, DataBuffer, ReadLength, &ReadTransferred, &More);
+    while (ERROR_SUCCESS == Error && More)
+        Error = StgPipeRead(Pipe,
+            Msg + 1, StorageUnitParams->MaxTransferLength, &DataLength, &More);
+
+    ReleaseSRWLockExclusive(&Pipe->ReceiveLock);
 
-    Error = SpdOverlappedWaitResult(
-        ReadFile(Handle,
-            Msg, sizeof(TRANSACT_MSG) + StorageUnitParams->MaxTransferLength, 0, &Overlapped),
-        Handle, &Overlapped, &BytesTransferred);
     if (ERROR_SUCCESS != Error)
         goto exit;
     if (sizeof(TRANSACT_MSG) > BytesTransferred || Req->Hint != Msg->Rsp.Hint)
@@ -175,17 +684,13 @@ static DWORD StgTransactPipe(HANDLE Handle,
     }
     if (SpdIoctlTransactReadKind == Msg->Rsp.Kind && SCSISTAT_GOOD == Msg->Rsp.Status.ScsiStatus)
     {
-        DataLength = Req->Op.Read.BlockCount * StorageUnitParams->BlockLength;
-        if (DataLength > StorageUnitParams->MaxTransferLength)
+        if (ReadLength > StorageUnitParams->MaxTransferLength)
         {
             Error = ERROR_IO_DEVICE;
             goto exit;
         }
-        BytesTransferred -= sizeof(TRANSACT_MSG);
-        if (BytesTransferred > DataLength)
-            BytesTransferred = DataLength;
-        memcpy(DataBuffer, Msg + 1, BytesTransferred);
-        memset((PUINT8)(DataBuffer) + BytesTransferred, 0, DataLength - BytesTransferred);
+        /* the data may come short; the rest are zero */
+        memset((PUINT8)(DataBuffer) + ReadTransferred, 0, ReadLength - ReadTransferred);
     }
     memcpy(Rsp, &Msg->Rsp, sizeof *Rsp);
 
@@ -199,6 +704,24 @@ exit:
     return Error;
 }
 
+static DWORD StgClosePipe(STG_PIPE *Pipe)
+{
+    DWORD Error;
+
+    if (SPD_SOCKET_INVALID != Pipe->Socket)
+    {
+        SpdSocketClose(Pipe->Socket);
+        SpdSocketCleanup();
+        Error = ERROR_SUCCESS;
+    }
+    else
+        Error = CloseHandle(Pipe->Handle) ? 0 : GetLastError();
+    MemFree(Pipe->Buffer);
+    MemFree(Pipe);
+
+    return Error;
+}
+
 static DWORD StgOpenRaw(PWSTR Name, ULONG Timeout,
     PHANDLE PHandle, SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams)
 {
@@ -397,6 +920,11 @@ static DWORD StgOpen(PWSTR Name, ULONG Timeout,
         L'e'  == Name[7] &&
         L'\\' == Name[8])
         return StgOpenPipe(Name, Timeout, PHandle, StorageUnitParams);
+    else if (
+        (L't' == Name[0] && L'c' == Name[1] && L'p' == Name[2] && L':' == Name[3]) ||
+        (L'u' == Name[0] && L'n' == Name[1] && L'i' == Name[2] && L'x' == Name[3] &&
+            L':' == Name[4]))
+        return StgOpenSocket(Name, Timeout, PHandle, StorageUnitParams);
     else
         return StgOpenRaw(Name, Timeout, PHandle, StorageUnitParams);
 }
@@ -416,7 +944,7 @@ static DWORD StgTransact(HANDLE Handle,
 DWORD StgClose(HANDLE Handle)
 {
     if (IsPipeHandle(Handle))
-        return CloseHandle(GetPipeHandle(Handle)) ? 0 : GetLastError();
+        return StgClosePipe(GetPipeHandle(Handle));
     else
         return CloseHandle(GetRawHandle(Handle)) ? 0 : GetLastError();
 }
@@ -503,19 +1031,36 @@ static void OpWarn(UINT8 OpKind, UINT64 BlockAddress, UINT32 BlockCount,
             Description, Error);
 }
 
-static int run(PWSTR PipeName, ULONG OpCount, PWSTR OpSet, UINT64 BlockAddress, UINT32 BlockCount,
-    PULONG RandomSeed)
+typedef struct
+{
+    HANDLE Handle;
+    const SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams;
+    UINT64 BlockBase, BlockRange;       /* blocks this thread may touch */
+    ULONG OpCount;
+    PWSTR OpSet;
+    UINT64 BlockAddress;
+    UINT32 BlockCount;
+    ULONG RandomSeed;
+    DWORD Error;
+} RUN_CONTEXT;
+
+static DWORD run_ops(RUN_CONTEXT *Context)
 {
 #define CheckCondition(x)               \
     if (!(x))                           \
     {                                   \
-        OpWarn(Req.Kind, BlockAddress, OpBlockCount, "condition fail", #x, 0);\
+        OpWarn(Req.Kind, OpBlockAddress, OpBlockCount, "condition fail", #x, 0);\
         Error = ERROR_IO_DEVICE;        \
         goto exit;                      \
     }                                   \
     else
-    HANDLE Handle = INVALID_HANDLE_VALUE;
-    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    HANDLE Handle = Context->Handle;
+    const SPD_IOCTL_STORAGE_UNIT_PARAMS *StorageUnitParams = Context->StorageUnitParams;
+    ULONG OpCount = Context->OpCount;
+    PWSTR OpSet = Context->OpSet;
+    UINT64 BlockAddress = Context->BlockAddress;
+    UINT32 BlockCount = Context->BlockCount;
+    PULONG RandomSeed = &Context->RandomSeed;
     SPD_IOCTL_TRANSACT_REQ Req;
     SPD_IOCTL_TRANSACT_RSP Rsp;
     PVOID DataBuffer = 0;
@@ -523,18 +1068,12 @@ static int run(PWSTR PipeName, ULONG OpCount, PWSTR OpSet, UINT64 BlockAddress,
     ULONG OpKindCount;
     UINT8 TestOpKind;
     BOOLEAN RandomAddress, RandomCount;
+    UINT64 OpBlockAddress;
     UINT32 MaxBlockCount, OpBlockCount;
     DWORD ThreadId;
     DWORD Error;
 
-    Error = StgOpen(PipeName, 3000, &Handle, &StorageUnitParams);
-    if (ERROR_SUCCESS != Error)
-    {
-        warn(L"cannot open %s: %lu", PipeName, Error);
-        goto exit;
-    }
-
-    DataBuffer = MemAlloc(StorageUnitParams.MaxTransferLength);
+    DataBuffer = MemAlloc(StorageUnitParams->MaxTransferLength);
     if (0 == DataBuffer)
     {
         Error = ERROR_NO_SYSTEM_RESOURCES;
@@ -570,7 +1109,7 @@ static int run(PWSTR PipeName, ULONG OpCount, PWSTR OpSet, UINT64 BlockAddress,
 
     RandomAddress = -1 == BlockAddress;
     RandomCount = -1 == BlockCount;
-    MaxBlockCount = StorageUnitParams.MaxTransferLength / StorageUnitParams.BlockLength;
+    MaxBlockCount = StorageUnitParams->MaxTransferLength / StorageUnitParams->BlockLength;
     ThreadId = GetCurrentThreadId();
 
     for (ULONG I = 0, J = 0; OpCount > I; I++)
@@ -581,7 +1120,7 @@ static int run(PWSTR PipeName, ULONG OpCount, PWSTR OpSet, UINT64 BlockAddress,
                 GenRandomBytes(RandomSeed, &BlockAddress, sizeof BlockAddress);
             else if (0 != I)
                 BlockAddress += BlockCount;
-            BlockAddress %= StorageUnitParams.BlockCount;
+            BlockAddress %= Context->BlockRange;
 
             if (RandomCount)
             {
@@ -593,8 +1132,9 @@ static int run(PWSTR PipeName, ULONG OpCount, PWSTR OpSet, UINT64 BlockAddress,
             if (BlockCount == 0)
                 BlockCount = 1;
 
-            OpBlockCount = BlockAddress + BlockCount <= StorageUnitParams.BlockCount ?
-                BlockCount : (UINT32)(StorageUnitParams.BlockCount - BlockAddress);
+            OpBlockCount = BlockAddress + BlockCount <= Context->BlockRange ?
+                BlockCount : (UINT32)(Context->BlockRange - BlockAddress);
+            OpBlockAddress = Context->BlockBase + BlockAddress;
 
             TestOpKind = SpdIoctlTransactReservedKind;
         }
@@ -607,34 +1147,34 @@ static int run(PWSTR PipeName, ULONG OpCount, PWSTR OpSet, UINT64 BlockAddress,
         switch (Req.Kind)
         {
         case SpdIoctlTransactReadKind:
-            Req.Op.Read.BlockAddress = BlockAddress;
+            Req.Op.Read.BlockAddress = OpBlockAddress;
             Req.Op.Read.BlockCount = OpBlockCount;
-            Req.Op.Read.ForceUnitAccess = !StorageUnitParams.CacheSupported;
+            Req.Op.Read.ForceUnitAccess = !StorageUnitParams->CacheSupported;
             break;
         case SpdIoctlTransactWriteKind:
-            Req.Op.Write.BlockAddress = BlockAddress;
+            Req.Op.Write.BlockAddress = OpBlockAddress;
             Req.Op.Write.BlockCount = OpBlockCount;
-            Req.Op.Write.ForceUnitAccess = !StorageUnitParams.CacheSupported;
-            FillOrTest(DataBuffer, StorageUnitParams.BlockLength, BlockAddress, OpBlockCount, 0);
+            Req.Op.Write.ForceUnitAccess = !StorageUnitParams->CacheSupported;
+            FillOrTest(DataBuffer, StorageUnitParams->BlockLength, OpBlockAddress, OpBlockCount, 0);
             TestOpKind = SpdIoctlTransactWriteKind;
             break;
         case SpdIoctlTransactFlushKind:
-            Req.Op.Flush.BlockAddress = BlockAddress;
+            Req.Op.Flush.BlockAddress = OpBlockAddress;
             Req.Op.Flush.BlockCount = OpBlockCount;
             break;
         case SpdIoctlTransactUnmapKind:
             Req.Op.Unmap.Count = 1;
-            ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)->BlockAddress = BlockAddress;
+            ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)->BlockAddress = OpBlockAddress;
             ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)->BlockCount = OpBlockCount;
             ((SPD_IOCTL_UNMAP_DESCRIPTOR *)DataBuffer)->Reserved = 0;
             TestOpKind = SpdIoctlTransactUnmapKind;
             break;
         }
 
-        Error = StgTransact(Handle, &Req, &Rsp, DataBuffer, &StorageUnitParams);
+        Error = StgTransact(Handle, &Req, &Rsp, DataBuffer, StorageUnitParams);
         if (ERROR_SUCCESS != Error)
         {
-            OpWarn(Req.Kind, BlockAddress, OpBlockCount, "transact error", 0, Error);
+            OpWarn(Req.Kind, OpBlockAddress, OpBlockCount, "transact error", 0, Error);
             goto exit;
         }
 
@@ -647,10 +1187,10 @@ static int run(PWSTR PipeName, ULONG OpCount, PWSTR OpSet, UINT64 BlockAddress,
             if (SpdIoctlTransactWriteKind == TestOpKind)
             {
                 /* test buffer after Write */
-                if (!FillOrTest(DataBuffer, StorageUnitParams.BlockLength, BlockAddress, OpBlockCount,
+                if (!FillOrTest(DataBuffer, StorageUnitParams->BlockLength, OpBlockAddress, OpBlockCount,
                     SpdIoctlTransactWriteKind))
                 {
-                    OpWarn(Req.Kind, BlockAddress, OpBlockCount, "bad buffer", "after Write", 0);
+                    OpWarn(Req.Kind, OpBlockAddress, OpBlockCount, "bad buffer", "after Write", 0);
                     Error = ERROR_IO_DEVICE;
                     goto exit;
                 }
@@ -658,10 +1198,10 @@ static int run(PWSTR PipeName, ULONG OpCount, PWSTR OpSet, UINT64 BlockAddress,
             else if (SpdIoctlTransactUnmapKind == TestOpKind)
             {
                 /* test buffer after Unmap */
-                if (!FillOrTest(DataBuffer, StorageUnitParams.BlockLength, BlockAddress, OpBlockCount,
+                if (!FillOrTest(DataBuffer, StorageUnitParams->BlockLength, OpBlockAddress, OpBlockCount,
                     SpdIoctlTransactUnmapKind))
                 {
-                    OpWarn(Req.Kind, BlockAddress, OpBlockCount, "bad buffer", "after Unmap", 0);
+                    OpWarn(Req.Kind, OpBlockAddress, OpBlockCount, "bad buffer", "after Unmap", 0);
                     Error = ERROR_IO_DEVICE;
                     goto exit;
                 }
@@ -678,28 +1218,133 @@ static int run(PWSTR PipeName, ULONG OpCount, PWSTR OpSet, UINT64 BlockAddress,
 exit:
     MemFree(DataBuffer);
 
+    return Error;
+#undef CheckCondition
+}
+
+static DWORD WINAPI run_thread(PVOID Context0)
+{
+    RUN_CONTEXT *Context = Context0;
+
+    Context->Error = run_ops(Context);
+
+    return 0;
+}
+
+static int run(PWSTR PipeName, ULONG QueueDepth,
+    ULONG OpCount, PWSTR OpSet, UINT64 BlockAddress, UINT32 BlockCount,
+    PULONG RandomSeed)
+{
+    HANDLE Handle = INVALID_HANDLE_VALUE;
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    RUN_CONTEXT *Contexts = 0;
+    HANDLE *Threads = 0;
+    ULONG ThreadCount = 0;
+    DWORD Error;
+
+    Error = StgOpen(PipeName, 3000, &Handle, &StorageUnitParams);
+    if (ERROR_SUCCESS != Error)
+    {
+        warn(L"cannot open %s: %lu", PipeName, Error);
+        goto exit;
+    }
+
+    if (0 == QueueDepth)
+        QueueDepth = 1;
+    if (QueueDepth > StorageUnitParams.BlockCount)
+        QueueDepth = (ULONG)StorageUnitParams.BlockCount;
+
+    Contexts = MemAlloc(QueueDepth * sizeof *Contexts);
+    Threads = MemAlloc(QueueDepth * sizeof *Threads);
+    if (0 == Contexts || 0 == Threads)
+    {
+        Error = ERROR_NO_SYSTEM_RESOURCES;
+        warn(L"cannot allocate memory");
+        goto exit;
+    }
+
+    /*
+     * Each thread works on its own range of blocks, so that a thread's reads only
+     * see its own writes and unmaps. All threads share the one connection; with a
+     * framed pipe this keeps QueueDepth requests in flight.
+     */
+    for (ULONG I = 0; QueueDepth > I; I++)
+    {
+        RUN_CONTEXT *Context = &Contexts[I];
+
+        memset(Context, 0, sizeof *Context);
+        Context->Handle = Handle;
+        Context->StorageUnitParams = &StorageUnitParams;
+        Context->BlockRange = StorageUnitParams.BlockCount / QueueDepth;
+        Context->BlockBase = I * Context->BlockRange;
+        Context->OpCount = OpCount;
+        Context->OpSet = OpSet;
+        Context->BlockAddress = BlockAddress;
+        Context->BlockCount = BlockCount;
+        Context->RandomSeed = *RandomSeed + I;
+    }
+
+    if (1 == QueueDepth)
+        run_thread(&Contexts[0]);
+    else
+    {
+        for (; QueueDepth > ThreadCount; ThreadCount++)
+        {
+            Threads[ThreadCount] = CreateThread(0, 0, run_thread, &Contexts[ThreadCount], 0, 0);
+            if (0 == Threads[ThreadCount])
+            {
+                Error = GetLastError();
+                warn(L"cannot create thread: %lu", Error);
+                break;
+            }
+        }
+        for (ULONG I = 0; ThreadCount > I; I++)
+        {
+            WaitForSingleObject(Threads[I], INFINITE);
+            CloseHandle(Threads[I]);
+        }
+        if (ERROR_SUCCESS != Error)
+            goto exit;
+    }
+
+    for (ULONG I = 0; QueueDepth > I; I++)
+        if (ERROR_SUCCESS != Contexts[I].Error)
+        {
+            Error = Contexts[I].Error;
+            goto exit;
+        }
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    MemFree(Threads);
+    MemFree(Contexts);
+
     if (INVALID_HANDLE_VALUE != Handle)
         StgClose(Handle);
 
     return Error;
-#undef CheckCondition
 }
 
 static void usage(void)
 {
     warn(L""
-        "usage: %s [-s Seed] \\\\.\\pipe\\PipeName\\Target OpCount [RWFU] [Address|*] [Count|*]\n"
-        "usage: %s [-s Seed] \\\\.\\X: OpCount [RWFU] [Address|*] [Count|*]\n"
+        "usage: %s [-s Seed] [-q Depth] \\\\.\\pipe\\PipeName\\Target OpCount [RWFU] [Address|*] [Count|*]\n"
+        "usage: %s [-s Seed] [-q Depth] \\\\.\\X: OpCount [RWFU] [Address|*] [Count|*]\n"
+        "usage: %s [-s Seed] [-q Depth] tcp://Host:Port|unix://Path OpCount [RWFU] [Address|*] [Count|*]\n"
         "    -s Seed     Seed to use for randomness (default: time)\n"
+        "    -q Depth    Requests in flight, each from its own thread and block range (default: 1)\n"
         "    PipeName    Name of storage unit pipe\n"
         "    Target      SCSI target id (usually 0)\n"
         "    X:          Volume drive (must use RAW file system; requires admin)\n"
+        "    Host:Port   TCP address of storage unit socket\n"
+        "    Path        Path of storage unit Unix domain socket\n"
         "    OpCount     Operation count\n"
         "    RWFU        One or more: R: Read, W: Write, F: Flush, U: Unmap\n"
         "    Address     Starting block address, *: random\n"
         "    Count       Block count per operation, *: random\n"
         "",
-        L"" PROGNAME, L"" PROGNAME);
+        L"" PROGNAME, L"" PROGNAME, L"" PROGNAME);
 
     ExitProcess(ERROR_INVALID_PARAMETER);
 }
@@ -711,20 +1356,30 @@ int wmain(int argc, wchar_t **argv)
     PWSTR OpSet = L"";
     UINT64 BlockAddress = 0;
     UINT32 BlockCount = 0;
-    ULONG RandomSeed = 1;
+    ULONG RandomSeed = GetTickCount();
+    ULONG QueueDepth = 1;
     wchar_t *endp;
 
     argc--;
     argv++;
-    if (0 != argv[0] && L'-' == argv[0][0] && L's' == argv[0][1] && L'\0' == argv[0][2] &&
+    while (0 != argv[0] && L'-' == argv[0][0] && L'\0' != argv[0][1] && L'\0' == argv[0][2] &&
         0 != argv[1])
     {
-        RandomSeed = (ULONG)wcstoint(argv[1], 0, 0, &endp);
+        switch (argv[0][1])
+        {
+        case L's':
+            RandomSeed = (ULONG)wcstoint(argv[1], 0, 0, &endp);
+            break;
+        case L'q':
+            QueueDepth = (ULONG)wcstoint(argv[1], 0, 0, &endp);
+            break;
+        default:
+            usage();
+            break;
+        }
         argc -= 2;
         argv += 2;
     }
-    else
-        RandomSeed = GetTickCount();
 
     if (2 > argc || 5 < argc)
         usage();
@@ -747,10 +1402,10 @@ int wmain(int argc, wchar_t **argv)
         wsprintfW(BlockAddressStr, L"%x:%x", (UINT32)(BlockAddress >> 32), BlockAddress);
     if (-1 != BlockCount)
         wsprintfW(BlockCountStr, L"%lu", BlockCount);
-    info(L"%s -s %lu %s %lu \"%s\" %s %s",
-        L"" PROGNAME, RandomSeed, PipeName, OpCount, OpSet, BlockAddressStr, BlockCountStr);
+    info(L"%s -s %lu -q %lu %s %lu \"%s\" %s %s",
+        L"" PROGNAME, RandomSeed, QueueDepth, PipeName, OpCount, OpSet, BlockAddressStr, BlockCountStr);
 
-    int ExitCode = run(PipeName, OpCount, OpSet, BlockAddress, BlockCount, &RandomSeed);
+    int ExitCode = run(PipeName, QueueDepth, OpCount, OpSet, BlockAddress, BlockCount, &RandomSeed);
     if (0 == ExitCode)
         info(L"OK");
     return ExitCode;
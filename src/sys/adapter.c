@@ -44,8 +44,10 @@ ULONG SpdHwFindAdapter(
         ConfigInfo->ScatterGather = TRUE;
         ConfigInfo->Master = TRUE;
         ConfigInfo->CachesData = TRUE;
-        ConfigInfo->MaximumNumberOfTargets = (UCHAR)DeviceExtension->StorageUnitCapacity;
-        ConfigInfo->MaximumNumberOfLogicalUnits = 1;
+        ConfigInfo->MaximumNumberOfTargets =
+            (UCHAR)SPD_IOCTL_TARGET_COUNT(DeviceExtension->StorageUnitCapacity);
+        ConfigInfo->MaximumNumberOfLogicalUnits =
+            (UCHAR)SPD_IOCTL_LUN_COUNT(DeviceExtension->StorageUnitCapacity);
         ConfigInfo->WmiDataProvider = FALSE;
         ConfigInfo->SynchronizationModel = StorSynchronizeFullDuplex;
         ConfigInfo->VirtualDevice = TRUE;
@@ -93,13 +95,11 @@ BOOLEAN SpdHwResetBus(PVOID DeviceExtension0, ULONG PathId)
         SPD_DEVICE_EXTENSION *DeviceExtension = DeviceExtension0;
         SPD_STORAGE_UNIT *StorageUnit;
 
-        for (ULONG I = 0; DeviceExtension->StorageUnitCapacity > I; I++)
+        for (ULONG Index = 0;
+            0 != (StorageUnit = SpdStorageUnitReferenceNext(DeviceExtension, &Index));)
         {
-            StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, SPD_IOCTL_BTL(0, I, 0));
-            if (0 == StorageUnit)
-                continue;
-
             SpdIoqReset(StorageUnit->Ioq, FALSE);
+            SpdStorageUnitUnmapSrbs(DeviceExtension, StorageUnit);
 
             SpdStorageUnitDereference(DeviceExtension, StorageUnit);
         }
@@ -30,8 +30,41 @@
 #include <storport.h>
 #include <ntddscsi.h>
 #include <winspd/ioctl.h>
+#include <shared/ring.h>
+#include <shared/chunk.h>
+#include <shared/unittab.h>
 #include "srbcompat.h"
 
+/* epoch readers run at DISPATCH_LEVEL and cannot be preempted; writers spin */
+#define SpdEpochWait()                  YieldProcessor()
+#include <shared/epoch.h>
+
+/* scheduler deadlines and rate limits run on interrupt time */
+#define SpdIoSchedNow()                 KeQueryInterruptTime()
+#include <shared/iosched.h>
+
+/* multi-queue locks are spin locks; queue operations run at DISPATCH_LEVEL */
+#define SPD_MQ_LOCK                     KSPIN_LOCK
+#define SpdMqLockInitialize(L)          KeInitializeSpinLock(L)
+#define SpdMqLockAcquire(L)             KeAcquireSpinLockAtDpcLevel(L)
+#define SpdMqLockTryAcquire(L)          KeTryToAcquireSpinLockAtDpcLevel(L)
+#define SpdMqLockRelease(L)             KeReleaseSpinLockFromDpcLevel(L)
+#include <shared/mqueue.h>
+#include <shared/merge.h>
+#include <shared/bcache.h>
+
+/* dispatchers poll on the performance counter; interrupt time is too coarse for that */
+static inline
+UINT64 SpdPerformanceTime(VOID)
+{
+    LARGE_INTEGER Counter, Frequency;
+    Counter = KeQueryPerformanceCounter(&Frequency);
+    return (UINT64)(Counter.QuadPart / Frequency.QuadPart) * 10000000 +
+        (UINT64)(Counter.QuadPart % Frequency.QuadPart) * 10000000 / (UINT64)Frequency.QuadPart;
+}
+#define SpdSpinWaitNow()                SpdPerformanceTime()
+#include <shared/spinwait.h>
+
 /* disable warnings */
 #pragma warning(disable:4100)           /* unreferenced formal parameter */
 #pragma warning(disable:4200)           /* zero-sized array in struct/union */
@@ -140,6 +173,10 @@ const char *SrbStringize(PVOID Srb, char Buffer[], size_t Size);
 #define SpdFree(Pointer, Tag)           ExFreePoolWithTag(Pointer, Tag)
 #define SpdTagStorageUnit               'SdpS'
 #define SpdTagIoq                       'QdpS'
+#define SpdTagRing                      'RdpS'
+#define SpdTagEpoch                     'EdpS'
+#define SpdTagUnitTable                 'TdpS'
+#define SpdTagReadCache                 'CdpS'
 
 /* hash mix */
 /* Based on the MurmurHash3 fmix32/fmix64 function:
@@ -208,8 +245,9 @@ FORCEINLINE VOID SpdSrbComplete(PVOID DeviceExtension, PVOID Srb, UCHAR SrbStatu
     StorPortNotification(RequestComplete, DeviceExtension, Srb);
 }
 UCHAR SpdSrbExecuteScsi(PVOID DeviceExtension, PVOID Srb);
-VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension, PVOID Context, PVOID DataBuffer);
-UCHAR SpdSrbExecuteScsiComplete(PVOID SrbExtension, PVOID Context, PVOID DataBuffer);
+VOID SpdSrbExecuteScsiPrepare(PVOID Chunk, PVOID Context, PVOID DataBuffer);
+VOID SpdSrbExecuteScsiPrepareMapped(PVOID Chunk, PVOID Context, PVOID DataBuffer);
+UCHAR SpdSrbExecuteScsiComplete(PVOID Chunk, PVOID Context, PVOID DataBuffer);
 UCHAR SpdSrbAbortCommand(PVOID DeviceExtension, PVOID Srb);
 UCHAR SpdSrbResetBus(PVOID DeviceExtension, PVOID Srb);
 UCHAR SpdSrbResetDevice(PVOID DeviceExtension, PVOID Srb);
@@ -316,14 +354,61 @@ retry:
 
 /* I/O queue */
 typedef struct
+{
+    PMDL Mdl;
+    PKEVENT Event;
+    VOID (*Prepare)(PVOID Chunk, PVOID Context, PVOID DataBuffer);
+    UCHAR (*Complete)(PVOID Chunk, PVOID Context, PVOID DataBuffer);
+    SPD_RING_PORT ReqPort, RspPort;
+    PUINT8 DataBuffer;
+    ULONG DataStride;
+    ULONG Capacity;
+    ULONG FreeSlotCount;
+    ULONG *FreeSlots;                   /* stack of free data slots */
+    UINT8 *SlotInUse;
+} SPD_IOQ_RING;
+/*
+ * The I/O queue is a multi-queue (see shared/mqueue.h) of SRB chunks: each chunk of an
+ * SRB lives in the queue that its address hashes to, so the chunks of a large SRB are
+ * dispatched in parallel. Which chunk goes next and how fast is up to the scheduler
+ * configured at provision time (see shared/iosched.h); when its rate limit holds chunks
+ * back, ThrottleTimer wakes the dispatchers once there is credit again. If the storage
+ * unit coalesces, the chunk that goes next may take adjacent pending SRB's along with
+ * it (see SpdIoqMergeNoLock). A dispatcher that finds no chunk may poll for a while
+ * before it waits on PendingEvent; posters do not set the event while one polls (see
+ * shared/spinwait.h). SRB's that are done are collected while the locks are held and
+ * completed to StorPort once they are released (see SpdIoqCompleteSrbs). Lock order:
+ * SpinLock, then queue locks in ascending order, then UnmapSpinLock. Stopped changes
+ * only while SpinLock and all queue locks are held, so holding any one of them is
+ * enough to read it.
+ */
+#define SPD_IOQ_QUEUE_MAX               16
+#define SPD_IOQ_BUCKET_MIN              64
+#define SPD_IOQ_MERGE_SCAN_MAX          64      /* pending requests to look at per queue */
+typedef struct
+{
+    volatile LONG64 LockHoldTime;       /* in the completion paths; 100ns units */
+    volatile LONG64 LockHoldCount;
+    volatile LONG64 CompleteTime;       /* in SpdSrbComplete, which used to be under the lock */
+    volatile LONG64 CompleteCount;
+} SPD_IOQ_STATS;
+typedef struct
 {
     PVOID DeviceExtension;
-    KSPIN_LOCK SpinLock;
+    KSPIN_LOCK SpinLock;                /* protects Ring */
+    KSPIN_LOCK UnmapSpinLock;           /* protects UnmapList and SRB map state */
     BOOLEAN Stopped;
     SPD_QEVENT PendingEvent;
-    LIST_ENTRY PendingList, ProcessList;
-    ULONG ProcessBucketCount;
-    PVOID ProcessBuckets[];
+    SPD_MQ_ENTRY UnmapList;             /* SRB's whose completion waits for an unmap */
+    SPD_IOQ_RING *volatile Ring;
+    KTIMER ThrottleTimer;               /* wakes up dispatchers held back by the rate limit */
+    KDPC ThrottleDpc;
+    volatile LONG ThrottleState;
+    SPD_SPINWAIT SpinWait;              /* dispatchers polling for chunks */
+    SPD_IOQ_STATS Stats;                /* see SpdIoqGetStats */
+    volatile BOOLEAN StatsTiming;       /* also time lock holds and completions */
+    SPD_MQ Mq;
+    SPD_MQ_QUEUE Queues[];              /* followed by the processing buckets */
 } SPD_IOQ;
 NTSTATUS SpdIoqCreate(PVOID DeviceExtension, SPD_IOQ **PIoq);
 VOID SpdIoqDelete(SPD_IOQ *Ioq);
@@ -332,44 +417,123 @@ BOOLEAN SpdIoqStopped(SPD_IOQ *Ioq);
 NTSTATUS SpdIoqCancelSrb(SPD_IOQ *Ioq, PVOID Srb);
 NTSTATUS SpdIoqPostSrb(SPD_IOQ *Ioq, PVOID Srb);
 NTSTATUS SpdIoqStartProcessingSrb(SPD_IOQ *Ioq, PLARGE_INTEGER Timeout, PIRP CancellableIrp,
-    VOID (*Prepare)(PVOID SrbExtension, PVOID Context, PVOID DataBuffer),
+    VOID (*Prepare)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
     PVOID Context, PVOID DataBuffer);
 VOID SpdIoqEndProcessingSrb(SPD_IOQ *Ioq, UINT64 Hint,
-    UCHAR (*Complete)(PVOID SrbExtension, PVOID Context, PVOID DataBuffer),
-    PVOID Context, PVOID DataBuffer);
+    UCHAR (*Complete)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
+    PVOID Context, PVOID DataBuffer,
+    SPD_MQ_ENTRY *CompleteList);
+VOID SpdIoqCompleteSrbs(SPD_IOQ *Ioq, SPD_MQ_ENTRY *CompleteList);
+VOID SpdIoqGetStats(SPD_IOQ *Ioq, SPD_IOQ_STATS *Stats);
+VOID SpdIoqSetStatsTiming(SPD_IOQ *Ioq, BOOLEAN Timing);
+NTSTATUS SpdIoqSetupRing(SPD_IOQ *Ioq,
+    ULONG Capacity, PVOID Buffer, UINT64 BufferSize, HANDLE Event, ULONG DataStride,
+    VOID (*Prepare)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
+    UCHAR (*Complete)(PVOID Chunk, PVOID Context, PVOID DataBuffer));
+NTSTATUS SpdIoqRingDoorbell(SPD_IOQ *Ioq);
+PVOID SpdIoqMapSrb(SPD_IOQ *Ioq, PVOID Chunk, PVOID DataBuffer);
+VOID SpdIoqUnmapSrbs(SPD_IOQ *Ioq);
+BOOLEAN SpdIoqUnmapPending(SPD_IOQ *Ioq);
+enum
+{
+    SpdSrbMapNone = 0,
+    SpdSrbMapPending,                   /* MDL built; waiting for SpdIoqMapSrb */
+    SpdSrbMapDone,                      /* mapped into MapProcess at MapAddress */
+    SpdSrbMapFailed,                    /* do not try again; copy instead */
+    SpdSrbMapUnmapping,                 /* SpdIoqUnmapSrbs is working on it */
+};
+/*
+ * An SRB is dispatched as up to SPD_SRB_CHUNK_MAX chunks at a time (see shared/chunk.h).
+ * A chunk is a request of its own: its hint is its address and it is active from the
+ * time it is posted until it is retired; when it completes it may be reposted with the
+ * next piece of the SRB. The SRB completes when its last active chunk is retired.
+ */
+#define SPD_SRB_CHUNK_MAX               8
+typedef struct _SPD_SRB_CHUNK
+{
+    SPD_MQ_ENTRY QueueEntry;            /* must be first: the request hint is its address */
+    struct _SPD_SRB_EXTENSION *SrbExtension;
+    ULONG ChunkOffset;
+    BOOLEAN Active;                     /* protected by the chunk's queue lock */
+    BOOLEAN Mapped;
+} SPD_SRB_CHUNK;
 typedef struct _SPD_SRB_EXTENSION
 {
+    SPD_SRB_CHUNK Chunks[SPD_SRB_CHUNK_MAX];    /* must be first: see SpdIoqCompleteSrbNoLock */
     struct _SPD_STORAGE_UNIT *StorageUnit;
-    LIST_ENTRY ListEntry;
-    PVOID HashNext;
     PVOID Srb;
     PVOID SystemDataBuffer;
     ULONG SystemDataLength;
-    ULONG ChunkOffset;
+    ULONG ChunkCount;                   /* chunks in use; read-only after posting */
+    volatile LONG ChunkNextOffset;      /* offset of the next piece to hand out */
+    volatile LONG ChunkActiveCount;
+    volatile LONG ChunkSrbStatus;       /* first error; 0 (SRB_STATUS_PENDING) if none */
+    /* zero-copy mapping; see SpdSrbExecuteScsiPrepareMapped; protected by UnmapSpinLock */
+    PMDL MapMdl;
+    PVOID MapAddress;
+    PEPROCESS MapProcess;
+    UINT8 MapState;
+    BOOLEAN CompletePending;
+    UCHAR CompleteSrbStatus;
+    /*
+     * merging; only SRB's of a single chunk merge. A merged SRB is protected by the
+     * queue lock of its MergeLeader, which is the SRB whose chunk was handed out (the
+     * leader points to itself) and whose Merge lists all merged SRB's.
+     */
+    SPD_MERGE_ENTRY MergeEntry;
+    SPD_MERGE Merge;
+    struct _SPD_SRB_EXTENSION *MergeLeader;
+    UINT64 ReadCacheGeneration;         /* READ: see shared/bcache.h */
 } SPD_SRB_EXTENSION;
 #define SpdSrbExtension(Srb)            ((SPD_SRB_EXTENSION *)SrbGetMiniportContext(Srb))
+typedef struct
+{
+    SPD_IOCTL_TRANSACT_REQ *Req;
+    PVOID MapChunk;                     /* out: call SpdIoqMapSrb for this chunk */
+    PVOID MappedDataBuffer;             /* out: chunk address in the current process */
+} SPD_SRB_MAP_CONTEXT;
 
 /* storage units */
 typedef struct _SPD_STORAGE_UNIT SPD_STORAGE_UNIT;
 typedef struct _SPD_DEVICE_EXTENSION
 {
-    KSPIN_LOCK SpinLock;
+    KSPIN_LOCK SpinLock;                /* serializes changes to StorageUnits */
     PDEVICE_OBJECT DeviceObject;        /* adapter device */
-    ULONG StorageUnitCount, StorageUnitCapacity;
-    SPD_STORAGE_UNIT *StorageUnits[];
+    ULONG StorageUnitCapacity;
+    SPD_EPOCH Epoch;                    /* lock-free StorageUnits lookup; one slot per CPU */
+    SPD_UNIT_TABLE *StorageUnits;       /* by index (B/T/L) and by GUID */
 } SPD_DEVICE_EXTENSION;
+typedef struct
+{
+    PMDL Mdl;                           /* 0 if slot is free */
+    PVOID SystemAddress;
+    ULONG Length;
+    ULONG RefCount;                     /* one for the registration plus one per user */
+    BOOLEAN Registered;
+} SPD_REGISTERED_BUFFER;
 typedef struct _SPD_STORAGE_UNIT
 {
+    /* fields updated with interlocked operations */
+    volatile LONG RefCount;
     /* fields protected by SPD_DEVICE_EXTENSION::SpinLock */
-    ULONG RefCount;
+    SPD_UNIT_TABLE_ENTRY TableEntry;
     /* fields below are read-only after construction */
     SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
     CHAR SerialNumber[36];
     ULONG OwnerProcessId;
     SPD_IOQ *Ioq;
+    PIO_WORKITEM UnmapWorkItem;         /* see SpdStorageUnitUnmapSrbs */
     /* fields not protected */
     PDEVICE_OBJECT DeviceObject;        /* disk device */
     ULONG TransactProcessId;
+    volatile LONG UnmapWorkCount;       /* interlocked */
+    /* fields protected by BufferSpinLock */
+    KSPIN_LOCK BufferSpinLock;
+    BOOLEAN BuffersStopped;
+    SPD_REGISTERED_BUFFER Buffers[SPD_IOCTL_REGISTERED_BUFFER_MAX];
+    /* fields protected by ReadCacheSpinLock; ReadCache.EntryCount is 0 if there is no cache */
+    KSPIN_LOCK ReadCacheSpinLock;
+    SPD_BCACHE ReadCache;
 } SPD_STORAGE_UNIT;
 NTSTATUS SpdDeviceExtensionInit(SPD_DEVICE_EXTENSION *DeviceExtension, PVOID BusInformation);
 VOID SpdDeviceExtensionFini(SPD_DEVICE_EXTENSION *DeviceExtension);
@@ -390,10 +554,29 @@ SPD_STORAGE_UNIT *SpdStorageUnitReferenceByBtl(
 VOID SpdStorageUnitDereference(
     SPD_DEVICE_EXTENSION *DeviceExtension,
     SPD_STORAGE_UNIT *StorageUnit);
-ULONG SpdStorageUnitGetUseBitmap(
+VOID SpdStorageUnitUnmapSrbs(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit);
+NTSTATUS SpdStorageUnitRegisterBuffer(
+    SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer, ULONG Length,
+    PUINT32 PIndex);
+NTSTATUS SpdStorageUnitUnregisterBuffer(
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT32 Index);
+PVOID SpdStorageUnitReferenceBuffer(
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT32 Index, ULONG Length);
+VOID SpdStorageUnitDereferenceBuffer(
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT32 Index);
+SPD_STORAGE_UNIT *SpdStorageUnitReferenceNext(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    PULONG PIndex);
+ULONG SpdStorageUnitGetList(
     SPD_DEVICE_EXTENSION *DeviceExtension,
     PULONG PProcessId,
-    UINT8 Bitmap[32]);
+    PUINT32 BtlBuf, ULONG BtlCount);
 NTSTATUS SpdStorageUnitGlobalSetDevice(
     PDEVICE_OBJECT DeviceObject);
 SPD_STORAGE_UNIT *SpdStorageUnitGlobalReferenceByDevice(
@@ -411,8 +594,10 @@ SPD_STORAGE_UNIT *SpdStorageUnitReference(PVOID DeviceExtension, PVOID Srb)
 extern ERESOURCE SpdGlobalDeviceResource;
 extern SPD_DEVICE_EXTENSION *SpdGlobalDeviceExtension;  /* protected by SpdGlobalDeviceResource */
 extern ULONG SpdStorageUnitCapacity;                    /* read-only after DriverLoad */
-#define SPD_INDEX_FROM_BTL(Btl)         SPD_IOCTL_BTL_T(Btl)
-#define SPD_BTL_FROM_INDEX(Idx)         SPD_IOCTL_BTL(0, Idx, 0)
+#define SPD_INDEX_FROM_BTL(DeviceExtension, Btl)\
+    SPD_IOCTL_INDEX_FROM_BTL((DeviceExtension)->StorageUnitCapacity, Btl)
+#define SPD_BTL_FROM_INDEX(DeviceExtension, Idx)\
+    SPD_IOCTL_BTL_FROM_INDEX((DeviceExtension)->StorageUnitCapacity, Idx)
 
 /* utility */
 NTSTATUS SpdRegistryGetValue(PUNICODE_STRING Path, PUNICODE_STRING ValueName,
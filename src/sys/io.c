@@ -97,6 +97,7 @@ UCHAR SpdSrbAbortCommand(PVOID DeviceExtension, PVOID Srb)
         return SRB_STATUS_NO_DEVICE;
 
     Result = SpdIoqCancelSrb(StorageUnit->Ioq, Srb);
+    SpdStorageUnitUnmapSrbs(DeviceExtension, StorageUnit);
 
     SpdStorageUnitDereference(DeviceExtension, StorageUnit);
 
@@ -116,22 +117,31 @@ UCHAR SpdSrbResetBus(PVOID DeviceExtension, PVOID Srb)
     return SRB_STATUS_SUCCESS;
 }
 
-UCHAR SpdSrbResetDevice(PVOID DeviceExtension, PVOID Srb)
+UCHAR SpdSrbResetDevice(PVOID DeviceExtension0, PVOID Srb)
 {
+    SPD_DEVICE_EXTENSION *DeviceExtension = DeviceExtension0;
     SPD_STORAGE_UNIT *StorageUnit;
     UCHAR PathId, TargetId, Lun;
+    UCHAR Result = SRB_STATUS_NO_DEVICE;
 
+    /* reset every LUN of the target (the SRB's Lun is invalid) */
     SrbGetPathTargetLun(Srb, &PathId, &TargetId, &Lun);
-    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension,
-        SPD_IOCTL_BTL(PathId, TargetId, 0/* Lun is invalid! */));
-    if (0 == StorageUnit)
-        return SRB_STATUS_NO_DEVICE;
+    for (ULONG L = 0; SPD_IOCTL_LUN_COUNT(DeviceExtension->StorageUnitCapacity) > L; L++)
+    {
+        StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension,
+            SPD_IOCTL_BTL(PathId, TargetId, L));
+        if (0 == StorageUnit)
+            continue;
 
-    SpdIoqReset(StorageUnit->Ioq, FALSE);
+        SpdIoqReset(StorageUnit->Ioq, FALSE);
+        SpdStorageUnitUnmapSrbs(DeviceExtension, StorageUnit);
 
-    SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
 
-    return SRB_STATUS_SUCCESS;
+        Result = SRB_STATUS_SUCCESS;
+    }
+
+    return Result;
 }
 
 UCHAR SpdSrbResetLogicalUnit(PVOID DeviceExtension, PVOID Srb)
@@ -143,6 +153,7 @@ UCHAR SpdSrbResetLogicalUnit(PVOID DeviceExtension, PVOID Srb)
         return SRB_STATUS_NO_DEVICE;
 
     SpdIoqReset(StorageUnit->Ioq, FALSE);
+    SpdStorageUnitUnmapSrbs(DeviceExtension, StorageUnit);
 
     SpdStorageUnitDereference(DeviceExtension, StorageUnit);
 
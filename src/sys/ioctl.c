@@ -20,6 +20,7 @@
  */
 
 #include <sys/driver.h>
+#include <shared/batch.h>
 
 static VOID SpdIoctlProvision(SPD_DEVICE_EXTENSION *DeviceExtension,
     ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_PROVISION_PARAMS *Params,
@@ -40,6 +41,11 @@ static VOID SpdIoctlProvision(SPD_DEVICE_EXTENSION *DeviceExtension,
         DIRECT_ACCESS_DEVICE != Params->Dir.Par.StorageUnitParams.DeviceType ||
         0 == Params->Dir.Par.StorageUnitParams.MaxTransferLength ||
         0 != Params->Dir.Par.StorageUnitParams.MaxTransferLength %
+            Params->Dir.Par.StorageUnitParams.BlockLength ||
+        SpdIoctlSchedPolicyCount <= Params->Dir.Par.StorageUnitParams.SchedPolicy ||
+        SPD_IOSCHED_BANDWIDTH_MAX < Params->Dir.Par.StorageUnitParams.MaxBandwidth ||
+        SPD_SPINWAIT_BUDGET_MAX / 10 < Params->Dir.Par.StorageUnitParams.SpinBudget ||
+        SPD_IOCTL_READ_CACHE_SIZE_MAX < (UINT64)Params->Dir.Par.StorageUnitParams.ReadCacheBlockCount *
             Params->Dir.Par.StorageUnitParams.BlockLength)
     {
         Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
@@ -92,10 +98,8 @@ static VOID SpdIoctlGetList(SPD_DEVICE_EXTENSION *DeviceExtension,
     ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_LIST_PARAMS *Params,
     PIRP Irp)
 {
-    PUINT32 BtlBgnP = Irp->AssociatedIrp.SystemBuffer;
-    PUINT32 BtlEndP = (PVOID)((PUINT8)BtlBgnP + OutputBufferLength);
-    PUINT32 BtlP = BtlBgnP;
-    UINT8 Bitmap[32];
+    PUINT32 BtlBuf = Irp->AssociatedIrp.SystemBuffer;
+    ULONG BtlCount = OutputBufferLength / sizeof(UINT32);
     ULONG Count;
 
     if (sizeof *Params > InputBufferLength)
@@ -104,25 +108,60 @@ static VOID SpdIoctlGetList(SPD_DEVICE_EXTENSION *DeviceExtension,
         goto exit;
     }
 
-    Count = SpdStorageUnitGetUseBitmap(DeviceExtension, 0, Bitmap);
+    Count = SpdStorageUnitGetList(DeviceExtension, 0, BtlBuf, BtlCount);
+    if (Count > BtlCount)
+    {
+        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+        goto exit;
+    }
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = Count * sizeof(UINT32);
+
+exit:;
+}
+
+static NTSTATUS SpdIoctlLockDataBuffer(PVOID *PDataBuffer, ULONG Length, PIRP Irp)
+{
+    PVOID DataBuffer = *PDataBuffer;
+    PMDL Mdl;
+    NTSTATUS Result = STATUS_SUCCESS;
 
-    for (ULONG I = 0; 0 < Count && sizeof Bitmap * 8 > I; I++)
-        if (FlagOn(Bitmap[I >> 3], 1 << (I & 7)))
+    /* the MDL is attached to the IRP and gets freed when the IRP completes */
+    try
+    {
+        ProbeForWrite(DataBuffer, Length, 1);
+
+        Mdl = IoAllocateMdl(
+            DataBuffer,
+            Length,
+            0 != Irp->MdlAddress,
+            FALSE,
+            Irp);
+        if (0 == Mdl)
         {
-            if (BtlP + 1 > BtlEndP)
-            {
-                Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
-                goto exit;
-            }
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            leave;
+        }
 
-            *BtlP++ = SPD_BTL_FROM_INDEX(I);
-            Count--;
+        MmProbeAndLockPages(Mdl, UserMode, IoWriteAccess);
+
+        DataBuffer = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+        if (0 == DataBuffer)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            leave;
         }
+    }
+    except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        Result = GetExceptionCode();
+    }
 
-    Irp->IoStatus.Status = STATUS_SUCCESS;
-    Irp->IoStatus.Information = (PUINT8)BtlP - (PUINT8)BtlBgnP;
+    if (NT_SUCCESS(Result))
+        *PDataBuffer = DataBuffer;
 
-exit:;
+    return Result;
 }
 
 static VOID SpdIoctlTransact(SPD_DEVICE_EXTENSION *DeviceExtension,
@@ -130,8 +169,10 @@ static VOID SpdIoctlTransact(SPD_DEVICE_EXTENSION *DeviceExtension,
     PIRP Irp)
 {
     SPD_STORAGE_UNIT *StorageUnit = 0;
-    PMDL Mdl = 0;
     PVOID DataBuffer;
+    UINT32 DataBufferIndex = (UINT32)-1;
+    BOOLEAN ZeroCopy = FALSE;
+    SPD_SRB_MAP_CONTEXT MapContext;
 
     if (sizeof *Params > InputBufferLength || sizeof *Params > OutputBufferLength)
     {
@@ -142,7 +183,7 @@ static VOID SpdIoctlTransact(SPD_DEVICE_EXTENSION *DeviceExtension,
     DataBuffer = (PVOID)(UINT_PTR)Params->DataBuffer;
 
     if ((!Params->ReqValid && !Params->RspValid) ||
-        (Params->ReqValid && 0 == DataBuffer))
+        (Params->ReqValid && 0 == DataBuffer && !Params->DataBufferRegistered))
     {
         Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
         goto exit;
@@ -161,55 +202,49 @@ static VOID SpdIoctlTransact(SPD_DEVICE_EXTENSION *DeviceExtension,
         goto exit;
     }
 
-    if (0 != DataBuffer && UserMode == Irp->RequestorMode)
-    {
-        try
-        {
-            ProbeForWrite(DataBuffer, StorageUnit->StorageUnitParams.MaxTransferLength, 1);
-
-            Mdl = IoAllocateMdl(
-                DataBuffer,
-                StorageUnit->StorageUnitParams.MaxTransferLength,
-                0 != Irp->MdlAddress,
-                FALSE,
-                Irp);
-            if (0 == Mdl)
-            {
-                Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-                leave;
-            }
+    /* zero-copy requires a unit that opted in and a caller that can handle mapped data */
+    ZeroCopy = StorageUnit->StorageUnitParams.ZeroCopy && UserMode == Irp->RequestorMode;
 
-            MmProbeAndLockPages(Mdl, UserMode, IoWriteAccess);
-
-            DataBuffer = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
-            if (0 == DataBuffer)
-            {
-                Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-                leave;
-            }
-        }
-        except (EXCEPTION_EXECUTE_HANDLER)
+    if (Params->DataBufferRegistered)
+    {
+        /* registered buffers are already locked and mapped; see SpdStorageUnitRegisterBuffer */
+        DataBuffer = SpdStorageUnitReferenceBuffer(StorageUnit, (UINT32)Params->DataBuffer,
+            StorageUnit->StorageUnitParams.MaxTransferLength);
+        if (0 == DataBuffer)
         {
-            Irp->IoStatus.Status = GetExceptionCode();
+            Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
             goto exit;
         }
-
+        DataBufferIndex = (UINT32)Params->DataBuffer;
+    }
+    else if (0 != DataBuffer && UserMode == Irp->RequestorMode)
+    {
+        Irp->IoStatus.Status = SpdIoctlLockDataBuffer(&DataBuffer,
+            StorageUnit->StorageUnitParams.MaxTransferLength, Irp);
         if (!NT_SUCCESS(Irp->IoStatus.Status))
             goto exit;
     }
 
     if (Params->RspValid)
         SpdIoqEndProcessingSrb(StorageUnit->Ioq,
-            Params->Dir.Rsp.Hint, SpdSrbExecuteScsiComplete, &Params->Dir.Rsp, DataBuffer);
+            Params->Dir.Rsp.Hint, SpdSrbExecuteScsiComplete, &Params->Dir.Rsp, DataBuffer, 0);
 
     if (Params->ReqValid)
     {
+        BOOLEAN DataBufferMapped = ZeroCopy && Params->DataBufferMapped;
+
         Params->ReqValid = 0;
         Params->RspValid = 0;
+        Params->DataBufferMapped = 0;
         RtlZeroMemory(&Params->Dir.Req, sizeof Params->Dir.Req);
+        MapContext.Req = &Params->Dir.Req;
+        MapContext.MapChunk = 0;
+        MapContext.MappedDataBuffer = 0;
 
         /* wait for an SRB to arrive */
-        while (STATUS_UNSUCCESSFUL == (Irp->IoStatus.Status =
+        while (STATUS_UNSUCCESSFUL == (Irp->IoStatus.Status = DataBufferMapped ?
+            SpdIoqStartProcessingSrb(StorageUnit->Ioq,
+                0, Irp, SpdSrbExecuteScsiPrepareMapped, &MapContext, DataBuffer) :
             SpdIoqStartProcessingSrb(StorageUnit->Ioq,
                 0, Irp, SpdSrbExecuteScsiPrepare, &Params->Dir.Req, DataBuffer)))
         {
@@ -229,6 +264,17 @@ static VOID SpdIoctlTransact(SPD_DEVICE_EXTENSION *DeviceExtension,
             goto exit;
         }
 
+        /* first chunk of a zero-copy SRB: map it into our process now that we are at PASSIVE */
+        if (0 != MapContext.MapChunk)
+            MapContext.MappedDataBuffer =
+                SpdIoqMapSrb(StorageUnit->Ioq, MapContext.MapChunk, DataBuffer);
+
+        if (0 != MapContext.MappedDataBuffer)
+        {
+            Params->DataBufferMapped = 1;
+            Params->DataBuffer = (UINT64)(UINT_PTR)MapContext.MappedDataBuffer;
+        }
+
         Params->ReqValid = 1;
     }
 
@@ -236,6 +282,11 @@ static VOID SpdIoctlTransact(SPD_DEVICE_EXTENSION *DeviceExtension,
     Irp->IoStatus.Information = Params->ReqValid ? sizeof *Params : 0;
 
 exit:;
+    if (ZeroCopy)
+        /* complete any SRB's that were waiting to be unmapped */
+        SpdIoqUnmapSrbs(StorageUnit->Ioq);
+    if ((UINT32)-1 != DataBufferIndex)
+        SpdStorageUnitDereferenceBuffer(StorageUnit, DataBufferIndex);
     if (0 != StorageUnit)
         SpdStorageUnitDereference(DeviceExtension, StorageUnit);
 }
@@ -270,6 +321,387 @@ exit:;
         SpdStorageUnitDereference(DeviceExtension, StorageUnit);
 }
 
+typedef struct
+{
+    SPD_IOQ *Ioq;
+    PIRP Irp;
+    SPD_MQ_ENTRY CompleteList;          /* SRB's that the responses of the batch finished */
+} SPD_IOCTL_TRANSACT_BATCH_CONTEXT;
+
+static VOID SpdIoctlTransactBatchEnd(PVOID Context0,
+    SPD_IOCTL_TRANSACT_RSP *Rsp, PVOID DataBuffer)
+{
+    SPD_IOCTL_TRANSACT_BATCH_CONTEXT *Context = Context0;
+
+    SpdIoqEndProcessingSrb(Context->Ioq,
+        Rsp->Hint, SpdSrbExecuteScsiComplete, Rsp, DataBuffer, &Context->CompleteList);
+}
+
+static LONG SpdIoctlTransactBatchStart(PVOID Context0, BOOLEAN Wait,
+    SPD_IOCTL_TRANSACT_REQ *Req, PVOID DataBuffer)
+{
+    SPD_IOCTL_TRANSACT_BATCH_CONTEXT *Context = Context0;
+    LARGE_INTEGER Timeout;
+    NTSTATUS Result;
+
+    RtlZeroMemory(Req, sizeof *Req);
+
+    /* all responses have been delivered; complete their SRB's before we may wait */
+    SpdIoqCompleteSrbs(Context->Ioq, &Context->CompleteList);
+
+    if (!Wait)
+    {
+        /* only take an SRB that is already pending */
+        Timeout.QuadPart = 0;
+        Result = SpdIoqStartProcessingSrb(Context->Ioq,
+            &Timeout, Context->Irp, SpdSrbExecuteScsiPrepare, Req, DataBuffer);
+        if (STATUS_SUCCESS == Result)
+            return SpdBatchStartSuccess;
+        else if (STATUS_TIMEOUT == Result || STATUS_UNSUCCESSFUL == Result)
+            return SpdBatchStartEmpty;
+        else
+            return SpdBatchStartCancelled;
+    }
+
+    /* wait for an SRB to arrive */
+    while (STATUS_UNSUCCESSFUL == (Result =
+        SpdIoqStartProcessingSrb(Context->Ioq,
+            0, Context->Irp, SpdSrbExecuteScsiPrepare, Req, DataBuffer)))
+    {
+        if (SpdIoqStopped(Context->Ioq))
+            return SpdBatchStartCancelled;
+    }
+
+    return STATUS_SUCCESS == Result ? SpdBatchStartSuccess : SpdBatchStartCancelled;
+}
+
+static VOID SpdIoctlTransactBatch(SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_TRANSACT_BATCH_PARAMS *Params,
+    PIRP Irp)
+{
+    static SPD_BATCH_IOQ_INTERFACE BatchInterface =
+    {
+        SpdIoctlTransactBatchEnd,
+        SpdIoctlTransactBatchStart,
+    };
+    SPD_IOCTL_TRANSACT_BATCH_CONTEXT Context;
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+    PVOID DataBuffer;
+    UINT32 DataBufferIndex = (UINT32)-1;
+    ULONG ParamsSize, MaxTransferLength, ReqCount;
+    LONG Result;
+
+    if (FIELD_OFFSET(SPD_IOCTL_TRANSACT_BATCH_PARAMS, Entries) > InputBufferLength ||
+        0 == Params->Count || SPD_IOCTL_TRANSACT_BATCH_MAX < Params->Count)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    ParamsSize = SPD_IOCTL_TRANSACT_BATCH_PARAMS_SIZE(Params->Count);
+    if (ParamsSize > InputBufferLength || ParamsSize > OutputBufferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    DataBuffer = (PVOID)(UINT_PTR)Params->DataBuffer;
+    if (0 == DataBuffer && !Params->DataBufferRegistered)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, Params->Btl);
+    if (0 == StorageUnit)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    if (IoGetRequestorProcessId(Irp) != StorageUnit->TransactProcessId)
+    {
+        Irp->IoStatus.Status = STATUS_ACCESS_DENIED;
+        goto exit;
+    }
+
+    MaxTransferLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    if (MAXULONG / Params->Count < MaxTransferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    if (Params->DataBufferRegistered)
+    {
+        DataBuffer = SpdStorageUnitReferenceBuffer(StorageUnit, (UINT32)Params->DataBuffer,
+            Params->Count * MaxTransferLength);
+        if (0 == DataBuffer)
+        {
+            Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+            goto exit;
+        }
+        DataBufferIndex = (UINT32)Params->DataBuffer;
+    }
+    else if (UserMode == Irp->RequestorMode)
+    {
+        Irp->IoStatus.Status = SpdIoctlLockDataBuffer(&DataBuffer,
+            Params->Count * MaxTransferLength, Irp);
+        if (!NT_SUCCESS(Irp->IoStatus.Status))
+            goto exit;
+    }
+
+    Context.Ioq = StorageUnit->Ioq;
+    Context.Irp = Irp;
+    SpdMqListInitialize(&Context.CompleteList);
+    Result = SpdTransactBatch(&BatchInterface, &Context,
+        Params->Entries, Params->Count, DataBuffer, MaxTransferLength, &ReqCount);
+    SpdIoqCompleteSrbs(StorageUnit->Ioq, &Context.CompleteList);
+
+    /* batches never map, but they may complete an SRB that an earlier transact mapped */
+    if (StorageUnit->StorageUnitParams.ZeroCopy)
+        SpdIoqUnmapSrbs(StorageUnit->Ioq);
+
+    if (SpdBatchStartCancelled == Result)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = ParamsSize;
+
+exit:;
+    if ((UINT32)-1 != DataBufferIndex)
+        SpdStorageUnitDereferenceBuffer(StorageUnit, DataBufferIndex);
+    if (0 != StorageUnit)
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+}
+
+static VOID SpdIoctlRingSetup(SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_RING_SETUP_PARAMS *Params,
+    PIRP Irp)
+{
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+    ULONG ProcessId;
+
+    if (sizeof *Params > InputBufferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    if (UserMode != Irp->RequestorMode)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+        goto exit;
+    }
+
+    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, Params->Btl);
+    if (0 == StorageUnit)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    /*
+     * The ring stays mapped until the queue is stopped, which happens at the latest
+     * when the owner process exits. So only the owner may set up a ring.
+     */
+    ProcessId = IoGetRequestorProcessId(Irp);
+    if (ProcessId != StorageUnit->OwnerProcessId ||
+        ProcessId != StorageUnit->TransactProcessId)
+    {
+        Irp->IoStatus.Status = STATUS_ACCESS_DENIED;
+        goto exit;
+    }
+
+    Irp->IoStatus.Status = SpdIoqSetupRing(StorageUnit->Ioq,
+        Params->Capacity,
+        (PVOID)(UINT_PTR)Params->Buffer, Params->BufferSize,
+        (HANDLE)(UINT_PTR)Params->Event,
+        StorageUnit->StorageUnitParams.MaxTransferLength,
+        SpdSrbExecuteScsiPrepare, SpdSrbExecuteScsiComplete);
+
+exit:;
+    if (0 != StorageUnit)
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+}
+
+static VOID SpdIoctlRingDoorbell(SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_RING_DOORBELL_PARAMS *Params,
+    PIRP Irp)
+{
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+
+    if (sizeof *Params > InputBufferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, Params->Btl);
+    if (0 == StorageUnit)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    if (IoGetRequestorProcessId(Irp) != StorageUnit->TransactProcessId)
+    {
+        Irp->IoStatus.Status = STATUS_ACCESS_DENIED;
+        goto exit;
+    }
+
+    Irp->IoStatus.Status = SpdIoqRingDoorbell(StorageUnit->Ioq);
+
+    /* rings never map, but they may complete an SRB that an earlier transact mapped */
+    if (StorageUnit->StorageUnitParams.ZeroCopy)
+        SpdIoqUnmapSrbs(StorageUnit->Ioq);
+
+exit:;
+    if (0 != StorageUnit)
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+}
+
+static VOID SpdIoctlRegisterBuffer(SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_REGISTER_BUFFER_PARAMS *Params,
+    PIRP Irp)
+{
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+    ULONG ProcessId;
+    UINT32 Index;
+
+    if (sizeof *Params > InputBufferLength || sizeof *Params > OutputBufferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    if (UserMode != Irp->RequestorMode)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+        goto exit;
+    }
+
+    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, Params->Btl);
+    if (0 == StorageUnit)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    /*
+     * Registered buffers stay locked until the storage unit is unprovisioned, which
+     * happens at the latest when the owner process exits. So only the owner may
+     * register buffers.
+     */
+    ProcessId = IoGetRequestorProcessId(Irp);
+    if (ProcessId != StorageUnit->OwnerProcessId ||
+        ProcessId != StorageUnit->TransactProcessId)
+    {
+        Irp->IoStatus.Status = STATUS_ACCESS_DENIED;
+        goto exit;
+    }
+
+    Irp->IoStatus.Status = SpdStorageUnitRegisterBuffer(StorageUnit,
+        (PVOID)(UINT_PTR)Params->Buffer, Params->BufferSize, &Index);
+    if (!NT_SUCCESS(Irp->IoStatus.Status))
+        goto exit;
+
+    Params->Index = Index;
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = sizeof *Params;
+
+exit:;
+    if (0 != StorageUnit)
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+}
+
+static VOID SpdIoctlUnregisterBuffer(SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_UNREGISTER_BUFFER_PARAMS *Params,
+    PIRP Irp)
+{
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+
+    if (sizeof *Params > InputBufferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, Params->Btl);
+    if (0 == StorageUnit)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    if (IoGetRequestorProcessId(Irp) != StorageUnit->OwnerProcessId)
+    {
+        Irp->IoStatus.Status = STATUS_ACCESS_DENIED;
+        goto exit;
+    }
+
+    Irp->IoStatus.Status = SpdStorageUnitUnregisterBuffer(StorageUnit, Params->Index);
+
+exit:;
+    if (0 != StorageUnit)
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+}
+
+static VOID SpdIoctlGetStats(SPD_DEVICE_EXTENSION *DeviceExtension,
+    ULONG InputBufferLength, ULONG OutputBufferLength, SPD_IOCTL_GET_STATS_PARAMS *Params,
+    PIRP Irp)
+{
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+    SPD_IOQ_STATS Stats;
+
+    if (sizeof *Params > InputBufferLength || sizeof *Params > OutputBufferLength)
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, Params->Btl);
+    if (0 == StorageUnit)
+    {
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        goto exit;
+    }
+
+    switch (Params->Timing)
+    {
+    case SpdIoctlStatsTimingKeep:
+        break;
+    case SpdIoctlStatsTimingOn:
+        SpdIoqSetStatsTiming(StorageUnit->Ioq, TRUE);
+        break;
+    case SpdIoctlStatsTimingOff:
+        SpdIoqSetStatsTiming(StorageUnit->Ioq, FALSE);
+        break;
+    default:
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    SpdIoqGetStats(StorageUnit->Ioq, &Stats);
+
+    Params->Timing = StorageUnit->Ioq->StatsTiming ? 1 : 0;
+    Params->LockHoldTime = Stats.LockHoldTime;
+    Params->LockHoldCount = Stats.LockHoldCount;
+    Params->CompleteTime = Stats.CompleteTime;
+    Params->CompleteCount = Stats.CompleteCount;
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = sizeof *Params;
+
+exit:;
+    if (0 != StorageUnit)
+        SpdStorageUnitDereference(DeviceExtension, StorageUnit);
+}
+
 VOID SpdHwProcessServiceRequest(PVOID DeviceExtension, PVOID Irp0)
 {
     SPD_ENTER(ioctl,
@@ -306,6 +738,24 @@ VOID SpdHwProcessServiceRequest(PVOID DeviceExtension, PVOID Irp0)
     case SPD_IOCTL_SET_TRANSACT_PID:
         SpdIoctlSetTransactProcessId(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
         break;
+    case SPD_IOCTL_TRANSACT_BATCH:
+        SpdIoctlTransactBatch(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
+        break;
+    case SPD_IOCTL_RING_SETUP:
+        SpdIoctlRingSetup(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
+        break;
+    case SPD_IOCTL_RING_DOORBELL:
+        SpdIoctlRingDoorbell(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
+        break;
+    case SPD_IOCTL_REGISTER_BUFFER:
+        SpdIoctlRegisterBuffer(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
+        break;
+    case SPD_IOCTL_UNREGISTER_BUFFER:
+        SpdIoctlUnregisterBuffer(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
+        break;
+    case SPD_IOCTL_GET_STATS:
+        SpdIoctlGetStats(DeviceExtension, InputBufferLength, OutputBufferLength, Params, Irp);
+        break;
     default:
         Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
         goto exit;
@@ -330,14 +780,12 @@ VOID SpdHwCompleteServiceIrp(PVOID DeviceExtension0)
     SPD_DEVICE_EXTENSION *DeviceExtension = DeviceExtension0;
     SPD_STORAGE_UNIT *StorageUnit;
 
-    for (ULONG I = 0; DeviceExtension->StorageUnitCapacity > I; I++)
+    for (ULONG Index = 0;
+        0 != (StorageUnit = SpdStorageUnitReferenceNext(DeviceExtension, &Index));)
     {
-        StorageUnit = SpdStorageUnitReferenceByBtl(DeviceExtension, SPD_IOCTL_BTL(0, I, 0));
-        if (0 == StorageUnit)
-            continue;
-
         /* stop the unit's Ioq; this will cause all pending service IRP's to be cancelled */
         SpdIoqReset(StorageUnit->Ioq, TRUE);
+        SpdStorageUnitUnmapSrbs(DeviceExtension, StorageUnit);
 
         SpdStorageUnitDereference(DeviceExtension, StorageUnit);
     }
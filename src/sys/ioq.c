@@ -21,24 +21,451 @@
 
 #include <sys/driver.h>
 
+static inline SPD_MQ_QUEUE *SpdIoqQueue(SPD_IOQ *Ioq, SPD_SRB_CHUNK *Chunk)
+{
+    return SpdMqQueue(&Ioq->Mq, (UINT64)(UINT_PTR)&Chunk->QueueEntry);
+}
+
+static inline ULONG SpdIoqHomeQueue(SPD_IOQ *Ioq)
+{
+    /* dispatchers prefer the queue of their processor and steal from the others */
+    return KeGetCurrentProcessorNumberEx(0) % Ioq->Mq.QueueCount;
+}
+
+enum
+{
+    SpdIoqThrottleIdle = 0,
+    SpdIoqThrottleArmed,                /* ThrottleDpc will run */
+    SpdIoqThrottleDeleted,              /* ThrottleDpc frees the queue when it runs */
+};
+
+static VOID SpdIoqFree(SPD_IOQ *Ioq);
+static VOID SpdIoqRingFillNoLock(SPD_IOQ *Ioq);
+
+/* chunks are pending: wake up a waiter, unless a dispatcher is polling and will see them */
+static inline VOID SpdIoqWakeup(SPD_IOQ *Ioq)
+{
+    /* the chunks must be visible before we look for pollers; see shared/spinwait.h */
+    MemoryBarrier();
+    if (!SpdSpinWaitPolling(&Ioq->SpinWait))
+        SpdQeventSet(&Ioq->PendingEvent);
+}
+
+/*
+ * Poll for pending chunks before waiting on PendingEvent, for as long as SpinWait says.
+ * Returns TRUE if chunks may be pending (or the queue is stopped), in which case the
+ * caller need not wait. PASSIVE_LEVEL.
+ */
+static BOOLEAN SpdIoqPoll(SPD_IOQ *Ioq)
+{
+    UINT64 Spin, Start, Elapsed = 0;
+    BOOLEAN Found = FALSE;
+
+    /* while the rate limit holds chunks back, the pending ones cannot be taken */
+    if (SpdIoqThrottleIdle != Ioq->ThrottleState)
+        return FALSE;
+
+    Spin = SpdSpinWaitBegin(&Ioq->SpinWait);
+    if (0 == Spin)
+        return FALSE;
+
+    Start = SpdSpinWaitNow();
+    for (ULONG I = 1;; I++)
+    {
+        if (0 != Ioq->Mq.PendingCount || Ioq->Stopped)
+        {
+            Found = TRUE;
+            Elapsed = SpdSpinWaitNow() - Start;
+            break;
+        }
+
+        YieldProcessor();
+
+        if (0 == I % SPD_SPINWAIT_CHECK && Spin <= (Elapsed = SpdSpinWaitNow() - Start))
+            break;
+    }
+
+    SpdSpinWaitEnd(&Ioq->SpinWait, Found, Elapsed);
+
+    /* a poster that saw us polling did not set the event: look once more */
+    return Found || 0 != Ioq->Mq.PendingCount;
+}
+
+/*
+ * Requests are pending but the rate limit holds them back: have ThrottleDpc wake up
+ * a dispatcher and refill the ring once there is credit again. Any IRQL <= DISPATCH.
+ */
+static VOID SpdIoqThrottle(SPD_IOQ *Ioq)
+{
+    UINT64 Delay;
+    LARGE_INTEGER DueTime;
+
+    Delay = SpdMqThrottleDelay(&Ioq->Mq);
+    if (0 == Delay)
+        return;
+
+    if (SpdIoqThrottleIdle == InterlockedCompareExchange(&Ioq->ThrottleState,
+        SpdIoqThrottleArmed, SpdIoqThrottleIdle))
+    {
+        DueTime.QuadPart = -(INT64)Delay;
+        KeSetTimer(&Ioq->ThrottleTimer, DueTime, &Ioq->ThrottleDpc);
+    }
+}
+
+static KDEFERRED_ROUTINE SpdIoqThrottleDpc;
+static VOID SpdIoqThrottleDpc(PKDPC Dpc, PVOID DeferredContext, PVOID Arg1, PVOID Arg2)
+{
+    SPD_IOQ *Ioq = DeferredContext;
+
+    if (SpdIoqThrottleDeleted != Ioq->ThrottleState)
+    {
+        /* wake up a waiter; it will take what the credit allows or throttle again */
+        SpdQeventSet(&Ioq->PendingEvent);
+
+        if (0 != Ioq->Ring)
+        {
+            KeAcquireSpinLockAtDpcLevel(&Ioq->SpinLock);
+            if (0 != Ioq->Ring)
+                SpdIoqRingFillNoLock(Ioq);
+            KeReleaseSpinLockFromDpcLevel(&Ioq->SpinLock);
+        }
+    }
+
+    /* SpdIoqDelete leaves the queue to us if it finds us armed */
+    if (SpdIoqThrottleArmed != InterlockedCompareExchange(&Ioq->ThrottleState,
+        SpdIoqThrottleIdle, SpdIoqThrottleArmed))
+        SpdIoqFree(Ioq);
+}
+
+/*
+ * Lock hold and completion counts are always kept; their times only while the stats
+ * IOCTL has turned timing on, because reading the performance counter is not free.
+ * A zero Begin means that timing was off when the measurement started.
+ */
+static inline UINT64 SpdIoqStatsBegin(SPD_IOQ *Ioq)
+{
+    return Ioq->StatsTiming ? SpdPerformanceTime() : 0;
+}
+
+static inline VOID SpdIoqStatsEnd(volatile LONG64 *Time, volatile LONG64 *Count,
+    UINT64 Begin, ULONG N)
+{
+    if (0 != Begin)
+        InterlockedAdd64(Time, (LONG64)(SpdPerformanceTime() - Begin));
+    InterlockedAdd64(Count, N);
+}
+
+/*
+ * The SRB is done: add it to CompleteList, which the caller passes to SpdIoqCompleteSrbs
+ * once it has released its locks. Chunk queue locked (or no chunk active).
+ */
+static VOID SpdIoqCompleteSrbNoLock(SPD_IOQ *Ioq, SPD_SRB_EXTENSION *SrbExtension,
+    SPD_MQ_ENTRY *CompleteList)
+{
+    UCHAR SrbStatus = 0 != SrbExtension->ChunkSrbStatus ?
+        (UCHAR)SrbExtension->ChunkSrbStatus : SRB_STATUS_SUCCESS;
+
+    /* the map state may change under us (SpdIoqMapSrb) unless we hold UnmapSpinLock */
+    KeAcquireSpinLockAtDpcLevel(&Ioq->UnmapSpinLock);
+    if (SpdSrbMapPending == SrbExtension->MapState || SpdSrbMapDone == SrbExtension->MapState)
+    {
+        /*
+         * The SRB pages are (or are about to be) mapped into a user process. We cannot
+         * complete the SRB until they are unmapped, which requires PASSIVE_LEVEL; so
+         * park the SRB in the UnmapList and let SpdIoqMapSrb or SpdIoqUnmapSrbs finish.
+         * All chunks are retired, so the first chunk's queue entry is free to use.
+         */
+        SrbExtension->CompletePending = TRUE;
+        SrbExtension->CompleteSrbStatus = SrbStatus;
+        SpdMqListInsertTail(&Ioq->UnmapList, &SrbExtension->Chunks[0].QueueEntry);
+        KeReleaseSpinLockFromDpcLevel(&Ioq->UnmapSpinLock);
+        return;
+    }
+    KeReleaseSpinLockFromDpcLevel(&Ioq->UnmapSpinLock);
+
+    ASSERT(0 == SrbExtension->MapMdl);
+    SrbExtension->CompleteSrbStatus = SrbStatus;
+    SpdMqListInsertTail(CompleteList, &SrbExtension->Chunks[0].QueueEntry);
+}
+
+/*
+ * Complete the SRB's collected by SpdIoqCompleteSrbNoLock. StorPortNotification is not
+ * cheap, so we call it only once we hold no I/O queue lock: the time under lock then
+ * stays short, however many SRB's a response (or a ring round) finishes.
+ */
+VOID SpdIoqCompleteSrbs(SPD_IOQ *Ioq, SPD_MQ_ENTRY *CompleteList)
+{
+    SPD_SRB_EXTENSION *SrbExtension;
+    SPD_MQ_ENTRY *Entry, *Flink;
+    UINT64 Begin;
+    ULONG Count = 0;
+
+    if (SpdMqListIsEmpty(CompleteList))
+        return;
+
+    Begin = SpdIoqStatsBegin(Ioq);
+
+    for (Entry = CompleteList->Flink; CompleteList != Entry; Entry = Flink, Count++)
+    {
+        /* store Flink now, because *Entry becomes invalid after SpdSrbComplete */
+        Flink = Entry->Flink;
+        SrbExtension = CONTAINING_RECORD(Entry, SPD_SRB_EXTENSION, Chunks[0].QueueEntry);
+        SpdSrbComplete(Ioq->DeviceExtension, SrbExtension->Srb, SrbExtension->CompleteSrbStatus);
+    }
+    SpdMqListInitialize(CompleteList);
+
+    SpdIoqStatsEnd(&Ioq->Stats.CompleteTime, &Ioq->Stats.CompleteCount, Begin, Count);
+}
+
+/*
+ * Retire an active chunk: it will not be posted again. The first error of a chunk is
+ * the status of the SRB. Returns TRUE if this was the last active chunk, in which case
+ * the caller completes the SRB. Chunk queue locked.
+ */
+static BOOLEAN SpdIoqRetireChunkNoLock(SPD_SRB_CHUNK *Chunk, UCHAR SrbStatus)
+{
+    SPD_SRB_EXTENSION *SrbExtension = Chunk->SrbExtension;
+
+    ASSERT(Chunk->Active);
+    Chunk->Active = FALSE;
+
+    if (SRB_STATUS_SUCCESS != SrbStatus)
+        InterlockedCompareExchange(&SrbExtension->ChunkSrbStatus, SrbStatus, 0);
+
+    return 0 == InterlockedDecrement(&SrbExtension->ChunkActiveCount);
+}
+
+/*
+ * Take pending SRB's that are adjacent to the one whose chunk is about to be handed out
+ * and merge them into its request, up to MaxTransferLength. We look at every queue, but
+ * we only try to lock the other ones: we already hold a queue lock, so we must not wait.
+ * Merged SRB's leave their queues; they are retired by SpdIoqSplitNoLock once the merged
+ * request is done. Chunk queue locked.
+ */
+static VOID SpdIoqMergeNoLock(SPD_IOQ *Ioq, SPD_MQ_QUEUE *Queue, SPD_SRB_CHUNK *Chunk)
+{
+    SPD_SRB_EXTENSION *Leader = Chunk->SrbExtension, *Member;
+    SPD_IOCTL_STORAGE_UNIT_PARAMS *Params = &Leader->StorageUnit->StorageUnitParams;
+    SPD_MQ_QUEUE *Other;
+    SPD_MQ_ENTRY *Entry, *Flink;
+    ULONG Home = (ULONG)(Queue - Ioq->Mq.Queues), Scanned;
+    ULONG MergedLength = 0;
+    BOOLEAN Added;
+
+    /* SpdScsiPostSrb gives a key only to single chunk READ/WRITE's of a coalescing unit */
+    if (0 == Leader->MergeEntry.Key)
+        return;
+
+    SpdMergeInitialize(&Leader->Merge, &Leader->MergeEntry,
+        Params->MaxTransferLength / Params->BlockLength);
+
+    for (ULONG I = 0; Ioq->Mq.QueueCount > I && 0 < SpdMergeRoom(&Leader->Merge); I++)
+    {
+        Other = &Ioq->Mq.Queues[(Home + I) % Ioq->Mq.QueueCount];
+        if (0 == Other->PendingCount)
+            continue;
+        if (Other != Queue && !SpdMqLockTryAcquire(&Other->Lock))
+            continue;
+
+        /* an SRB added at the front may make another one adjacent: go until none is added */
+        do
+        {
+            Added = FALSE;
+            Scanned = 0;
+            for (ULONG J = 0; SpdIoSchedClassCount > J; J++)
+                for (Entry = Other->PendingLists[J].Flink;
+                    &Other->PendingLists[J] != Entry && SPD_IOQ_MERGE_SCAN_MAX > Scanned;
+                    Entry = Flink, Scanned++)
+                {
+                    Flink = Entry->Flink;
+                    Member = CONTAINING_RECORD(Entry, SPD_SRB_CHUNK, QueueEntry)->SrbExtension;
+                    if (SpdMergeAdd(&Leader->Merge, &Member->MergeEntry))
+                    {
+                        SpdMqRemoveNoLock(&Ioq->Mq, Other, Entry);
+                        Member->MergeLeader = Leader;
+                        MergedLength += Member->SystemDataLength;
+                        Added = TRUE;
+                    }
+                }
+        } while (Added && 0 < SpdMergeRoom(&Leader->Merge));
+
+        if (Other != Queue)
+            SpdMqLockRelease(&Other->Lock);
+    }
+
+    /* the scheduler admitted the leader only; the merged SRB's count as one request */
+    if (0 != MergedLength)
+    {
+        Leader->MergeLeader = Leader;
+        SpdMqCharge(&Ioq->Mq, MergedLength);
+    }
+}
+
+/*
+ * The merged request of a leader is done (or is being reset): retire the SRB's that
+ * were merged into it. Their status has been set by Complete, unless SrbStatus is an
+ * error. The leader itself is retired by the caller. Leader queue locked.
+ */
+static VOID SpdIoqSplitNoLock(SPD_IOQ *Ioq, SPD_SRB_EXTENSION *Leader, UCHAR SrbStatus,
+    SPD_MQ_ENTRY *CompleteList)
+{
+    SPD_MERGE_ENTRY *Entry, *Next;
+    SPD_SRB_EXTENSION *Member;
+
+    ASSERT(Leader == Leader->MergeLeader);
+
+    for (Entry = Leader->Merge.First; 0 != Entry; Entry = Next)
+    {
+        /* store Next now, because *Entry becomes invalid after SpdIoqCompleteSrbs */
+        Next = Entry->Next;
+        Member = CONTAINING_RECORD(Entry, SPD_SRB_EXTENSION, MergeEntry);
+        Member->MergeLeader = 0;
+        if (Leader != Member && SpdIoqRetireChunkNoLock(&Member->Chunks[0], SrbStatus))
+            SpdIoqCompleteSrbNoLock(Ioq, Member, CompleteList);
+    }
+
+    Leader->Merge.First = 0;
+    Leader->Merge.Count = 0;
+}
+
+static VOID SpdIoqEndProcessingSrbNoLock(SPD_IOQ *Ioq, SPD_MQ_QUEUE *Queue, UINT64 Hint,
+    UCHAR (*Complete)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
+    PVOID Context, PVOID DataBuffer,
+    SPD_MQ_ENTRY *CompleteList)
+{
+    SPD_MQ_ENTRY *Entry;
+    SPD_SRB_CHUNK *Chunk;
+
+    Entry = SpdMqProcessRemoveNoLock(&Ioq->Mq, Queue, Hint);
+    if (0 == Entry)
+        return;
+
+    Chunk = CONTAINING_RECORD(Entry, SPD_SRB_CHUNK, QueueEntry);
+    UCHAR SrbStatus = Complete(Chunk, Context, DataBuffer);
+    if (Chunk->SrbExtension == Chunk->SrbExtension->MergeLeader)
+    {
+        /* Complete has fanned the response out; merged SRB's are single chunk ones */
+        ASSERT(SRB_STATUS_PENDING != SrbStatus);
+        SpdIoqSplitNoLock(Ioq, Chunk->SrbExtension, SRB_STATUS_SUCCESS, CompleteList);
+    }
+    if (SRB_STATUS_PENDING == SrbStatus)
+    {
+        /*
+         * If Complete returns PENDING the chunk has been given the next
+         * piece of its SRB and we need to repost it; we will also place
+         * it at the queue head, so that it gets picked up immediately after.
+         * The other chunks of the SRB are meanwhile processed in parallel.
+         *
+         * This functionality supports splitting SRB's into chunks,
+         * which is required for I/O that exceeds our MaxTransferLength.
+         * See https://tinyurl.com/ychyv62s
+         */
+        SpdMqPostNoLock(&Ioq->Mq, Queue, Entry, TRUE);
+
+        /* queue is not empty; wake up a waiter */
+        SpdIoqWakeup(Ioq);
+    }
+    else if (SpdIoqRetireChunkNoLock(Chunk, SrbStatus))
+        SpdIoqCompleteSrbNoLock(Ioq, Chunk->SrbExtension, CompleteList);
+}
+
+static VOID SpdIoqRingFillNoLock(SPD_IOQ *Ioq)
+{
+    SPD_IOQ_RING *Ring = Ioq->Ring;
+    SPD_IOCTL_RING_REQ *Entry;
+    SPD_MQ_QUEUE *Queue;
+    SPD_MQ_ENTRY *QueueEntry;
+    BOOLEAN Doorbell = FALSE;
+    ULONG Slot;
+
+    while (0 < Ring->FreeSlotCount)
+    {
+        Entry = SpdRingReserve(&Ring->ReqPort);
+        if (0 == Entry)
+            /* cannot happen with a well behaved consumer: there are as many entries as slots */
+            break;
+
+        /* returns with the SRB's queue locked */
+        QueueEntry = SpdMqTake(&Ioq->Mq, SpdIoqHomeQueue(Ioq), &Queue);
+        if (0 == QueueEntry)
+        {
+            if (0 != Ioq->Mq.PendingCount)
+                SpdIoqThrottle(Ioq);
+            break;
+        }
+
+        SPD_SRB_CHUNK *Chunk = CONTAINING_RECORD(QueueEntry, SPD_SRB_CHUNK, QueueEntry);
+
+        SpdIoqMergeNoLock(Ioq, Queue, Chunk);
+
+        Slot = Ring->FreeSlots[--Ring->FreeSlotCount];
+        ASSERT(!Ring->SlotInUse[Slot]);
+        Ring->SlotInUse[Slot] = 1;
+
+        RtlZeroMemory(Entry, sizeof *Entry);
+        Entry->Slot = Slot;
+        Ring->Prepare(Chunk, &Entry->Req, Ring->DataBuffer + Slot * Ring->DataStride);
+
+        SpdMqProcessInsertNoLock(&Ioq->Mq, Queue, QueueEntry);
+        SpdMqLockRelease(&Queue->Lock);
+
+        SpdRingCommit(&Ring->ReqPort, &Doorbell);
+    }
+
+    if (Doorbell)
+        KeSetEvent(Ring->Event, IO_NO_INCREMENT, FALSE);
+}
+
+static VOID SpdIoqRingFree(SPD_IOQ_RING *Ring)
+{
+    if (0 != Ring->Mdl)
+    {
+        if (FlagOn(Ring->Mdl->MdlFlags, MDL_PAGES_LOCKED))
+            MmUnlockPages(Ring->Mdl);
+        IoFreeMdl(Ring->Mdl);
+    }
+    if (0 != Ring->Event)
+        ObDereferenceObject(Ring->Event);
+    SpdFree(Ring, SpdTagRing);
+}
+
 NTSTATUS SpdIoqCreate(PVOID DeviceExtension, SPD_IOQ **PIoq)
 {
     SPD_IOQ *Ioq;
-    ULONG BucketCount = (PAGE_SIZE - sizeof *Ioq) / sizeof Ioq->ProcessBuckets[0];
+    ULONG QueueCount, BucketCount, Size;
 
     *PIoq = 0;
 
-    Ioq = SpdAllocNonPaged(PAGE_SIZE, SpdTagIoq);
+    QueueCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    if (SPD_IOQ_QUEUE_MAX < QueueCount)
+        QueueCount = SPD_IOQ_QUEUE_MAX;
+
+    /*
+     * Round up to whole pages, which also cache aligns the queues (pool allocations
+     * of a page or more are page aligned); any space left goes to the buckets.
+     */
+    Size = FIELD_OFFSET(SPD_IOQ, Queues) +
+        QueueCount * (sizeof Ioq->Queues[0] + SPD_IOQ_BUCKET_MIN * sizeof(SPD_MQ_ENTRY *));
+    Size = (Size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    BucketCount = (Size - FIELD_OFFSET(SPD_IOQ, Queues) - QueueCount * sizeof Ioq->Queues[0]) /
+        (QueueCount * sizeof(SPD_MQ_ENTRY *));
+
+    Ioq = SpdAllocNonPaged(Size, SpdTagIoq);
     if (0 == Ioq)
         return STATUS_INSUFFICIENT_RESOURCES;
-    RtlZeroMemory(Ioq, PAGE_SIZE);
+    RtlZeroMemory(Ioq, Size);
 
     Ioq->DeviceExtension = DeviceExtension;
     KeInitializeSpinLock(&Ioq->SpinLock);
+    KeInitializeSpinLock(&Ioq->UnmapSpinLock);
     SpdQeventInitialize(&Ioq->PendingEvent, 0);
-    InitializeListHead(&Ioq->PendingList);
-    InitializeListHead(&Ioq->ProcessList);
-    Ioq->ProcessBucketCount = BucketCount;
+    SpdMqListInitialize(&Ioq->UnmapList);
+    KeInitializeTimer(&Ioq->ThrottleTimer);
+    KeInitializeDpc(&Ioq->ThrottleDpc, SpdIoqThrottleDpc, Ioq);
+    SpdSpinWaitInitialize(&Ioq->SpinWait, 0);
+    SpdMqInitialize(&Ioq->Mq,
+        Ioq->Queues, QueueCount,
+        (SPD_MQ_ENTRY **)(Ioq->Queues + QueueCount), BucketCount);
 
     *PIoq = Ioq;
 
@@ -48,45 +475,59 @@ NTSTATUS SpdIoqCreate(PVOID DeviceExtension, SPD_IOQ **PIoq)
 VOID SpdIoqDelete(SPD_IOQ *Ioq)
 {
     SpdIoqReset(Ioq, FALSE);
+    ASSERT(SpdMqListIsEmpty(&Ioq->UnmapList));
+
+    DEBUGLOG("%p, LockHold=%lld/%lld, Complete=%lld/%lld (100ns/count)", Ioq,
+        Ioq->Stats.LockHoldTime, Ioq->Stats.LockHoldCount,
+        Ioq->Stats.CompleteTime, Ioq->Stats.CompleteCount);
+
+    /*
+     * We may be called at DISPATCH_LEVEL, so we cannot wait for a ThrottleDpc that
+     * is already queued or running; instead we let it free the queue.
+     */
+    if (KeCancelTimer(&Ioq->ThrottleTimer) ||
+        SpdIoqThrottleArmed != InterlockedExchange(&Ioq->ThrottleState, SpdIoqThrottleDeleted))
+        SpdIoqFree(Ioq);
+}
+
+static VOID SpdIoqFree(SPD_IOQ *Ioq)
+{
+    if (0 != Ioq->Ring)
+        SpdIoqRingFree(Ioq->Ring);
     SpdQeventFinalize(&Ioq->PendingEvent);
     SpdFree(Ioq, SpdTagIoq);
 }
 
 VOID SpdIoqReset(SPD_IOQ *Ioq, BOOLEAN Stop)
 {
+    SPD_IOQ_RING *Ring = 0;
+    SPD_MQ_ENTRY CompleteList;
     KIRQL Irql;
 
+    SpdMqListInitialize(&CompleteList);
+
     KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    for (ULONG I = 0; Ioq->Mq.QueueCount > I; I++)
+        SpdMqLockAcquire(&Ioq->Queues[I].Lock);
 
     if (!Ioq->Stopped)
     {
-        PLIST_ENTRY PendingEntry, ProcessEntry, Flink;
-
-        PendingEntry = Ioq->PendingList.Flink;
-        ProcessEntry = Ioq->ProcessList.Flink;
+        SPD_MQ_ENTRY List, *Entry, *Flink;
+        SPD_SRB_CHUNK *Chunk;
 
-        InitializeListHead(&Ioq->PendingList);
-        InitializeListHead(&Ioq->ProcessList);
-        RtlZeroMemory(Ioq->ProcessBuckets,
-            Ioq->ProcessBucketCount * sizeof Ioq->ProcessBuckets[0]);
+        SpdMqListInitialize(&List);
+        for (ULONG I = 0; Ioq->Mq.QueueCount > I; I++)
+            SpdMqResetNoLock(&Ioq->Mq, &Ioq->Queues[I], &List);
 
-        for (; PendingEntry != &Ioq->PendingList; PendingEntry = Flink)
+        for (Entry = List.Flink; &List != Entry; Entry = Flink)
         {
-            /* store Flink now, because *PendingEntry becomes invalid after SpdSrbComplete */
-            Flink = PendingEntry->Flink;
-            SpdSrbComplete(
-                Ioq->DeviceExtension,
-                CONTAINING_RECORD(PendingEntry, SPD_SRB_EXTENSION, ListEntry)->Srb,
-                SRB_STATUS_ABORTED);
-        }
-        for (; ProcessEntry != &Ioq->ProcessList; ProcessEntry = Flink)
-        {
-            /* store Flink now, because *ProcessEntry becomes invalid after SpdSrbComplete */
-            Flink = ProcessEntry->Flink;
-            SpdSrbComplete(
-                Ioq->DeviceExtension,
-                CONTAINING_RECORD(ProcessEntry, SPD_SRB_EXTENSION, ListEntry)->Srb,
-                SRB_STATUS_ABORTED);
+            /* store Flink now, because SpdIoqCompleteSrbNoLock may reuse *Entry */
+            Flink = Entry->Flink;
+            Chunk = CONTAINING_RECORD(Entry, SPD_SRB_CHUNK, QueueEntry);
+            if (Chunk->SrbExtension == Chunk->SrbExtension->MergeLeader)
+                SpdIoqSplitNoLock(Ioq, Chunk->SrbExtension, SRB_STATUS_ABORTED, &CompleteList);
+            if (SpdIoqRetireChunkNoLock(Chunk, SRB_STATUS_ABORTED))
+                SpdIoqCompleteSrbNoLock(Ioq, Chunk->SrbExtension, &CompleteList);
         }
 
         if (Stop)
@@ -94,11 +535,39 @@ VOID SpdIoqReset(SPD_IOQ *Ioq, BOOLEAN Stop)
             Ioq->Stopped = TRUE;
 
             /* we are being stopped, permanently wake up waiters */
-            SpdQeventSetNoLock(&Ioq->PendingEvent);
+            SpdQeventSet(&Ioq->PendingEvent);
+
+            /* detach the ring and wake up its consumer */
+            Ring = Ioq->Ring;
+            Ioq->Ring = 0;
+            if (0 != Ring)
+                KeSetEvent(Ring->Event, IO_NO_INCREMENT, FALSE);
         }
     }
 
+    for (ULONG I = Ioq->Mq.QueueCount; 0 < I; I--)
+        SpdMqLockRelease(&Ioq->Queues[I - 1].Lock);
     KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+
+    SpdIoqCompleteSrbs(Ioq, &CompleteList);
+
+    if (0 != Ring)
+        SpdIoqRingFree(Ring);
+}
+
+VOID SpdIoqGetStats(SPD_IOQ *Ioq, SPD_IOQ_STATS *Stats)
+{
+    /* 64-bit reads are not atomic on x86 */
+    Stats->LockHoldTime = InterlockedCompareExchange64(&Ioq->Stats.LockHoldTime, 0, 0);
+    Stats->LockHoldCount = InterlockedCompareExchange64(&Ioq->Stats.LockHoldCount, 0, 0);
+    Stats->CompleteTime = InterlockedCompareExchange64(&Ioq->Stats.CompleteTime, 0, 0);
+    Stats->CompleteCount = InterlockedCompareExchange64(&Ioq->Stats.CompleteCount, 0, 0);
+}
+
+VOID SpdIoqSetStatsTiming(SPD_IOQ *Ioq, BOOLEAN Timing)
+{
+    /* 8-bit store is atomic */
+    Ioq->StatsTiming = Timing;
 }
 
 BOOLEAN SpdIoqStopped(SPD_IOQ *Ioq)
@@ -117,179 +586,612 @@ BOOLEAN SpdIoqStopped(SPD_IOQ *Ioq)
 
 NTSTATUS SpdIoqCancelSrb(SPD_IOQ *Ioq, PVOID Srb)
 {
-    NTSTATUS Result = STATUS_UNSUCCESSFUL;
+    SPD_SRB_EXTENSION *SrbExtension = SpdSrbExtension(Srb), *Leader;
+    SPD_SRB_CHUNK *Chunk;
+    SPD_MQ_QUEUE *Queue;
+    SPD_MQ_ENTRY CompleteList;
+    NTSTATUS Result = STATUS_SUCCESS;
+    BOOLEAN Completed = FALSE;
     KIRQL Irql;
 
-    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    ASSERT(Srb == SrbExtension->Srb);
 
-    if (!Ioq->Stopped)
+    SpdMqListInitialize(&CompleteList);
+
+retry:
+    /*
+     * An SRB that has been merged into another one's request is not in its own queue:
+     * it is protected by the queue lock of its leader. MergeLeader is set while both
+     * queues are locked, so we check it again under the lock of either one.
+     */
+    Leader = SrbExtension->MergeLeader;
+    if (0 != Leader && SrbExtension != Leader)
     {
-        SPD_SRB_EXTENSION *SrbExtension = SpdSrbExtension(Srb);
-        ULONG Index;
+        Chunk = &SrbExtension->Chunks[0];
+        Queue = SpdIoqQueue(Ioq, &Leader->Chunks[0]);
 
-        ASSERT(Srb == SrbExtension->Srb);
+        KeAcquireSpinLock(&Queue->Lock, &Irql);
 
-        Index = SpdHashMixPointer(SrbExtension) % Ioq->ProcessBucketCount;
-        for (PVOID *P = &Ioq->ProcessBuckets[Index]; *P; P = &((SPD_SRB_EXTENSION *)(*P))->HashNext)
-            if (*P == SrbExtension)
-            {
-                *P = SrbExtension->HashNext;
-                SrbExtension->HashNext = 0;
+        if (Ioq->Stopped)
+            Result = STATUS_UNSUCCESSFUL;
+        else if (Leader == SrbExtension->MergeLeader)
+        {
+            /* the merged request has been handed out; its range keeps a hole for us */
+            SpdMergeRemove(&Leader->Merge, &SrbExtension->MergeEntry);
+            SrbExtension->MergeLeader = 0;
+            if (SpdIoqRetireChunkNoLock(Chunk, SRB_STATUS_ABORTED))
+                SpdIoqCompleteSrbNoLock(Ioq, SrbExtension, &CompleteList);
+        }
+        /* else the merged request is done and has completed us */
 
-                break;
-            }
+        KeReleaseSpinLock(&Queue->Lock, Irql);
 
-        RemoveEntryList(&SrbExtension->ListEntry);
-        SrbExtension->ListEntry.Flink = SrbExtension->ListEntry.Blink = 0;
+        SpdIoqCompleteSrbs(Ioq, &CompleteList);
 
-        SrbExtension->Srb = 0;
+        return Result;
+    }
 
-        SpdSrbComplete(Ioq->DeviceExtension, Srb, SRB_STATUS_ABORTED);
+    /*
+     * The chunks of the SRB may be in different queues: retire the active ones a queue
+     * at a time. Whoever retires the last chunk completes the SRB, so we stop once that
+     * is us or once no chunk is active. If no chunk is active to begin with, the SRB is
+     * already being completed; see SpdIoqCompleteSrbNoLock.
+     */
+    for (ULONG I = 0; !Completed && SrbExtension->ChunkCount > I; I++)
+    {
+        Chunk = &SrbExtension->Chunks[I];
+        Queue = SpdIoqQueue(Ioq, Chunk);
 
-        Result = STATUS_SUCCESS;
+        KeAcquireSpinLock(&Queue->Lock, &Irql);
+
+        if (Ioq->Stopped)
+            Result = STATUS_UNSUCCESSFUL;
+        else if (0 == SrbExtension->ChunkActiveCount)
+            Completed = TRUE;
+        else if (SrbExtension->MergeLeader != 0 && SrbExtension->MergeLeader != SrbExtension)
+        {
+            /* merged after we looked */
+            KeReleaseSpinLock(&Queue->Lock, Irql);
+            goto retry;
+        }
+        else if (SrbExtension == SrbExtension->MergeLeader)
+            /*
+             * Our request carries the SRB's merged into it and we cannot take it back;
+             * the SRB is aborted when the request is done. See SpdIoqSplitNoLock.
+             */
+            InterlockedCompareExchange(&SrbExtension->ChunkSrbStatus, SRB_STATUS_ABORTED, 0);
+        else if (Chunk->Active)
+        {
+            SpdMqRemoveNoLock(&Ioq->Mq, Queue, &Chunk->QueueEntry);
+            if (SpdIoqRetireChunkNoLock(Chunk, SRB_STATUS_ABORTED))
+            {
+                SpdIoqCompleteSrbNoLock(Ioq, SrbExtension, &CompleteList);
+                Completed = TRUE;
+            }
+        }
+
+        KeReleaseSpinLock(&Queue->Lock, Irql);
+
+        if (!NT_SUCCESS(Result))
+            break;
     }
 
-    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    SpdIoqCompleteSrbs(Ioq, &CompleteList);
 
     return Result;
 }
 
 NTSTATUS SpdIoqPostSrb(SPD_IOQ *Ioq, PVOID Srb)
 {
+    SPD_SRB_EXTENSION *SrbExtension = SpdSrbExtension(Srb);
+    ULONG ChunkCount = SrbExtension->ChunkCount;
+    ULONG PostCount = 0;
+    SPD_SRB_CHUNK *Chunk;
+    SPD_MQ_QUEUE *Queue;
+    SPD_MQ_ENTRY CompleteList;
     NTSTATUS Result = STATUS_CANCELLED;
     KIRQL Irql;
 
-    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    ASSERT(0 < ChunkCount && SPD_SRB_CHUNK_MAX >= ChunkCount);
+    ASSERT(0 == SrbExtension->Srb);
+    SrbExtension->Srb = Srb;
 
-    if (!Ioq->Stopped)
+    /* all chunks are active before we post any: a chunk may complete before we post the next */
+    SrbExtension->ChunkActiveCount = ChunkCount;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    for (; ChunkCount > PostCount; PostCount++)
     {
-        SPD_SRB_EXTENSION *SrbExtension = SpdSrbExtension(Srb);
+        Chunk = &SrbExtension->Chunks[PostCount];
+        Queue = SpdIoqQueue(Ioq, Chunk);
 
-        ASSERT(0 == SrbExtension->Srb);
-        SrbExtension->Srb = Srb;
+        KeAcquireSpinLockAtDpcLevel(&Queue->Lock);
 
-        ASSERT(0 == SrbExtension->ListEntry.Flink && 0 == SrbExtension->ListEntry.Blink);
-        InsertTailList(&Ioq->PendingList, &SrbExtension->ListEntry);
+        if (Ioq->Stopped)
+        {
+            KeReleaseSpinLockFromDpcLevel(&Queue->Lock);
+            break;
+        }
 
-        /* queue is not empty; wake up a waiter */
-        SpdQeventSetNoLock(&Ioq->PendingEvent);
+        ASSERT(0 == Chunk->QueueEntry.Flink && 0 == Chunk->QueueEntry.Blink);
+        Chunk->Active = TRUE;
+        SpdMqPostNoLock(&Ioq->Mq, Queue, &Chunk->QueueEntry, FALSE);
+
+        KeReleaseSpinLockFromDpcLevel(&Queue->Lock);
+    }
+
+    if (0 < PostCount)
+    {
+        if (ChunkCount > PostCount)
+        {
+            /*
+             * The queue was stopped after we posted some chunks; those have been
+             * retired by SpdIoqReset. Retire the others and complete the SRB.
+             */
+            InterlockedCompareExchange(&SrbExtension->ChunkSrbStatus, SRB_STATUS_ABORTED, 0);
+            if (0 == InterlockedAdd(&SrbExtension->ChunkActiveCount, -(LONG)(ChunkCount - PostCount)))
+            {
+                SpdMqListInitialize(&CompleteList);
+                SpdIoqCompleteSrbNoLock(Ioq, SrbExtension, &CompleteList);
+                SpdIoqCompleteSrbs(Ioq, &CompleteList);
+            }
+        }
 
         Result = STATUS_SUCCESS;
     }
 
-    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    if (ChunkCount == PostCount)
+    {
+        /* queue is not empty; wake up a waiter */
+        SpdIoqWakeup(Ioq);
+
+        /* SpdIoqWakeup is a full barrier: the SRB is visible before we look at Ring */
+        if (0 != Ioq->Ring)
+        {
+            KeAcquireSpinLockAtDpcLevel(&Ioq->SpinLock);
+            if (0 != Ioq->Ring)
+                SpdIoqRingFillNoLock(Ioq);
+            KeReleaseSpinLockFromDpcLevel(&Ioq->SpinLock);
+        }
+    }
+
+    KeLowerIrql(Irql);
 
     return Result;
 }
 
 NTSTATUS SpdIoqStartProcessingSrb(SPD_IOQ *Ioq, PLARGE_INTEGER Timeout, PIRP CancellableIrp,
-    VOID (*Prepare)(PVOID SrbExtension, PVOID Context, PVOID DataBuffer),
+    VOID (*Prepare)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
     PVOID Context, PVOID DataBuffer)
 {
+    SPD_MQ_QUEUE *Queue;
+    SPD_MQ_ENTRY *Entry;
     NTSTATUS Result;
     KIRQL Irql;
 
-    Result = SpdQeventCancellableWait(&Ioq->PendingEvent, Timeout, CancellableIrp);
-    if (STATUS_TIMEOUT == Result)
-        return STATUS_TIMEOUT;
-    if (STATUS_CANCELLED == Result || STATUS_THREAD_IS_TERMINATING == Result)
-        return STATUS_CANCELLED;
-    ASSERT(STATUS_SUCCESS == Result);
+    /*
+     * A zero timeout only takes what is already pending: it must not spin, and it must
+     * not wait on PendingEvent either. A zero wait would consume the event, and a poster
+     * that finds a poller does not set it again, so a chunk posted in between would be
+     * left pending with nobody woken for it.
+     */
+    if ((0 == Timeout || 0 != Timeout->QuadPart) && !SpdIoqPoll(Ioq))
+    {
+        Result = SpdQeventCancellableWait(&Ioq->PendingEvent, Timeout, CancellableIrp);
+        if (STATUS_TIMEOUT == Result)
+            return STATUS_TIMEOUT;
+        if (STATUS_CANCELLED == Result || STATUS_THREAD_IS_TERMINATING == Result)
+            return STATUS_CANCELLED;
+        ASSERT(STATUS_SUCCESS == Result);
+    }
 
-    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
-    if (!Ioq->Stopped)
+    /*
+     * A stopped queue is empty and stays empty, so we need not check Stopped before
+     * taking an SRB; SpdMqTake returns with the SRB's queue locked.
+     */
+    Entry = SpdMqTake(&Ioq->Mq, SpdIoqHomeQueue(Ioq), &Queue);
+    if (0 != Entry)
     {
-        PLIST_ENTRY PendingEntry;
+        SPD_SRB_CHUNK *Chunk = CONTAINING_RECORD(Entry, SPD_SRB_CHUNK, QueueEntry);
 
-        PendingEntry = &Ioq->PendingList;
-        if (PendingEntry->Flink != PendingEntry)
-        {
-            SPD_SRB_EXTENSION *SrbExtension =
-                CONTAINING_RECORD(PendingEntry->Flink, SPD_SRB_EXTENSION, ListEntry);
-            BOOLEAN Wake;
-            ULONG Index;
-
-            Wake = !RemoveEntryList(&SrbExtension->ListEntry);
-
-            Prepare(SrbExtension, Context, DataBuffer);
-
-            InsertTailList(&Ioq->ProcessList, &SrbExtension->ListEntry);
-            Index = SpdHashMixPointer(SrbExtension) % Ioq->ProcessBucketCount;
-#if DBG
-            for (PVOID X = Ioq->ProcessBuckets[Index]; X; X = ((SPD_SRB_EXTENSION *)X)->HashNext)
-                ASSERT(X != SrbExtension);
-            ASSERT(0 == SrbExtension->HashNext);
-#endif
-            SrbExtension->HashNext = Ioq->ProcessBuckets[Index];
-            Ioq->ProcessBuckets[Index] = SrbExtension;
-
-            if (Wake)
-                /* queue is not empty; wake up a waiter */
-                SpdQeventSetNoLock(&Ioq->PendingEvent);
-
-            Result = STATUS_SUCCESS;
-        }
-        else
-            Result = STATUS_UNSUCCESSFUL;
+        SpdIoqMergeNoLock(Ioq, Queue, Chunk);
+
+        Prepare(Chunk, Context, DataBuffer);
+
+        SpdMqProcessInsertNoLock(&Ioq->Mq, Queue, Entry);
+
+        SpdMqLockRelease(&Queue->Lock);
+
+        if (0 != Ioq->Mq.PendingCount)
+            /* queue is not empty; wake up a waiter */
+            SpdIoqWakeup(Ioq);
+
+        Result = STATUS_SUCCESS;
+    }
+    else if (!Ioq->Stopped)
+    {
+        /* if requests are pending the rate limit holds them back; we will be woken */
+        if (0 != Ioq->Mq.PendingCount)
+            SpdIoqThrottle(Ioq);
+
+        Result = STATUS_UNSUCCESSFUL;
     }
     else
     {
         /* queue is stopped; wake up a waiter */
-        SpdQeventSetNoLock(&Ioq->PendingEvent);
+        SpdQeventSet(&Ioq->PendingEvent);
 
         Result = STATUS_CANCELLED;
     }
 
-    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    KeLowerIrql(Irql);
 
     return Result;
 }
 
+/*
+ * If CompleteList is not 0, the SRB's that are done are added to it and the caller
+ * completes them with SpdIoqCompleteSrbs; this lets a batch complete all its SRB's in
+ * one pass. Otherwise they are completed before we return.
+ */
 VOID SpdIoqEndProcessingSrb(SPD_IOQ *Ioq, UINT64 Hint,
-    UCHAR (*Complete)(PVOID SrbExtension, PVOID Context, PVOID DataBuffer),
-    PVOID Context, PVOID DataBuffer)
+    UCHAR (*Complete)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
+    PVOID Context, PVOID DataBuffer,
+    SPD_MQ_ENTRY *CompleteList)
 {
+    SPD_MQ_QUEUE *Queue = SpdMqQueue(&Ioq->Mq, Hint);
+    SPD_MQ_ENTRY LocalCompleteList;
+    UINT64 Begin;
     KIRQL Irql;
 
-    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    if (0 == CompleteList)
+    {
+        SpdMqListInitialize(&LocalCompleteList);
+        CompleteList = &LocalCompleteList;
+    }
+
+    KeAcquireSpinLock(&Queue->Lock, &Irql);
+    Begin = SpdIoqStatsBegin(Ioq);
 
     if (!Ioq->Stopped)
+        SpdIoqEndProcessingSrbNoLock(Ioq, Queue, Hint, Complete, Context, DataBuffer,
+            CompleteList);
+
+    SpdIoqStatsEnd(&Ioq->Stats.LockHoldTime, &Ioq->Stats.LockHoldCount, Begin, 1);
+    KeReleaseSpinLock(&Queue->Lock, Irql);
+
+    if (&LocalCompleteList == CompleteList)
+        SpdIoqCompleteSrbs(Ioq, CompleteList);
+}
+
+NTSTATUS SpdIoqSetupRing(SPD_IOQ *Ioq,
+    ULONG Capacity, PVOID Buffer, UINT64 BufferSize, HANDLE Event, ULONG DataStride,
+    VOID (*Prepare)(PVOID Chunk, PVOID Context, PVOID DataBuffer),
+    UCHAR (*Complete)(PVOID Chunk, PVOID Context, PVOID DataBuffer))
+{
+    ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+
+    SPD_RING_LAYOUT Layout;
+    SPD_IOQ_RING *Ring = 0;
+    ULONG RingSize;
+    PUINT8 SystemBuffer;
+    KIRQL Irql;
+    NTSTATUS Result;
+
+    if (0 == Capacity || SPD_IOCTL_RING_CAPACITY_MAX < Capacity ||
+        0 != (Capacity & (Capacity - 1)) ||
+        0 != ((UINT_PTR)Buffer & (PAGE_SIZE - 1)))
+        return STATUS_INVALID_PARAMETER;
+
+    SpdRingGetLayout(Capacity,
+        sizeof(SPD_IOCTL_RING_REQ), sizeof(SPD_IOCTL_RING_RSP), DataStride, &Layout);
+    if (Layout.Size > BufferSize || MAXULONG < Layout.Size)
+        return STATUS_INVALID_PARAMETER;
+
+    RingSize = sizeof *Ring + Capacity * (sizeof Ring->FreeSlots[0] + sizeof Ring->SlotInUse[0]);
+    Ring = SpdAllocNonPaged(RingSize, SpdTagRing);
+    if (0 == Ring)
     {
-        SPD_SRB_EXTENSION *SrbExtension = (PVOID)(UINT_PTR)Hint;
-        ULONG Index;
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+    RtlZeroMemory(Ring, RingSize);
+    Ring->FreeSlots = (PVOID)(Ring + 1);
+    Ring->SlotInUse = (PVOID)(Ring->FreeSlots + Capacity);
 
-        Index = SpdHashMixPointer(SrbExtension) % Ioq->ProcessBucketCount;
-        for (PVOID *P = &Ioq->ProcessBuckets[Index]; *P; P = &((SPD_SRB_EXTENSION *)(*P))->HashNext)
-            if (*P == SrbExtension)
+    Result = ObReferenceObjectByHandle(Event,
+        EVENT_MODIFY_STATE, *ExEventObjectType, UserMode, &Ring->Event, 0);
+    if (!NT_SUCCESS(Result))
+    {
+        Ring->Event = 0;
+        goto exit;
+    }
+
+    /* the ring MDL is not attached to any IRP; it lives until the queue is stopped */
+    Ring->Mdl = IoAllocateMdl(Buffer, (ULONG)Layout.Size, FALSE, FALSE, 0);
+    if (0 == Ring->Mdl)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    try
+    {
+        MmProbeAndLockPages(Ring->Mdl, UserMode, IoWriteAccess);
+    }
+    except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        Result = GetExceptionCode();
+        goto exit;
+    }
+
+    SystemBuffer = MmGetSystemAddressForMdlSafe(Ring->Mdl, NormalPagePriority);
+    if (0 == SystemBuffer)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    SpdRingInitialize((PVOID)(SystemBuffer + Layout.ReqRingOffset));
+    SpdRingInitialize((PVOID)(SystemBuffer + Layout.RspRingOffset));
+    SpdRingPortInitialize(&Ring->ReqPort,
+        (PVOID)(SystemBuffer + Layout.ReqRingOffset), SystemBuffer + Layout.ReqEntriesOffset,
+        Capacity, sizeof(SPD_IOCTL_RING_REQ));
+    SpdRingPortInitialize(&Ring->RspPort,
+        (PVOID)(SystemBuffer + Layout.RspRingOffset), SystemBuffer + Layout.RspEntriesOffset,
+        Capacity, sizeof(SPD_IOCTL_RING_RSP));
+    Ring->Prepare = Prepare;
+    Ring->Complete = Complete;
+    Ring->DataBuffer = SystemBuffer + Layout.DataOffset;
+    Ring->DataStride = DataStride;
+    Ring->Capacity = Capacity;
+    for (ULONG I = 0; Capacity > I; I++)
+        Ring->FreeSlots[I] = Capacity - 1 - I;
+    Ring->FreeSlotCount = Capacity;
+
+    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+
+    if (Ioq->Stopped)
+        Result = STATUS_CANCELLED;
+    else if (0 != Ioq->Ring)
+        Result = STATUS_INVALID_DEVICE_REQUEST;
+    else
+    {
+        Ioq->Ring = Ring;
+
+        /* Ring must be visible before we look at the queues; see SpdIoqPostSrb */
+        MemoryBarrier();
+        SpdIoqRingFillNoLock(Ioq);
+        Result = STATUS_SUCCESS;
+    }
+
+    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+
+exit:
+    if (!NT_SUCCESS(Result) && 0 != Ring)
+        SpdIoqRingFree(Ring);
+
+    return Result;
+}
+
+NTSTATUS SpdIoqRingDoorbell(SPD_IOQ *Ioq)
+{
+    SPD_IOQ_RING *Ring;
+    SPD_IOCTL_RING_RSP Entry;
+    SPD_MQ_QUEUE *Queue;
+    SPD_MQ_ENTRY CompleteList;
+    UINT64 Begin;
+    BOOLEAN Empty;
+    KIRQL Irql;
+
+    SpdMqListInitialize(&CompleteList);
+
+    /*
+     * Drain the RSP ring in bounded rounds so that we never hold the spin lock for
+     * longer than Capacity completions; the SRB's of a round are completed after it
+     * releases the spin lock. We are done only when the ring is empty after a full
+     * barrier; see shared/ring.h for why this cannot lose a doorbell.
+     */
+    do
+    {
+        KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+        Begin = SpdIoqStatsBegin(Ioq);
+
+        Ring = Ioq->Ring;
+        if (Ioq->Stopped || 0 == Ring)
+        {
+            KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+            return Ioq->Stopped ? STATUS_CANCELLED : STATUS_INVALID_DEVICE_REQUEST;
+        }
+
+        for (ULONG I = 0; Ring->Capacity > I && SpdRingPop(&Ring->RspPort, &Entry); I++)
+        {
+            /* ignore responses for slots that we did not hand out */
+            if (Ring->Capacity <= Entry.Slot || !Ring->SlotInUse[Entry.Slot])
+                continue;
+
+            Queue = SpdMqQueue(&Ioq->Mq, Entry.Rsp.Hint);
+            SpdMqLockAcquire(&Queue->Lock);
+            SpdIoqEndProcessingSrbNoLock(Ioq, Queue, Entry.Rsp.Hint, Ring->Complete, &Entry.Rsp,
+                Ring->DataBuffer + Entry.Slot * Ring->DataStride, &CompleteList);
+            SpdMqLockRelease(&Queue->Lock);
+
+            Ring->SlotInUse[Entry.Slot] = 0;
+            Ring->FreeSlots[Ring->FreeSlotCount++] = Entry.Slot;
+        }
+
+        SpdIoqRingFillNoLock(Ioq);
+
+        Empty = SpdRingIsEmpty(&Ring->RspPort);
+
+        SpdIoqStatsEnd(&Ioq->Stats.LockHoldTime, &Ioq->Stats.LockHoldCount, Begin, 1);
+        KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+
+        SpdIoqCompleteSrbs(Ioq, &CompleteList);
+    } while (!Empty);
+
+    return STATUS_SUCCESS;
+}
+
+PVOID SpdIoqMapSrb(SPD_IOQ *Ioq, PVOID Chunk0, PVOID DataBuffer)
+{
+    ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+
+    SPD_SRB_CHUNK *Chunk = Chunk0;
+    SPD_SRB_EXTENSION *SrbExtension = Chunk->SrbExtension;
+    SPD_MQ_QUEUE *Queue = SpdIoqQueue(Ioq, Chunk);
+    PVOID MapAddress, Result = 0;
+    BOOLEAN Complete = FALSE;
+    KIRQL Irql;
+
+    ASSERT(SpdSrbMapPending == SrbExtension->MapState);
+
+    /*
+     * The SRB cannot go away while it is in the Pending state: our chunk is either
+     * still being processed or the SRB is parked in the UnmapList waiting for us.
+     */
+    try
+    {
+        MapAddress = MmMapLockedPagesSpecifyCache(SrbExtension->MapMdl,
+            UserMode, MmCached, 0, FALSE, NormalPagePriority |
+            (FlagOn(SrbGetSrbFlags(SrbExtension->Srb), SRB_FLAGS_DATA_OUT) ?
+                MdlMappingNoWrite : 0));
+    }
+    except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        MapAddress = 0;
+    }
+
+    /* the chunk is protected by its queue lock; the map state by UnmapSpinLock */
+    KeAcquireSpinLock(&Queue->Lock, &Irql);
+    KeAcquireSpinLockAtDpcLevel(&Ioq->UnmapSpinLock);
+
+    if (0 != MapAddress)
+    {
+        SrbExtension->MapAddress = MapAddress;
+        SrbExtension->MapProcess = PsGetCurrentProcess();
+        ObReferenceObject(SrbExtension->MapProcess);
+        SrbExtension->MapState = SpdSrbMapDone;
+    }
+    else
+        SrbExtension->MapState = SpdSrbMapFailed;
+
+    if (0 != MapAddress && !SrbExtension->CompletePending)
+        Result = (PUINT8)MapAddress + Chunk->ChunkOffset;
+    else
+    {
+        /* fall back to copying; Prepare skipped the copy because it expected a mapping */
+        Chunk->Mapped = FALSE;
+        if (0 != DataBuffer && FlagOn(SrbGetSrbFlags(SrbExtension->Srb), SRB_FLAGS_DATA_OUT))
+            SpdChunkPrepare(
+                SrbExtension->SystemDataBuffer, SrbExtension->SystemDataLength,
+                Chunk->ChunkOffset,
+                SrbExtension->StorageUnit->StorageUnitParams.MaxTransferLength,
+                TRUE, FALSE, DataBuffer);
+
+        if (SpdSrbMapFailed == SrbExtension->MapState)
+        {
+            IoFreeMdl(SrbExtension->MapMdl);
+            SrbExtension->MapMdl = 0;
+
+            if (SrbExtension->CompletePending)
             {
-                *P = SrbExtension->HashNext;
+                SrbExtension->CompletePending = FALSE;
+                SpdMqListRemove(&SrbExtension->Chunks[0].QueueEntry);
+                Complete = TRUE;
+            }
+        }
+
+        /* if the mapping succeeded but the SRB is completing, SpdIoqUnmapSrbs undoes it */
+    }
 
-                RemoveEntryList(&SrbExtension->ListEntry);
+    KeReleaseSpinLockFromDpcLevel(&Ioq->UnmapSpinLock);
+    KeReleaseSpinLock(&Queue->Lock, Irql);
 
-                UCHAR SrbStatus = Complete(SrbExtension, Context, DataBuffer);
-                if (SRB_STATUS_PENDING == SrbStatus)
-                {
-                    /*
-                     * If Complete returns PENDING we need to repost the SRB
-                     * and we will also place it at the queue head, so that it
-                     * gets picked up immediately after.
-                     *
-                     * This functionality supports splitting SRB's into chunks,
-                     * which is required for I/O that exceeds our MaxTransferLength.
-                     * See https://tinyurl.com/ychyv62s
-                     */
-                    InsertHeadList(&Ioq->PendingList, &SrbExtension->ListEntry);
-
-                    /* queue is not empty; wake up a waiter */
-                    SpdQeventSetNoLock(&Ioq->PendingEvent);
-                }
-                else
-                    SpdSrbComplete(Ioq->DeviceExtension, SrbExtension->Srb, SrbStatus);
+    /* the SRB is no longer in any list; complete it now that we hold no lock */
+    if (Complete)
+        SpdSrbComplete(Ioq->DeviceExtension, SrbExtension->Srb, SrbExtension->CompleteSrbStatus);
+
+    return Result;
+}
+
+BOOLEAN SpdIoqUnmapPending(SPD_IOQ *Ioq)
+{
+    BOOLEAN Result;
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&Ioq->UnmapSpinLock, &Irql);
 
+    Result = !SpdMqListIsEmpty(&Ioq->UnmapList);
+
+    KeReleaseSpinLock(&Ioq->UnmapSpinLock, Irql);
+
+    return Result;
+}
+
+VOID SpdIoqUnmapSrbs(SPD_IOQ *Ioq)
+{
+    ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+
+    SPD_SRB_EXTENSION *SrbExtension;
+    SPD_MQ_ENTRY *ListEntry;
+    KAPC_STATE ApcState;
+    KIRQL Irql;
+
+    for (;;)
+    {
+        SrbExtension = 0;
+
+        KeAcquireSpinLock(&Ioq->UnmapSpinLock, &Irql);
+
+        for (ListEntry = Ioq->UnmapList.Flink; &Ioq->UnmapList != ListEntry;
+            ListEntry = ListEntry->Flink)
+        {
+            SPD_SRB_EXTENSION *Candidate =
+                CONTAINING_RECORD(ListEntry, SPD_SRB_EXTENSION, Chunks[0].QueueEntry);
+
+            /* Pending entries are finished by SpdIoqMapSrb */
+            if (SpdSrbMapDone == Candidate->MapState)
+            {
+                Candidate->MapState = SpdSrbMapUnmapping;
+                SrbExtension = Candidate;
                 break;
             }
-    }
+        }
 
-    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+        KeReleaseSpinLock(&Ioq->UnmapSpinLock, Irql);
+
+        if (0 == SrbExtension)
+            break;
+
+        /* the mapping lives in the address space of MapProcess */
+        if (PsGetCurrentProcess() != SrbExtension->MapProcess)
+        {
+            KeStackAttachProcess(SrbExtension->MapProcess, &ApcState);
+            MmUnmapLockedPages(SrbExtension->MapAddress, SrbExtension->MapMdl);
+            KeUnstackDetachProcess(&ApcState);
+        }
+        else
+            MmUnmapLockedPages(SrbExtension->MapAddress, SrbExtension->MapMdl);
+        IoFreeMdl(SrbExtension->MapMdl);
+        ObDereferenceObject(SrbExtension->MapProcess);
+        SrbExtension->MapMdl = 0;
+        SrbExtension->MapAddress = 0;
+        SrbExtension->MapProcess = 0;
+
+        /* no chunk of the SRB is active, so we need not take any queue lock */
+        KeAcquireSpinLock(&Ioq->UnmapSpinLock, &Irql);
+
+        SpdMqListRemove(&SrbExtension->Chunks[0].QueueEntry);
+        SrbExtension->CompletePending = FALSE;
+
+        KeReleaseSpinLockFromDpcLevel(&Ioq->UnmapSpinLock);
+
+        SpdSrbComplete(Ioq->DeviceExtension, SrbExtension->Srb, SrbExtension->CompleteSrbStatus);
+
+        KeLowerIrql(Irql);
+    }
 }
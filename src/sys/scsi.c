@@ -35,6 +35,15 @@ static UCHAR SpdScsiPostUnmapSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
     PVOID Srb, PCDB Cdb);
 static UCHAR SpdScsiPostSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
     PVOID Srb, ULONG DataLength);
+static VOID SpdScsiMergeEntry(SPD_STORAGE_UNIT *StorageUnit,
+    PCDB Cdb, SPD_MERGE_ENTRY *MergeEntry);
+static BOOLEAN SpdScsiReadCacheLookup(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_SRB_EXTENSION *SrbExtension, PCDB Cdb);
+static VOID SpdScsiReadCacheFill(SPD_STORAGE_UNIT *StorageUnit, UINT64 Generation,
+    UINT64 BlockAddress, ULONG DataLength, PVOID DataBuffer);
+static VOID SpdScsiReadCacheInvalidate(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT64 BlockCount);
+static VOID SpdScsiReadCacheInvalidateSrb(SPD_SRB_EXTENSION *SrbExtension);
 static UCHAR SpdScsiErrorEx(PVOID Srb,
     UCHAR SenseKey,
     UCHAR AdditionalSenseCode,
@@ -42,6 +51,8 @@ static UCHAR SpdScsiErrorEx(PVOID Srb,
     PUINT64 PInformation);
 static VOID SpdCdbGetRange(PCDB Cdb,
     PUINT64 POffset, PUINT32 PLength, PUINT32 PForceUnitAccess);
+static VOID SpdUnmapDescriptorGetRange(PUNMAP_BLOCK_DESCRIPTOR Descriptor,
+    PUINT64 POffset, PUINT32 PLength);
 
 #define SpdScsiError(S,K,A)             SpdScsiErrorEx(S,K,A,0,0)
 
@@ -125,51 +136,54 @@ exit:
     return SrbStatus;
 }
 
-static UCHAR SpdScsiReportLuns(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit,
+static UCHAR SpdScsiReportLuns(PVOID DeviceExtension0, SPD_STORAGE_UNIT *StorageUnit,
     PVOID Srb, PCDB Cdb)
 {
+    SPD_DEVICE_EXTENSION *DeviceExtension = DeviceExtension0;
     PVOID DataBuffer = SrbGetDataBuffer(Srb);
     ULONG DataTransferLength = SrbGetDataTransferLength(Srb);
-    PLUN_LIST LunList;
-    ULONG Length;
+    UCHAR Header[sizeof(LUN_LIST)] = { 0 };
+    ULONG Offset, Length;
+    UCHAR PathId, TargetId, Lun;
+    SPD_STORAGE_UNIT *Unit;
 
     if (0 == DataBuffer)
         return SRB_STATUS_INTERNAL_ERROR;
 
     RtlZeroMemory(DataBuffer, DataTransferLength);
 
-    LunList = DataBuffer;
-    if (0 != StorageUnit)
-    {
-        Length = RTL_FIELD_SIZE(LUN_LIST, Lun[0]);
-
-        if (sizeof(LUN_LIST) + Length > DataTransferLength)
-            return SRB_STATUS_DATA_OVERRUN;
-
-        // Our Lun is always 0. See RtlZeroMemory above.
-        // LunList->Lun[0][0] = 0;
-        // LunList->Lun[0][1] = 0;
-        // LunList->Lun[0][2] = 0;
-        // LunList->Lun[0][3] = 0;
-        // LunList->Lun[0][4] = 0;
-        // LunList->Lun[0][5] = 0;
-        // LunList->Lun[0][6] = 0;
-        // LunList->Lun[0][7] = 0;
-    }
-    else
+    /*
+     * List the LUNs of the target that have a storage unit. A short allocation length
+     * truncates the list, but the header still reports the full LUN LIST LENGTH, so that
+     * the initiator can retry with a buffer that is large enough (SPC-4 4.2.5.6).
+     */
+    SrbGetPathTargetLun(Srb, &PathId, &TargetId, &Lun);
+    Length = 0;
+    for (ULONG L = 0; SPD_IOCTL_LUN_COUNT(DeviceExtension->StorageUnitCapacity) > L; L++)
     {
-        Length = 0;
-
-        if (sizeof(LUN_LIST) + Length > DataTransferLength)
-            return SRB_STATUS_DATA_OVERRUN;
+        Unit = SpdStorageUnitReferenceByBtl(DeviceExtension, SPD_IOCTL_BTL(PathId, TargetId, L));
+        if (0 == Unit)
+            continue;
+        SpdStorageUnitDereference(DeviceExtension, Unit);
+
+        /* single level LUN; flat space addressing above 255; other bytes are zero */
+        Offset = sizeof(LUN_LIST) + Length;
+        if (Offset < DataTransferLength)
+            ((PUINT8)DataBuffer)[Offset] = (UCHAR)(255 < L ? 0x40 | ((L >> 8) & 0x3f) : 0);
+        if (Offset + 1 < DataTransferLength)
+            ((PUINT8)DataBuffer)[Offset + 1] = (UCHAR)(L & 0xff);
+        Length += RTL_FIELD_SIZE(LUN_LIST, Lun[0]);
     }
 
-    LunList->LunListLength[0] = (Length >> 24) & 0xff;
-    LunList->LunListLength[1] = (Length >> 16) & 0xff;
-    LunList->LunListLength[2] = (Length >> 8) & 0xff;
-    LunList->LunListLength[3] = Length & 0xff;
+    Header[0] = (Length >> 24) & 0xff;
+    Header[1] = (Length >> 16) & 0xff;
+    Header[2] = (Length >> 8) & 0xff;
+    Header[3] = Length & 0xff;
+    RtlCopyMemory(DataBuffer, Header,
+        sizeof Header < DataTransferLength ? sizeof Header : DataTransferLength);
 
-    SrbSetDataTransferLength(Srb, sizeof(LUN_LIST) + Length);
+    if (sizeof(LUN_LIST) + Length < DataTransferLength)
+        SrbSetDataTransferLength(Srb, sizeof(LUN_LIST) + Length);
 
     return SRB_STATUS_SUCCESS;
 }
@@ -361,6 +375,11 @@ static UCHAR SpdScsiInquiry(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit
                 BlockLimits->MaximumUnmapBlockDescriptorCount[1] = (U32 >> 16) & 0xff;
                 BlockLimits->MaximumUnmapBlockDescriptorCount[2] = (U32 >> 8) & 0xff;
                 BlockLimits->MaximumUnmapBlockDescriptorCount[3] = U32 & 0xff;
+                U32 = StorageUnit->StorageUnitParams.UnmapGranularity;
+                BlockLimits->OptimalUnmapGranularity[0] = (U32 >> 24) & 0xff;
+                BlockLimits->OptimalUnmapGranularity[1] = (U32 >> 16) & 0xff;
+                BlockLimits->OptimalUnmapGranularity[2] = (U32 >> 8) & 0xff;
+                BlockLimits->OptimalUnmapGranularity[3] = U32 & 0xff;
             }
 
             SrbSetDataTransferLength(Srb, sizeof(VPD_BLOCK_LIMITS_PAGE));
@@ -548,6 +567,7 @@ static UCHAR SpdScsiPostRangeSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
     UINT64 BlockAddress, EndBlockAddress;
     UINT32 BlockCount;
     ULONG DataLength;
+    BOOLEAN Write = FALSE;
 
     switch (Cdb->AsByte[0])
     {
@@ -571,6 +591,7 @@ static UCHAR SpdScsiPostRangeSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
         DataLength = BlockCount * StorageUnit->StorageUnitParams.BlockLength;
         if (SrbGetDataTransferLength(Srb) < DataLength)
             return SRB_STATUS_INTERNAL_ERROR;
+        Write = TRUE;
         break;
 
     case SCSIOP_SYNCHRONIZE_CACHE:
@@ -596,6 +617,9 @@ static UCHAR SpdScsiPostRangeSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
         EndBlockAddress > StorageUnit->StorageUnitParams.BlockCount)
         return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_BLOCK);
 
+    if (Write && 0 != StorageUnit->ReadCache.EntryCount)
+        SpdScsiReadCacheInvalidate(StorageUnit, BlockAddress, BlockCount);
+
     return SpdScsiPostSrb(DeviceExtension, StorageUnit, Srb, DataLength);
 }
 
@@ -648,6 +672,9 @@ static UCHAR SpdScsiPostUnmapSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *Storag
         if (EndBlockAddress < BlockAddress ||
             EndBlockAddress > StorageUnit->StorageUnitParams.BlockCount)
             return SpdScsiError(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_BLOCK);
+
+        if (0 != StorageUnit->ReadCache.EntryCount)
+            SpdScsiReadCacheInvalidate(StorageUnit, BlockAddress, BlockCount);
     }
 
     return SpdScsiPostSrb(DeviceExtension, StorageUnit, Srb, DataLength);
@@ -657,6 +684,8 @@ static UCHAR SpdScsiPostSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit
     PVOID Srb, ULONG DataLength)
 {
     SPD_SRB_EXTENSION *SrbExtension;
+    ULONG MaxTransferLength, ChunkCount;
+    UINT8 Class;
     ULONG StorResult;
     NTSTATUS Result;
 
@@ -675,22 +704,232 @@ static UCHAR SpdScsiPostSrb(PVOID DeviceExtension, SPD_STORAGE_UNIT *StorageUnit
         SrbExtension->SystemDataLength = DataLength;
     }
 
+    /* a READ that the read cache holds in full completes without a round trip */
+    if (0 != StorageUnit->ReadCache.EntryCount &&
+        SpdScsiReadCacheLookup(StorageUnit, SrbExtension, SrbGetCdb(Srb)))
+        return SRB_STATUS_SUCCESS;
+
+    /*
+     * Give the first pieces of the SRB to as many chunks as we have, so that they can
+     * be processed in parallel; each chunk claims the next piece when it completes.
+     */
+    MaxTransferLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    ChunkCount = SpdChunkCount(DataLength, MaxTransferLength);
+    if (SPD_SRB_CHUNK_MAX < ChunkCount)
+        ChunkCount = SPD_SRB_CHUNK_MAX;
+    switch (SrbGetCdb(Srb)->AsByte[0])
+    {
+    case SCSIOP_WRITE6:
+    case SCSIOP_WRITE:
+    case SCSIOP_WRITE12:
+    case SCSIOP_WRITE16:
+    case SCSIOP_UNMAP:
+        Class = SpdIoSchedBulkClass;
+        break;
+    default:
+        Class = SpdIoSchedUrgentClass;
+        break;
+    }
+    for (ULONG I = 0; ChunkCount > I; I++)
+    {
+        SrbExtension->Chunks[I].SrbExtension = SrbExtension;
+        SrbExtension->Chunks[I].ChunkOffset = I * MaxTransferLength;
+        SrbExtension->Chunks[I].QueueEntry.Class = Class;
+        SrbExtension->Chunks[I].QueueEntry.Length =
+            SpdChunkLength(DataLength, I * MaxTransferLength, MaxTransferLength);
+    }
+    SrbExtension->ChunkCount = ChunkCount;
+    SrbExtension->ChunkNextOffset = ChunkCount * MaxTransferLength;
+
+    /* a READ/WRITE that fits in a single request may be merged with adjacent ones */
+    if (StorageUnit->StorageUnitParams.Coalesce &&
+        0 != DataLength && MaxTransferLength >= DataLength)
+        SpdScsiMergeEntry(StorageUnit, SrbGetCdb(Srb), &SrbExtension->MergeEntry);
+
     Result = SpdIoqPostSrb(StorageUnit->Ioq, Srb);
     return NT_SUCCESS(Result) ? SRB_STATUS_PENDING : SRB_STATUS_ABORTED;
 }
 
-VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension0, PVOID Context, PVOID DataBuffer)
+static VOID SpdScsiMergeEntry(SPD_STORAGE_UNIT *StorageUnit,
+    PCDB Cdb, SPD_MERGE_ENTRY *MergeEntry)
 {
-    ASSERT(DISPATCH_LEVEL == KeGetCurrentIrql());
+    UINT32 ForceUnitAccess;
+
+    switch (Cdb->AsByte[0])
+    {
+    case SCSIOP_READ6:
+    case SCSIOP_READ:
+    case SCSIOP_READ12:
+    case SCSIOP_READ16:
+        MergeEntry->Key = SpdIoctlTransactReadKind;
+        break;
+
+    case SCSIOP_WRITE6:
+    case SCSIOP_WRITE:
+    case SCSIOP_WRITE12:
+    case SCSIOP_WRITE16:
+        MergeEntry->Key = SpdIoctlTransactWriteKind;
+        break;
+
+    default:
+        MergeEntry->Key = 0;
+        return;
+    }
+
+    SpdCdbGetRange(Cdb, &MergeEntry->BlockAddress, &MergeEntry->BlockCount, &ForceUnitAccess);
+
+    /* requests with and without FUA do not merge; see SpdSrbExecuteScsiPrepareInternal */
+    if (!StorageUnit->StorageUnitParams.CacheSupported || ForceUnitAccess)
+        MergeEntry->Key |= SPD_MERGE_KEY_FUA;
+}
+
+/*
+ * Read cache (see shared/bcache.h): READ's are served from the cache when they are posted
+ * and fill it when they complete; WRITE's and UNMAP's invalidate it when they are posted
+ * and again when they complete. A FUA READ is not served from the cache, but it fills it.
+ */
+static BOOLEAN SpdScsiReadCacheLookup(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_SRB_EXTENSION *SrbExtension, PCDB Cdb)
+{
+    UINT64 BlockAddress;
+    UINT32 BlockCount, ForceUnitAccess;
+    BOOLEAN Result = FALSE;
+    KIRQL Irql;
+
+    switch (Cdb->AsByte[0])
+    {
+    case SCSIOP_READ6:
+    case SCSIOP_READ:
+    case SCSIOP_READ12:
+    case SCSIOP_READ16:
+        break;
+
+    default:
+        return FALSE;
+    }
+
+    SpdCdbGetRange(Cdb, &BlockAddress, &BlockCount, &ForceUnitAccess);
+
+    KeAcquireSpinLock(&StorageUnit->ReadCacheSpinLock, &Irql);
+    SrbExtension->ReadCacheGeneration = SpdBcacheGeneration(&StorageUnit->ReadCache);
+    if (!ForceUnitAccess)
+        Result = SpdBcacheRead(&StorageUnit->ReadCache,
+            BlockAddress, BlockCount, SrbExtension->SystemDataBuffer);
+    KeReleaseSpinLock(&StorageUnit->ReadCacheSpinLock, Irql);
+
+    return Result;
+}
+
+static VOID SpdScsiReadCacheFill(SPD_STORAGE_UNIT *StorageUnit, UINT64 Generation,
+    UINT64 BlockAddress, ULONG DataLength, PVOID DataBuffer)
+{
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&StorageUnit->ReadCacheSpinLock, &Irql);
+    SpdBcacheFill(&StorageUnit->ReadCache, Generation,
+        BlockAddress, DataLength / StorageUnit->StorageUnitParams.BlockLength, DataBuffer);
+    KeReleaseSpinLock(&StorageUnit->ReadCacheSpinLock, Irql);
+}
+
+static VOID SpdScsiReadCacheInvalidate(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT64 BlockCount)
+{
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&StorageUnit->ReadCacheSpinLock, &Irql);
+    SpdBcacheInvalidate(&StorageUnit->ReadCache, BlockAddress, BlockCount);
+    KeReleaseSpinLock(&StorageUnit->ReadCacheSpinLock, Irql);
+}
+
+/* a WRITE or UNMAP has a response: it may have raced with a READ that filled the cache */
+static VOID SpdScsiReadCacheInvalidateSrb(SPD_SRB_EXTENSION *SrbExtension)
+{
+    SPD_STORAGE_UNIT *StorageUnit = SrbExtension->StorageUnit;
+    PCDB Cdb = SrbGetCdb(SrbExtension->Srb);
+    UINT64 BlockAddress;
+    UINT32 BlockCount;
+
+    switch (Cdb->AsByte[0])
+    {
+    case SCSIOP_WRITE6:
+    case SCSIOP_WRITE:
+    case SCSIOP_WRITE12:
+    case SCSIOP_WRITE16:
+        SpdCdbGetRange(Cdb, &BlockAddress, &BlockCount, 0);
+        SpdScsiReadCacheInvalidate(StorageUnit, BlockAddress, BlockCount);
+        break;
+
+    case SCSIOP_UNMAP:
+        for (ULONG I = 0, N = SrbExtension->SystemDataLength / sizeof(UNMAP_BLOCK_DESCRIPTOR); N > I; I++)
+        {
+            SpdUnmapDescriptorGetRange(
+                &((PUNMAP_LIST_HEADER)SrbExtension->SystemDataBuffer)->Descriptors[I],
+                &BlockAddress, &BlockCount);
+            SpdScsiReadCacheInvalidate(StorageUnit, BlockAddress, BlockCount);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/*
+ * Prepare a request that has other SRB's merged into it (see SpdIoqMergeNoLock): it
+ * covers the block range of the whole merge and its write data are gathered from all
+ * the merged SRB's. The merged SRB's fit in MaxTransferLength and are never mapped.
+ */
+static VOID SpdSrbExecuteScsiPrepareMerged(SPD_SRB_CHUNK *Chunk,
+    SPD_IOCTL_TRANSACT_REQ *Req, PVOID DataBuffer)
+{
+    SPD_SRB_EXTENSION *Leader = Chunk->SrbExtension, *Member;
+    SPD_STORAGE_UNIT *StorageUnit = Leader->StorageUnit;
+    SPD_MERGE *Merge = &Leader->Merge;
+    UINT32 ForceUnitAccess = 0 != (Merge->Key & SPD_MERGE_KEY_FUA);
+
+    ASSERT(!Chunk->Mapped);
+
+    Req->Hint = (UINT64)(UINT_PTR)Chunk;
+    Req->Kind = Merge->Key & ~SPD_MERGE_KEY_FUA;
+    if (SpdIoctlTransactReadKind == Req->Kind)
+    {
+        Req->Op.Read.BlockAddress = Merge->BlockAddress;
+        Req->Op.Read.BlockCount = Merge->BlockCount;
+        Req->Op.Read.ForceUnitAccess = ForceUnitAccess;
+        return;
+    }
+
+    Req->Op.Write.BlockAddress = Merge->BlockAddress;
+    Req->Op.Write.BlockCount = Merge->BlockCount;
+    Req->Op.Write.ForceUnitAccess = ForceUnitAccess;
+    for (SPD_MERGE_ENTRY *Entry = Merge->First; 0 != Entry; Entry = Entry->Next)
+    {
+        Member = CONTAINING_RECORD(Entry, SPD_SRB_EXTENSION, MergeEntry);
+        SpdChunkPrepare(
+            Member->SystemDataBuffer, Member->SystemDataLength, 0,
+            StorageUnit->StorageUnitParams.MaxTransferLength,
+            TRUE, FALSE,
+            (PUINT8)DataBuffer +
+                SpdMergeOffset(Merge, Entry, StorageUnit->StorageUnitParams.BlockLength));
+    }
+}
 
-    SPD_SRB_EXTENSION *SrbExtension = SrbExtension0;
+static VOID SpdSrbExecuteScsiPrepareInternal(SPD_SRB_CHUNK *Chunk,
+    SPD_IOCTL_TRANSACT_REQ *Req, PVOID DataBuffer)
+{
+    SPD_SRB_EXTENSION *SrbExtension = Chunk->SrbExtension;
     SPD_STORAGE_UNIT *StorageUnit = SrbExtension->StorageUnit;
-    SPD_IOCTL_TRANSACT_REQ *Req = Context;
     PVOID Srb = SrbExtension->Srb;
     PCDB Cdb;
     UINT32 ForceUnitAccess;
     ULONG ChunkLength;
 
+    if (SrbExtension == SrbExtension->MergeLeader)
+    {
+        SpdSrbExecuteScsiPrepareMerged(Chunk, Req, DataBuffer);
+        return;
+    }
+
     Cdb = SrbGetCdb(Srb);
     switch (Cdb->AsByte[0])
     {
@@ -698,7 +937,7 @@ VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension0, PVOID Context, PVOID DataBuff
     case SCSIOP_READ:
     case SCSIOP_READ12:
     case SCSIOP_READ16:
-        Req->Hint = (UINT64)(UINT_PTR)SrbExtension;
+        Req->Hint = (UINT64)(UINT_PTR)Chunk;
         Req->Kind = SpdIoctlTransactReadKind;
         SpdCdbGetRange(Cdb,
             &Req->Op.Read.BlockAddress,
@@ -706,11 +945,12 @@ VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension0, PVOID Context, PVOID DataBuff
             &ForceUnitAccess);
         Req->Op.Read.ForceUnitAccess =
             StorageUnit->StorageUnitParams.CacheSupported ? ForceUnitAccess : 1;
-        ChunkLength = SrbExtension->SystemDataLength - SrbExtension->ChunkOffset;
-        if (ChunkLength > StorageUnit->StorageUnitParams.MaxTransferLength)
-            ChunkLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+        ChunkLength = SpdChunkPrepare(
+            SrbExtension->SystemDataBuffer, SrbExtension->SystemDataLength, Chunk->ChunkOffset,
+            StorageUnit->StorageUnitParams.MaxTransferLength,
+            FALSE, Chunk->Mapped, DataBuffer);
         Req->Op.Read.BlockAddress +=
-            SrbExtension->ChunkOffset / StorageUnit->StorageUnitParams.BlockLength;
+            Chunk->ChunkOffset / StorageUnit->StorageUnitParams.BlockLength;
         Req->Op.Read.BlockCount =
             ChunkLength / StorageUnit->StorageUnitParams.BlockLength;
         return;
@@ -719,7 +959,7 @@ VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension0, PVOID Context, PVOID DataBuff
     case SCSIOP_WRITE:
     case SCSIOP_WRITE12:
     case SCSIOP_WRITE16:
-        Req->Hint = (UINT64)(UINT_PTR)SrbExtension;
+        Req->Hint = (UINT64)(UINT_PTR)Chunk;
         Req->Kind = SpdIoctlTransactWriteKind;
         SpdCdbGetRange(Cdb,
             &Req->Op.Write.BlockAddress,
@@ -727,20 +967,19 @@ VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension0, PVOID Context, PVOID DataBuff
             &ForceUnitAccess);
         Req->Op.Write.ForceUnitAccess =
             StorageUnit->StorageUnitParams.CacheSupported ? ForceUnitAccess : 1;
-        ChunkLength = SrbExtension->SystemDataLength - SrbExtension->ChunkOffset;
-        if (ChunkLength > StorageUnit->StorageUnitParams.MaxTransferLength)
-            ChunkLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+        ChunkLength = SpdChunkPrepare(
+            SrbExtension->SystemDataBuffer, SrbExtension->SystemDataLength, Chunk->ChunkOffset,
+            StorageUnit->StorageUnitParams.MaxTransferLength,
+            TRUE, Chunk->Mapped, DataBuffer);
         Req->Op.Write.BlockAddress +=
-            SrbExtension->ChunkOffset / StorageUnit->StorageUnitParams.BlockLength;
+            Chunk->ChunkOffset / StorageUnit->StorageUnitParams.BlockLength;
         Req->Op.Write.BlockCount =
             ChunkLength / StorageUnit->StorageUnitParams.BlockLength;
-        RtlCopyMemory(DataBuffer,
-            (PUINT8)SrbExtension->SystemDataBuffer + SrbExtension->ChunkOffset, ChunkLength);
         return;
 
     case SCSIOP_SYNCHRONIZE_CACHE:
     case SCSIOP_SYNCHRONIZE_CACHE16:
-        Req->Hint = (UINT64)(UINT_PTR)SrbExtension;
+        Req->Hint = (UINT64)(UINT_PTR)Chunk;
         Req->Kind = SpdIoctlTransactFlushKind;
         SpdCdbGetRange(Cdb,
             &Req->Op.Flush.BlockAddress,
@@ -749,7 +988,7 @@ VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension0, PVOID Context, PVOID DataBuff
         return;
 
     case SCSIOP_UNMAP:
-        Req->Hint = (UINT64)(UINT_PTR)SrbExtension;
+        Req->Hint = (UINT64)(UINT_PTR)Chunk;
         Req->Kind = SpdIoctlTransactUnmapKind;
         Req->Op.Unmap.Count = SrbExtension->SystemDataLength / sizeof(UNMAP_BLOCK_DESCRIPTOR);
         for (ULONG I = 0, N = Req->Op.Unmap.Count; N > I; I++)
@@ -780,23 +1019,206 @@ VOID SpdSrbExecuteScsiPrepare(PVOID SrbExtension0, PVOID Context, PVOID DataBuff
     }
 }
 
-UCHAR SpdSrbExecuteScsiComplete(PVOID SrbExtension0, PVOID Context, PVOID DataBuffer)
+VOID SpdSrbExecuteScsiPrepare(PVOID Chunk0, PVOID Context, PVOID DataBuffer)
 {
     ASSERT(DISPATCH_LEVEL == KeGetCurrentIrql());
 
-    SPD_SRB_EXTENSION *SrbExtension = SrbExtension0;
+    SPD_SRB_CHUNK *Chunk = Chunk0;
+
+    Chunk->Mapped = FALSE;
+    SpdSrbExecuteScsiPrepareInternal(Chunk, Context, DataBuffer);
+}
+
+VOID SpdSrbExecuteScsiPrepareMapped(PVOID Chunk0, PVOID Context, PVOID DataBuffer)
+{
+    ASSERT(DISPATCH_LEVEL == KeGetCurrentIrql());
+
+    SPD_SRB_CHUNK *Chunk = Chunk0;
+    SPD_SRB_EXTENSION *SrbExtension = Chunk->SrbExtension;
+    SPD_IOQ *Ioq = SrbExtension->StorageUnit->Ioq;
+    SPD_SRB_MAP_CONTEXT *MapContext = Context;
+    PVOID Srb = SrbExtension->Srb;
+    PCDB Cdb;
+
+    /*
+     * Zero-copy: instead of copying READ/WRITE data through the transact data buffer,
+     * map the SRB data pages into the transacting process and let the storage unit
+     * access them directly. The mapping is built by the first chunk that gets here and
+     * reused by the chunks that follow; chunks prepared while it is being built are
+     * copied. It is torn down before the SRB is completed.
+     *
+     * We are at DISPATCH_LEVEL here, so we can only describe the pages with an MDL.
+     * The mapping itself is done by SpdIoqMapSrb at PASSIVE_LEVEL; until then the
+     * chunk is marked as mapped so that Prepare does not copy the write data.
+     *
+     * The chunks of the SRB may be in different queues, so the map state is
+     * protected by UnmapSpinLock rather than by our queue lock.
+     *
+     * A mapping is made of whole pages, so we map only data that occupy whole pages;
+     * otherwise the process would also see the bytes around the data, which may belong
+     * to someone else. The data of a WRITE are mapped read-only.
+     */
+    MapContext->MapChunk = 0;
+    MapContext->MappedDataBuffer = 0;
+    Chunk->Mapped = FALSE;
+
+    /* a merged request spans the data of several SRB's, so it is always copied */
+    Cdb = SrbGetCdb(Srb);
+    switch (SrbExtension == SrbExtension->MergeLeader ? 0 : Cdb->AsByte[0])
+    {
+    case SCSIOP_READ6:
+    case SCSIOP_READ:
+    case SCSIOP_READ12:
+    case SCSIOP_READ16:
+    case SCSIOP_WRITE6:
+    case SCSIOP_WRITE:
+    case SCSIOP_WRITE12:
+    case SCSIOP_WRITE16:
+        KeAcquireSpinLockAtDpcLevel(&Ioq->UnmapSpinLock);
+        if (SpdSrbMapNone == SrbExtension->MapState && 0 != SrbExtension->SystemDataLength &&
+            0 == BYTE_OFFSET(SrbExtension->SystemDataBuffer) &&
+            0 == BYTE_OFFSET(SrbExtension->SystemDataLength))
+        {
+            SrbExtension->MapMdl = IoAllocateMdl(SrbExtension->SystemDataBuffer,
+                SrbExtension->SystemDataLength, FALSE, FALSE, 0);
+            if (0 != SrbExtension->MapMdl)
+            {
+                MmBuildMdlForNonPagedPool(SrbExtension->MapMdl);
+                SrbExtension->MapState = SpdSrbMapPending;
+                Chunk->Mapped = TRUE;
+                MapContext->MapChunk = Chunk;
+            }
+            else
+                SrbExtension->MapState = SpdSrbMapFailed;
+        }
+        else if (SpdSrbMapNone == SrbExtension->MapState)
+            SrbExtension->MapState = SpdSrbMapFailed;
+        else if (SpdSrbMapDone == SrbExtension->MapState &&
+            PsGetCurrentProcess() == SrbExtension->MapProcess)
+        {
+            Chunk->Mapped = TRUE;
+            MapContext->MappedDataBuffer =
+                (PUINT8)SrbExtension->MapAddress + Chunk->ChunkOffset;
+        }
+        KeReleaseSpinLockFromDpcLevel(&Ioq->UnmapSpinLock);
+        break;
+
+    default:
+        break;
+    }
+
+    SpdSrbExecuteScsiPrepareInternal(Chunk, MapContext->Req, DataBuffer);
+}
+
+/* give a completed chunk the next piece of its SRB: PENDING if there is one, else SUCCESS */
+static UCHAR SpdSrbExecuteScsiNextChunk(SPD_SRB_CHUNK *Chunk)
+{
+    SPD_SRB_EXTENSION *SrbExtension = Chunk->SrbExtension;
+
+    /* once a chunk has failed there is no point in handing out more pieces */
+    if (0 == SrbExtension->ChunkSrbStatus &&
+        SpdChunkNext(&SrbExtension->ChunkNextOffset, SrbExtension->SystemDataLength,
+            SrbExtension->StorageUnit->StorageUnitParams.MaxTransferLength, &Chunk->ChunkOffset))
+    {
+        /* the scheduler charges the rate limit by the bytes of the piece */
+        Chunk->QueueEntry.Length = SpdChunkLength(SrbExtension->SystemDataLength,
+            Chunk->ChunkOffset, SrbExtension->StorageUnit->StorageUnitParams.MaxTransferLength);
+        return SRB_STATUS_PENDING;
+    }
+
+    return SRB_STATUS_SUCCESS;
+}
+
+/*
+ * Fan the response of a merged request out to the SRB's that are still in the merge:
+ * read data are scattered to each of them and an error fails all of them. Their status
+ * is set here; SpdIoqSplitNoLock retires them.
+ */
+static UCHAR SpdSrbExecuteScsiCompleteMerged(SPD_SRB_CHUNK *Chunk,
+    SPD_IOCTL_TRANSACT_RSP *Rsp, PVOID DataBuffer)
+{
+    SPD_SRB_EXTENSION *Leader = Chunk->SrbExtension, *Member;
+    SPD_STORAGE_UNIT *StorageUnit = Leader->StorageUnit;
+    SPD_MERGE *Merge = &Leader->Merge;
+    BOOLEAN Read = SpdIoctlTransactReadKind == (Merge->Key & ~SPD_MERGE_KEY_FUA);
+    BOOLEAN ReadCache = 0 != StorageUnit->ReadCache.EntryCount;
+    ULONG ChunkOffset;
+
+    if (ReadCache && !Read)
+        SpdScsiReadCacheInvalidate(StorageUnit, Merge->BlockAddress, Merge->BlockCount);
+
+    for (SPD_MERGE_ENTRY *Entry = Merge->First; 0 != Entry; Entry = Entry->Next)
+    {
+        Member = CONTAINING_RECORD(Entry, SPD_SRB_EXTENSION, MergeEntry);
+
+        if (SCSISTAT_GOOD != Rsp->Status.ScsiStatus)
+        {
+            /* an SRB that has been aborted keeps its status and sense data */
+            if (0 == InterlockedCompareExchange(&Member->ChunkSrbStatus, SRB_STATUS_ERROR, 0))
+                Member->ChunkSrbStatus = SpdScsiErrorEx(Member->Srb,
+                    Rsp->Status.SenseKey,
+                    Rsp->Status.ASC,
+                    Rsp->Status.ASCQ,
+                    Rsp->Status.InformationValid ? &Rsp->Status.Information : 0);
+        }
+        else if (Read)
+        {
+            ChunkOffset = 0;
+            SpdChunkComplete(
+                Member->SystemDataBuffer, Member->SystemDataLength, &ChunkOffset,
+                StorageUnit->StorageUnitParams.MaxTransferLength,
+                TRUE, FALSE,
+                0 != DataBuffer ?
+                    (PUINT8)DataBuffer +
+                        SpdMergeOffset(Merge, Entry, StorageUnit->StorageUnitParams.BlockLength) :
+                    0);
+            if (ReadCache)
+                SpdScsiReadCacheFill(StorageUnit, Member->ReadCacheGeneration,
+                    Entry->BlockAddress, Member->SystemDataLength, Member->SystemDataBuffer);
+        }
+    }
+
+    return SCSISTAT_GOOD == Rsp->Status.ScsiStatus ? SRB_STATUS_SUCCESS : SRB_STATUS_ERROR;
+}
+
+UCHAR SpdSrbExecuteScsiComplete(PVOID Chunk0, PVOID Context, PVOID DataBuffer)
+{
+    ASSERT(DISPATCH_LEVEL == KeGetCurrentIrql());
+
+    SPD_SRB_CHUNK *Chunk = Chunk0;
+    SPD_SRB_EXTENSION *SrbExtension = Chunk->SrbExtension;
     SPD_STORAGE_UNIT *StorageUnit = SrbExtension->StorageUnit;
     SPD_IOCTL_TRANSACT_RSP *Rsp = Context;
     PVOID Srb = SrbExtension->Srb;
+    ULONG ChunkOffset = Chunk->ChunkOffset;
+    UINT64 BlockAddress;
+    UCHAR SrbStatus;
     PCDB Cdb;
-    ULONG ChunkLength;
+
+    if (SrbExtension == SrbExtension->MergeLeader)
+        return SpdSrbExecuteScsiCompleteMerged(Chunk, Rsp, DataBuffer);
+
+    /* even a failed WRITE may have changed the medium */
+    if (0 != StorageUnit->ReadCache.EntryCount)
+        SpdScsiReadCacheInvalidateSrb(SrbExtension);
 
     if (SCSISTAT_GOOD != Rsp->Status.ScsiStatus)
-        return SpdScsiErrorEx(Srb,
+    {
+        /*
+         * Chunks may fail at once: only the first one to fail fills in the sense data
+         * and its status becomes the SRB status; see SpdIoqEndProcessingSrb.
+         */
+        if (0 != InterlockedCompareExchange(&SrbExtension->ChunkSrbStatus, SRB_STATUS_ERROR, 0))
+            return SRB_STATUS_ERROR;
+
+        SrbStatus = SpdScsiErrorEx(Srb,
             Rsp->Status.SenseKey,
             Rsp->Status.ASC,
             Rsp->Status.ASCQ,
             Rsp->Status.InformationValid ? &Rsp->Status.Information : 0);
+        SrbExtension->ChunkSrbStatus = SrbStatus;
+        return SrbStatus;
+    }
 
     Cdb = SrbGetCdb(Srb);
     switch (Cdb->AsByte[0])
@@ -805,31 +1227,31 @@ UCHAR SpdSrbExecuteScsiComplete(PVOID SrbExtension0, PVOID Context, PVOID DataBu
     case SCSIOP_READ:
     case SCSIOP_READ12:
     case SCSIOP_READ16:
-        ChunkLength = SrbExtension->SystemDataLength - SrbExtension->ChunkOffset;
-        if (ChunkLength > StorageUnit->StorageUnitParams.MaxTransferLength)
-            ChunkLength = StorageUnit->StorageUnitParams.MaxTransferLength;
-        if (0 != DataBuffer)
-            RtlCopyMemory((PUINT8)SrbExtension->SystemDataBuffer + SrbExtension->ChunkOffset,
-                DataBuffer, ChunkLength);
-        else
-            RtlZeroMemory((PUINT8)SrbExtension->SystemDataBuffer + SrbExtension->ChunkOffset,
-                ChunkLength);
-        SrbExtension->ChunkOffset += ChunkLength;
-        /* if we are done return SUCCESS; if we have more chunks return PENDING */
-        return SrbExtension->ChunkOffset >= SrbExtension->SystemDataLength ?
-            SRB_STATUS_SUCCESS : SRB_STATUS_PENDING;
+        /* if the SRB has more pieces return PENDING; else return SUCCESS */
+        SpdChunkComplete(
+            SrbExtension->SystemDataBuffer, SrbExtension->SystemDataLength, &ChunkOffset,
+            StorageUnit->StorageUnitParams.MaxTransferLength,
+            TRUE, Chunk->Mapped, DataBuffer);
+        if (0 != StorageUnit->ReadCache.EntryCount)
+        {
+            SpdCdbGetRange(Cdb, &BlockAddress, 0, 0);
+            SpdScsiReadCacheFill(StorageUnit, SrbExtension->ReadCacheGeneration,
+                BlockAddress + Chunk->ChunkOffset / StorageUnit->StorageUnitParams.BlockLength,
+                ChunkOffset - Chunk->ChunkOffset,
+                (PUINT8)SrbExtension->SystemDataBuffer + Chunk->ChunkOffset);
+        }
+        return SpdSrbExecuteScsiNextChunk(Chunk);
 
     case SCSIOP_WRITE6:
     case SCSIOP_WRITE:
     case SCSIOP_WRITE12:
     case SCSIOP_WRITE16:
-        ChunkLength = SrbExtension->SystemDataLength - SrbExtension->ChunkOffset;
-        if (ChunkLength > StorageUnit->StorageUnitParams.MaxTransferLength)
-            ChunkLength = StorageUnit->StorageUnitParams.MaxTransferLength;
-        SrbExtension->ChunkOffset += ChunkLength;
-        /* if we are done return SUCCESS; if we have more chunks return PENDING */
-        return SrbExtension->ChunkOffset >= SrbExtension->SystemDataLength ?
-            SRB_STATUS_SUCCESS : SRB_STATUS_PENDING;
+        /* if the SRB has more pieces return PENDING; else return SUCCESS */
+        SpdChunkComplete(
+            SrbExtension->SystemDataBuffer, SrbExtension->SystemDataLength, &ChunkOffset,
+            StorageUnit->StorageUnitParams.MaxTransferLength,
+            FALSE, Chunk->Mapped, DataBuffer);
+        return SpdSrbExecuteScsiNextChunk(Chunk);
 
     case SCSIOP_SYNCHRONIZE_CACHE:
     case SCSIOP_SYNCHRONIZE_CACHE16:
@@ -970,3 +1392,22 @@ static VOID SpdCdbGetRange(PCDB Cdb,
         break;
     }
 }
+
+static VOID SpdUnmapDescriptorGetRange(PUNMAP_BLOCK_DESCRIPTOR Descriptor,
+    PUINT64 POffset, PUINT32 PLength)
+{
+    *POffset =
+        ((UINT64)Descriptor->StartingLba[0] << 56) |
+        ((UINT64)Descriptor->StartingLba[1] << 48) |
+        ((UINT64)Descriptor->StartingLba[2] << 40) |
+        ((UINT64)Descriptor->StartingLba[3] << 32) |
+        ((UINT64)Descriptor->StartingLba[4] << 24) |
+        ((UINT64)Descriptor->StartingLba[5] << 16) |
+        ((UINT64)Descriptor->StartingLba[6] << 8) |
+        ((UINT64)Descriptor->StartingLba[7]);
+    *PLength =
+        ((UINT32)Descriptor->LbaCount[0] << 24) |
+        ((UINT32)Descriptor->LbaCount[1] << 16) |
+        ((UINT32)Descriptor->LbaCount[2] << 8) |
+        ((UINT32)Descriptor->LbaCount[3]);
+}
@@ -32,6 +32,9 @@ NTSTATUS SpdDeviceExtensionInit(SPD_DEVICE_EXTENSION *DeviceExtension, PVOID Bus
     ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
     ASSERT(0 != DeviceExtension);
 
+    SPD_EPOCH_SLOT *EpochSlots = 0;
+    ULONG EpochSlotCount, EpochSize;
+    SPD_UNIT_TABLE *StorageUnits = 0;
     NTSTATUS Result;
 
     KeEnterCriticalRegion();
@@ -44,6 +47,23 @@ NTSTATUS SpdDeviceExtensionInit(SPD_DEVICE_EXTENSION *DeviceExtension, PVOID Bus
         goto exit;
     }
 
+    /* one slot per possible processor; whole pages keep the slots cache aligned */
+    EpochSlotCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    EpochSize = (EpochSlotCount * sizeof(SPD_EPOCH_SLOT) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    EpochSlots = SpdAllocNonPaged(EpochSize, SpdTagEpoch);
+    if (0 == EpochSlots)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    StorageUnits = SpdAllocNonPaged(SpdUnitTableSize(SpdStorageUnitCapacity), SpdTagUnitTable);
+    if (0 == StorageUnits)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
     Result = PsSetCreateProcessNotifyRoutine(SpdDeviceExtensionNotifyRoutine, FALSE);
     if (!NT_SUCCESS(Result))
         goto exit;
@@ -51,11 +71,22 @@ NTSTATUS SpdDeviceExtensionInit(SPD_DEVICE_EXTENSION *DeviceExtension, PVOID Bus
     KeInitializeSpinLock(&DeviceExtension->SpinLock);
     DeviceExtension->DeviceObject = BusInformation;
     DeviceExtension->StorageUnitCapacity = SpdStorageUnitCapacity;
+    SpdEpochInitialize(&DeviceExtension->Epoch, EpochSlots, EpochSlotCount);
+    EpochSlots = 0;
+    SpdUnitTableInitialize(StorageUnits, SpdStorageUnitCapacity);
+    DeviceExtension->StorageUnits = StorageUnits;
+    StorageUnits = 0;
     SpdGlobalDeviceExtension = DeviceExtension;
 
     Result = STATUS_SUCCESS;
 
 exit:
+    if (0 != StorageUnits)
+        SpdFree(StorageUnits, SpdTagUnitTable);
+
+    if (0 != EpochSlots)
+        SpdFree(EpochSlots, SpdTagEpoch);
+
     ExReleaseResourceLite(&SpdGlobalDeviceResource);
     KeLeaveCriticalRegion();
 
@@ -73,6 +104,10 @@ VOID SpdDeviceExtensionFini(SPD_DEVICE_EXTENSION *DeviceExtension)
     if (DeviceExtension == SpdGlobalDeviceExtension)
     {
         PsSetCreateProcessNotifyRoutine(SpdDeviceExtensionNotifyRoutine, TRUE);
+        SpdFree(DeviceExtension->StorageUnits, SpdTagUnitTable);
+        DeviceExtension->StorageUnits = 0;
+        SpdFree(DeviceExtension->Epoch.Slots, SpdTagEpoch);
+        DeviceExtension->Epoch.Slots = 0;
         SpdGlobalDeviceExtension = 0;
     }
 
@@ -88,22 +123,24 @@ static VOID SpdDeviceExtensionNotifyRoutine(HANDLE ParentId, HANDLE ProcessId0,
         return;
 
     ULONG ProcessId = (ULONG)(UINT_PTR)ProcessId0;
-    UINT8 Bitmap[32];
-    ULONG Count;
+    SPD_STORAGE_UNIT *StorageUnit;
+    BOOLEAN Owned;
 
     KeEnterCriticalRegion();
     ExAcquireResourceSharedLite(&SpdGlobalDeviceResource, TRUE);
 
     ASSERT(0 != SpdGlobalDeviceExtension);
 
-    Count = SpdStorageUnitGetUseBitmap(SpdGlobalDeviceExtension, &ProcessId, Bitmap);
+    for (ULONG Index = 0;
+        0 != (StorageUnit = SpdStorageUnitReferenceNext(SpdGlobalDeviceExtension, &Index));)
+    {
+        Owned = ProcessId == StorageUnit->OwnerProcessId;
+        SpdStorageUnitDereference(SpdGlobalDeviceExtension, StorageUnit);
 
-    for (ULONG I = 0; 0 < Count && sizeof Bitmap * 8 > I; I++)
-        if (FlagOn(Bitmap[I >> 3], 1 << (I & 7)))
-        {
-            SpdStorageUnitUnprovision(SpdGlobalDeviceExtension, 0, I, ProcessId);
-            Count--;
-        }
+        /* Index is now past the unit */
+        if (Owned)
+            SpdStorageUnitUnprovision(SpdGlobalDeviceExtension, 0, Index - 1, ProcessId);
+    }
 
     ExReleaseResourceLite(&SpdGlobalDeviceResource);
     KeLeaveCriticalRegion();
@@ -139,8 +176,8 @@ NTSTATUS SpdStorageUnitProvision(
     NTSTATUS Result;
     CHAR SerialNumber[RTL_FIELD_SIZE(SPD_STORAGE_UNIT, SerialNumber) + 1];
     SPD_STORAGE_UNIT *StorageUnit = 0;
-    SPD_STORAGE_UNIT *DuplicateUnit;
-    UINT32 Btl;
+    PVOID ReadCacheBuffer;
+    BOOLEAN Duplicate, Inserted;
     KIRQL Irql;
 
     *PBtl = (UINT32)-1;
@@ -154,6 +191,8 @@ NTSTATUS SpdStorageUnitProvision(
 
     RtlZeroMemory(StorageUnit, sizeof *StorageUnit);
     StorageUnit->RefCount = 1;
+    KeInitializeSpinLock(&StorageUnit->BufferSpinLock);
+    KeInitializeSpinLock(&StorageUnit->ReadCacheSpinLock);
     RtlCopyMemory(&StorageUnit->StorageUnitParams, StorageUnitParams,
         sizeof *StorageUnitParams);
     /* "left align" ProductId except that we allow all-NUL for testing */
@@ -197,39 +236,53 @@ NTSTATUS SpdStorageUnitProvision(
     if (!NT_SUCCESS(Result))
         goto exit;
 
-    KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
-    DuplicateUnit = 0;
-    Btl = (UINT32)-1;
-    for (ULONG I = 0; DeviceExtension->StorageUnitCapacity > I; I++)
+    StorageUnit->UnmapWorkItem = IoAllocateWorkItem(DeviceExtension->DeviceObject);
+    if (0 == StorageUnit->UnmapWorkItem)
     {
-        SPD_STORAGE_UNIT *Unit = DeviceExtension->StorageUnits[I];
-        if (0 == Unit)
-        {
-            if ((UINT32)-1 == Btl)
-                Btl = SPD_BTL_FROM_INDEX(I);
-            continue;
-        }
-
-        if (RtlEqualMemory(&StorageUnit->StorageUnitParams.Guid, &Unit->StorageUnitParams.Guid,
-            sizeof Unit->StorageUnitParams.Guid))
-        {
-            DuplicateUnit = Unit;
-            break;
-        }
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
     }
-    if (0 == DuplicateUnit && -1 != Btl)
+    SpdMqSetScheduler(&StorageUnit->Ioq->Mq,
+        (UINT8)StorageUnit->StorageUnitParams.SchedPolicy,
+        StorageUnit->StorageUnitParams.MaxIops,
+        StorageUnit->StorageUnitParams.MaxBandwidth);
+    SpdSpinWaitInitialize(&StorageUnit->Ioq->SpinWait,
+        StorageUnit->StorageUnitParams.SpinBudget * 10);
+
+    if (0 != StorageUnit->StorageUnitParams.ReadCacheBlockCount)
     {
-        DeviceExtension->StorageUnits[SPD_INDEX_FROM_BTL(Btl)] = StorageUnit;
-        DeviceExtension->StorageUnitCount++;
+        /* SpdIoctlProvision has bounded the size by SPD_IOCTL_READ_CACHE_SIZE_MAX */
+        ReadCacheBuffer = SpdAllocNonPaged(
+            (SIZE_T)SpdBcacheBufferSize(
+                StorageUnit->StorageUnitParams.ReadCacheBlockCount,
+                StorageUnit->StorageUnitParams.BlockLength),
+            SpdTagReadCache);
+        if (0 == ReadCacheBuffer)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+        SpdBcacheInitialize(&StorageUnit->ReadCache, ReadCacheBuffer,
+            StorageUnit->StorageUnitParams.ReadCacheBlockCount,
+            StorageUnit->StorageUnitParams.BlockLength);
     }
+
+    RtlCopyMemory(&StorageUnit->TableEntry.Guid, &StorageUnit->StorageUnitParams.Guid,
+        sizeof StorageUnit->TableEntry.Guid);
+
+    KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
+    Duplicate = 0 != SpdUnitTableLookupGuid(DeviceExtension->StorageUnits,
+        &StorageUnit->TableEntry.Guid);
+    Inserted = !Duplicate &&
+        SpdUnitTableInsert(DeviceExtension->StorageUnits, &StorageUnit->TableEntry);
     KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
 
-    if (0 != DuplicateUnit)
+    if (Duplicate)
     {
         Result = STATUS_OBJECT_NAME_COLLISION;
         goto exit;
     }
-    if (-1 == Btl)
+    if (!Inserted)
     {
         Result = STATUS_CANNOT_MAKE;
         goto exit;
@@ -237,22 +290,29 @@ NTSTATUS SpdStorageUnitProvision(
 
     StorPortNotification(BusChangeDetected, DeviceExtension, (UCHAR)0);
 
-    *PBtl = Btl;
+    *PBtl = SPD_BTL_FROM_INDEX(DeviceExtension, StorageUnit->TableEntry.Index);
     Result = STATUS_SUCCESS;
 
 exit:
-    if (!NT_SUCCESS(Result))
+    if (!NT_SUCCESS(Result) && 0 != StorageUnit)
     {
         if (0 != StorageUnit->Ioq)
             SpdIoqDelete(StorageUnit->Ioq);
 
-        if (0 != StorageUnit)
-            SpdFree(StorageUnit, SpdTagStorageUnit);
+        if (0 != StorageUnit->UnmapWorkItem)
+            IoFreeWorkItem(StorageUnit->UnmapWorkItem);
+
+        if (0 != StorageUnit->ReadCache.Data)
+            SpdFree(StorageUnit->ReadCache.Data, SpdTagReadCache);
+
+        SpdFree(StorageUnit, SpdTagStorageUnit);
     }
 
     return Result;
 }
 
+static VOID SpdStorageUnitUnregisterAllBuffers(SPD_STORAGE_UNIT *StorageUnit);
+
 NTSTATUS SpdStorageUnitUnprovision(
     SPD_DEVICE_EXTENSION *DeviceExtension,
     PGUID Guid, ULONG Index,
@@ -262,38 +322,17 @@ NTSTATUS SpdStorageUnitUnprovision(
     ASSERT(0 != DeviceExtension);
 
     NTSTATUS Result;
+    SPD_UNIT_TABLE_ENTRY *Entry;
     SPD_STORAGE_UNIT *StorageUnit;
     KIRQL Irql;
 
     KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
-    StorageUnit = 0;
-    if (0 != Guid)
-    {
-        for (ULONG I = 0; DeviceExtension->StorageUnitCapacity > I; I++)
-        {
-            SPD_STORAGE_UNIT *Unit = DeviceExtension->StorageUnits[I];
-            if (0 == Unit)
-                continue;
-
-            if (RtlEqualMemory(Guid, &Unit->StorageUnitParams.Guid,
-                sizeof Unit->StorageUnitParams.Guid))
-            {
-                StorageUnit = Unit;
-                Index = I;
-                break;
-            }
-        }
-    }
-    else
-    {
-        if (DeviceExtension->StorageUnitCapacity > Index)
-            StorageUnit = DeviceExtension->StorageUnits[Index];
-    }
+    Entry = 0 != Guid ?
+        SpdUnitTableLookupGuid(DeviceExtension->StorageUnits, Guid) :
+        SpdUnitTableLookup(DeviceExtension->StorageUnits, Index);
+    StorageUnit = 0 != Entry ? CONTAINING_RECORD(Entry, SPD_STORAGE_UNIT, TableEntry) : 0;
     if (0 != StorageUnit && ProcessId == StorageUnit->OwnerProcessId)
-    {
-        DeviceExtension->StorageUnitCount--;
-        DeviceExtension->StorageUnits[Index] = 0;
-    }
+        SpdUnitTableRemove(DeviceExtension->StorageUnits, Entry);
     KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
 
     if (0 == StorageUnit)
@@ -307,8 +346,13 @@ NTSTATUS SpdStorageUnitUnprovision(
         goto exit;
     }
 
-    /* stop the ioq and dereference the storage unit */
+    /* wait for lock-free lookups that may have found the unit before it was removed */
+    SpdEpochSynchronize(&DeviceExtension->Epoch);
+
+    /* stop the ioq, unmap zero-copy SRB's, release registered buffers and dereference the storage unit */
     SpdIoqReset(StorageUnit->Ioq, TRUE);
+    SpdIoqUnmapSrbs(StorageUnit->Ioq);
+    SpdStorageUnitUnregisterAllBuffers(StorageUnit);
     SpdStorageUnitDereference(DeviceExtension, StorageUnit);
 
     StorPortNotification(BusChangeDetected, DeviceExtension, (UCHAR)0);
@@ -323,22 +367,29 @@ SPD_STORAGE_UNIT *SpdStorageUnitReferenceByBtl(
     SPD_DEVICE_EXTENSION *DeviceExtension,
     UINT32 Btl)
 {
+    SPD_UNIT_TABLE_ENTRY *Entry;
     SPD_STORAGE_UNIT *StorageUnit;
-    UINT8 B, T, L;
+    ULONG Index, Slot;
     KIRQL Irql;
 
-    B = SPD_IOCTL_BTL_B(Btl);
-    T = SPD_IOCTL_BTL_T(Btl);
-    L = SPD_IOCTL_BTL_L(Btl);
-
-    if (0 != B || 0 != L)
+    Index = SPD_INDEX_FROM_BTL(DeviceExtension, Btl);
+    if ((ULONG)-1 == Index)
         return 0;
 
-    KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
-    StorageUnit = DeviceExtension->StorageUnitCapacity > T ? DeviceExtension->StorageUnits[T] : 0;
+    /*
+     * This is the SRB and transact hot path, so it does not take the adapter spin lock.
+     * A published unit holds a reference until SpdStorageUnitUnprovision removes it and
+     * waits for the epoch; so a unit found inside the epoch can be safely referenced.
+     */
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    Slot = KeGetCurrentProcessorNumberEx(0);
+    SpdEpochEnter(&DeviceExtension->Epoch, Slot);
+    Entry = SpdUnitTableLookup(DeviceExtension->StorageUnits, Index);
+    StorageUnit = 0 != Entry ? CONTAINING_RECORD(Entry, SPD_STORAGE_UNIT, TableEntry) : 0;
     if (0 != StorageUnit)
-        StorageUnit->RefCount++;
-    KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
+        InterlockedIncrement(&StorageUnit->RefCount);
+    SpdEpochLeave(&DeviceExtension->Epoch, Slot);
+    KeLowerIrql(Irql);
 
     return StorageUnit;
 }
@@ -347,16 +398,15 @@ static SPD_STORAGE_UNIT *SpdStorageUnitReferenceByDevice(
     SPD_DEVICE_EXTENSION *DeviceExtension,
     PDEVICE_OBJECT DeviceObject)
 {
+    SPD_UNIT_TABLE *Table = DeviceExtension->StorageUnits;
     SPD_STORAGE_UNIT *StorageUnit;
     KIRQL Irql;
 
     KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
     StorageUnit = 0;
-    for (ULONG I = 0; DeviceExtension->StorageUnitCapacity > I; I++)
+    for (ULONG I = SpdUnitTableNext(Table, 0); Table->Capacity > I; I = SpdUnitTableNext(Table, I + 1))
     {
-        SPD_STORAGE_UNIT *Unit = DeviceExtension->StorageUnits[I];
-        if (0 == Unit)
-            continue;
+        SPD_STORAGE_UNIT *Unit = CONTAINING_RECORD(Table->Entries[I], SPD_STORAGE_UNIT, TableEntry);
 
         if (DeviceObject == Unit->DeviceObject)
         {
@@ -365,7 +415,7 @@ static SPD_STORAGE_UNIT *SpdStorageUnitReferenceByDevice(
         }
     }
     if (0 != StorageUnit)
-        StorageUnit->RefCount++;
+        InterlockedIncrement(&StorageUnit->RefCount);
     KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
 
     return StorageUnit;
@@ -375,40 +425,283 @@ VOID SpdStorageUnitDereference(
     SPD_DEVICE_EXTENSION *DeviceExtension,
     SPD_STORAGE_UNIT *StorageUnit)
 {
-    BOOLEAN Delete;
+    if (0 == InterlockedDecrement(&StorageUnit->RefCount))
+    {
+        SpdStorageUnitUnregisterAllBuffers(StorageUnit);
+        SpdIoqDelete(StorageUnit->Ioq);
+        IoFreeWorkItem(StorageUnit->UnmapWorkItem);
+        if (0 != StorageUnit->ReadCache.Data)
+        {
+            DEBUGLOG("%p, ReadCache: Hit=%llu, Miss=%llu, Fill=%llu, Evict=%llu, Invalidate=%llu",
+                StorageUnit,
+                StorageUnit->ReadCache.HitCount, StorageUnit->ReadCache.MissCount,
+                StorageUnit->ReadCache.FillCount, StorageUnit->ReadCache.EvictCount,
+                StorageUnit->ReadCache.InvalidateCount);
+            SpdFree(StorageUnit->ReadCache.Data, SpdTagReadCache);
+        }
+        SpdFree(StorageUnit, SpdTagStorageUnit);
+    }
+}
+
+/*
+ * Unmap and complete the zero-copy SRB's that a reset or cancel has parked in the I/O
+ * queue's UnmapList (see SpdIoqCompleteSrbNoLock). A transact drains the list when it
+ * is done, but after a reset or cancel there may never be another transact. Unmapping
+ * requires PASSIVE_LEVEL, so at higher IRQL (e.g. in HwResetBus) we queue a work item,
+ * which holds a reference to the storage unit until it has drained the list.
+ */
+static IO_WORKITEM_ROUTINE SpdStorageUnitUnmapWorkItem;
+static VOID SpdStorageUnitUnmapWorkItem(PDEVICE_OBJECT DeviceObject, PVOID Context)
+{
+    SPD_STORAGE_UNIT *StorageUnit = Context;
+    LONG Count;
+
+    /* callers that asked while we were draining are covered by another round */
+    do
+    {
+        Count = StorageUnit->UnmapWorkCount;
+        SpdIoqUnmapSrbs(StorageUnit->Ioq);
+    } while (0 != InterlockedAdd(&StorageUnit->UnmapWorkCount, -Count));
+
+    SpdStorageUnitDereference(StorageUnit->Ioq->DeviceExtension, StorageUnit);
+}
+
+VOID SpdStorageUnitUnmapSrbs(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    SPD_STORAGE_UNIT *StorageUnit)
+{
+    if (!SpdIoqUnmapPending(StorageUnit->Ioq))
+        return;
+
+    if (PASSIVE_LEVEL == KeGetCurrentIrql())
+        SpdIoqUnmapSrbs(StorageUnit->Ioq);
+    else if (1 == InterlockedIncrement(&StorageUnit->UnmapWorkCount))
+    {
+        InterlockedIncrement(&StorageUnit->RefCount);
+        IoQueueWorkItem(StorageUnit->UnmapWorkItem,
+            SpdStorageUnitUnmapWorkItem, DelayedWorkQueue, StorageUnit);
+    }
+}
+
+static VOID SpdRegisteredBufferFree(PMDL Mdl)
+{
+    if (FlagOn(Mdl->MdlFlags, MDL_PAGES_LOCKED))
+        MmUnlockPages(Mdl);
+    IoFreeMdl(Mdl);
+}
+
+NTSTATUS SpdStorageUnitRegisterBuffer(
+    SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer, ULONG Length,
+    PUINT32 PIndex)
+{
+    ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+
+    SPD_REGISTERED_BUFFER *RegisteredBuffer;
+    PMDL Mdl = 0;
+    PVOID SystemAddress = 0;
+    UINT32 Index;
     KIRQL Irql;
+    NTSTATUS Result;
 
-    KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
-    StorageUnit->RefCount--;
-    Delete = 0 == StorageUnit->RefCount;
-    KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
+    *PIndex = (UINT32)-1;
+
+    if (0 == Buffer || 0 == Length)
+        return STATUS_INVALID_PARAMETER;
 
-    if (Delete)
+    /* the MDL is owned by the storage unit; it lives until unregistered or unprovisioned */
+    try
     {
-        SpdIoqDelete(StorageUnit->Ioq);
-        SpdFree(StorageUnit, SpdTagStorageUnit);
+        ProbeForWrite(Buffer, Length, 1);
+
+        Mdl = IoAllocateMdl(Buffer, Length, FALSE, FALSE, 0);
+        if (0 == Mdl)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            leave;
+        }
+
+        MmProbeAndLockPages(Mdl, UserMode, IoWriteAccess);
+
+        SystemAddress = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+        if (0 == SystemAddress)
+        {
+            Result = STATUS_INSUFFICIENT_RESOURCES;
+            leave;
+        }
+
+        Result = STATUS_SUCCESS;
+    }
+    except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        Result = GetExceptionCode();
+    }
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Result = STATUS_INSUFFICIENT_RESOURCES;
+    KeAcquireSpinLock(&StorageUnit->BufferSpinLock, &Irql);
+    if (StorageUnit->BuffersStopped)
+        Result = STATUS_CANCELLED;
+    else
+        for (Index = 0; SPD_IOCTL_REGISTERED_BUFFER_MAX > Index; Index++)
+        {
+            RegisteredBuffer = &StorageUnit->Buffers[Index];
+            if (0 == RegisteredBuffer->Mdl)
+            {
+                RegisteredBuffer->Mdl = Mdl;
+                RegisteredBuffer->SystemAddress = SystemAddress;
+                RegisteredBuffer->Length = Length;
+                RegisteredBuffer->RefCount = 1;
+                RegisteredBuffer->Registered = TRUE;
+                Mdl = 0;
+
+                *PIndex = Index;
+                Result = STATUS_SUCCESS;
+                break;
+            }
+        }
+    KeReleaseSpinLock(&StorageUnit->BufferSpinLock, Irql);
+
+exit:
+    if (0 != Mdl)
+        SpdRegisteredBufferFree(Mdl);
+
+    return Result;
+}
+
+NTSTATUS SpdStorageUnitUnregisterBuffer(
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT32 Index)
+{
+    SPD_REGISTERED_BUFFER *RegisteredBuffer;
+    PMDL Mdl = 0;
+    KIRQL Irql;
+    NTSTATUS Result;
+
+    if (SPD_IOCTL_REGISTERED_BUFFER_MAX <= Index)
+        return STATUS_INVALID_PARAMETER;
+
+    Result = STATUS_INVALID_PARAMETER;
+    KeAcquireSpinLock(&StorageUnit->BufferSpinLock, &Irql);
+    RegisteredBuffer = &StorageUnit->Buffers[Index];
+    if (RegisteredBuffer->Registered)
+    {
+        RegisteredBuffer->Registered = FALSE;
+        if (0 == --RegisteredBuffer->RefCount)
+        {
+            Mdl = RegisteredBuffer->Mdl;
+            RegisteredBuffer->Mdl = 0;
+        }
+        Result = STATUS_SUCCESS;
     }
+    KeReleaseSpinLock(&StorageUnit->BufferSpinLock, Irql);
+
+    if (0 != Mdl)
+        SpdRegisteredBufferFree(Mdl);
+
+    return Result;
+}
+
+static VOID SpdStorageUnitUnregisterAllBuffers(SPD_STORAGE_UNIT *StorageUnit)
+{
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&StorageUnit->BufferSpinLock, &Irql);
+    StorageUnit->BuffersStopped = TRUE;
+    KeReleaseSpinLock(&StorageUnit->BufferSpinLock, Irql);
+
+    for (UINT32 Index = 0; SPD_IOCTL_REGISTERED_BUFFER_MAX > Index; Index++)
+        SpdStorageUnitUnregisterBuffer(StorageUnit, Index);
+}
+
+PVOID SpdStorageUnitReferenceBuffer(
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT32 Index, ULONG Length)
+{
+    SPD_REGISTERED_BUFFER *RegisteredBuffer;
+    PVOID SystemAddress = 0;
+    KIRQL Irql;
+
+    if (SPD_IOCTL_REGISTERED_BUFFER_MAX <= Index)
+        return 0;
+
+    KeAcquireSpinLock(&StorageUnit->BufferSpinLock, &Irql);
+    RegisteredBuffer = &StorageUnit->Buffers[Index];
+    if (RegisteredBuffer->Registered && Length <= RegisteredBuffer->Length)
+    {
+        RegisteredBuffer->RefCount++;
+        SystemAddress = RegisteredBuffer->SystemAddress;
+    }
+    KeReleaseSpinLock(&StorageUnit->BufferSpinLock, Irql);
+
+    return SystemAddress;
+}
+
+VOID SpdStorageUnitDereferenceBuffer(
+    SPD_STORAGE_UNIT *StorageUnit,
+    UINT32 Index)
+{
+    SPD_REGISTERED_BUFFER *RegisteredBuffer;
+    PMDL Mdl = 0;
+    KIRQL Irql;
+
+    ASSERT(SPD_IOCTL_REGISTERED_BUFFER_MAX > Index);
+
+    KeAcquireSpinLock(&StorageUnit->BufferSpinLock, &Irql);
+    RegisteredBuffer = &StorageUnit->Buffers[Index];
+    ASSERT(0 < RegisteredBuffer->RefCount);
+    if (0 == --RegisteredBuffer->RefCount)
+    {
+        Mdl = RegisteredBuffer->Mdl;
+        RegisteredBuffer->Mdl = 0;
+    }
+    KeReleaseSpinLock(&StorageUnit->BufferSpinLock, Irql);
+
+    if (0 != Mdl)
+        SpdRegisteredBufferFree(Mdl);
 }
 
-ULONG SpdStorageUnitGetUseBitmap(
+SPD_STORAGE_UNIT *SpdStorageUnitReferenceNext(
+    SPD_DEVICE_EXTENSION *DeviceExtension,
+    PULONG PIndex)
+{
+    SPD_UNIT_TABLE *Table = DeviceExtension->StorageUnits;
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+    ULONG Index;
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
+    Index = SpdUnitTableNext(Table, *PIndex);
+    if (Table->Capacity > Index)
+    {
+        StorageUnit = CONTAINING_RECORD(Table->Entries[Index], SPD_STORAGE_UNIT, TableEntry);
+        InterlockedIncrement(&StorageUnit->RefCount);
+        Index++;
+    }
+    *PIndex = Index;
+    KeReleaseSpinLock(&DeviceExtension->SpinLock, Irql);
+
+    return StorageUnit;
+}
+
+ULONG SpdStorageUnitGetList(
     SPD_DEVICE_EXTENSION *DeviceExtension,
     PULONG PProcessId,
-    UINT8 Bitmap[32])
+    PUINT32 BtlBuf, ULONG BtlCount)
 {
+    SPD_UNIT_TABLE *Table = DeviceExtension->StorageUnits;
     ULONG Count = 0;
     KIRQL Irql;
 
-    RtlZeroMemory(Bitmap, 32);
-
     KeAcquireSpinLock(&DeviceExtension->SpinLock, &Irql);
-    for (ULONG I = 0;
-        DeviceExtension->StorageUnitCount > Count && DeviceExtension->StorageUnitCapacity > I;
-        I++)
+    for (ULONG I = SpdUnitTableNext(Table, 0); Table->Capacity > I; I = SpdUnitTableNext(Table, I + 1))
     {
-        SPD_STORAGE_UNIT *Unit = DeviceExtension->StorageUnits[I];
-        if (0 != Unit && (0 == PProcessId || *PProcessId == Unit->OwnerProcessId))
+        SPD_STORAGE_UNIT *Unit = CONTAINING_RECORD(Table->Entries[I], SPD_STORAGE_UNIT, TableEntry);
+        if (0 == PProcessId || *PProcessId == Unit->OwnerProcessId)
         {
-            SetFlag(Bitmap[I >> 3], 1 << (I & 7));
+            if (BtlCount > Count)
+                BtlBuf[Count] = SPD_BTL_FROM_INDEX(DeviceExtension, I);
             Count++;
         }
     }
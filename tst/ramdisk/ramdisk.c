@@ -0,0 +1,443 @@
+/**
+ * @file ramdisk.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winspd/winspd.h>
+#include "ramstore.h"
+
+#define info(format, ...)               \
+    SpdServiceLog(EVENTLOG_INFORMATION_TYPE, format, __VA_ARGS__)
+#define warn(format, ...)               \
+    SpdServiceLog(EVENTLOG_WARNING_TYPE, format, __VA_ARGS__)
+#define fail(ExitCode, format, ...)     \
+    (SpdServiceLog(EVENTLOG_ERROR_TYPE, format, __VA_ARGS__), ExitProcess(ExitCode))
+
+#define WARNONCE(expr)                  \
+    do                                  \
+    {                                   \
+        static LONG Once;               \
+        if (!(expr) &&                  \
+            0 == InterlockedCompareExchange(&Once, 1, 0))\
+            warn(L"WARNONCE(%S) failed at %S:%d", #expr, __func__, __LINE__);\
+    } while (0,0)
+
+#define RAMDISK_MAX_TRANSFER_LENGTH     (256 * 1024)
+#define RAMDISK_BATCH_SIZE              16      /* requests are cheap: amortize the transacts */
+
+typedef struct _RAMDISK
+{
+    SPD_STORAGE_UNIT *StorageUnit;
+    RAMSTORE *Store;
+    UINT32 BlockLength;
+} RAMDISK;
+
+static BOOLEAN Read(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN FlushFlag,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    RAMDISK *RamDisk = StorageUnit->UserContext;
+
+    if (!RamStoreRead(RamDisk->Store,
+        Buffer, BlockAddress * RamDisk->BlockLength, (UINT64)BlockCount * RamDisk->BlockLength))
+        SpdStorageUnitStatusSetSense(Status,
+            SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_BLOCK, 0);
+
+    return TRUE;
+}
+
+static BOOLEAN Write(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN FlushFlag,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    WARNONCE(!StorageUnit->StorageUnitParams.WriteProtected);
+
+    RAMDISK *RamDisk = StorageUnit->UserContext;
+
+    /* the only way that a write within the storage unit fails is that we ran out of memory */
+    if (!RamStoreWrite(RamDisk->Store,
+        Buffer, BlockAddress * RamDisk->BlockLength, (UINT64)BlockCount * RamDisk->BlockLength))
+        SpdStorageUnitStatusSetSense(Status,
+            SCSI_SENSE_MEDIUM_ERROR, SCSI_ADSENSE_WRITE_ERROR, 0);
+
+    return TRUE;
+}
+
+static BOOLEAN Flush(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT32 BlockCount,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    WARNONCE(!StorageUnit->StorageUnitParams.WriteProtected);
+
+    /* written data are as durable as they will ever be */
+    return TRUE;
+}
+
+static BOOLEAN Unmap(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_UNMAP_DESCRIPTOR Descriptors[], UINT32 Count,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    WARNONCE(!StorageUnit->StorageUnitParams.WriteProtected);
+    WARNONCE(StorageUnit->StorageUnitParams.UnmapSupported);
+
+    RAMDISK *RamDisk = StorageUnit->UserContext;
+
+    for (UINT32 I = 0; Count > I; I++)
+        RamStoreUnmap(RamDisk->Store,
+            Descriptors[I].BlockAddress * RamDisk->BlockLength,
+            (UINT64)Descriptors[I].BlockCount * RamDisk->BlockLength);
+
+    return TRUE;
+}
+
+static SPD_STORAGE_UNIT_INTERFACE RamDiskInterface =
+{
+    Read,
+    Write,
+    Flush,
+    Unmap,
+};
+
+static BOOLEAN EnableLockMemoryPrivilege(VOID)
+{
+    HANDLE Token;
+    TOKEN_PRIVILEGES Privileges;
+    BOOL Success;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &Token))
+        return FALSE;
+
+    Privileges.PrivilegeCount = 1;
+    Privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+    /* AdjustTokenPrivileges succeeds with ERROR_NOT_ALL_ASSIGNED if we do not hold it */
+    Success =
+        LookupPrivilegeValueW(0, SE_LOCK_MEMORY_NAME, &Privileges.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(Token, FALSE, &Privileges, 0, 0, 0) &&
+        ERROR_SUCCESS == GetLastError();
+
+    CloseHandle(Token);
+
+    return Success;
+}
+
+DWORD RamDiskCreate(
+    UINT64 BlockCount, UINT32 BlockLength,
+    PWSTR ProductId, PWSTR ProductRevision,
+    BOOLEAN WriteProtected,
+    BOOLEAN UnmapSupported,
+    BOOLEAN LargePages,
+    PWSTR PipeName,
+    RAMDISK **PRamDisk)
+{
+    RAMDISK *RamDisk = 0;
+    SPD_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+    SIZE_T LargePageMinimum;
+    DWORD Error;
+
+    *PRamDisk = 0;
+
+    if (0 == BlockCount || 0 == BlockLength || (UINT64)-1 / BlockLength < BlockCount)
+    {
+        Error = ERROR_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    UuidCreate(&StorageUnitParams.Guid);
+    StorageUnitParams.BlockCount = BlockCount;
+    StorageUnitParams.BlockLength = BlockLength;
+    StorageUnitParams.MaxTransferLength = RAMDISK_MAX_TRANSFER_LENGTH;
+    if (0 == WideCharToMultiByte(CP_UTF8, 0,
+        ProductId, lstrlenW(ProductId),
+        StorageUnitParams.ProductId, sizeof StorageUnitParams.ProductId,
+        0, 0))
+    {
+        Error = ERROR_INVALID_PARAMETER;
+        goto exit;
+    }
+    if (0 == WideCharToMultiByte(CP_UTF8, 0,
+        ProductRevision, lstrlenW(ProductRevision),
+        StorageUnitParams.ProductRevisionLevel, sizeof StorageUnitParams.ProductRevisionLevel,
+        0, 0))
+    {
+        Error = ERROR_INVALID_PARAMETER;
+        goto exit;
+    }
+    StorageUnitParams.WriteProtected = WriteProtected;
+    StorageUnitParams.CacheSupported = TRUE;
+    StorageUnitParams.UnmapSupported = UnmapSupported;
+    /* memory is freed a chunk at a time; smaller UNMAP's only write zeroes */
+    StorageUnitParams.UnmapGranularity = RAMSTORE_CHUNK_LENGTH > BlockLength ?
+        (UINT32)(RAMSTORE_CHUNK_LENGTH / BlockLength) : 1;
+
+    if (LargePages)
+    {
+        LargePageMinimum = GetLargePageMinimum();
+        if (0 == LargePageMinimum || 0 != RAMSTORE_CHUNK_LENGTH % LargePageMinimum)
+        {
+            warn(L"large pages are not supported; using regular pages");
+            LargePages = FALSE;
+        }
+        else if (!EnableLockMemoryPrivilege())
+        {
+            warn(L"cannot enable SeLockMemoryPrivilege; using regular pages");
+            LargePages = FALSE;
+        }
+    }
+
+    RamDisk = malloc(sizeof *RamDisk);
+    if (0 == RamDisk)
+    {
+        Error = ERROR_NOT_ENOUGH_MEMORY;
+        goto exit;
+    }
+    memset(RamDisk, 0, sizeof *RamDisk);
+    RamDisk->BlockLength = BlockLength;
+
+    if (!RamStoreCreate(BlockCount * BlockLength, LargePages, &RamDisk->Store))
+    {
+        Error = ERROR_NOT_ENOUGH_MEMORY;
+        goto exit;
+    }
+
+    Error = SpdStorageUnitCreate(PipeName, &StorageUnitParams, &RamDiskInterface, &StorageUnit);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    SpdStorageUnitSetDispatcherBatchSize(StorageUnit, RAMDISK_BATCH_SIZE);
+
+    RamDisk->StorageUnit = StorageUnit;
+    StorageUnit->UserContext = RamDisk;
+
+    *PRamDisk = RamDisk;
+
+    Error = ERROR_SUCCESS;
+
+exit:
+    if (ERROR_SUCCESS != Error)
+    {
+        if (0 != RamDisk)
+        {
+            if (0 != RamDisk->Store)
+                RamStoreDelete(RamDisk->Store);
+            free(RamDisk);
+        }
+    }
+
+    return Error;
+}
+
+VOID RamDiskDelete(RAMDISK *RamDisk)
+{
+    SpdStorageUnitDelete(RamDisk->StorageUnit);
+
+    info(L"chunks: %lu allocated, %lu from large pages",
+        (ULONG)RamDisk->Store->ChunkCount, (ULONG)RamDisk->Store->LargeChunkCount);
+
+    RamStoreDelete(RamDisk->Store);
+    free(RamDisk);
+}
+
+SPD_STORAGE_UNIT *RamDiskStorageUnit(RAMDISK *RamDisk)
+{
+    return RamDisk->StorageUnit;
+}
+
+#define PROGNAME                        "ramdisk"
+
+static void usage(void)
+{
+    static WCHAR usage[] = L""
+        "usage: %s OPTIONS\n"
+        "\n"
+        "options:\n"
+        "    -c BlockCount                       Storage unit size in blocks\n"
+        "    -l BlockLength                      Storage unit block length\n"
+        "    -i ProductId                        1-16 chars\n"
+        "    -r ProductRevision                  1-4 chars\n"
+        "    -W 0|1                              Disable/enable writes (deflt: enable)\n"
+        "    -U 0|1                              Disable/enable unmap (deflt: enable)\n"
+        "    -L 0|1                              Disable/enable large pages (deflt: disable)\n"
+        "    -t Threads                          Dispatcher threads (deflt: 0 = processors)\n"
+        "    -R RingCapacity                     Shared ring capacity (deflt: 0 = transact)\n"
+        "    -d -1                               Debug flags\n"
+        "    -D DebugLogFile                     Debug log file; - for stderr\n"
+        "    -p \\\\.\\pipe\\PipeName                Listen on pipe; omit to use driver\n"
+        "";
+
+    fail(ERROR_INVALID_PARAMETER, usage, L"" PROGNAME);
+}
+
+static ULONG argtol(wchar_t **argp, ULONG deflt)
+{
+    if (0 == argp[0])
+        usage();
+
+    wchar_t *endp;
+    ULONG ul = wcstol(argp[0], &endp, 10);
+    return L'\0' != argp[0][0] && L'\0' == *endp ? ul : deflt;
+}
+
+static wchar_t *argtos(wchar_t **argp)
+{
+    if (0 == argp[0])
+        usage();
+
+    return argp[0];
+}
+
+static SPD_GUARD ConsoleCtrlGuard = SPD_GUARD_INIT;
+
+static BOOL WINAPI ConsoleCtrlHandler(DWORD CtrlType)
+{
+    SpdGuardExecute(&ConsoleCtrlGuard, SpdStorageUnitShutdown);
+    return TRUE;
+}
+
+int wmain(int argc, wchar_t **argv)
+{
+    wchar_t **argp;
+    ULONG BlockCount = 1024 * 1024;
+    ULONG BlockLength = 512;
+    PWSTR ProductId = L"RamDisk";
+    PWSTR ProductRevision = L"1.0";
+    ULONG WriteAllowed = 1;
+    ULONG UnmapSupported = 1;
+    ULONG LargePages = 0;
+    ULONG ThreadCount = 0;
+    ULONG RingCapacity = 0;
+    ULONG DebugFlags = 0;
+    PWSTR DebugLogFile = 0;
+    HANDLE DebugLogHandle = INVALID_HANDLE_VALUE;
+    PWSTR PipeName = 0;
+    RAMDISK *RamDisk = 0;
+    DWORD Error;
+
+    for (argp = argv + 1; 0 != argp[0]; argp++)
+    {
+        if (L'-' != argp[0][0])
+            break;
+        switch (argp[0][1])
+        {
+        case L'?':
+            usage();
+            break;
+        case L'c':
+            BlockCount = argtol(++argp, BlockCount);
+            break;
+        case L'd':
+            DebugFlags = argtol(++argp, DebugFlags);
+            break;
+        case L'D':
+            DebugLogFile = argtos(++argp);
+            break;
+        case L'i':
+            ProductId = argtos(++argp);
+            break;
+        case L'l':
+            BlockLength = argtol(++argp, BlockLength);
+            break;
+        case L'L':
+            LargePages = argtol(++argp, LargePages);
+            break;
+        case L'p':
+            PipeName = argtos(++argp);
+            break;
+        case L'r':
+            ProductRevision = argtos(++argp);
+            break;
+        case L'R':
+            RingCapacity = argtol(++argp, RingCapacity);
+            break;
+        case L't':
+            ThreadCount = argtol(++argp, ThreadCount);
+            break;
+        case L'U':
+            UnmapSupported = argtol(++argp, UnmapSupported);
+            break;
+        case L'W':
+            WriteAllowed = argtol(++argp, WriteAllowed);
+            break;
+        default:
+            usage();
+            break;
+        }
+    }
+
+    if (0 != argp[0])
+        usage();
+
+    if (0 != DebugLogFile)
+    {
+        if (L'-' == DebugLogFile[0] && L'\0' == DebugLogFile[1])
+            DebugLogHandle = GetStdHandle(STD_ERROR_HANDLE);
+        else
+            DebugLogHandle = CreateFileW(
+                DebugLogFile,
+                FILE_APPEND_DATA,
+                FILE_SHARE_READ | FILE_SHARE_WRITE,
+                0,
+                OPEN_ALWAYS,
+                FILE_ATTRIBUTE_NORMAL,
+                0);
+        if (INVALID_HANDLE_VALUE == DebugLogHandle)
+            fail(GetLastError(), L"error: cannot open debug log file");
+
+        SpdDebugLogSetHandle(DebugLogHandle);
+    }
+
+    Error = RamDiskCreate(
+        BlockCount, BlockLength,
+        ProductId, ProductRevision,
+        !WriteAllowed,
+        !!UnmapSupported,
+        !!LargePages,
+        PipeName,
+        &RamDisk);
+    if (0 != Error)
+        fail(Error, L"error: cannot create RamDisk: error %lu", Error);
+    SpdStorageUnitSetDebugLog(RamDiskStorageUnit(RamDisk), DebugFlags);
+    SpdStorageUnitSetDispatcherRingCapacity(RamDiskStorageUnit(RamDisk), RingCapacity);
+    Error = SpdStorageUnitStartDispatcher(RamDiskStorageUnit(RamDisk), ThreadCount);
+    if (0 != Error)
+        fail(Error, L"error: cannot start RamDisk: error %lu", Error);
+
+    info(L"%s -c %lu -l %lu -i %s -r %s -W %u -U %u -L %u -t %lu -R %lu%s%s",
+        L"" PROGNAME,
+        BlockCount, BlockLength, ProductId, ProductRevision,
+        !!WriteAllowed,
+        !!UnmapSupported,
+        !!LargePages,
+        ThreadCount,
+        RingCapacity,
+        0 != PipeName ? L" -p " : L"",
+        0 != PipeName ? PipeName : L"");
+
+    SpdGuardSet(&ConsoleCtrlGuard, RamDiskStorageUnit(RamDisk));
+    SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+    SpdStorageUnitWaitDispatcher(RamDiskStorageUnit(RamDisk));
+    SpdGuardSet(&ConsoleCtrlGuard, 0);
+
+    RamDiskDelete(RamDisk);
+    RamDisk = 0;
+
+    return 0;
+}
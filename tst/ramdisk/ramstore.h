@@ -0,0 +1,474 @@
+/**
+ * @file ramstore.h
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#ifndef RAMSTORE_H_INCLUDED
+#define RAMSTORE_H_INCLUDED
+
+/*
+ * RAM store
+ *
+ * The storage engine of the ramdisk sample: a byte addressed store of Length bytes that
+ * is allocated lazily, a chunk (2MB) at a time, and that gives memory back on unmap. It
+ * knows nothing of storage units, so that it can be tested and benchmarked on its own,
+ * on Windows or on POSIX systems.
+ *
+ * Chunks are found through a two-level page table: a directory of tables, each of which
+ * maps 1GB worth of chunks. Every chunk that has not been written, or has been unmapped
+ * since, points to a single shared zero page, and every table that holds no chunks is the
+ * shared zero table; so a lookup never branches on a missing table and a read of a zero
+ * chunk fills the buffer with zeroes without touching any memory of the store.
+ *
+ * Lookups take no locks. A write that finds the zero page in its chunk (or the zero table
+ * in its directory entry) allocates a new one and installs it with a compare-and-swap;
+ * the loser of a race frees its copy and uses the winner's. An unmap swaps the chunks
+ * that it covers in full for the zero page (and zeroes the parts of the others that it
+ * covers); it frees them once no reader can still see them, which it knows through an
+ * epoch (shared/epoch.h) that every read, write and unmap enters. Tables are only freed
+ * with the store.
+ *
+ * Chunks may be allocated from large pages; when a large page cannot be had the chunk
+ * is allocated from regular pages instead.
+ */
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+#define RamStoreThreadHint()            (GetCurrentThreadId() >> 2)
+
+#else
+
+#include <shared/posix.h>
+#include <sys/mman.h>
+
+#define RamStoreThreadHint()            \
+    ((ULONG)(((UINT64)(UINT_PTR)pthread_self() * 0x9e3779b97f4a7c15ULL) >> 40))
+
+#endif
+
+#include <shared/epoch.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RAMSTORE_CHUNK_SHIFT            21      /* 2MB: the large page size on x64 */
+#define RAMSTORE_CHUNK_LENGTH           ((UINT64)1 << RAMSTORE_CHUNK_SHIFT)
+#define RAMSTORE_TABLE_SHIFT            9       /* 512 chunks (1GB) per table */
+#define RAMSTORE_TABLE_LENGTH           (1 << RAMSTORE_TABLE_SHIFT)
+#define RAMSTORE_PAGE_LENGTH            4096
+#define RAMSTORE_SLOT_COUNT             64
+#define RAMSTORE_RETIRE_COUNT           64      /* chunks freed per epoch synchronize */
+
+typedef struct
+{
+    PVOID volatile Chunks[RAMSTORE_TABLE_LENGTH];
+} RAMSTORE_TABLE;
+
+typedef struct
+{
+    SPD_EPOCH_SLOT Slots[RAMSTORE_SLOT_COUNT];
+    SPD_EPOCH Epoch;
+    UINT64 Length;
+    UINT64 TableCount;
+    RAMSTORE_TABLE *volatile *Directory;
+    RAMSTORE_TABLE *ZeroTable;
+    PVOID ZeroPage;
+    BOOLEAN LargePages;
+    volatile LONG64 ChunkCount;         /* chunks allocated */
+    volatile LONG64 LargeChunkCount;    /* of which from large pages */
+} RAMSTORE;
+
+static inline
+PVOID RamStorePageAlloc(UINT64 Size, BOOLEAN LargePages, BOOLEAN *PLargePages)
+{
+    PVOID Pointer = 0;
+
+    /* fresh pages read as zeroes on both systems */
+#if defined(_WIN32)
+    if (LargePages)
+        Pointer = VirtualAlloc(0, (SIZE_T)Size,
+            MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    if (0 != PLargePages)
+        *PLargePages = 0 != Pointer;
+    if (0 == Pointer)
+        Pointer = VirtualAlloc(0, (SIZE_T)Size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    Pointer = MAP_FAILED;
+    if (LargePages)
+        Pointer = mmap(0, (size_t)Size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (0 != PLargePages)
+        *PLargePages = MAP_FAILED != Pointer;
+    if (MAP_FAILED == Pointer)
+        Pointer = mmap(0, (size_t)Size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == Pointer)
+        Pointer = 0;
+#endif
+
+    return Pointer;
+}
+
+static inline
+VOID RamStorePageFree(PVOID Pointer, UINT64 Size)
+{
+#if defined(_WIN32)
+    VirtualFree(Pointer, 0, MEM_RELEASE);
+#else
+    munmap(Pointer, (size_t)Size);
+#endif
+}
+
+static inline
+VOID RamStorePageProtect(PVOID Pointer, UINT64 Size)
+{
+    /* the zero page and the zero table are shared: catch anyone who writes to them */
+#if defined(_WIN32)
+    DWORD Protect;
+    VirtualProtect(Pointer, (SIZE_T)Size, PAGE_READONLY, &Protect);
+#else
+    mprotect(Pointer, (size_t)Size, PROT_READ);
+#endif
+}
+
+static inline
+UINT64 RamStoreDirectorySize(UINT64 TableCount)
+{
+    return (TableCount * sizeof(PVOID) + RAMSTORE_PAGE_LENGTH - 1) &
+        ~(UINT64)(RAMSTORE_PAGE_LENGTH - 1);
+}
+
+static inline
+VOID RamStoreDelete(RAMSTORE *Store)
+{
+    RAMSTORE_TABLE *Table;
+    PVOID Chunk;
+
+    if (0 != Store->Directory)
+    {
+        for (UINT64 I = 0; Store->TableCount > I; I++)
+        {
+            Table = Store->Directory[I];
+            if (0 == Table || Store->ZeroTable == Table)
+                continue;
+            for (ULONG J = 0; RAMSTORE_TABLE_LENGTH > J; J++)
+            {
+                Chunk = Table->Chunks[J];
+                if (Store->ZeroPage != Chunk)
+                    RamStorePageFree(Chunk, RAMSTORE_CHUNK_LENGTH);
+            }
+            RamStorePageFree(Table, sizeof *Table);
+        }
+        RamStorePageFree((PVOID)Store->Directory, RamStoreDirectorySize(Store->TableCount));
+    }
+    if (0 != Store->ZeroTable)
+        RamStorePageFree(Store->ZeroTable, sizeof *Store->ZeroTable);
+    if (0 != Store->ZeroPage)
+        RamStorePageFree(Store->ZeroPage, RAMSTORE_PAGE_LENGTH);
+    RamStorePageFree(Store, sizeof *Store);
+}
+
+static inline
+BOOLEAN RamStoreCreate(UINT64 Length, BOOLEAN LargePages, RAMSTORE **PStore)
+{
+    RAMSTORE *Store;
+    UINT64 TableCount;
+
+    *PStore = 0;
+
+    if (0 == Length)
+        return FALSE;
+
+    TableCount = ((Length - 1) >> (RAMSTORE_CHUNK_SHIFT + RAMSTORE_TABLE_SHIFT)) + 1;
+    if ((size_t)-1 / sizeof(PVOID) < TableCount)
+        return FALSE;
+
+    /* page aligned, so that the epoch slots are cache aligned */
+    Store = RamStorePageAlloc(sizeof *Store, FALSE, 0);
+    if (0 == Store)
+        return FALSE;
+    SpdEpochInitialize(&Store->Epoch, Store->Slots, RAMSTORE_SLOT_COUNT);
+    Store->Length = Length;
+    Store->TableCount = TableCount;
+    Store->LargePages = LargePages;
+
+    Store->ZeroPage = RamStorePageAlloc(RAMSTORE_PAGE_LENGTH, FALSE, 0);
+    Store->ZeroTable = RamStorePageAlloc(sizeof *Store->ZeroTable, FALSE, 0);
+    Store->Directory = RamStorePageAlloc(RamStoreDirectorySize(TableCount), FALSE, 0);
+    if (0 == Store->ZeroPage || 0 == Store->ZeroTable || 0 == Store->Directory)
+    {
+        RamStoreDelete(Store);
+        return FALSE;
+    }
+
+    for (ULONG I = 0; RAMSTORE_TABLE_LENGTH > I; I++)
+        Store->ZeroTable->Chunks[I] = Store->ZeroPage;
+    for (UINT64 I = 0; TableCount > I; I++)
+        Store->Directory[I] = Store->ZeroTable;
+    RamStorePageProtect(Store->ZeroPage, RAMSTORE_PAGE_LENGTH);
+    RamStorePageProtect(Store->ZeroTable, sizeof *Store->ZeroTable);
+
+    *PStore = Store;
+
+    return TRUE;
+}
+
+static inline
+BOOLEAN RamStoreRange(RAMSTORE *Store, UINT64 Offset, UINT64 Length)
+{
+    return Store->Length >= Offset && Store->Length - Offset >= Length;
+}
+
+static inline
+UINT64 RamStorePart(UINT64 Offset, UINT64 Length, ULONG Shift)
+{
+    /* the leading part of the range that lies in one chunk (or table) */
+    UINT64 Part = ((UINT64)1 << Shift) - (Offset & (((UINT64)1 << Shift) - 1));
+    return Length > Part ? Part : Length;
+}
+
+static inline
+PVOID volatile *RamStoreEntry(RAMSTORE_TABLE *Table, UINT64 Offset)
+{
+    return &Table->Chunks[(Offset >> RAMSTORE_CHUNK_SHIFT) & (RAMSTORE_TABLE_LENGTH - 1)];
+}
+
+static inline
+RAMSTORE_TABLE *RamStoreTable(RAMSTORE *Store, UINT64 Offset)
+{
+    return Store->Directory[Offset >> (RAMSTORE_CHUNK_SHIFT + RAMSTORE_TABLE_SHIFT)];
+}
+
+static inline
+PVOID RamStoreAllocateChunk(RAMSTORE *Store, UINT64 Offset)
+{
+    RAMSTORE_TABLE *volatile *DirectoryEntry =
+        &Store->Directory[Offset >> (RAMSTORE_CHUNK_SHIFT + RAMSTORE_TABLE_SHIFT)];
+    RAMSTORE_TABLE *Table, *NewTable;
+    PVOID volatile *Entry;
+    PVOID Chunk, NewChunk;
+    BOOLEAN LargePages;
+
+    Table = *DirectoryEntry;
+    if (Store->ZeroTable == Table)
+    {
+        NewTable = RamStorePageAlloc(sizeof *NewTable, FALSE, 0);
+        if (0 == NewTable)
+            return 0;
+        for (ULONG I = 0; RAMSTORE_TABLE_LENGTH > I; I++)
+            NewTable->Chunks[I] = Store->ZeroPage;
+
+        Table = InterlockedCompareExchangePointer((PVOID volatile *)DirectoryEntry,
+            NewTable, Store->ZeroTable);
+        if (Store->ZeroTable == Table)
+            Table = NewTable;
+        else
+            RamStorePageFree(NewTable, sizeof *NewTable);
+    }
+
+    Entry = RamStoreEntry(Table, Offset);
+    Chunk = *Entry;
+    if (Store->ZeroPage != Chunk)
+        return Chunk;
+
+    NewChunk = RamStorePageAlloc(RAMSTORE_CHUNK_LENGTH, Store->LargePages, &LargePages);
+    if (0 == NewChunk)
+        return 0;
+
+    Chunk = InterlockedCompareExchangePointer(Entry, NewChunk, Store->ZeroPage);
+    if (Store->ZeroPage != Chunk)
+    {
+        RamStorePageFree(NewChunk, RAMSTORE_CHUNK_LENGTH);
+        return Chunk;
+    }
+
+    InterlockedAdd64(&Store->ChunkCount, 1);
+    if (LargePages)
+        InterlockedAdd64(&Store->LargeChunkCount, 1);
+
+    return NewChunk;
+}
+
+static inline
+VOID RamStoreReclaim(RAMSTORE *Store, PVOID Retired[], ULONG Count)
+{
+    if (0 == Count)
+        return;
+
+    /* wait until no reader or writer can still be in one of these chunks */
+    SpdEpochSynchronize(&Store->Epoch);
+
+    for (ULONG I = 0; Count > I; I++)
+        RamStorePageFree(Retired[I], RAMSTORE_CHUNK_LENGTH);
+    InterlockedAdd64(&Store->ChunkCount, -(LONG64)Count);
+}
+
+static inline
+BOOLEAN RamStoreIsZero(const VOID *Buffer, UINT64 Length)
+{
+    const UINT8 *P = Buffer, *EndP = P + Length;
+
+    if (0 == (((UINT_PTR)P | (UINT_PTR)Length) & 7))
+    {
+        for (; EndP > P; P += 8)
+            if (0 != *(const UINT64 *)P)
+                return FALSE;
+    }
+    else
+    {
+        for (; EndP > P; P++)
+            if (0 != *P)
+                return FALSE;
+    }
+
+    return TRUE;
+}
+
+static inline
+BOOLEAN RamStoreRead(RAMSTORE *Store, PVOID Buffer, UINT64 Offset, UINT64 Length)
+{
+    UINT64 Part;
+    PVOID Chunk;
+    ULONG Slot;
+
+    if (!RamStoreRange(Store, Offset, Length))
+        return FALSE;
+
+    Slot = SpdEpochEnterAny(&Store->Epoch, RamStoreThreadHint());
+
+    for (; 0 < Length; Offset += Part, Length -= Part)
+    {
+        Part = RamStorePart(Offset, Length, RAMSTORE_CHUNK_SHIFT);
+        Chunk = *RamStoreEntry(RamStoreTable(Store, Offset), Offset);
+        if (Store->ZeroPage == Chunk)
+            memset(Buffer, 0, (size_t)Part);
+        else
+            memcpy(Buffer, (UINT8 *)Chunk + (Offset & (RAMSTORE_CHUNK_LENGTH - 1)), (size_t)Part);
+        Buffer = (UINT8 *)Buffer + Part;
+    }
+
+    SpdEpochLeave(&Store->Epoch, Slot);
+
+    return TRUE;
+}
+
+static inline
+BOOLEAN RamStoreWrite(RAMSTORE *Store, const VOID *Buffer, UINT64 Offset, UINT64 Length)
+{
+    BOOLEAN Result = TRUE;
+    UINT64 Part;
+    PVOID Chunk;
+    ULONG Slot;
+
+    if (!RamStoreRange(Store, Offset, Length))
+        return FALSE;
+
+    Slot = SpdEpochEnterAny(&Store->Epoch, RamStoreThreadHint());
+
+    for (; 0 < Length; Offset += Part, Length -= Part)
+    {
+        Part = RamStorePart(Offset, Length, RAMSTORE_CHUNK_SHIFT);
+        Chunk = *RamStoreEntry(RamStoreTable(Store, Offset), Offset);
+        if (Store->ZeroPage == Chunk)
+        {
+            /* zeroes need no memory: file systems write plenty of them when they format */
+            if (!RamStoreIsZero(Buffer, Part))
+                Chunk = RamStoreAllocateChunk(Store, Offset);
+            if (0 == Chunk)
+            {
+                Result = FALSE;
+                break;
+            }
+        }
+        if (Store->ZeroPage != Chunk)
+            memcpy((UINT8 *)Chunk + (Offset & (RAMSTORE_CHUNK_LENGTH - 1)), Buffer, (size_t)Part);
+        Buffer = (const UINT8 *)Buffer + Part;
+    }
+
+    SpdEpochLeave(&Store->Epoch, Slot);
+
+    return Result;
+}
+
+static inline
+BOOLEAN RamStoreUnmap(RAMSTORE *Store, UINT64 Offset, UINT64 Length)
+{
+    PVOID Retired[RAMSTORE_RETIRE_COUNT];
+    ULONG RetiredCount = 0;
+    RAMSTORE_TABLE *Table;
+    UINT64 Part;
+    PVOID Chunk;
+    ULONG Slot;
+
+    if (!RamStoreRange(Store, Offset, Length))
+        return FALSE;
+
+    Slot = SpdEpochEnterAny(&Store->Epoch, RamStoreThreadHint());
+
+    for (; 0 < Length; Offset += Part, Length -= Part)
+    {
+        Table = RamStoreTable(Store, Offset);
+        if (Store->ZeroTable == Table)
+        {
+            Part = RamStorePart(Offset, Length, RAMSTORE_CHUNK_SHIFT + RAMSTORE_TABLE_SHIFT);
+            continue;
+        }
+
+        Part = RamStorePart(Offset, Length, RAMSTORE_CHUNK_SHIFT);
+        Chunk = *RamStoreEntry(Table, Offset);
+        if (Store->ZeroPage == Chunk)
+            continue;
+
+        /* a range that reaches the end of the store covers its last (short) chunk */
+        if (0 != (Offset & (RAMSTORE_CHUNK_LENGTH - 1)) ||
+            (RAMSTORE_CHUNK_LENGTH != Part && Store->Length != Offset + Part))
+        {
+            memset((UINT8 *)Chunk + (Offset & (RAMSTORE_CHUNK_LENGTH - 1)), 0, (size_t)Part);
+            continue;
+        }
+
+        Chunk = InterlockedExchangePointer(RamStoreEntry(Table, Offset), Store->ZeroPage);
+        if (Store->ZeroPage == Chunk)
+            continue;
+
+        Retired[RetiredCount++] = Chunk;
+        if (RAMSTORE_RETIRE_COUNT == RetiredCount)
+        {
+            /* do not wait for ourselves */
+            SpdEpochLeave(&Store->Epoch, Slot);
+            RamStoreReclaim(Store, Retired, RetiredCount);
+            RetiredCount = 0;
+            Slot = SpdEpochEnterAny(&Store->Epoch, RamStoreThreadHint());
+        }
+    }
+
+    SpdEpochLeave(&Store->Epoch, Slot);
+    RamStoreReclaim(Store, Retired, RetiredCount);
+
+    return TRUE;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,6 +20,7 @@
  */
 
 #include <winspd/winspd.h>
+#include <shared/extmap.h>
 
 #define info(format, ...)               \
     SpdServiceLog(EVENTLOG_INFORMATION_TYPE, format, __VA_ARGS__)
@@ -37,17 +38,44 @@
             warn(L"WARNONCE(%S) failed at %S:%d", #expr, __func__, __LINE__);\
     } while (0,0)
 
+enum
+{
+    RawDiskEngineMap = 0,               /* memory mapped file */
+    RawDiskEngineIo,                    /* unbuffered overlapped file I/O */
+};
+
 typedef struct _RAWDISK
 {
     SPD_STORAGE_UNIT *StorageUnit;
+    const SPD_STORAGE_UNIT_INTERFACE *Interface;
     UINT64 BlockCount;
     UINT32 BlockLength;
     HANDLE Handle;
     HANDLE Mapping;
     PVOID Pointer;
+    HANDLE WriteThroughHandle;
+    HANDLE Port;
+    HANDLE PortThread;
+    SRWLOCK FlushLock;
+    CONDITION_VARIABLE FlushCondition;
+    UINT64 FlushStarted, FlushFinished, FlushFailed;
+    UINT64 FlushRequestCount;
+    SPD_EXTENT_MAP Extents;
     BOOLEAN Sparse;
 } RAWDISK;
 
+typedef struct _RAWDISK_IO
+{
+    OVERLAPPED Overlapped;
+    SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest;
+    UINT64 BlockAddress;
+    UINT8 ASC;
+} RAWDISK_IO;
+
+#define RAWDISK_IO_ALIGNMENT_MASK       (4096 - 1)
+#define RAWDISK_IO_ASYNC_DEPTH          64
+#define RAWDISK_EXTENT_SHIFT            16      /* NTFS sparse files allocate 64KB at a time */
+
 static inline BOOLEAN ExceptionFilter(ULONG Code, PEXCEPTION_POINTERS Pointers,
     PUINT_PTR PDataAddress)
 {
@@ -91,6 +119,48 @@ static VOID CopyBuffer(SPD_STORAGE_UNIT *StorageUnit,
     }
 }
 
+static BOOL FlushFile(RAWDISK *RawDisk)
+{
+    UINT64 Target;
+    BOOL Success;
+
+    AcquireSRWLockExclusive(&RawDisk->FlushLock);
+
+    RawDisk->FlushRequestCount++;
+
+    /*
+     * Group commit: a flush that is already in progress may have missed our data, so we
+     * need the next one. Whoever finds no flush in progress issues it on behalf of all
+     * those that are waiting for it.
+     */
+    Target = RawDisk->FlushStarted + 1;
+    while (RawDisk->FlushFinished < Target)
+    {
+        if (RawDisk->FlushStarted == RawDisk->FlushFinished)
+        {
+            RawDisk->FlushStarted++;
+            ReleaseSRWLockExclusive(&RawDisk->FlushLock);
+
+            Success = FlushFileBuffers(RawDisk->Handle);
+
+            AcquireSRWLockExclusive(&RawDisk->FlushLock);
+            if (!Success)
+                RawDisk->FlushFailed = RawDisk->FlushStarted;
+            RawDisk->FlushFinished++;
+            WakeAllConditionVariable(&RawDisk->FlushCondition);
+        }
+        else
+            SleepConditionVariableSRW(&RawDisk->FlushCondition, &RawDisk->FlushLock, INFINITE, 0);
+    }
+
+    /* only the last failure is kept: a failed later flush also fails ours */
+    Success = RawDisk->FlushFailed < Target;
+
+    ReleaseSRWLockExclusive(&RawDisk->FlushLock);
+
+    return Success;
+}
+
 static BOOLEAN FlushInternal(SPD_STORAGE_UNIT *StorageUnit,
     UINT64 BlockAddress, UINT32 BlockCount,
     SPD_STORAGE_UNIT_STATUS *Status)
@@ -100,7 +170,7 @@ static BOOLEAN FlushInternal(SPD_STORAGE_UNIT *StorageUnit,
 
     if (!FlushViewOfFile(FileBuffer, BlockCount * RawDisk->BlockLength))
         goto error;
-    if (!FlushFileBuffers(RawDisk->Handle))
+    if (!FlushFile(RawDisk))
         goto error;
 
     return TRUE;
@@ -126,11 +196,27 @@ static BOOLEAN Read(SPD_STORAGE_UNIT *StorageUnit,
     }
 
     RAWDISK *RawDisk = StorageUnit->UserContext;
-    PVOID FileBuffer = (PUINT8)RawDisk->Pointer + BlockAddress * RawDisk->BlockLength;
+    UINT64 Offset = BlockAddress * RawDisk->BlockLength;
+    UINT64 Length = (UINT64)BlockCount * RawDisk->BlockLength;
+    UINT64 RunLength;
+    BOOLEAN Allocated;
 
-    CopyBuffer(StorageUnit,
-        Buffer, FileBuffer, BlockCount * RawDisk->BlockLength, SCSI_ADSENSE_UNRECOVERED_ERROR,
-        Status);
+    /* unallocated ranges read as zeroes: do not fault in the zero pages of the view */
+    for (; 0 < Length; Offset += RunLength, Length -= RunLength)
+    {
+        RunLength = SpdExtentMapRun(&RawDisk->Extents, Offset, Length, &Allocated);
+        if (Allocated)
+        {
+            CopyBuffer(StorageUnit,
+                Buffer, (PUINT8)RawDisk->Pointer + Offset, (ULONG)RunLength,
+                SCSI_ADSENSE_UNRECOVERED_ERROR, Status);
+            if (SCSISTAT_GOOD != Status->ScsiStatus)
+                break;
+        }
+        else
+            memset(Buffer, 0, (size_t)RunLength);
+        Buffer = (PUINT8)Buffer + RunLength;
+    }
 
     return TRUE;
 }
@@ -145,6 +231,9 @@ static BOOLEAN Write(SPD_STORAGE_UNIT *StorageUnit,
     RAWDISK *RawDisk = StorageUnit->UserContext;
     PVOID FileBuffer = (PUINT8)RawDisk->Pointer + BlockAddress * RawDisk->BlockLength;
 
+    SpdExtentMapSet(&RawDisk->Extents,
+        BlockAddress * RawDisk->BlockLength, (UINT64)BlockCount * RawDisk->BlockLength);
+
     CopyBuffer(StorageUnit,
         FileBuffer, Buffer, BlockCount * RawDisk->BlockLength, SCSI_ADSENSE_WRITE_ERROR,
         Status);
@@ -195,9 +284,16 @@ static BOOLEAN Unmap(SPD_STORAGE_UNIT *StorageUnit,
             FileBuffer = (PUINT8)RawDisk->Pointer + Descriptors[I].BlockAddress * RawDisk->BlockLength;
 
             CopyBuffer(StorageUnit,
-                FileBuffer, 0, Descriptors[I].BlockCount * RawDisk->BlockLength, SCSI_ADSENSE_NO_SENSE,
-                0);
+                FileBuffer, 0, Descriptors[I].BlockCount * RawDisk->BlockLength, SCSI_ADSENSE_WRITE_ERROR,
+                Status);
+            if (SCSISTAT_GOOD != Status->ScsiStatus)
+                break;
         }
+
+        /* only what now reads as zero from the file is a hole */
+        SpdExtentMapClear(&RawDisk->Extents,
+            Descriptors[I].BlockAddress * RawDisk->BlockLength,
+            Descriptors[I].BlockCount * RawDisk->BlockLength);
     }
 
     return TRUE;
@@ -211,55 +307,371 @@ static SPD_STORAGE_UNIT_INTERFACE RawDiskInterface =
     Unmap,
 };
 
-DWORD RawDiskCreate(PWSTR RawDiskFile,
+static PVOID IoBufferAlloc(size_t Size)
+{
+    PVOID P;
+
+    if ((UINT32)Size != Size ||
+        ERROR_SUCCESS != SpdIoctlMemAlignAlloc((UINT32)Size, RAWDISK_IO_ALIGNMENT_MASK, &P))
+        return 0;
+
+    return P;
+}
+
+static VOID IoBufferFree(PVOID P)
+{
+    if (0 != P)
+        SpdIoctlMemAlignFree(P);
+}
+
+static BOOL IoPrepare(OVERLAPPED *Overlapped, UINT64 Offset)
+{
+    memset(Overlapped, 0, sizeof *Overlapped);
+    Overlapped->Offset = (DWORD)Offset;
+    Overlapped->OffsetHigh = (DWORD)(Offset >> 32);
+    Overlapped->hEvent = CreateEventW(0, TRUE, FALSE, 0);
+    if (0 == Overlapped->hEvent)
+        return FALSE;
+
+    /* setting the low bit keeps the completion off the port; IoWait waits for it instead */
+    Overlapped->hEvent = (HANDLE)((UINT_PTR)Overlapped->hEvent | 1);
+
+    return TRUE;
+}
+
+static BOOL IoWait(HANDLE Handle, OVERLAPPED *Overlapped, BOOL Success)
+{
+    DWORD BytesTransferred;
+
+    if (Success || ERROR_IO_PENDING == GetLastError())
+        Success = GetOverlappedResult(Handle, Overlapped, &BytesTransferred, TRUE);
+
+    CloseHandle((HANDLE)((UINT_PTR)Overlapped->hEvent & ~(UINT_PTR)1));
+
+    return Success;
+}
+
+static BOOL IoSynchronous(HANDLE Handle, BOOLEAN WriteFlag,
+    PVOID Buffer, DWORD Length, UINT64 Offset)
+{
+    OVERLAPPED Overlapped;
+
+    if (!IoPrepare(&Overlapped, Offset))
+        return FALSE;
+
+    return IoWait(Handle, &Overlapped, WriteFlag ?
+        WriteFile(Handle, Buffer, Length, 0, &Overlapped) :
+        ReadFile(Handle, Buffer, Length, 0, &Overlapped));
+}
+
+static BOOLEAN IoTransfer(SPD_STORAGE_UNIT *StorageUnit,
+    HANDLE Handle, BOOLEAN WriteFlag,
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, UINT8 ASC,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    RAWDISK *RawDisk = StorageUnit->UserContext;
+    SPD_STORAGE_UNIT_ASYNC_REQUEST *AsyncRequest;
+    RAWDISK_IO *Io;
+    UINT64 Offset = BlockAddress * RawDisk->BlockLength;
+    DWORD Length = BlockCount * RawDisk->BlockLength;
+    BOOL Success;
+
+    AsyncRequest = SpdStorageUnitBeginAsyncRequest();
+    if (0 == AsyncRequest)
+    {
+        if (!IoSynchronous(Handle, WriteFlag, Buffer, Length, Offset))
+            SpdStorageUnitStatusSetSense(Status, SCSI_SENSE_MEDIUM_ERROR, ASC, &BlockAddress);
+
+        return TRUE;
+    }
+
+    Io = malloc(sizeof *Io);
+    if (0 != Io)
+    {
+        memset(Io, 0, sizeof *Io);
+        Io->Overlapped.Offset = (DWORD)Offset;
+        Io->Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+        Io->AsyncRequest = AsyncRequest;
+        Io->BlockAddress = BlockAddress;
+        Io->ASC = ASC;
+
+        Success = WriteFlag ?
+            WriteFile(Handle, Buffer, Length, 0, &Io->Overlapped) :
+            ReadFile(Handle, Buffer, Length, 0, &Io->Overlapped);
+
+        /* a completion packet is queued even if the I/O completed synchronously */
+        if (Success || ERROR_IO_PENDING == GetLastError())
+            return FALSE;
+
+        free(Io);
+    }
+
+    SpdStorageUnitStatusSetSense(Status, SCSI_SENSE_MEDIUM_ERROR, ASC, &BlockAddress);
+    SpdStorageUnitCompleteAsyncRequest(AsyncRequest, Status);
+
+    return FALSE;
+}
+
+static DWORD WINAPI IoCompletionThread(PVOID RawDisk0)
+{
+    RAWDISK *RawDisk = RawDisk0;
+    RAWDISK_IO *Io;
+    OVERLAPPED *Overlapped;
+    DWORD BytesTransferred;
+    ULONG_PTR CompletionKey;
+    SPD_STORAGE_UNIT_STATUS Status;
+    BOOL Success;
+
+    for (;;)
+    {
+        Success = GetQueuedCompletionStatus(RawDisk->Port,
+            &BytesTransferred, &CompletionKey, &Overlapped, INFINITE);
+        if (0 == Overlapped)
+            break;              /* posted by RawDiskClose */
+
+        Io = CONTAINING_RECORD(Overlapped, RAWDISK_IO, Overlapped);
+
+        memset(&Status, 0, sizeof Status);
+        if (!Success)
+            SpdStorageUnitStatusSetSense(&Status,
+                SCSI_SENSE_MEDIUM_ERROR, Io->ASC, &Io->BlockAddress);
+
+        SpdStorageUnitCompleteAsyncRequest(Io->AsyncRequest, &Status);
+
+        free(Io);
+    }
+
+    return 0;
+}
+
+static BOOLEAN IoRead(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN FlushFlag,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    WARNONCE(StorageUnit->StorageUnitParams.CacheSupported || FlushFlag);
+
+    RAWDISK *RawDisk = StorageUnit->UserContext;
+    UINT64 Length = (UINT64)BlockCount * RawDisk->BlockLength;
+    BOOLEAN Allocated;
+
+    if (Length == SpdExtentMapRun(&RawDisk->Extents,
+        BlockAddress * RawDisk->BlockLength, Length, &Allocated) && !Allocated)
+    {
+        memset(Buffer, 0, (size_t)Length);
+        return TRUE;
+    }
+
+    /* unbuffered reads never come from the file cache, so FUA needs no flush */
+    return IoTransfer(StorageUnit,
+        RawDisk->Handle, FALSE,
+        Buffer, BlockAddress, BlockCount, SCSI_ADSENSE_UNRECOVERED_ERROR,
+        Status);
+}
+
+static BOOLEAN IoWrite(SPD_STORAGE_UNIT *StorageUnit,
+    PVOID Buffer, UINT64 BlockAddress, UINT32 BlockCount, BOOLEAN FlushFlag,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    WARNONCE(!StorageUnit->StorageUnitParams.WriteProtected);
+    WARNONCE(StorageUnit->StorageUnitParams.CacheSupported || FlushFlag);
+
+    RAWDISK *RawDisk = StorageUnit->UserContext;
+
+    SpdExtentMapSet(&RawDisk->Extents,
+        BlockAddress * RawDisk->BlockLength, (UINT64)BlockCount * RawDisk->BlockLength);
+
+    return IoTransfer(StorageUnit,
+        FlushFlag ? RawDisk->WriteThroughHandle : RawDisk->Handle, TRUE,
+        Buffer, BlockAddress, BlockCount, SCSI_ADSENSE_WRITE_ERROR,
+        Status);
+}
+
+static BOOLEAN IoFlush(SPD_STORAGE_UNIT *StorageUnit,
+    UINT64 BlockAddress, UINT32 BlockCount,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    WARNONCE(!StorageUnit->StorageUnitParams.WriteProtected);
+    WARNONCE(StorageUnit->StorageUnitParams.CacheSupported);
+
+    RAWDISK *RawDisk = StorageUnit->UserContext;
+
+    if (!FlushFile(RawDisk))
+        SpdStorageUnitStatusSetSense(Status,
+            SCSI_SENSE_MEDIUM_ERROR, SCSI_ADSENSE_WRITE_ERROR, 0);
+
+    return TRUE;
+}
+
+static BOOLEAN IoUnmap(SPD_STORAGE_UNIT *StorageUnit,
+    SPD_UNMAP_DESCRIPTOR Descriptors[], UINT32 Count,
+    SPD_STORAGE_UNIT_STATUS *Status)
+{
+    WARNONCE(!StorageUnit->StorageUnitParams.WriteProtected);
+    WARNONCE(StorageUnit->StorageUnitParams.UnmapSupported);
+
+    RAWDISK *RawDisk = StorageUnit->UserContext;
+    FILE_ZERO_DATA_INFORMATION Zero;
+    OVERLAPPED Overlapped;
+    PVOID ZeroBuffer = 0;
+    UINT32 ZeroLength = StorageUnit->StorageUnitParams.MaxTransferLength;
+    UINT64 StartOffset, Offset, EndOffset, Information;
+    DWORD Length;
+
+    for (UINT32 I = 0; Count > I; I++)
+    {
+        BOOLEAN SetZero = FALSE;
+
+        StartOffset = Offset = Descriptors[I].BlockAddress * RawDisk->BlockLength;
+        EndOffset = (Descriptors[I].BlockAddress + Descriptors[I].BlockCount) * RawDisk->BlockLength;
+
+        if (RawDisk->Sparse && IoPrepare(&Overlapped, 0))
+        {
+            Zero.FileOffset.QuadPart = Offset;
+            Zero.BeyondFinalZero.QuadPart = EndOffset;
+            SetZero = IoWait(RawDisk->Handle, &Overlapped, DeviceIoControl(RawDisk->Handle,
+                FSCTL_SET_ZERO_DATA, &Zero, sizeof Zero, 0, 0, 0, &Overlapped));
+        }
+
+        if (SetZero)
+            Offset = EndOffset;
+        else
+        {
+            if (0 == ZeroBuffer)
+            {
+                ZeroBuffer = IoBufferAlloc(ZeroLength);
+                if (0 != ZeroBuffer)
+                    memset(ZeroBuffer, 0, ZeroLength);
+            }
+
+            for (; 0 != ZeroBuffer && EndOffset > Offset; Offset += Length)
+            {
+                Length = (DWORD)(EndOffset - Offset < ZeroLength ? EndOffset - Offset : ZeroLength);
+                if (!IoSynchronous(RawDisk->Handle, TRUE, ZeroBuffer, Length, Offset))
+                    break;
+            }
+        }
+
+        /* only what now reads as zero from the file is a hole */
+        SpdExtentMapClear(&RawDisk->Extents, StartOffset, Offset - StartOffset);
+
+        if (EndOffset > Offset)
+        {
+            Information = Offset / RawDisk->BlockLength;
+            SpdStorageUnitStatusSetSense(Status,
+                SCSI_SENSE_MEDIUM_ERROR, SCSI_ADSENSE_WRITE_ERROR, &Information);
+            break;
+        }
+    }
+
+    IoBufferFree(ZeroBuffer);
+
+    return TRUE;
+}
+
+static SPD_STORAGE_UNIT_INTERFACE RawDiskIoInterface =
+{
+    IoRead,
+    IoWrite,
+    IoFlush,
+    IoUnmap,
+};
+
+static VOID RawDiskLoadExtents(RAWDISK *RawDisk, UINT64 FileSize)
+{
+    FILE_ALLOCATED_RANGE_BUFFER Query, Ranges[256];
+    DWORD BytesTransferred, Count;
+    BOOL Success;
+
+    /* without sparse support any range may hold data */
+    if (!RawDisk->Sparse)
+    {
+        SpdExtentMapSetAll(&RawDisk->Extents);
+        return;
+    }
+
+    Query.FileOffset.QuadPart = 0;
+    Query.Length.QuadPart = FileSize;
+    for (;;)
+    {
+        Success = DeviceIoControl(RawDisk->Handle,
+            FSCTL_QUERY_ALLOCATED_RANGES, &Query, sizeof Query, Ranges, sizeof Ranges,
+            &BytesTransferred, 0);
+        Count = Success || ERROR_MORE_DATA == GetLastError() ?
+            BytesTransferred / sizeof Ranges[0] : 0;
+
+        for (DWORD I = 0; Count > I; I++)
+            SpdExtentMapSet(&RawDisk->Extents,
+                Ranges[I].FileOffset.QuadPart, Ranges[I].Length.QuadPart);
+
+        if (Success)
+            break;
+        if (0 == Count)
+        {
+            SpdExtentMapSetAll(&RawDisk->Extents);
+            break;
+        }
+
+        /* ERROR_MORE_DATA: continue after the last range returned */
+        Query.FileOffset.QuadPart = Ranges[Count - 1].FileOffset.QuadPart +
+            Ranges[Count - 1].Length.QuadPart;
+        Query.Length.QuadPart = FileSize - Query.FileOffset.QuadPart;
+    }
+}
+
+static VOID RawDiskClose(RAWDISK *RawDisk)
+{
+    if (0 != RawDisk->PortThread)
+    {
+        PostQueuedCompletionStatus(RawDisk->Port, 0, 0, 0);
+        WaitForSingleObject(RawDisk->PortThread, INFINITE);
+        CloseHandle(RawDisk->PortThread);
+    }
+
+    if (0 != RawDisk->Port)
+        CloseHandle(RawDisk->Port);
+
+    if (0 != RawDisk->Pointer)
+    {
+        FlushViewOfFile(RawDisk->Pointer, 0);
+        UnmapViewOfFile(RawDisk->Pointer);
+    }
+
+    if (0 != RawDisk->Mapping)
+        CloseHandle(RawDisk->Mapping);
+
+    if (INVALID_HANDLE_VALUE != RawDisk->WriteThroughHandle)
+        CloseHandle(RawDisk->WriteThroughHandle);
+
+    if (INVALID_HANDLE_VALUE != RawDisk->Handle)
+    {
+        FlushFileBuffers(RawDisk->Handle);
+        CloseHandle(RawDisk->Handle);
+    }
+
+    SpdExtentMapFinalize(&RawDisk->Extents);
+
+    free(RawDisk);
+}
+
+static DWORD RawDiskOpen(PWSTR RawDiskFile,
     UINT64 BlockCount, UINT32 BlockLength,
-    PWSTR ProductId, PWSTR ProductRevision,
-    BOOLEAN WriteProtected,
-    BOOLEAN CacheSupported,
-    BOOLEAN UnmapSupported,
-    PWSTR PipeName,
+    ULONG Engine,
     RAWDISK **PRawDisk)
 {
     RAWDISK *RawDisk = 0;
-    HANDLE Handle = INVALID_HANDLE_VALUE;
-    HANDLE Mapping = 0;
-    PVOID Pointer = 0;
+    HANDLE Handle;
     FILE_SET_SPARSE_BUFFER Sparse;
     DWORD BytesTransferred;
     LARGE_INTEGER FileSize;
     BOOLEAN ZeroSize;
     SPD_PARTITION Partition;
-    SPD_STORAGE_UNIT_PARAMS StorageUnitParams;
-    SPD_STORAGE_UNIT *StorageUnit = 0;
+    UINT8 PartitionTable[512];
+    OVERLAPPED Overlapped;
+    PVOID Buffer;
     DWORD Error;
 
     *PRawDisk = 0;
 
-    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
-    UuidCreate(&StorageUnitParams.Guid);
-    StorageUnitParams.BlockCount = BlockCount;
-    StorageUnitParams.BlockLength = BlockLength;
-    StorageUnitParams.MaxTransferLength = 64 * 1024;
-    if (0 == WideCharToMultiByte(CP_UTF8, 0,
-        ProductId, lstrlenW(ProductId),
-        StorageUnitParams.ProductId, sizeof StorageUnitParams.ProductId,
-        0, 0))
-    {
-        Error = ERROR_INVALID_PARAMETER;
-        goto exit;
-    }
-    if (0 == WideCharToMultiByte(CP_UTF8, 0,
-        ProductRevision, lstrlenW(ProductRevision),
-        StorageUnitParams.ProductRevisionLevel, sizeof StorageUnitParams.ProductRevisionLevel,
-        0, 0))
-    {
-        Error = ERROR_INVALID_PARAMETER;
-        goto exit;
-    }
-    StorageUnitParams.WriteProtected = WriteProtected;
-    StorageUnitParams.CacheSupported = CacheSupported;
-    StorageUnitParams.UnmapSupported = UnmapSupported;
-
     RawDisk = malloc(sizeof *RawDisk);
     if (0 == RawDisk)
     {
@@ -267,19 +679,32 @@ DWORD RawDiskCreate(PWSTR RawDiskFile,
         goto exit;
     }
 
-    Handle = CreateFileW(RawDiskFile,
-        GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
-    if (INVALID_HANDLE_VALUE == Handle)
+    memset(RawDisk, 0, sizeof *RawDisk);
+    RawDisk->Interface = RawDiskEngineIo == Engine ? &RawDiskIoInterface : &RawDiskInterface;
+    RawDisk->BlockCount = BlockCount;
+    RawDisk->BlockLength = BlockLength;
+    RawDisk->Handle = INVALID_HANDLE_VALUE;
+    RawDisk->WriteThroughHandle = INVALID_HANDLE_VALUE;
+    InitializeSRWLock(&RawDisk->FlushLock);
+    InitializeConditionVariable(&RawDisk->FlushCondition);
+
+    /* the I/O engine reopens the file for unbuffered and write-through access */
+    RawDisk->Handle = CreateFileW(RawDiskFile,
+        GENERIC_READ | GENERIC_WRITE,
+        RawDiskEngineIo == Engine ? FILE_SHARE_READ | FILE_SHARE_WRITE : 0,
+        0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (INVALID_HANDLE_VALUE == RawDisk->Handle)
     {
         Error = GetLastError();
         goto exit;
     }
 
     Sparse.SetSparse = TRUE;
-    Sparse.SetSparse = DeviceIoControl(Handle,
+    Sparse.SetSparse = DeviceIoControl(RawDisk->Handle,
         FSCTL_SET_SPARSE, &Sparse, sizeof Sparse, 0, 0, &BytesTransferred, 0);
+    RawDisk->Sparse = Sparse.SetSparse;
 
-    if (!GetFileSizeEx(Handle, &FileSize))
+    if (!GetFileSizeEx(RawDisk->Handle, &FileSize))
     {
         Error = GetLastError();
         goto exit;
@@ -294,22 +719,8 @@ DWORD RawDiskCreate(PWSTR RawDiskFile,
         goto exit;
     }
 
-    if (!SetFilePointerEx(Handle, FileSize, 0, FILE_BEGIN) ||
-        !SetEndOfFile(Handle))
-    {
-        Error = GetLastError();
-        goto exit;
-    }
-
-    Mapping = CreateFileMappingW(Handle, 0, PAGE_READWRITE, 0, 0, 0);
-    if (0 == Mapping)
-    {
-        Error = GetLastError();
-        goto exit;
-    }
-
-    Pointer = MapViewOfFile(Mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
-    if (0 == Pointer)
+    if (!SetFilePointerEx(RawDisk->Handle, FileSize, 0, FILE_BEGIN) ||
+        !SetEndOfFile(RawDisk->Handle))
     {
         Error = GetLastError();
         goto exit;
@@ -321,47 +732,170 @@ DWORD RawDiskCreate(PWSTR RawDiskFile,
         Partition.Type = 7;
         Partition.BlockAddress = 4096 >= BlockLength ? 4096 / BlockLength : 1;
         Partition.BlockCount = BlockCount - Partition.BlockAddress;
-        if (ERROR_SUCCESS == SpdDefinePartitionTable(&Partition, 1, Pointer))
+        if (ERROR_SUCCESS == SpdDefinePartitionTable(&Partition, 1, PartitionTable))
         {
-            FlushViewOfFile(Pointer, 0);
-            FlushFileBuffers(Handle);
+            memset(&Overlapped, 0, sizeof Overlapped);
+            WriteFile(RawDisk->Handle, PartitionTable, sizeof PartitionTable, &BytesTransferred,
+                &Overlapped);
+            FlushFileBuffers(RawDisk->Handle);
         }
     }
 
-    Error = SpdStorageUnitCreate(PipeName, &StorageUnitParams, &RawDiskInterface, &StorageUnit);
+    Error = SpdExtentMapInitialize(&RawDisk->Extents, FileSize.QuadPart, RAWDISK_EXTENT_SHIFT);
     if (ERROR_SUCCESS != Error)
         goto exit;
+    RawDiskLoadExtents(RawDisk, FileSize.QuadPart);
 
-    memset(RawDisk, 0, sizeof *RawDisk);
-    RawDisk->StorageUnit = StorageUnit;
-    RawDisk->BlockCount = BlockCount;
-    RawDisk->BlockLength = BlockLength;
-    RawDisk->Handle = Handle;
-    RawDisk->Mapping = Mapping;
-    RawDisk->Pointer = Pointer;
-    RawDisk->Sparse = Sparse.SetSparse;
-    StorageUnit->UserContext = RawDisk;
+    if (RawDiskEngineIo == Engine)
+    {
+        Handle = ReOpenFile(RawDisk->Handle,
+            GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED);
+        if (INVALID_HANDLE_VALUE == Handle)
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+        CloseHandle(RawDisk->Handle);
+        RawDisk->Handle = Handle;
+
+        RawDisk->WriteThroughHandle = ReOpenFile(RawDisk->Handle,
+            GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+            FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED | FILE_FLAG_WRITE_THROUGH);
+        if (INVALID_HANDLE_VALUE == RawDisk->WriteThroughHandle)
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+
+        /* unbuffered I/O fails unless BlockLength is a multiple of the volume sector size */
+        Buffer = IoBufferAlloc(BlockLength);
+        if (0 == Buffer)
+        {
+            Error = ERROR_NOT_ENOUGH_MEMORY;
+            goto exit;
+        }
+        Error = IoSynchronous(RawDisk->Handle, FALSE, Buffer, BlockLength, 0) ?
+            ERROR_SUCCESS : GetLastError();
+        IoBufferFree(Buffer);
+        if (ERROR_SUCCESS != Error)
+            goto exit;
+
+        RawDisk->Port = CreateIoCompletionPort(RawDisk->Handle, 0, 0, 0);
+        if (0 == RawDisk->Port ||
+            0 == CreateIoCompletionPort(RawDisk->WriteThroughHandle, RawDisk->Port, 0, 0))
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+
+        RawDisk->PortThread = CreateThread(0, 0, IoCompletionThread, RawDisk, 0, 0);
+        if (0 == RawDisk->PortThread)
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+    }
+    else
+    {
+        RawDisk->Mapping = CreateFileMappingW(RawDisk->Handle, 0, PAGE_READWRITE, 0, 0, 0);
+        if (0 == RawDisk->Mapping)
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+
+        RawDisk->Pointer = MapViewOfFile(RawDisk->Mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        if (0 == RawDisk->Pointer)
+        {
+            Error = GetLastError();
+            goto exit;
+        }
+    }
 
     *PRawDisk = RawDisk;
 
     Error = ERROR_SUCCESS;
 
 exit:
+    if (ERROR_SUCCESS != Error && 0 != RawDisk)
+        RawDiskClose(RawDisk);
+
+    return Error;
+}
+
+DWORD RawDiskCreate(PWSTR RawDiskFile,
+    UINT64 BlockCount, UINT32 BlockLength,
+    PWSTR ProductId, PWSTR ProductRevision,
+    BOOLEAN WriteProtected,
+    BOOLEAN CacheSupported,
+    BOOLEAN UnmapSupported,
+    ULONG Engine,
+    PWSTR PipeName,
+    RAWDISK **PRawDisk)
+{
+    RAWDISK *RawDisk = 0;
+    SPD_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_STORAGE_UNIT *StorageUnit = 0;
+    DWORD Error;
+
+    *PRawDisk = 0;
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    UuidCreate(&StorageUnitParams.Guid);
+    StorageUnitParams.BlockCount = BlockCount;
+    StorageUnitParams.BlockLength = BlockLength;
+    StorageUnitParams.MaxTransferLength = 64 * 1024;
+    if (0 == WideCharToMultiByte(CP_UTF8, 0,
+        ProductId, lstrlenW(ProductId),
+        StorageUnitParams.ProductId, sizeof StorageUnitParams.ProductId,
+        0, 0))
+    {
+        Error = ERROR_INVALID_PARAMETER;
+        goto exit;
+    }
+    if (0 == WideCharToMultiByte(CP_UTF8, 0,
+        ProductRevision, lstrlenW(ProductRevision),
+        StorageUnitParams.ProductRevisionLevel, sizeof StorageUnitParams.ProductRevisionLevel,
+        0, 0))
+    {
+        Error = ERROR_INVALID_PARAMETER;
+        goto exit;
+    }
+    StorageUnitParams.WriteProtected = WriteProtected;
+    StorageUnitParams.CacheSupported = CacheSupported;
+    StorageUnitParams.UnmapSupported = UnmapSupported;
+    /* holes are punched a chunk at a time; smaller UNMAP's would only write zeroes */
+    StorageUnitParams.UnmapGranularity = (1 << RAWDISK_EXTENT_SHIFT) > BlockLength ?
+        (1 << RAWDISK_EXTENT_SHIFT) / BlockLength : 1;
+
+    Error = RawDiskOpen(RawDiskFile, BlockCount, BlockLength, Engine, &RawDisk);
+    if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    Error = SpdStorageUnitCreate(PipeName, &StorageUnitParams, RawDisk->Interface, &StorageUnit);
     if (ERROR_SUCCESS != Error)
+        goto exit;
+
+    if (RawDiskEngineIo == Engine)
     {
-        if (0 != StorageUnit)
-            SpdStorageUnitDelete(StorageUnit);
+        /* unbuffered I/O goes straight to the dispatcher buffers, which must be aligned */
+        SpdStorageUnitSetBufferAllocator(StorageUnit, IoBufferAlloc, IoBufferFree);
+        SpdStorageUnitSetDispatcherAsyncDepth(StorageUnit, RAWDISK_IO_ASYNC_DEPTH);
+    }
 
-        if (0 != Pointer)
-            UnmapViewOfFile(Pointer);
+    RawDisk->StorageUnit = StorageUnit;
+    StorageUnit->UserContext = RawDisk;
 
-        if (0 != Mapping)
-            CloseHandle(Mapping);
+    *PRawDisk = RawDisk;
 
-        if (INVALID_HANDLE_VALUE != Handle)
-            CloseHandle(Handle);
+    Error = ERROR_SUCCESS;
 
-        free(RawDisk);
+exit:
+    if (ERROR_SUCCESS != Error)
+    {
+        if (0 != RawDisk)
+            RawDiskClose(RawDisk);
     }
 
     return Error;
@@ -371,13 +905,10 @@ VOID RawDiskDelete(RAWDISK *RawDisk)
 {
     SpdStorageUnitDelete(RawDisk->StorageUnit);
 
-    FlushViewOfFile(RawDisk->Pointer, 0);
-    FlushFileBuffers(RawDisk->Handle);
-    UnmapViewOfFile(RawDisk->Pointer);
-    CloseHandle(RawDisk->Mapping);
-    CloseHandle(RawDisk->Handle);
+    info(L"flushes: %lu requested, %lu issued",
+        (ULONG)RawDisk->FlushRequestCount, (ULONG)RawDisk->FlushStarted);
 
-    free(RawDisk);
+    RawDiskClose(RawDisk);
 }
 
 SPD_STORAGE_UNIT *RawDiskStorageUnit(RAWDISK *RawDisk)
@@ -385,6 +916,174 @@ SPD_STORAGE_UNIT *RawDiskStorageUnit(RAWDISK *RawDisk)
     return RawDisk->StorageUnit;
 }
 
+#define RAWDISK_BENCH_THREAD_COUNT      4
+
+typedef struct _RAWDISK_BENCH
+{
+    SPD_STORAGE_UNIT *StorageUnit;
+    BOOLEAN WriteFlag;
+    BOOLEAN Random;
+    UINT32 BlockCount;
+    volatile LONG Stop;
+    LONG64 Next;
+    LONG64 OpCount;
+    LONG64 ErrorCount;
+} RAWDISK_BENCH;
+
+static DWORD WINAPI RawDiskBenchThread(PVOID Bench0)
+{
+    RAWDISK_BENCH *Bench = Bench0;
+    SPD_STORAGE_UNIT *StorageUnit = Bench->StorageUnit;
+    UINT64 RunCount = StorageUnit->StorageUnitParams.BlockCount / Bench->BlockCount;
+    UINT32 Seed = GetCurrentThreadId();
+    UINT64 Random, BlockAddress;
+    LONG64 OpCount = 0, ErrorCount = 0;
+    SPD_STORAGE_UNIT_STATUS Status;
+    PVOID Buffer;
+
+    Buffer = IoBufferAlloc(Bench->BlockCount * StorageUnit->StorageUnitParams.BlockLength);
+    if (0 == Buffer)
+    {
+        InterlockedIncrement64(&Bench->ErrorCount);
+        return 0;
+    }
+    memset(Buffer, 0x5a, Bench->BlockCount * StorageUnit->StorageUnitParams.BlockLength);
+
+    while (!Bench->Stop)
+    {
+        if (Bench->Random)
+        {
+            Seed = Seed * 1103515245 + 12345;
+            Random = Seed >> 8;
+            Seed = Seed * 1103515245 + 12345;
+            Random = (Random << 24) | (Seed >> 8);
+            BlockAddress = Random % RunCount * Bench->BlockCount;
+        }
+        else
+            BlockAddress = (UINT64)InterlockedIncrement64(&Bench->Next) % RunCount *
+                Bench->BlockCount;
+
+        memset(&Status, 0, sizeof Status);
+        if (Bench->WriteFlag)
+            StorageUnit->Interface->Write(StorageUnit,
+                Buffer, BlockAddress, Bench->BlockCount, FALSE, &Status);
+        else
+            StorageUnit->Interface->Read(StorageUnit,
+                Buffer, BlockAddress, Bench->BlockCount, FALSE, &Status);
+        if (SCSISTAT_GOOD != Status.ScsiStatus)
+            ErrorCount++;
+        OpCount++;
+    }
+
+    InterlockedAdd64(&Bench->OpCount, OpCount);
+    InterlockedAdd64(&Bench->ErrorCount, ErrorCount);
+
+    IoBufferFree(Buffer);
+
+    return 0;
+}
+
+static DWORD RawDiskBench(PWSTR RawDiskFile,
+    UINT64 BlockCount, UINT32 BlockLength,
+    ULONG Seconds)
+{
+    static struct
+    {
+        PWSTR Name;
+        BOOLEAN WriteFlag;
+        BOOLEAN Random;
+        UINT32 Length;
+    } Tests[] =
+    {
+        /* writes first, so that the reads find allocated data */
+        { L"1M sequential write", TRUE, FALSE, 1024 * 1024 },
+        { L"4K random write", TRUE, TRUE, 4096 },
+        { L"1M sequential read", FALSE, FALSE, 1024 * 1024 },
+        { L"4K random read", FALSE, TRUE, 4096 },
+    };
+    static PWSTR EngineNames[] = { L"map", L"io" };
+    RAWDISK *RawDisk;
+    SPD_STORAGE_UNIT StorageUnit;
+    SPD_STORAGE_UNIT_STATUS Status;
+    RAWDISK_BENCH Bench;
+    HANDLE Threads[RAWDISK_BENCH_THREAD_COUNT];
+    ULONG ThreadCount;
+    LARGE_INTEGER Frequency, Start, End;
+    double Elapsed;
+    DWORD Error;
+
+    if (1024 * 1024 > BlockCount * BlockLength || 0 == Seconds)
+        return ERROR_INVALID_PARAMETER;
+
+    QueryPerformanceFrequency(&Frequency);
+
+    for (ULONG Engine = RawDiskEngineMap; RawDiskEngineIo >= Engine; Engine++)
+    {
+        Error = RawDiskOpen(RawDiskFile, BlockCount, BlockLength, Engine, &RawDisk);
+        if (ERROR_SUCCESS != Error)
+            return Error;
+
+        /* drive the engine directly: there is no dispatcher, so all I/O is synchronous */
+        memset(&StorageUnit, 0, sizeof StorageUnit);
+        StorageUnit.UserContext = RawDisk;
+        StorageUnit.StorageUnitParams.BlockCount = BlockCount;
+        StorageUnit.StorageUnitParams.BlockLength = BlockLength;
+        StorageUnit.StorageUnitParams.MaxTransferLength = 1024 * 1024;
+        StorageUnit.StorageUnitParams.CacheSupported = TRUE;
+        StorageUnit.StorageUnitParams.UnmapSupported = TRUE;
+        StorageUnit.Interface = RawDisk->Interface;
+
+        for (ULONG I = 0; sizeof Tests / sizeof Tests[0] > I; I++)
+        {
+            memset(&Bench, 0, sizeof Bench);
+            Bench.StorageUnit = &StorageUnit;
+            Bench.WriteFlag = Tests[I].WriteFlag;
+            Bench.Random = Tests[I].Random;
+            Bench.BlockCount = BlockLength < Tests[I].Length ? Tests[I].Length / BlockLength : 1;
+
+            QueryPerformanceCounter(&Start);
+
+            for (ThreadCount = 0; RAWDISK_BENCH_THREAD_COUNT > ThreadCount; ThreadCount++)
+            {
+                Threads[ThreadCount] = CreateThread(0, 0, RawDiskBenchThread, &Bench, 0, 0);
+                if (0 == Threads[ThreadCount])
+                    break;
+            }
+
+            Sleep(Seconds * 1000);
+            Bench.Stop = TRUE;
+
+            for (ULONG J = 0; ThreadCount > J; J++)
+            {
+                WaitForSingleObject(Threads[J], INFINITE);
+                CloseHandle(Threads[J]);
+            }
+
+            /* written data count only once they reach the file */
+            if (Bench.WriteFlag)
+            {
+                memset(&Status, 0, sizeof Status);
+                StorageUnit.Interface->Flush(&StorageUnit, 0, 0, &Status);
+                if (SCSISTAT_GOOD != Status.ScsiStatus)
+                    Bench.ErrorCount++;
+            }
+
+            QueryPerformanceCounter(&End);
+            Elapsed = (double)(End.QuadPart - Start.QuadPart) / Frequency.QuadPart;
+
+            info(L"%s %s: %lu IOPS, %lu MB/s%s",
+                EngineNames[Engine], Tests[I].Name,
+                (ULONG)(Bench.OpCount / Elapsed),
+                (ULONG)(Bench.OpCount * Bench.BlockCount * BlockLength / Elapsed / (1024 * 1024)),
+                0 != Bench.ErrorCount || 0 == ThreadCount ? L" (errors)" : L"");
+        }
+
+        RawDiskClose(RawDisk);
+    }
+
+    return ERROR_SUCCESS;
+}
+
 #define PROGNAME                        "rawdisk"
 
 static void usage(void)
@@ -401,6 +1100,9 @@ static void usage(void)
         "    -W 0|1                              Disable/enable writes (deflt: enable)\n"
         "    -C 0|1                              Disable/enable cache (deflt: enable)\n"
         "    -U 0|1                              Disable/enable unmap (deflt: enable)\n"
+        "    -e map|io                           Memory mapped or unbuffered I/O (deflt: map)\n"
+        "    -b Seconds                          Benchmark both engines and exit;\n"
+        "                                        overwrites RawDiskFile\n"
         "    -d -1                               Debug flags\n"
         "    -D DebugLogFile                     Debug log file; - for stderr\n"
         "    -p \\\\.\\pipe\\PipeName                Listen on pipe; omit to use driver\n"
@@ -446,6 +1148,9 @@ int wmain(int argc, wchar_t **argv)
     ULONG WriteAllowed = 1;
     ULONG CacheSupported = 1;
     ULONG UnmapSupported = 1;
+    PWSTR EngineName = L"map";
+    ULONG Engine = RawDiskEngineMap;
+    ULONG BenchSeconds = 0;
     ULONG DebugFlags = 0;
     PWSTR DebugLogFile = 0;
     HANDLE DebugLogHandle = INVALID_HANDLE_VALUE;
@@ -462,6 +1167,9 @@ int wmain(int argc, wchar_t **argv)
         case L'?':
             usage();
             break;
+        case L'b':
+            BenchSeconds = argtol(++argp, BenchSeconds);
+            break;
         case L'c':
             BlockCount = argtol(++argp, BlockCount);
             break;
@@ -474,6 +1182,9 @@ int wmain(int argc, wchar_t **argv)
         case L'D':
             DebugLogFile = argtos(++argp);
             break;
+        case L'e':
+            EngineName = argtos(++argp);
+            break;
         case L'f':
             RawDiskFile = argtos(++argp);
             break;
@@ -504,6 +1215,13 @@ int wmain(int argc, wchar_t **argv)
     if (0 != argp[0] || 0 == RawDiskFile)
         usage();
 
+    if (0 == lstrcmpW(EngineName, L"map"))
+        Engine = RawDiskEngineMap;
+    else if (0 == lstrcmpW(EngineName, L"io"))
+        Engine = RawDiskEngineIo;
+    else
+        usage();
+
     if (0 != DebugLogFile)
     {
         if (L'-' == DebugLogFile[0] && L'\0' == DebugLogFile[1])
@@ -523,12 +1241,22 @@ int wmain(int argc, wchar_t **argv)
         SpdDebugLogSetHandle(DebugLogHandle);
     }
 
+    if (0 != BenchSeconds)
+    {
+        Error = RawDiskBench(RawDiskFile, BlockCount, BlockLength, BenchSeconds);
+        if (0 != Error)
+            fail(Error, L"error: cannot benchmark RawDisk: error %lu", Error);
+
+        return 0;
+    }
+
     Error = RawDiskCreate(RawDiskFile,
         BlockCount, BlockLength,
         ProductId, ProductRevision,
         !WriteAllowed,
         !!CacheSupported,
         !!UnmapSupported,
+        Engine,
         PipeName,
         &RawDisk);
     if (0 != Error)
@@ -538,13 +1266,14 @@ int wmain(int argc, wchar_t **argv)
     if (0 != Error)
         fail(Error, L"error: cannot start RawDisk: error %lu", Error);
 
-    info(L"%s -f %s -c %lu -l %lu -i %s -r %s -W %u -C %u -U %u%s%s",
+    info(L"%s -f %s -c %lu -l %lu -i %s -r %s -W %u -C %u -U %u -e %s%s%s",
         L"" PROGNAME,
         RawDiskFile,
         BlockCount, BlockLength, ProductId, ProductRevision,
         !!WriteAllowed,
         !!CacheSupported,
         !!UnmapSupported,
+        EngineName,
         0 != PipeName ? L" -p " : L"",
         0 != PipeName ? PipeName : L"");
 
@@ -0,0 +1,278 @@
+/**
+ * @file batch-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winspd/winspd.h>
+#include <shared/batch.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+/*
+ * User mode stand-in for SPD_IOQ.
+ *
+ * It models an initiator that keeps Depth requests outstanding until Total requests
+ * have been issued. Every completed request lets the initiator issue a new one.
+ */
+#define TEST_IOQ_MAX                    4096
+#define TEST_DATA_STRIDE                64
+typedef struct
+{
+    UINT64 Pending[TEST_IOQ_MAX];
+    ULONG PendingHead, PendingCount;
+    UINT8 Processing[TEST_IOQ_MAX + 1];
+    ULONG Total, Posted, Completed;
+    BOOLEAN Stopped;
+} TEST_IOQ;
+
+static VOID TestIoqPost(TEST_IOQ *Ioq)
+{
+    ASSERT(TEST_IOQ_MAX > Ioq->PendingCount);
+    Ioq->Pending[(Ioq->PendingHead + Ioq->PendingCount++) % TEST_IOQ_MAX] = ++Ioq->Posted;
+}
+
+static VOID TestIoqInit(TEST_IOQ *Ioq, ULONG Total, ULONG Depth)
+{
+    memset(Ioq, 0, sizeof *Ioq);
+    Ioq->Total = Total;
+    while (Ioq->Posted < Total && Ioq->Posted < Depth)
+        TestIoqPost(Ioq);
+}
+
+static VOID TestIoqEndProcessing(PVOID Context,
+    SPD_IOCTL_TRANSACT_RSP *Rsp, PVOID DataBuffer)
+{
+    TEST_IOQ *Ioq = Context;
+
+    ASSERT(0 < Rsp->Hint && Ioq->Posted >= Rsp->Hint);
+    ASSERT(Ioq->Processing[Rsp->Hint]);
+    ASSERT(SpdIoctlTransactReadKind == Rsp->Kind);
+    ASSERT(~Rsp->Hint == *(PUINT64)DataBuffer);
+
+    Ioq->Processing[Rsp->Hint] = 0;
+    Ioq->Completed++;
+
+    if (Ioq->Posted < Ioq->Total)
+        TestIoqPost(Ioq);
+}
+
+static LONG TestIoqStartProcessing(PVOID Context, BOOLEAN Wait,
+    SPD_IOCTL_TRANSACT_REQ *Req, PVOID DataBuffer)
+{
+    TEST_IOQ *Ioq = Context;
+    UINT64 Hint;
+
+    /* a single threaded stand-in cannot block, so Wait behaves like a poll */
+    if (Ioq->Stopped)
+        return SpdBatchStartCancelled;
+    if (0 == Ioq->PendingCount)
+        return SpdBatchStartEmpty;
+
+    Hint = Ioq->Pending[Ioq->PendingHead];
+    Ioq->PendingHead = (Ioq->PendingHead + 1) % TEST_IOQ_MAX;
+    Ioq->PendingCount--;
+
+    ASSERT(!Ioq->Processing[Hint]);
+    Ioq->Processing[Hint] = 1;
+
+    memset(Req, 0, sizeof *Req);
+    Req->Hint = Hint;
+    Req->Kind = SpdIoctlTransactReadKind;
+    Req->Op.Read.BlockAddress = Hint;
+    Req->Op.Read.BlockCount = 1;
+    *(PUINT64)DataBuffer = 0;
+
+    return SpdBatchStartSuccess;
+}
+
+static SPD_BATCH_IOQ_INTERFACE TestIoqInterface =
+{
+    TestIoqEndProcessing,
+    TestIoqStartProcessing,
+};
+
+/* run a dispatcher over the stand-in queue and return the number of transact calls */
+static ULONG batch_dispatch(TEST_IOQ *Ioq, ULONG BatchSize)
+{
+    SPD_IOCTL_TRANSACT_BATCH_ENTRY *Entries;
+    PUINT8 DataBuffer;
+    ULONG Calls, ReqCount;
+    LONG Result;
+
+    Entries = calloc(BatchSize, sizeof *Entries);
+    DataBuffer = calloc(BatchSize, TEST_DATA_STRIDE);
+    ASSERT(0 != Entries && 0 != DataBuffer);
+
+    for (ULONG I = 0; BatchSize > I; I++)
+        Entries[I].ReqValid = 1;
+
+    for (Calls = 0;;)
+    {
+        Result = SpdTransactBatch(&TestIoqInterface, Ioq,
+            Entries, BatchSize, DataBuffer, TEST_DATA_STRIDE, &ReqCount);
+        Calls++;
+        ASSERT(SpdBatchStartSuccess == Result);
+        ASSERT(BatchSize >= ReqCount);
+
+        if (0 == ReqCount)
+            break;
+
+        for (ULONG I = 0; BatchSize > I; I++)
+        {
+            SPD_IOCTL_TRANSACT_BATCH_ENTRY *Entry = &Entries[I];
+            UINT64 Hint;
+
+            ASSERT(!Entry->RspValid);
+            if (!Entry->ReqValid)
+            {
+                Entry->ReqValid = 1;
+                continue;
+            }
+
+            ASSERT(SpdIoctlTransactReadKind == Entry->Dir.Req.Kind);
+            ASSERT(Entry->Dir.Req.Hint == Entry->Dir.Req.Op.Read.BlockAddress);
+            ASSERT(0 == *(PUINT64)(DataBuffer + I * TEST_DATA_STRIDE));
+
+            Hint = Entry->Dir.Req.Hint;
+            *(PUINT64)(DataBuffer + I * TEST_DATA_STRIDE) = ~Hint;
+
+            memset(&Entry->Dir.Rsp, 0, sizeof Entry->Dir.Rsp);
+            Entry->Dir.Rsp.Hint = Hint;
+            Entry->Dir.Rsp.Kind = SpdIoctlTransactReadKind;
+            Entry->RspValid = 1;
+        }
+    }
+
+    free(DataBuffer);
+    free(Entries);
+
+    return Calls;
+}
+
+static void batch_transact_dotest(ULONG Total, ULONG Depth, ULONG BatchSize)
+{
+    TEST_IOQ *Ioq;
+
+    Ioq = malloc(sizeof *Ioq);
+    ASSERT(0 != Ioq);
+
+    TestIoqInit(Ioq, Total, Depth);
+    batch_dispatch(Ioq, BatchSize);
+
+    ASSERT(Total == Ioq->Posted);
+    ASSERT(Total == Ioq->Completed);
+    ASSERT(0 == Ioq->PendingCount);
+    for (ULONG I = 1; Total >= I; I++)
+        ASSERT(0 == Ioq->Processing[I]);
+
+    free(Ioq);
+}
+
+static void batch_transact_test(void)
+{
+    batch_transact_dotest(1000, 1, 1);
+    batch_transact_dotest(1000, 1, 16);
+    batch_transact_dotest(1000, 16, 1);
+    batch_transact_dotest(1000, 16, 4);
+    batch_transact_dotest(1000, 16, 16);
+    batch_transact_dotest(1000, 16, 64);
+    batch_transact_dotest(1000, 64, SPD_IOCTL_TRANSACT_BATCH_MAX);
+}
+
+static void batch_cancel_test(void)
+{
+    SPD_IOCTL_TRANSACT_BATCH_ENTRY Entries[4];
+    UINT8 DataBuffer[4 * TEST_DATA_STRIDE];
+    TEST_IOQ *Ioq;
+    ULONG ReqCount;
+    LONG Result;
+
+    Ioq = malloc(sizeof *Ioq);
+    ASSERT(0 != Ioq);
+
+    /* requests already started are handed out even if the queue stops afterwards */
+    TestIoqInit(Ioq, 2, 2);
+    memset(Entries, 0, sizeof Entries);
+    for (ULONG I = 0; 4 > I; I++)
+        Entries[I].ReqValid = 1;
+    Result = SpdTransactBatch(&TestIoqInterface, Ioq,
+        Entries, 4, DataBuffer, TEST_DATA_STRIDE, &ReqCount);
+    ASSERT(SpdBatchStartSuccess == Result);
+    ASSERT(2 == ReqCount);
+    ASSERT(Entries[0].ReqValid && Entries[1].ReqValid);
+    ASSERT(!Entries[2].ReqValid && !Entries[3].ReqValid);
+
+    /* responses are delivered even if the queue is stopped */
+    Ioq->Stopped = TRUE;
+    for (ULONG I = 0; 2 > I; I++)
+    {
+        UINT64 Hint = Entries[I].Dir.Req.Hint;
+        *(PUINT64)(DataBuffer + I * TEST_DATA_STRIDE) = ~Hint;
+        memset(&Entries[I].Dir.Rsp, 0, sizeof Entries[I].Dir.Rsp);
+        Entries[I].Dir.Rsp.Hint = Hint;
+        Entries[I].Dir.Rsp.Kind = SpdIoctlTransactReadKind;
+        Entries[I].RspValid = 1;
+    }
+    for (ULONG I = 0; 4 > I; I++)
+        Entries[I].ReqValid = 1;
+    Result = SpdTransactBatch(&TestIoqInterface, Ioq,
+        Entries, 4, DataBuffer, TEST_DATA_STRIDE, &ReqCount);
+    ASSERT(SpdBatchStartCancelled == Result);
+    ASSERT(0 == ReqCount);
+    ASSERT(2 == Ioq->Completed);
+    for (ULONG I = 0; 4 > I; I++)
+        ASSERT(!Entries[I].ReqValid && !Entries[I].RspValid);
+
+    free(Ioq);
+}
+
+static void batch_syscall_count_test(void)
+{
+    static ULONG BatchSizes[] = { 1, 8, 32 };
+    ULONG Total = 4000, Depth = 32;
+    ULONG Calls, PrevCalls = 0;
+    TEST_IOQ *Ioq;
+
+    Ioq = malloc(sizeof *Ioq);
+    ASSERT(0 != Ioq);
+
+    for (ULONG I = 0; sizeof BatchSizes / sizeof BatchSizes[0] > I; I++)
+    {
+        TestIoqInit(Ioq, Total, Depth);
+        Calls = batch_dispatch(Ioq, BatchSizes[I]);
+        ASSERT(Total == Ioq->Completed);
+
+        tlib_printf("batch=%u calls/io=%u.%03u ",
+            (unsigned)BatchSizes[I],
+            (unsigned)(Calls / Total), (unsigned)(Calls % Total * 1000 / Total));
+
+        if (0 != PrevCalls)
+            ASSERT(Calls < PrevCalls);
+        PrevCalls = Calls;
+    }
+
+    free(Ioq);
+}
+
+void batch_tests(void)
+{
+    TEST(batch_transact_test);
+    TEST(batch_cancel_test);
+    TEST(batch_syscall_count_test);
+}
@@ -0,0 +1,362 @@
+/**
+ * @file bcache-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#if defined(_WIN32)
+#include <winspd/winspd.h>
+#else
+#include <shared/posix.h>
+#include <winspd/ioctl.h>
+#endif
+#include <shared/bcache.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+#define TEST_BLOCK_LENGTH               16
+
+static ULONG bcache_random(PULONG PSeed)
+{
+    *PSeed = *PSeed * 1103515245 + 12345;
+    return *PSeed >> 8;
+}
+
+/* block data are derived from the block address and a version, so that stale data show */
+static void bcache_block(PUINT8 Buffer, UINT64 BlockAddress, UINT32 BlockCount, UINT8 Version)
+{
+    for (UINT32 I = 0; BlockCount > I; I++)
+    {
+        UINT64 Address = BlockAddress + I;
+        memset(Buffer + I * TEST_BLOCK_LENGTH, Version, TEST_BLOCK_LENGTH);
+        memcpy(Buffer + I * TEST_BLOCK_LENGTH, &Address, sizeof Address);
+    }
+}
+
+static SPD_BCACHE *bcache_create(ULONG EntryCount)
+{
+    SPD_BCACHE *Cache;
+    PVOID Buffer;
+
+    Cache = malloc(sizeof *Cache);
+    ASSERT(0 != Cache);
+    Buffer = malloc((size_t)SpdBcacheBufferSize(EntryCount, TEST_BLOCK_LENGTH));
+    ASSERT(0 != Buffer);
+    SpdBcacheInitialize(Cache, Buffer, EntryCount, TEST_BLOCK_LENGTH);
+
+    return Cache;
+}
+
+static void bcache_delete(SPD_BCACHE *Cache)
+{
+    free(Cache->Data);
+    free(Cache);
+}
+
+static void bcache_read_test(void)
+{
+    SPD_BCACHE *Cache;
+    UINT8 Buffer[8 * TEST_BLOCK_LENGTH], Expected[8 * TEST_BLOCK_LENGTH];
+    UINT64 Generation;
+
+    Cache = bcache_create(32);
+
+    ASSERT(!SpdBcacheRead(Cache, 100, 4, Buffer));
+
+    Generation = SpdBcacheGeneration(Cache);
+    bcache_block(Expected, 100, 4, 1);
+    SpdBcacheFill(Cache, Generation, 100, 4, Expected);
+    ASSERT(4 == Cache->FillCount);
+
+    /* a hit must be complete; a part of the range is a miss */
+    memset(Buffer, 0, sizeof Buffer);
+    ASSERT(SpdBcacheRead(Cache, 100, 4, Buffer));
+    ASSERT(0 == memcmp(Buffer, Expected, 4 * TEST_BLOCK_LENGTH));
+    ASSERT(SpdBcacheRead(Cache, 101, 2, Buffer));
+    ASSERT(0 == memcmp(Buffer, Expected + TEST_BLOCK_LENGTH, 2 * TEST_BLOCK_LENGTH));
+    ASSERT(!SpdBcacheRead(Cache, 98, 4, Buffer));
+    ASSERT(!SpdBcacheRead(Cache, 103, 2, Buffer));
+    ASSERT(2 == Cache->HitCount);
+    ASSERT(3 == Cache->MissCount);
+
+    /* filling again replaces the data */
+    bcache_block(Expected, 102, 4, 2);
+    SpdBcacheFill(Cache, Generation, 102, 4, Expected);
+    ASSERT(6 == Cache->FillCount);
+    ASSERT(SpdBcacheRead(Cache, 102, 4, Buffer));
+    ASSERT(0 == memcmp(Buffer, Expected, 4 * TEST_BLOCK_LENGTH));
+
+    /* more than a quarter of the cache is not cached */
+    bcache_block(Expected, 200, 8, 1);
+    SpdBcacheFill(Cache, Generation, 200, 8, Expected);
+    ASSERT(SpdBcacheRead(Cache, 200, 8, Buffer));
+    bcache_block(Expected, 300, 8, 1);
+    SpdBcacheFill(Cache, Generation, 300, 8, Expected);
+    ASSERT(SpdBcacheRead(Cache, 300, 8, Buffer));
+    {
+        UINT8 Large[9 * TEST_BLOCK_LENGTH];
+        bcache_block(Large, 400, 9, 1);
+        SpdBcacheFill(Cache, Generation, 400, 9, Large);
+        ASSERT(!SpdBcacheRead(Cache, 400, 1, Buffer));
+    }
+
+    bcache_delete(Cache);
+}
+
+static void bcache_invalidate_test(void)
+{
+    SPD_BCACHE *Cache;
+    UINT8 Buffer[8 * TEST_BLOCK_LENGTH], Expected[8 * TEST_BLOCK_LENGTH];
+    UINT64 Generation;
+
+    Cache = bcache_create(32);
+
+    Generation = SpdBcacheGeneration(Cache);
+    bcache_block(Expected, 100, 8, 1);
+    SpdBcacheFill(Cache, Generation, 100, 8, Expected);
+
+    /* a small range is looked up block by block */
+    SpdBcacheInvalidate(Cache, 102, 2);
+    ASSERT(2 == Cache->InvalidateCount);
+    ASSERT(SpdBcacheRead(Cache, 100, 2, Buffer));
+    ASSERT(!SpdBcacheRead(Cache, 101, 2, Buffer));
+    ASSERT(!SpdBcacheRead(Cache, 103, 1, Buffer));
+    ASSERT(SpdBcacheRead(Cache, 104, 4, Buffer));
+
+    /* a read posted before the invalidation does not fill the cache */
+    bcache_block(Expected, 102, 2, 1);
+    SpdBcacheFill(Cache, Generation, 102, 2, Expected);
+    ASSERT(!SpdBcacheRead(Cache, 102, 1, Buffer));
+
+    /* a read posted after it does */
+    Generation = SpdBcacheGeneration(Cache);
+    bcache_block(Expected, 102, 2, 2);
+    SpdBcacheFill(Cache, Generation, 102, 2, Expected);
+    ASSERT(SpdBcacheRead(Cache, 100, 8, Buffer));
+    ASSERT(0 == memcmp(Buffer + 2 * TEST_BLOCK_LENGTH, Expected, 2 * TEST_BLOCK_LENGTH));
+
+    /* a large range scans the cache */
+    SpdBcacheInvalidate(Cache, 0, 1ULL << 40);
+    ASSERT(10 == Cache->InvalidateCount);
+    for (UINT64 I = 100; 108 > I; I++)
+        ASSERT(!SpdBcacheRead(Cache, I, 1, Buffer));
+
+    bcache_delete(Cache);
+}
+
+static void bcache_evict_test(void)
+{
+    SPD_BCACHE *Cache;
+    UINT8 Buffer[TEST_BLOCK_LENGTH];
+    UINT64 Generation;
+
+    Cache = bcache_create(16);
+    Generation = SpdBcacheGeneration(Cache);
+
+    for (UINT64 I = 0; 16 > I; I++)
+    {
+        bcache_block(Buffer, I, 1, 1);
+        SpdBcacheFill(Cache, Generation, I, 1, Buffer);
+    }
+    ASSERT(0 == Cache->EvictCount);
+
+    /* blocks that are hit survive a scan; the others are evicted first */
+    for (UINT64 I = 0; 4 > I; I++)
+        ASSERT(SpdBcacheRead(Cache, I, 1, Buffer));
+    for (UINT64 I = 100; 112 > I; I++)
+    {
+        bcache_block(Buffer, I, 1, 1);
+        SpdBcacheFill(Cache, Generation, I, 1, Buffer);
+    }
+    ASSERT(12 == Cache->EvictCount);
+    for (UINT64 I = 0; 4 > I; I++)
+    {
+        ASSERT(SpdBcacheRead(Cache, I, 1, Buffer));
+        ASSERT(I == *(UINT64 *)Buffer);
+    }
+    for (UINT64 I = 4; 16 > I; I++)
+        ASSERT(!SpdBcacheRead(Cache, I, 1, Buffer));
+
+    bcache_delete(Cache);
+}
+
+/*
+ * Model test: random reads, writes and unmaps against a disk whose every block has a
+ * version. Reads are served from the cache when it can and must always see the latest
+ * version; some reads race with writes (they are posted before a write and complete after
+ * it) and must never leave stale data in the cache.
+ */
+static void bcache_model_dotest(ULONG EntryCount, ULONG Seed)
+{
+    enum { BlockCount = 256, RangeMax = 8, Rounds = 20000 };
+    SPD_BCACHE *Cache;
+    UINT8 Versions[BlockCount] = { 0 };
+    UINT8 Buffer[RangeMax * TEST_BLOCK_LENGTH], Expected[RangeMax * TEST_BLOCK_LENGTH];
+    UINT64 BlockAddress, Generation;
+    UINT32 Count;
+
+    Cache = bcache_create(EntryCount);
+
+    for (ULONG Round = 0; Rounds > Round; Round++)
+    {
+        Count = 1 + bcache_random(&Seed) % RangeMax;
+        BlockAddress = bcache_random(&Seed) % (BlockCount - Count + 1);
+
+        switch (bcache_random(&Seed) % 10)
+        {
+        case 0:
+            /* write (or unmap): invalidate when posted and when completed */
+            SpdBcacheInvalidate(Cache, BlockAddress, Count);
+            for (UINT32 I = 0; Count > I; I++)
+                Versions[BlockAddress + I]++;
+            SpdBcacheInvalidate(Cache, BlockAddress, Count);
+            break;
+
+        case 1:
+            /* a read that races with a write: it is served the old data and completes last */
+            Generation = SpdBcacheGeneration(Cache);
+            for (UINT32 I = 0; Count > I; I++)
+                bcache_block(Buffer + I * TEST_BLOCK_LENGTH, BlockAddress + I, 1,
+                    Versions[BlockAddress + I]);
+            SpdBcacheInvalidate(Cache, BlockAddress, Count);
+            for (UINT32 I = 0; Count > I; I++)
+                Versions[BlockAddress + I]++;
+            SpdBcacheInvalidate(Cache, BlockAddress, Count);
+            SpdBcacheFill(Cache, Generation, BlockAddress, Count, Buffer);
+            break;
+
+        case 2:
+            /* a read posted after a write, but served before it: the write completes last */
+            SpdBcacheInvalidate(Cache, BlockAddress, Count);
+            Generation = SpdBcacheGeneration(Cache);
+            for (UINT32 I = 0; Count > I; I++)
+                bcache_block(Buffer + I * TEST_BLOCK_LENGTH, BlockAddress + I, 1,
+                    Versions[BlockAddress + I]);
+            SpdBcacheFill(Cache, Generation, BlockAddress, Count, Buffer);
+            for (UINT32 I = 0; Count > I; I++)
+                Versions[BlockAddress + I]++;
+            SpdBcacheInvalidate(Cache, BlockAddress, Count);
+            break;
+
+        default:
+            /* read */
+            for (UINT32 I = 0; Count > I; I++)
+                bcache_block(Expected + I * TEST_BLOCK_LENGTH, BlockAddress + I, 1,
+                    Versions[BlockAddress + I]);
+            Generation = SpdBcacheGeneration(Cache);
+            if (SpdBcacheRead(Cache, BlockAddress, Count, Buffer))
+                ASSERT(0 == memcmp(Buffer, Expected, Count * TEST_BLOCK_LENGTH));
+            else
+                SpdBcacheFill(Cache, Generation, BlockAddress, Count, Expected);
+            break;
+        }
+    }
+
+    ASSERT(0 < Cache->HitCount);
+
+    bcache_delete(Cache);
+}
+
+static void bcache_model_test(void)
+{
+    bcache_model_dotest(32, 1);
+    bcache_model_dotest(64, 2);
+    bcache_model_dotest(1024, 3);
+}
+
+/*
+ * Hit rate benchmark: a boot-like read workload over a large disk. Most reads go to a
+ * hot set of blocks that is re-read over and over; the others are a sequential scan
+ * that is never re-read and an occasional write to the hot set. We report the share of
+ * read requests that the cache serves, for caches smaller and larger than the hot set.
+ */
+static void bcache_bench_dotest(ULONG EntryCount)
+{
+    enum { HotCount = 4096, Rounds = 400000 };
+    SPD_BCACHE *Cache;
+    UINT8 Buffer[8 * TEST_BLOCK_LENGTH];
+    UINT64 BlockAddress, Generation, ScanAddress = 1 << 20;
+    UINT32 Count;
+    ULONG Seed = 1, Reads = 0;
+
+    Cache = bcache_create(EntryCount);
+    memset(Buffer, 0, sizeof Buffer);
+
+    for (ULONG Round = 0; Rounds > Round; Round++)
+    {
+        ULONG R = bcache_random(&Seed) % 100;
+        if (R < 70)
+        {
+            /* hot set: skewed, so that some hot blocks are hotter than others */
+            ULONG X = bcache_random(&Seed) % HotCount;
+            BlockAddress = (UINT64)X * X / HotCount * 8;
+            Count = 8;
+        }
+        else if (R < 99)
+        {
+            BlockAddress = ScanAddress;
+            Count = 8;
+            ScanAddress += Count;
+        }
+        else
+        {
+            BlockAddress = (UINT64)(bcache_random(&Seed) % HotCount) * 8;
+            SpdBcacheInvalidate(Cache, BlockAddress, 8);
+            SpdBcacheInvalidate(Cache, BlockAddress, 8);
+            continue;
+        }
+
+        Reads++;
+        Generation = SpdBcacheGeneration(Cache);
+        if (!SpdBcacheRead(Cache, BlockAddress, Count, Buffer))
+            SpdBcacheFill(Cache, Generation, BlockAddress, Count, Buffer);
+    }
+
+    ASSERT(Reads == Cache->HitCount + Cache->MissCount);
+    tlib_printf("blocks=%u hit=%u%% ",
+        (unsigned)EntryCount, (unsigned)(Cache->HitCount * 100 / Reads));
+
+    bcache_delete(Cache);
+}
+
+static void bcache_bench_test(void)
+{
+    bcache_bench_dotest(4096);
+    bcache_bench_dotest(16384);
+    bcache_bench_dotest(65536);
+}
+
+void bcache_tests(void)
+{
+    TEST(bcache_read_test);
+    TEST(bcache_invalidate_test);
+    TEST(bcache_evict_test);
+    TEST(bcache_model_test);
+    TEST_OPT(bcache_bench_test);
+}
+
+#if !defined(_WIN32)
+int main(int argc, char *argv[])
+{
+    TESTSUITE(bcache_tests);
+
+    tlib_run_tests(argc, argv);
+
+    return 0;
+}
+#endif
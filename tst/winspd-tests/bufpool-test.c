@@ -0,0 +1,241 @@
+/**
+ * @file bufpool-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#if defined(_WIN32)
+#include <winspd/winspd.h>
+#include <process.h>
+#else
+#include <shared/posix.h>
+#include <winspd/ioctl.h>
+#endif
+#include <shared/bufpool.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+static void bufpool_class_test(void)
+{
+    ASSERT(0 == SpdBufferPoolClass(0));
+    ASSERT(0 == SpdBufferPoolClass(1));
+    ASSERT(0 == SpdBufferPoolClass(512));
+    ASSERT(1 == SpdBufferPoolClass(513));
+    ASSERT(3 == SpdBufferPoolClass(4096));
+    ASSERT(8 == SpdBufferPoolClass(64 * 1024 + 1));
+    ASSERT(SPD_BUFFER_POOL_CLASS_COUNT - 1 == SpdBufferPoolClass(16 * 1024 * 1024));
+    ASSERT(SPD_BUFFER_POOL_CLASS_COUNT == SpdBufferPoolClass(16 * 1024 * 1024 + 1));
+}
+
+static void bufpool_reuse_test(void)
+{
+    SPD_BUFFER_POOL Pool;
+    PVOID Buffers[SPD_BUFFER_POOL_CACHE_MAX + 8], Buffer;
+
+    SpdBufferPoolInitialize(&Pool);
+
+    /* a freed buffer comes back for any size in the same class (LIFO) */
+    Buffer = SpdBufferPoolAlloc(&Pool, 4096);
+    ASSERT(0 != Buffer);
+    ASSERT(0 == ((UINT_PTR)Buffer & (MEMORY_ALLOCATION_ALIGNMENT - 1)));
+    memset(Buffer, 0xcd, 4096);
+    SpdBufferPoolFree(&Pool, Buffer);
+    ASSERT(Buffer == SpdBufferPoolAlloc(&Pool, 2049));
+    ASSERT(1 == Pool.AllocCount);
+
+    /* but not for a different class */
+    Buffers[0] = SpdBufferPoolAlloc(&Pool, 512);
+    ASSERT(0 != Buffers[0] && Buffer != Buffers[0]);
+    ASSERT(2 == Pool.AllocCount);
+    SpdBufferPoolFree(&Pool, Buffers[0]);
+    SpdBufferPoolFree(&Pool, Buffer);
+
+    /* each class caches a bounded number of buffers */
+    for (ULONG I = 0; sizeof Buffers / sizeof Buffers[0] > I; I++)
+    {
+        Buffers[I] = SpdBufferPoolAlloc(&Pool, 1024);
+        ASSERT(0 != Buffers[I]);
+    }
+    for (ULONG I = 0; sizeof Buffers / sizeof Buffers[0] > I; I++)
+        SpdBufferPoolFree(&Pool, Buffers[I]);
+    ASSERT(SPD_BUFFER_POOL_CACHE_MAX == QueryDepthSList(&Pool.FreeLists[1]));
+
+    /* oversize buffers are never cached */
+    Buffer = SpdBufferPoolAlloc(&Pool, 16 * 1024 * 1024 + 1);
+    ASSERT(0 != Buffer);
+    SpdBufferPoolFree(&Pool, Buffer);
+    for (ULONG I = 0; SPD_BUFFER_POOL_CLASS_COUNT > I; I++)
+        ASSERT(SPD_BUFFER_POOL_CACHE_MAX >= QueryDepthSList(&Pool.FreeLists[I]));
+
+    SpdBufferPoolFree(&Pool, 0);
+
+    SpdBufferPoolFinalize(&Pool);
+    ASSERT(0 == Pool.CacheSize);
+
+    /* all classes together cache a bounded number of bytes */
+    for (ULONG I = 0; SPD_BUFFER_POOL_CACHE_SIZE_MAX / (16 * 1024 * 1024) + 2 > I; I++)
+    {
+        Buffers[I] = SpdBufferPoolAlloc(&Pool, 16 * 1024 * 1024);
+        ASSERT(0 != Buffers[I]);
+    }
+    for (ULONG I = 0; SPD_BUFFER_POOL_CACHE_SIZE_MAX / (16 * 1024 * 1024) + 2 > I; I++)
+        SpdBufferPoolFree(&Pool, Buffers[I]);
+    ASSERT(SPD_BUFFER_POOL_CACHE_SIZE_MAX / (16 * 1024 * 1024) ==
+        QueryDepthSList(&Pool.FreeLists[SPD_BUFFER_POOL_CLASS_COUNT - 1]));
+    ASSERT(SPD_BUFFER_POOL_CACHE_SIZE_MAX == Pool.CacheSize);
+    Buffer = SpdBufferPoolAlloc(&Pool, 512);
+    SpdBufferPoolFree(&Pool, Buffer);
+    ASSERT(0 == QueryDepthSList(&Pool.FreeLists[0]));
+    Buffer = SpdBufferPoolAlloc(&Pool, 16 * 1024 * 1024);
+    ASSERT(SPD_BUFFER_POOL_CACHE_SIZE_MAX - 16 * 1024 * 1024 == Pool.CacheSize);
+    SpdBufferPoolFree(&Pool, Buffer);
+
+    SpdBufferPoolFinalize(&Pool);
+    for (ULONG I = 0; SPD_BUFFER_POOL_CLASS_COUNT > I; I++)
+        ASSERT(0 == QueryDepthSList(&Pool.FreeLists[I]));
+}
+
+/*
+ * Benchmark harness.
+ *
+ * Each iteration models the buffer lifecycle of one pipe transact: allocate a message
+ * buffer large enough for a header and MaxTransferLength bytes of data, write the
+ * header and a small data payload, then free the buffer. The heap variant is what the
+ * pipe transact did before it used a buffer pool.
+ */
+#define BUFPOOL_TEST_MSG_SIZE           64
+#define BUFPOOL_TEST_THREAD_MAX         8
+
+typedef struct
+{
+    SPD_BUFFER_POOL Pool;
+    BOOLEAN UsePool;
+    ULONG MaxTransferLength, DataLength;
+    ULONG Count;
+    LONG Failed;
+} BUFPOOL_TEST_DATA;
+
+static unsigned __stdcall bufpool_bench_thread(void *Data0)
+{
+    BUFPOOL_TEST_DATA *Data = Data0;
+    size_t Size = BUFPOOL_TEST_MSG_SIZE + Data->MaxTransferLength;
+    PUINT8 Msg;
+
+    for (ULONG I = 0; Data->Count > I; I++)
+    {
+        Msg = Data->UsePool ?
+            SpdBufferPoolAlloc(&Data->Pool, Size) :
+            HeapAlloc(GetProcessHeap(), 0, Size);
+        if (0 == Msg)
+        {
+            InterlockedIncrement(&Data->Failed);
+            break;
+        }
+
+        memset(Msg, (UINT8)I, BUFPOOL_TEST_MSG_SIZE + Data->DataLength);
+
+        if (Data->UsePool)
+            SpdBufferPoolFree(&Data->Pool, Msg);
+        else
+            HeapFree(GetProcessHeap(), 0, Msg);
+    }
+
+    return 0;
+}
+
+static void bufpool_bench_dotest(BOOLEAN UsePool, ULONG ThreadCount,
+    ULONG MaxTransferLength, ULONG DataLength, ULONG Count)
+{
+    BUFPOOL_TEST_DATA *Data;
+    HANDLE Threads[BUFPOOL_TEST_THREAD_MAX];
+    LARGE_INTEGER Frequency, Start, Stop;
+    UINT64 Nanoseconds, AllocCount;
+
+    ASSERT(BUFPOOL_TEST_THREAD_MAX >= ThreadCount);
+
+    Data = calloc(1, sizeof *Data);
+    ASSERT(0 != Data);
+    SpdBufferPoolInitialize(&Data->Pool);
+    Data->UsePool = UsePool;
+    Data->MaxTransferLength = MaxTransferLength;
+    Data->DataLength = DataLength;
+    Data->Count = Count;
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, bufpool_bench_thread, Data, 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        CloseHandle(Threads[I]);
+    }
+
+    QueryPerformanceCounter(&Stop);
+
+    ASSERT(0 == Data->Failed);
+
+    Nanoseconds = (UINT64)(Stop.QuadPart - Start.QuadPart) * 1000000000 /
+        Frequency.QuadPart / ((UINT64)Count * ThreadCount);
+    AllocCount = UsePool ? (UINT64)Data->Pool.AllocCount : (UINT64)Count * ThreadCount;
+
+    /* a warm pool allocates at most once per thread racing on a size class */
+    if (UsePool)
+        ASSERT(ThreadCount >= AllocCount);
+
+    tlib_printf("%s/%u/%uk alloc/io=%u.%03u ns/io=%u ",
+        UsePool ? "pool" : "heap", (unsigned)ThreadCount, (unsigned)(MaxTransferLength / 1024),
+        (unsigned)(AllocCount / ((UINT64)Count * ThreadCount)),
+        (unsigned)(AllocCount * 1000 / ((UINT64)Count * ThreadCount) % 1000),
+        (unsigned)Nanoseconds);
+
+    SpdBufferPoolFinalize(&Data->Pool);
+    free(Data);
+}
+
+static void bufpool_bench_test(void)
+{
+    bufpool_bench_dotest(FALSE, 1, 64 * 1024, 512, 100000);
+    bufpool_bench_dotest(TRUE, 1, 64 * 1024, 512, 100000);
+    bufpool_bench_dotest(FALSE, 1, 1024 * 1024, 512, 100000);
+    bufpool_bench_dotest(TRUE, 1, 1024 * 1024, 512, 100000);
+    bufpool_bench_dotest(FALSE, 4, 64 * 1024, 512, 100000);
+    bufpool_bench_dotest(TRUE, 4, 64 * 1024, 512, 100000);
+}
+
+void bufpool_tests(void)
+{
+    TEST(bufpool_class_test);
+    TEST(bufpool_reuse_test);
+    TEST_OPT(bufpool_bench_test);
+}
+
+#if !defined(_WIN32)
+int main(int argc, char *argv[])
+{
+    TESTSUITE(bufpool_tests);
+
+    tlib_run_tests(argc, argv);
+
+    return 0;
+}
+#endif
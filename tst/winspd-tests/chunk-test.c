@@ -0,0 +1,289 @@
+/**
+ * @file chunk-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winspd/winspd.h>
+#include <shared/chunk.h>
+#include <tlib/testsuite.h>
+#include <process.h>
+#include <stdlib.h>
+
+#define TEST_POISON                     0xcd
+#define TEST_CHUNK_MAX                  8
+
+static UINT8 chunk_pattern(ULONG Offset)
+{
+    return (UINT8)(Offset * 7 + (Offset >> 8) + 1);
+}
+
+/*
+ * Model a storage unit that serves an SRB of DataLength bytes in chunks of at most
+ * MaxTransferLength bytes, either through a transact data buffer (copied) or by
+ * accessing the SRB pages directly (mapped), and check that the SRB ends up with
+ * the right data and that mapped chunks never touch the transact data buffer.
+ */
+static void chunk_dotest(ULONG DataLength, ULONG MaxTransferLength, BOOLEAN Mapped)
+{
+    PUINT8 SystemDataBuffer, DataBuffer, Storage;
+    ULONG ChunkOffset, ChunkLength, Chunks;
+    BOOLEAN Done;
+
+    SystemDataBuffer = malloc(DataLength);
+    DataBuffer = malloc(MaxTransferLength);
+    Storage = malloc(DataLength);
+    ASSERT(0 != SystemDataBuffer && 0 != DataBuffer && 0 != Storage);
+
+    /* write: SRB -> storage */
+    for (ULONG I = 0; DataLength > I; I++)
+        SystemDataBuffer[I] = chunk_pattern(I);
+    memset(Storage, 0, DataLength);
+    memset(DataBuffer, TEST_POISON, MaxTransferLength);
+
+    for (ChunkOffset = 0, Chunks = 0, Done = FALSE; !Done; Chunks++)
+    {
+        ChunkLength = SpdChunkPrepare(SystemDataBuffer, DataLength, ChunkOffset,
+            MaxTransferLength, TRUE, Mapped, DataBuffer);
+        ASSERT(0 < ChunkLength && MaxTransferLength >= ChunkLength);
+
+        if (Mapped)
+            memcpy(Storage + ChunkOffset, SystemDataBuffer + ChunkOffset, ChunkLength);
+        else
+            memcpy(Storage + ChunkOffset, DataBuffer, ChunkLength);
+
+        Done = SpdChunkComplete(SystemDataBuffer, DataLength, &ChunkOffset,
+            MaxTransferLength, FALSE, Mapped, DataBuffer);
+    }
+
+    ASSERT(DataLength == ChunkOffset);
+    ASSERT((DataLength + MaxTransferLength - 1) / MaxTransferLength == Chunks);
+    ASSERT(0 == memcmp(Storage, SystemDataBuffer, DataLength));
+    if (Mapped)
+        for (ULONG I = 0; MaxTransferLength > I; I++)
+            ASSERT(TEST_POISON == DataBuffer[I]);
+
+    /* read: storage -> SRB */
+    memset(SystemDataBuffer, 0, DataLength);
+    memset(DataBuffer, TEST_POISON, MaxTransferLength);
+
+    for (ChunkOffset = 0, Chunks = 0, Done = FALSE; !Done; Chunks++)
+    {
+        ChunkLength = SpdChunkPrepare(SystemDataBuffer, DataLength, ChunkOffset,
+            MaxTransferLength, FALSE, Mapped, DataBuffer);
+
+        if (Mapped)
+            memcpy(SystemDataBuffer + ChunkOffset, Storage + ChunkOffset, ChunkLength);
+        else
+            memcpy(DataBuffer, Storage + ChunkOffset, ChunkLength);
+
+        Done = SpdChunkComplete(SystemDataBuffer, DataLength, &ChunkOffset,
+            MaxTransferLength, TRUE, Mapped, DataBuffer);
+    }
+
+    ASSERT(DataLength == ChunkOffset);
+    ASSERT((DataLength + MaxTransferLength - 1) / MaxTransferLength == Chunks);
+    for (ULONG I = 0; DataLength > I; I++)
+        ASSERT(chunk_pattern(I) == SystemDataBuffer[I]);
+    if (Mapped)
+        for (ULONG I = 0; MaxTransferLength > I; I++)
+            ASSERT(TEST_POISON == DataBuffer[I]);
+
+    free(Storage);
+    free(DataBuffer);
+    free(SystemDataBuffer);
+}
+
+static void chunk_copy_test(void)
+{
+    chunk_dotest(512, 512, FALSE);
+    chunk_dotest(4096, 512, FALSE);
+    chunk_dotest(4096 + 512, 4096, FALSE);
+    chunk_dotest(1024 * 1024, 64 * 1024, FALSE);
+    chunk_dotest(1024 * 1024 - 512, 64 * 1024, FALSE);
+}
+
+static void chunk_mapped_test(void)
+{
+    chunk_dotest(512, 512, TRUE);
+    chunk_dotest(4096, 512, TRUE);
+    chunk_dotest(4096 + 512, 4096, TRUE);
+    chunk_dotest(1024 * 1024, 64 * 1024, TRUE);
+    chunk_dotest(1024 * 1024 - 512, 64 * 1024, TRUE);
+}
+
+static void chunk_zero_fill_test(void)
+{
+    UINT8 SystemDataBuffer[3 * 512];
+    ULONG ChunkOffset = 512;
+    BOOLEAN Done;
+
+    /* a copied read without a data buffer zero-fills its chunk only */
+    memset(SystemDataBuffer, TEST_POISON, sizeof SystemDataBuffer);
+    Done = SpdChunkComplete(SystemDataBuffer, sizeof SystemDataBuffer, &ChunkOffset,
+        512, TRUE, FALSE, 0);
+    ASSERT(!Done);
+    ASSERT(1024 == ChunkOffset);
+    for (ULONG I = 0; sizeof SystemDataBuffer > I; I++)
+        ASSERT((512 <= I && 1024 > I ? 0 : TEST_POISON) == SystemDataBuffer[I]);
+
+    /* a mapped read leaves the SRB data alone */
+    memset(SystemDataBuffer, TEST_POISON, sizeof SystemDataBuffer);
+    Done = SpdChunkComplete(SystemDataBuffer, sizeof SystemDataBuffer, &ChunkOffset,
+        512, TRUE, TRUE, 0);
+    ASSERT(Done);
+    ASSERT(1536 == ChunkOffset);
+    for (ULONG I = 0; sizeof SystemDataBuffer > I; I++)
+        ASSERT(TEST_POISON == SystemDataBuffer[I]);
+}
+
+static void chunk_count_test(void)
+{
+    ASSERT(1 == SpdChunkCount(0, 512));
+    ASSERT(1 == SpdChunkCount(1, 512));
+    ASSERT(1 == SpdChunkCount(512, 512));
+    ASSERT(2 == SpdChunkCount(513, 512));
+    ASSERT(16 == SpdChunkCount(1024 * 1024, 64 * 1024));
+    ASSERT(16 == SpdChunkCount(1024 * 1024 - 512, 64 * 1024));
+}
+
+typedef struct
+{
+    PUINT8 SystemDataBuffer, Storage;
+    ULONG DataLength, MaxTransferLength;
+    BOOLEAN Write, Mapped;
+    volatile LONG NextOffset;
+    volatile LONG *Claims;
+} CHUNK_PARALLEL_TEST;
+
+typedef struct
+{
+    CHUNK_PARALLEL_TEST *Test;
+    ULONG ChunkOffset;
+} CHUNK_PARALLEL_THREAD;
+
+/* a dispatcher thread that serves one chunk slot of the SRB, like SpdSrbExecuteScsiComplete */
+static unsigned __stdcall chunk_parallel_thread(void *Data0)
+{
+    CHUNK_PARALLEL_THREAD *Data = Data0;
+    CHUNK_PARALLEL_TEST *Test = Data->Test;
+    PUINT8 DataBuffer;
+    ULONG ChunkOffset, ChunkLength;
+
+    DataBuffer = malloc(Test->MaxTransferLength);
+    ASSERT(0 != DataBuffer);
+
+    ChunkOffset = Data->ChunkOffset;
+    do
+    {
+        InterlockedIncrement(&Test->Claims[ChunkOffset / Test->MaxTransferLength]);
+
+        ChunkLength = SpdChunkPrepare(Test->SystemDataBuffer, Test->DataLength, ChunkOffset,
+            Test->MaxTransferLength, Test->Write, Test->Mapped, DataBuffer);
+        ASSERT(0 < ChunkLength && Test->MaxTransferLength >= ChunkLength);
+
+        if (Test->Write)
+            memcpy(Test->Storage + ChunkOffset,
+                Test->Mapped ? Test->SystemDataBuffer + ChunkOffset : DataBuffer, ChunkLength);
+        else
+            memcpy(Test->Mapped ? Test->SystemDataBuffer + ChunkOffset : DataBuffer,
+                Test->Storage + ChunkOffset, ChunkLength);
+
+        /* the local offset is discarded: the next piece is claimed from the shared offset */
+        SpdChunkComplete(Test->SystemDataBuffer, Test->DataLength, &ChunkOffset,
+            Test->MaxTransferLength, !Test->Write, Test->Mapped, DataBuffer);
+        if (0 == ChunkOffset % (3 * Test->MaxTransferLength))
+            SwitchToThread();
+    } while (SpdChunkNext(&Test->NextOffset, Test->DataLength, Test->MaxTransferLength,
+        &ChunkOffset));
+
+    free(DataBuffer);
+
+    return 0;
+}
+
+static void chunk_parallel_dotest(ULONG DataLength, ULONG MaxTransferLength, BOOLEAN Write,
+    BOOLEAN Mapped)
+{
+    CHUNK_PARALLEL_TEST Test;
+    CHUNK_PARALLEL_THREAD Data[TEST_CHUNK_MAX];
+    HANDLE Threads[TEST_CHUNK_MAX];
+    ULONG ChunkCount, PieceCount;
+
+    memset(&Test, 0, sizeof Test);
+    Test.SystemDataBuffer = malloc(DataLength);
+    Test.Storage = malloc(DataLength);
+    Test.DataLength = DataLength;
+    Test.MaxTransferLength = MaxTransferLength;
+    Test.Write = Write;
+    Test.Mapped = Mapped;
+    PieceCount = SpdChunkCount(DataLength, MaxTransferLength);
+    Test.Claims = calloc(PieceCount, sizeof Test.Claims[0]);
+    ASSERT(0 != Test.SystemDataBuffer && 0 != Test.Storage && 0 != Test.Claims);
+
+    for (ULONG I = 0; DataLength > I; I++)
+        (Write ? Test.SystemDataBuffer : Test.Storage)[I] = chunk_pattern(I);
+    memset(Write ? Test.Storage : Test.SystemDataBuffer, 0, DataLength);
+
+    /* like SpdScsiPostSrb: the chunks start at the first pieces of the SRB */
+    ChunkCount = TEST_CHUNK_MAX < PieceCount ? TEST_CHUNK_MAX : PieceCount;
+    Test.NextOffset = ChunkCount * MaxTransferLength;
+    for (ULONG I = 0; ChunkCount > I; I++)
+    {
+        Data[I].Test = &Test;
+        Data[I].ChunkOffset = I * MaxTransferLength;
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, chunk_parallel_thread, &Data[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; ChunkCount > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        CloseHandle(Threads[I]);
+    }
+
+    /* every piece is served exactly once */
+    for (ULONG I = 0; PieceCount > I; I++)
+        ASSERT(1 == Test.Claims[I]);
+    for (ULONG I = 0; DataLength > I; I++)
+        ASSERT(chunk_pattern(I) == (Write ? Test.Storage : Test.SystemDataBuffer)[I]);
+
+    free((PVOID)Test.Claims);
+    free(Test.Storage);
+    free(Test.SystemDataBuffer);
+}
+
+static void chunk_parallel_test(void)
+{
+    for (ULONG J = 0; 4 > J; J++)
+    {
+        BOOLEAN Write = 0 != (J & 1), Mapped = 0 != (J & 2);
+        chunk_parallel_dotest(512, 512, Write, Mapped);
+        chunk_parallel_dotest(4096 + 512, 512, Write, Mapped);
+        chunk_parallel_dotest(1024 * 1024, 64 * 1024, Write, Mapped);
+        chunk_parallel_dotest(1024 * 1024 - 512, 4096, Write, Mapped);
+    }
+}
+
+void chunk_tests(void)
+{
+    TEST(chunk_copy_test);
+    TEST(chunk_mapped_test);
+    TEST(chunk_zero_fill_test);
+    TEST(chunk_count_test);
+    TEST(chunk_parallel_test);
+}
@@ -0,0 +1,300 @@
+/**
+ * @file epoch-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#if defined(_WIN32)
+#include <winspd/winspd.h>
+#include <process.h>
+#else
+#include <shared/posix.h>
+#include <winspd/ioctl.h>
+#endif
+#include <shared/epoch.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+#define TEST_SLOT_COUNT                 8
+#define TEST_UNIT_COUNT                 4
+#define TEST_UNIT_ALIVE                 0x41564c41
+#define TEST_UNIT_DEAD                  0x44414544
+
+/* a simulated storage unit: published in a table and freed when its last reference goes */
+typedef struct
+{
+    volatile LONG Magic;
+    volatile LONG RefCount;
+} EPOCH_TEST_UNIT;
+
+typedef struct
+{
+    SPD_EPOCH Epoch;
+    SPD_EPOCH_SLOT *Slots;
+    EPOCH_TEST_UNIT *volatile Units[TEST_UNIT_COUNT];
+    volatile LONG Stop;
+    volatile LONG Errors;
+} EPOCH_TEST;
+
+typedef struct
+{
+    EPOCH_TEST *Test;
+    ULONG Slot;
+    ULONG Lookups;
+} EPOCH_TEST_THREAD;
+
+static void epoch_create(EPOCH_TEST *Test)
+{
+    memset(Test, 0, sizeof *Test);
+    Test->Slots = _aligned_malloc(TEST_SLOT_COUNT * sizeof Test->Slots[0], 64);
+    ASSERT(0 != Test->Slots);
+    SpdEpochInitialize(&Test->Epoch, Test->Slots, TEST_SLOT_COUNT);
+}
+
+static void epoch_delete(EPOCH_TEST *Test)
+{
+    _aligned_free(Test->Slots);
+}
+
+static EPOCH_TEST_UNIT *epoch_unit_create(void)
+{
+    EPOCH_TEST_UNIT *Unit = malloc(sizeof *Unit);
+    ASSERT(0 != Unit);
+    Unit->Magic = TEST_UNIT_ALIVE;
+    Unit->RefCount = 1;
+    return Unit;
+}
+
+static void epoch_unit_dereference(EPOCH_TEST *Test, EPOCH_TEST_UNIT *Unit)
+{
+    if (TEST_UNIT_ALIVE != Unit->Magic)
+        InterlockedIncrement(&Test->Errors);
+    if (0 == InterlockedDecrement(&Unit->RefCount))
+    {
+        Unit->Magic = TEST_UNIT_DEAD;
+        free(Unit);
+    }
+}
+
+/* like SpdStorageUnitReferenceByBtl */
+static EPOCH_TEST_UNIT *epoch_unit_reference(EPOCH_TEST *Test, ULONG Slot, ULONG Index,
+    BOOLEAN Preempt)
+{
+    EPOCH_TEST_UNIT *Unit;
+
+    SpdEpochEnter(&Test->Epoch, Slot);
+    Unit = Test->Units[Index];
+    if (0 != Unit)
+    {
+        /* widen the window in which the writer may unpublish and release the unit */
+        if (Preempt)
+            SwitchToThread();
+
+        if (TEST_UNIT_ALIVE != Unit->Magic || 1 >= InterlockedIncrement(&Unit->RefCount))
+            InterlockedIncrement(&Test->Errors);
+    }
+    SpdEpochLeave(&Test->Epoch, Slot);
+
+    return Unit;
+}
+
+/* like SpdStorageUnitUnprovision */
+static void epoch_unit_remove(EPOCH_TEST *Test, ULONG Index)
+{
+    EPOCH_TEST_UNIT *Unit = InterlockedExchangePointer((PVOID *)&Test->Units[Index], 0);
+
+    if (0 != Unit)
+    {
+        SpdEpochSynchronize(&Test->Epoch);
+        epoch_unit_dereference(Test, Unit);
+    }
+}
+
+static unsigned __stdcall epoch_synchronize_thread(void *Data)
+{
+    SpdEpochSynchronize(Data);
+    return 0;
+}
+
+static void epoch_synchronize_test(void)
+{
+    EPOCH_TEST Test;
+    HANDLE Thread;
+
+    epoch_create(&Test);
+
+    /* idle slots do not hold up a writer */
+    SpdEpochSynchronize(&Test.Epoch);
+    SpdEpochSynchronize(&Test.Epoch);
+
+    /* a reader in the old epoch does */
+    SpdEpochEnter(&Test.Epoch, 3);
+    Thread = (HANDLE)_beginthreadex(0, 0, epoch_synchronize_thread, &Test.Epoch, 0, 0);
+    ASSERT(0 != Thread);
+    ASSERT(WAIT_TIMEOUT == WaitForSingleObject(Thread, 100));
+    SpdEpochLeave(&Test.Epoch, 3);
+    ASSERT(WAIT_OBJECT_0 == WaitForSingleObject(Thread, INFINITE));
+    CloseHandle(Thread);
+
+    /* a reader that entered after the writer started does not */
+    SpdEpochEnter(&Test.Epoch, 3);
+    Test.Epoch.Slots[3].Epoch = Test.Epoch.Epoch + 1;
+    SpdEpochSynchronize(&Test.Epoch);
+    SpdEpochLeave(&Test.Epoch, 3);
+
+    /* nor does a slot when the epoch wraps */
+    Test.Epoch.Epoch = -1;
+    SpdEpochEnter(&Test.Epoch, 5);
+    Thread = (HANDLE)_beginthreadex(0, 0, epoch_synchronize_thread, &Test.Epoch, 0, 0);
+    ASSERT(0 != Thread);
+    ASSERT(WAIT_TIMEOUT == WaitForSingleObject(Thread, 100));
+    SpdEpochLeave(&Test.Epoch, 5);
+    ASSERT(WAIT_OBJECT_0 == WaitForSingleObject(Thread, INFINITE));
+    CloseHandle(Thread);
+    ASSERT(1 == Test.Epoch.Epoch);
+    SpdEpochEnter(&Test.Epoch, 5);
+    ASSERT(1 == Test.Epoch.Slots[5].Epoch);
+    SpdEpochLeave(&Test.Epoch, 5);
+
+    epoch_delete(&Test);
+}
+
+static void epoch_enterany_test(void)
+{
+    EPOCH_TEST Test;
+    ULONG Slot0, Slot1, Slot2;
+
+    epoch_create(&Test);
+
+    /* readers claim the idle slot at their hint, or the next idle one */
+    Slot0 = SpdEpochEnterAny(&Test.Epoch, 3);
+    ASSERT(3 == Slot0);
+    Slot1 = SpdEpochEnterAny(&Test.Epoch, 3 + TEST_SLOT_COUNT);
+    ASSERT(4 == Slot1);
+    SpdEpochEnter(&Test.Epoch, 7);
+    Slot2 = SpdEpochEnterAny(&Test.Epoch, 7);
+    ASSERT(0 == Slot2);
+    ASSERT(Test.Epoch.Epoch == Test.Epoch.Slots[Slot2].Epoch);
+
+    SpdEpochLeave(&Test.Epoch, Slot1);
+    Slot1 = SpdEpochEnterAny(&Test.Epoch, 3);
+    ASSERT(4 == Slot1);
+
+    SpdEpochLeave(&Test.Epoch, 7);
+    SpdEpochLeave(&Test.Epoch, Slot2);
+    SpdEpochLeave(&Test.Epoch, Slot1);
+    SpdEpochLeave(&Test.Epoch, Slot0);
+    for (ULONG I = 0; TEST_SLOT_COUNT > I; I++)
+        ASSERT(0 == Test.Epoch.Slots[I].Epoch);
+
+    epoch_delete(&Test);
+}
+
+static unsigned __stdcall epoch_stress_thread(void *Data0)
+{
+    EPOCH_TEST_THREAD *Data = Data0;
+    EPOCH_TEST *Test = Data->Test;
+    EPOCH_TEST_UNIT *Unit;
+
+    while (!Test->Stop)
+    {
+        Unit = epoch_unit_reference(Test, Data->Slot, Data->Lookups % TEST_UNIT_COUNT,
+            0 == Data->Lookups % 7);
+        if (0 != Unit)
+            epoch_unit_dereference(Test, Unit);
+        if (0 == ++Data->Lookups % 16)
+            SwitchToThread();
+    }
+
+    return 0;
+}
+
+static void epoch_stress_dotest(ULONG ThreadCount, ULONG Iterations)
+{
+    EPOCH_TEST Test;
+    EPOCH_TEST_THREAD Data[TEST_SLOT_COUNT];
+    HANDLE Threads[TEST_SLOT_COUNT];
+    ULONG Lookups = 0;
+
+    ASSERT(TEST_SLOT_COUNT >= ThreadCount);
+
+    epoch_create(&Test);
+    for (ULONG I = 0; TEST_UNIT_COUNT > I; I++)
+        Test.Units[I] = epoch_unit_create();
+
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        Data[I].Test = &Test;
+        Data[I].Slot = I;
+        Data[I].Lookups = I;
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, epoch_stress_thread, &Data[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    /* unprovision and provision units while the readers look them up */
+    for (ULONG I = 0; Iterations > I; I++)
+    {
+        epoch_unit_remove(&Test, I % TEST_UNIT_COUNT);
+        if (0 == I % 16)
+            SwitchToThread();
+        InterlockedExchangePointer((PVOID *)&Test.Units[I % TEST_UNIT_COUNT],
+            epoch_unit_create());
+    }
+
+    Test.Stop = 1;
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        CloseHandle(Threads[I]);
+        Lookups += Data[I].Lookups;
+    }
+
+    for (ULONG I = 0; TEST_UNIT_COUNT > I; I++)
+    {
+        ASSERT(1 == Test.Units[I]->RefCount);
+        epoch_unit_remove(&Test, I);
+    }
+    ASSERT(0 == Test.Errors);
+    ASSERT(0 < Lookups);
+
+    epoch_delete(&Test);
+}
+
+static void epoch_stress_test(void)
+{
+    epoch_stress_dotest(1, 10000);
+    epoch_stress_dotest(TEST_SLOT_COUNT, 50000);
+}
+
+void epoch_tests(void)
+{
+    TEST(epoch_synchronize_test);
+    TEST(epoch_enterany_test);
+    TEST(epoch_stress_test);
+}
+
+#if !defined(_WIN32)
+int main(int argc, char *argv[])
+{
+    TESTSUITE(epoch_tests);
+
+    tlib_run_tests(argc, argv);
+
+    return 0;
+}
+#endif
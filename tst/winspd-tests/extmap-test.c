@@ -0,0 +1,220 @@
+/**
+ * @file extmap-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#if defined(_WIN32)
+#include <winspd/winspd.h>
+#else
+#include <shared/posix.h>
+#include <winspd/ioctl.h>
+#endif
+#include <shared/extmap.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+static ULONG extmap_random(PULONG PSeed)
+{
+    *PSeed = *PSeed * 1103515245 + 12345;
+    return *PSeed >> 8;
+}
+
+static UINT64 extmap_run(SPD_EXTENT_MAP *Map, UINT64 Offset, UINT64 Length, BOOLEAN Allocated)
+{
+    BOOLEAN RunAllocated;
+    UINT64 RunLength;
+
+    RunLength = SpdExtentMapRun(Map, Offset, Length, &RunAllocated);
+    return RunAllocated == Allocated ? RunLength : (UINT64)-1;
+}
+
+static void extmap_basic_test(void)
+{
+    SPD_EXTENT_MAP Map;
+    UINT64 Length = 10 * 4096 + 2048;
+
+    ASSERT(ERROR_INVALID_PARAMETER == SpdExtentMapInitialize(&Map, 0, 12));
+    ASSERT(ERROR_SUCCESS == SpdExtentMapInitialize(&Map, Length, 12));
+    ASSERT(11 == Map.ChunkCount);
+
+    ASSERT(Length == extmap_run(&Map, 0, Length, FALSE));
+
+    /* a set marks every chunk that it touches */
+    SpdExtentMapSet(&Map, 4096 + 1, 10);
+    ASSERT(4096 == extmap_run(&Map, 0, Length, FALSE));
+    ASSERT(4096 == extmap_run(&Map, 4096, Length - 4096, TRUE));
+    ASSERT(4096 - 100 == extmap_run(&Map, 4096 + 100, 5000, TRUE));
+    ASSERT(50 == extmap_run(&Map, 4096 + 100, 50, TRUE));
+    ASSERT(Length - 8192 == extmap_run(&Map, 8192, Length - 8192, FALSE));
+
+    SpdExtentMapSet(&Map, 3 * 4096 - 1, 2);
+    ASSERT(8192 == extmap_run(&Map, 8192, Length - 8192, TRUE));
+    ASSERT(4096 == extmap_run(&Map, 8192 + 4096, 8192, TRUE));
+
+    /* a clear only clears the chunks that it covers in full */
+    SpdExtentMapClear(&Map, 4096 + 1, 8192);
+    ASSERT(4096 == extmap_run(&Map, 4096, Length - 4096, TRUE));
+    ASSERT(4096 == extmap_run(&Map, 8192, Length - 8192, FALSE));
+    ASSERT(4096 == extmap_run(&Map, 3 * 4096, Length - 3 * 4096, TRUE));
+    SpdExtentMapClear(&Map, 4096, 4096);
+    SpdExtentMapClear(&Map, 3 * 4096, 4096);
+    ASSERT(Length == extmap_run(&Map, 0, Length, FALSE));
+
+    /* the last chunk is short; a range that reaches the end of the image covers it */
+    SpdExtentMapSet(&Map, Length - 1, 1);
+    ASSERT(2048 == extmap_run(&Map, 10 * 4096, 2048, TRUE));
+    SpdExtentMapClear(&Map, 10 * 4096, 1024);
+    ASSERT(2048 == extmap_run(&Map, 10 * 4096, 2048, TRUE));
+    SpdExtentMapClear(&Map, 10 * 4096, 2048);
+    ASSERT(Length == extmap_run(&Map, 0, Length, FALSE));
+
+    /* ranges past the end of the image are ignored or read as unallocated */
+    SpdExtentMapSet(&Map, Length, 4096);
+    SpdExtentMapSet(&Map, Length - 1, (UINT64)-1);
+    ASSERT(2048 == extmap_run(&Map, 10 * 4096, 2048, TRUE));
+    ASSERT(4096 == extmap_run(&Map, 10 * 4096, 4096, TRUE));
+    ASSERT(4096 == extmap_run(&Map, Length, 4096, FALSE));
+    SpdExtentMapClear(&Map, 0, (UINT64)-1);
+    ASSERT(Length == extmap_run(&Map, 0, Length, FALSE));
+
+    SpdExtentMapSetAll(&Map);
+    ASSERT(Length == extmap_run(&Map, 0, Length, TRUE));
+
+    SpdExtentMapFinalize(&Map);
+}
+
+static void extmap_model_dotest(UINT64 Length, ULONG ChunkShift, ULONG Seed)
+{
+    enum { Rounds = 20000 };
+    SPD_EXTENT_MAP Map;
+    UINT8 *Chunks;
+    UINT64 ChunkLength = 1ULL << ChunkShift, ChunkCount, Offset, RangeMax, RangeLength, RunLength;
+    UINT64 Chunk, EndChunk;
+    BOOLEAN Allocated;
+
+    ASSERT(ERROR_SUCCESS == SpdExtentMapInitialize(&Map, Length, ChunkShift));
+    ChunkCount = Map.ChunkCount;
+    ASSERT((Length + ChunkLength - 1) / ChunkLength == ChunkCount);
+    Chunks = calloc((size_t)ChunkCount, 1);
+    ASSERT(0 != Chunks);
+
+    for (ULONG Round = 0; Rounds > Round; Round++)
+    {
+        Offset = extmap_random(&Seed) % Length;
+        RangeMax = Length - Offset;
+        if (0 == extmap_random(&Seed) % 2 && 4 * ChunkLength < RangeMax)
+            RangeMax = 4 * ChunkLength;
+        RangeLength = 1 + extmap_random(&Seed) % RangeMax;
+
+        switch (extmap_random(&Seed) % 4)
+        {
+        case 0:
+            SpdExtentMapSet(&Map, Offset, RangeLength);
+            for (Chunk = Offset / ChunkLength; (Offset + RangeLength - 1) / ChunkLength >= Chunk; Chunk++)
+                Chunks[Chunk] = 1;
+            break;
+        case 1:
+            SpdExtentMapClear(&Map, Offset, RangeLength);
+            Chunk = (Offset + ChunkLength - 1) / ChunkLength;
+            EndChunk = Length == Offset + RangeLength ? ChunkCount : (Offset + RangeLength) / ChunkLength;
+            for (; EndChunk > Chunk; Chunk++)
+                Chunks[Chunk] = 0;
+            break;
+        default:
+            /* the runs must cover the range and must agree with the model at every chunk */
+            while (0 < RangeLength)
+            {
+                RunLength = SpdExtentMapRun(&Map, Offset, RangeLength, &Allocated);
+                ASSERT(0 < RunLength && RangeLength >= RunLength);
+                for (Chunk = Offset / ChunkLength; (Offset + RunLength - 1) / ChunkLength >= Chunk; Chunk++)
+                    ASSERT(Allocated == Chunks[Chunk]);
+                if (RangeLength > RunLength)
+                    ASSERT(Allocated != Chunks[(Offset + RunLength) / ChunkLength]);
+                Offset += RunLength;
+                RangeLength -= RunLength;
+            }
+            break;
+        }
+    }
+
+    free(Chunks);
+    SpdExtentMapFinalize(&Map);
+}
+
+static void extmap_model_test(void)
+{
+    extmap_model_dotest(300 * 512 + 100, 9, 1);
+    extmap_model_dotest(1000 * 64, 6, 2);
+    extmap_model_dotest(64 * 4096, 12, 3);
+}
+
+/*
+ * Startup benchmark: build the map of a 4TB image with 64KB chunks (64M chunks) from
+ * a fragmented list of allocated ranges, as a loader would, and scan it.
+ */
+static void extmap_large_test(void)
+{
+    enum { ExtentCount = 100000 };
+    SPD_EXTENT_MAP Map;
+    UINT64 Length = 4ULL << 40, Stride = Length / ExtentCount, Offset, RunLength;
+    BOOLEAN Allocated;
+    ULONG RunCount, Seed = 1;
+    DWORD Start, BuildTime, ScanTime;
+
+    ASSERT(ERROR_SUCCESS == SpdExtentMapInitialize(&Map, Length, 16));
+
+    Start = GetTickCount();
+    for (ULONG I = 0; ExtentCount > I; I++)
+        SpdExtentMapSet(&Map, I * Stride, 1 + extmap_random(&Seed) % (Stride / 2));
+    BuildTime = GetTickCount() - Start;
+
+    Start = GetTickCount();
+    RunCount = 0;
+    for (Offset = 0; Length > Offset; Offset += RunLength, RunCount++)
+        RunLength = SpdExtentMapRun(&Map, Offset, Length - Offset, &Allocated);
+    ScanTime = GetTickCount() - Start;
+    ASSERT(2 * ExtentCount == RunCount);
+
+    SpdExtentMapSet(&Map, 0, Length);
+    ASSERT(Length == SpdExtentMapRun(&Map, 0, Length, &Allocated));
+    ASSERT(Allocated);
+
+    tlib_printf("chunks=%u extents=%u build=%ums scan=%ums ",
+        (unsigned)Map.ChunkCount, (unsigned)ExtentCount, (unsigned)BuildTime, (unsigned)ScanTime);
+
+    SpdExtentMapFinalize(&Map);
+}
+
+void extmap_tests(void)
+{
+    TEST(extmap_basic_test);
+    TEST(extmap_model_test);
+    TEST(extmap_large_test);
+}
+
+#if !defined(_WIN32)
+int main(int argc, char *argv[])
+{
+    TESTSUITE(extmap_tests);
+
+    tlib_run_tests(argc, argv);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,435 @@
+/**
+ * @file frame-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#if defined(_WIN32)
+#include <winspd/winspd.h>
+#else
+#include <shared/posix.h>
+#include <winspd/ioctl.h>
+#endif
+#include <shared/frame.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+#define TEST_BLOCK_LENGTH               512
+#define TEST_MAX_TRANSFER_LENGTH        (16 * TEST_BLOCK_LENGTH)
+#define TEST_FRAME_MAX                  \
+    (sizeof(SPD_FRAME_HEADER) + sizeof(SPD_IOCTL_TRANSACT_RSP) + TEST_MAX_TRANSFER_LENGTH)
+
+static ULONG frame_encode(PUINT8 Buffer, UINT8 Type, const VOID *Message,
+    const VOID *Data, UINT32 DataLength)
+{
+    ULONG HeaderLength;
+
+    HeaderLength = SpdFrameEncode(Buffer, SPD_FRAME_VERSION, Type, Message, DataLength);
+    if (0 != DataLength)
+        memcpy(Buffer + HeaderLength, Data, DataLength);
+
+    return HeaderLength + DataLength;
+}
+
+static BOOLEAN frame_decode(PUINT8 Buffer, ULONG Length, SPD_FRAME *Frame)
+{
+    return SpdFrameDecode(Buffer, Length,
+        TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH, Frame);
+}
+
+static void frame_hello_test(void)
+{
+    SPD_FRAME_HEADER Hello;
+    SPD_FRAME Frame;
+    ULONG Length;
+
+    Length = SpdFrameEncodeHello(&Hello, SPD_FRAME_VERSION);
+    ASSERT(sizeof Hello == Length);
+    ASSERT(frame_decode((PVOID)&Hello, Length, &Frame));
+    ASSERT(SpdFrameHelloType == Frame.Type);
+    ASSERT(SPD_FRAME_VERSION == Frame.Version);
+    ASSERT(0 == Frame.Message);
+    ASSERT(0 == Frame.DataLength);
+
+    /* a HELLO from the future is fine; a REQ from the future is not */
+    Hello.Version = SPD_FRAME_VERSION + 1;
+    ASSERT(frame_decode((PVOID)&Hello, Length, &Frame));
+    ASSERT(SPD_FRAME_VERSION + 1 == Frame.Version);
+
+    Hello.Version = 0;
+    ASSERT(!frame_decode((PVOID)&Hello, Length, &Frame));
+
+    /* a HELLO never carries data */
+    SpdFrameEncodeHello(&Hello, SPD_FRAME_VERSION);
+    Hello.DataLength = 8;
+    ASSERT(!frame_decode((PVOID)&Hello, Length, &Frame));
+
+    /* a HELLO is shorter than any unframed message */
+    ASSERT(sizeof Hello < sizeof(SPD_IOCTL_TRANSACT_REQ));
+    ASSERT(sizeof Hello < sizeof(SPD_IOCTL_TRANSACT_RSP));
+}
+
+static void frame_req_test(void)
+{
+    static UINT8 Kinds[] =
+    {
+        SpdIoctlTransactReadKind,
+        SpdIoctlTransactWriteKind,
+        SpdIoctlTransactFlushKind,
+        SpdIoctlTransactUnmapKind,
+    };
+    PUINT8 Buffer, Data;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_FRAME Frame;
+    ULONG Length, DataLength;
+
+    Buffer = malloc(TEST_FRAME_MAX);
+    Data = malloc(TEST_MAX_TRANSFER_LENGTH);
+    ASSERT(0 != Buffer && 0 != Data);
+    for (ULONG I = 0; TEST_MAX_TRANSFER_LENGTH > I; I++)
+        Data[I] = (UINT8)(I * 31 + 7);
+
+    for (ULONG K = 0; sizeof Kinds / sizeof Kinds[0] > K; K++)
+        for (UINT32 Count = 1; 16 >= Count; Count++)
+        {
+            memset(&Req, 0, sizeof Req);
+            Req.Hint = 0x1000 + K * 100 + Count;
+            Req.Kind = Kinds[K];
+            switch (Req.Kind)
+            {
+            case SpdIoctlTransactReadKind:
+                Req.Op.Read.BlockAddress = Count;
+                Req.Op.Read.BlockCount = Count;
+                break;
+            case SpdIoctlTransactWriteKind:
+                Req.Op.Write.BlockAddress = Count;
+                Req.Op.Write.BlockCount = Count;
+                break;
+            case SpdIoctlTransactFlushKind:
+                Req.Op.Flush.BlockAddress = Count;
+                Req.Op.Flush.BlockCount = Count;
+                break;
+            case SpdIoctlTransactUnmapKind:
+                Req.Op.Unmap.Count = Count;
+                break;
+            }
+
+            DataLength = SpdFrameReqDataLength(&Req, TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH);
+            ASSERT((ULONG)-1 != DataLength);
+            ASSERT((SpdIoctlTransactWriteKind == Req.Kind ? Count * TEST_BLOCK_LENGTH :
+                SpdIoctlTransactUnmapKind == Req.Kind ? Count * sizeof(SPD_IOCTL_UNMAP_DESCRIPTOR) :
+                0) == DataLength);
+
+            Length = frame_encode(Buffer, SpdFrameReqType, &Req, Data, DataLength);
+            ASSERT(0 == (Length - DataLength) % 8);
+            ASSERT(frame_decode(Buffer, Length, &Frame));
+            ASSERT(SpdFrameReqType == Frame.Type);
+            ASSERT(0 == memcmp(Frame.Message, &Req, sizeof Req));
+            ASSERT(DataLength == Frame.DataLength);
+            ASSERT(0 == memcmp(Frame.Data, Data, DataLength));
+
+            /* truncated and padded frames are rejected */
+            ASSERT(!frame_decode(Buffer, Length - 1, &Frame));
+            ASSERT(!frame_decode(Buffer, Length + 1, &Frame));
+        }
+
+    /* a request too large for the unit */
+    memset(&Req, 0, sizeof Req);
+    Req.Kind = SpdIoctlTransactWriteKind;
+    Req.Op.Write.BlockCount = TEST_MAX_TRANSFER_LENGTH / TEST_BLOCK_LENGTH + 1;
+    ASSERT((ULONG)-1 == SpdFrameReqDataLength(&Req, TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH));
+    Req.Op.Write.BlockCount = 0xffffffff;
+    ASSERT((ULONG)-1 == SpdFrameReqDataLength(&Req, TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH));
+
+    /* a WRITE whose data do not match its block count */
+    Req.Op.Write.BlockCount = 2;
+    Length = frame_encode(Buffer, SpdFrameReqType, &Req, Data, TEST_BLOCK_LENGTH);
+    ASSERT(!frame_decode(Buffer, Length, &Frame));
+
+    /* a FLUSH with data */
+    Req.Kind = SpdIoctlTransactFlushKind;
+    Length = frame_encode(Buffer, SpdFrameReqType, &Req, Data, TEST_BLOCK_LENGTH);
+    ASSERT(!frame_decode(Buffer, Length, &Frame));
+
+    free(Data);
+    free(Buffer);
+}
+
+static void frame_rsp_test(void)
+{
+    PUINT8 Buffer, Data;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    SPD_FRAME Frame;
+    ULONG Length;
+
+    Buffer = malloc(TEST_FRAME_MAX);
+    Data = malloc(TEST_MAX_TRANSFER_LENGTH);
+    ASSERT(0 != Buffer && 0 != Data);
+    for (ULONG I = 0; TEST_MAX_TRANSFER_LENGTH > I; I++)
+        Data[I] = (UINT8)(I * 13 + 5);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = 42;
+    Rsp.Kind = SpdIoctlTransactReadKind;
+    Length = frame_encode(Buffer, SpdFrameRspType, &Rsp, Data, TEST_MAX_TRANSFER_LENGTH);
+    ASSERT(frame_decode(Buffer, Length, &Frame));
+    ASSERT(SpdFrameRspType == Frame.Type);
+    ASSERT(0 == memcmp(Frame.Message, &Rsp, sizeof Rsp));
+    ASSERT(TEST_MAX_TRANSFER_LENGTH == Frame.DataLength);
+    ASSERT(0 == memcmp(Frame.Data, Data, TEST_MAX_TRANSFER_LENGTH));
+
+    /* a failed READ carries no data */
+    Rsp.Status.ScsiStatus = SCSISTAT_CHECK_CONDITION;
+    Length = frame_encode(Buffer, SpdFrameRspType, &Rsp, 0, 0);
+    ASSERT(frame_decode(Buffer, Length, &Frame));
+    ASSERT(0 == Frame.DataLength);
+
+    /* only READ responses carry data */
+    Rsp.Kind = SpdIoctlTransactWriteKind;
+    Length = frame_encode(Buffer, SpdFrameRspType, &Rsp, Data, TEST_BLOCK_LENGTH);
+    ASSERT(!frame_decode(Buffer, Length, &Frame));
+    Length = frame_encode(Buffer, SpdFrameRspType, &Rsp, 0, 0);
+    ASSERT(frame_decode(Buffer, Length, &Frame));
+
+    /* more data than the unit can transfer */
+    Rsp.Kind = SpdIoctlTransactReadKind;
+    Rsp.Status.ScsiStatus = SCSISTAT_GOOD;
+    Length = SpdFrameEncode(Buffer, SPD_FRAME_VERSION, SpdFrameRspType, &Rsp,
+        TEST_MAX_TRANSFER_LENGTH + TEST_BLOCK_LENGTH);
+    ASSERT(!frame_decode(Buffer, Length + TEST_MAX_TRANSFER_LENGTH + TEST_BLOCK_LENGTH, &Frame));
+
+    free(Data);
+    free(Buffer);
+}
+
+static void frame_header_test(void)
+{
+    UINT8 Buffer[sizeof(SPD_FRAME_HEADER) + sizeof(SPD_IOCTL_TRANSACT_RSP) + 16];
+    SPD_FRAME_HEADER *Header = (PVOID)Buffer;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    SPD_FRAME Frame;
+    ULONG Length;
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = 7;
+    Rsp.Kind = SpdIoctlTransactFlushKind;
+    Length = SpdFrameEncode(Buffer, SPD_FRAME_VERSION, SpdFrameRspType, &Rsp, 0);
+    ASSERT(frame_decode(Buffer, Length, &Frame));
+
+    /* a longer header (from a later minor revision) is skipped over */
+    memset(Buffer + Length, 0xcc, 16);
+    Header->HeaderLength += 16;
+    ASSERT(frame_decode(Buffer, Length + 16, &Frame));
+    ASSERT(0 == memcmp(Frame.Message, &Rsp, sizeof Rsp));
+    ASSERT(Buffer + Length + 16 == Frame.Data);
+
+    /* but it must stay 8-byte aligned and hold the message */
+    Header->HeaderLength = (UINT16)(Length + 4);
+    ASSERT(!frame_decode(Buffer, Length + 4, &Frame));
+    Header->HeaderLength = (UINT16)(Length - 8);
+    ASSERT(!frame_decode(Buffer, Length, &Frame));
+    Header->HeaderLength = (UINT16)Length;
+
+    Header->Magic ^= 1;
+    ASSERT(!frame_decode(Buffer, Length, &Frame));
+    Header->Magic ^= 1;
+
+    Header->Type = 0;
+    ASSERT(!frame_decode(Buffer, Length, &Frame));
+    Header->Type = 0xff;
+    ASSERT(!frame_decode(Buffer, Length, &Frame));
+    Header->Type = SpdFrameRspType;
+
+    Header->Version = SPD_FRAME_VERSION + 1;
+    ASSERT(!frame_decode(Buffer, Length, &Frame));
+    Header->Version = SPD_FRAME_VERSION;
+
+    ASSERT(frame_decode(Buffer, Length, &Frame));
+    for (ULONG I = 0; Length > I; I++)
+        ASSERT(!frame_decode(Buffer, I, &Frame));
+}
+
+static void frame_split_test(void)
+{
+    UINT8 Buffer[sizeof(SPD_FRAME_HEADER) + sizeof(SPD_IOCTL_TRANSACT_REQ) + sizeof(SPD_IOCTL_TRANSACT_RSP)];
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    SPD_FRAME Frame;
+    ULONG Length;
+
+    /* the header of a WRITE request, with its data still to come */
+    memset(&Req, 0, sizeof Req);
+    Req.Hint = 11;
+    Req.Kind = SpdIoctlTransactWriteKind;
+    Req.Op.Write.BlockCount = 2;
+    Length = SpdFrameEncode(Buffer, SPD_FRAME_VERSION, SpdFrameReqType, &Req,
+        2 * TEST_BLOCK_LENGTH);
+    ASSERT(SpdFrameDecodeHeader(Buffer, Length,
+        TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH, &Frame));
+    ASSERT(SpdFrameReqType == Frame.Type);
+    ASSERT(0 == memcmp(Frame.Message, &Req, sizeof Req));
+    ASSERT(0 == Frame.Data);
+    ASSERT(2 * TEST_BLOCK_LENGTH == Frame.DataLength);
+
+    /* the header must come alone; data that came along are not accounted for */
+    ASSERT(!SpdFrameDecodeHeader(Buffer, Length + 8,
+        TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH, &Frame));
+    ASSERT(!SpdFrameDecodeHeader(Buffer, Length - 8,
+        TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH, &Frame));
+
+    /* the request is still checked against its data length */
+    SpdFrameEncode(Buffer, SPD_FRAME_VERSION, SpdFrameReqType, &Req, TEST_BLOCK_LENGTH);
+    ASSERT(!SpdFrameDecodeHeader(Buffer, Length,
+        TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH, &Frame));
+
+    /* the header of a READ response */
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = 11;
+    Rsp.Kind = SpdIoctlTransactReadKind;
+    Length = SpdFrameEncode(Buffer, SPD_FRAME_VERSION, SpdFrameRspType, &Rsp,
+        TEST_MAX_TRANSFER_LENGTH);
+    ASSERT(SpdFrameDecodeHeader(Buffer, Length,
+        TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH, &Frame));
+    ASSERT(0 == Frame.Data);
+    ASSERT(TEST_MAX_TRANSFER_LENGTH == Frame.DataLength);
+
+    /* a complete frame is not a header */
+    ASSERT(!frame_decode(Buffer, Length, &Frame));
+}
+
+/*
+ * Fuzz the decoder: random buffers and random mutations of valid frames. Every buffer
+ * is allocated at its exact length, so that a read past the end is caught by tools
+ * such as a debug heap or address sanitizer. A frame that decodes must be consistent.
+ */
+static ULONG frame_random(PULONG PSeed)
+{
+    *PSeed = *PSeed * 1103515245 + 12345;
+    return *PSeed >> 8;
+}
+
+static void frame_check_decoded(PUINT8 Buffer, ULONG Length, SPD_FRAME *Frame)
+{
+    SPD_FRAME_HEADER *Header = (PVOID)Buffer;
+
+    ASSERT(SpdFrameHelloType == Frame->Type ||
+        SpdFrameReqType == Frame->Type ||
+        SpdFrameRspType == Frame->Type);
+    ASSERT(Header->HeaderLength + Frame->DataLength == Length);
+    ASSERT(TEST_MAX_TRANSFER_LENGTH >= Frame->DataLength);
+    ASSERT(Buffer + Header->HeaderLength == Frame->Data);
+    if (SpdFrameReqType == Frame->Type)
+        ASSERT(SpdFrameReqDataLength(Frame->Message,
+            TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH) == Frame->DataLength);
+}
+
+static void frame_fuzz_test(void)
+{
+    ULONG Seed = 0x5eed;
+    PUINT8 Valid, Buffer;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_FRAME Frame;
+    ULONG ValidLength, Length, Decoded = 0;
+
+    Valid = malloc(TEST_FRAME_MAX);
+    ASSERT(0 != Valid);
+
+    for (ULONG Round = 0; 100000 > Round; Round++)
+    {
+        if (0 == Round % 2)
+        {
+            /* random bytes behind a plausible header */
+            Length = frame_random(&Seed) % (sizeof(SPD_FRAME_HEADER) + 128);
+            Buffer = malloc(0 != Length ? Length : 1);
+            ASSERT(0 != Buffer);
+            for (ULONG I = 0; Length > I; I++)
+                Buffer[I] = (UINT8)frame_random(&Seed);
+            if (sizeof(SPD_FRAME_HEADER) <= Length && 0 != frame_random(&Seed) % 4)
+            {
+                ((SPD_FRAME_HEADER *)Buffer)->Magic = SPD_FRAME_MAGIC;
+                ((SPD_FRAME_HEADER *)Buffer)->Version = SPD_FRAME_VERSION;
+            }
+        }
+        else
+        {
+            /* a valid WRITE with a few bytes flipped and a random length */
+            memset(&Req, 0, sizeof Req);
+            Req.Hint = Round;
+            Req.Kind = SpdIoctlTransactWriteKind;
+            Req.Op.Write.BlockCount = 1 + frame_random(&Seed) % 2;
+            ValidLength = SpdFrameEncode(Valid, SPD_FRAME_VERSION, SpdFrameReqType, &Req,
+                Req.Op.Write.BlockCount * TEST_BLOCK_LENGTH);
+            ValidLength += Req.Op.Write.BlockCount * TEST_BLOCK_LENGTH;
+            memset(Valid + sizeof(SPD_FRAME_HEADER) + sizeof Req, 0xa5,
+                ValidLength - sizeof(SPD_FRAME_HEADER) - sizeof Req);
+
+            Length = ValidLength;
+            switch (frame_random(&Seed) % 4)
+            {
+            case 0:
+                Length -= frame_random(&Seed) % ValidLength;
+                break;
+            case 1:
+                Length += frame_random(&Seed) % 64;
+                break;
+            }
+            Buffer = malloc(0 != Length ? Length : 1);
+            ASSERT(0 != Buffer);
+            memcpy(Buffer, Valid, Length < ValidLength ? Length : ValidLength);
+            if (Length > ValidLength)
+                memset(Buffer + ValidLength, 0x5a, Length - ValidLength);
+            for (ULONG Flips = frame_random(&Seed) % 4, I = 0; Flips > I && 0 != Length; I++)
+                Buffer[frame_random(&Seed) % (sizeof(SPD_FRAME_HEADER) + sizeof Req < Length ?
+                    sizeof(SPD_FRAME_HEADER) + sizeof Req : Length)] ^=
+                    (UINT8)(1 << frame_random(&Seed) % 8);
+        }
+
+        if (frame_decode(Buffer, Length, &Frame))
+        {
+            frame_check_decoded(Buffer, Length, &Frame);
+            Decoded++;
+        }
+
+        free(Buffer);
+    }
+
+    free(Valid);
+
+    tlib_printf("decoded=%lu/100000 ", (unsigned long)Decoded);
+}
+
+void frame_tests(void)
+{
+    TEST(frame_hello_test);
+    TEST(frame_req_test);
+    TEST(frame_rsp_test);
+    TEST(frame_header_test);
+    TEST(frame_split_test);
+    TEST(frame_fuzz_test);
+}
+
+#if !defined(_WIN32)
+int main(int argc, char *argv[])
+{
+    TESTSUITE(frame_tests);
+
+    tlib_run_tests(argc, argv);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,443 @@
+/**
+ * @file hintmap-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#if defined(_WIN32)
+#include <winspd/winspd.h>
+#include <process.h>
+#else
+#include <shared/posix.h>
+#include <winspd/ioctl.h>
+#endif
+#include <shared/hintmap.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+static UINT64 hintmap_take(SPD_HINT_MAP *Map, UINT64 Hint)
+{
+    UINT64 Value;
+
+    if (!SpdHintMapTake(Map, Hint, &Value))
+        return (UINT64)-1;
+
+    return Value;
+}
+
+static void hintmap_basic_test(void)
+{
+    SPD_HINT_MAP Map;
+    UINT64 Value;
+
+    ASSERT(ERROR_SUCCESS == SpdHintMapInitialize(&Map, 16));
+
+    ASSERT(!SpdHintMapPut(&Map, 0, 1));
+    ASSERT(!SpdHintMapTake(&Map, 0, &Value));
+
+    ASSERT(SpdHintMapPut(&Map, 42, 4096));
+    ASSERT(!SpdHintMapPut(&Map, 42, 512));
+    ASSERT(SpdHintMapPut(&Map, (UINT64)-1, 512));
+    ASSERT(!SpdHintMapTake(&Map, 43, &Value));
+    ASSERT(0 == Value);
+    ASSERT(4096 == hintmap_take(&Map, 42));
+    ASSERT((UINT64)-1 == hintmap_take(&Map, 42));
+    ASSERT(512 == hintmap_take(&Map, (UINT64)-1));
+
+    /* a taken hint may be put again; values are 64-bit and may be 0 */
+    ASSERT(SpdHintMapPut(&Map, 42, 0x100000400ULL));
+    ASSERT(0x100000400ULL == hintmap_take(&Map, 42));
+    ASSERT(SpdHintMapPut(&Map, 42, 0));
+    ASSERT(0 == hintmap_take(&Map, 42));
+
+    SpdHintMapFinalize(&Map);
+}
+
+static void hintmap_source_test(void)
+{
+    SPD_HINT_MAP Map;
+    UINT64 Key;
+
+    ASSERT(ERROR_SUCCESS == SpdHintMapInitialize(&Map, SPD_HINT_MAP_SOURCE_MAX));
+
+    /* a hint-0 READ (legacy unframed client) on every source: 0 gets a non-zero key */
+    for (ULONG Source = 0; SPD_HINT_MAP_SOURCE_MAX > Source; Source++)
+    {
+        Key = SpdHintMapKey(0, Source);
+        ASSERT(0 != Key);
+        ASSERT(0 == SpdHintMapHint(Key, Source));
+        ASSERT(SpdHintMapPut(&Map, Key, 4096 + Source));
+    }
+    for (ULONG Source = 0; SPD_HINT_MAP_SOURCE_MAX > Source; Source++)
+        ASSERT(4096 + Source == hintmap_take(&Map, SpdHintMapKey(0, Source)));
+
+    /* sources may use the same hints; a duplicate within a source is still rejected */
+    ASSERT(SpdHintMapPut(&Map, SpdHintMapKey(42, 0), 1));
+    ASSERT(SpdHintMapPut(&Map, SpdHintMapKey(42, 1), 2));
+    ASSERT(!SpdHintMapPut(&Map, SpdHintMapKey(42, 1), 3));
+    ASSERT(2 == hintmap_take(&Map, SpdHintMapKey(42, 1)));
+    ASSERT(1 == hintmap_take(&Map, SpdHintMapKey(42, 0)));
+
+    /* keys of different sources are far apart, so counters and pointers never meet */
+    for (ULONG Source = 1; SPD_HINT_MAP_SOURCE_MAX > Source; Source++)
+    {
+        Key = SpdHintMapKey(0, Source) - SpdHintMapKey(0, 0);
+        ASSERT(1ULL << 49 <= Key && 0 - (1ULL << 49) >= Key);
+        ASSERT((UINT64)-1 == SpdHintMapHint(SpdHintMapKey((UINT64)-1, Source), Source));
+    }
+
+    SpdHintMapFinalize(&Map);
+}
+
+static void hintmap_depth_test(void)
+{
+    SPD_HINT_MAP Map;
+    ULONG Depth = 256;
+
+    ASSERT(ERROR_SUCCESS == SpdHintMapInitialize(&Map, Depth));
+
+    /* the expected depth fits */
+    for (ULONG Round = 0; 1000 > Round; Round++)
+    {
+        UINT64 Base = (UINT64)Round * 0x9e3779b97f4a7c15ULL;
+
+        for (ULONG I = 0; Depth > I; I++)
+            ASSERT(SpdHintMapPut(&Map, Base + I + 1, I + 1));
+        for (ULONG I = 0; Depth > I; I++)
+            ASSERT(I + 1 == hintmap_take(&Map, Base + I + 1));
+    }
+
+    /* the map is empty again */
+    for (ULONG I = 0; (Map.BucketMask + 1) * SPD_HINT_MAP_BUCKET_SIZE > I; I++)
+        ASSERT(0 == Map.Slots[I].Hint);
+
+    SpdHintMapFinalize(&Map);
+}
+
+/*
+ * Stress harness.
+ *
+ * Dispatcher threads put hints for the requests they receive; the responses for
+ * those requests are taken by other (completer) threads, as happens when requests
+ * are completed asynchronously. Each dispatcher uses its own hint range, so every
+ * take must find exactly the value that was put for its hint.
+ */
+#define HINTMAP_TEST_THREAD_MAX         16
+#define HINTMAP_TEST_WINDOW             8
+
+typedef struct
+{
+    SPD_HINT_MAP Map;
+    SRWLOCK Lock;
+    UINT64 *Queue;
+    ULONG QueueHead, QueueTail, QueueSize;
+    ULONG Count;
+    LONG Dispatchers;
+    LONG PutFailures, TakeFailures;
+} HINTMAP_TEST_DATA;
+
+static unsigned __stdcall hintmap_dispatcher_thread(void *Data0)
+{
+    HINTMAP_TEST_DATA *Data = Data0;
+    static LONG ThreadIndex;
+    UINT64 Base = (UINT64)InterlockedIncrement(&ThreadIndex) << 40;
+    UINT64 Hint;
+
+    for (ULONG I = 0; Data->Count > I;)
+    {
+        Hint = Base + I + 1;
+        if (!SpdHintMapPut(&Data->Map, Hint, SpdHintMapHash(Hint)))
+        {
+            InterlockedIncrement(&Data->PutFailures);
+            break;
+        }
+
+        for (;;)
+        {
+            AcquireSRWLockExclusive(&Data->Lock);
+            if (Data->QueueSize > Data->QueueTail - Data->QueueHead)
+            {
+                Data->Queue[Data->QueueTail++ % Data->QueueSize] = Hint;
+                Hint = 0;
+            }
+            ReleaseSRWLockExclusive(&Data->Lock);
+            if (0 == Hint)
+                break;
+            SwitchToThread();
+        }
+
+        I++;
+    }
+
+    InterlockedDecrement(&Data->Dispatchers);
+
+    return 0;
+}
+
+static unsigned __stdcall hintmap_completer_thread(void *Data0)
+{
+    HINTMAP_TEST_DATA *Data = Data0;
+    UINT64 Hint;
+
+    for (;;)
+    {
+        Hint = 0;
+        AcquireSRWLockExclusive(&Data->Lock);
+        if (Data->QueueHead != Data->QueueTail)
+            Hint = Data->Queue[Data->QueueHead++ % Data->QueueSize];
+        ReleaseSRWLockExclusive(&Data->Lock);
+
+        if (0 == Hint)
+        {
+            if (0 == Data->Dispatchers && Data->QueueHead == Data->QueueTail)
+                break;
+            SwitchToThread();
+            continue;
+        }
+
+        if (SpdHintMapHash(Hint) != hintmap_take(&Data->Map, Hint))
+            InterlockedIncrement(&Data->TakeFailures);
+    }
+
+    return 0;
+}
+
+static void hintmap_stress_dotest(ULONG DispatcherCount, ULONG CompleterCount, ULONG Count)
+{
+    HINTMAP_TEST_DATA *Data;
+    HANDLE Threads[HINTMAP_TEST_THREAD_MAX];
+
+    ASSERT(HINTMAP_TEST_THREAD_MAX >= DispatcherCount + CompleterCount);
+
+    Data = calloc(1, sizeof *Data);
+    ASSERT(0 != Data);
+    InitializeSRWLock(&Data->Lock);
+    Data->QueueSize = DispatcherCount * HINTMAP_TEST_WINDOW;
+    Data->Queue = calloc(Data->QueueSize, sizeof Data->Queue[0]);
+    ASSERT(0 != Data->Queue);
+    Data->Count = Count;
+    Data->Dispatchers = DispatcherCount;
+
+    /* requests in flight: those queued plus one per dispatcher */
+    ASSERT(ERROR_SUCCESS == SpdHintMapInitialize(&Data->Map,
+        Data->QueueSize + DispatcherCount));
+
+    for (ULONG I = 0; DispatcherCount > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, hintmap_dispatcher_thread, Data, 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = DispatcherCount; DispatcherCount + CompleterCount > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, hintmap_completer_thread, Data, 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; DispatcherCount + CompleterCount > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        CloseHandle(Threads[I]);
+    }
+
+    ASSERT(0 == Data->PutFailures);
+    ASSERT(0 == Data->TakeFailures);
+    ASSERT(Data->QueueHead == DispatcherCount * Count);
+    for (ULONG I = 0; (Data->Map.BucketMask + 1) * SPD_HINT_MAP_BUCKET_SIZE > I; I++)
+        ASSERT(0 == Data->Map.Slots[I].Hint);
+
+    SpdHintMapFinalize(&Data->Map);
+    free(Data->Queue);
+    free(Data);
+}
+
+static void hintmap_stress_test(void)
+{
+    hintmap_stress_dotest(1, 1, 100000);
+    hintmap_stress_dotest(4, 4, 100000);
+    hintmap_stress_dotest(8, 2, 50000);
+}
+
+/*
+ * Benchmark harness.
+ *
+ * Each thread puts and takes a window of hints, as a pipe dispatcher thread does for
+ * its READ requests. The locked variant models the hint table that the pipe transport
+ * used before: a chained hash under an exclusive lock with an allocation per hint.
+ */
+typedef struct _HINTMAP_TEST_ITEM
+{
+    struct _HINTMAP_TEST_ITEM *HashNext;
+    UINT64 Hint;
+    ULONG Value;
+} HINTMAP_TEST_ITEM;
+typedef struct
+{
+    SPD_HINT_MAP Map;
+    SRWLOCK Lock;
+    HINTMAP_TEST_ITEM *HashBuckets[61];
+    BOOLEAN UseMap;
+    ULONG Count;
+    LONG ThreadIndex;
+    LONG Failures;
+} HINTMAP_BENCH_DATA;
+
+static BOOLEAN hintmap_locked_put(HINTMAP_BENCH_DATA *Data, UINT64 Hint, ULONG Value)
+{
+    ULONG HashIndex = SpdHintMapHash(Hint) % 61;
+    HINTMAP_TEST_ITEM *Item;
+    BOOLEAN Result = FALSE;
+
+    AcquireSRWLockExclusive(&Data->Lock);
+    for (Item = Data->HashBuckets[HashIndex]; Item; Item = Item->HashNext)
+        if (Item->Hint == Hint)
+            goto exit;
+    Item = HeapAlloc(GetProcessHeap(), 0, sizeof *Item);
+    if (0 == Item)
+        goto exit;
+    Item->Hint = Hint;
+    Item->Value = Value;
+    Item->HashNext = Data->HashBuckets[HashIndex];
+    Data->HashBuckets[HashIndex] = Item;
+    Result = TRUE;
+exit:
+    ReleaseSRWLockExclusive(&Data->Lock);
+
+    return Result;
+}
+
+static ULONG hintmap_locked_take(HINTMAP_BENCH_DATA *Data, UINT64 Hint)
+{
+    ULONG HashIndex = SpdHintMapHash(Hint) % 61;
+    HINTMAP_TEST_ITEM *Item;
+    ULONG Result = 0;
+
+    AcquireSRWLockExclusive(&Data->Lock);
+    for (HINTMAP_TEST_ITEM **P = &Data->HashBuckets[HashIndex]; *P; P = &(*P)->HashNext)
+        if ((*P)->Hint == Hint)
+        {
+            Item = *P;
+            *P = Item->HashNext;
+            Result = Item->Value;
+            HeapFree(GetProcessHeap(), 0, Item);
+            break;
+        }
+    ReleaseSRWLockExclusive(&Data->Lock);
+
+    return Result;
+}
+
+static unsigned __stdcall hintmap_bench_thread(void *Data0)
+{
+    HINTMAP_BENCH_DATA *Data = Data0;
+    UINT64 Base = (UINT64)InterlockedIncrement(&Data->ThreadIndex) << 40;
+    UINT64 Hint;
+
+    for (ULONG I = 0; Data->Count > I; I += HINTMAP_TEST_WINDOW)
+    {
+        for (ULONG J = 0; HINTMAP_TEST_WINDOW > J; J++)
+        {
+            Hint = Base + I + J + 1;
+            if (!(Data->UseMap ?
+                SpdHintMapPut(&Data->Map, Hint, J + 1) :
+                hintmap_locked_put(Data, Hint, J + 1)))
+                InterlockedIncrement(&Data->Failures);
+        }
+        for (ULONG J = 0; HINTMAP_TEST_WINDOW > J; J++)
+        {
+            Hint = Base + I + J + 1;
+            if (J + 1 != (Data->UseMap ?
+                hintmap_take(&Data->Map, Hint) :
+                hintmap_locked_take(Data, Hint)))
+                InterlockedIncrement(&Data->Failures);
+        }
+    }
+
+    return 0;
+}
+
+static void hintmap_bench_dotest(BOOLEAN UseMap, ULONG ThreadCount, ULONG Count)
+{
+    HINTMAP_BENCH_DATA *Data;
+    HANDLE Threads[HINTMAP_TEST_THREAD_MAX];
+    LARGE_INTEGER Frequency, Start, Stop;
+    UINT64 Nanoseconds;
+
+    ASSERT(HINTMAP_TEST_THREAD_MAX >= ThreadCount);
+
+    Data = calloc(1, sizeof *Data);
+    ASSERT(0 != Data);
+    InitializeSRWLock(&Data->Lock);
+    ASSERT(ERROR_SUCCESS == SpdHintMapInitialize(&Data->Map, ThreadCount * HINTMAP_TEST_WINDOW));
+    Data->UseMap = UseMap;
+    Data->Count = Count;
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, hintmap_bench_thread, Data, 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        CloseHandle(Threads[I]);
+    }
+
+    QueryPerformanceCounter(&Stop);
+
+    ASSERT(0 == Data->Failures);
+
+    /* one put and one take per hint */
+    Nanoseconds = (UINT64)(Stop.QuadPart - Start.QuadPart) * 1000000000 /
+        Frequency.QuadPart / ((UINT64)Count * ThreadCount);
+
+    tlib_printf("%s/%u ns/hint=%u ",
+        UseMap ? "map" : "locked", (unsigned)ThreadCount, (unsigned)Nanoseconds);
+
+    SpdHintMapFinalize(&Data->Map);
+    free(Data);
+}
+
+static void hintmap_bench_test(void)
+{
+    hintmap_bench_dotest(FALSE, 1, 1000000);
+    hintmap_bench_dotest(TRUE, 1, 1000000);
+    hintmap_bench_dotest(FALSE, 8, 200000);
+    hintmap_bench_dotest(TRUE, 8, 200000);
+}
+
+void hintmap_tests(void)
+{
+    TEST(hintmap_basic_test);
+    TEST(hintmap_source_test);
+    TEST(hintmap_depth_test);
+    TEST(hintmap_stress_test);
+    TEST_OPT(hintmap_bench_test);
+}
+
+#if !defined(_WIN32)
+int main(int argc, char *argv[])
+{
+    TESTSUITE(hintmap_tests);
+
+    tlib_run_tests(argc, argv);
+
+    return 0;
+}
+#endif
@@ -438,6 +438,88 @@ static void ioctl_transact_read_chunked_test(void)
     ioctl_transact_read_dotest(3);
 }
 
+static void ioctl_transact_read_registered_test(void)
+{
+    SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    PVOID DataBuffer = 0;
+    HANDLE DeviceHandle;
+    UINT32 Btl, Index, Index2;
+    DWORD Error;
+    BOOL Success;
+    HANDLE Thread;
+    DWORD ExitCode;
+
+    DataBuffer = malloc(5 * 512);
+    ASSERT(0 != DataBuffer);
+
+    Error = SpdIoctlOpenDevice(L"" SPD_IOCTL_HARDWARE_ID, &DeviceHandle);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    memset(&StorageUnitParams, 0, sizeof StorageUnitParams);
+    memcpy(&StorageUnitParams.Guid, &TestGuid, sizeof TestGuid);
+    StorageUnitParams.BlockCount = 16;
+    StorageUnitParams.BlockLength = 512;
+    StorageUnitParams.MaxTransferLength = 5 * 512;
+    Error = SpdIoctlProvision(DeviceHandle, &StorageUnitParams, &Btl);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Btl);
+
+    Error = SpdIoctlRegisterBuffer(DeviceHandle, Btl, DataBuffer, 5 * 512, &Index);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(SPD_IOCTL_REGISTERED_BUFFER_MAX > Index);
+
+    /* a buffer smaller than MaxTransferLength cannot be used to transact */
+    Error = SpdIoctlRegisterBuffer(DeviceHandle, Btl, DataBuffer, 512, &Index2);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(Index != Index2);
+    Error = SpdIoctlTransactRegistered(DeviceHandle, Btl, 0, &Req, Index2);
+    ASSERT(ERROR_INVALID_PARAMETER == Error);
+    Error = SpdIoctlUnregisterBuffer(DeviceHandle, Btl, Index2);
+    ASSERT(ERROR_SUCCESS == Error);
+    Error = SpdIoctlUnregisterBuffer(DeviceHandle, Btl, Index2);
+    ASSERT(ERROR_INVALID_PARAMETER == Error);
+
+    Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_read_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
+    ASSERT(0 != Thread);
+
+    Error = SpdIoctlTransactRegistered(DeviceHandle, Btl, 0, &Req, Index);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    ASSERT(0 != Req.Hint);
+    ASSERT(SpdIoctlTransactReadKind == Req.Kind);
+    ASSERT(7 == Req.Op.Read.BlockAddress);
+    ASSERT(5 == Req.Op.Read.BlockCount);
+
+    FillOrTest(DataBuffer, 512, 7, 5, SpdIoctlTransactReservedKind);
+
+    memset(&Rsp, 0, sizeof Rsp);
+    Rsp.Hint = Req.Hint;
+    Rsp.Kind = Req.Kind;
+
+    Error = SpdIoctlTransactRegistered(DeviceHandle, Btl, &Rsp, 0, Index);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    /* leave the buffer registered; unprovision must release it */
+    Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
+    ASSERT(ERROR_SUCCESS == Error);
+
+    Success = CloseHandle(DeviceHandle);
+    ASSERT(Success);
+
+    free(DataBuffer);
+
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+
+    ASSERT(ERROR_SUCCESS == ExitCode);
+}
+
 static unsigned __stdcall ioctl_transact_write_test_thread(void *Data)
 {
     UINT32 Btl = (UINT32)(UINT_PTR)Data;
@@ -646,6 +728,7 @@ static void ioctl_transact_flush_test(void)
     SPD_IOCTL_STORAGE_UNIT_PARAMS StorageUnitParams;
     SPD_IOCTL_TRANSACT_REQ Req;
     SPD_IOCTL_TRANSACT_RSP Rsp;
+    SPD_IOCTL_GET_STATS_PARAMS Stats;
     PVOID DataBuffer = 0;
     HANDLE DeviceHandle;
     UINT32 Btl;
@@ -673,6 +756,12 @@ static void ioctl_transact_flush_test(void)
     Error = SpdIoctlScsiInquiry(DeviceHandle, Btl, 0, 3000);
     ASSERT(ERROR_SUCCESS == Error);
 
+    Error = SpdIoctlGetStats(DeviceHandle, Btl, SpdIoctlStatsTimingOn, &Stats);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(1 == Stats.Timing);
+    ASSERT(0 == Stats.LockHoldCount);
+    ASSERT(0 == Stats.CompleteCount);
+
     Thread = (HANDLE)_beginthreadex(0, 0, ioctl_transact_flush_test_thread, (PVOID)(UINT_PTR)Btl, 0, 0);
     ASSERT(0 != Thread);
 
@@ -692,6 +781,12 @@ static void ioctl_transact_flush_test(void)
     Error = SpdIoctlTransact(DeviceHandle, Btl, &Rsp, 0, DataBuffer);
     ASSERT(ERROR_SUCCESS == Error);
 
+    Error = SpdIoctlGetStats(DeviceHandle, Btl, SpdIoctlStatsTimingOff, &Stats);
+    ASSERT(ERROR_SUCCESS == Error);
+    ASSERT(0 == Stats.Timing);
+    ASSERT(0 != Stats.LockHoldCount);
+    ASSERT(0 != Stats.CompleteCount);
+
     Error = SpdIoctlUnprovision(DeviceHandle, &StorageUnitParams.Guid);
     ASSERT(ERROR_SUCCESS == Error);
 
@@ -1399,6 +1494,7 @@ void ioctl_tests(void)
     TEST(ioctl_list_test);
     TEST(ioctl_transact_read_test);
     TEST(ioctl_transact_read_chunked_test);
+    TEST(ioctl_transact_read_registered_test);
     TEST(ioctl_transact_write_test);
     TEST(ioctl_transact_write_chunked_test);
     TEST(ioctl_transact_flush_test);
@@ -0,0 +1,543 @@
+/**
+ * @file iosched-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winspd/winspd.h>
+
+/* the scheduler runs on simulated time */
+static UINT64 iosched_now;
+#define SpdIoSchedNow()                 (iosched_now)
+#include <shared/iosched.h>
+#include <shared/mqueue.h>
+#include <tlib/testsuite.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_BUCKET_COUNT               64
+#define TEST_US                         10ULL
+#define TEST_MS                         10000ULL
+
+typedef struct
+{
+    SPD_MQ_ENTRY Entry;
+    ULONG Id;
+    UINT64 Arrival;
+} IOSCHED_TEST_REQ;
+
+typedef struct
+{
+    SPD_MQ Mq;
+    SPD_MQ_QUEUE *Queues;
+    SPD_MQ_ENTRY **Buckets;
+} IOSCHED_TEST_QUEUE;
+
+static void iosched_create(IOSCHED_TEST_QUEUE *Q, ULONG QueueCount,
+    UINT8 Policy, UINT32 MaxIops, UINT64 MaxBandwidth)
+{
+    Q->Queues = _aligned_malloc(QueueCount * sizeof Q->Queues[0], 64);
+    Q->Buckets = malloc(QueueCount * TEST_BUCKET_COUNT * sizeof Q->Buckets[0]);
+    ASSERT(0 != Q->Queues && 0 != Q->Buckets);
+    SpdMqInitialize(&Q->Mq, Q->Queues, QueueCount, Q->Buckets, TEST_BUCKET_COUNT);
+    SpdMqSetScheduler(&Q->Mq, Policy, MaxIops, MaxBandwidth);
+}
+
+static void iosched_delete(IOSCHED_TEST_QUEUE *Q)
+{
+    free(Q->Buckets);
+    _aligned_free(Q->Queues);
+}
+
+static void iosched_post(SPD_MQ *Mq, IOSCHED_TEST_REQ *Req, UINT8 Kind, ULONG Length)
+{
+    SPD_MQ_QUEUE *Queue = SpdMqQueue(Mq, (UINT64)(UINT_PTR)&Req->Entry);
+
+    Req->Entry.Class = SpdIoSchedClass(Kind);
+    Req->Entry.Length = Length;
+    Req->Arrival = iosched_now;
+
+    SpdMqLockAcquire(&Queue->Lock);
+    SpdMqPostNoLock(Mq, Queue, &Req->Entry, FALSE);
+    SpdMqLockRelease(&Queue->Lock);
+}
+
+static IOSCHED_TEST_REQ *iosched_take(SPD_MQ *Mq)
+{
+    SPD_MQ_QUEUE *Queue;
+    SPD_MQ_ENTRY *Entry;
+
+    Entry = SpdMqTake(Mq, 0, &Queue);
+    if (0 == Entry)
+        return 0;
+    SpdMqLockRelease(&Queue->Lock);
+
+    return CONTAINING_RECORD(Entry, IOSCHED_TEST_REQ, Entry);
+}
+
+static void iosched_bucket_test(void)
+{
+    SPD_IOSCHED Sched;
+    UINT64 Delay;
+
+    /* unlimited */
+    SpdIoSchedInitialize(&Sched, SpdIoctlSchedFifoPolicy, 0, 0, 0);
+    ASSERT(!SpdIoSchedLimited(&Sched));
+    for (ULONG I = 0; 1000 > I; I++)
+        ASSERT(SpdIoSchedAdmit(&Sched, 1024 * 1024, 0));
+    ASSERT(0 == SpdIoSchedDelay(&Sched, 0));
+
+    /* an invalid policy is FIFO */
+    SpdIoSchedInitialize(&Sched, SpdIoctlSchedPolicyCount, 0, 0, 0);
+    ASSERT(SpdIoctlSchedFifoPolicy == Sched.Policy);
+
+    /* 100 requests/s: a burst of 10, then one every 10ms */
+    SpdIoSchedInitialize(&Sched, SpdIoctlSchedFifoPolicy, 100, 0, 0);
+    ASSERT(SpdIoSchedLimited(&Sched));
+    for (ULONG I = 0; 10 > I; I++)
+        ASSERT(SpdIoSchedAdmit(&Sched, 0, 0));
+    ASSERT(!SpdIoSchedAdmit(&Sched, 0, 0));
+    Delay = SpdIoSchedDelay(&Sched, 0);
+    ASSERT(0 < Delay && 10 * TEST_MS >= Delay);
+    ASSERT(!SpdIoSchedAdmit(&Sched, 0, Delay - 1));
+    ASSERT(SpdIoSchedAdmit(&Sched, 0, Delay));
+    ASSERT(!SpdIoSchedAdmit(&Sched, 0, Delay));
+
+    /* idle time earns no more than a burst */
+    for (ULONG I = 0; 10 > I; I++)
+        ASSERT(SpdIoSchedAdmit(&Sched, 0, 3600 * SPD_IOSCHED_SECOND));
+    ASSERT(!SpdIoSchedAdmit(&Sched, 0, 3600 * SPD_IOSCHED_SECOND));
+
+    /* 1MB/s: a large request is admitted and its debt holds back the next one */
+    SpdIoSchedInitialize(&Sched, SpdIoctlSchedFifoPolicy, 0, 1024 * 1024, 0);
+    ASSERT(SpdIoSchedAdmit(&Sched, 1024 * 1024, 0));
+    ASSERT(!SpdIoSchedAdmit(&Sched, 512, 0));
+    Delay = SpdIoSchedDelay(&Sched, 0);
+    ASSERT(SPD_IOSCHED_SECOND - SPD_IOSCHED_BURST <= Delay && SPD_IOSCHED_SECOND >= Delay);
+    ASSERT(SpdIoSchedAdmit(&Sched, 512, Delay));
+
+    /* bandwidth is capped so that credit cannot overflow */
+    SpdIoSchedInitialize(&Sched, SpdIoctlSchedFifoPolicy, 0, ~0ULL, 0);
+    ASSERT(SPD_IOSCHED_BANDWIDTH_MAX == Sched.MaxBandwidth);
+    ASSERT(0 < Sched.ByteCredit);
+}
+
+static void iosched_pick_test(void)
+{
+    IOSCHED_TEST_QUEUE Q;
+    IOSCHED_TEST_REQ Reqs[64], *Req;
+
+    memset(Reqs, 0, sizeof Reqs);
+    for (ULONG I = 0; 64 > I; I++)
+        Reqs[I].Id = I;
+    iosched_now = 0;
+
+    /* FIFO: posting order regardless of class */
+    iosched_create(&Q, 1, SpdIoctlSchedFifoPolicy, 0, 0);
+    for (ULONG I = 0; 8 > I; I++)
+        iosched_post(&Q.Mq, &Reqs[I], 0 == I % 2 ? SpdIoctlTransactWriteKind :
+            SpdIoctlTransactReadKind, 4096);
+    for (ULONG I = 0; 8 > I; I++)
+        ASSERT(&Reqs[I] == iosched_take(&Q.Mq));
+    ASSERT(0 == iosched_take(&Q.Mq));
+    iosched_delete(&Q);
+
+    /* Priority: reads and flushes first, but a write every SPD_IOSCHED_STARVE_MAX */
+    iosched_create(&Q, 1, SpdIoctlSchedPriorityPolicy, 0, 0);
+    for (ULONG I = 0; 4 > I; I++)
+        iosched_post(&Q.Mq, &Reqs[I], SpdIoctlTransactWriteKind, 1024 * 1024);
+    for (ULONG I = 4; 4 + 2 * SPD_IOSCHED_STARVE_MAX > I; I++)
+        iosched_post(&Q.Mq, &Reqs[I], 0 == I % 3 ? SpdIoctlTransactFlushKind :
+            SpdIoctlTransactReadKind, 4096);
+    for (ULONG I = 4; 4 + SPD_IOSCHED_STARVE_MAX > I; I++)
+        ASSERT(&Reqs[I] == iosched_take(&Q.Mq));
+    ASSERT(&Reqs[0] == iosched_take(&Q.Mq));
+    for (ULONG I = 4 + SPD_IOSCHED_STARVE_MAX; 4 + 2 * SPD_IOSCHED_STARVE_MAX > I; I++)
+        ASSERT(&Reqs[I] == iosched_take(&Q.Mq));
+    ASSERT(&Reqs[1] == iosched_take(&Q.Mq));
+    ASSERT(&Reqs[2] == iosched_take(&Q.Mq));
+
+    /* a request posted at the head is taken next within its class */
+    iosched_post(&Q.Mq, &Reqs[40], SpdIoctlTransactReadKind, 4096);
+    Reqs[41].Entry.Class = SpdIoSchedUrgentClass;
+    SpdMqLockAcquire(&Q.Queues[0].Lock);
+    SpdMqPostNoLock(&Q.Mq, &Q.Queues[0], &Reqs[41].Entry, TRUE);
+    SpdMqLockRelease(&Q.Queues[0].Lock);
+    ASSERT(&Reqs[41] == iosched_take(&Q.Mq));
+    ASSERT(&Reqs[40] == iosched_take(&Q.Mq));
+    ASSERT(&Reqs[3] == iosched_take(&Q.Mq));
+    ASSERT(0 == iosched_take(&Q.Mq));
+    iosched_delete(&Q);
+
+    /* Deadline: reads first, until a write has waited past its deadline */
+    iosched_create(&Q, 1, SpdIoctlSchedDeadlinePolicy, 0, 0);
+    iosched_post(&Q.Mq, &Reqs[0], SpdIoctlTransactWriteKind, 1024 * 1024);
+    iosched_now = SPD_IOSCHED_BULK_EXPIRE - SPD_IOSCHED_URGENT_EXPIRE - 1;
+    iosched_post(&Q.Mq, &Reqs[1], SpdIoctlTransactReadKind, 4096);
+    iosched_now++;
+    iosched_post(&Q.Mq, &Reqs[2], SpdIoctlTransactReadKind, 4096);
+    iosched_now++;
+    iosched_post(&Q.Mq, &Reqs[3], SpdIoctlTransactReadKind, 4096);
+    ASSERT(&Reqs[1] == iosched_take(&Q.Mq));
+    ASSERT(&Reqs[2] == iosched_take(&Q.Mq));
+    ASSERT(&Reqs[0] == iosched_take(&Q.Mq));
+    ASSERT(&Reqs[3] == iosched_take(&Q.Mq));
+    ASSERT(0 == iosched_take(&Q.Mq));
+    iosched_delete(&Q);
+
+    /* rate limit: requests are held back, not lost */
+    iosched_now = 0;
+    iosched_create(&Q, 2, SpdIoctlSchedPriorityPolicy, 20, 0);
+    for (ULONG I = 0; 4 > I; I++)
+        iosched_post(&Q.Mq, &Reqs[I], SpdIoctlTransactReadKind, 4096);
+    ASSERT(0 != iosched_take(&Q.Mq));
+    ASSERT(0 != iosched_take(&Q.Mq));
+    ASSERT(0 == iosched_take(&Q.Mq));
+    ASSERT(2 == Q.Mq.PendingCount);
+    ASSERT(50 * TEST_MS >= SpdMqThrottleDelay(&Q.Mq));
+    iosched_now += SpdMqThrottleDelay(&Q.Mq);
+    ASSERT(0 == SpdMqThrottleDelay(&Q.Mq));
+    ASSERT(0 != iosched_take(&Q.Mq));
+    ASSERT(0 == iosched_take(&Q.Mq));
+    iosched_delete(&Q);
+}
+
+/*
+ * Simulation harness.
+ *
+ * Replays a request mix through a multi-queue with a given policy and rate limit, on
+ * simulated time. The storage unit is modeled as TEST_DEVICE_DEPTH dispatchers that
+ * serve a request in a fixed overhead plus its length over the device bandwidth. The
+ * harness reports the latency (posting to completion) of each class of requests.
+ *
+ * Besides the built-in mixes, a recorded mix may be replayed by pointing the
+ * WINSPD_IOSCHED_TRACE environment variable to a file of "<microseconds> <R|W|F|U>
+ * <bytes>" lines.
+ */
+#define TEST_DEVICE_DEPTH               4
+#define TEST_DEVICE_OVERHEAD            (50 * TEST_US)
+#define TEST_DEVICE_BANDWIDTH           (512ULL * 1024 * 1024)
+
+typedef struct
+{
+    UINT64 Time;
+    UINT8 Kind;
+    ULONG Length;
+} IOSCHED_TEST_RECORD;
+
+typedef struct
+{
+    ULONG Count[SpdIoSchedClassCount];
+    UINT64 P50[SpdIoSchedClassCount], P99[SpdIoSchedClassCount], Max[SpdIoSchedClassCount];
+    UINT64 Makespan;
+} IOSCHED_TEST_RESULT;
+
+static int iosched_compare(const void *A, const void *B)
+{
+    UINT64 X = *(const UINT64 *)A, Y = *(const UINT64 *)B;
+    return X < Y ? -1 : X > Y ? +1 : 0;
+}
+
+static UINT64 iosched_service_time(ULONG Length)
+{
+    return TEST_DEVICE_OVERHEAD + Length * SPD_IOSCHED_SECOND / TEST_DEVICE_BANDWIDTH;
+}
+
+static void iosched_replay(IOSCHED_TEST_RECORD *Trace, ULONG Count,
+    UINT8 Policy, UINT32 MaxIops, UINT64 MaxBandwidth,
+    IOSCHED_TEST_RESULT *Result)
+{
+    IOSCHED_TEST_QUEUE Q;
+    IOSCHED_TEST_REQ *Reqs, *Req;
+    IOSCHED_TEST_REQ *Slots[TEST_DEVICE_DEPTH];
+    UINT64 Finish[TEST_DEVICE_DEPTH];
+    UINT64 *Latencies[SpdIoSchedClassCount], Next, Delay;
+    ULONG Posted = 0, Completed = 0, Class, N;
+
+    memset(Result, 0, sizeof *Result);
+    memset(Slots, 0, sizeof Slots);
+    Reqs = calloc(Count, sizeof Reqs[0]);
+    ASSERT(0 != Reqs);
+    for (ULONG I = 0; SpdIoSchedClassCount > I; I++)
+    {
+        Latencies[I] = malloc(Count * sizeof Latencies[I][0]);
+        ASSERT(0 != Latencies[I]);
+    }
+
+    iosched_now = 0 != Count ? Trace[0].Time : 0;
+    iosched_create(&Q, 1, Policy, MaxIops, MaxBandwidth);
+
+    while (Count > Completed)
+    {
+        /* complete what the device is done with */
+        for (ULONG I = 0; TEST_DEVICE_DEPTH > I; I++)
+            if (0 != Slots[I] && Finish[I] <= iosched_now)
+            {
+                Class = Slots[I]->Entry.Class;
+                Latencies[Class][Result->Count[Class]++] = iosched_now - Slots[I]->Arrival;
+                Slots[I] = 0;
+                Completed++;
+            }
+
+        /* post what has arrived */
+        for (; Count > Posted && Trace[Posted].Time <= iosched_now; Posted++)
+        {
+            Reqs[Posted].Id = Posted;
+            iosched_post(&Q.Mq, &Reqs[Posted], Trace[Posted].Kind, Trace[Posted].Length);
+        }
+
+        /* dispatch to idle slots */
+        for (ULONG I = 0; TEST_DEVICE_DEPTH > I; I++)
+            if (0 == Slots[I])
+            {
+                Req = iosched_take(&Q.Mq);
+                if (0 == Req)
+                    break;
+                Slots[I] = Req;
+                Finish[I] = iosched_now + iosched_service_time(Req->Entry.Length);
+            }
+
+        /* advance to the next arrival, completion or end of throttling */
+        Next = ~0ULL;
+        if (Count > Posted)
+            Next = Trace[Posted].Time;
+        N = 0;
+        for (ULONG I = 0; TEST_DEVICE_DEPTH > I; I++)
+            if (0 != Slots[I])
+            {
+                if (Next > Finish[I])
+                    Next = Finish[I];
+                N++;
+            }
+        if (TEST_DEVICE_DEPTH > N && 0 != Q.Mq.PendingCount)
+        {
+            Delay = SpdMqThrottleDelay(&Q.Mq);
+            ASSERT(0 != Delay);
+            if (Next > iosched_now + Delay)
+                Next = iosched_now + Delay;
+        }
+        ASSERT(~0ULL != Next || Count == Completed);
+        if (~0ULL != Next && Next > iosched_now)
+            iosched_now = Next;
+    }
+
+    ASSERT(0 == Q.Mq.PendingCount);
+    Result->Makespan = 0 != Count ? iosched_now - Trace[0].Time : 0;
+    for (ULONG I = 0; SpdIoSchedClassCount > I; I++)
+    {
+        N = Result->Count[I];
+        if (0 != N)
+        {
+            qsort(Latencies[I], N, sizeof Latencies[I][0], iosched_compare);
+            Result->P50[I] = Latencies[I][N / 2];
+            Result->P99[I] = Latencies[I][(N - 1) * 99 / 100];
+            Result->Max[I] = Latencies[I][N - 1];
+        }
+        free(Latencies[I]);
+    }
+
+    iosched_delete(&Q);
+    free(Reqs);
+}
+
+static const char *iosched_policy_name(UINT8 Policy)
+{
+    switch (Policy)
+    {
+    case SpdIoctlSchedFifoPolicy:
+        return "fifo";
+    case SpdIoctlSchedPriorityPolicy:
+        return "prio";
+    case SpdIoctlSchedDeadlinePolicy:
+        return "dead";
+    default:
+        return "?";
+    }
+}
+
+static void iosched_report(UINT8 Policy, IOSCHED_TEST_RESULT *Result)
+{
+    tlib_printf("%s r99=%uus w99=%uus wmax=%uus ",
+        iosched_policy_name(Policy),
+        (unsigned)(Result->P99[SpdIoSchedUrgentClass] / TEST_US),
+        (unsigned)(Result->P99[SpdIoSchedBulkClass] / TEST_US),
+        (unsigned)(Result->Max[SpdIoSchedBulkClass] / TEST_US));
+}
+
+/*
+ * A latency sensitive mix: a steady stream of 4k reads with a flush now and then, and
+ * every 100ms a burst of 1MB writes that keeps the device busy for about 30ms.
+ */
+static ULONG iosched_burst_mix(IOSCHED_TEST_RECORD **PTrace)
+{
+    IOSCHED_TEST_RECORD *Trace;
+    ULONG Count = 0, Capacity = 16384;
+
+    Trace = malloc(Capacity * sizeof Trace[0]);
+    ASSERT(0 != Trace);
+
+    for (UINT64 Time = 0; SPD_IOSCHED_SECOND > Time; Time += 200 * TEST_US)
+    {
+        if (0 == Time % (100 * TEST_MS))
+            for (ULONG I = 0; 64 > I; I++)
+            {
+                Trace[Count].Time = Time;
+                Trace[Count].Kind = SpdIoctlTransactWriteKind;
+                Trace[Count].Length = 1024 * 1024;
+                Count++;
+            }
+        Trace[Count].Time = Time;
+        Trace[Count].Kind = 0 == Count % 50 ?
+            SpdIoctlTransactFlushKind : SpdIoctlTransactReadKind;
+        Trace[Count].Length = SpdIoctlTransactFlushKind == Trace[Count].Kind ? 0 : 4096;
+        Count++;
+        ASSERT(Capacity >= Count + 64);
+    }
+
+    *PTrace = Trace;
+    return Count;
+}
+
+static ULONG iosched_load_trace(const char *FileName, IOSCHED_TEST_RECORD **PTrace)
+{
+    IOSCHED_TEST_RECORD *Trace = 0;
+    ULONG Count = 0, Capacity = 0;
+    unsigned long long Time;
+    unsigned long Length;
+    char Line[256], Op;
+    FILE *File;
+
+    File = fopen(FileName, "r");
+    ASSERT(0 != File);
+
+    while (0 != fgets(Line, sizeof Line, File))
+    {
+        if (3 != sscanf(Line, "%llu %c %lu", &Time, &Op, &Length))
+            continue;
+        if (Capacity == Count)
+        {
+            Capacity = 0 != Capacity ? Capacity * 2 : 1024;
+            Trace = realloc(Trace, Capacity * sizeof Trace[0]);
+            ASSERT(0 != Trace);
+        }
+        Trace[Count].Time = Time * TEST_US;
+        Trace[Count].Kind =
+            'W' == Op ? SpdIoctlTransactWriteKind :
+            'F' == Op ? SpdIoctlTransactFlushKind :
+            'U' == Op ? SpdIoctlTransactUnmapKind :
+            SpdIoctlTransactReadKind;
+        Trace[Count].Length = (ULONG)Length;
+        /* replay in time order */
+        if (0 < Count && Trace[Count - 1].Time > Trace[Count].Time)
+            Trace[Count].Time = Trace[Count - 1].Time;
+        Count++;
+    }
+
+    fclose(File);
+
+    *PTrace = Trace;
+    return Count;
+}
+
+static void iosched_replay_test(void)
+{
+    IOSCHED_TEST_RECORD *Trace;
+    IOSCHED_TEST_RESULT Results[SpdIoctlSchedPolicyCount];
+    ULONG Count;
+
+    Count = iosched_burst_mix(&Trace);
+    for (UINT8 Policy = 0; SpdIoctlSchedPolicyCount > Policy; Policy++)
+    {
+        iosched_replay(Trace, Count, Policy, 0, 0, &Results[Policy]);
+        iosched_report(Policy, &Results[Policy]);
+        ASSERT(Count == Results[Policy].Count[0] + Results[Policy].Count[1]);
+    }
+    free(Trace);
+
+    /* reads no longer wait behind the write bursts */
+    ASSERT(Results[SpdIoctlSchedPriorityPolicy].P99[SpdIoSchedUrgentClass] * 4 <
+        Results[SpdIoctlSchedFifoPolicy].P99[SpdIoSchedUrgentClass]);
+    ASSERT(Results[SpdIoctlSchedDeadlinePolicy].P99[SpdIoSchedUrgentClass] * 4 <
+        Results[SpdIoctlSchedFifoPolicy].P99[SpdIoSchedUrgentClass]);
+
+    /* and the writes still get done within a burst period */
+    for (UINT8 Policy = 0; SpdIoctlSchedPolicyCount > Policy; Policy++)
+        ASSERT(100 * TEST_MS > Results[Policy].Max[SpdIoSchedBulkClass]);
+}
+
+static void iosched_limit_test(void)
+{
+    IOSCHED_TEST_RECORD Trace[2000];
+    IOSCHED_TEST_RESULT Result;
+
+    /* 2000 reads arrive within 100ms; at 1000 requests/s they take about 2s */
+    for (ULONG I = 0; 2000 > I; I++)
+    {
+        Trace[I].Time = I * 50 * TEST_US;
+        Trace[I].Kind = SpdIoctlTransactReadKind;
+        Trace[I].Length = 4096;
+    }
+    iosched_replay(Trace, 2000, SpdIoctlSchedFifoPolicy, 1000, 0, &Result);
+    ASSERT(2000 == Result.Count[SpdIoSchedUrgentClass]);
+    ASSERT(19 * SPD_IOSCHED_SECOND / 10 - SPD_IOSCHED_BURST <= Result.Makespan);
+    ASSERT(21 * SPD_IOSCHED_SECOND / 10 >= Result.Makespan);
+    tlib_printf("iops=%ums ", (unsigned)(Result.Makespan / TEST_MS));
+
+    /* 200 64k writes at 6.4MB/s take about 2s */
+    for (ULONG I = 0; 200 > I; I++)
+    {
+        Trace[I].Time = 0;
+        Trace[I].Kind = SpdIoctlTransactWriteKind;
+        Trace[I].Length = 64 * 1024;
+    }
+    iosched_replay(Trace, 200, SpdIoctlSchedDeadlinePolicy, 0, 100 * 64 * 1024, &Result);
+    ASSERT(200 == Result.Count[SpdIoSchedBulkClass]);
+    ASSERT(19 * SPD_IOSCHED_SECOND / 10 - SPD_IOSCHED_BURST <= Result.Makespan);
+    ASSERT(21 * SPD_IOSCHED_SECOND / 10 >= Result.Makespan);
+    tlib_printf("bw=%ums ", (unsigned)(Result.Makespan / TEST_MS));
+}
+
+static void iosched_trace_test(void)
+{
+    IOSCHED_TEST_RECORD *Trace;
+    IOSCHED_TEST_RESULT Result;
+    const char *FileName;
+    ULONG Count;
+
+    FileName = getenv("WINSPD_IOSCHED_TRACE");
+    if (0 == FileName)
+        return;
+
+    Count = iosched_load_trace(FileName, &Trace);
+    for (UINT8 Policy = 0; SpdIoctlSchedPolicyCount > Policy; Policy++)
+    {
+        iosched_replay(Trace, Count, Policy, 0, 0, &Result);
+        iosched_report(Policy, &Result);
+        ASSERT(Count == Result.Count[0] + Result.Count[1]);
+    }
+    free(Trace);
+}
+
+void iosched_tests(void)
+{
+    TEST(iosched_bucket_test);
+    TEST(iosched_pick_test);
+    TEST(iosched_replay_test);
+    TEST(iosched_limit_test);
+    TEST(iosched_trace_test);
+}
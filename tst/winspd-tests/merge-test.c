@@ -0,0 +1,304 @@
+/**
+ * @file merge-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winspd/winspd.h>
+#include <shared/merge.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+#define TEST_BLOCK_LENGTH               16
+#define TEST_BLOCK_COUNT                1024
+#define TEST_REQUEST_MAX                64
+#define TEST_READ_KEY                   SpdIoctlTransactReadKind
+#define TEST_WRITE_KEY                  SpdIoctlTransactWriteKind
+
+static ULONG merge_random(PULONG PSeed)
+{
+    *PSeed = *PSeed * 1103515245 + 12345;
+    return *PSeed >> 8;
+}
+
+static void merge_entry(SPD_MERGE_ENTRY *Entry, UINT64 BlockAddress, UINT32 BlockCount, UINT8 Key)
+{
+    memset(Entry, 0, sizeof *Entry);
+    Entry->BlockAddress = BlockAddress;
+    Entry->BlockCount = BlockCount;
+    Entry->Key = Key;
+}
+
+static void merge_add_test(void)
+{
+    SPD_MERGE_ENTRY Entries[8];
+    SPD_MERGE Merge;
+
+    merge_entry(&Entries[0], 100, 4, TEST_WRITE_KEY);
+    merge_entry(&Entries[1], 104, 4, TEST_WRITE_KEY);
+    merge_entry(&Entries[2], 96, 4, TEST_WRITE_KEY);
+    merge_entry(&Entries[3], 109, 1, TEST_WRITE_KEY);   /* not adjacent */
+    merge_entry(&Entries[4], 108, 1, TEST_READ_KEY);    /* other kind */
+    merge_entry(&Entries[5], 108, 1, TEST_WRITE_KEY | SPD_MERGE_KEY_FUA);
+    merge_entry(&Entries[6], 108, 1, 0);                /* does not merge */
+    merge_entry(&Entries[7], 108, 8, TEST_WRITE_KEY);   /* too large */
+
+    SpdMergeInitialize(&Merge, &Entries[0], 16);
+    ASSERT(1 == Merge.Count);
+    ASSERT(100 == Merge.BlockAddress && 4 == Merge.BlockCount);
+    ASSERT(12 == SpdMergeRoom(&Merge));
+
+    /* grow at the end and then at the front */
+    ASSERT(SpdMergeAdd(&Merge, &Entries[1]));
+    ASSERT(SpdMergeAdd(&Merge, &Entries[2]));
+    ASSERT(3 == Merge.Count);
+    ASSERT(96 == Merge.BlockAddress && 12 == Merge.BlockCount);
+    ASSERT(&Entries[2] == Merge.First);
+    ASSERT(&Entries[0] == Entries[2].Next);
+    ASSERT(&Entries[1] == Entries[0].Next);
+    ASSERT(0 == Entries[1].Next);
+    ASSERT(0 == SpdMergeOffset(&Merge, &Entries[2], TEST_BLOCK_LENGTH));
+    ASSERT(4 * TEST_BLOCK_LENGTH == SpdMergeOffset(&Merge, &Entries[0], TEST_BLOCK_LENGTH));
+    ASSERT(8 * TEST_BLOCK_LENGTH == SpdMergeOffset(&Merge, &Entries[1], TEST_BLOCK_LENGTH));
+
+    for (ULONG I = 3; 8 > I; I++)
+        ASSERT(!SpdMergeAdd(&Merge, &Entries[I]));
+    ASSERT(3 == Merge.Count && 12 == Merge.BlockCount);
+
+    /* a removed member leaves a hole; the range and the other offsets stay */
+    SpdMergeRemove(&Merge, &Entries[0]);
+    ASSERT(2 == Merge.Count);
+    ASSERT(96 == Merge.BlockAddress && 12 == Merge.BlockCount);
+    ASSERT(&Entries[1] == Entries[2].Next);
+    ASSERT(8 * TEST_BLOCK_LENGTH == SpdMergeOffset(&Merge, &Entries[1], TEST_BLOCK_LENGTH));
+    SpdMergeRemove(&Merge, &Entries[0]);
+    ASSERT(2 == Merge.Count);
+
+    /* a request that does not merge cannot lead a merge with others either */
+    SpdMergeInitialize(&Merge, &Entries[6], 16);
+    merge_entry(&Entries[7], 109, 1, 0);
+    ASSERT(!SpdMergeAdd(&Merge, &Entries[7]));
+}
+
+typedef struct
+{
+    SPD_MERGE_ENTRY Entry;
+    BOOLEAN Pending;
+    BOOLEAN Cancelled;
+    ULONG Fill;                         /* pattern that Buffer starts with */
+    PUINT8 Buffer;                      /* SRB data */
+} MERGE_TEST_REQUEST;
+
+static UINT8 merge_pattern(ULONG Round, ULONG Offset)
+{
+    return (UINT8)(Round * 31 + Offset * 7 + (Offset >> 8) + 1);
+}
+
+/*
+ * Model a storage unit that serves runs of pending requests the way the driver does:
+ * the first pending request leads a merge, takes the pending requests that become
+ * adjacent until none does, and the merged request is served through a single transact
+ * data buffer. Write data are gathered into it and read data are scattered from it; a
+ * member may be cancelled once the merged request is handed out. The storage must end
+ * up as if every request had been served on its own and a cancelled read must not be
+ * touched.
+ */
+static void merge_model_dotest(ULONG Seed, UINT32 MaxBlockCount)
+{
+    MERGE_TEST_REQUEST Requests[TEST_REQUEST_MAX];
+    PUINT8 Storage, Model, DataBuffer;
+    ULONG RequestCount, Served;
+    UINT64 BlockAddress;
+    BOOLEAN Added;
+
+    Storage = malloc(TEST_BLOCK_COUNT * TEST_BLOCK_LENGTH);
+    Model = malloc(TEST_BLOCK_COUNT * TEST_BLOCK_LENGTH);
+    DataBuffer = malloc(MaxBlockCount * TEST_BLOCK_LENGTH);
+    ASSERT(0 != Storage && 0 != Model && 0 != DataBuffer);
+
+    for (ULONG Round = 0; 64 > Round; Round++)
+    {
+        for (ULONG I = 0; TEST_BLOCK_COUNT * TEST_BLOCK_LENGTH > I; I++)
+            Storage[I] = Model[I] = merge_pattern(Round, I);
+
+        /* runs of adjacent requests over a random part of the storage; some are gaps */
+        BlockAddress = merge_random(&Seed) % 64;
+        for (RequestCount = 0; TEST_REQUEST_MAX > RequestCount; )
+        {
+            UINT32 BlockCount = 1 + merge_random(&Seed) % (8 < MaxBlockCount ? 8 : MaxBlockCount);
+            if (BlockAddress + BlockCount > TEST_BLOCK_COUNT)
+                break;
+            if (0 != merge_random(&Seed) % 8)
+            {
+                MERGE_TEST_REQUEST *Request = &Requests[RequestCount++];
+                UINT8 Key = 0 != merge_random(&Seed) % 2 ? TEST_WRITE_KEY : TEST_READ_KEY;
+                if (0 == merge_random(&Seed) % 8)
+                    Key |= SPD_MERGE_KEY_FUA;
+                if (0 == merge_random(&Seed) % 16)
+                    Key = 0;
+                merge_entry(&Request->Entry, BlockAddress, BlockCount, Key);
+                Request->Pending = TRUE;
+                Request->Cancelled = FALSE;
+                Request->Fill = Round + RequestCount;
+                Request->Buffer = malloc(BlockCount * TEST_BLOCK_LENGTH);
+                ASSERT(0 != Request->Buffer);
+                for (ULONG I = 0; BlockCount * TEST_BLOCK_LENGTH > I; I++)
+                    Request->Buffer[I] = (UINT8)~merge_pattern(Request->Fill, I);
+            }
+            BlockAddress += BlockCount;
+        }
+
+        /* the pending order is random */
+        for (ULONG I = RequestCount; 1 < I; I--)
+        {
+            ULONG J = merge_random(&Seed) % I;
+            MERGE_TEST_REQUEST Temp = Requests[I - 1];
+            Requests[I - 1] = Requests[J];
+            Requests[J] = Temp;
+        }
+
+        /* the requests do not overlap, so the model serves each of them on its own */
+        for (ULONG I = 0; RequestCount > I; I++)
+            if (TEST_READ_KEY != (Requests[I].Entry.Key & ~SPD_MERGE_KEY_FUA))
+                memcpy(Model + Requests[I].Entry.BlockAddress * TEST_BLOCK_LENGTH,
+                    Requests[I].Buffer, Requests[I].Entry.BlockCount * TEST_BLOCK_LENGTH);
+
+        for (Served = 0; RequestCount > Served;)
+        {
+            MERGE_TEST_REQUEST *Leader = 0, *Cancel = 0;
+            SPD_MERGE Merge;
+            UINT64 NextAddress;
+            ULONG Count, Offset;
+
+            for (ULONG I = 0; RequestCount > I && 0 == Leader; I++)
+                if (Requests[I].Pending)
+                    Leader = &Requests[I];
+            Leader->Pending = FALSE;
+            Served++;
+
+            SpdMergeInitialize(&Merge, &Leader->Entry, MaxBlockCount);
+            do
+            {
+                Added = FALSE;
+                for (ULONG I = 0; RequestCount > I; I++)
+                    if (Requests[I].Pending && SpdMergeAdd(&Merge, &Requests[I].Entry))
+                    {
+                        Requests[I].Pending = FALSE;
+                        Served++;
+                        Added = TRUE;
+                    }
+            } while (Added);
+
+            /* members are in address order, adjacent and alike; the merge is maximal */
+            ASSERT(MaxBlockCount >= Merge.BlockCount);
+            NextAddress = Merge.BlockAddress;
+            Count = 0;
+            for (SPD_MERGE_ENTRY *Entry = Merge.First; 0 != Entry; Entry = Entry->Next, Count++)
+            {
+                ASSERT(NextAddress == Entry->BlockAddress);
+                ASSERT(Merge.Key == Entry->Key);
+                ASSERT(1 == Merge.Count || 0 != Entry->Key);
+                NextAddress += Entry->BlockCount;
+            }
+            ASSERT(Merge.Count == Count);
+            ASSERT(Merge.BlockAddress + Merge.BlockCount == NextAddress);
+            for (ULONG I = 0; RequestCount > I; I++)
+                if (Requests[I].Pending)
+                    ASSERT(!SpdMergeAdd(&Merge, &Requests[I].Entry));
+
+            /* prepare: gather the write data */
+            memset(DataBuffer, 0xcd, MaxBlockCount * TEST_BLOCK_LENGTH);
+            if (TEST_READ_KEY != (Merge.Key & ~SPD_MERGE_KEY_FUA))
+                for (SPD_MERGE_ENTRY *Entry = Merge.First; 0 != Entry; Entry = Entry->Next)
+                {
+                    MERGE_TEST_REQUEST *Request = CONTAINING_RECORD(Entry, MERGE_TEST_REQUEST, Entry);
+                    Offset = SpdMergeOffset(&Merge, Entry, TEST_BLOCK_LENGTH);
+                    ASSERT(Merge.BlockCount * TEST_BLOCK_LENGTH >= Offset + Entry->BlockCount * TEST_BLOCK_LENGTH);
+                    memcpy(DataBuffer + Offset, Request->Buffer, Entry->BlockCount * TEST_BLOCK_LENGTH);
+                }
+
+            /* the merged request is handed out; a member other than the leader may be cancelled */
+            if (1 < Merge.Count && 0 == merge_random(&Seed) % 4)
+            {
+                ULONG N = 1 + merge_random(&Seed) % (Merge.Count - 1);
+                SPD_MERGE_ENTRY *Entry = Merge.First;
+                if (&Leader->Entry == Entry)
+                    Entry = Entry->Next;
+                for (; 1 < N; N--)
+                    if (0 != Entry->Next && &Leader->Entry != Entry->Next)
+                        Entry = Entry->Next;
+                Cancel = CONTAINING_RECORD(Entry, MERGE_TEST_REQUEST, Entry);
+                Cancel->Cancelled = TRUE;
+                SpdMergeRemove(&Merge, Entry);
+                ASSERT(Count - 1 == Merge.Count);
+                ASSERT(Merge.BlockAddress + Merge.BlockCount == NextAddress);
+            }
+
+            /* the storage unit serves the whole range in one call */
+            if (TEST_READ_KEY == (Merge.Key & ~SPD_MERGE_KEY_FUA))
+                memcpy(DataBuffer, Storage + Merge.BlockAddress * TEST_BLOCK_LENGTH,
+                    Merge.BlockCount * TEST_BLOCK_LENGTH);
+            else
+                memcpy(Storage + Merge.BlockAddress * TEST_BLOCK_LENGTH, DataBuffer,
+                    Merge.BlockCount * TEST_BLOCK_LENGTH);
+
+            /* complete: scatter the read data to the members that are left */
+            if (TEST_READ_KEY == (Merge.Key & ~SPD_MERGE_KEY_FUA))
+                for (SPD_MERGE_ENTRY *Entry = Merge.First; 0 != Entry; Entry = Entry->Next)
+                {
+                    MERGE_TEST_REQUEST *Request = CONTAINING_RECORD(Entry, MERGE_TEST_REQUEST, Entry);
+                    memcpy(Request->Buffer, DataBuffer + SpdMergeOffset(&Merge, Entry, TEST_BLOCK_LENGTH),
+                        Entry->BlockCount * TEST_BLOCK_LENGTH);
+                }
+        }
+
+        /* writes are stored (a cancelled write was already gathered); reads see the storage */
+        ASSERT(0 == memcmp(Storage, Model, TEST_BLOCK_COUNT * TEST_BLOCK_LENGTH));
+        for (ULONG I = 0; RequestCount > I; I++)
+        {
+            MERGE_TEST_REQUEST *Request = &Requests[I];
+            if (TEST_READ_KEY == (Request->Entry.Key & ~SPD_MERGE_KEY_FUA))
+            {
+                PUINT8 Expected = Model + Request->Entry.BlockAddress * TEST_BLOCK_LENGTH;
+                for (ULONG J = 0; Request->Entry.BlockCount * TEST_BLOCK_LENGTH > J; J++)
+                    ASSERT((Request->Cancelled ?
+                        (UINT8)~merge_pattern(Request->Fill, J) : Expected[J]) == Request->Buffer[J]);
+            }
+            free(Request->Buffer);
+        }
+    }
+
+    free(DataBuffer);
+    free(Model);
+    free(Storage);
+}
+
+static void merge_model_test(void)
+{
+    merge_model_dotest(1, 1);
+    merge_model_dotest(2, 8);
+    merge_model_dotest(3, 16);
+    merge_model_dotest(4, 128);
+    merge_model_dotest(5, TEST_BLOCK_COUNT);
+}
+
+void merge_tests(void)
+{
+    TEST(merge_add_test);
+    TEST(merge_model_test);
+}
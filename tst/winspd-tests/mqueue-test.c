@@ -0,0 +1,394 @@
+/**
+ * @file mqueue-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#if defined(_WIN32)
+#include <winspd/winspd.h>
+#include <process.h>
+#else
+#include <shared/posix.h>
+#include <winspd/ioctl.h>
+#endif
+#include <shared/iosched.h>
+#include <shared/mqueue.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+#define TEST_BUCKET_COUNT               16
+
+/* a simulated SRB: just enough to tell requests apart and count their completions */
+typedef struct
+{
+    SPD_MQ_ENTRY Entry;
+    ULONG Id;
+    ULONG Owner;
+    volatile LONG Busy;
+    volatile LONG Completed;
+} MQ_TEST_SRB;
+
+typedef struct
+{
+    SPD_MQ Mq;
+    SPD_MQ_QUEUE *Queues;
+    SPD_MQ_ENTRY **Buckets;
+} MQ_TEST_QUEUE;
+
+static void mqueue_create(MQ_TEST_QUEUE *Q, ULONG QueueCount)
+{
+    Q->Queues = _aligned_malloc(QueueCount * sizeof Q->Queues[0], 64);
+    Q->Buckets = malloc(QueueCount * TEST_BUCKET_COUNT * sizeof Q->Buckets[0]);
+    ASSERT(0 != Q->Queues && 0 != Q->Buckets);
+    SpdMqInitialize(&Q->Mq, Q->Queues, QueueCount, Q->Buckets, TEST_BUCKET_COUNT);
+}
+
+static void mqueue_delete(MQ_TEST_QUEUE *Q)
+{
+    free(Q->Buckets);
+    _aligned_free(Q->Queues);
+}
+
+static void mqueue_post(SPD_MQ *Mq, MQ_TEST_SRB *Srb, BOOLEAN Head)
+{
+    SPD_MQ_QUEUE *Queue = SpdMqQueue(Mq, (UINT64)(UINT_PTR)&Srb->Entry);
+
+    SpdMqLockAcquire(&Queue->Lock);
+    SpdMqPostNoLock(Mq, Queue, &Srb->Entry, Head);
+    SpdMqLockRelease(&Queue->Lock);
+}
+
+static MQ_TEST_SRB *mqueue_start(SPD_MQ *Mq, ULONG Home)
+{
+    SPD_MQ_QUEUE *Queue;
+    SPD_MQ_ENTRY *Entry;
+
+    Entry = SpdMqTake(Mq, Home, &Queue);
+    if (0 == Entry)
+        return 0;
+    ASSERT(Queue == SpdMqQueue(Mq, (UINT64)(UINT_PTR)Entry));
+    SpdMqProcessInsertNoLock(Mq, Queue, Entry);
+    SpdMqLockRelease(&Queue->Lock);
+
+    return CONTAINING_RECORD(Entry, MQ_TEST_SRB, Entry);
+}
+
+static MQ_TEST_SRB *mqueue_end(SPD_MQ *Mq, UINT64 Hint)
+{
+    SPD_MQ_QUEUE *Queue = SpdMqQueue(Mq, Hint);
+    SPD_MQ_ENTRY *Entry;
+
+    SpdMqLockAcquire(&Queue->Lock);
+    Entry = SpdMqProcessRemoveNoLock(Mq, Queue, Hint);
+    SpdMqLockRelease(&Queue->Lock);
+
+    return 0 != Entry ? CONTAINING_RECORD(Entry, MQ_TEST_SRB, Entry) : 0;
+}
+
+static void mqueue_basic_test(void)
+{
+    MQ_TEST_QUEUE Q;
+    MQ_TEST_SRB Srbs[64], *Srb;
+    ULONG Taken = 0;
+
+    mqueue_create(&Q, 4);
+    memset(Srbs, 0, sizeof Srbs);
+
+    for (ULONG I = 0; 64 > I; I++)
+    {
+        Srbs[I].Id = I;
+        mqueue_post(&Q.Mq, &Srbs[I], FALSE);
+    }
+    ASSERT(64 == Q.Mq.PendingCount);
+
+    /* a single consumer gets everything, its home queue first */
+    while (0 != (Srb = mqueue_start(&Q.Mq, 1)))
+    {
+        ASSERT(0 == Srb->Busy);
+        Srb->Busy = 1;
+        Taken++;
+    }
+    ASSERT(64 == Taken);
+    ASSERT(0 == Q.Mq.PendingCount);
+    for (ULONG I = 0; 4 > I; I++)
+        ASSERT(0 == Q.Queues[I].PendingCount);
+
+    /* responses find their requests by hint; unknown hints find nothing */
+    ASSERT(0 == mqueue_end(&Q.Mq, 0));
+    ASSERT(0 == mqueue_end(&Q.Mq, (UINT64)(UINT_PTR)&Srbs[0] + 8));
+    for (ULONG I = 0; 64 > I; I++)
+    {
+        Srb = mqueue_end(&Q.Mq, (UINT64)(UINT_PTR)&Srbs[I].Entry);
+        ASSERT(&Srbs[I] == Srb);
+    }
+    for (ULONG I = 0; 64 > I; I++)
+        ASSERT(0 == mqueue_end(&Q.Mq, (UINT64)(UINT_PTR)&Srbs[I].Entry));
+    for (ULONG I = 0; 4 > I; I++)
+        ASSERT(SpdMqListIsEmpty(&Q.Queues[I].ProcessList));
+
+    mqueue_delete(&Q);
+}
+
+static void mqueue_steal_test(void)
+{
+    MQ_TEST_QUEUE Q;
+    MQ_TEST_SRB Srbs[256], *Srb;
+    SPD_MQ_QUEUE *Queue;
+    ULONG Count, First, Last;
+
+    mqueue_create(&Q, 4);
+    memset(Srbs, 0, sizeof Srbs);
+
+    /* post only the requests that land in queue 2 */
+    Count = 0;
+    First = Last = (ULONG)-1;
+    for (ULONG I = 0; 256 > I; I++)
+    {
+        Srbs[I].Id = I;
+        if (&Q.Queues[2] == SpdMqQueue(&Q.Mq, (UINT64)(UINT_PTR)&Srbs[I].Entry))
+        {
+            mqueue_post(&Q.Mq, &Srbs[I], FALSE);
+            if ((ULONG)-1 == First)
+                First = I;
+            Last = I;
+            Count++;
+        }
+    }
+    ASSERT(2 <= Count);
+    ASSERT(Count == (ULONG)Q.Queues[2].PendingCount);
+
+    /* a consumer whose home queue is empty steals, in order */
+    Srb = mqueue_start(&Q.Mq, 0);
+    ASSERT(&Srbs[First] == Srb);
+
+    /* a request posted at the head (the next chunk of an SRB) is taken next */
+    ASSERT(&Srbs[First] == mqueue_end(&Q.Mq, (UINT64)(UINT_PTR)&Srbs[First].Entry));
+    mqueue_post(&Q.Mq, &Srbs[First], TRUE);
+    ASSERT(&Srbs[First] == mqueue_start(&Q.Mq, 3));
+
+    Srb = 0;
+    for (ULONG I = 1; Count > I; I++)
+        Srb = mqueue_start(&Q.Mq, I % 4);
+    ASSERT(&Srbs[Last] == Srb);
+    ASSERT(0 == mqueue_start(&Q.Mq, 2));
+
+    /* take leaves the queue locked for the caller */
+    mqueue_post(&Q.Mq, &Srbs[First], FALSE);
+    ASSERT(0 != SpdMqTake(&Q.Mq, 0, &Queue));
+    ASSERT(&Q.Queues[2] == Queue);
+    SpdMqLockRelease(&Queue->Lock);
+
+    mqueue_delete(&Q);
+}
+
+static void mqueue_reset_test(void)
+{
+    MQ_TEST_QUEUE Q;
+    MQ_TEST_SRB Srbs[32];
+    SPD_MQ_QUEUE *Queue;
+    SPD_MQ_ENTRY List, *Entry;
+    ULONG Count;
+
+    mqueue_create(&Q, 2);
+    memset(Srbs, 0, sizeof Srbs);
+
+    for (ULONG I = 0; 32 > I; I++)
+        mqueue_post(&Q.Mq, &Srbs[I], FALSE);
+    for (ULONG I = 0; 16 > I; I++)
+        ASSERT(0 != mqueue_start(&Q.Mq, 0));
+
+    /* requests are removed whether pending or processing */
+    for (ULONG I = 0; 32 > I; I += 8)
+    {
+        Queue = SpdMqQueue(&Q.Mq, (UINT64)(UINT_PTR)&Srbs[I].Entry);
+        SpdMqLockAcquire(&Queue->Lock);
+        SpdMqRemoveNoLock(&Q.Mq, Queue, &Srbs[I].Entry);
+        SpdMqLockRelease(&Queue->Lock);
+        ASSERT(0 == mqueue_end(&Q.Mq, (UINT64)(UINT_PTR)&Srbs[I].Entry));
+    }
+
+    /* reset hands back everything else */
+    SpdMqListInitialize(&List);
+    for (ULONG I = 0; 2 > I; I++)
+    {
+        SpdMqLockAcquire(&Q.Queues[I].Lock);
+        SpdMqResetNoLock(&Q.Mq, &Q.Queues[I], &List);
+        SpdMqLockRelease(&Q.Queues[I].Lock);
+    }
+    Count = 0;
+    for (Entry = List.Flink; &List != Entry; Entry = Entry->Flink)
+    {
+        ASSERT(0 == Entry->HashNext);
+        Count++;
+    }
+    ASSERT(28 == Count);
+    ASSERT(0 == Q.Mq.PendingCount);
+    ASSERT(0 == mqueue_start(&Q.Mq, 0));
+    for (ULONG I = 0; 32 > I; I++)
+        ASSERT(0 == mqueue_end(&Q.Mq, (UINT64)(UINT_PTR)&Srbs[I].Entry));
+
+    mqueue_delete(&Q);
+}
+
+/*
+ * Stress and scaling harness.
+ *
+ * Every thread owns a few SRB's. It posts those that are idle, then takes a pending
+ * request (its own or anybody's) from its home queue or by stealing, and ends it right
+ * away. Each SRB must be ended once for every time it is posted. The harness is timed
+ * with one queue and with one queue per thread, so that it doubles as a benchmark of
+ * the queue locks on a many-core box.
+ */
+#define TEST_THREAD_MAX                 16
+#define TEST_SRBS_PER_THREAD            8
+
+typedef struct
+{
+    SPD_MQ *Mq;
+    MQ_TEST_SRB *Srbs;
+    ULONG Index, Operations;
+    LONG Posted;
+} MQ_TEST_THREAD;
+
+static unsigned __stdcall mqueue_stress_thread(void *Data0)
+{
+    MQ_TEST_THREAD *Data = Data0;
+    MQ_TEST_SRB *Srb;
+    ULONG Operations = 0;
+
+    while (Data->Operations > Operations)
+    {
+        for (ULONG I = 0; TEST_SRBS_PER_THREAD > I; I++)
+        {
+            Srb = &Data->Srbs[Data->Index * TEST_SRBS_PER_THREAD + I];
+            if (0 == InterlockedCompareExchange(&Srb->Busy, 1, 0))
+            {
+                mqueue_post(Data->Mq, Srb, FALSE);
+                Data->Posted++;
+            }
+        }
+
+        Srb = mqueue_start(Data->Mq, Data->Index);
+        if (0 == Srb)
+        {
+            YieldProcessor();
+            continue;
+        }
+
+        ASSERT(Srb == mqueue_end(Data->Mq, (UINT64)(UINT_PTR)&Srb->Entry));
+        InterlockedIncrement(&Srb->Completed);
+        ASSERT(1 == InterlockedExchange(&Srb->Busy, 0));
+        Operations++;
+    }
+
+    return 0;
+}
+
+static ULONG mqueue_stress_dotest(ULONG QueueCount, ULONG ThreadCount, ULONG Operations)
+{
+    MQ_TEST_QUEUE Q;
+    MQ_TEST_SRB *Srbs, *Srb;
+    MQ_TEST_THREAD Data[TEST_THREAD_MAX];
+    HANDLE Threads[TEST_THREAD_MAX];
+    LONG Posted, Completed;
+    DWORD Time;
+
+    ASSERT(TEST_THREAD_MAX >= ThreadCount);
+
+    mqueue_create(&Q, QueueCount);
+    Srbs = calloc(ThreadCount * TEST_SRBS_PER_THREAD, sizeof *Srbs);
+    ASSERT(0 != Srbs);
+    for (ULONG I = 0; ThreadCount * TEST_SRBS_PER_THREAD > I; I++)
+    {
+        Srbs[I].Id = I;
+        Srbs[I].Owner = I / TEST_SRBS_PER_THREAD;
+    }
+
+    Time = GetTickCount();
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        Data[I].Mq = &Q.Mq;
+        Data[I].Srbs = Srbs;
+        Data[I].Index = I;
+        Data[I].Operations = Operations;
+        Data[I].Posted = 0;
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, mqueue_stress_thread, &Data[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        CloseHandle(Threads[I]);
+    }
+    Time = GetTickCount() - Time;
+
+    /* end whatever is still pending */
+    while (0 != (Srb = mqueue_start(&Q.Mq, 0)))
+    {
+        ASSERT(Srb == mqueue_end(&Q.Mq, (UINT64)(UINT_PTR)&Srb->Entry));
+        InterlockedIncrement(&Srb->Completed);
+        Srb->Busy = 0;
+    }
+
+    Posted = Completed = 0;
+    for (ULONG I = 0; ThreadCount > I; I++)
+        Posted += Data[I].Posted;
+    for (ULONG I = 0; ThreadCount * TEST_SRBS_PER_THREAD > I; I++)
+    {
+        ASSERT(0 == Srbs[I].Busy);
+        Completed += Srbs[I].Completed;
+    }
+    ASSERT(Posted == Completed);
+    ASSERT(0 == Q.Mq.PendingCount);
+
+    free(Srbs);
+    mqueue_delete(&Q);
+
+    return Time;
+}
+
+static void mqueue_stress_test(void)
+{
+    ULONG Time1, TimeN;
+
+    mqueue_stress_dotest(1, 1, 10000);
+    mqueue_stress_dotest(3, 2, 10000);
+
+    Time1 = mqueue_stress_dotest(1, 8, 50000);
+    TimeN = mqueue_stress_dotest(8, 8, 50000);
+    tlib_printf("1q=%ums 8q=%ums ", (unsigned)Time1, (unsigned)TimeN);
+}
+
+void mqueue_tests(void)
+{
+    TEST(mqueue_basic_test);
+    TEST(mqueue_steal_test);
+    TEST(mqueue_reset_test);
+    TEST(mqueue_stress_test);
+}
+
+#if !defined(_WIN32)
+int main(int argc, char *argv[])
+{
+    TESTSUITE(mqueue_tests);
+
+    tlib_run_tests(argc, argv);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,488 @@
+/**
+ * @file ramstore-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+/*
+ * These tests use only the RAM store and tlib, so that they also run on POSIX systems
+ * (see the Makefile).
+ */
+
+#include <ramstore.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <time.h>
+#endif
+
+#define CHUNK                           RAMSTORE_CHUNK_LENGTH
+#define TEST_THREAD_COUNT               8
+
+#if defined(_WIN32)
+typedef HANDLE ramstore_thread_t;
+static ramstore_thread_t ramstore_thread_create(unsigned (__stdcall *Function)(void *), void *Data)
+{
+    HANDLE Thread = (HANDLE)_beginthreadex(0, 0, Function, Data, 0, 0);
+    ASSERT(0 != Thread);
+    return Thread;
+}
+static void ramstore_thread_join(ramstore_thread_t Thread)
+{
+    WaitForSingleObject(Thread, INFINITE);
+    CloseHandle(Thread);
+}
+static ULONG ramstore_time(void)
+{
+    return GetTickCount();
+}
+#define RAMSTORE_THREAD_FUNCTION(Name)  static unsigned __stdcall Name(void *Data0)
+#else
+typedef pthread_t ramstore_thread_t;
+static ramstore_thread_t ramstore_thread_create(void *(*Function)(void *), void *Data)
+{
+    pthread_t Thread;
+    ASSERT(0 == pthread_create(&Thread, 0, Function, Data));
+    return Thread;
+}
+static void ramstore_thread_join(ramstore_thread_t Thread)
+{
+    pthread_join(Thread, 0);
+}
+static ULONG ramstore_time(void)
+{
+    struct timespec Time;
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (ULONG)(Time.tv_sec * 1000 + Time.tv_nsec / 1000000);
+}
+#define RAMSTORE_THREAD_FUNCTION(Name)  static void *Name(void *Data0)
+#endif
+
+static ULONG ramstore_random(ULONG *PSeed)
+{
+    *PSeed = *PSeed * 1103515245 + 12345;
+    return *PSeed >> 8;
+}
+
+static BOOLEAN ramstore_iszero(RAMSTORE *Store, UINT64 Offset, UINT64 Length)
+{
+    static UINT8 Buffer[64 * 1024];
+    UINT64 Part;
+
+    for (; 0 < Length; Offset += Part, Length -= Part)
+    {
+        Part = sizeof Buffer < Length ? sizeof Buffer : Length;
+        memset(Buffer, 0xcc, (size_t)Part);
+        ASSERT(RamStoreRead(Store, Buffer, Offset, Part));
+        if (!RamStoreIsZero(Buffer, Part))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* the chunks that are not the zero page; must agree with the store's own count */
+static LONG64 ramstore_chunkcount(RAMSTORE *Store)
+{
+    LONG64 ChunkCount = 0;
+
+    for (UINT64 I = 0; Store->TableCount > I; I++)
+        if (Store->ZeroTable != Store->Directory[I])
+            for (ULONG J = 0; RAMSTORE_TABLE_LENGTH > J; J++)
+                ChunkCount += Store->ZeroPage != Store->Directory[I]->Chunks[J];
+
+    ASSERT(Store->ChunkCount == ChunkCount);
+    return ChunkCount;
+}
+
+static void ramstore_basic_test(void)
+{
+    /* 2 full chunks and a short one */
+    UINT64 Length = 2 * CHUNK + 3 * 4096;
+    static UINT8 Buffer[3 * 4096], Zero[3 * 4096];
+    RAMSTORE *Store;
+
+    ASSERT(!RamStoreCreate(0, FALSE, &Store));
+    ASSERT(RamStoreCreate(Length, FALSE, &Store));
+    ASSERT(1 == Store->TableCount);
+    ASSERT(ramstore_iszero(Store, 0, Length));
+    ASSERT(0 == ramstore_chunkcount(Store));
+
+    /* out of range */
+    ASSERT(!RamStoreRead(Store, Buffer, Length - 4096, 4097));
+    ASSERT(!RamStoreWrite(Store, Buffer, Length + 1, 0));
+    ASSERT(!RamStoreUnmap(Store, (UINT64)-1, 2));
+    ASSERT(RamStoreRead(Store, Buffer, Length, 0));
+
+    /* zeroes need no chunks */
+    ASSERT(RamStoreWrite(Store, Zero, CHUNK - 4096, sizeof Zero));
+    ASSERT(0 == ramstore_chunkcount(Store));
+
+    /* a write across a chunk boundary allocates both chunks */
+    memset(Buffer, 0x5a, sizeof Buffer);
+    ASSERT(RamStoreWrite(Store, Buffer, CHUNK - 4096, sizeof Buffer));
+    ASSERT(2 == ramstore_chunkcount(Store));
+    memset(Buffer, 0, sizeof Buffer);
+    ASSERT(RamStoreRead(Store, Buffer, CHUNK - 4096, sizeof Buffer));
+    for (ULONG I = 0; sizeof Buffer > I; I++)
+        ASSERT(0x5a == Buffer[I]);
+    ASSERT(ramstore_iszero(Store, 0, CHUNK - 4096));
+    ASSERT(ramstore_iszero(Store, CHUNK + 2 * 4096, Length - (CHUNK + 2 * 4096)));
+
+    /* zeroes over data are data */
+    ASSERT(RamStoreWrite(Store, Zero, CHUNK, 4096));
+    ASSERT(2 == ramstore_chunkcount(Store));
+    ASSERT(ramstore_iszero(Store, CHUNK, 4096));
+
+    /* an unmap zeroes what it covers in part and frees what it covers in full */
+    ASSERT(RamStoreUnmap(Store, CHUNK - 4096, 2048));
+    ASSERT(2 == ramstore_chunkcount(Store));
+    ASSERT(ramstore_iszero(Store, 0, CHUNK - 2048));
+    ASSERT(!ramstore_iszero(Store, CHUNK - 2048, 2048));
+    ASSERT(RamStoreUnmap(Store, CHUNK, CHUNK));
+    ASSERT(1 == ramstore_chunkcount(Store));
+    ASSERT(!ramstore_iszero(Store, CHUNK - 2048, 2048));
+    ASSERT(ramstore_iszero(Store, CHUNK, Length - CHUNK));
+    ASSERT(RamStoreUnmap(Store, 0, CHUNK - 1));
+    ASSERT(1 == ramstore_chunkcount(Store));
+    ASSERT(RamStoreUnmap(Store, 0, CHUNK));
+    ASSERT(0 == ramstore_chunkcount(Store));
+    ASSERT(ramstore_iszero(Store, 0, Length));
+
+    /* the last chunk is short; a range that reaches the end of the store covers it */
+    ASSERT(RamStoreWrite(Store, Buffer + 1, Length - 1, 1));
+    ASSERT(1 == ramstore_chunkcount(Store));
+    ASSERT(RamStoreUnmap(Store, 2 * CHUNK, 4096));
+    ASSERT(1 == ramstore_chunkcount(Store));
+    ASSERT(RamStoreUnmap(Store, 2 * CHUNK, Length - 2 * CHUNK));
+    ASSERT(0 == ramstore_chunkcount(Store));
+
+    RamStoreDelete(Store);
+
+    /* a large store costs nothing until it is written; unmaps skip its empty tables */
+    ASSERT(RamStoreCreate(1ULL << 40, FALSE, &Store));
+    ASSERT(1024 == Store->TableCount);
+    ASSERT(RamStoreWrite(Store, Buffer, (1ULL << 40) - sizeof Buffer, sizeof Buffer));
+    ASSERT(RamStoreUnmap(Store, 0, 1ULL << 40));
+    ASSERT(0 == ramstore_chunkcount(Store));
+    RamStoreDelete(Store);
+}
+
+/*
+ * Random reads, writes, zero writes and unmaps against a model; the ranges are mostly
+ * small and often cross chunks.
+ */
+static void ramstore_model_dotest(UINT64 Length, ULONG Seed)
+{
+    enum { Rounds = 10000 };
+    RAMSTORE *Store;
+    UINT8 *Model, *Buffer;
+    UINT64 Offset, RangeMax, RangeLength;
+    ULONG Pattern;
+
+    Model = calloc((size_t)Length, 1);
+    Buffer = malloc((size_t)Length);
+    ASSERT(0 != Model && 0 != Buffer);
+    ASSERT(RamStoreCreate(Length, FALSE, &Store));
+
+    for (ULONG Round = 0; Rounds > Round; Round++)
+    {
+        Offset = ramstore_random(&Seed) % Length;
+        if (0 == ramstore_random(&Seed) % 4)
+            Offset &= ~(UINT64)(CHUNK - 1);
+        RangeMax = Length - Offset;
+        if (0 != ramstore_random(&Seed) % 8 && 64 * 1024 < RangeMax)
+            RangeMax = 64 * 1024;
+        RangeLength = 1 + ramstore_random(&Seed) % RangeMax;
+
+        switch (ramstore_random(&Seed) % 8)
+        {
+        case 0:
+        case 1:
+        case 2:
+            Pattern = ramstore_random(&Seed);
+            for (UINT64 I = 0; RangeLength > I; I++)
+                Buffer[I] = (UINT8)(Pattern + I);
+            ASSERT(RamStoreWrite(Store, Buffer, Offset, RangeLength));
+            memcpy(Model + Offset, Buffer, (size_t)RangeLength);
+            break;
+        case 3:
+            memset(Buffer, 0, (size_t)RangeLength);
+            ASSERT(RamStoreWrite(Store, Buffer, Offset, RangeLength));
+            memset(Model + Offset, 0, (size_t)RangeLength);
+            break;
+        case 4:
+            if (0 != ramstore_random(&Seed) % 2)
+                RangeLength = Length - Offset;
+            ASSERT(RamStoreUnmap(Store, Offset, RangeLength));
+            memset(Model + Offset, 0, (size_t)RangeLength);
+            break;
+        default:
+            ASSERT(RamStoreRead(Store, Buffer, Offset, RangeLength));
+            ASSERT(0 == memcmp(Model + Offset, Buffer, (size_t)RangeLength));
+            break;
+        }
+    }
+
+    ASSERT(RamStoreRead(Store, Buffer, 0, Length));
+    ASSERT(0 == memcmp(Model, Buffer, (size_t)Length));
+    ramstore_chunkcount(Store);
+
+    RamStoreDelete(Store);
+    free(Buffer);
+    free(Model);
+}
+
+static void ramstore_model_test(void)
+{
+    ramstore_model_dotest(3 * CHUNK, 1);
+    ramstore_model_dotest(5 * CHUNK + 12345, 2);
+}
+
+/*
+ * Threads write, read back and unmap blocks of their own, which share chunks with the
+ * blocks of the other threads, while another thread keeps unmapping whole chunks under
+ * them. A block must read as its last write or, if a chunk unmap got in the way, as
+ * zeroes; a chunk that is freed while a thread is still in it faults.
+ */
+#define STRESS_BLOCK_LENGTH             4096
+#define STRESS_LENGTH                   (4 * CHUNK)
+#define STRESS_BLOCK_COUNT              (STRESS_LENGTH / STRESS_BLOCK_LENGTH)
+
+typedef struct
+{
+    RAMSTORE *Store;
+    volatile LONG Stop;
+    volatile LONG Errors;
+    volatile LONG64 UnmapCount;
+} RAMSTORE_STRESS;
+
+typedef struct
+{
+    RAMSTORE_STRESS *Stress;
+    ULONG Index;
+    ULONG Iterations;
+} RAMSTORE_STRESS_THREAD;
+
+RAMSTORE_THREAD_FUNCTION(ramstore_stress_thread)
+{
+    RAMSTORE_STRESS_THREAD *Data = Data0;
+    RAMSTORE *Store = Data->Stress->Store;
+    static ULONG Expected[TEST_THREAD_COUNT][STRESS_BLOCK_COUNT / TEST_THREAD_COUNT];
+    ULONG Buffer[STRESS_BLOCK_LENGTH / sizeof(ULONG)];
+    ULONG Seed = Data->Index + 1, Block, Stamp;
+    UINT64 Offset;
+
+    for (ULONG I = 0; Data->Iterations > I; I++)
+    {
+        Block = ramstore_random(&Seed) % (STRESS_BLOCK_COUNT / TEST_THREAD_COUNT);
+        Offset = ((UINT64)Block * TEST_THREAD_COUNT + Data->Index) * STRESS_BLOCK_LENGTH;
+
+        switch (ramstore_random(&Seed) % 4)
+        {
+        case 0:
+            RamStoreUnmap(Store, Offset, STRESS_BLOCK_LENGTH);
+            Expected[Data->Index][Block] = 0;
+            break;
+        default:
+            Stamp = (Data->Index + 1) << 24 | (I & 0xffffff);
+            for (ULONG J = 0; sizeof Buffer / sizeof Buffer[0] > J; J++)
+                Buffer[J] = Stamp;
+            if (!RamStoreWrite(Store, Buffer, Offset, sizeof Buffer))
+                InterlockedIncrement(&Data->Stress->Errors);
+            Expected[Data->Index][Block] = Stamp;
+            break;
+        }
+
+        memset(Buffer, 0xcc, sizeof Buffer);
+        RamStoreRead(Store, Buffer, Offset, sizeof Buffer);
+        for (ULONG J = 0; sizeof Buffer / sizeof Buffer[0] > J; J++)
+            if (0 != Buffer[J] && Expected[Data->Index][Block] != Buffer[J])
+            {
+                InterlockedIncrement(&Data->Stress->Errors);
+                break;
+            }
+        if (0 != Buffer[0])
+            for (ULONG J = 1; sizeof Buffer / sizeof Buffer[0] > J; J++)
+                if (Buffer[0] != Buffer[J])
+                {
+                    InterlockedIncrement(&Data->Stress->Errors);
+                    break;
+                }
+    }
+
+    return 0;
+}
+
+RAMSTORE_THREAD_FUNCTION(ramstore_stress_unmap_thread)
+{
+    RAMSTORE_STRESS *Stress = Data0;
+    ULONG Seed = 42;
+
+    while (!Stress->Stop)
+    {
+        RamStoreUnmap(Stress->Store,
+            ramstore_random(&Seed) % (STRESS_LENGTH / CHUNK) * CHUNK, CHUNK);
+        InterlockedAdd64(&Stress->UnmapCount, 1);
+    }
+
+    return 0;
+}
+
+static void ramstore_stress_test(void)
+{
+    RAMSTORE_STRESS Stress;
+    RAMSTORE_STRESS_THREAD Data[TEST_THREAD_COUNT];
+    ramstore_thread_t Threads[TEST_THREAD_COUNT], UnmapThread;
+
+    memset(&Stress, 0, sizeof Stress);
+    ASSERT(RamStoreCreate(STRESS_LENGTH, FALSE, &Stress.Store));
+
+    UnmapThread = ramstore_thread_create(ramstore_stress_unmap_thread, &Stress);
+    for (ULONG I = 0; TEST_THREAD_COUNT > I; I++)
+    {
+        Data[I].Stress = &Stress;
+        Data[I].Index = I;
+        Data[I].Iterations = 50000;
+        Threads[I] = ramstore_thread_create(ramstore_stress_thread, &Data[I]);
+    }
+    for (ULONG I = 0; TEST_THREAD_COUNT > I; I++)
+        ramstore_thread_join(Threads[I]);
+    Stress.Stop = 1;
+    ramstore_thread_join(UnmapThread);
+
+    ASSERT(0 == Stress.Errors);
+    ASSERT(0 < Stress.UnmapCount);
+    ramstore_chunkcount(Stress.Store);
+    ASSERT(RamStoreUnmap(Stress.Store, 0, STRESS_LENGTH));
+    ASSERT(0 == ramstore_chunkcount(Stress.Store));
+
+    RamStoreDelete(Stress.Store);
+}
+
+/*
+ * Benchmark: 4KB random and 1MB sequential writes and reads over a 256MB store from 1
+ * and from TEST_THREAD_COUNT threads; the first write pass also allocates the chunks.
+ */
+#define BENCH_LENGTH                    (256ULL << 20)
+
+typedef struct
+{
+    RAMSTORE *Store;
+    BOOLEAN WriteFlag;
+    ULONG TransferLength;
+    ULONG OpCount;
+    ULONG Next;                         /* sequential transfers start here */
+    ULONG Seed;                         /* 4KB transfers are random */
+} RAMSTORE_BENCH;
+
+RAMSTORE_THREAD_FUNCTION(ramstore_bench_thread)
+{
+    RAMSTORE_BENCH *Bench = Data0;
+    ULONG RunCount = (ULONG)(BENCH_LENGTH / Bench->TransferLength);
+    UINT64 Offset;
+    PVOID Buffer;
+
+    Buffer = malloc(Bench->TransferLength);
+    ASSERT(0 != Buffer);
+    memset(Buffer, 0x5a, Bench->TransferLength);
+
+    for (ULONG I = 0; Bench->OpCount > I; I++)
+    {
+        Offset = (UINT64)((4096 == Bench->TransferLength ?
+            ramstore_random(&Bench->Seed) : Bench->Next + I) % RunCount) * Bench->TransferLength;
+        if (Bench->WriteFlag)
+            RamStoreWrite(Bench->Store, Buffer, Offset, Bench->TransferLength);
+        else
+            RamStoreRead(Bench->Store, Buffer, Offset, Bench->TransferLength);
+    }
+
+    free(Buffer);
+
+    return 0;
+}
+
+static void ramstore_bench_dotest(RAMSTORE *Store, ULONG ThreadCount,
+    BOOLEAN WriteFlag, ULONG TransferLength, ULONG OpCount)
+{
+    RAMSTORE_BENCH Bench[TEST_THREAD_COUNT];
+    ramstore_thread_t Threads[TEST_THREAD_COUNT];
+    ULONG Start, Time;
+
+    Start = ramstore_time();
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        Bench[I].Store = Store;
+        Bench[I].WriteFlag = WriteFlag;
+        Bench[I].TransferLength = TransferLength;
+        Bench[I].OpCount = OpCount / ThreadCount;
+        Bench[I].Next = (ULONG)(BENCH_LENGTH / TransferLength / ThreadCount * I);
+        Bench[I].Seed = I + 1;
+        Threads[I] = ramstore_thread_create(ramstore_bench_thread, &Bench[I]);
+    }
+    for (ULONG I = 0; ThreadCount > I; I++)
+        ramstore_thread_join(Threads[I]);
+    Time = ramstore_time() - Start;
+    if (0 == Time)
+        Time = 1;
+
+    tlib_printf("%s%s/%u=%uMB/s ",
+        WriteFlag ? "w" : "r", 4096 == TransferLength ? "4K" : "1M", (unsigned)ThreadCount,
+        (unsigned)((UINT64)OpCount * TransferLength / 1024 * 1000 / 1024 / Time));
+}
+
+static void ramstore_bench_test(void)
+{
+    RAMSTORE *Store;
+
+    ASSERT(RamStoreCreate(BENCH_LENGTH, FALSE, &Store));
+
+    for (ULONG ThreadCount = 1; TEST_THREAD_COUNT >= ThreadCount; ThreadCount *= TEST_THREAD_COUNT)
+    {
+        ramstore_bench_dotest(Store, ThreadCount, TRUE, 1024 * 1024, 1024);
+        ramstore_bench_dotest(Store, ThreadCount, TRUE, 4096, 256 * 1024);
+        ramstore_bench_dotest(Store, ThreadCount, FALSE, 1024 * 1024, 1024);
+        ramstore_bench_dotest(Store, ThreadCount, FALSE, 4096, 256 * 1024);
+        ASSERT(RamStoreUnmap(Store, 0, BENCH_LENGTH));
+        ASSERT(0 == ramstore_chunkcount(Store));
+    }
+
+    RamStoreDelete(Store);
+}
+
+void ramstore_tests(void)
+{
+    TEST(ramstore_basic_test);
+    TEST(ramstore_model_test);
+    TEST(ramstore_stress_test);
+    TEST_OPT(ramstore_bench_test);
+}
+
+#if !defined(_WIN32)
+int main(int argc, char *argv[])
+{
+    TESTSUITE(ramstore_tests);
+
+    tlib_run_tests(argc, argv);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,261 @@
+/**
+ * @file reqpool-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winspd/winspd.h>
+#include <shared/reqpool.h>
+#include <tlib/testsuite.h>
+#include <process.h>
+#include <stdlib.h>
+
+static void reqpool_depth_test(void)
+{
+    SPD_REQUEST_POOL Pool;
+    SPD_REQUEST_POOL_ENTRY Entries[4], *Taken[4];
+
+    SpdRequestPoolInitialize(&Pool);
+    for (ULONG I = 0; 4 > I; I++)
+        SpdRequestPoolAdd(&Pool, &Entries[I]);
+    ASSERT(4 == Pool.Depth);
+
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        Taken[I] = SpdRequestPoolGet(&Pool);
+        ASSERT(Taken[I] >= &Entries[0] && Taken[I] <= &Entries[3]);
+        for (ULONG J = 0; I > J; J++)
+            ASSERT(Taken[J] != Taken[I]);
+    }
+    ASSERT(0 == Pool.FreeCount);
+    ASSERT(0 == Pool.FreeList);
+
+    for (ULONG I = 0; 4 > I; I++)
+        SpdRequestPoolPut(&Pool, Taken[I]);
+    ASSERT(4 == Pool.FreeCount);
+
+    /* a drained pool does not block */
+    SpdRequestPoolDrain(&Pool);
+
+    /* a stopped pool hands out nothing */
+    SpdRequestPoolStop(&Pool);
+    ASSERT(0 == SpdRequestPoolGet(&Pool));
+}
+
+/*
+ * Dispatcher/completer harness.
+ *
+ * Dispatcher threads take entries and queue them to completer threads, which return
+ * them to the pool, much like a storage unit that completes requests asynchronously.
+ * The number of entries outstanding must never exceed the pool depth.
+ */
+typedef struct
+{
+    SPD_REQUEST_POOL Pool;
+    SPD_REQUEST_POOL_ENTRY *Entries;
+    SRWLOCK Lock;
+    CONDITION_VARIABLE Condition;
+    SPD_REQUEST_POOL_ENTRY *Queue;
+    LONG Outstanding, MaxOutstanding;
+    LONG Remaining, Completed;
+    BOOLEAN Done;
+} REQPOOL_TEST_DATA;
+
+static unsigned __stdcall reqpool_dispatcher_thread(void *Data0)
+{
+    REQPOOL_TEST_DATA *Data = Data0;
+    SPD_REQUEST_POOL_ENTRY *Entry;
+    LONG Outstanding, MaxOutstanding;
+
+    while (0 <= InterlockedDecrement(&Data->Remaining))
+    {
+        Entry = SpdRequestPoolGet(&Data->Pool);
+        if (0 == Entry)
+            break;
+
+        Outstanding = InterlockedIncrement(&Data->Outstanding);
+        do
+        {
+            MaxOutstanding = Data->MaxOutstanding;
+            if (Outstanding <= MaxOutstanding)
+                break;
+        } while (MaxOutstanding != InterlockedCompareExchange(
+            &Data->MaxOutstanding, Outstanding, MaxOutstanding));
+
+        AcquireSRWLockExclusive(&Data->Lock);
+        Entry->Next = Data->Queue;
+        Data->Queue = Entry;
+        ReleaseSRWLockExclusive(&Data->Lock);
+        WakeConditionVariable(&Data->Condition);
+    }
+
+    return 0;
+}
+
+static unsigned __stdcall reqpool_completer_thread(void *Data0)
+{
+    REQPOOL_TEST_DATA *Data = Data0;
+    SPD_REQUEST_POOL_ENTRY *Entry;
+
+    for (;;)
+    {
+        AcquireSRWLockExclusive(&Data->Lock);
+        while (0 == Data->Queue && !Data->Done)
+            SleepConditionVariableSRW(&Data->Condition, &Data->Lock, INFINITE, 0);
+        Entry = Data->Queue;
+        if (0 != Entry)
+            Data->Queue = Entry->Next;
+        ReleaseSRWLockExclusive(&Data->Lock);
+
+        if (0 == Entry)
+            break;
+
+        InterlockedDecrement(&Data->Outstanding);
+        InterlockedIncrement(&Data->Completed);
+        SpdRequestPoolPut(&Data->Pool, Entry);
+    }
+
+    return 0;
+}
+
+static void reqpool_stress_dotest(ULONG Depth, ULONG DispatcherCount, ULONG CompleterCount,
+    LONG Count)
+{
+    REQPOOL_TEST_DATA *Data;
+    HANDLE Threads[16];
+
+    ASSERT(16 >= DispatcherCount + CompleterCount);
+
+    Data = calloc(1, sizeof *Data);
+    ASSERT(0 != Data);
+    Data->Entries = calloc(Depth, sizeof Data->Entries[0]);
+    ASSERT(0 != Data->Entries);
+    InitializeSRWLock(&Data->Lock);
+    InitializeConditionVariable(&Data->Condition);
+    Data->Remaining = Count;
+
+    SpdRequestPoolInitialize(&Data->Pool);
+    for (ULONG I = 0; Depth > I; I++)
+        SpdRequestPoolAdd(&Data->Pool, &Data->Entries[I]);
+
+    for (ULONG I = 0; CompleterCount > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, reqpool_completer_thread, Data, 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = CompleterCount; CompleterCount + DispatcherCount > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, reqpool_dispatcher_thread, Data, 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    for (ULONG I = CompleterCount; CompleterCount + DispatcherCount > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        CloseHandle(Threads[I]);
+    }
+
+    /* every entry comes back once the completers catch up */
+    SpdRequestPoolDrain(&Data->Pool);
+    ASSERT(Count == Data->Completed);
+    ASSERT(0 == Data->Outstanding);
+    ASSERT((LONG)Depth >= Data->MaxOutstanding);
+
+    AcquireSRWLockExclusive(&Data->Lock);
+    Data->Done = TRUE;
+    ReleaseSRWLockExclusive(&Data->Lock);
+    WakeAllConditionVariable(&Data->Condition);
+    for (ULONG I = 0; CompleterCount > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        CloseHandle(Threads[I]);
+    }
+
+    tlib_printf("depth=%u max=%u ", (unsigned)Depth, (unsigned)Data->MaxOutstanding);
+
+    free(Data->Entries);
+    free(Data);
+}
+
+static void reqpool_stress_test(void)
+{
+    /* every entry takes a trip through a condition variable: keep the counts modest */
+    reqpool_stress_dotest(1, 4, 1, 2000);
+    reqpool_stress_dotest(4, 4, 2, 4000);
+    reqpool_stress_dotest(16, 8, 4, 4000);
+}
+
+typedef struct
+{
+    SPD_REQUEST_POOL *Pool;
+    SPD_REQUEST_POOL_ENTRY *Entry;
+} REQPOOL_GET_DATA;
+
+static unsigned __stdcall reqpool_get_thread(void *Data0)
+{
+    REQPOOL_GET_DATA *Data = Data0;
+
+    Data->Entry = SpdRequestPoolGet(Data->Pool);
+
+    return 0;
+}
+
+static void reqpool_stop_test(void)
+{
+    SPD_REQUEST_POOL Pool;
+    SPD_REQUEST_POOL_ENTRY Entry, *Taken;
+    REQPOOL_GET_DATA GetData[4];
+    HANDLE Threads[4];
+
+    SpdRequestPoolInitialize(&Pool);
+    SpdRequestPoolAdd(&Pool, &Entry);
+
+    Taken = SpdRequestPoolGet(&Pool);
+    ASSERT(&Entry == Taken);
+
+    /* getters block on an empty pool until it is stopped */
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        GetData[I].Pool = &Pool;
+        GetData[I].Entry = (PVOID)1;
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, reqpool_get_thread, &GetData[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; 4 > I; I++)
+        ASSERT(WAIT_TIMEOUT == WaitForSingleObject(Threads[I], 100));
+
+    SpdRequestPoolStop(&Pool);
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        ASSERT(WAIT_OBJECT_0 == WaitForSingleObject(Threads[I], INFINITE));
+        CloseHandle(Threads[I]);
+        ASSERT(0 == GetData[I].Entry);
+    }
+
+    /* entries still come back after stop, and then the pool drains */
+    SpdRequestPoolPut(&Pool, Taken);
+    SpdRequestPoolDrain(&Pool);
+    ASSERT(1 == Pool.FreeCount);
+}
+
+void reqpool_tests(void)
+{
+    TEST(reqpool_depth_test);
+    TEST(reqpool_stress_test);
+    TEST(reqpool_stop_test);
+}
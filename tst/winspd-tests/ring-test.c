@@ -0,0 +1,275 @@
+/**
+ * @file ring-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#if defined(_WIN32)
+#include <winspd/winspd.h>
+#include <process.h>
+#else
+#include <shared/posix.h>
+#include <winspd/ioctl.h>
+#endif
+#include <shared/ring.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+static void ring_layout_test(void)
+{
+    static UINT32 Capacities[] = { 1, 2, 16, SPD_IOCTL_RING_CAPACITY_MAX };
+    SPD_RING_LAYOUT Layout;
+
+    for (ULONG I = 0; sizeof Capacities / sizeof Capacities[0] > I; I++)
+    {
+        UINT32 Capacity = Capacities[I];
+
+        SpdRingGetLayout(Capacity,
+            sizeof(SPD_IOCTL_RING_REQ), sizeof(SPD_IOCTL_RING_RSP), 64 * 1024, &Layout);
+
+        ASSERT(0 == Layout.ReqRingOffset);
+        ASSERT(sizeof(SPD_RING) == Layout.ReqEntriesOffset);
+        ASSERT(Layout.ReqEntriesOffset + Capacity * sizeof(SPD_IOCTL_RING_REQ) <=
+            Layout.RspRingOffset);
+        ASSERT(0 == Layout.RspRingOffset % sizeof(SPD_RING));
+        ASSERT(Layout.RspRingOffset + sizeof(SPD_RING) == Layout.RspEntriesOffset);
+        ASSERT(Layout.RspEntriesOffset + Capacity * sizeof(SPD_IOCTL_RING_RSP) <=
+            Layout.DataOffset);
+        ASSERT(0 == Layout.DataOffset % 4096);
+        ASSERT(Layout.DataOffset + (UINT64)Capacity * 64 * 1024 == Layout.Size);
+    }
+}
+
+static void ring_full_empty_test(void)
+{
+    SPD_RING Ring;
+    UINT64 Entries[8], Entry;
+    SPD_RING_PORT Producer, Consumer;
+    BOOLEAN Doorbell;
+
+    SpdRingInitialize(&Ring);
+    SpdRingPortInitialize(&Producer, &Ring, Entries, 8, sizeof Entries[0]);
+    SpdRingPortInitialize(&Consumer, &Ring, Entries, 8, sizeof Entries[0]);
+
+    ASSERT(SpdRingIsEmpty(&Consumer));
+    ASSERT(!SpdRingPop(&Consumer, &Entry));
+
+    /* only the empty to non-empty transition rings the doorbell */
+    for (UINT64 I = 0; 8 > I; I++)
+    {
+        Doorbell = FALSE;
+        ASSERT(SpdRingPush(&Producer, &I, &Doorbell));
+        ASSERT((0 == I) == Doorbell);
+    }
+
+    Entry = 8;
+    Doorbell = FALSE;
+    ASSERT(!SpdRingPush(&Producer, &Entry, &Doorbell));
+    ASSERT(!Doorbell);
+
+    ASSERT(SpdRingPop(&Consumer, &Entry));
+    ASSERT(0 == Entry);
+
+    /* not empty: a push after a pop must not ring */
+    Entry = 8;
+    Doorbell = FALSE;
+    ASSERT(SpdRingPush(&Producer, &Entry, &Doorbell));
+    ASSERT(!Doorbell);
+
+    for (UINT64 I = 1; 9 > I; I++)
+    {
+        ASSERT(SpdRingPop(&Consumer, &Entry));
+        ASSERT(I == Entry);
+    }
+    ASSERT(!SpdRingPop(&Consumer, &Entry));
+    ASSERT(SpdRingIsEmpty(&Consumer));
+
+    /* indexes wrap around; the ring is empty again, so the next push rings */
+    Entry = 9;
+    Doorbell = FALSE;
+    ASSERT(SpdRingPush(&Producer, &Entry, &Doorbell));
+    ASSERT(Doorbell);
+    ASSERT(!SpdRingIsEmpty(&Consumer));
+    ASSERT(SpdRingPop(&Consumer, &Entry));
+    ASSERT(9 == Entry);
+}
+
+static void ring_hostile_peer_test(void)
+{
+    SPD_RING Ring;
+    UINT64 Entries[4], Entry;
+    SPD_RING_PORT Producer, Consumer;
+    BOOLEAN Doorbell;
+
+    SpdRingInitialize(&Ring);
+    SpdRingPortInitialize(&Producer, &Ring, Entries, 4, sizeof Entries[0]);
+    SpdRingPortInitialize(&Consumer, &Ring, Entries, 4, sizeof Entries[0]);
+
+    /* a Tail too far ahead is rejected */
+    Ring.Tail = 5;
+    ASSERT(!SpdRingPop(&Consumer, &Entry));
+    Ring.Tail = (UINT32)-1;
+    ASSERT(!SpdRingPop(&Consumer, &Entry));
+
+    /* a Head that claims more than was produced makes the ring look full */
+    Ring.Tail = 0;
+    Ring.Head = 7;
+    Entry = 0;
+    Doorbell = FALSE;
+    ASSERT(!SpdRingPush(&Producer, &Entry, &Doorbell));
+
+    /* the producer never trusts the shared Tail */
+    Ring.Head = 0;
+    Ring.Tail = 3;
+    ASSERT(SpdRingPush(&Producer, &Entry, &Doorbell));
+    ASSERT(1 == Ring.Tail);
+}
+
+/*
+ * Producer/consumer harness.
+ *
+ * The consumer sleeps on an auto-reset event only after SpdRingIsEmpty reports an
+ * empty ring; the producer signals the event only when SpdRingCommit rings the
+ * doorbell. A lost wakeup deadlocks the test.
+ */
+typedef struct
+{
+    SPD_RING Ring;
+    SPD_RING_PORT Producer, Consumer;
+    UINT64 *Entries;
+    UINT64 Count;
+    HANDLE Event;
+    ULONG Doorbells, Wakeups;
+    BOOLEAN Failed;
+} RING_TEST_DATA;
+
+static unsigned __stdcall ring_producer_thread(void *Data0)
+{
+    RING_TEST_DATA *Data = Data0;
+    BOOLEAN Doorbell;
+
+    for (UINT64 I = 0; Data->Count > I;)
+    {
+        Doorbell = FALSE;
+        if (!SpdRingPush(&Data->Producer, &I, &Doorbell))
+        {
+            SwitchToThread();
+            continue;
+        }
+        I++;
+
+        if (Doorbell)
+        {
+            Data->Doorbells++;
+            SetEvent(Data->Event);
+        }
+    }
+
+    return 0;
+}
+
+static unsigned __stdcall ring_consumer_thread(void *Data0)
+{
+    RING_TEST_DATA *Data = Data0;
+    UINT64 Entry;
+
+    for (UINT64 I = 0; Data->Count > I;)
+    {
+        if (SpdRingPop(&Data->Consumer, &Entry))
+        {
+            if (I != Entry)
+                Data->Failed = TRUE;
+            I++;
+            continue;
+        }
+
+        if (SpdRingIsEmpty(&Data->Consumer))
+        {
+            WaitForSingleObject(Data->Event, INFINITE);
+            Data->Wakeups++;
+        }
+    }
+
+    return 0;
+}
+
+static void ring_producer_consumer_dotest(UINT32 Capacity, UINT64 Count)
+{
+    RING_TEST_DATA *Data;
+    HANDLE Threads[2];
+
+    Data = calloc(1, sizeof *Data);
+    ASSERT(0 != Data);
+    Data->Entries = calloc(Capacity, sizeof Data->Entries[0]);
+    ASSERT(0 != Data->Entries);
+    Data->Event = CreateEventW(0, FALSE, FALSE, 0);
+    ASSERT(0 != Data->Event);
+    Data->Count = Count;
+
+    SpdRingInitialize(&Data->Ring);
+    SpdRingPortInitialize(&Data->Producer, &Data->Ring, Data->Entries, Capacity, sizeof(UINT64));
+    SpdRingPortInitialize(&Data->Consumer, &Data->Ring, Data->Entries, Capacity, sizeof(UINT64));
+
+    Threads[0] = (HANDLE)_beginthreadex(0, 0, ring_consumer_thread, Data, 0, 0);
+    ASSERT(0 != Threads[0]);
+    Threads[1] = (HANDLE)_beginthreadex(0, 0, ring_producer_thread, Data, 0, 0);
+    ASSERT(0 != Threads[1]);
+
+    WaitForSingleObject(Threads[1], INFINITE);
+    WaitForSingleObject(Threads[0], INFINITE);
+    CloseHandle(Threads[1]);
+    CloseHandle(Threads[0]);
+
+    ASSERT(!Data->Failed);
+    ASSERT(SpdRingIsEmpty(&Data->Consumer));
+    ASSERT(Count >= Data->Doorbells);
+
+    tlib_printf("cap=%u doorbells/entry=%u.%03u ",
+        (unsigned)Capacity,
+        (unsigned)(Data->Doorbells / Count), (unsigned)(Data->Doorbells % Count * 1000 / Count));
+
+    CloseHandle(Data->Event);
+    free(Data->Entries);
+    free(Data);
+}
+
+static void ring_producer_consumer_test(void)
+{
+    ring_producer_consumer_dotest(1, 100000);
+    ring_producer_consumer_dotest(8, 1000000);
+    ring_producer_consumer_dotest(SPD_IOCTL_RING_CAPACITY_MAX, 1000000);
+}
+
+void ring_tests(void)
+{
+    TEST(ring_layout_test);
+    TEST(ring_full_empty_test);
+    TEST(ring_hostile_peer_test);
+    TEST(ring_producer_consumer_test);
+}
+
+#if !defined(_WIN32)
+int main(int argc, char *argv[])
+{
+    TESTSUITE(ring_tests);
+
+    tlib_run_tests(argc, argv);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,242 @@
+/**
+ * @file socket-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <winspd/winspd.h>
+#include <process.h>
+#endif
+#include <shared/socket.h>
+#include <tlib/testsuite.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_BLOCK_LENGTH               512
+#define TEST_MAX_TRANSFER_LENGTH        (64 * 1024)
+#define TEST_REQUEST_COUNT              1000
+
+static void socket_parse_name_test(void)
+{
+    char Host[SPD_SOCKET_NAME_MAX], Port[16];
+    BOOLEAN Unix;
+
+    ASSERT(SpdSocketParseName("tcp://localhost:1234", &Unix, Host, Port));
+    ASSERT(!Unix && 0 == strcmp(Host, "localhost") && 0 == strcmp(Port, "1234"));
+    ASSERT(SpdSocketParseName("tcp://:1234", &Unix, Host, Port));
+    ASSERT(!Unix && 0 == strcmp(Host, "") && 0 == strcmp(Port, "1234"));
+    ASSERT(SpdSocketParseName("tcp://[::1]:80", &Unix, Host, Port));
+    ASSERT(!Unix && 0 == strcmp(Host, "::1") && 0 == strcmp(Port, "80"));
+    ASSERT(SpdSocketParseName("unix:///tmp/spd.sock", &Unix, Host, Port));
+    ASSERT(Unix && 0 == strcmp(Host, "/tmp/spd.sock"));
+
+    ASSERT(!SpdSocketParseName("tcp://localhost", &Unix, Host, Port));
+    ASSERT(!SpdSocketParseName("tcp://localhost:", &Unix, Host, Port));
+    ASSERT(!SpdSocketParseName("tcp://localhost:12a", &Unix, Host, Port));
+    ASSERT(!SpdSocketParseName("tcp://[::1:80", &Unix, Host, Port));
+    ASSERT(!SpdSocketParseName("unix://", &Unix, Host, Port));
+    ASSERT(!SpdSocketParseName("udp://localhost:1234", &Unix, Host, Port));
+    ASSERT(!SpdSocketParseName("\\\\.\\pipe\\spd", &Unix, Host, Port));
+}
+
+/*
+ * Loopback harness.
+ *
+ * The server echoes every WRITE request as a READ response that carries the same
+ * data; the client checks that the data come back intact. The client sends some of
+ * its frames a few bytes at a time, so that the server sees partial receives.
+ */
+typedef struct
+{
+    SPD_SOCKET Listener;
+    BOOLEAN Failed;
+} SOCKET_TEST_DATA;
+
+static unsigned __stdcall socket_server_thread(void *Data0)
+{
+    SOCKET_TEST_DATA *Data = Data0;
+    SPD_SOCKET Socket;
+    UINT64 Buffer[SPD_SOCKET_FRAME_HEADER_SIZE / sizeof(UINT64)];
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP Rsp;
+    SPD_FRAME Frame;
+    PVOID DataBuffer;
+
+    DataBuffer = malloc(TEST_MAX_TRANSFER_LENGTH);
+    if (0 == DataBuffer || ERROR_SUCCESS != SpdSocketAccept(Data->Listener, &Socket))
+    {
+        Data->Failed = TRUE;
+        free(DataBuffer);
+        return 0;
+    }
+
+    for (;;)
+    {
+        if (ERROR_SUCCESS != SpdSocketRecvFrameHeader(Socket,
+            TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH, Buffer, &Frame))
+            break;
+        if (SpdFrameReqType != Frame.Type ||
+            ERROR_SUCCESS != SpdSocketRecv(Socket, DataBuffer, Frame.DataLength))
+        {
+            Data->Failed = TRUE;
+            break;
+        }
+        memcpy(&Req, Frame.Message, sizeof Req);
+
+        memset(&Rsp, 0, sizeof Rsp);
+        Rsp.Hint = Req.Hint;
+        Rsp.Kind = SpdIoctlTransactReadKind;
+        if (ERROR_SUCCESS != SpdSocketSendFrame(Socket, SPD_FRAME_VERSION, SpdFrameRspType,
+            &Rsp, DataBuffer, Frame.DataLength))
+        {
+            Data->Failed = TRUE;
+            break;
+        }
+    }
+
+    SpdSocketClose(Socket);
+    free(DataBuffer);
+
+    return 0;
+}
+
+static void socket_send_slowly(SPD_SOCKET Socket, PUINT8 Buffer, ULONG Length)
+{
+    for (ULONG Offset = 0, Piece; Length > Offset; Offset += Piece)
+    {
+        Piece = Length - Offset < 7 ? Length - Offset : 7;
+        ASSERT(ERROR_SUCCESS == SpdSocketSend(Socket, Buffer + Offset, Piece));
+    }
+}
+
+static void socket_loopback_dotest(const char *ListenName, const char *ConnectName)
+{
+    SOCKET_TEST_DATA Data;
+    SPD_SOCKET Socket;
+    HANDLE Thread;
+    UINT64 Buffer[SPD_SOCKET_FRAME_HEADER_SIZE / sizeof(UINT64)];
+    SPD_IOCTL_TRANSACT_REQ Req;
+    SPD_IOCTL_TRANSACT_RSP *Rsp;
+    SPD_FRAME Frame;
+    PUINT8 Out, In, Slow;
+    ULONG Seed = 1, Length;
+
+    memset(&Data, 0, sizeof Data);
+    ASSERT(ERROR_SUCCESS == SpdSocketOpen(ListenName, TRUE, &Data.Listener));
+
+    Thread = (HANDLE)_beginthreadex(0, 0, socket_server_thread, &Data, 0, 0);
+    ASSERT(0 != Thread);
+
+    ASSERT(ERROR_SUCCESS == SpdSocketOpen(ConnectName, FALSE, &Socket));
+
+    Out = malloc(TEST_MAX_TRANSFER_LENGTH);
+    In = malloc(TEST_MAX_TRANSFER_LENGTH);
+    Slow = malloc(sizeof(SPD_FRAME_HEADER) + sizeof Req + TEST_MAX_TRANSFER_LENGTH);
+    ASSERT(0 != Out && 0 != In && 0 != Slow);
+
+    for (ULONG I = 0; TEST_REQUEST_COUNT > I; I++)
+    {
+        Seed = Seed * 1103515245 + 12345;
+
+        memset(&Req, 0, sizeof Req);
+        Req.Hint = I + 1;
+        Req.Kind = SpdIoctlTransactWriteKind;
+        Req.Op.Write.BlockCount = (Seed >> 8) % (TEST_MAX_TRANSFER_LENGTH / TEST_BLOCK_LENGTH + 1);
+        Length = Req.Op.Write.BlockCount * TEST_BLOCK_LENGTH;
+        for (ULONG J = 0; Length > J; J++)
+            Out[J] = (UINT8)(I + J * 3);
+
+        if (0 == I % 10)
+        {
+            ULONG HeaderLength = SpdFrameEncode(Slow,
+                SPD_FRAME_VERSION, SpdFrameReqType, &Req, Length);
+            memcpy(Slow + HeaderLength, Out, Length);
+            socket_send_slowly(Socket, Slow, HeaderLength + (0 != Length ? 64 : 0));
+            if (0 != Length)
+                ASSERT(ERROR_SUCCESS == SpdSocketSend(Socket,
+                    Slow + HeaderLength + 64, Length - 64));
+        }
+        else
+            ASSERT(ERROR_SUCCESS == SpdSocketSendFrame(Socket,
+                SPD_FRAME_VERSION, SpdFrameReqType, &Req, Out, Length));
+
+        ASSERT(ERROR_SUCCESS == SpdSocketRecvFrameHeader(Socket,
+            TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH, Buffer, &Frame));
+        ASSERT(SpdFrameRspType == Frame.Type);
+        Rsp = Frame.Message;
+        ASSERT(Req.Hint == Rsp->Hint);
+        ASSERT(Length == Frame.DataLength);
+        memset(In, 0, Length);
+        ASSERT(ERROR_SUCCESS == SpdSocketRecv(Socket, In, Frame.DataLength));
+        ASSERT(0 == memcmp(In, Out, Length));
+    }
+
+    /* a malformed frame makes the server hang up */
+    memset(Slow, 0xcc, sizeof(SPD_FRAME_HEADER));
+    ASSERT(ERROR_SUCCESS == SpdSocketSend(Socket, Slow, sizeof(SPD_FRAME_HEADER)));
+    ASSERT(ERROR_SUCCESS != SpdSocketRecvFrameHeader(Socket,
+        TEST_BLOCK_LENGTH, TEST_MAX_TRANSFER_LENGTH, Buffer, &Frame));
+
+    WaitForSingleObject(Thread, INFINITE);
+    CloseHandle(Thread);
+
+    ASSERT(!Data.Failed);
+
+    free(Slow);
+    free(In);
+    free(Out);
+    SpdSocketClose(Socket);
+    SpdSocketClose(Data.Listener);
+}
+
+static void socket_loopback_tcp_test(void)
+{
+    socket_loopback_dotest("tcp://127.0.0.1:43517", "tcp://127.0.0.1:43517");
+}
+
+static void socket_loopback_unix_test(void)
+{
+    socket_loopback_dotest("unix://winspd-tests.sock", "unix://winspd-tests.sock");
+    remove("winspd-tests.sock");
+}
+
+void socket_tests(void)
+{
+    if (ERROR_SUCCESS != SpdSocketStartup())
+        return;
+
+    TEST(socket_parse_name_test);
+    TEST(socket_loopback_tcp_test);
+    TEST(socket_loopback_unix_test);
+
+    SpdSocketCleanup();
+}
+
+#if !defined(_WIN32)
+int main(int argc, char *argv[])
+{
+    TESTSUITE(socket_tests);
+
+    tlib_run_tests(argc, argv);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,229 @@
+/**
+ * @file spinwait-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winspd/winspd.h>
+#include <shared/spinwait.h>
+#include <tlib/testsuite.h>
+#include <process.h>
+#include <stdlib.h>
+
+#define TEST_US                         10ULL
+
+static void spinwait_adapt_test(void)
+{
+    SPD_SPINWAIT SpinWait;
+
+    /* a budget of 0 never polls */
+    SpdSpinWaitInitialize(&SpinWait, 0);
+    ASSERT(0 == SpdSpinWaitBegin(&SpinWait));
+    ASSERT(!SpdSpinWaitPolling(&SpinWait));
+
+    SpdSpinWaitInitialize(&SpinWait, 10 * SPD_SPINWAIT_BUDGET_MAX);
+    ASSERT(SPD_SPINWAIT_BUDGET_MAX == SpdSpinWaitBegin(&SpinWait));
+    SpdSpinWaitEnd(&SpinWait, TRUE, 0);
+
+    SpdSpinWaitInitialize(&SpinWait, 100 * TEST_US);
+    ASSERT(100 * TEST_US == SpdSpinWaitBegin(&SpinWait));
+    ASSERT(SpdSpinWaitPolling(&SpinWait));
+    ASSERT(100 * TEST_US == SpdSpinWaitBegin(&SpinWait));
+    SpdSpinWaitEnd(&SpinWait, TRUE, 5 * TEST_US);
+    ASSERT(SpdSpinWaitPolling(&SpinWait));
+
+    /* nothing showed up: poll half as long, but never less than the minimum */
+    SpdSpinWaitEnd(&SpinWait, FALSE, 100 * TEST_US);
+    ASSERT(!SpdSpinWaitPolling(&SpinWait));
+    ASSERT(50 * TEST_US == SpinWait.Spin);
+    for (ULONG I = 0; 16 > I; I++)
+    {
+        SpdSpinWaitBegin(&SpinWait);
+        SpdSpinWaitEnd(&SpinWait, FALSE, SpinWait.Spin);
+    }
+    ASSERT(SPD_SPINWAIT_MIN == SpinWait.Spin);
+
+    /* a request showed up after T: poll for at least 2T, up to the budget */
+    SpdSpinWaitBegin(&SpinWait);
+    SpdSpinWaitEnd(&SpinWait, TRUE, 3 * TEST_US);
+    ASSERT(6 * TEST_US == SpinWait.Spin);
+    SpdSpinWaitBegin(&SpinWait);
+    SpdSpinWaitEnd(&SpinWait, TRUE, 1 * TEST_US);
+    ASSERT(6 * TEST_US == SpinWait.Spin);
+    SpdSpinWaitBegin(&SpinWait);
+    SpdSpinWaitEnd(&SpinWait, TRUE, 80 * TEST_US);
+    ASSERT(100 * TEST_US == SpinWait.Spin);
+    ASSERT(!SpdSpinWaitPolling(&SpinWait));
+
+    /* a budget below the minimum is the minimum */
+    SpdSpinWaitInitialize(&SpinWait, SPD_SPINWAIT_MIN / 2);
+    SpdSpinWaitBegin(&SpinWait);
+    SpdSpinWaitEnd(&SpinWait, FALSE, SPD_SPINWAIT_MIN / 2);
+    ASSERT(SPD_SPINWAIT_MIN / 2 == SpinWait.Spin);
+}
+
+/*
+ * Wake-up latency benchmark: a producer posts requests one at a time with gaps that
+ * are mostly short and sometimes long, and a consumer waits for them the way a driver
+ * dispatcher does: it polls per SpinWait and then blocks on an auto-reset event, which
+ * the producer sets only if nobody polls. The latency of a request is the time from
+ * its posting to the consumer seeing it. A lost wake-up hangs the consumer, which the
+ * wait timeout catches.
+ */
+#define SPINWAIT_TEST_COUNT             20000
+
+typedef struct
+{
+    SPD_SPINWAIT SpinWait;
+    HANDLE Event;
+    volatile LONG Pending;
+    volatile LONG Stop;
+    volatile UINT64 PostTime;
+    ULONG Count;
+    UINT64 *Latencies;
+    ULONG Blocked;
+} SPINWAIT_TEST_DATA;
+
+static BOOLEAN spinwait_poll(SPINWAIT_TEST_DATA *Data)
+{
+    UINT64 Spin, Start, Elapsed = 0;
+    BOOLEAN Found = FALSE;
+
+    Spin = SpdSpinWaitBegin(&Data->SpinWait);
+    if (0 == Spin)
+        return FALSE;
+
+    Start = SpdSpinWaitNow();
+    for (ULONG I = 1;; I++)
+    {
+        if (0 != Data->Pending || Data->Stop)
+        {
+            Found = TRUE;
+            Elapsed = SpdSpinWaitNow() - Start;
+            break;
+        }
+
+        YieldProcessor();
+
+        if (0 == I % SPD_SPINWAIT_CHECK && Spin <= (Elapsed = SpdSpinWaitNow() - Start))
+            break;
+    }
+
+    SpdSpinWaitEnd(&Data->SpinWait, Found, Elapsed);
+
+    return Found || 0 != Data->Pending;
+}
+
+static unsigned __stdcall spinwait_consumer_thread(void *Data0)
+{
+    SPINWAIT_TEST_DATA *Data = Data0;
+
+    while (!Data->Stop)
+    {
+        if (!spinwait_poll(Data))
+        {
+            Data->Blocked++;
+            if (WAIT_OBJECT_0 != WaitForSingleObject(Data->Event, 10000))
+                return 1;
+        }
+
+        if (0 != InterlockedExchange(&Data->Pending, 0))
+            Data->Latencies[Data->Count++] = SpdSpinWaitNow() - Data->PostTime;
+    }
+
+    return 0;
+}
+
+static int spinwait_compare(const void *P0, const void *P1)
+{
+    UINT64 L0 = *(const UINT64 *)P0, L1 = *(const UINT64 *)P1;
+    return L0 < L1 ? -1 : L0 > L1 ? +1 : 0;
+}
+
+static void spinwait_bench_dotest(UINT32 Budget)
+{
+    SPINWAIT_TEST_DATA *Data;
+    HANDLE Thread;
+    DWORD ExitCode;
+    ULONG Seed = 1;
+    UINT64 Gap, Start;
+
+    Data = calloc(1, sizeof *Data);
+    ASSERT(0 != Data);
+    Data->Latencies = malloc(SPINWAIT_TEST_COUNT * sizeof Data->Latencies[0]);
+    ASSERT(0 != Data->Latencies);
+    SpdSpinWaitInitialize(&Data->SpinWait, Budget);
+    Data->Event = CreateEventW(0, FALSE, FALSE, 0);
+    ASSERT(0 != Data->Event);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, spinwait_consumer_thread, Data, 0, 0);
+    ASSERT(0 != Thread);
+
+    for (ULONG I = 0; SPINWAIT_TEST_COUNT > I; I++)
+    {
+        /* gaps of 2-50us; and every so often one of 1ms, which outlasts any budget */
+        Seed = Seed * 1103515245 + 12345;
+        Gap = 0 == (Seed >> 8) % 32 ? 1000 * TEST_US : (2 + (Seed >> 8) % 49) * TEST_US;
+        for (Start = SpdSpinWaitNow(); Gap > SpdSpinWaitNow() - Start;)
+            YieldProcessor();
+
+        Data->PostTime = SpdSpinWaitNow();
+        InterlockedExchange(&Data->Pending, 1);
+        if (!SpdSpinWaitPolling(&Data->SpinWait))
+            SetEvent(Data->Event);
+
+        /* one request at a time, so that each latency is for a consumer that had none */
+        while (0 != Data->Pending)
+            YieldProcessor();
+    }
+
+    InterlockedExchange(&Data->Stop, 1);
+    SetEvent(Data->Event);
+    WaitForSingleObject(Thread, INFINITE);
+    GetExitCodeThread(Thread, &ExitCode);
+    CloseHandle(Thread);
+    CloseHandle(Data->Event);
+
+    ASSERT(0 == ExitCode);
+    ASSERT(SPINWAIT_TEST_COUNT == Data->Count);
+
+    qsort(Data->Latencies, Data->Count, sizeof Data->Latencies[0], spinwait_compare);
+    tlib_printf("spin=%uus p50=%uus p90=%uus p99=%uus p999=%uus blocked=%u%% ",
+        (unsigned)(Budget / TEST_US),
+        (unsigned)(Data->Latencies[Data->Count * 50 / 100] / TEST_US),
+        (unsigned)(Data->Latencies[Data->Count * 90 / 100] / TEST_US),
+        (unsigned)(Data->Latencies[Data->Count * 99 / 100] / TEST_US),
+        (unsigned)(Data->Latencies[Data->Count * 999 / 1000] / TEST_US),
+        (unsigned)(Data->Blocked * 100ULL / Data->Count));
+
+    free(Data->Latencies);
+    free(Data);
+}
+
+static void spinwait_bench_test(void)
+{
+    spinwait_bench_dotest(0);
+    spinwait_bench_dotest(20 * TEST_US);
+    spinwait_bench_dotest(100 * TEST_US);
+}
+
+void spinwait_tests(void)
+{
+    TEST(spinwait_adapt_test);
+    TEST_OPT(spinwait_bench_test);
+}
@@ -0,0 +1,170 @@
+/**
+ * @file unittab-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winspd/winspd.h>
+#include <shared/unittab.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+static SPD_UNIT_TABLE *unittab_create(ULONG Capacity)
+{
+    SPD_UNIT_TABLE *Table = malloc(SpdUnitTableSize(Capacity));
+    ASSERT(0 != Table);
+    SpdUnitTableInitialize(Table, Capacity);
+    return Table;
+}
+
+static void unittab_guid(GUID *Guid, ULONG I)
+{
+    memset(Guid, 0, sizeof *Guid);
+    Guid->Data1 = 0x5370645f;
+    Guid->Data4[7] = (UINT8)I;
+    Guid->Data4[6] = (UINT8)(I >> 8);
+}
+
+static void unittab_insert_test(void)
+{
+    SPD_UNIT_TABLE *Table = unittab_create(16);
+    SPD_UNIT_TABLE_ENTRY Entries[17];
+
+    memset(Entries, 0, sizeof Entries);
+    for (ULONG I = 0; 17 > I; I++)
+        unittab_guid(&Entries[I].Guid, I);
+
+    ASSERT(0 == SpdUnitTableLookup(Table, 0));
+    ASSERT(0 == SpdUnitTableLookupGuid(Table, &Entries[0].Guid));
+    ASSERT(16 == SpdUnitTableNext(Table, 0));
+
+    /* units take the lowest free index until the table is full */
+    for (ULONG I = 0; 16 > I; I++)
+    {
+        ASSERT(SpdUnitTableInsert(Table, &Entries[I]));
+        ASSERT(I == Entries[I].Index);
+    }
+    ASSERT(16 == Table->Count);
+    ASSERT(!SpdUnitTableInsert(Table, &Entries[16]));
+    ASSERT(16 == Table->Count);
+
+    for (ULONG I = 0; 16 > I; I++)
+    {
+        ASSERT(&Entries[I] == SpdUnitTableLookup(Table, I));
+        ASSERT(&Entries[I] == SpdUnitTableLookupGuid(Table, &Entries[I].Guid));
+    }
+    ASSERT(0 == SpdUnitTableLookup(Table, 16));
+    ASSERT(0 == SpdUnitTableLookup(Table, (ULONG)-1));
+    ASSERT(0 == SpdUnitTableLookupGuid(Table, &Entries[16].Guid));
+
+    /* a freed index is reused first */
+    SpdUnitTableRemove(Table, &Entries[5]);
+    SpdUnitTableRemove(Table, &Entries[3]);
+    ASSERT(0 == SpdUnitTableLookup(Table, 3));
+    ASSERT(0 == SpdUnitTableLookupGuid(Table, &Entries[3].Guid));
+    ASSERT(&Entries[4] == SpdUnitTableLookupGuid(Table, &Entries[4].Guid));
+    ASSERT(14 == Table->Count);
+    ASSERT(4 == SpdUnitTableNext(Table, 3));
+    ASSERT(6 == SpdUnitTableNext(Table, 5));
+
+    ASSERT(SpdUnitTableInsert(Table, &Entries[16]));
+    ASSERT(3 == Entries[16].Index);
+    ASSERT(&Entries[16] == SpdUnitTableLookupGuid(Table, &Entries[16].Guid));
+    ASSERT(SpdUnitTableInsert(Table, &Entries[3]));
+    ASSERT(5 == Entries[3].Index);
+
+    free(Table);
+}
+
+static void unittab_large_test(void)
+{
+    ULONG Capacity = SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY;
+    SPD_UNIT_TABLE *Table = unittab_create(Capacity);
+    SPD_UNIT_TABLE_ENTRY *Entries = malloc(Capacity * sizeof Entries[0]);
+    ULONG Count;
+
+    ASSERT(0 != Entries);
+    memset(Entries, 0, Capacity * sizeof Entries[0]);
+
+    for (ULONG I = 0; Capacity > I; I++)
+    {
+        unittab_guid(&Entries[I].Guid, I);
+        ASSERT(SpdUnitTableInsert(Table, &Entries[I]));
+        ASSERT(I == Entries[I].Index);
+    }
+    ASSERT(Capacity == Table->Count);
+
+    /* keep every 7th unit */
+    for (ULONG I = 0; Capacity > I; I++)
+        if (0 != I % 7)
+            SpdUnitTableRemove(Table, &Entries[I]);
+    ASSERT((Capacity + 6) / 7 == Table->Count);
+
+    Count = 0;
+    for (ULONG I = SpdUnitTableNext(Table, 0); Capacity > I; I = SpdUnitTableNext(Table, I + 1))
+    {
+        ASSERT(0 == I % 7);
+        ASSERT(&Entries[I] == SpdUnitTableLookup(Table, I));
+        Count++;
+    }
+    ASSERT(Table->Count == Count);
+
+    for (ULONG I = 0; Capacity > I; I++)
+        ASSERT((0 == I % 7 ? &Entries[I] : 0) == SpdUnitTableLookupGuid(Table, &Entries[I].Guid));
+
+    free(Entries);
+    free(Table);
+}
+
+static void unittab_btl_test(void)
+{
+    ULONG Capacities[] = { 16, 64, 128, 200, SPD_IOCTL_STORAGE_UNIT_MAX_CAPACITY };
+    ULONG Capacity, Btl;
+
+    for (ULONG J = 0; sizeof Capacities / sizeof Capacities[0] > J; J++)
+    {
+        Capacity = Capacities[J];
+
+        /* the first units are LUN 0 of consecutive targets */
+        for (ULONG I = 0; SPD_IOCTL_TARGET_COUNT(Capacity) > I; I++)
+            ASSERT(SPD_IOCTL_BTL(0, I, 0) == SPD_IOCTL_BTL_FROM_INDEX(Capacity, I));
+
+        ASSERT(SPD_IOCTL_TARGET_COUNT(Capacity) * SPD_IOCTL_LUN_COUNT(Capacity) >= Capacity);
+        ASSERT(256 > SPD_IOCTL_TARGET_COUNT(Capacity));
+        ASSERT(256 > SPD_IOCTL_LUN_COUNT(Capacity));
+
+        for (ULONG I = 0; Capacity > I; I++)
+        {
+            Btl = SPD_IOCTL_BTL_FROM_INDEX(Capacity, I);
+            ASSERT(0 == SPD_IOCTL_BTL_B(Btl));
+            ASSERT(SPD_IOCTL_LUN_COUNT(Capacity) > SPD_IOCTL_BTL_L(Btl));
+            ASSERT(I == SPD_IOCTL_INDEX_FROM_BTL(Capacity, Btl));
+        }
+
+        ASSERT((ULONG)-1 == SPD_IOCTL_INDEX_FROM_BTL(Capacity, SPD_IOCTL_BTL(1, 0, 0)));
+        ASSERT((ULONG)-1 == SPD_IOCTL_INDEX_FROM_BTL(Capacity,
+            SPD_IOCTL_BTL(0, SPD_IOCTL_TARGET_COUNT(Capacity), 0)));
+    }
+}
+
+void unittab_tests(void)
+{
+    TEST(unittab_insert_test);
+    TEST(unittab_large_test);
+    TEST(unittab_btl_test);
+}
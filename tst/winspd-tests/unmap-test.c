@@ -0,0 +1,226 @@
+/**
+ * @file unmap-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winspd/winspd.h>
+#include <shared/unmap.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+static ULONG unmap_random(PULONG PSeed)
+{
+    *PSeed = *PSeed * 1103515245 + 12345;
+    return *PSeed >> 8;
+}
+
+static void unmap_descriptor(SPD_UNMAP_DESCRIPTOR *Descriptor, UINT64 BlockAddress, UINT32 BlockCount)
+{
+    Descriptor->BlockAddress = BlockAddress;
+    Descriptor->BlockCount = BlockCount;
+    Descriptor->Reserved = 0;
+}
+
+static void unmap_basic_test(void)
+{
+    SPD_UNMAP_DESCRIPTOR Descriptors[8];
+
+    ASSERT(0 == SpdUnmapCompact(Descriptors, 0, 8, 1000));
+
+    /* out of order, overlapping, adjacent and empty */
+    unmap_descriptor(&Descriptors[0], 20, 5);
+    unmap_descriptor(&Descriptors[1], 0, 10);
+    unmap_descriptor(&Descriptors[2], 50, 0);
+    unmap_descriptor(&Descriptors[3], 8, 4);
+    unmap_descriptor(&Descriptors[4], 12, 3);
+    unmap_descriptor(&Descriptors[5], 24, 1);
+    ASSERT(2 == SpdUnmapCompact(Descriptors, 6, 1, 1000));
+    ASSERT(0 == Descriptors[0].BlockAddress && 15 == Descriptors[0].BlockCount);
+    ASSERT(20 == Descriptors[1].BlockAddress && 5 == Descriptors[1].BlockCount);
+
+    /* aligned inwards; fragments that hold no whole granule are dropped */
+    unmap_descriptor(&Descriptors[0], 3, 14);
+    unmap_descriptor(&Descriptors[1], 17, 6);
+    unmap_descriptor(&Descriptors[2], 40, 7);
+    unmap_descriptor(&Descriptors[3], 33, 6);
+    ASSERT(1 == SpdUnmapCompact(Descriptors, 4, 8, 1000));
+    ASSERT(8 == Descriptors[0].BlockAddress && 8 == Descriptors[0].BlockCount);
+
+    /* the short last granule of the device */
+    unmap_descriptor(&Descriptors[0], 990, 10);
+    unmap_descriptor(&Descriptors[1], 980, 10);
+    ASSERT(1 == SpdUnmapCompact(Descriptors, 2, 8, 1000));
+    ASSERT(984 == Descriptors[0].BlockAddress && 16 == Descriptors[0].BlockCount);
+    unmap_descriptor(&Descriptors[0], 996, 3);
+    ASSERT(0 == SpdUnmapCompact(Descriptors, 1, 8, 1000));
+
+    /* merged ranges that do not fit a descriptor are split where the next one starts */
+    unmap_descriptor(&Descriptors[0], 0, 0xf0000000);
+    unmap_descriptor(&Descriptors[1], 0x80000000, 0xf0000000);
+    unmap_descriptor(&Descriptors[2], 0x100000000ULL, 0x10);
+    ASSERT(2 == SpdUnmapCompact(Descriptors, 3, 1, 1ULL << 40));
+    ASSERT(0 == Descriptors[0].BlockAddress && 0xf0000000 == Descriptors[0].BlockCount);
+    ASSERT(0xf0000000 == Descriptors[1].BlockAddress && 0x80000000 == Descriptors[1].BlockCount);
+
+    /* ... at a granule boundary, so that the granule across the cut is not lost */
+    unmap_descriptor(&Descriptors[0], 3, 0xfffffff0);
+    unmap_descriptor(&Descriptors[1], 0x80000003, 0xf0000000);
+    ASSERT(2 == SpdUnmapCompact(Descriptors, 2, 8, 1ULL << 40));
+    ASSERT(8 == Descriptors[0].BlockAddress && 0xffffffe8 == Descriptors[0].BlockCount);
+    ASSERT(0xfffffff0 == Descriptors[1].BlockAddress && 0x70000010 == Descriptors[1].BlockCount);
+}
+
+/*
+ * Properties, checked block by block against the original list: the result is sorted,
+ * aligned and disjoint; it unmaps no block that the original did not; and it unmaps
+ * every granule that the original covered in full.
+ */
+static void unmap_property_dotest(UINT32 Granularity, UINT32 BlockCount, ULONG Seed)
+{
+    enum { Rounds = 2000, DescriptorMax = 64 };
+    SPD_UNMAP_DESCRIPTOR Descriptors[DescriptorMax];
+    UINT8 *Requested, *Unmapped;
+    UINT32 Count, NewCount, Length;
+    UINT64 End;
+
+    Requested = malloc(BlockCount);
+    Unmapped = malloc(BlockCount);
+    ASSERT(0 != Requested && 0 != Unmapped);
+
+    for (ULONG Round = 0; Rounds > Round; Round++)
+    {
+        memset(Requested, 0, BlockCount);
+        memset(Unmapped, 0, BlockCount);
+
+        Count = unmap_random(&Seed) % (DescriptorMax + 1);
+        for (UINT32 I = 0; Count > I; I++)
+        {
+            Length = unmap_random(&Seed) % (4 * Granularity + 2);
+            unmap_descriptor(&Descriptors[I],
+                unmap_random(&Seed) % (BlockCount - Length + 1), Length);
+            for (UINT32 J = 0; Length > J; J++)
+                Requested[Descriptors[I].BlockAddress + J] = 1;
+        }
+
+        NewCount = SpdUnmapCompact(Descriptors, Count, Granularity, BlockCount);
+        ASSERT(Count >= NewCount);
+
+        for (UINT32 I = 0; NewCount > I; I++)
+        {
+            End = Descriptors[I].BlockAddress + Descriptors[I].BlockCount;
+            ASSERT(0 < Descriptors[I].BlockCount);
+            ASSERT(0 == Descriptors[I].BlockAddress % Granularity);
+            ASSERT(0 == End % Granularity || BlockCount == End);
+            if (0 < I)
+                ASSERT(Descriptors[I - 1].BlockAddress + Descriptors[I - 1].BlockCount <
+                    Descriptors[I].BlockAddress);
+            for (UINT64 J = Descriptors[I].BlockAddress; End > J; J++)
+            {
+                ASSERT(Requested[J]);
+                Unmapped[J] = 1;
+            }
+        }
+
+        for (UINT32 Granule = 0; BlockCount > Granule; Granule += Granularity)
+        {
+            UINT32 GranuleEnd = BlockCount - Granule > Granularity ? Granule + Granularity : BlockCount;
+            BOOLEAN Covered = TRUE;
+            for (UINT32 J = Granule; GranuleEnd > J; J++)
+                Covered = Covered && Requested[J];
+            for (UINT32 J = Granule; GranuleEnd > J; J++)
+                ASSERT(Covered == Unmapped[J]);
+        }
+    }
+
+    free(Unmapped);
+    free(Requested);
+}
+
+static void unmap_property_test(void)
+{
+    unmap_property_dotest(1, 256, 1);
+    unmap_property_dotest(8, 1000, 2);
+    unmap_property_dotest(16, 1024, 3);
+    unmap_property_dotest(128, 4000, 4);
+}
+
+/*
+ * Benchmark: a full UNMAP of 64KB worth of descriptors (4096), many times over, in the
+ * shapes that Windows sends: sorted runs of small adjacent ranges (a file system freeing
+ * a fragmented file) and the same ranges shuffled.
+ */
+static void unmap_bench_dotest(BOOLEAN Shuffle, UINT32 Granularity)
+{
+    enum { Rounds = 1000, DescriptorCount = 4096 };
+    static SPD_UNMAP_DESCRIPTOR Original[DescriptorCount], Descriptors[DescriptorCount];
+    SPD_UNMAP_DESCRIPTOR Descriptor;
+    UINT64 BlockAddress = 0, InBlocks = 0, OutBlocks = 0;
+    ULONG Seed = 1, OutCount = 0;
+    DWORD Start, Time;
+
+    for (UINT32 I = 0; DescriptorCount > I; I++)
+    {
+        /* runs of about 8 adjacent 4KB-64KB ranges, with gaps between runs */
+        if (0 == unmap_random(&Seed) % 8)
+            BlockAddress += 8 * (1 + unmap_random(&Seed) % 256);
+        unmap_descriptor(&Original[I], BlockAddress, 8 * (1 + unmap_random(&Seed) % 16));
+        BlockAddress += Original[I].BlockCount;
+        InBlocks += Original[I].BlockCount;
+    }
+    if (Shuffle)
+        for (UINT32 I = DescriptorCount - 1; 0 < I; I--)
+        {
+            UINT32 J = unmap_random(&Seed) % (I + 1);
+            Descriptor = Original[I];
+            Original[I] = Original[J];
+            Original[J] = Descriptor;
+        }
+
+    Start = GetTickCount();
+    for (ULONG Round = 0; Rounds > Round; Round++)
+    {
+        memcpy(Descriptors, Original, sizeof Descriptors);
+        OutCount = SpdUnmapCompact(Descriptors, DescriptorCount, Granularity, BlockAddress);
+    }
+    Time = GetTickCount() - Start;
+
+    for (ULONG I = 0; OutCount > I; I++)
+        OutBlocks += Descriptors[I].BlockCount;
+    ASSERT(0 < OutCount && OutBlocks <= InBlocks);
+
+    tlib_printf("shuffle=%u granularity=%u descriptors=%u->%u blocks=%u%% time=%uus ",
+        (unsigned)Shuffle, (unsigned)Granularity,
+        (unsigned)DescriptorCount, (unsigned)OutCount,
+        (unsigned)(OutBlocks * 100 / InBlocks),
+        (unsigned)(Time * 1000 / Rounds));
+}
+
+static void unmap_bench_test(void)
+{
+    unmap_bench_dotest(FALSE, 1);
+    unmap_bench_dotest(TRUE, 1);
+    unmap_bench_dotest(TRUE, 128);
+}
+
+void unmap_tests(void)
+{
+    TEST(unmap_basic_test);
+    TEST(unmap_property_test);
+    TEST_OPT(unmap_bench_test);
+}
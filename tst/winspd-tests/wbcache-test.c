@@ -0,0 +1,578 @@
+/**
+ * @file wbcache-test.c
+ *
+ * @copyright 2018-2020 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinSpd.
+ *
+ * You can redistribute it and/or modify it under the terms of the GNU
+ * General Public License version 3 as published by the Free Software
+ * Foundation.
+ *
+ * Licensees holding a valid commercial license may use this software
+ * in accordance with the commercial license agreement provided in
+ * conjunction with the software.  The terms and conditions of any such
+ * commercial license agreement shall govern, supersede, and render
+ * ineffective any application of the GPLv3 license to this software,
+ * notwithstanding of any reference thereto in the software or
+ * associated repository.
+ */
+
+#include <winspd/winspd.h>
+#include <shared/wbcache.h>
+#include <tlib/testsuite.h>
+#include <stdlib.h>
+
+#define TEST_BLOCK_LENGTH               16
+
+static ULONG wbcache_random(PULONG PSeed)
+{
+    *PSeed = *PSeed * 1103515245 + 12345;
+    return *PSeed >> 8;
+}
+
+/* block data are derived from the block address and a version, so that stale data show */
+static void wbcache_block(PUINT8 Buffer, UINT64 BlockAddress, UINT32 BlockCount, UINT8 Version)
+{
+    for (UINT32 I = 0; BlockCount > I; I++)
+    {
+        UINT64 Address = BlockAddress + I;
+        memset(Buffer + I * TEST_BLOCK_LENGTH, Version, TEST_BLOCK_LENGTH);
+        memcpy(Buffer + I * TEST_BLOCK_LENGTH, &Address, sizeof Address);
+    }
+}
+
+static UINT8 wbcache_block_version(PUINT8 Buffer, UINT64 BlockAddress)
+{
+    ASSERT(0 == memcmp(Buffer, &BlockAddress, sizeof BlockAddress));
+    return Buffer[sizeof BlockAddress];
+}
+
+static SPD_WBCACHE *wbcache_create(ULONG EntryCount)
+{
+    SPD_WBCACHE *Cache;
+    PVOID Buffer;
+
+    Cache = malloc(sizeof *Cache);
+    ASSERT(0 != Cache);
+    Buffer = malloc((size_t)SpdWbcacheBufferSize(EntryCount, TEST_BLOCK_LENGTH));
+    ASSERT(0 != Buffer);
+    SpdWbcacheInitialize(Cache, Buffer, EntryCount, TEST_BLOCK_LENGTH);
+
+    return Cache;
+}
+
+static void wbcache_delete(SPD_WBCACHE *Cache)
+{
+    free(Cache->Data);
+    free(Cache);
+}
+
+static void wbcache_write_test(void)
+{
+    SPD_WBCACHE *Cache;
+    UINT8 Buffer[8 * TEST_BLOCK_LENGTH], Expected[8 * TEST_BLOCK_LENGTH];
+    UINT64 RunAddress;
+    UINT32 RunCount;
+
+    Cache = wbcache_create(32);
+
+    ASSERT(!SpdWbcacheRead(Cache, 100, 4, Buffer));
+    ASSERT(!SpdWbcacheDestageBegin(Cache, 0, 0, 8, Buffer, &RunAddress, &RunCount));
+
+    wbcache_block(Expected, 100, 4, 1);
+    ASSERT(SpdWbcacheWrite(Cache, 100, 4, Expected));
+    ASSERT(4 == SpdWbcacheDirtyCount(Cache));
+    ASSERT(SpdWbcacheDirtyRange(Cache, 0, 0));
+    ASSERT(SpdWbcacheDirtyRange(Cache, 103, 10));
+    ASSERT(!SpdWbcacheDirtyRange(Cache, 104, 10));
+
+    /* dirty data are served from the cache */
+    memset(Buffer, 0, sizeof Buffer);
+    ASSERT(SpdWbcacheRead(Cache, 101, 3, Buffer));
+    ASSERT(0 == memcmp(Buffer, Expected + TEST_BLOCK_LENGTH, 3 * TEST_BLOCK_LENGTH));
+    ASSERT(!SpdWbcacheRead(Cache, 101, 4, Buffer));
+
+    /* destaging makes them clean, but they stay in the cache */
+    memset(Buffer, 0, sizeof Buffer);
+    ASSERT(SpdWbcacheDestageBegin(Cache, 0, 0, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(100 == RunAddress && 4 == RunCount);
+    ASSERT(0 == memcmp(Buffer, Expected, 4 * TEST_BLOCK_LENGTH));
+    ASSERT(4 == SpdWbcacheDirtyCount(Cache));
+    SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, TRUE);
+    ASSERT(0 == SpdWbcacheDirtyCount(Cache));
+    ASSERT(!SpdWbcacheDestageBegin(Cache, 0, 0, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(SpdWbcacheRead(Cache, 100, 4, Buffer));
+    ASSERT(0 == memcmp(Buffer, Expected, 4 * TEST_BLOCK_LENGTH));
+
+    /* a failed destage leaves the blocks dirty */
+    wbcache_block(Expected, 101, 1, 2);
+    ASSERT(SpdWbcacheWrite(Cache, 101, 1, Expected));
+    ASSERT(SpdWbcacheDestageBegin(Cache, 0, 0, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(101 == RunAddress && 1 == RunCount);
+    SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, FALSE);
+    ASSERT(1 == SpdWbcacheDirtyCount(Cache));
+    ASSERT(SpdWbcacheDestageBegin(Cache, 0, 0, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(101 == RunAddress && 1 == RunCount);
+
+    /* a block that is written while it is destaged stays dirty */
+    wbcache_block(Expected, 101, 1, 3);
+    ASSERT(SpdWbcacheWrite(Cache, 101, 1, Expected));
+    SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, TRUE);
+    ASSERT(1 == SpdWbcacheDirtyCount(Cache));
+    ASSERT(SpdWbcacheDestageBegin(Cache, 0, 0, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(3 == wbcache_block_version(Buffer, 101));
+    SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, TRUE);
+    ASSERT(0 == SpdWbcacheDirtyCount(Cache));
+    ASSERT(3 == Cache->DestageCount && 6 == Cache->DestageBlockCount);
+
+    wbcache_delete(Cache);
+}
+
+static void wbcache_combine_test(void)
+{
+    SPD_WBCACHE *Cache;
+    UINT8 Buffer[8 * TEST_BLOCK_LENGTH];
+    UINT64 RunAddress;
+    UINT32 RunCount;
+
+    Cache = wbcache_create(64);
+
+    /* written out of order and apart: 12, 10, 30, 11, 13, 9 */
+    wbcache_block(Buffer, 12, 1, 1);
+    ASSERT(SpdWbcacheWrite(Cache, 12, 1, Buffer));
+    wbcache_block(Buffer, 10, 1, 1);
+    ASSERT(SpdWbcacheWrite(Cache, 10, 1, Buffer));
+    wbcache_block(Buffer, 30, 1, 1);
+    ASSERT(SpdWbcacheWrite(Cache, 30, 1, Buffer));
+    wbcache_block(Buffer, 11, 1, 1);
+    ASSERT(SpdWbcacheWrite(Cache, 11, 1, Buffer));
+    wbcache_block(Buffer, 13, 1, 1);
+    ASSERT(SpdWbcacheWrite(Cache, 13, 1, Buffer));
+    wbcache_block(Buffer, 9, 1, 1);
+    ASSERT(SpdWbcacheWrite(Cache, 9, 1, Buffer));
+
+    /* the oldest block (12) is extended both ways into a single run */
+    ASSERT(SpdWbcacheDestageBegin(Cache, 0, 0, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(9 == RunAddress && 5 == RunCount);
+    for (UINT32 I = 0; RunCount > I; I++)
+        ASSERT(1 == wbcache_block_version(Buffer + I * TEST_BLOCK_LENGTH, RunAddress + I));
+    SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, TRUE);
+    ASSERT(SpdWbcacheDestageBegin(Cache, 0, 0, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(30 == RunAddress && 1 == RunCount);
+    SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, TRUE);
+
+    /* runs are no longer than MaxBlockCount */
+    for (UINT64 I = 0; 20 > I; I++)
+    {
+        wbcache_block(Buffer, 100 + I, 1, 2);
+        ASSERT(SpdWbcacheWrite(Cache, 100 + I, 1, Buffer));
+    }
+    ASSERT(SpdWbcacheDestageBegin(Cache, 0, 0, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(100 == RunAddress && 8 == RunCount);
+    SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, TRUE);
+
+    /* a range only picks dirty blocks in it (but may extend the run beyond it) */
+    ASSERT(!SpdWbcacheDestageBegin(Cache, 0, 100, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(SpdWbcacheDestageBegin(Cache, 117, 1, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(110 == RunAddress && 8 == RunCount);
+    SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, TRUE);
+    ASSERT(SpdWbcacheDestageBegin(Cache, 0, 1000, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(108 == RunAddress && 2 == RunCount);
+    SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, TRUE);
+    ASSERT(SpdWbcacheDestageBegin(Cache, 0, 0, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(118 == RunAddress && 2 == RunCount);
+    SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, TRUE);
+    ASSERT(0 == SpdWbcacheDirtyCount(Cache));
+
+    wbcache_delete(Cache);
+}
+
+static void wbcache_evict_test(void)
+{
+    SPD_WBCACHE *Cache;
+    UINT8 Buffer[16 * TEST_BLOCK_LENGTH];
+    UINT64 Generation, RunAddress;
+    UINT32 RunCount;
+
+    Cache = wbcache_create(16);
+
+    /* fill with clean blocks; a read refreshes them in the LRU order */
+    Generation = SpdWbcacheGeneration(Cache);
+    wbcache_block(Buffer, 0, 4, 1);
+    for (UINT64 I = 0; 4 > I; I++)
+        SpdWbcacheFill(Cache, Generation, I * 4, 4, Buffer);
+    ASSERT(SpdWbcacheRead(Cache, 0, 4, Buffer));
+    ASSERT(0 == Cache->EvictCount);
+
+    /* writes evict the least recently used clean blocks */
+    wbcache_block(Buffer, 100, 8, 2);
+    ASSERT(SpdWbcacheWrite(Cache, 100, 8, Buffer));
+    ASSERT(8 == Cache->EvictCount);
+    ASSERT(SpdWbcacheRead(Cache, 0, 4, Buffer));
+    ASSERT(!SpdWbcacheRead(Cache, 4, 1, Buffer));
+    ASSERT(!SpdWbcacheRead(Cache, 8, 1, Buffer));
+    ASSERT(SpdWbcacheRead(Cache, 12, 4, Buffer));
+
+    /* evictions end the fills of reads that were under way */
+    ASSERT(Generation != SpdWbcacheGeneration(Cache));
+    wbcache_block(Buffer, 200, 1, 1);
+    SpdWbcacheFill(Cache, Generation, 200, 1, Buffer);
+    ASSERT(!SpdWbcacheRead(Cache, 200, 1, Buffer));
+
+    /* dirty blocks are never evicted: a write that does not fit fails */
+    wbcache_block(Buffer, 300, 8, 2);
+    ASSERT(SpdWbcacheWrite(Cache, 300, 8, Buffer));
+    ASSERT(16 == SpdWbcacheDirtyCount(Cache));
+    wbcache_block(Buffer, 400, 1, 2);
+    ASSERT(!SpdWbcacheWrite(Cache, 400, 1, Buffer));
+    Generation = SpdWbcacheGeneration(Cache);
+    SpdWbcacheFill(Cache, Generation, 400, 1, Buffer);
+    ASSERT(!SpdWbcacheRead(Cache, 400, 1, Buffer));
+
+    /* but a write over blocks that it has can always be done */
+    wbcache_block(Buffer, 100, 8, 3);
+    ASSERT(SpdWbcacheWrite(Cache, 100, 8, Buffer));
+
+    /* the clean blocks of a write are not evicted to make room for it */
+    ASSERT(SpdWbcacheDestageBegin(Cache, 0, 0, 8, Buffer, &RunAddress, &RunCount));
+    ASSERT(100 == RunAddress && 8 == RunCount);
+    SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, TRUE);
+    ASSERT(8 == SpdWbcacheDirtyCount(Cache));
+    wbcache_block(Buffer, 92, 12, 4);
+    ASSERT(!SpdWbcacheWrite(Cache, 92, 12, Buffer));
+    wbcache_block(Buffer, 96, 8, 4);
+    ASSERT(SpdWbcacheWrite(Cache, 96, 8, Buffer));
+    ASSERT(16 == SpdWbcacheDirtyCount(Cache));
+    ASSERT(SpdWbcacheRead(Cache, 96, 8, Buffer));
+    for (UINT32 I = 0; 8 > I; I++)
+        ASSERT(4 == wbcache_block_version(Buffer + I * TEST_BLOCK_LENGTH, 96 + I));
+    ASSERT(!SpdWbcacheRead(Cache, 104, 1, Buffer));
+    ASSERT(!SpdWbcacheWrite(Cache, 0, 1, Buffer));
+
+    wbcache_delete(Cache);
+}
+
+static void wbcache_discard_test(void)
+{
+    SPD_WBCACHE *Cache;
+    UINT8 Buffer[8 * TEST_BLOCK_LENGTH];
+    UINT64 Generation;
+
+    Cache = wbcache_create(32);
+
+    wbcache_block(Buffer, 100, 8, 1);
+    ASSERT(SpdWbcacheWrite(Cache, 100, 8, Buffer));
+    Generation = SpdWbcacheGeneration(Cache);
+
+    /* a small range is looked up block by block; dirty blocks are dropped too */
+    SpdWbcacheDiscard(Cache, 102, 2);
+    ASSERT(2 == Cache->DiscardCount);
+    ASSERT(6 == SpdWbcacheDirtyCount(Cache));
+    ASSERT(!SpdWbcacheRead(Cache, 102, 1, Buffer));
+    ASSERT(SpdWbcacheRead(Cache, 104, 4, Buffer));
+
+    /* a read started before the discard does not fill the cache */
+    wbcache_block(Buffer, 102, 2, 1);
+    SpdWbcacheFill(Cache, Generation, 102, 2, Buffer);
+    ASSERT(!SpdWbcacheRead(Cache, 102, 1, Buffer));
+
+    /* a fill does not replace the blocks that the cache has */
+    Generation = SpdWbcacheGeneration(Cache);
+    wbcache_block(Buffer, 100, 8, 9);
+    SpdWbcacheFill(Cache, Generation, 100, 8, Buffer);
+    ASSERT(SpdWbcacheRead(Cache, 100, 8, Buffer));
+    ASSERT(1 == wbcache_block_version(Buffer, 100));
+    ASSERT(9 == wbcache_block_version(Buffer + 2 * TEST_BLOCK_LENGTH, 102));
+    ASSERT(1 == wbcache_block_version(Buffer + 4 * TEST_BLOCK_LENGTH, 104));
+    ASSERT(6 == SpdWbcacheDirtyCount(Cache));
+
+    /* a large range scans the cache */
+    SpdWbcacheDiscard(Cache, 0, 1ULL << 40);
+    ASSERT(10 == Cache->DiscardCount);
+    ASSERT(0 == SpdWbcacheDirtyCount(Cache));
+    ASSERT(32 == Cache->Counts[SpdWbcacheFree]);
+
+    wbcache_delete(Cache);
+}
+
+/*
+ * Model test: random reads, writes and unmaps against a backend whose every block has
+ * a version, with the cache in front of it used the way the dispatcher uses it. Reads
+ * must always see the latest version, whether the cache serves them or not; some reads
+ * race with writes, and some writes come while a run of the same blocks is destaged.
+ * The backend has a volatile cache of its own: destaged versions become durable only
+ * when the backend is flushed, which FUA writes must do even if the destage thread got
+ * to their blocks first. When everything is flushed at the end the durable versions
+ * must be the latest ones.
+ */
+typedef struct
+{
+    SPD_WBCACHE *Cache;
+    UINT8 *Backend, *Durable;
+    UINT8 Buffer[8 * TEST_BLOCK_LENGTH];
+    UINT64 RunAddress;
+    UINT32 RunCount;
+} WBCACHE_MODEL;
+
+static BOOLEAN wbcache_model_destage_begin(WBCACHE_MODEL *Model,
+    UINT64 BlockAddress, UINT64 BlockCount, ULONG LowWater)
+{
+    return LowWater < SpdWbcacheDirtyCount(Model->Cache) &&
+        SpdWbcacheDestageBegin(Model->Cache, BlockAddress, BlockCount, 8, Model->Buffer,
+            &Model->RunAddress, &Model->RunCount);
+}
+
+static void wbcache_model_destage_end(WBCACHE_MODEL *Model, BOOLEAN Success)
+{
+    if (Success)
+        for (UINT32 I = 0; Model->RunCount > I; I++)
+            Model->Backend[Model->RunAddress + I] = wbcache_block_version(
+                Model->Buffer + I * TEST_BLOCK_LENGTH, Model->RunAddress + I);
+    SpdWbcacheDestageEnd(Model->Cache, Model->RunAddress, Model->RunCount, Success);
+}
+
+static void wbcache_model_destage(WBCACHE_MODEL *Model,
+    UINT64 BlockAddress, UINT64 BlockCount, ULONG LowWater)
+{
+    while (wbcache_model_destage_begin(Model, BlockAddress, BlockCount, LowWater))
+        wbcache_model_destage_end(Model, TRUE);
+}
+
+/* FUA and SYNCHRONIZE CACHE: destage the range and flush it, whether it was dirty or not */
+static void wbcache_model_flush(WBCACHE_MODEL *Model, UINT8 *Versions,
+    UINT64 BlockAddress, UINT64 BlockCount, UINT64 TotalCount)
+{
+    wbcache_model_destage(Model, BlockAddress, BlockCount, 0);
+    if (0 == BlockCount)
+        BlockCount = TotalCount - BlockAddress;
+    memcpy(Model->Durable + BlockAddress, Model->Backend + BlockAddress, (size_t)BlockCount);
+    for (UINT64 I = 0; BlockCount > I; I++)
+        ASSERT(Versions[BlockAddress + I] == Model->Durable[BlockAddress + I]);
+}
+
+static void wbcache_model_write(WBCACHE_MODEL *Model, UINT8 *Versions,
+    UINT64 BlockAddress, UINT32 Count)
+{
+    UINT8 Buffer[8 * TEST_BLOCK_LENGTH];
+
+    for (UINT32 I = 0; Count > I; I++)
+        wbcache_block(Buffer + I * TEST_BLOCK_LENGTH, BlockAddress + I, 1,
+            ++Versions[BlockAddress + I]);
+    while (!SpdWbcacheWrite(Model->Cache, BlockAddress, Count, Buffer))
+        wbcache_model_destage(Model, 0, 0, Model->Cache->EntryCount / 2);
+}
+
+static void wbcache_fua_test(void)
+{
+    enum { BlockCount = 64 };
+    WBCACHE_MODEL Model;
+    UINT8 Versions[BlockCount] = { 0 }, Backend[BlockCount] = { 0 }, Durable[BlockCount] = { 0 };
+
+    Model.Cache = wbcache_create(32);
+    Model.Backend = Backend;
+    Model.Durable = Durable;
+
+    /* the destage thread writes the blocks of a FUA write before the write destages them */
+    wbcache_model_write(&Model, Versions, 10, 4);
+    wbcache_model_destage(&Model, 0, 0, 0);
+    ASSERT(0 == SpdWbcacheDirtyCount(Model.Cache));
+    ASSERT(0 == Durable[10]);
+    wbcache_model_flush(&Model, Versions, 10, 4, BlockCount);
+    ASSERT(0 == memcmp(Versions, Durable, BlockCount));
+
+    /* the same for SYNCHRONIZE CACHE of the whole storage unit */
+    wbcache_model_write(&Model, Versions, 20, 8);
+    wbcache_model_destage(&Model, 0, 0, 0);
+    ASSERT(0 == Durable[20]);
+    wbcache_model_flush(&Model, Versions, 0, 0, BlockCount);
+    ASSERT(0 == memcmp(Versions, Durable, BlockCount));
+
+    wbcache_delete(Model.Cache);
+}
+
+static void wbcache_model_dotest(ULONG EntryCount, ULONG Seed)
+{
+    enum { BlockCount = 256, RangeMax = 8, Rounds = 40000 };
+    WBCACHE_MODEL Model;
+    UINT8 Versions[BlockCount] = { 0 }, Backend[BlockCount] = { 0 }, Durable[BlockCount] = { 0 };
+    UINT8 Buffer[RangeMax * TEST_BLOCK_LENGTH];
+    UINT64 BlockAddress, Generation;
+    UINT32 Count;
+
+    Model.Cache = wbcache_create(EntryCount);
+    Model.Backend = Backend;
+    Model.Durable = Durable;
+
+    for (ULONG Round = 0; Rounds > Round; Round++)
+    {
+        Count = 1 + wbcache_random(&Seed) % RangeMax;
+        BlockAddress = wbcache_random(&Seed) % (BlockCount - Count + 1);
+
+        switch (wbcache_random(&Seed) % 16)
+        {
+        case 0:
+        case 1:
+        case 2:
+        case 3:
+            wbcache_model_write(&Model, Versions, BlockAddress, Count);
+            break;
+
+        case 4:
+            /* FUA write; the destage thread may get to its blocks first */
+            wbcache_model_write(&Model, Versions, BlockAddress, Count);
+            if (wbcache_random(&Seed) % 2)
+                wbcache_model_destage(&Model, 0, 0, 0);
+            wbcache_model_flush(&Model, Versions, BlockAddress, Count, BlockCount);
+            break;
+
+        case 5:
+            /* unmap: the blocks read as version 0 afterwards */
+            SpdWbcacheDiscard(Model.Cache, BlockAddress, Count);
+            for (UINT32 I = 0; Count > I; I++)
+                Versions[BlockAddress + I] = Backend[BlockAddress + I] =
+                    Durable[BlockAddress + I] = 0;
+            break;
+
+        case 6:
+            /* a write (or two) while a run is destaged; the run may fail */
+            if (wbcache_model_destage_begin(&Model, 0, 0, 0))
+            {
+                wbcache_model_write(&Model, Versions,
+                    Model.RunAddress + wbcache_random(&Seed) % Model.RunCount, 1);
+                if (wbcache_random(&Seed) % 2)
+                    wbcache_model_write(&Model, Versions, BlockAddress, Count);
+                wbcache_model_destage_end(&Model, 0 != wbcache_random(&Seed) % 4);
+            }
+            break;
+
+        case 7:
+            /* a read that misses races with a write: it gets the old data and fills last */
+            wbcache_model_destage(&Model, BlockAddress, Count, 0);
+            Generation = SpdWbcacheGeneration(Model.Cache);
+            for (UINT32 I = 0; Count > I; I++)
+                wbcache_block(Buffer + I * TEST_BLOCK_LENGTH, BlockAddress + I, 1,
+                    Backend[BlockAddress + I]);
+            wbcache_model_write(&Model, Versions, BlockAddress, Count);
+            if (wbcache_random(&Seed) % 2)
+                wbcache_model_destage(&Model, 0, 0, 0);
+            SpdWbcacheFill(Model.Cache, Generation, BlockAddress, Count, Buffer);
+            break;
+
+        case 8:
+            /* background destaging */
+            wbcache_model_destage(&Model, 0, 0, wbcache_random(&Seed) % 2 ? 0 : EntryCount / 4);
+            break;
+
+        default:
+            /* read: a miss destages the range and reads the backend */
+            if (SpdWbcacheRead(Model.Cache, BlockAddress, Count, Buffer))
+            {
+                for (UINT32 I = 0; Count > I; I++)
+                    ASSERT(Versions[BlockAddress + I] == wbcache_block_version(
+                        Buffer + I * TEST_BLOCK_LENGTH, BlockAddress + I));
+            }
+            else
+            {
+                wbcache_model_destage(&Model, BlockAddress, Count, 0);
+                Generation = SpdWbcacheGeneration(Model.Cache);
+                for (UINT32 I = 0; Count > I; I++)
+                {
+                    ASSERT(Versions[BlockAddress + I] == Backend[BlockAddress + I]);
+                    wbcache_block(Buffer + I * TEST_BLOCK_LENGTH, BlockAddress + I, 1,
+                        Backend[BlockAddress + I]);
+                }
+                SpdWbcacheFill(Model.Cache, Generation, BlockAddress, Count, Buffer);
+            }
+            break;
+        }
+
+        ASSERT(EntryCount == Model.Cache->Counts[SpdWbcacheFree] +
+            Model.Cache->Counts[SpdWbcacheClean] + Model.Cache->Counts[SpdWbcacheDirty]);
+    }
+
+    wbcache_model_flush(&Model, Versions, 0, 0, BlockCount);
+    ASSERT(0 == SpdWbcacheDirtyCount(Model.Cache));
+    ASSERT(0 == memcmp(Versions, Backend, BlockCount));
+    ASSERT(0 < Model.Cache->HitCount);
+
+    wbcache_delete(Model.Cache);
+}
+
+static void wbcache_model_test(void)
+{
+    wbcache_model_dotest(32, 1);
+    wbcache_model_dotest(64, 2);
+    wbcache_model_dotest(1024, 3);
+}
+
+/*
+ * Write combining benchmark: small writes from a number of sequential streams (think
+ * files being written or a log) interleaved with each other and with random writes.
+ * Dirty blocks are destaged the way the dispatcher does it: down to a quarter of the
+ * cache when it is half dirty, and everything once per "interval". We report how many
+ * blocks each backend write carries on average.
+ */
+static void wbcache_bench_dotest(ULONG EntryCount, ULONG StreamCount, ULONG RandomPercent)
+{
+    enum { Rounds = 200000, Interval = 10000, MaxBlockCount = 32 };
+    SPD_WBCACHE *Cache;
+    UINT8 Buffer[MaxBlockCount * TEST_BLOCK_LENGTH];
+    UINT64 Streams[64], BlockAddress, RunAddress;
+    UINT32 RunCount;
+    ULONG Seed = 1;
+
+    Cache = wbcache_create(EntryCount);
+    memset(Buffer, 0, sizeof Buffer);
+    for (ULONG I = 0; StreamCount > I; I++)
+        Streams[I] = (UINT64)I << 24;
+
+    for (ULONG Round = 0; Rounds > Round; Round++)
+    {
+        if (wbcache_random(&Seed) % 100 < RandomPercent)
+            BlockAddress = 1ULL << 32 | wbcache_random(&Seed) % (1 << 20);
+        else
+            BlockAddress = Streams[wbcache_random(&Seed) % StreamCount]++;
+
+        while (!SpdWbcacheWrite(Cache, BlockAddress, 1, Buffer))
+            while (EntryCount / 2 < SpdWbcacheDirtyCount(Cache) &&
+                SpdWbcacheDestageBegin(Cache, 0, 0, MaxBlockCount, Buffer, &RunAddress, &RunCount))
+                SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, TRUE);
+
+        if (EntryCount / 2 < SpdWbcacheDirtyCount(Cache) || 0 == (Round + 1) % Interval)
+        {
+            ULONG LowWater = 0 == (Round + 1) % Interval ? 0 : EntryCount / 4;
+            while (LowWater < SpdWbcacheDirtyCount(Cache) &&
+                SpdWbcacheDestageBegin(Cache, 0, 0, MaxBlockCount, Buffer, &RunAddress, &RunCount))
+                SpdWbcacheDestageEnd(Cache, RunAddress, RunCount, TRUE);
+        }
+    }
+
+    ASSERT(0 == SpdWbcacheDirtyCount(Cache));
+    ASSERT(Rounds == Cache->WriteCount);
+    tlib_printf("blocks=%u streams=%u random=%u%% blocks/write=%u.%02u ",
+        (unsigned)EntryCount, (unsigned)StreamCount, (unsigned)RandomPercent,
+        (unsigned)(Cache->DestageBlockCount / Cache->DestageCount),
+        (unsigned)(Cache->DestageBlockCount * 100 / Cache->DestageCount % 100));
+
+    wbcache_delete(Cache);
+}
+
+static void wbcache_bench_test(void)
+{
+    wbcache_bench_dotest(1024, 4, 0);
+    wbcache_bench_dotest(1024, 64, 10);
+    wbcache_bench_dotest(16384, 64, 10);
+}
+
+void wbcache_tests(void)
+{
+    TEST(wbcache_write_test);
+    TEST(wbcache_combine_test);
+    TEST(wbcache_evict_test);
+    TEST(wbcache_discard_test);
+    TEST(wbcache_fua_test);
+    TEST(wbcache_model_test);
+    TEST_OPT(wbcache_bench_test);
+}
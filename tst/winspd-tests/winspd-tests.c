@@ -42,6 +42,25 @@ int main(int argc, char *argv[])
 {
     TESTSUITE(ioctl_tests);
     TESTSUITE(scsi_tests);
+    TESTSUITE(batch_tests);
+    TESTSUITE(ring_tests);
+    TESTSUITE(chunk_tests);
+    TESTSUITE(reqpool_tests);
+    TESTSUITE(bufpool_tests);
+    TESTSUITE(hintmap_tests);
+    TESTSUITE(frame_tests);
+    TESTSUITE(socket_tests);
+    TESTSUITE(mqueue_tests);
+    TESTSUITE(epoch_tests);
+    TESTSUITE(unittab_tests);
+    TESTSUITE(iosched_tests);
+    TESTSUITE(merge_tests);
+    TESTSUITE(spinwait_tests);
+    TESTSUITE(bcache_tests);
+    TESTSUITE(wbcache_tests);
+    TESTSUITE(extmap_tests);
+    TESTSUITE(unmap_tests);
+    TESTSUITE(ramstore_tests);
 
     atexit(exiting);
     signal(SIGABRT, abort_handler);